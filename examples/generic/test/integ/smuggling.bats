@@ -0,0 +1,57 @@
+#!/usr/bin/env bats
+
+# Request smuggling regressions using bats:
+# https://github.com/sstephenson/bats
+#
+# A body sent with a method that takes none must not be parsed as the
+# next request on the connection.
+
+PIDFILE=run/generic.pid
+CONFFILE=conf/generic.conf
+
+# Start and stop have to be tweaked before being used
+stop_app() {
+	if [ -f "$PIDFILE" ]; then
+		kill -QUIT `cat "$PIDFILE"`
+		sleep 3
+	fi
+	if [ -f "$PIDFILE" ]; then
+		kill -KILL `cat "$PIDFILE"`
+		sleep 2
+	fi
+}
+
+start_app() {
+	stop_app
+	kore -nrc "$CONFFILE"
+}
+
+send_raw() {
+	printf "$1" | openssl s_client -quiet -ign_eof \
+	    -connect 127.0.0.1:8888 2>/dev/null
+}
+
+statuses() {
+	printf "%s" "$1" | grep -a -o "HTTP/1.1 [0-9]*"
+}
+
+@test "get with content-length body is refused" {
+	query="GET / HTTP/1.1\r\nHost: x\r\nContent-Length: 34\r\n\r\n"
+	query="${query}GET /private HTTP/1.1\r\nHost: x\r\n\r\n"
+	result=`send_raw "$query"`
+	[ "`statuses "$result"`" = "HTTP/1.1 400" ]
+}
+
+@test "get with chunked body is refused" {
+	query="GET / HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n"
+	query="${query}0\r\n\r\nGET /private HTTP/1.1\r\nHost: x\r\n\r\n"
+	result=`send_raw "$query"`
+	[ "`statuses "$result"`" = "HTTP/1.1 400" ]
+}
+
+@test "get with an empty content-length is still pipelined" {
+	query="GET / HTTP/1.1\r\nHost: x\r\nContent-Length: 0\r\n\r\n"
+	query="${query}GET / HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n"
+	result=`send_raw "$query"`
+	[ "`statuses "$result" | wc -l`" -eq 2 ]
+}
@@ -17,10 +17,13 @@
 /*
  * Simple example of how SSE (Server Side Events) could be used in Kore.
  *
- * Upon new arrivals, a join event is broadcast to all clients.
- * If a client goes away a leave event is broadcasted.
- * Each connection gets its own 10 second ping timer which will emit
- * a ping event to the connection endpoint.
+ * Clients are subscribed to the "events" channel. Upon new arrivals,
+ * a join event is published to it on all workers, if a client goes
+ * away a leave event is published.
+ *
+ * Kore keeps the connections alive with heartbeats on its own and
+ * replays the events a client missed when its browser reconnects
+ * with a Last-Event-ID header.
  */
 
 #include <kore/kore.h>
@@ -28,21 +31,10 @@
 
 #include "assets.h"
 
-void	sse_ping(void *, u_int64_t);
 int	page(struct http_request *);
 int	subscribe(struct http_request *);
+void	sse_connect(struct connection *);
 void	sse_disconnect(struct connection *);
-void	sse_send(struct connection *, void *, size_t);
-void	sse_broadcast(struct connection *, void *, size_t);
-int	check_header(struct http_request *, const char *, const char *);
-
-/*
- * Each client subscribed to our SSE gets a state attached
- * to their hdlr_extra pointer member.
- */
-struct sse_state {
-	struct kore_timer		*timer;
-};
 
 int
 page(struct http_request *req)
@@ -61,122 +53,33 @@ page(struct http_request *req)
 int
 subscribe(struct http_request *req)
 {
-	struct sse_state	*state;
-	char			*hello = "event:join\ndata: client\n\n";
-
-	/* Preventive paranoia. */
-	if (req->hdlr_extra != NULL) {
-		kore_log(LOG_ERR, "%p: already subscribed", req->owner);
-		http_response(req, 500, NULL, 0);
-		return (KORE_RESULT_OK);
-	}
-
-	/* Only allow GET methods. */
-	if (req->method != HTTP_METHOD_GET) {
-		http_response_header(req, "allow", "get");
-		http_response(req, 405, NULL, 0);
-		return (KORE_RESULT_OK);
-	}
-
-	/* Only do SSE if the client told us it wanted too. */
-	if (!check_header(req, "accept", "text/event-stream"))
-		return (KORE_RESULT_OK);
-
-	/* Do not include content-length in our response. */
-	req->flags |= HTTP_REQUEST_NO_CONTENT_LENGTH;
-
-	/* Notify existing clients of our new client now. */
-	sse_broadcast(req->owner, hello, strlen(hello));
-
-	/* Set a disconnection method so we know when this client goes away. */
-	req->owner->disconnect = sse_disconnect;
-
-	/* Allocate a state to be carried by our connection. */
-	state = kore_malloc(sizeof(*state));
-	req->owner->hdlr_extra = state;
-
-	/* Now start a timer to send a ping back every 10 second. */
-	state->timer = kore_timer_add(sse_ping, 10000, req->owner, 0);
-
-	/* Respond that the SSE channel is now open. */
-	kore_log(LOG_NOTICE, "%p: connected for SSE", req->owner);
-	http_response_header(req, "content-type", "text/event-stream");
-	http_response(req, 200, NULL, 0);
+	kore_sse_handshake(req, "sse_connect", "sse_disconnect");
 
 	return (KORE_RESULT_OK);
 }
 
 void
-sse_broadcast(struct connection *src, void *data, size_t len)
+sse_connect(struct connection *c)
 {
-	struct connection	*c;
+	const char	*who = "client";
 
-	/* Broadcast the message to all other clients. */
-	TAILQ_FOREACH(c, &connections, list) {
-		if (c == src)
-			continue;
-		sse_send(c, data, len);
-	}
-}
-
-void
-sse_send(struct connection *c, void *data, size_t len)
-{
-	struct sse_state	*state = c->hdlr_extra;
-
-	/* Do not send to clients that do not have a state. */
-	if (state == NULL)
-		return;
+	kore_log(LOG_NOTICE, "%p: connected for SSE", c);
 
-	/* Queue outgoing data now. */
-	net_send_queue(c, data, len);
-	net_send_flush(c);
-}
-
-void
-sse_ping(void *arg, u_int64_t now)
-{
-	struct connection		*c = arg;
-	char				*ping = "event:ping\ndata:\n\n";
+	/* Notify existing clients of our new client now. */
+	kore_sse_publish("events", "join", who, strlen(who),
+	    SSE_PUBLISH_GLOBAL);
 
-	/* Send our ping to the client. */
-	sse_send(c, ping, strlen(ping));
+	kore_sse_subscribe(c, "events");
 }
 
 void
 sse_disconnect(struct connection *c)
 {
-	struct sse_state	*state = c->hdlr_extra;
-	char			*leaving = "event: leave\ndata: client\n\n";
+	const char	*who = "client";
 
 	kore_log(LOG_NOTICE, "%p: disconnecting for SSE", c);
 
 	/* Tell others we are leaving. */
-	sse_broadcast(c, leaving, strlen(leaving));
-
-	/* Kill our timer and free/remove the state. */
-	kore_timer_remove(state->timer);
-	kore_free(state);
-
-	/* Prevent us to be called again. */
-	c->hdlr_extra = NULL;
-	c->disconnect = NULL;
-}
-
-int
-check_header(struct http_request *req, const char *name, const char *value)
-{
-	const char		*hdr;
-
-	if (!http_request_header(req, name, &hdr)) {
-		http_response(req, 400, NULL, 0);
-		return (KORE_RESULT_ERROR);
-	}
-
-	if (strcmp(hdr, value)) {
-		http_response(req, 400, NULL, 0);
-		return (KORE_RESULT_ERROR);
-	}
-
-	return (KORE_RESULT_OK);
+	kore_sse_publish("events", "leave", who, strlen(who),
+	    SSE_PUBLISH_GLOBAL);
 }
@@ -27,9 +27,22 @@ extern "C" {
 
 #define KORE_CURL_TIMEOUT			60
 #define KORE_CURL_RECV_MAX			(1024 * 1024 * 2)
+#define KORE_CURL_MAX_CONNS			500
+#define KORE_CURL_HANDLE_CACHE			64
 
 #define KORE_CURL_FLAG_HTTP_PARSED_HEADERS	0x0001
 #define KORE_CURL_FLAG_BOUND			0x0002
+#define KORE_CURL_FLAG_STREAM			0x0004
+#define KORE_CURL_FLAG_STREAM_HEADERS		0x0008
+#define KORE_CURL_FLAG_STREAM_CHUNKED		0x0010
+#define KORE_CURL_FLAG_PAUSED			0x0020
+#define KORE_CURL_FLAG_RESUME			0x0040
+
+/*
+ * A transfer streaming into a request pauses once this many bytes are
+ * waiting to go out on the client connection.
+ */
+#define KORE_CURL_STREAM_PENDING_MAX		(256 * 1024)
 
 #define KORE_CURL_SYNC				0x1000
 #define KORE_CURL_ASYNC				0x2000
@@ -52,6 +65,14 @@ struct kore_curl {
 
 	char			errbuf[CURL_ERROR_SIZE];
 
+	/* For streamed responses, see kore_curl_stream(). */
+	struct {
+		void			*arg;
+		int			(*cb)(struct kore_curl *,
+					    const void *, size_t, void *);
+		TAILQ_ENTRY(kore_curl)	list;
+	} stream;
+
 	/* For the simplified HTTP api. */
 	struct {
 		long				status;
@@ -68,10 +89,16 @@ struct kore_curl {
 
 extern u_int16_t	kore_curl_timeout;
 extern u_int64_t	kore_curl_recv_max;
+extern u_int32_t	kore_curl_max_conns;
+extern u_int32_t	kore_curl_max_host_conns;
+extern int		kore_curl_http2;
 
 void	kore_curl_sysinit(void);
+void	kore_curl_worker_init(void);
 void	kore_curl_do_timeout(void);
 void	kore_curl_run_scheduled(void);
+int	kore_curl_running(void);
+int	kore_curl_pending(void);
 void	kore_curl_run(struct kore_curl *);
 void	kore_curl_cleanup(struct kore_curl *);
 int	kore_curl_success(struct kore_curl *);
@@ -97,6 +124,12 @@ void	kore_curl_bind_request(struct kore_curl *, struct http_request *);
 void	kore_curl_bind_callback(struct kore_curl *,
 	    void (*cb)(struct kore_curl *, void *), void *);
 
+void	kore_curl_stream(struct kore_curl *,
+	    int (*cb)(struct kore_curl *, const void *, size_t, void *), void *);
+void	kore_curl_stream_resume(struct kore_curl *);
+void	kore_curl_stream_request(struct kore_curl *, struct http_request *);
+int	kore_curl_stream_finish(struct kore_curl *);
+
 const char	*kore_curl_strerror(struct kore_curl *);
 
 #if defined(__cplusplus)
@@ -38,21 +38,47 @@ extern "C" {
 #define HTTP_URI_LEN		2000
 #define HTTP_USERAGENT_LEN	256
 #define HTTP_REFERER_LEN	256
-#define HTTP_REQ_HEADER_MAX	25
+#define HTTP_REQ_HEADER_MAX	KORE_HTTP_HEADER_LINES
 #define HTTP_MAX_QUERY_ARGS	20
+#define HTTP_HEADER_KNOWN_MAX	32
+#define HTTP_HEADER_INDEX_MAX	32
 #define HTTP_MAX_COOKIES	10
+#define HTTP_CACHE_VARY_MAX	8
+
+#define HTTP_CACHE_SIZE		(16 * 1024 * 1024)
+#define HTTP_CACHE_MAX		(1024 * 1024)
 #define HTTP_MAX_COOKIENAME	255
 #define HTTP_HEADER_BUFSIZE	1024
 #define HTTP_COOKIE_BUFSIZE	1024
 #define HTTP_DATE_MAXSIZE	255
 #define HTTP_REQUEST_LIMIT	1000
 #define HTTP_REQUEST_MS		10
+#define HTTP_SLOW_REQUEST_RATE	10
+#define HTTP_SLOW_REQUEST_SAMPLE	1
 #define HTTP_BODY_DISK_PATH	"tmp_files"
 #define HTTP_BODY_DISK_OFFLOAD	0
 #define HTTP_BODY_PATH_MAX	256
+#define HTTP_BODY_DISK_BUFFER	(128 * 1024)
+#define HTTP_ARENA_CHUNK	4096
 #define HTTP_BOUNDARY_MAX	80
+#define HTTP_MULTIPART_BOUNDARY_MAX	70
+#define HTTP_MULTIPART_HEADER_MAX	4096
+#define HTTP_MULTIPART_FIELD_MAX	(64 * 1024)
 #define HTTP_HEADER_TIMEOUT	10
 #define HTTP_BODY_TIMEOUT	60
+#define HTTP2_MAX_STREAMS	128
+#define HTTP_RANGES_MAX		16
+#define HTTP_OVERLOAD_INTERVAL	100
+#define HTTP_OVERLOAD_MIN	4
+#define HTTP_FILEREF_ETAG_LEN	64
+
+#define HTTP_COMPRESS_MIN_SIZE	256
+#define HTTP_COMPRESS_TYPES_MAX	16
+#define HTTP_COMPRESS_GZIP_LEVEL	6
+#define HTTP_COMPRESS_BROTLI_QUALITY	5
+
+#define HTTP2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN	(sizeof(HTTP2_PREFACE) - 1)
 
 #define HTTP_ARG_TYPE_RAW	0
 #define HTTP_ARG_TYPE_BYTE	1
@@ -66,6 +92,14 @@ extern "C" {
 #define HTTP_ARG_TYPE_FLOAT	9
 #define HTTP_ARG_TYPE_DOUBLE	10
 
+/* Accept-Encoding weights are kept in thousandths. */
+#define HTTP_QVALUE_MAX		1000
+
+/* Content codings, also used to index kore_fileref.encoded. */
+#define HTTP_COMPRESS_GZIP	0
+#define HTTP_COMPRESS_BROTLI	1
+#define HTTP_COMPRESS_MAX	KORE_FILEREF_ENCODINGS
+
 #define HTTP_STATE_ERROR	0
 #define HTTP_STATE_CONTINUE	1
 #define HTTP_STATE_COMPLETE	2
@@ -107,9 +141,22 @@ struct http_arg {
 	char			*name;
 	char			*s_value;
 
+	/* Last typed conversion of s_value, see http_argument_get(). */
+	int			conv_type;
+	int			conv_result;
+	u_int64_t		conv;
+
 	TAILQ_ENTRY(http_arg)	list;
 };
 
+/*
+ * Argument sources not parsed yet, see http_populate_qs/post(). They are
+ * kept in the order they were populated in so that order is preserved.
+ */
+#define HTTP_ARGS_PENDING_QS	1
+#define HTTP_ARGS_PENDING_POST	2
+#define HTTP_ARGS_PENDING_MAX	2
+
 #define COPY_ARG_TYPE(v, t)				\
 	do {						\
 		*(t *)nout = v;				\
@@ -223,9 +270,48 @@ struct http_file {
 	size_t			offset;
 	size_t			length;
 	struct http_request	*req;
+
+	/* Set when the file was streamed to its own temporary file. */
+	int			fd;
+	char			*path;
+
 	TAILQ_ENTRY(http_file)	list;
 };
 
+#define HTTP_MULTIPART_PART_START	1
+#define HTTP_MULTIPART_PART_DATA	2
+#define HTTP_MULTIPART_PART_END		3
+
+/*
+ * Incremental multipart/form-data parser, see http_multipart_create().
+ * The name, filename and type of the current part are valid from its
+ * PART_START event up to and including its PART_END event.
+ */
+struct http_multipart {
+	int			state;
+	int			skip;
+	struct http_request	*req;
+	void			*arg;
+	int			(*cb)(struct http_multipart *, int,
+				    const u_int8_t *, size_t);
+
+	char			*name;
+	char			*filename;
+	char			*type;
+
+	size_t			dlen;
+	size_t			held;
+	u_int8_t		delim[HTTP_MULTIPART_BOUNDARY_MAX + 4];
+	u_int8_t		shift[256];
+
+	size_t			ntail;
+	u_int8_t		tail[2];
+
+	struct kore_buf		hdrs;
+	struct kore_buf		field;
+	struct http_file	*file;
+};
+
 #define HTTP_METHOD_GET		0x0001
 #define HTTP_METHOD_POST	0x0002
 #define HTTP_METHOD_PUT		0x0004
@@ -241,13 +327,19 @@ struct http_file {
 #define HTTP_REQUEST_COMPLETE		0x0001
 #define HTTP_REQUEST_DELETE		0x0002
 #define HTTP_REQUEST_SLEEPING		0x0004
+#define HTTP_REQUEST_CHUNKED_BODY	0x0008
+#define HTTP_REQUEST_BODY_DIGEST	0x0010
 #define HTTP_REQUEST_EXPECT_BODY	0x0020
 #define HTTP_REQUEST_RETAIN_EXTRA	0x0040
 #define HTTP_REQUEST_NO_CONTENT_LENGTH	0x0080
 #define HTTP_REQUEST_AUTHED		0x0100
+#define HTTP_REQUEST_POOLED_HEADERS	0x0200
+#define HTTP_REQUEST_OFFLOADED		0x0400
+#define HTTP_REQUEST_BODY_TMPFILE	0x0800
 
 #define HTTP_VERSION_1_1		0x1000
 #define HTTP_VERSION_1_0		0x2000
+#define HTTP_VERSION_2			0x4000
 
 #define HTTP_VALIDATOR_IS_REQUEST	0x8000
 
@@ -259,6 +351,9 @@ struct http_file {
 struct reqcall;
 struct kore_task;
 struct http_client;
+struct http2_stream;
+struct http_arena_chunk;
+struct http_chunked;
 
 struct http_redirect {
 	regex_t				rctx;
@@ -267,34 +362,61 @@ struct http_redirect {
 	TAILQ_ENTRY(http_redirect)	list;
 };
 
+#define HTTP_OVERLOAD_ADMITTED		1
+#define HTTP_OVERLOAD_QUEUED		2
+#define HTTP_OVERLOAD_RUNNING		3
+
 struct http_request {
 	u_int8_t			method;
 	u_int8_t			fsm_state;
+	u_int8_t			receiving;
+	u_int8_t			overload;
+	u_int8_t			hdr_overflow;
 	u_int16_t			flags;
 	u_int16_t			status;
 	u_int64_t			ms;
 	u_int64_t			start;
 	u_int64_t			end;
 	u_int64_t			total;
+	u_int64_t			t_created;
+	u_int64_t			t_ttfb;
+	u_int64_t			t_sleep;
+	u_int64_t			t_slept;
+	u_int64_t			t_hdrs;
+	u_int64_t			t_body;
+	u_int64_t			t_auth;
+	u_int64_t			t_handler;
+	u_int64_t			t_flush;
+	u_int64_t			t_ready;
 	const char			*path;
 	const char			*host;
 	const char			*agent;
 	const char			*referer;
 	struct connection		*owner;
-	SHA2_CTX			hashctx;
+	struct http2_stream		*stream;
+	void				*hashctx;
 	u_int8_t			*headers;
 	struct kore_buf			*http_body;
 	int				http_body_fd;
 	char				*http_body_path;
+	struct kore_buf			*http_body_pending;
 	u_int64_t			http_body_length;
 	u_int64_t			http_body_offset;
 	u_int64_t			content_length;
 	void				*hdlr_extra;
 	size_t				state_len;
 	char				*query_string;
+	char				*args_post;
+	u_int8_t			args_npending;
+	u_int8_t			args_pending[HTTP_ARGS_PENDING_MAX];
 	struct kore_route		*rt;
 	struct http_runlock_queue	*runlock;
 	void				(*onfree)(struct http_request *);
+	struct http_arena_chunk		*arena;
+	struct upstream_session		*upstream;
+	struct http_multipart		*multipart;
+	struct http_chunked		*chunked;
+	struct http_cache_entry		*cache;
 
 #if defined(KORE_USE_PYTHON)
 	void				*py_req;
@@ -312,6 +434,12 @@ struct http_request {
 
 #if defined(KORE_USE_TASKS)
 	LIST_HEAD(, kore_task)		tasks;
+
+	struct kore_task		*offload;
+	int				offload_status;
+	int				offload_close;
+	void				*offload_body;
+	size_t				offload_len;
 #endif
 
 #if defined(KORE_USE_PGSQL)
@@ -322,10 +450,13 @@ struct http_request {
 	TAILQ_HEAD(, http_cookie)	resp_cookies;
 	TAILQ_HEAD(, http_header)	req_headers;
 	TAILQ_HEAD(, http_header)	resp_headers;
+	struct http_header		*hdr_known[HTTP_HEADER_KNOWN_MAX];
+	struct http_header		*hdr_index[HTTP_HEADER_INDEX_MAX];
 	TAILQ_HEAD(, http_arg)		arguments;
 	TAILQ_HEAD(, http_file)		files;
 	TAILQ_ENTRY(http_request)	list;
 	TAILQ_ENTRY(http_request)	olist;
+	TAILQ_ENTRY(http_request)	ovlist;
 };
 
 #define KORE_HTTP_STATE(f)		{ #f, f }
@@ -341,19 +472,60 @@ struct http_media_type {
 	LIST_ENTRY(http_media_type)	list;
 };
 
+/* A byte range of a fileref, see http_response_fileref(). */
+struct http_range {
+	off_t			off;
+	size_t			len;
+};
+
+/* Response caching for a route, see cache.c. */
+struct http_cache {
+	u_int64_t		ttl;
+	u_int64_t		stale;
+	int			nvary;
+	char			*vary[HTTP_CACHE_VARY_MAX];
+};
+
+#if defined(KORE_USE_COMPRESS)
+struct http_compress {
+	int			encodings;
+	size_t			min_size;
+	int			ntypes;
+	char			*types[HTTP_COMPRESS_TYPES_MAX];
+};
+#endif
+
 extern size_t		http_body_max;
 extern u_int16_t	http_body_timeout;
 extern u_int16_t	http_header_max;
 extern u_int16_t	http_header_timeout;
 extern u_int32_t	http_request_ms;
+extern u_int32_t	http_slow_request_ms;
+extern u_int32_t	http_slow_request_rate;
+extern u_int32_t	http_slow_request_sample;
 extern u_int64_t	http_hsts_enable;
 extern u_int16_t	http_keepalive_time;
 extern u_int32_t	http_request_limit;
 extern u_int32_t	http_request_count;
+extern u_int32_t	http_overload_target;
+extern u_int32_t	http_overload_interval;
 extern u_int64_t	http_body_disk_offload;
+extern size_t		http_body_disk_buffer;
+extern int		http_body_disk_tmpfile;
+extern size_t		http_multipart_field_max;
 extern int		http_pretty_error;
+extern int		http2_enable;
+extern u_int32_t	http2_max_streams;
 extern char		*http_body_disk_path;
+#if defined(KORE_USE_COMPRESS)
+extern int		http_compress_gzip_level;
+#if defined(KORE_USE_BROTLI)
+extern int		http_compress_brotli_quality;
+#endif
+#endif
 extern struct kore_pool	http_header_pool;
+extern size_t		http_cache_size;
+extern size_t		http_cache_max;
 
 void		kore_accesslog(struct http_request *);
 
@@ -369,14 +541,28 @@ char		*http_validate_header(char *);
 int		http_method_value(const char *);
 void		http_start_recv(struct connection *);
 void		http_request_free(struct http_request *);
+void		http_request_header_add(struct http_request *,
+		    char *, char *);
+struct http_request	*http_request_new(struct connection *,
+			    const char *, const char *, char *, const char *);
 void		http_request_sleep(struct http_request *);
 void		http_request_wakeup(struct http_request *);
 void		http_process_request(struct http_request *);
+int		http_ratelimit_check(struct http_request *);
 int		http_body_rewind(struct http_request *);
+int		http_body_persist(struct http_request *, const char *);
+int		http_body_setup(struct http_request *);
+int		http_body_update(struct http_request *, const void *, size_t);
+const char	*http_server_header(size_t *);
+int		http_write_response_cookie(struct kore_buf *,
+		    struct http_cookie *);
 int		http_media_register(const char *, const char *);
 int		http_check_timeout(struct connection *, u_int64_t);
 ssize_t		http_body_read(struct http_request *, void *, size_t);
+void		*http_request_alloc(struct http_request *, size_t);
+char		*http_request_strdup(struct http_request *, const char *);
 int		http_body_digest(struct http_request *, char *, size_t);
+const u_int8_t	*http_body_digest_raw(struct http_request *);
 
 int		http_redirect_add(struct kore_domain *,
 		    const char *, int, const char *);
@@ -387,14 +573,31 @@ void		http_response_close(struct http_request *, int,
 		    const void *, size_t);
 void		http_response_fileref(struct http_request *, int,
 		    struct kore_fileref *);
+void		http_response_fileref_type(struct http_request *, int,
+		    struct kore_fileref *, const char *);
+void		http_response_block(struct http_request *, int,
+		    const void *, size_t, const void *, size_t);
+void		http_fileref_etag(struct kore_fileref *, char *, size_t);
+int		http_fileref_unmodified(struct http_request *,
+		    struct kore_fileref *, const char *);
 void		http_serveable(struct http_request *, const void *,
 		    size_t, const char *, const char *);
 void		http_response_stream(struct http_request *, int, void *,
 		    size_t, int (*cb)(struct netbuf *), void *);
+void		http_response_rope(struct http_request *, int,
+		    struct kore_rope *);
+void		http_response_json_begin(struct http_request *, int,
+		    struct kore_json_writer *);
+int		http_response_json_busy(struct http_request *,
+		    struct kore_json_writer *);
+int		http_response_json_end(struct http_request *,
+		    struct kore_json_writer *);
 int		http_request_header(struct http_request *,
 		    const char *, const char **);
+int		http_accept_encoding(struct http_request *, const char *);
 void		http_response_header(struct http_request *,
 		    const char *, const char *);
+void		http_response_vary(struct http_request *, const char *);
 int		http_state_run(struct http_state *, u_int8_t,
 		    struct http_request *);
 int	 	http_request_cookie(struct http_request *,
@@ -404,6 +607,7 @@ void		http_response_cookie(struct http_request *, const char *,
 		    struct http_cookie **);
 
 void		http_runlock_init(struct http_runlock *);
+void		http_runlock_release_all(struct http_runlock *);
 void		http_runlock_release(struct http_runlock *,
 		    struct http_request *);
 int		http_runlock_acquire(struct http_runlock *,
@@ -420,6 +624,8 @@ int		http_header_recv(struct netbuf *);
 void		http_populate_qs(struct http_request *);
 void		http_populate_post(struct http_request *);
 void		http_populate_multipart_form(struct http_request *);
+void		http_argument_add(struct http_request *, char *, char *,
+		    int, int);
 void		http_populate_cookies(struct http_request *);
 int		http_argument_get(struct http_request *,
 		    const char *, void **, void *, int);
@@ -430,6 +636,68 @@ void			http_file_rewind(struct http_file *);
 ssize_t			http_file_read(struct http_file *, void *, size_t);
 struct http_file	*http_file_lookup(struct http_request *, const char *);
 
+struct http_multipart	*http_multipart_create(struct http_request *,
+			    int (*)(struct http_multipart *, int,
+			    const u_int8_t *, size_t), void *);
+int			http_multipart_feed(struct http_multipart *,
+			    const void *, size_t);
+int			http_multipart_done(struct http_multipart *);
+void			http_multipart_free(struct http_multipart *);
+
+void		http2_init(void);
+void		http2_cleanup(void);
+void		http2_session_start(struct connection *);
+void		http2_session_free(struct connection *);
+int		http2_session_drain(struct connection *);
+void		http2_request_free(struct http_request *);
+void		http2_request_http11(struct http_request *);
+void		http2_request_attach(struct connection *,
+		    struct http_request *);
+void		http2_response(struct connection *, struct http_request *,
+		    int, const void *, size_t);
+void		http2_response_stream(struct http_request *, void *, size_t,
+		    int (*cb)(struct netbuf *), void *);
+void		http2_response_fileref(struct http_request *,
+		    struct kore_fileref *);
+void		http2_response_fileref_range(struct http_request *,
+		    struct kore_fileref *, off_t, size_t);
+
+int		http_cache_serve(struct http_request *);
+void		http_cache_store(struct http_request *, int,
+		    const void *, size_t);
+void		http_cache_release(struct http_request *);
+void		http_cache_conf_free(struct http_cache *);
+
+void		http_overload_init(void);
+int		http_overload_check(struct http_request *);
+void		http_overload_ready(struct http_request *);
+void		http_overload_start(struct http_request *);
+void		http_overload_sample(void);
+void		http_overload_release(struct http_request *);
+int		http_overload_active(void);
+int		http_overload_priority(const char *);
+u_int32_t	http_overload_limit(void);
+u_int32_t	http_overload_accept(u_int32_t);
+
+#if defined(KORE_USE_COMPRESS)
+void		http_compress_init(void);
+void		http_compress_cleanup(void);
+int		http_compress_encoding(const char *);
+int		http_compress_select(struct http_request *, int,
+		    const char *, size_t);
+int		http_compress_response(struct http_request *, int,
+		    const void *, size_t);
+int		http_compress_stream(struct http_request *, int, void *,
+		    size_t, int (*cb)(struct netbuf *), void *);
+int		http_compress_fileref(struct http_request *, int,
+		    struct kore_fileref *, const char *);
+int		http_compress_rope(struct http_request *, int,
+		    struct kore_rope *);
+void		http_compress_conf_free(struct http_compress *);
+struct http_compress	*http_compress_conf_create(struct http_compress *);
+struct kore_buf	*http_compress_data(int, const void *, size_t);
+#endif
+
 enum http_status_code {
 	HTTP_STATUS_CONTINUE			= 100,
 	HTTP_STATUS_SWITCHING_PROTOCOLS		= 101,
@@ -466,6 +734,7 @@ enum http_status_code {
 	HTTP_STATUS_REQUEST_RANGE_INVALID	= 416,
 	HTTP_STATUS_EXPECTATION_FAILED		= 417,
 	HTTP_STATUS_MISDIRECTED_REQUEST		= 421,
+	HTTP_STATUS_TOO_MANY_REQUESTS		= 429,
 	HTTP_STATUS_INTERNAL_ERROR		= 500,
 	HTTP_STATUS_NOT_IMPLEMENTED		= 501,
 	HTTP_STATUS_BAD_GATEWAY			= 502,
@@ -31,6 +31,48 @@ struct jsonrpc_log
 	int			lvl;
 };
 
+#if defined(KORE_JSONRPC_NATIVE)
+struct jsonrpc_batch;
+
+/*
+ * JSON RPC request, built on the kore JSON parser and writer. Results are
+ * written with the kore_json_write_*() functions on writer.
+ */
+struct jsonrpc_request
+{
+	struct jsonrpc_log	log;
+	struct kore_buf		buf;
+	struct kore_json	json;
+	struct kore_json_writer	writer;
+	struct http_request	*http;
+	struct jsonrpc_batch	*batch;
+	struct kore_json_item	*id;
+	const char		*method;
+	struct kore_json_item	*params;
+	unsigned int		flags;
+	int			log_levels;
+
+	/* Free for use by a method, cleanup is called on destroy. */
+	void			*arg;
+	void			(*cleanup)(struct jsonrpc_request *);
+};
+
+/*
+ * A method served by jsonrpc_dispatch(), tables end with a NULL name.
+ *
+ * The callback answers with jsonrpc_result() or jsonrpc_error() and
+ * returns KORE_RESULT_OK, or returns KORE_RESULT_RETRY to be called again
+ * later while it waits on something.
+ */
+struct jsonrpc_method
+{
+	const char	*name;
+	int		(*cb)(struct jsonrpc_request *);
+};
+
+/* Maximum number of calls in a single batch request. */
+#define JSONRPC_BATCH_MAX	128
+#else
 /* JSON RPC request. */
 struct jsonrpc_request
 {
@@ -54,6 +96,7 @@ struct jsonrpc_request
 
 #define YAJL_GEN_KO(OPERATION)	\
 	((OPERATION) != yajl_gen_status_ok)
+#endif
 
 enum jsonrpc_error_code
 {
@@ -79,6 +122,10 @@ void	jsonrpc_destroy_request(struct jsonrpc_request *);
 int	jsonrpc_error(struct jsonrpc_request *, int, const char *);
 int	jsonrpc_result(struct jsonrpc_request *,
 	    int (*)(struct jsonrpc_request *, void *), void *);
+#if defined(KORE_JSONRPC_NATIVE)
+int	jsonrpc_dispatch(struct http_request *,
+	    const struct jsonrpc_method *);
+#endif
 #if defined(__cplusplus)
 }
 #endif
@@ -57,6 +57,10 @@ extern int daemon(int, int);
 #endif
 #endif
 
+#if !defined(KORE_NO_ZEROCOPY) && defined(__linux__)
+#define KORE_USE_PLATFORM_ZEROCOPY	1
+#endif
+
 #if defined(__OpenBSD__)
 #define KORE_USE_PLATFORM_PLEDGE	1
 #endif
@@ -89,6 +93,15 @@ typedef void		KORE_PRIVATE_KEY;
 
 #define KORE_BASE64_RAW		0x0001
 
+#define KORE_REUSEPORT_OFF	0
+#define KORE_REUSEPORT_ON	1
+#define KORE_REUSEPORT_CPU	2
+#define KORE_REUSEPORT_NODE	3
+
+#define KORE_NUMA_OFF		0
+#define KORE_NUMA_ON		1
+#define KORE_NUMA_BIND		2
+
 #define KORE_WAIT_INFINITE	(u_int64_t)-1
 #define KORE_RESEED_TIME	(1800 * 1000)
 
@@ -107,9 +120,27 @@ typedef void		KORE_PRIVATE_KEY;
 #define kore_debug(...)
 #endif
 
+/*
+ * Static tracepoints for USDT aware tracers such as bpftrace or dtrace.
+ * Built with USDT=1 a probe is a single nop until a tracer attaches,
+ * otherwise they compile away. See misc/bpftrace for example scripts.
+ */
+#if defined(KORE_USE_USDT)
+#include <sys/sdt.h>
+#define KORE_PROBE1(n, a)		DTRACE_PROBE1(kore, n, a)
+#define KORE_PROBE2(n, a, b)		DTRACE_PROBE2(kore, n, a, b)
+#define KORE_PROBE3(n, a, b, c)		DTRACE_PROBE3(kore, n, a, b, c)
+#else
+#define KORE_PROBE1(n, a)
+#define KORE_PROBE2(n, a, b)
+#define KORE_PROBE3(n, a, b, c)
+#endif
+
 #define NETBUF_RECV			0
 #define NETBUF_SEND			1
 #define NETBUF_SEND_PAYLOAD_MAX		8192
+#define NETBUF_ROPE_COPY_MAX		512
+#define NETBUF_SHARED_COPY_MAX		512
 #define SENDFILE_PAYLOAD_MAX		(1024 * 1024 * 10)
 
 #define NETBUF_LAST_CHAIN		0
@@ -120,6 +151,8 @@ typedef void		KORE_PRIVATE_KEY;
 #define NETBUF_MUST_RESEND	0x04
 #define NETBUF_IS_STREAM	0x10
 #define NETBUF_IS_FILEREF	0x20
+#define NETBUF_ZEROCOPY		0x40
+#define NETBUF_RECV_POOLED	0x80
 
 #define KORE_X509_COMMON_NAME_ONLY	0x0001
 
@@ -130,9 +163,30 @@ typedef void		KORE_PRIVATE_KEY;
 #if !defined(KORE_NO_HTTP)
 struct http_request;
 struct http_redirect;
+struct iovec;
+struct http2_session;
+#if defined(KORE_USE_COMPRESS)
+struct websocket_deflate;
+#endif
+struct websocket_sub;
+struct sse_client;
+struct http_compress;
+struct http_cache;
+struct http_cache_entry;
 #endif
 
+struct kore_msg_ring;
+struct kore_json_keys;
+
 #define KORE_FILEREF_SOFT_REMOVED	0x1000
+#define KORE_FILEREF_ENCODINGS		2
+
+#define KORE_FILEREF_TIMEOUT		(1000 * 30)
+#define KORE_FILEREF_REVALIDATE		1000
+
+#define KORE_FILEMAP_CACHE_SIZE		(8 * 1024 * 1024)
+#define KORE_FILEMAP_CACHE_MAX		(16 * 1024)
+#define KORE_FILEMAP_RESOLVE_TTL	1000
 
 struct kore_fileref {
 	int				cnt;
@@ -140,12 +194,22 @@ struct kore_fileref {
 	int				ontls;
 	off_t				size;
 	char				*path;
+	u_int32_t			hash;
+	ino_t				ino;
 	u_int64_t			mtime;
 	time_t				mtime_sec;
+	u_int64_t			checked;
 	u_int64_t			expiration;
 	void				*base;
 	int				fd;
+	int				wd;
+#if defined(KORE_USE_COMPRESS)
+	/* Compressed variants, see http_compress_fileref(). */
+	struct kore_buf			*encoded[KORE_FILEREF_ENCODINGS];
+#endif
 	TAILQ_ENTRY(kore_fileref)	list;
+	LIST_ENTRY(kore_fileref)	hlist;
+	LIST_ENTRY(kore_fileref)	wlist;
 };
 
 struct netbuf {
@@ -153,6 +217,7 @@ struct netbuf {
 	size_t			s_off;
 	size_t			b_len;
 	size_t			m_len;
+	size_t			scan_off;
 	u_int8_t		type;
 	u_int8_t		flags;
 
@@ -160,6 +225,12 @@ struct netbuf {
 	off_t			fd_off;
 	off_t			fd_len;
 
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+	u_int32_t		zc_seq;
+	u_int32_t		zc_cnt;
+	u_int32_t		zc_done;
+#endif
+
 	struct connection	*owner;
 	void			*extra;
 	int			(*cb)(struct netbuf *);
@@ -175,6 +246,10 @@ TAILQ_HEAD(netbuf_head, netbuf);
 #define KORE_TYPE_TASK		4
 #define KORE_TYPE_PYSOCKET	5
 #define KORE_TYPE_CURL_HANDLE	6
+#define KORE_TYPE_FILEREF	7
+#define KORE_TYPE_MSG_RING	8
+#define KORE_TYPE_TLS_SHAKE	9
+#define KORE_TYPE_UPSTREAM	10
 
 #define CONN_STATE_UNKNOWN		0
 #define CONN_STATE_TLS_SHAKE		1
@@ -185,6 +260,9 @@ TAILQ_HEAD(netbuf_head, netbuf);
 #define CONN_PROTO_HTTP		1
 #define CONN_PROTO_WEBSOCKET	2
 #define CONN_PROTO_MSG		3
+#define CONN_PROTO_HTTP2	4
+#define CONN_PROTO_PROXY	5
+#define CONN_PROTO_SSE		6
 #define CONN_PROTO_ACME_ALPN	200
 
 #define KORE_EVENT_READ		0x01
@@ -198,8 +276,16 @@ TAILQ_HEAD(netbuf_head, netbuf);
 #define CONN_LOG_TLS_FAILURE	0x0020
 #define CONN_TLS_ALPN_ACME_SEEN	0x0040
 #define CONN_TLS_SNI_SEEN	0x0080
+#define CONN_RECV_PENDING	0x0100
+#define CONN_TLS_ALPN_H2	0x0200
+#define CONN_ZEROCOPY		0x0400
+#define CONN_ZEROCOPY_OFF	0x0800
+#define CONN_TLS_KTLS		0x1000
+#define CONN_MSG_OWED		0x2000
+#define CONN_TLS_SHAKING	0x4000
 
 #define KORE_IDLE_TIMER_MAX	5000
+#define KORE_HTTP_HEADER_LINES	25
 
 #define WEBSOCKET_OP_CONT	0x00
 #define WEBSOCKET_OP_TEXT	0x01
@@ -211,6 +297,14 @@ TAILQ_HEAD(netbuf_head, netbuf);
 #define WEBSOCKET_BROADCAST_LOCAL	1
 #define WEBSOCKET_BROADCAST_GLOBAL	2
 
+#define KORE_WEBSOCKET_TOPIC_MAX	128
+
+#define SSE_PUBLISH_LOCAL	1
+#define SSE_PUBLISH_GLOBAL	2
+
+#define KORE_SSE_CHANNEL_MAX	128
+#define KORE_SSE_EVENT_MAX	64
+
 #define KORE_TIMER_ONESHOT	0x01
 #define KORE_TIMER_FLAGS	(KORE_TIMER_ONESHOT)
 
@@ -233,6 +327,8 @@ struct connection {
 	KORE_X509		*tls_cert;
 	char			*tls_sni;
 	int			tls_reneg;
+	u_int64_t		tls_wlast;
+	u_int64_t		tls_wbytes;
 
 	u_int16_t		flags;
 	void			*hdlr_extra;
@@ -241,6 +337,8 @@ struct connection {
 	void			(*disconnect)(struct connection *);
 	int			(*read)(struct connection *, size_t *);
 	int			(*write)(struct connection *, size_t, size_t *);
+	int			(*writev)(struct connection *,
+				    struct iovec *, int, size_t *);
 
 	int			family;
 	union {
@@ -254,17 +352,40 @@ struct connection {
 		u_int64_t	start;
 	} idle_timer;
 
+	u_int64_t		timeout_tick;
+	TAILQ_ENTRY(connection)	tlist;
+
 	struct netbuf_head	send_queue;
 	struct netbuf		*snb;
 	struct netbuf		*rnb;
 
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+	struct netbuf_head	zc_queue;
+	u_int32_t		zc_next;
+#endif
+
+	struct kore_buf		*rpending;
+	size_t			rpending_off;
+	size_t			rpending_last;
+	TAILQ_ENTRY(connection)	rlist;
+
 #if !defined(KORE_NO_HTTP)
 	u_int64_t			http_start;
+	u_int64_t			http_hdr_first;
 	u_int64_t			http_timeout;
+	u_int16_t			http_hdr_cnt;
+	u_int16_t			http_hdr_start;
+	u_int16_t			http_hdr_line[KORE_HTTP_HEADER_LINES];
 	struct kore_runtime_call	*ws_connect;
 	struct kore_runtime_call	*ws_message;
 	struct kore_runtime_call	*ws_disconnect;
+#if defined(KORE_USE_COMPRESS)
+	struct websocket_deflate	*ws_deflate;
+#endif
+	LIST_HEAD(, websocket_sub)	ws_subs;
+	struct sse_client		*sse;
 	TAILQ_HEAD(, http_request)	http_requests;
+	struct http2_session		*h2;
 #endif
 
 	TAILQ_ENTRY(connection)	list;
@@ -313,12 +434,29 @@ struct kore_route_params {
 	TAILQ_ENTRY(kore_route_params)	list;
 };
 
+#define KORE_ROUTE_PRIORITY_NORMAL	0
+#define KORE_ROUTE_PRIORITY_LOW		1
+#define KORE_ROUTE_PRIORITY_HIGH	2
+
+/* Per worker concurrency limit of a route, see overload.c. */
+struct kore_route_overload {
+	u_int32_t		limit;
+	u_int32_t		inflight;
+	u_int32_t		samples;
+	u_int64_t		window;
+	u_int64_t		latency;
+	u_int64_t		baseline;
+};
+
 struct kore_route {
 	char					*path;
 	char					*func;
 	int					type;
 	int					errors;
 	int					methods;
+	int					offload;
+	int					digest;
+	int					multipart;
 	regex_t					rctx;
 	struct kore_domain			*dom;
 	struct kore_auth			*auth;
@@ -326,6 +464,20 @@ struct kore_route {
 	struct kore_runtime_call		*on_free;
 	struct kore_runtime_call		*on_headers;
 	struct kore_runtime_call		*on_body_chunk;
+	struct kore_upstream			*upstream;
+	struct kore_ratelimit			*ratelimit;
+	int					ratelimit_key;
+	int					priority;
+	struct kore_route_overload		overload;
+	struct http_cache			*cache;
+#if defined(KORE_USE_COMPRESS)
+	struct http_compress			*compress;
+#endif
+
+	u_int32_t				order;
+	u_int32_t				metrics_id;
+	size_t					nsegs;
+	struct kore_route_seg			*segs;
 
 	TAILQ_HEAD(, kore_route_params)		params;
 	TAILQ_ENTRY(kore_route)			list;
@@ -340,7 +492,10 @@ struct kore_domain {
 	int					accesslog;
 
 	char					*domain;
-	struct kore_buf				*logbuf;
+	char					*accesslog_path;
+	u_int8_t				accesslog_ship;
+	u_int8_t				accesslog_format;
+	u_int32_t				accesslog_fields;
 	struct kore_server			*server;
 
 #if defined(KORE_USE_ACME)
@@ -351,11 +506,18 @@ struct kore_domain {
 #endif
 	char					*cafile;
 	char					*crlfile;
+	char					*ocspfile;
 	char					*certfile;
 	char					*certkey;
 	KORE_TLS_CTX				*tls_ctx;
 	int					x509_verify_depth;
+	void					*ocsp;
+	size_t					ocsp_len;
 #if !defined(KORE_NO_HTTP)
+	struct kore_router			*router;
+#if defined(KORE_USE_COMPRESS)
+	struct http_compress			*compress;
+#endif
 	TAILQ_HEAD(, kore_route)		routes;
 	TAILQ_HEAD(, http_redirect)		redirects;
 #endif
@@ -375,12 +537,26 @@ struct listener {
 	struct kore_server		*server;
 	struct kore_runtime_call	*connect;
 
+	/* Per worker SO_REUSEPORT sockets, only set in the parent. */
+	int				*reuse_fds;
+	u_int16_t			reuse_cnt;
+
 	LIST_ENTRY(listener)		list;
 };
 
+struct kore_proxy {
+	int				family;
+	char				*name;
+	socklen_t			addrlen;
+	struct sockaddr_storage		addr;
+};
+
 struct kore_server {
 	int				tls;
 	char				*name;
+	struct kore_proxy		*proxy;
+	struct kore_ratelimit		*ratelimit;
+	struct kore_domain_index	*dindex;
 	struct kore_domain_h		domains;
 	LIST_HEAD(, listener)		listeners;
 	LIST_ENTRY(kore_server)		list;
@@ -388,6 +564,18 @@ struct kore_server {
 
 LIST_HEAD(kore_server_list, kore_server);
 
+#define KORE_RATELIMIT_KEY_ADDRESS	1
+#define KORE_RATELIMIT_KEY_ROUTE	2
+#define KORE_RATELIMIT_KEY_AUTH		3
+
+struct kore_ratelimit {
+	char				*name;
+	u_int64_t			seed;
+	u_int64_t			interval;
+	u_int64_t			tolerance;
+	TAILQ_ENTRY(kore_ratelimit)	list;
+};
+
 #if !defined(KORE_NO_HTTP)
 
 #define KORE_PARAMS_QUERY_STRING	0x0001
@@ -402,10 +590,38 @@ struct kore_auth {
 	char			*value;
 	char			*redirect;
 	struct kore_validator	*validator;
+	u_int32_t		cache_ttl;
+	u_int32_t		cache_fail_ttl;
 
 	TAILQ_ENTRY(kore_auth)	list;
 };
 
+#define KORE_UPSTREAM_ROUND_ROBIN	1
+#define KORE_UPSTREAM_LEAST_CONN	2
+#define KORE_UPSTREAM_HASH_IP		3
+#define KORE_UPSTREAM_HASH_URI		4
+
+struct kore_upstream {
+	char				*name;
+	int				balance;
+	u_int32_t			keepalive;
+	u_int32_t			keepalive_timeout;
+	u_int32_t			max_fails;
+	u_int32_t			fail_timeout;
+	u_int32_t			connect_timeout;
+	u_int32_t			timeout;
+	u_int64_t			buffer_max;
+
+	u_int32_t			next;
+	u_int32_t			server_count;
+	struct kore_upstream_server	**servers;
+
+	size_t				ring_len;
+	struct kore_upstream_point	*ring;
+
+	LIST_ENTRY(kore_upstream)	list;
+};
+
 #define HANDLER_TYPE_STATIC	1
 #define HANDLER_TYPE_DYNAMIC	2
 
@@ -445,14 +661,70 @@ struct kore_module {
  * logs when it reached at least 75% of that or if its been > 1 second since
  * it was last synced.
  */
-#define KORE_ACCESSLOG_BUFLEN		131072U
-#define KORE_ACCESSLOG_SYNC		98304U
+/* KORE_ACCESSLOG_BUFLEN must be a power of 2. */
+#define KORE_ACCESSLOG_BUFLEN		524288U
+#define KORE_ACCESSLOG_LINE_MAX		8192
 
 struct kore_alog_header {
 	u_int16_t		domain;
 	u_int16_t		loglen;
 } __attribute__((packed));
 
+#define KORE_ALOG_FORMAT_CLF		0
+#define KORE_ALOG_FORMAT_JSON		1
+#define KORE_ALOG_FORMAT_BINARY		2
+
+#define KORE_ALOG_SHIP_NONE		0
+#define KORE_ALOG_SHIP_DGRAM		1
+#define KORE_ALOG_SHIP_SYSLOG		2
+
+/* Fields selectable with accesslog_fields for json and binary logs. */
+#define KORE_ALOG_FIELD_ADDR		0x0001
+#define KORE_ALOG_FIELD_CN		0x0002
+#define KORE_ALOG_FIELD_TIME		0x0004
+#define KORE_ALOG_FIELD_METHOD		0x0008
+#define KORE_ALOG_FIELD_PATH		0x0010
+#define KORE_ALOG_FIELD_VERSION		0x0020
+#define KORE_ALOG_FIELD_STATUS		0x0040
+#define KORE_ALOG_FIELD_BYTES		0x0080
+#define KORE_ALOG_FIELD_BODY		0x0100
+#define KORE_ALOG_FIELD_REFERER		0x0200
+#define KORE_ALOG_FIELD_AGENT		0x0400
+#define KORE_ALOG_FIELD_HOST		0x0800
+#define KORE_ALOG_FIELD_DURATION	0x1000
+#define KORE_ALOG_FIELD_ROUTE		0x2000
+#define KORE_ALOG_FIELDS_ALL		0x3fff
+#define KORE_ALOG_FIELDS_MAX		14
+
+#define KORE_ALOG_STR_PATH		0
+#define KORE_ALOG_STR_HOST		1
+#define KORE_ALOG_STR_AGENT		2
+#define KORE_ALOG_STR_REFERER		3
+#define KORE_ALOG_STR_CN		4
+#define KORE_ALOG_STR_ROUTE		5
+#define KORE_ALOG_STR_MAX		6
+
+/*
+ * A binary accesslog record, the strings follow it in KORE_ALOG_STR_*
+ * order without terminating NUL bytes. Fields not selected are zero.
+ * All values are in host byte order.
+ */
+struct kore_alog_record {
+	u_int16_t		length;
+	u_int16_t		status;
+	u_int32_t		fields;
+	u_int8_t		method;
+	u_int8_t		version;
+	u_int8_t		family;
+	u_int8_t		reserved;
+	u_int32_t		duration;
+	u_int64_t		time;
+	u_int64_t		bytes;
+	u_int64_t		body;
+	u_int8_t		addr[16];
+	u_int16_t		strlen[KORE_ALOG_STR_MAX];
+} __attribute__((packed));
+
 struct kore_privsep {
 	char		*root;
 	char		*runas;
@@ -460,6 +732,73 @@ struct kore_privsep {
 	int		skip_chroot;
 };
 
+/* Event loop counters, see worker_event_wait(). */
+struct kore_evloop {
+	u_int64_t		wakeups;
+	u_int64_t		events;
+	u_int64_t		idle_usec;
+	u_int64_t		busy_hits;
+	u_int64_t		busy_usec;
+};
+
+#define KORE_METRICS_STATUS_MAX		600
+#define KORE_METRICS_ROUTES		64
+#define KORE_METRICS_DOMAINS		16
+
+/* Which request timing a histogram holds. */
+#define KORE_METRICS_TTFB		0
+#define KORE_METRICS_TOTAL		1
+#define KORE_METRICS_SLEEP		2
+#define KORE_METRICS_TIMINGS		3
+
+/*
+ * Log-linear latency histogram in microseconds: every power of two is
+ * split into KORE_HISTO_SUB linear buckets, anything from 2^26 usec
+ * (about 67 seconds) up lands in the last one.
+ */
+#define KORE_HISTO_SUB_BITS		2
+#define KORE_HISTO_SUB			(1 << KORE_HISTO_SUB_BITS)
+#define KORE_HISTO_OCTAVES		25
+#define KORE_HISTO_BUCKETS		\
+	(KORE_HISTO_SUB * (KORE_HISTO_OCTAVES + 1))
+
+struct kore_histogram {
+	u_int64_t		count;
+	u_int64_t		sum;
+	u_int64_t		buckets[KORE_HISTO_BUCKETS];
+};
+
+/*
+ * Per worker counters and gauges, these live in shared memory next to
+ * the worker so any worker can aggregate them, see metrics.c.
+ */
+struct kore_metrics {
+	u_int64_t		status[KORE_METRICS_STATUS_MAX];
+	u_int64_t		routes[KORE_METRICS_ROUTES];
+	struct kore_histogram	route_timings[KORE_METRICS_ROUTES]
+				    [KORE_METRICS_TIMINGS];
+	struct kore_histogram	domain_timings[KORE_METRICS_DOMAINS]
+				    [KORE_METRICS_TIMINGS];
+	u_int64_t		bytes_in;
+	u_int64_t		bytes_out;
+	u_int64_t		tls_handshakes;
+	u_int64_t		accesslog_dropped;
+	u_int64_t		connections;
+	u_int64_t		pgsql_queue;
+	u_int64_t		curl_running;
+	u_int64_t		coroutines;
+	u_int64_t		coro_runnable;
+	u_int64_t		coro_runnable_tasks;
+	u_int64_t		coro_runnable_age;
+	u_int64_t		coro_suspended_age;
+	u_int64_t		coro_budget_hits;
+	struct kore_histogram	coro_slices;
+	struct kore_histogram	coro_waits;
+	u_int64_t		loop_lag_usec;
+	u_int64_t		overload_shed;
+	u_int64_t		overload_limit;
+};
+
 struct kore_worker {
 	u_int16_t			id;
 	u_int16_t			cpu;
@@ -476,11 +815,20 @@ struct kore_worker {
 	u_int64_t			time_locked;
 	struct kore_route		*active_route;
 	struct kore_privsep		*ps;
+	struct kore_evloop		loop;
+	struct kore_metrics		metrics;
+#if defined(__linux__)
+	struct kore_msg_ring		*ring;
+#endif
 
-	/* Used by the workers to store accesslogs. */
+	/*
+	 * Single producer (worker) single consumer (parent) accesslog ring,
+	 * head is only written by the worker and tail only by the parent.
+	 */
 	struct {
-		int			lock;
-		size_t			offset;
+		u_int64_t		head;
+		u_int64_t		tail;
+		u_int64_t		reported;
 		char			buf[KORE_ACCESSLOG_BUFLEN];
 	} lb;
 };
@@ -497,12 +845,28 @@ struct kore_validator {
 	regex_t				rctx;
 	struct kore_runtime_call	*rcall;
 
+	/* Byte set and length bounds for simple regexes, see validator.c. */
+	int				span;
+	size_t				span_min;
+	size_t				span_max;
+	u_int8_t			span_set[32];
+
 	TAILQ_ENTRY(kore_validator)	list;
 };
 #endif /* !KORE_NO_HTTP */
 
 #define KORE_BUF_OWNER_API	0x0001
 
+/*
+ * Per worker clock, refreshed once per event loop iteration.
+ */
+struct kore_clock {
+	u_int64_t		ms;
+	time_t			wall;
+	char			date[32];
+	char			clf[32];
+};
+
 struct kore_buf {
 	u_int8_t		*data;
 	int			flags;
@@ -510,6 +874,35 @@ struct kore_buf {
 	size_t			offset;
 };
 
+#define KORE_ROPE_CHUNK		8192
+#define KORE_ROPE_CHUNK_DATA	\
+	(KORE_ROPE_CHUNK - sizeof(struct kore_rope_chunk))
+
+/*
+ * A rope appends into a chain of fixed size pool chunks so growing it
+ * never copies, the chunks can be queued as-is with net_send_queue_rope().
+ */
+struct kore_rope_chunk {
+	size_t				len;
+	TAILQ_ENTRY(kore_rope_chunk)	list;
+	u_int8_t			data[];
+};
+
+struct kore_rope {
+	size_t				length;
+	TAILQ_HEAD(kore_rope_chunk_head, kore_rope_chunk)	chunks;
+};
+
+/*
+ * Immutable send data queued on many connections at once without
+ * copying, see net_send_shared(). Each queued netbuf holds a reference.
+ */
+struct netbuf_shared {
+	u_int32_t			refs;
+	size_t				len;
+	u_int8_t			data[];
+};
+
 #define KORE_JSON_TYPE_OBJECT		0x0001
 #define KORE_JSON_TYPE_ARRAY		0x0002
 #define KORE_JSON_TYPE_STRING		0x0004
@@ -536,7 +929,13 @@ struct kore_buf {
 #define KORE_JSON_ERR_INVALID_SEARCH	9
 #define KORE_JSON_ERR_NOT_FOUND		10
 #define KORE_JSON_ERR_TYPE_MISMATCH	11
-#define KORE_JSON_ERR_LAST		KORE_JSON_ERR_TYPE_MISMATCH
+#define KORE_JSON_ERR_INVALID_UTF8	12
+#define KORE_JSON_ERR_LAST		KORE_JSON_ERR_INVALID_UTF8
+
+/* Item lives on the tape of an indexed parse, see kore_json_parse_indexed. */
+#define KORE_JSON_ITEM_TAPE		0x0001
+/* Object was looked at and is too small or has unnamed items to index. */
+#define KORE_JSON_ITEM_NOKEYS		0x0002
 
 #define kore_json_find_object(j, p)		\
     kore_json_find(j, p, KORE_JSON_TYPE_OBJECT)
@@ -588,13 +987,63 @@ struct kore_json {
 
 	struct kore_buf			tmpbuf;
 	struct kore_json_item		*root;
+
+	u_int8_t			*copy;
+	struct kore_json_item		*tape;
+	size_t				tape_len;
+};
+
+struct kore_json_path_seg {
+	const char			*name;
+	size_t				len;
+	u_int32_t			hash;
+	int				spot;
+};
+
+/*
+ * A search path split up and hashed once, see kore_json_path_compile().
+ * It holds no references to a document and can be used on any of them.
+ */
+struct kore_json_path {
+	char				*path;
+	int				count;
+	struct kore_json_path_seg	segs[KORE_JSON_DEPTH_MAX];
+};
+
+#define KORE_JSON_WRITER_DEPTH		64
+#define KORE_JSON_WRITER_KEY		0x0001
+
+/*
+ * Push style JSON writer, see kore_json_write_*(). Output is appended to
+ * the rope, if flush is set it is called whenever the rope holds at least
+ * flush_size bytes so the output can be sent while it is being written.
+ */
+struct kore_json_writer {
+	int				depth;
+	int				flags;
+	u_int64_t			object;
+	u_int64_t			next;
+	size_t				flush_size;
+	struct kore_rope		rope;
+
+	void				(*flush)(struct kore_json_writer *);
+	void				(*cleanup)(struct kore_json_writer *);
+	void				*arg;
 };
 
 struct kore_json_item {
 	u_int32_t			type;
+	u_int32_t			flags;
 	char				*name;
 	struct kore_json_item		*parent;
 
+	/*
+	 * Key index of an object, it is dropped when an item is attached
+	 * through the API. Unlinking items by hand must not be done on
+	 * objects that were searched.
+	 */
+	struct kore_json_keys		*keys;
+
 	union {
 		TAILQ_HEAD(, kore_json_item)	items;
 		char				*string;
@@ -610,9 +1059,18 @@ struct kore_json_item {
 	TAILQ_ENTRY(kore_json_item)	list;
 };
 
+#define KORE_POOL_HUGEPAGE_SIZE		(2 * 1024 * 1024)
+
+#define KORE_POOL_REGION_KEEP		0x0001
+#define KORE_POOL_REGION_HUGEPAGE	0x0002
+
 struct kore_pool_region {
 	void				*start;
 	size_t				length;
+	size_t				elms;
+	size_t				inuse;
+	u_int64_t			idle;
+	int				flags;
 	LIST_ENTRY(kore_pool_region)	list;
 };
 
@@ -622,17 +1080,58 @@ struct kore_pool_entry {
 	LIST_ENTRY(kore_pool_entry)	list;
 };
 
+#if defined(KORE_USE_TASKS)
+#define KORE_POOL_MAGAZINES		8
+#define KORE_POOL_MAGAZINE_SIZE		32
+
+struct kore_pool_magazine {
+	u_int32_t			count;
+	u_int64_t			allocs;
+	struct kore_pool_entry		*entries[KORE_POOL_MAGAZINE_SIZE];
+};
+#endif
+
 struct kore_pool {
 	size_t			elen;
 	size_t			slen;
 	size_t			elms;
 	size_t			inuse;
+	size_t			hwm;
 	size_t			growth;
+	size_t			nregions;
+	u_int64_t		allocs;
+	u_int64_t		stats_allocs;
+	u_int64_t		stats_ms;
 	volatile int		lock;
 	char			*name;
 
 	LIST_HEAD(, kore_pool_region)	regions;
 	LIST_HEAD(, kore_pool_entry)	freelist;
+
+#if defined(KORE_USE_TASKS)
+	struct kore_pool_magazine	*magazines;
+#endif
+};
+
+#define KORE_POOL_STATS_NAME		32
+
+struct kore_pool_stats {
+	char			name[KORE_POOL_STATS_NAME];
+	size_t			elen;
+	size_t			elms;
+	size_t			inuse;
+	size_t			hwm;
+	size_t			regions;
+	u_int64_t		allocs;
+	u_int64_t		rate;
+};
+
+/* Allocations too large for the mem.c blocks, in bytes. */
+struct kore_mem_stats {
+	u_int64_t		large_count;
+	u_int64_t		large_bytes;
+	u_int64_t		large_hwm;
+	u_int64_t		large_allocs;
 };
 
 struct kore_timer {
@@ -642,6 +1141,9 @@ struct kore_timer {
 	void		*arg;
 	void		(*cb)(void *, u_int64_t);
 
+	u_int16_t	slot;
+	u_int8_t	state;
+
 	TAILQ_ENTRY(kore_timer)	list;
 };
 
@@ -672,11 +1174,24 @@ struct kore_timer {
 #define KORE_MSG_ACCEPT_AVAILABLE	10
 #define KORE_PYTHON_SEND_OBJ		11
 #define KORE_MSG_WORKER_LOG		12
+#define KORE_MSG_POOL_STATS		13
+#define KORE_MSG_WEBSOCKET_TOPIC	14
+#define KORE_MSG_PGSQL_CACHE_PURGE	15
+#define KORE_MSG_AUTH_CACHE_PURGE	16
+#define KORE_MSG_TLS_TICKET_KEYS	17
+#define KORE_MSG_OCSP			18
+#define KORE_MSG_SSE			19
 #define KORE_MSG_ACME_BASE		100
 
 /* messages for applications should start at 201. */
 #define KORE_MSG_APP_BASE		200
 
+/* Default size of the per worker message ring, see msg.c. */
+#define KORE_MSG_RING_SIZE		(256 * 1024)
+
+/* Queued message bytes after which we flush before the loop ends. */
+#define KORE_MSG_FLUSH_THRESHOLD	(64 * 1024)
+
 /* Predefined message targets. */
 #define KORE_MSG_PARENT		1000
 #define KORE_MSG_WORKER_ALL	1001
@@ -690,17 +1205,33 @@ struct kore_msg {
 
 struct kore_keyreq {
 	int		padding;
+	u_int32_t	id;
 	char		domain[KORE_DOMAINNAME_LEN + 1];
 	size_t		data_len;
 	u_int8_t	data[];
 };
 
+/* KORE_MSG_KEYMGR_RESP, no data if the keymgr could not sign. */
+struct kore_keyres {
+	u_int32_t	id;
+	u_int8_t	data[];
+};
+
 struct kore_x509_msg {
 	char		domain[KORE_DOMAINNAME_LEN + 1];
 	size_t		data_len;
 	u_int8_t	data[];
 };
 
+/*
+ * Session ticket keys as handed out by the keymgr: a 16 byte name,
+ * 32 byte HMAC secret and 32 byte AES key each, the first one is used
+ * to issue new tickets. KORE_MSG_TLS_TICKET_KEYS carries up to
+ * KORE_TLS_TICKET_KEYS of them in a kore_x509_msg without a domain.
+ */
+#define KORE_TLS_TICKET_KEY_LEN		80
+#define KORE_TLS_TICKET_KEYS		3
+
 #if !defined(KORE_SINGLE_BINARY)
 extern char	*config_file;
 #endif
@@ -718,7 +1249,12 @@ extern char	*kore_pidfile;
 extern volatile sig_atomic_t	sig_recv;
 
 extern char	*kore_rand_file;
+extern char	*kore_tls_ticket_file;
+extern u_int32_t	kore_tls_ticket_rotate;
 extern int	kore_keymgr_active;
+#if !defined(KORE_NO_HTTP)
+extern u_int32_t	kore_accesslog_fsync;
+#endif
 
 extern struct kore_privsep	worker_privsep;
 extern struct kore_privsep	keymgr_privsep;
@@ -731,16 +1267,50 @@ extern const char		*kore_version;
 extern const char		*kore_build_date;
 extern int			worker_policy;
 extern u_int8_t			worker_set_affinity;
+extern u_int8_t			worker_numa;
+extern char			*worker_numa_nic;
 extern u_int32_t		worker_rlimit_nofiles;
 extern u_int32_t		worker_max_connections;
 extern u_int32_t		worker_active_connections;
 extern u_int32_t		worker_accept_threshold;
+extern u_int32_t		worker_event_batch;
+extern u_int32_t		worker_busy_poll;
+extern u_int32_t		kore_msg_ring_size;
+extern u_int32_t		kore_msg_flush_threshold;
+extern u_int8_t			worker_accept_exclusive;
 extern u_int64_t		kore_websocket_maxframe;
 extern u_int64_t		kore_websocket_timeout;
+extern u_int32_t		kore_sse_history;
+extern u_int32_t		kore_sse_heartbeat;
+#if defined(KORE_USE_COMPRESS)
+extern u_int8_t			kore_websocket_deflate;
+extern u_int8_t			kore_websocket_deflate_window;
+extern u_int8_t			kore_websocket_deflate_memlevel;
+extern u_int8_t			kore_websocket_deflate_takeover;
+extern size_t			kore_websocket_deflate_min_size;
+#endif
 extern u_int32_t		kore_socket_backlog;
+extern u_int8_t			kore_socket_reuseport;
+extern u_int32_t		kore_socket_busy_poll;
+extern u_int32_t		proxy_buffer;
+extern u_int32_t		kore_ratelimit_table_size;
+extern int			kore_upgrade_handover;
+extern u_int32_t		kore_upgrade_drain_timeout;
+#if !defined(KORE_NO_HTTP)
+extern u_int32_t		kore_auth_cache_size;
+#endif
+extern u_int32_t		proxy_connect_timeout;
+extern u_int32_t		proxy_idle_timeout;
+extern u_int32_t		kore_pool_idle_time;
+extern u_int8_t			kore_pool_hugepages;
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+extern size_t			kore_socket_zerocopy;
+#endif
 
 extern struct kore_worker	*worker;
+extern struct kore_evloop	*kore_evloop;
 extern struct kore_pool		nb_pool;
+extern struct kore_clock	kore_clock;
 extern struct kore_domain	*primary_dom;
 extern struct kore_server_list	kore_servers;
 
@@ -753,6 +1323,8 @@ void		kore_proctitle(const char *);
 void		kore_default_getopt(int, char **);
 
 void		kore_server_closeall(void);
+int		kore_server_reuseport(u_int16_t);
+void		kore_server_reuseport_select(u_int16_t);
 void		kore_server_cleanup(void);
 void		kore_server_free(struct kore_server *);
 void		kore_server_finalize(struct kore_server *);
@@ -779,6 +1351,10 @@ void		kore_worker_started(void);
 void		kore_worker_make_busy(void);
 void		kore_worker_shutdown(void);
 void		kore_worker_dispatch_signal(int);
+void		kore_worker_loop_report(void);
+void		kore_worker_pool_stats(struct kore_msg *, const void *);
+void		kore_worker_pool_stats_request(void);
+u_int16_t	kore_worker_running(void);
 int		kore_worker_spawn(u_int16_t, u_int16_t, u_int16_t);
 int		kore_worker_keymgr_response_verify(struct kore_msg *,
 		    const void *, struct kore_domain **);
@@ -797,7 +1373,7 @@ void		kore_platform_disable_read(int);
 void		kore_platform_disable_write(int);
 void		kore_platform_enable_accept(void);
 void		kore_platform_disable_accept(void);
-void		kore_platform_event_wait(u_int64_t);
+int		kore_platform_event_wait(u_int64_t);
 void		kore_platform_event_all(int, void *);
 void		kore_platform_event_level_all(int, void *);
 void		kore_platform_event_level_read(int, void *);
@@ -806,11 +1382,24 @@ void		kore_platform_schedule_read(int, void *);
 void		kore_platform_schedule_write(int, void *);
 void		kore_platform_event_schedule(int, int, int, void *);
 void		kore_platform_worker_setcpu(struct kore_worker *);
+void		kore_platform_thread_setcpu(int);
+u_int16_t	kore_platform_worker_cpu(u_int16_t);
+
+#if defined(__linux__)
+struct sock_fprog;
+struct sock_fprog	*kore_platform_reuseport_node(u_int16_t);
+#endif
 
 #if defined(KORE_USE_PLATFORM_SENDFILE)
 int		kore_platform_sendfile(struct connection *, struct netbuf *);
 #endif
 
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+int		kore_platform_zerocopy_send(struct connection *, size_t,
+		    size_t *);
+int		kore_platform_zerocopy_reap(struct connection *);
+#endif
+
 #if defined(KORE_USE_PLATFORM_PLEDGE)
 void		kore_platform_pledge(void);
 void		kore_platform_add_pledge(const char *);
@@ -824,6 +1413,15 @@ void		kore_tls_cleanup(void);
 void		kore_tls_dh_check(void);
 int		kore_tls_supported(void);
 void		kore_tls_version_set(int);
+void		kore_tls_ktls_set(int);
+void		kore_tls_handshake_threads_set(u_int16_t);
+void		kore_tls_handshake_drain(void);
+int		kore_tls_ktls_enabled(void);
+void		kore_tls_record_threshold_set(u_int32_t);
+void		kore_tls_record_idle_set(u_int32_t);
+void		kore_tls_session_cache_set(u_int32_t);
+void		kore_tls_session_cache_init(void);
+void		kore_tls_ticket_keys(const void *, size_t);
 void		kore_tls_keymgr_init(void);
 int		kore_tls_dh_load(const char *);
 void		kore_tls_seed(const void *, size_t);
@@ -833,10 +1431,17 @@ void		kore_tls_domain_cleanup(struct kore_domain *);
 int		kore_tls_connection_accept(struct connection *);
 void		kore_tls_connection_cleanup(struct connection *);
 int		kore_tls_write(struct connection *, size_t, size_t *);
+int		kore_tls_writev(struct connection *,
+		    struct iovec *, int, size_t *);
 void		kore_tls_domain_crl(struct kore_domain *, const void *, size_t);
+void		kore_tls_domain_ocsp(struct kore_domain *, const void *, size_t);
 void		kore_tls_domain_setup(struct kore_domain *,
 		    int, const void *, size_t);
 
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+int		kore_tls_sendfile(struct connection *, struct netbuf *);
+#endif
+
 KORE_PRIVATE_KEY	*kore_tls_rsakey_load(const char *);
 KORE_PRIVATE_KEY	*kore_tls_rsakey_generate(const char *);
 
@@ -849,8 +1454,12 @@ int		kore_tls_x509name_foreach(KORE_X509_NAMES *, int, void *,
 /* accesslog.c */
 void		kore_accesslog_init(u_int16_t);
 void		kore_accesslog_worker_init(void);
-void		kore_accesslog_run(void *, u_int64_t);
-void		kore_accesslog_gather(void *, u_int64_t, int);
+void		kore_accesslog_start(void);
+void		kore_accesslog_stop(void);
+void		kore_accesslog_rotate(void);
+int		kore_accesslog_reap(pid_t, int);
+int		kore_accesslog_ship(struct kore_domain *, const char *);
+u_int32_t	kore_accesslog_field(const char *);
 
 #if !defined(KORE_NO_HTTP)
 /* auth.c */
@@ -859,8 +1468,20 @@ int		kore_auth_cookie(struct http_request *, struct kore_auth *);
 int		kore_auth_header(struct http_request *, struct kore_auth *);
 int		kore_auth_request(struct http_request *, struct kore_auth *);
 void		kore_auth_init(void);
+void		kore_auth_worker_init(void);
+void		kore_auth_cache_purge(const char *);
 int		kore_auth_new(const char *);
 struct kore_auth	*kore_auth_lookup(const char *);
+
+/* upstream.c */
+void			kore_upstream_worker_init(void);
+int			kore_upstream_run(struct http_request *);
+void			kore_upstream_cleanup(struct http_request *);
+int			kore_upstream_finalize(struct kore_upstream *);
+int			kore_upstream_server_add(struct kore_upstream *,
+			    const char *, const char *);
+struct kore_upstream	*kore_upstream_create(const char *);
+struct kore_upstream	*kore_upstream_lookup(const char *);
 #endif
 
 /* timer.c */
@@ -875,10 +1496,12 @@ struct kore_timer	*kore_timer_add(void (*cb)(void *, u_int64_t),
 void			kore_connection_init(void);
 void			kore_connection_cleanup(void);
 void			kore_connection_prune(int);
+void			kore_connection_drain(void);
 struct connection	*kore_connection_new(void *);
 void			kore_connection_event(void *, int);
 int			kore_connection_nonblock(int, int);
 void			kore_connection_check_timeout(u_int64_t);
+void			kore_connection_timeout_update(struct connection *);
 int			kore_connection_handle(struct connection *);
 void			kore_connection_remove(struct connection *);
 void			kore_connection_disconnect(struct connection *);
@@ -889,6 +1512,12 @@ void			kore_connection_check_idletimer(u_int64_t,
 int			kore_connection_accept(struct listener *,
 			    struct connection **);
 
+/* proxy.c */
+int		kore_proxy_configure(struct kore_server *,
+		    const char *, const char *);
+void		kore_proxy_free(struct kore_proxy *);
+void		kore_proxy_start(struct connection *);
+
 void		kore_log_init(void);
 void		kore_log_file(const char *);
 
@@ -907,6 +1536,7 @@ void		*kore_realloc(void *, size_t);
 void		kore_free(void *);
 void		kore_mem_init(void);
 void		kore_mem_cleanup(void);
+void		kore_mem_stats_get(struct kore_mem_stats *);
 void		kore_mem_untag(void *);
 void		*kore_mem_lookup(u_int32_t);
 void		kore_mem_zero(void *, size_t);
@@ -919,6 +1549,8 @@ void		kore_pool_put(struct kore_pool *, void *);
 void		kore_pool_init(struct kore_pool *, const char *,
 		    size_t, size_t);
 void		kore_pool_cleanup(struct kore_pool *);
+void		kore_pool_reclaim(void *, u_int64_t);
+size_t		kore_pool_stats_get(struct kore_pool_stats *, size_t);
 
 /* utils.c */
 void		kore_debug_internal(char *, int, const char *, ...);
@@ -926,6 +1558,8 @@ void		fatal(const char *, ...) __attribute__((noreturn));
 void		fatalx(const char *, ...) __attribute__((noreturn));
 
 u_int64_t	kore_time_ms(void);
+u_int64_t	kore_time_us(void);
+void		kore_clock_tick(void);
 char		*kore_time_to_date(time_t);
 char		*kore_strdup(const char *);
 time_t		kore_date_to_time(const char *);
@@ -947,9 +1581,28 @@ int		kore_x509_issuer_name(struct connection *, char **, int);
 int		kore_x509_subject_name(struct connection *, char **, int);
 
 void		*kore_mem_find(void *, size_t, const void *, size_t);
+size_t		kore_mem_scan(const void *, size_t, size_t, u_int8_t);
 char		*kore_text_trim(char *, size_t);
 char		*kore_read_line(FILE *, char *, size_t);
 
+/* ratelimit.c */
+void			kore_ratelimit_init(void);
+int			kore_ratelimit_add(const char *, u_int32_t,
+			    u_int32_t, u_int32_t);
+int			kore_ratelimit_check(struct kore_ratelimit *,
+			    const void *, size_t, u_int64_t *);
+int			kore_ratelimit_connection(struct kore_ratelimit *,
+			    struct connection *, u_int64_t *);
+int			kore_ratelimit_key(const char *);
+struct kore_ratelimit	*kore_ratelimit_lookup(const char *);
+
+/* upgrade.c */
+void		kore_upgrade_init(int, char **);
+void		kore_upgrade_start(void);
+void		kore_upgrade_ready(void);
+void		kore_upgrade_release(void);
+int		kore_upgrade_socket(int, const char *, const char *);
+
 #if !defined(KORE_NO_HTTP)
 /* websocket.c */
 void		kore_websocket_handshake(struct http_request *,
@@ -959,12 +1612,35 @@ void		kore_websocket_send(struct connection *,
 		    u_int8_t, const void *, size_t);
 void		kore_websocket_broadcast(struct connection *,
 		    u_int8_t, const void *, size_t, int);
+void		kore_websocket_cleanup(struct connection *);
+void		kore_websocket_topic_init(void);
+void		kore_websocket_topic_reap(u_int16_t);
+int		kore_websocket_subscribe(struct connection *, const char *);
+int		kore_websocket_unsubscribe(struct connection *, const char *);
+void		kore_websocket_publish(struct connection *, const char *,
+		    u_int8_t, const void *, size_t, int);
+
+/* sse.c */
+void		kore_sse_init(void);
+void		kore_sse_worker_init(void);
+void		kore_sse_handshake(struct http_request *,
+		    const char *, const char *);
+void		kore_sse_send(struct connection *, const char *,
+		    const void *, size_t);
+void		kore_sse_cleanup(struct connection *);
+int		kore_sse_subscribe(struct connection *, const char *);
+int		kore_sse_unsubscribe(struct connection *, const char *);
+u_int64_t	kore_sse_publish(const char *, const char *,
+		    const void *, size_t, int);
 #endif
 
 /* msg.c */
 void		kore_msg_init(void);
 void		kore_msg_worker_init(void);
 void		kore_msg_parent_init(void);
+void		kore_msg_ring_init(void);
+void		kore_msg_ring_reap(pid_t);
+void		kore_msg_flush(void);
 void		kore_msg_unregister(u_int8_t);
 void		kore_msg_parent_add(struct kore_worker *);
 void		kore_msg_parent_remove(struct kore_worker *);
@@ -980,14 +1656,35 @@ int		kore_filemap_create(struct kore_domain *, const char *,
 		    const char *);
 extern char	*kore_filemap_ext;
 extern char	*kore_filemap_index;
+extern size_t	kore_filemap_cache_size;
+extern size_t	kore_filemap_cache_max;
+extern u_int64_t	kore_filemap_resolve_ttl;
+extern int		kore_filemap_precompressed;
+#endif
+
+#if !defined(KORE_NO_HTTP)
+/* metrics.c */
+void		kore_metrics_init(void);
+void		kore_metrics_request(struct http_request *);
+int		kore_metrics_route(struct kore_domain *, const char *);
+int		kore_metrics_serve(struct http_request *);
+void		kore_histogram_add(struct kore_histogram *, u_int64_t);
+u_int64_t	kore_histogram_bound(int);
+extern int	kore_metrics_enabled;
 #endif
 
 /* fileref.c */
+extern u_int64_t	kore_fileref_timeout;
+extern u_int64_t	kore_fileref_revalidate;
+extern u_int64_t	kore_fileref_cache_size;
+
 void			kore_fileref_init(void);
 struct kore_fileref	*kore_fileref_get(const char *, int);
 struct kore_fileref	*kore_fileref_create(struct kore_server *,
 			    const char *, int, off_t, struct timespec *);
+void			kore_fileref_retain(struct kore_fileref *);
 void			kore_fileref_release(struct kore_fileref *);
+int			kore_fileref_valid(struct kore_fileref *);
 
 /* domain.c */
 struct kore_domain	*kore_domain_new(const char *);
@@ -997,12 +1694,14 @@ struct kore_domain	*kore_domain_lookup(struct kore_server *, const char *);
 void		kore_domain_init(void);
 void		kore_domain_cleanup(void);
 void		kore_domain_free(struct kore_domain *);
+void		kore_domain_index_free(struct kore_server *);
 void		kore_module_init(void);
 void		kore_module_cleanup(void);
 void		kore_module_reload(int);
 void		kore_module_onload(void);
 int		kore_module_loaded(void);
 void		kore_domain_closelogs(void);
+int		kore_domain_accesslog(struct kore_domain *, const char *);
 void		*kore_module_getsym(const char *, struct kore_runtime **);
 void		kore_domain_load_crl(void);
 void		kore_domain_keymgr_init(void);
@@ -1013,6 +1712,7 @@ int		kore_domain_attach(struct kore_domain *, struct kore_server *);
 /* route.c */
 void		kore_route_reload(void);
 void		kore_route_free(struct kore_route *);
+void		kore_route_index_free(struct kore_domain *);
 void		kore_route_callback(struct kore_route *, const char *);
 
 struct kore_route	*kore_route_create(struct kore_domain *,
@@ -1052,6 +1752,7 @@ void	kore_runtime_wsmessage(struct kore_runtime_call *,
 void		kore_validator_init(void);
 void		kore_validator_reload(void);
 int		kore_validator_add(const char *, u_int8_t, const char *);
+int		kore_validator_compile(struct kore_validator *, const char *);
 int		kore_validator_run(struct http_request *, const char *, char *);
 int		kore_validator_check(struct http_request *,
 		    struct kore_validator *, const void *);
@@ -1074,19 +1775,42 @@ struct netbuf	*net_netbuf_get(void);
 int		net_send(struct connection *);
 int		net_send_flush(struct connection *);
 int		net_recv_flush(struct connection *);
+int		net_recv_pending(void);
+void		net_recv_pending_flush(void);
+void		net_recv_pending_remove(struct connection *);
+void		net_recv_pushback(struct connection *, const void *, size_t);
 int		net_read(struct connection *, size_t *);
 int		net_write(struct connection *, size_t, size_t *);
+int		net_writev(struct connection *, struct iovec *, int, size_t *);
 void		net_recv_reset(struct connection *, size_t,
 		    int (*cb)(struct netbuf *));
 void		net_remove_netbuf(struct connection *, struct netbuf *);
 void		net_recv_queue(struct connection *, size_t, int,
 		    int (*cb)(struct netbuf *));
+void		net_recv_pooled(struct connection *,
+		    int (*cb)(struct netbuf *));
+void		net_recv_buffer_put(void *);
+void		net_recv_buffers_init(size_t, size_t);
 void		net_recv_expand(struct connection *c, size_t,
 		    int (*cb)(struct netbuf *));
 void		net_send_queue(struct connection *, const void *, size_t);
+size_t		net_send_pending(struct connection *);
+struct netbuf	*net_send_reserve(struct connection *, size_t);
+void		net_send_queue_rope(struct connection *, struct kore_rope *);
+void		net_send_shared(struct connection *, struct netbuf_shared *);
+void		net_shared_release(struct netbuf_shared *);
+struct netbuf_shared	*net_shared_alloc(size_t);
 void		net_send_stream(struct connection *, void *,
 		    size_t, int (*cb)(struct netbuf *), struct netbuf **);
 void		net_send_fileref(struct connection *, struct kore_fileref *);
+void		net_send_fileref_range(struct connection *,
+		    struct kore_fileref *, off_t, size_t);
+
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+void		net_zerocopy_cleanup(struct connection *);
+void		net_zerocopy_complete(struct connection *,
+		    u_int32_t, u_int32_t);
+#endif
 
 /* buf.c */
 void		kore_buf_free(struct kore_buf *);
@@ -1103,18 +1827,49 @@ void	kore_buf_appendv(struct kore_buf *, const char *, va_list);
 void	kore_buf_replace_string(struct kore_buf *,
 	    const char *, const void *, size_t);
 
+void	kore_rope_pool_init(void);
+void	kore_rope_init(struct kore_rope *);
+void	kore_rope_cleanup(struct kore_rope *);
+void	kore_rope_append(struct kore_rope *, const void *, size_t);
+void	kore_rope_appendf(struct kore_rope *, const char *, ...);
+void	kore_rope_appendv(struct kore_rope *, const char *, va_list);
+void	kore_rope_tobuf(struct kore_rope *, struct kore_buf *);
+void	kore_rope_chunk_free(struct kore_rope_chunk *);
+
 /* json.c */
 int	kore_json_errno(void);
 int	kore_json_parse(struct kore_json *);
+int	kore_json_parse_indexed(struct kore_json *);
+void	kore_json_pool_init(void);
 void	kore_json_cleanup(struct kore_json *);
 void	kore_json_item_free(struct kore_json_item *);
 void	kore_json_init(struct kore_json *, const void *, size_t);
 void	kore_json_item_tobuf(struct kore_json_item *, struct kore_buf *);
+void	kore_json_item_torope(struct kore_json_item *, struct kore_rope *);
 void	kore_json_item_attach(struct kore_json_item *, struct kore_json_item *);
 
+void	kore_json_writer_init(struct kore_json_writer *);
+void	kore_json_writer_cleanup(struct kore_json_writer *);
+void	kore_json_write_key(struct kore_json_writer *, const char *);
+void	kore_json_write_begin_object(struct kore_json_writer *);
+void	kore_json_write_end_object(struct kore_json_writer *);
+void	kore_json_write_begin_array(struct kore_json_writer *);
+void	kore_json_write_end_array(struct kore_json_writer *);
+void	kore_json_write_string(struct kore_json_writer *, const char *);
+void	kore_json_write_number(struct kore_json_writer *, double);
+void	kore_json_write_integer(struct kore_json_writer *, int64_t);
+void	kore_json_write_integer_u64(struct kore_json_writer *, u_int64_t);
+void	kore_json_write_literal(struct kore_json_writer *, int);
+void	kore_json_write_item(struct kore_json_writer *,
+	    struct kore_json_item *);
+
 const char		*kore_json_strerror(void);
 struct kore_json_item	*kore_json_find(struct kore_json_item *,
 			    const char *, u_int32_t);
+struct kore_json_path	*kore_json_path_compile(const char *);
+struct kore_json_item	*kore_json_path_find(struct kore_json_item *,
+			    const struct kore_json_path *, u_int32_t);
+void			kore_json_path_free(struct kore_json_path *);
 struct kore_json_item	*kore_json_create_item(struct kore_json_item *,
 			    const char *, u_int32_t, ...);
 
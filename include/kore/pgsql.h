@@ -25,6 +25,8 @@
 #define KORE_PGSQL_SYNC			0x0001
 #define KORE_PGSQL_ASYNC		0x0002
 #define KORE_PGSQL_SCHEDULED		0x0004
+#define KORE_PGSQL_PIPELINE		0x0008
+#define KORE_PGSQL_SINGLE_ROW		0x0010
 
 #define KORE_PGSQL_PARAM_BINARY(v, l)	v, l, 1
 #define KORE_PGSQL_PARAM_TEXT_LEN(v, l)	v, l, 0
@@ -40,16 +42,36 @@ struct pgsql_conn {
 	char				*name;
 
 	PGconn				*db;
+	struct pgsql_db			*pgsqldb;
 	struct pgsql_job		*job;
+
+	/* Bitmap of statement ids prepared on this connection. */
+	u_int8_t			*prepared;
+	size_t				prepared_len;
+
 	TAILQ_ENTRY(pgsql_conn)		list;
 };
 
+struct pgsql_statement {
+	u_int32_t			id;
+	char				*name;
+	char				*sql;
+	LIST_ENTRY(pgsql_statement)	list;
+};
+
 struct pgsql_db {
 	char			*name;
 	char			*conn_string;
+	u_int16_t		conn_min;
 	u_int16_t		conn_max;
 	u_int16_t		conn_count;
 
+	TAILQ_HEAD(, pgsql_conn)	conn_free;
+	TAILQ_HEAD(, pgsql_wait)	wait_queue;
+
+	u_int32_t		stmt_count;
+	LIST_HEAD(, pgsql_statement)	statements;
+
 	LIST_ENTRY(pgsql_db)	rlist;
 };
 
@@ -59,6 +81,23 @@ struct kore_pgsql {
 	char			*error;
 	PGresult		*result;
 	struct pgsql_conn	*conn;
+	struct pgsql_prepare	*prepare;
+	struct pgsql_wait	*wait;
+
+	/* Opt-in result cache, see kore_pgsql_cache(). */
+	u_int32_t			cache_ttl;
+	struct pgsql_cache		*cache;
+	LIST_ENTRY(kore_pgsql)		cache_list;
+
+	/*
+	 * Queries sent in pipeline mode, in order. Entries pointing at a
+	 * statement are implicit prepares whose results are not surfaced.
+	 */
+	struct {
+		struct pgsql_statement	**queue;
+		u_int32_t		length;
+		u_int32_t		next;
+	} pipeline;
 
 	struct {
 		char		*channel;
@@ -72,11 +111,41 @@ struct kore_pgsql {
 	LIST_ENTRY(kore_pgsql)	rlist;
 };
 
+/*
+ * Streams the rows of a single row mode query into a chunked response,
+ * see kore_pgsql_stream_run(). At most one chunk is in flight, no more
+ * rows are read from the server until it was sent.
+ */
+#define KORE_PGSQL_STREAM_CHUNK		(16 * 1024)
+
+#define KORE_PGSQL_STREAM_STARTED	0x0001
+#define KORE_PGSQL_STREAM_CHUNKED	0x0002
+#define KORE_PGSQL_STREAM_INFLIGHT	0x0004
+#define KORE_PGSQL_STREAM_FINISHED	0x0008
+
+struct kore_pgsql_stream {
+	int			flags;
+	int			status;
+	struct kore_pgsql	*pgsql;
+	struct http_request	*req;
+
+	struct kore_buf		*buf;
+	struct kore_buf		bufs[2];
+
+	void			*arg;
+	int			(*row)(struct kore_pgsql *, int,
+				    struct kore_buf *, void *);
+};
+
+extern size_t		pgsql_cache_size;
+extern u_int16_t	pgsql_conn_min;
 extern u_int16_t	pgsql_conn_max;
 extern u_int32_t	pgsql_queue_limit;
+extern u_int32_t	pgsql_queue_count;
 
 void	kore_pgsql_sys_init(void);
 void	kore_pgsql_sys_cleanup(void);
+void	kore_pgsql_worker_init(void);
 void	kore_pgsql_init(struct kore_pgsql *);
 void	kore_pgsql_bind_request(struct kore_pgsql *, struct http_request *);
 void	kore_pgsql_bind_callback(struct kore_pgsql *,
@@ -92,7 +161,18 @@ int	kore_pgsql_v_query_params(struct kore_pgsql *,
 	    const void *, int, int, va_list);
 int	kore_pgsql_query_param_fields(struct kore_pgsql *, const void *,
 	    int, int, const char **, int *, int *);
+int	kore_pgsql_execute(struct kore_pgsql *,
+	    const char *, int, int, ...);
+int	kore_pgsql_v_execute(struct kore_pgsql *,
+	    const char *, int, int, va_list);
+int	kore_pgsql_execute_param_fields(struct kore_pgsql *, const char *,
+	    int, int, const char **, int *, int *);
+int	kore_pgsql_pipeline_sync(struct kore_pgsql *);
+void	kore_pgsql_cache(struct kore_pgsql *, u_int32_t);
+void	kore_pgsql_cache_purge(const char *);
 int	kore_pgsql_register(const char *, const char *);
+int	kore_pgsql_register_statement(const char *, const char *,
+	    const char *);
 int	kore_pgsql_ntuples(struct kore_pgsql *);
 int	kore_pgsql_nfields(struct kore_pgsql *);
 void	kore_pgsql_logerror(struct kore_pgsql *);
@@ -100,6 +180,16 @@ char	*kore_pgsql_fieldname(struct kore_pgsql *, int);
 char	*kore_pgsql_getvalue(struct kore_pgsql *, int, int);
 int	kore_pgsql_getlength(struct kore_pgsql *, int, int);
 int	kore_pgsql_column_binary(struct kore_pgsql *, int);
+PGresult	*kore_pgsql_result_take(struct kore_pgsql *);
+
+#if !defined(KORE_NO_HTTP)
+void	kore_pgsql_stream_init(struct kore_pgsql_stream *, struct kore_pgsql *,
+	    struct http_request *, int,
+	    int (*)(struct kore_pgsql *, int, struct kore_buf *, void *),
+	    void *);
+int	kore_pgsql_stream_run(struct kore_pgsql_stream *);
+void	kore_pgsql_stream_cleanup(struct kore_pgsql_stream *);
+#endif
 
 #if defined(__cplusplus)
 }
@@ -32,10 +32,21 @@ void		kore_python_cleanup(void);
 void		kore_python_coro_run(void);
 void		kore_python_proc_reap(void);
 int		kore_python_coro_pending(void);
+int		kore_python_coro_count(void);
+int		kore_python_coro_runnable(void);
+int		kore_python_coro_runnable_tasks(void);
+u_int64_t	kore_python_coro_budget_hits(void);
+u_int64_t	kore_python_coro_runnable_age(void);
+u_int64_t	kore_python_coro_suspended_age(void);
+void		kore_python_coro_trace_dump(void);
 void		kore_python_path(const char *);
 void		kore_python_coro_delete(void *);
 void		kore_python_routes_resolve(void);
 void		kore_python_log_error(const char *);
+void		kore_python_gil_release(void);
+void		kore_python_gil_acquire(void);
+void		kore_python_http_request_release(struct http_request *);
+void		kore_python_fork_prepare(void);
 
 PyObject	*kore_python_callable(PyObject *, const char *);
 
@@ -48,6 +59,10 @@ void	kore_python_seccomp_hook(const char *);
 extern const char			*kore_pymodule;
 #endif
 
+extern u_int32_t			kore_python_coro_budget;
+extern u_int32_t			kore_python_coro_budget_time;
+extern int				kore_python_gc_freeze;
+
 extern struct kore_module_functions	kore_python_module;
 extern struct kore_runtime		kore_python_runtime;
 
@@ -17,10 +17,44 @@
 #define CORO_STATE_RUNNABLE		1
 #define CORO_STATE_SUSPENDED		2
 
+/*
+ * Coroutine trace events, kept in a per worker ring buffer while
+ * kore.corotrace() is on. What arg holds depends on the event.
+ */
+#define CORO_TRACE_CREATE		1	/* runnable queue length */
+#define CORO_TRACE_RUN			2	/* runnable queue length */
+#define CORO_TRACE_SUSPEND		3	/* usec since started running */
+#define CORO_TRACE_WAKEUP		4	/* usec spent suspended */
+#define CORO_TRACE_DELETE		5	/* 0 */
+#define CORO_TRACE_KILL			6	/* 0 */
+
+#define CORO_TRACE_RING			8192
+
+struct python_coro_event {
+	u_int64_t			ts;
+	u_int64_t			id;
+	u_int32_t			type;
+	u_int32_t			arg;
+};
+
+/*
+ * Coroutines driving a request run ahead of background tasks, which
+ * still get every CORO_TASK_SHARE'th step when both queues are busy.
+ */
+#define CORO_PRIO_REQUEST		0
+#define CORO_PRIO_TASK			1
+#define CORO_PRIO_MAX			2
+
+#define CORO_TASK_SHARE			4
+
 struct python_coro {
 	u_int64_t			id;
+	int				prio;
 	int				state;
 	int				killed;
+	u_int64_t			queued;
+	u_int64_t			started;
+	u_int64_t			suspended;
 	PyObject			*obj;
 	char				*name;
 	PyObject			*result;
@@ -38,6 +72,9 @@ TAILQ_HEAD(coro_list, python_coro);
 static PyObject		*python_kore_app(PyObject *, PyObject *);
 static PyObject		*python_kore_log(PyObject *, PyObject *);
 static PyObject		*python_kore_time(PyObject *, PyObject *);
+static PyObject		*python_kore_httpdate(PyObject *, PyObject *);
+static PyObject		*python_kore_pool_stats(PyObject *, PyObject *);
+static PyObject		*python_kore_corostats(PyObject *, PyObject *);
 static PyObject		*python_kore_lock(PyObject *, PyObject *);
 static PyObject		*python_kore_proc(PyObject *, PyObject *);
 static PyObject		*python_kore_fatal(PyObject *, PyObject *);
@@ -50,7 +87,12 @@ static PyObject		*python_kore_sigtrap(PyObject *, PyObject *);
 static PyObject		*python_kore_setname(PyObject *, PyObject *);
 static PyObject		*python_kore_suspend(PyObject *, PyObject *);
 static PyObject		*python_kore_shutdown(PyObject *, PyObject *);
+static PyObject		*python_kore_auth_cache_purge(PyObject *, PyObject *);
+static PyObject		*python_kore_ratelimit(PyObject *, PyObject *);
+static PyObject		*python_kore_ratelimit_add(PyObject *,
+			    PyObject *);
 static PyObject		*python_kore_coroname(PyObject *, PyObject *);
+static PyObject		*python_kore_corodump(PyObject *, PyObject *);
 static PyObject		*python_kore_corotrace(PyObject *, PyObject *);
 static PyObject		*python_kore_task_kill(PyObject *, PyObject *);
 static PyObject		*python_kore_prerequest(PyObject *, PyObject *);
@@ -72,6 +114,7 @@ static PyObject		*python_kore_privsep(PyObject *, PyObject *,
 static PyObject		*python_kore_pgsql_query(PyObject *, PyObject *,
 			    PyObject *);
 static PyObject		*python_kore_pgsql_register(PyObject *, PyObject *);
+static PyObject		*python_kore_pgsql_prepare(PyObject *, PyObject *);
 #endif
 
 #if defined(KORE_USE_CURL)
@@ -81,6 +124,8 @@ static PyObject		*python_kore_httpclient(PyObject *,
 #endif
 
 static PyObject		*python_websocket_broadcast(PyObject *, PyObject *);
+static PyObject		*python_websocket_publish(PyObject *, PyObject *);
+static PyObject		*python_sse_publish(PyObject *, PyObject *, PyObject *);
 
 #define METHOD(n, c, a)		{ n, (PyCFunction)c, a, NULL }
 #define GETTER(n, g)		{ n, (getter)g, NULL, NULL, NULL }
@@ -91,6 +136,9 @@ static struct PyMethodDef pykore_methods[] = {
 	METHOD("app", python_kore_app, METH_VARARGS),
 	METHOD("log", python_kore_log, METH_VARARGS),
 	METHOD("time", python_kore_time, METH_NOARGS),
+	METHOD("httpdate", python_kore_httpdate, METH_NOARGS),
+	METHOD("pool_stats", python_kore_pool_stats, METH_NOARGS),
+	METHOD("corostats", python_kore_corostats, METH_NOARGS),
 	METHOD("lock", python_kore_lock, METH_NOARGS),
 	METHOD("proc", python_kore_proc, METH_VARARGS),
 	METHOD("queue", python_kore_queue, METH_VARARGS),
@@ -103,8 +151,12 @@ static struct PyMethodDef pykore_methods[] = {
 	METHOD("setname", python_kore_setname, METH_VARARGS),
 	METHOD("suspend", python_kore_suspend, METH_VARARGS),
 	METHOD("shutdown", python_kore_shutdown, METH_NOARGS),
+	METHOD("auth_cache_purge", python_kore_auth_cache_purge, METH_VARARGS),
+	METHOD("ratelimit", python_kore_ratelimit, METH_VARARGS),
+	METHOD("ratelimit_add", python_kore_ratelimit_add, METH_VARARGS),
 	METHOD("coroname", python_kore_coroname, METH_VARARGS),
 	METHOD("corotrace", python_kore_corotrace, METH_VARARGS),
+	METHOD("corodump", python_kore_corodump, METH_NOARGS),
 	METHOD("task_kill", python_kore_task_kill, METH_VARARGS),
 	METHOD("prerequest", python_kore_prerequest, METH_VARARGS),
 	METHOD("task_create", python_kore_task_create, METH_VARARGS),
@@ -117,8 +169,11 @@ static struct PyMethodDef pykore_methods[] = {
 	METHOD("privsep", python_kore_privsep, METH_VARARGS | METH_KEYWORDS),
 	METHOD("sendobj", python_kore_sendobj, METH_VARARGS | METH_KEYWORDS),
 	METHOD("websocket_broadcast", python_websocket_broadcast, METH_VARARGS),
+	METHOD("websocket_publish", python_websocket_publish, METH_VARARGS),
+	METHOD("sse_publish", python_sse_publish, METH_VARARGS | METH_KEYWORDS),
 #if defined(KORE_USE_PGSQL)
 	METHOD("dbsetup", python_kore_pgsql_register, METH_VARARGS),
+	METHOD("dbprepare", python_kore_pgsql_prepare, METH_VARARGS),
 	METHOD("dbquery", python_kore_pgsql_query,
 	    METH_VARARGS | METH_KEYWORDS),
 #endif
@@ -687,10 +742,26 @@ struct pyconnection {
 
 static PyObject *pyconnection_disconnect(struct pyconnection *, PyObject *);
 static PyObject *pyconnection_websocket_send(struct pyconnection *, PyObject *);
+static PyObject *pyconnection_websocket_subscribe(struct pyconnection *,
+    PyObject *);
+static PyObject *pyconnection_websocket_unsubscribe(struct pyconnection *,
+    PyObject *);
+static PyObject *pyconnection_sse_send(struct pyconnection *, PyObject *,
+    PyObject *);
+static PyObject *pyconnection_sse_subscribe(struct pyconnection *, PyObject *);
+static PyObject *pyconnection_sse_unsubscribe(struct pyconnection *,
+    PyObject *);
 
 static PyMethodDef pyconnection_methods[] = {
 	METHOD("disconnect", pyconnection_disconnect, METH_NOARGS),
 	METHOD("websocket_send", pyconnection_websocket_send, METH_VARARGS),
+	METHOD("websocket_subscribe",
+	    pyconnection_websocket_subscribe, METH_VARARGS),
+	METHOD("websocket_unsubscribe",
+	    pyconnection_websocket_unsubscribe, METH_VARARGS),
+	METHOD("sse_send", pyconnection_sse_send, METH_VARARGS | METH_KEYWORDS),
+	METHOD("sse_subscribe", pyconnection_sse_subscribe, METH_VARARGS),
+	METHOD("sse_unsubscribe", pyconnection_sse_unsubscribe, METH_VARARGS),
 	METHOD(NULL, NULL, -1),
 };
 
@@ -730,6 +801,23 @@ struct pyhttp_request {
 	struct http_request	*req;
 	PyObject		*dict;
 	PyObject		*data;
+	PyObject		*body;
+	PyObject		*args;
+	PyObject		*headers;
+};
+
+/*
+ * Read-only buffer exporter over a request body. The body is either
+ * borrowed from req->http_body or mapped from the offloaded body file.
+ * A borrowed kore_buf is handed over to this object when the request
+ * is freed while Python still holds a reference to it.
+ */
+struct pyhttp_body {
+	PyObject_HEAD
+	struct kore_buf		*buf;
+	int			owned;
+	void			*map;
+	size_t			length;
 };
 
 struct pyhttp_iterobj {
@@ -745,12 +833,14 @@ struct pyhttp_file {
 };
 
 static void	pyhttp_dealloc(struct pyhttp_request *);
+static void	pyhttp_body_dealloc(struct pyhttp_body *);
 static void	pyhttp_file_dealloc(struct pyhttp_file *);
 
 static PyObject *pyhttp_cookie(struct pyhttp_request *, PyObject *);
 static PyObject	*pyhttp_response(struct pyhttp_request *, PyObject *);
 static PyObject *pyhttp_argument(struct pyhttp_request *, PyObject *);
 static PyObject	*pyhttp_body_read(struct pyhttp_request *, PyObject *);
+static PyObject	*pyhttp_body_persist(struct pyhttp_request *, PyObject *);
 static PyObject	*pyhttp_file_lookup(struct pyhttp_request *, PyObject *);
 static PyObject	*pyhttp_populate_get(struct pyhttp_request *, PyObject *);
 static PyObject	*pyhttp_populate_post(struct pyhttp_request *, PyObject *);
@@ -760,12 +850,14 @@ static PyObject	*pyhttp_request_header(struct pyhttp_request *, PyObject *);
 static PyObject	*pyhttp_response_header(struct pyhttp_request *, PyObject *);
 static PyObject *pyhttp_websocket_handshake(struct pyhttp_request *,
 		    PyObject *);
+static PyObject *pyhttp_sse_handshake(struct pyhttp_request *, PyObject *);
 
 static PyMethodDef pyhttp_request_methods[] = {
 	METHOD("cookie", pyhttp_cookie, METH_VARARGS),
 	METHOD("response", pyhttp_response, METH_VARARGS),
 	METHOD("argument", pyhttp_argument, METH_VARARGS),
 	METHOD("body_read", pyhttp_body_read, METH_VARARGS),
+	METHOD("body_persist", pyhttp_body_persist, METH_VARARGS),
 	METHOD("file_lookup", pyhttp_file_lookup, METH_VARARGS),
 	METHOD("populate_get", pyhttp_populate_get, METH_NOARGS),
 	METHOD("populate_post", pyhttp_populate_post, METH_NOARGS),
@@ -774,12 +866,14 @@ static PyMethodDef pyhttp_request_methods[] = {
 	METHOD("request_header", pyhttp_request_header, METH_VARARGS),
 	METHOD("response_header", pyhttp_response_header, METH_VARARGS),
 	METHOD("websocket_handshake", pyhttp_websocket_handshake, METH_VARARGS),
+	METHOD("sse_handshake", pyhttp_sse_handshake, METH_VARARGS),
 	METHOD(NULL, NULL, -1)
 };
 
 static PyObject	*pyhttp_get_host(struct pyhttp_request *, void *);
 static PyObject	*pyhttp_get_path(struct pyhttp_request *, void *);
 static PyObject	*pyhttp_get_body(struct pyhttp_request *, void *);
+static PyObject	*pyhttp_get_body_view(struct pyhttp_request *, void *);
 static PyObject	*pyhttp_get_agent(struct pyhttp_request *, void *);
 static PyObject	*pyhttp_get_method(struct pyhttp_request *, void *);
 static PyObject	*pyhttp_get_protocol(struct pyhttp_request *, void *);
@@ -791,6 +885,7 @@ static PyGetSetDef pyhttp_request_getset[] = {
 	GETTER("host", pyhttp_get_host),
 	GETTER("path", pyhttp_get_path),
 	GETTER("body", pyhttp_get_body),
+	GETTER("body_view", pyhttp_get_body_view),
 	GETTER("agent", pyhttp_get_agent),
 	GETTER("method", pyhttp_get_method),
 	GETTER("protocol", pyhttp_get_protocol),
@@ -814,6 +909,22 @@ static PyTypeObject pyhttp_request_type = {
 	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
 };
 
+static int	pyhttp_body_getbuffer(struct pyhttp_body *, Py_buffer *, int);
+
+static PyBufferProcs pyhttp_body_buffer = {
+	.bf_getbuffer = (getbufferproc)pyhttp_body_getbuffer,
+};
+
+static PyTypeObject pyhttp_body_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "kore.http_body",
+	.tp_doc = "read-only http request body",
+	.tp_as_buffer = &pyhttp_body_buffer,
+	.tp_dealloc = (destructor)pyhttp_body_dealloc,
+	.tp_basicsize = sizeof(struct pyhttp_body),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
 static PyObject	*pyhttp_file_read(struct pyhttp_file *, PyObject *);
 
 static PyMethodDef pyhttp_file_methods[] = {
@@ -846,6 +957,9 @@ static PyTypeObject pyhttp_file_type = {
 #define CURL_CLIENT_OP_RUN	1
 #define CURL_CLIENT_OP_RESULT	2
 
+/* How much streamed body may sit unread before the transfer pauses. */
+#define CURL_CLIENT_STREAM_MAX	(64 * 1024)
+
 struct pycurl_slist {
 	struct curl_slist		*slist;
 	LIST_ENTRY(pycurl_slist)	list;
@@ -935,7 +1049,9 @@ struct pyhttp_client {
 struct pyhttp_client_op {
 	PyObject_HEAD
 	int			state;
+	int			stream;
 	int			headers;
+	struct kore_buf		*chunk;
 	struct python_coro	*coro;
 	struct pyhttp_client	*client;
 	struct pycurl_data	data;
@@ -943,7 +1059,15 @@ struct pyhttp_client_op {
 
 
 static PyObject	*pyhttp_client_op_await(PyObject *);
+static PyObject	*pyhttp_client_op_aiter(struct pyhttp_client_op *);
+static PyObject	*pyhttp_client_op_anext(struct pyhttp_client_op *);
 static PyObject	*pyhttp_client_op_iternext(struct pyhttp_client_op *);
+static PyObject	*pyhttp_client_op_stream_next(struct pyhttp_client_op *);
+static PyObject	*pyhttp_client_op_headers(struct pyhttp_client_op *);
+
+static PyObject	*pyhttp_client_op_get_status(struct pyhttp_client_op *, void *);
+static PyObject	*pyhttp_client_op_get_headers(struct pyhttp_client_op *,
+		    void *);
 
 static void	pyhttp_client_dealloc(struct pyhttp_client *);
 static void	pyhttp_client_op_dealloc(struct pyhttp_client_op *);
@@ -986,8 +1110,14 @@ static PyTypeObject pyhttp_client_type = {
 
 static PyAsyncMethods pyhttp_client_op_async = {
 	(unaryfunc)pyhttp_client_op_await,
-	NULL,
-	NULL
+	(unaryfunc)pyhttp_client_op_aiter,
+	(unaryfunc)pyhttp_client_op_anext
+};
+
+static PyGetSetDef pyhttp_client_op_getset[] = {
+	GETTER("status", pyhttp_client_op_get_status),
+	GETTER("headers", pyhttp_client_op_get_headers),
+	GETTER(NULL, NULL)
 };
 
 static PyTypeObject pyhttp_client_op_type = {
@@ -996,6 +1126,7 @@ static PyTypeObject pyhttp_client_op_type = {
 	.tp_doc = "Asynchronous HTTP client operation",
 	.tp_as_async = &pyhttp_client_op_async,
 	.tp_iternext = (iternextfunc)pyhttp_client_op_iternext,
+	.tp_getset = pyhttp_client_op_getset,
 	.tp_basicsize = sizeof(struct pyhttp_client_op),
 	.tp_dealloc = (destructor)pyhttp_client_op_dealloc,
 	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
@@ -1013,13 +1144,21 @@ struct pykore_pgsql {
 	PyObject_HEAD
 	struct kore_pgsql	sql;
 	int			state;
+	int			lazy;
+	int			stream;
 	int			binary;
+	int			prepared;
+	u_int32_t		cache;
 
 	char			*db;
 	struct python_coro	*coro;
 	char			*query;
 	PyObject		*result;
 
+	/* The single row result being handed out by async for. */
+	PyObject		*cursor;
+	int			cursor_row;
+
 	struct {
 		int		count;
 		const char	**values;
@@ -1032,12 +1171,13 @@ struct pykore_pgsql {
 static void	pykore_pgsql_dealloc(struct pykore_pgsql *);
 
 static PyObject	*pykore_pgsql_await(PyObject *);
+static PyObject	*pykore_pgsql_aiter(struct pykore_pgsql *);
 static PyObject	*pykore_pgsql_iternext(struct pykore_pgsql *);
 
 static PyAsyncMethods pykore_pgsql_async = {
 	(unaryfunc)pykore_pgsql_await,
-	NULL,
-	NULL
+	(unaryfunc)pykore_pgsql_aiter,
+	(unaryfunc)pykore_pgsql_await,
 };
 
 static PyTypeObject pykore_pgsql_type = {
@@ -1050,4 +1190,87 @@ static PyTypeObject pykore_pgsql_type = {
 	.tp_dealloc = (destructor)pykore_pgsql_dealloc,
 	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
 };
+
+/*
+ * A query result that keeps the PGresult and only creates Python objects
+ * for the rows, columns or values that are asked for.
+ */
+struct pykore_pgsql_result {
+	PyObject_HEAD
+	PGresult		*result;
+	int			rows;
+	int			fields;
+	PyObject		*names;
+};
+
+/* Read-only buffer over a single value inside a pykore_pgsql_result. */
+struct pykore_pgsql_value {
+	PyObject_HEAD
+	PyObject		*owner;
+	char			*data;
+	Py_ssize_t		length;
+};
+
+static void	pykore_pgsql_result_dealloc(struct pykore_pgsql_result *);
+
+static Py_ssize_t	pykore_pgsql_result_length(
+			    struct pykore_pgsql_result *);
+static PyObject		*pykore_pgsql_result_item(
+			    struct pykore_pgsql_result *, Py_ssize_t);
+
+static PyObject	*pykore_pgsql_result_value(struct pykore_pgsql_result *,
+		    PyObject *);
+static PyObject	*pykore_pgsql_result_column(struct pykore_pgsql_result *,
+		    PyObject *);
+static PyObject	*pykore_pgsql_result_buffer(struct pykore_pgsql_result *,
+		    PyObject *);
+static PyObject	*pykore_pgsql_result_get_fields(
+		    struct pykore_pgsql_result *, void *);
+
+static PyMethodDef pykore_pgsql_result_methods[] = {
+	METHOD("value", pykore_pgsql_result_value, METH_VARARGS),
+	METHOD("column", pykore_pgsql_result_column, METH_VARARGS),
+	METHOD("buffer", pykore_pgsql_result_buffer, METH_VARARGS),
+	METHOD(NULL, NULL, -1)
+};
+
+static PyGetSetDef pykore_pgsql_result_getset[] = {
+	GETTER("fields", pykore_pgsql_result_get_fields),
+	GETTER(NULL, NULL)
+};
+
+static PySequenceMethods pykore_pgsql_result_sequence = {
+	.sq_length = (lenfunc)pykore_pgsql_result_length,
+	.sq_item = (ssizeargfunc)pykore_pgsql_result_item,
+};
+
+static PyTypeObject pykore_pgsql_result_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "kore.pgsql_result",
+	.tp_doc = "lazily converted pgsql result",
+	.tp_getset = pykore_pgsql_result_getset,
+	.tp_methods = pykore_pgsql_result_methods,
+	.tp_as_sequence = &pykore_pgsql_result_sequence,
+	.tp_basicsize = sizeof(struct pykore_pgsql_result),
+	.tp_dealloc = (destructor)pykore_pgsql_result_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+static void	pykore_pgsql_value_dealloc(struct pykore_pgsql_value *);
+static int	pykore_pgsql_value_getbuffer(struct pykore_pgsql_value *,
+		    Py_buffer *, int);
+
+static PyBufferProcs pykore_pgsql_value_buffer = {
+	.bf_getbuffer = (getbufferproc)pykore_pgsql_value_getbuffer,
+};
+
+static PyTypeObject pykore_pgsql_value_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "kore.pgsql_value",
+	.tp_doc = "read-only pgsql result value",
+	.tp_as_buffer = &pykore_pgsql_value_buffer,
+	.tp_basicsize = sizeof(struct pykore_pgsql_value),
+	.tp_dealloc = (destructor)pykore_pgsql_value_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+};
 #endif
@@ -26,6 +26,21 @@
 
 #define KORE_TASK_THREADS		2
 
+#define KORE_TASK_PRIO_HIGH		0
+#define KORE_TASK_PRIO_NORMAL		1
+#define KORE_TASK_PRIO_LOW		2
+#define KORE_TASK_PRIO_MAX		3
+
+#define KORE_TASK_AFFINITY_INHERIT	0
+#define KORE_TASK_AFFINITY_NONE		1
+#define KORE_TASK_AFFINITY_SPREAD	2
+
+/* Slots per channel direction, must be a power of 2. */
+#define KORE_TASK_RING_SLOTS		32
+
+/* Messages larger than this are handed over by pointer. */
+#define KORE_TASK_MSG_INLINE		112
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -34,10 +49,28 @@ extern "C" {
 struct http_request;
 #endif
 
+struct kore_task_msg {
+	u_int32_t		len;
+	void			*ptr;
+	u_int8_t		data[KORE_TASK_MSG_INLINE];
+};
+
+struct kore_task_ring {
+	volatile u_int32_t	head;
+	volatile u_int32_t	tail;
+	volatile int		parked;
+	volatile int		waiting;
+	volatile int		closed;
+	struct kore_task_msg	msgs[KORE_TASK_RING_SLOTS];
+};
+
+struct kore_task_pending;
+
 struct kore_task {
 	struct kore_event	evt;
 	int			state;
 	int			result;
+	u_int8_t		prio;
 	pthread_rwlock_t	lock;
 
 #if !defined(KORE_NO_HTTP)
@@ -45,23 +78,25 @@ struct kore_task {
 #endif
 
 	int			fds[2];
+	struct kore_task_ring	*rings[2];
 	int			(*entry)(struct kore_task *);
 	void			(*cb)(struct kore_task *);
 
 	struct kore_task_thread		*thread;
 
+	TAILQ_HEAD(, kore_task_pending)	backlog;
 	TAILQ_ENTRY(kore_task)		list;
 	LIST_ENTRY(kore_task)		rlist;
 };
 
+TAILQ_HEAD(kore_task_queue, kore_task);
+
 struct kore_task_thread {
 	u_int8_t		idx;
 	pthread_t		tid;
 	pthread_mutex_t		lock;
-	pthread_cond_t		cond;
-	TAILQ_HEAD(, kore_task)	tasks;
-
-	TAILQ_ENTRY(kore_task_thread)	list;
+	u_int32_t		queued;
+	struct kore_task_queue	tasks[KORE_TASK_PRIO_MAX];
 };
 
 void		kore_task_init(void);
@@ -70,6 +105,7 @@ void		kore_task_run(struct kore_task *);
 void		kore_task_finish(struct kore_task *);
 void		kore_task_destroy(struct kore_task *);
 int		kore_task_finished(struct kore_task *);
+int		kore_task_thread(void);
 
 #if !defined(KORE_NO_HTTP)
 void		kore_task_bind_request(struct kore_task *,
@@ -79,9 +115,12 @@ void		kore_task_bind_callback(struct kore_task *,
 		    void (*cb)(struct kore_task *));
 void		kore_task_create(struct kore_task *,
 		    int (*entry)(struct kore_task *));
+void		kore_task_set_priority(struct kore_task *, u_int8_t);
 
 u_int32_t	kore_task_channel_read(struct kore_task *, void *, u_int32_t);
 void		kore_task_channel_write(struct kore_task *, void *, u_int32_t);
+void		*kore_task_channel_take(struct kore_task *, u_int32_t *);
+void		kore_task_channel_give(struct kore_task *, void *, u_int32_t);
 
 void		kore_task_set_state(struct kore_task *, int);
 void		kore_task_set_result(struct kore_task *, int);
@@ -90,6 +129,7 @@ int		kore_task_state(struct kore_task *);
 int		kore_task_result(struct kore_task *);
 
 extern u_int16_t	kore_task_threads;
+extern u_int8_t		kore_task_affinity;
 
 #if defined(__cplusplus)
 }
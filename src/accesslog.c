@@ -16,325 +16,1017 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
-#include <time.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <netdb.h>
+#include <paths.h>
+#include <poll.h>
 #include <signal.h>
 
 #include "kore.h"
 #include "http.h"
 
 /*
- * The worker will write accesslogs to its worker data structure which is
- * held in shared memory.
+ * The worker will write accesslogs to a ring in its worker data structure
+ * which is held in shared memory. The worker is the only one moving the
+ * head of this ring and the accesslog writer the only one moving its tail,
+ * so neither side ever waits on the other.
  *
  * Each accesslog is prefixed with the internal domain ID (2 bytes) and
  * the length of the log entry (2 bytes) (packed in kore_alog_header).
+ * If the ring has no room for an entry it is dropped and counted in
+ * the worker its metrics, the writer will log how many were lost.
  *
- * The parent will every 10ms fetch the produced accesslogs from the workers
- * and copy them to its own log buffer. Once this log buffer becomes full
- * or 1 second has passed the parent will parse the logs and append them
- * to the correct domain logbuffer which is eventually flushed to disk.
+ * The accesslog writer is a separate process forked from the parent so
+ * that slow disks never hold up the parent reaping workers or relaying
+ * messages. Every 10ms it walks the rings of all workers and writes the
+ * entries out with a single writev() per domain, pointing straight into
+ * the rings. It reopens the logs on SIGUSR1 and drains everything before
+ * exiting once the parent closes its pipe.
+ *
+ * Domains shipping their logs to a remote target get batches of entries
+ * packed into datagrams of at most ACCESSLOG_DGRAM_MAX bytes instead,
+ * syslog receives a single entry per datagram.
  */
 
-#define LOGBUF_SIZE			(KORE_ACCESSLOG_BUFLEN * worker_count)
-#define DOMAIN_LOGBUF_LEN		(1024 * 1024)
-#define LOG_ENTRY_MINSIZE_GUESS		90
+#define RING_MASK			(KORE_ACCESSLOG_BUFLEN - 1)
+#define ACCESSLOG_INTERVAL		10
+#define ACCESSLOG_IOV_MAX		256
+#define ACCESSLOG_DGRAM_MAX		8192
+
+struct accesslog_target {
+	struct kore_domain	*dom;
+	int			fd;
+	int			ship;
+	int			dirty;
+	int			iovcnt;
+	size_t			dglen;
+	u_int64_t		synced;
+	struct iovec		iov[ACCESSLOG_IOV_MAX];
+};
+
+static void	accesslog_spawn(void);
+static void	accesslog_writer(int);
+static void	accesslog_targets(void);
+static void	accesslog_drain(u_int64_t);
+static void	accesslog_reopen(void);
+static void	accesslog_sync(u_int64_t, int);
+static void	accesslog_add(struct accesslog_target *,
+		    struct kore_worker *, u_int64_t, size_t);
+static void	accesslog_flush(struct accesslog_target *, u_int64_t);
+static void	accesslog_ring_put(struct kore_worker *, u_int64_t,
+		    const void *, size_t);
+static void	accesslog_ring_get(struct kore_worker *, u_int64_t,
+		    void *, size_t);
 
-static void	accesslog_lock(struct kore_worker *);
-static void	accesslog_unlock(struct kore_worker *);
-static void	accesslog_flush_cb(struct kore_domain *);
-static void	accesslog_flush(struct kore_domain *, u_int64_t, int);
+static int	accesslog_clf(struct http_request *, const char *);
+static int	accesslog_json(struct http_request *, u_int32_t,
+		    const char *);
+static int	accesslog_binary(struct http_request *, u_int32_t,
+		    const char *);
+static void	accesslog_append(const void *, size_t);
+static void	accesslog_json_num(const char *, u_int64_t);
+static void	accesslog_json_str(const char *, const char *);
+static const char	*accesslog_method(struct http_request *);
+static const char	*accesslog_version(struct http_request *);
+static const char	*accesslog_addr(struct http_request *, char *, size_t);
+static u_int64_t	accesslog_duration(struct http_request *);
 
-static u_int64_t	time_cache = 0;
-static char		tbuf[128] = { '\0' };
+static struct {
+	const char	*name;
+	u_int32_t	flag;
+} accesslog_fields[] = {
+	{ "addr",	KORE_ALOG_FIELD_ADDR },
+	{ "cn",		KORE_ALOG_FIELD_CN },
+	{ "time",	KORE_ALOG_FIELD_TIME },
+	{ "method",	KORE_ALOG_FIELD_METHOD },
+	{ "path",	KORE_ALOG_FIELD_PATH },
+	{ "version",	KORE_ALOG_FIELD_VERSION },
+	{ "status",	KORE_ALOG_FIELD_STATUS },
+	{ "bytes",	KORE_ALOG_FIELD_BYTES },
+	{ "body",	KORE_ALOG_FIELD_BODY },
+	{ "referer",	KORE_ALOG_FIELD_REFERER },
+	{ "agent",	KORE_ALOG_FIELD_AGENT },
+	{ "host",	KORE_ALOG_FIELD_HOST },
+	{ "duration",	KORE_ALOG_FIELD_DURATION },
+	{ "route",	KORE_ALOG_FIELD_ROUTE },
+	{ NULL,		0 },
+};
 
-static struct kore_buf	*logbuf = NULL;
+u_int32_t	kore_accesslog_fsync = 0;
+
+static char			logline[KORE_ACCESSLOG_LINE_MAX];
+static char			logprefix[32];
+static size_t			loglen = 0;
+static int			logfull = 0;
+static pid_t			logger_pid = -1;
+static int			logger_pipe = -1;
+static struct accesslog_target	*targets = NULL;
+static u_int16_t		targets_len = 0;
 
 void
 kore_accesslog_worker_init(void)
 {
 	kore_domain_closelogs();
+
+	/* Restarted workers inherit the pipe towards the writer. */
+	if (logger_pipe != -1) {
+		(void)close(logger_pipe);
+		logger_pipe = -1;
+	}
 }
 
 void
 kore_accesslog(struct http_request *req)
 {
-	struct timespec		ts;
-	struct tm		*tm;
-	u_int64_t		now;
-	struct kore_alog_header	*hdr;
-	size_t			avail;
-	time_t			curtime;
-	int			len, attempts;
-	char			addr[INET6_ADDRSTRLEN], *cn_value;
-	const char		*ptr, *method, *http_version, *cn, *referer;
-
-	switch (req->method) {
-	case HTTP_METHOD_GET:
-		method = "GET";
-		break;
-	case HTTP_METHOD_POST:
-		method = "POST";
-		break;
-	case HTTP_METHOD_PUT:
-		method = "PUT";
-		break;
-	case HTTP_METHOD_DELETE:
-		method = "DELETE";
-		break;
-	case HTTP_METHOD_HEAD:
-		method = "HEAD";
+	struct kore_alog_header	hdr;
+	struct kore_domain	*dom;
+	u_int64_t		head, tail;
+	int			len;
+	char			*cn;
+
+	dom = req->rt->dom;
+	cn = NULL;
+
+	if (req->owner->tls_cert != NULL &&
+	    (dom->accesslog_format == KORE_ALOG_FORMAT_CLF ||
+	    (dom->accesslog_fields & KORE_ALOG_FIELD_CN))) {
+		if (!kore_x509_subject_name(req->owner, &cn,
+		    KORE_X509_COMMON_NAME_ONLY))
+			cn = NULL;
+	}
+
+	switch (dom->accesslog_format) {
+	case KORE_ALOG_FORMAT_JSON:
+		len = accesslog_json(req, dom->accesslog_fields, cn);
 		break;
-	case HTTP_METHOD_PATCH:
-		method = "PATCH";
+	case KORE_ALOG_FORMAT_BINARY:
+		len = accesslog_binary(req, dom->accesslog_fields, cn);
 		break;
 	default:
-		method = "UNKNOWN";
+		len = accesslog_clf(req, cn);
 		break;
 	}
 
-	if (req->flags & HTTP_VERSION_1_0)
-		http_version = "HTTP/1.0";
-	else
-		http_version = "HTTP/1.1";
-
-	if (req->referer != NULL)
-		referer = req->referer;
-	else
-		referer = "-";
+	kore_free(cn);
 
-	if (req->agent == NULL)
-		req->agent = "-";
+	if (len == -1) {
+		kore_log(LOG_WARNING, "log entry length exceeds limit");
+		worker->metrics.accesslog_dropped++;
+		return;
+	}
 
-	cn = "-";
-	cn_value = NULL;
+	head = worker->lb.head;
+	tail = __atomic_load_n(&worker->lb.tail, __ATOMIC_ACQUIRE);
 
-	if (req->owner->tls_cert != NULL) {
-		if (kore_x509_subject_name(req->owner, &cn_value,
-		    KORE_X509_COMMON_NAME_ONLY))
-			cn = cn_value;
+	if (KORE_ACCESSLOG_BUFLEN - (head - tail) < sizeof(hdr) + len) {
+		worker->metrics.accesslog_dropped++;
+		return;
 	}
 
-	switch (req->owner->family) {
-	case AF_INET:
-		ptr = inet_ntop(req->owner->family,
-		    &(req->owner->addr.ipv4.sin_addr), addr, sizeof(addr));
-		break;
-	case AF_INET6:
-		ptr = inet_ntop(req->owner->family,
-		    &(req->owner->addr.ipv6.sin6_addr), addr, sizeof(addr));
-		break;
-	case AF_UNIX:
-		ptr = NULL;
-		break;
-	default:
-		fatal("unknown family %d", req->owner->family);
-	}
+	hdr.loglen = len;
+	hdr.domain = dom->id;
 
-	if (ptr == NULL) {
-		addr[0] = '-';
-		addr[1] = '\0';
-	}
+	accesslog_ring_put(worker, head, &hdr, sizeof(hdr));
+	accesslog_ring_put(worker, head + sizeof(hdr), logline, len);
 
-	now = kore_time_ms();
-	if ((now - time_cache) >= 1000) {
-		time(&curtime);
-		tm = localtime(&curtime);
-		(void)strftime(tbuf, sizeof(tbuf), "%d/%b/%Y:%H:%M:%S %z", tm);
-		time_cache = now;
+	/* Publish the entry only once it has been written in full. */
+	__atomic_store_n(&worker->lb.head,
+	    head + sizeof(hdr) + len, __ATOMIC_RELEASE);
+}
+
+u_int32_t
+kore_accesslog_field(const char *name)
+{
+	int		i;
+
+	for (i = 0; accesslog_fields[i].name != NULL; i++) {
+		if (!strcmp(accesslog_fields[i].name, name))
+			return (accesslog_fields[i].flag);
 	}
 
-	attempts = 0;
-	ts.tv_sec = 0;
-	ts.tv_nsec = 1000000;
+	return (0);
+}
 
-	for (;;) {
-		if (attempts++ > 1000) {
-			if (getppid() == 1) {
-				if (kill(worker->pid, SIGQUIT) == -1)
-					fatal("failed to shutdown");
-				return;
-			}
+/*
+ * Open a datagram socket towards a udp://host:port, unix:///path or
+ * the local syslog target. The accesslog writer ships the entries of
+ * the domain over it instead of writing them to disk.
+ */
+int
+kore_accesslog_ship(struct kore_domain *dom, const char *target)
+{
+	struct sockaddr_un	sun;
+	struct addrinfo		hints, *res;
+	size_t			len;
+	int			fd, r;
+	const char		*path, *p, *port;
+	char			host[256];
 
-			attempts = 0;
+	fd = -1;
+	res = NULL;
+
+	if (!strcmp(target, "syslog") || !strncmp(target, "unix://", 7)) {
+		if (dom->accesslog_format == KORE_ALOG_FORMAT_BINARY &&
+		    target[0] == 's') {
+			kore_log(LOG_ERR,
+			    "binary accesslogs cannot go to syslog");
+			return (KORE_RESULT_ERROR);
 		}
 
-		accesslog_lock(worker);
+		path = target[0] == 's' ? _PATH_LOG : target + 7;
 
-		avail = KORE_ACCESSLOG_BUFLEN - worker->lb.offset;
-		if (avail < sizeof(*hdr) + LOG_ENTRY_MINSIZE_GUESS) {
-			accesslog_unlock(worker);
-			nanosleep(&ts, NULL);
-			continue;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		len = kore_strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+		if (len >= sizeof(sun.sun_path)) {
+			kore_log(LOG_ERR, "accesslog path '%s' too long", path);
+			return (KORE_RESULT_ERROR);
 		}
 
-		hdr = (struct kore_alog_header *)
-		    (worker->lb.buf + worker->lb.offset);
-		worker->lb.offset += sizeof(*hdr);
-
-		len = snprintf(worker->lb.buf + worker->lb.offset, avail,
-		    "%s - %s [%s] \"%s %s %s\" %d %" PRIu64" \"%s\" \"%s\"\n",
-		    addr, cn, tbuf, method, req->path, http_version,
-		    req->status, req->content_length, referer, req->agent);
-		if (len == -1)
-			fatal("failed to create log entry");
-
-		if ((size_t)len >= avail) {
-			worker->lb.offset -= sizeof(*hdr);
-			accesslog_unlock(worker);
-			nanosleep(&ts, NULL);
-			continue;
+		if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1 ||
+		    connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+			kore_log(LOG_ERR, "accesslog %s: %s", path, errno_s);
+			goto cleanup;
 		}
 
-		if ((size_t)len > USHRT_MAX) {
-			kore_log(LOG_WARNING,
-			    "log entry length exceeds limit (%d)", len);
-			worker->lb.offset -= sizeof(*hdr);
-			break;
+		dom->accesslog_ship = target[0] == 's' ?
+		    KORE_ALOG_SHIP_SYSLOG : KORE_ALOG_SHIP_DGRAM;
+	} else {
+		p = target + 6;
+		if (*p == '[') {
+			if ((port = strchr(p, ']')) == NULL || port[1] != ':')
+				goto invalid;
+			len = port - p - 1;
+			p++;
+			port += 2;
+		} else {
+			if ((port = strrchr(p, ':')) == NULL)
+				goto invalid;
+			len = port - p;
+			port++;
 		}
 
-		hdr->loglen = len;
-		hdr->domain = req->rt->dom->id;
+		if (len == 0 || len >= sizeof(host) || *port == '\0')
+			goto invalid;
 
-		worker->lb.offset += (size_t)len;
-		break;
+		memcpy(host, p, len);
+		host[len] = '\0';
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+
+		if ((r = getaddrinfo(host, port, &hints, &res)) != 0) {
+			kore_log(LOG_ERR, "accesslog %s: %s",
+			    target, gai_strerror(r));
+			return (KORE_RESULT_ERROR);
+		}
+
+		if ((fd = socket(res->ai_family, SOCK_DGRAM, 0)) == -1 ||
+		    connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+			kore_log(LOG_ERR, "accesslog %s: %s", target, errno_s);
+			goto cleanup;
+		}
+
+		freeaddrinfo(res);
+		dom->accesslog_ship = KORE_ALOG_SHIP_DGRAM;
 	}
 
-	kore_free(cn_value);
-	accesslog_unlock(worker);
+	if (!kore_connection_nonblock(fd, 0)) {
+		kore_log(LOG_ERR, "accesslog %s: %s", target, errno_s);
+		goto cleanup;
+	}
+
+	dom->accesslog = fd;
+
+	return (KORE_RESULT_OK);
+
+invalid:
+	kore_log(LOG_ERR, "invalid accesslog target '%s'", target);
+
+cleanup:
+	if (fd != -1)
+		(void)close(fd);
+	if (res != NULL)
+		freeaddrinfo(res);
+
+	return (KORE_RESULT_ERROR);
 }
 
 void
-kore_accesslog_gather(void *arg, u_int64_t now, int force)
+kore_accesslog_start(void)
 {
-	int				id;
-	struct kore_worker		*kw;
-	struct kore_alog_header		*hdr;
-	struct kore_domain		*dom;
-	size_t				off, remain;
+	struct kore_server	*srv;
+	struct kore_domain	*dom;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		TAILQ_FOREACH(dom, &srv->domains, list) {
+			if (dom->accesslog != -1) {
+				accesslog_spawn();
+				return;
+			}
+		}
+	}
+}
+
+void
+kore_accesslog_stop(void)
+{
+	int		status;
 
-	if (logbuf == NULL)
-		logbuf = kore_buf_alloc(LOGBUF_SIZE);
+	if (logger_pid == -1)
+		return;
+
+	/* The writer drains all rings once it sees the pipe close. */
+	(void)close(logger_pipe);
+	logger_pipe = -1;
+
+	while (waitpid(logger_pid, &status, 0) == -1) {
+		if (errno != EINTR)
+			break;
+	}
 
-	for (id = KORE_WORKER_BASE; id < worker_count; id++) {
-		kw = kore_worker_data(id);
+	logger_pid = -1;
+}
+
+void
+kore_accesslog_rotate(void)
+{
+	if (logger_pid == -1)
+		return;
+
+	if (kill(logger_pid, SIGUSR1) == -1)
+		kore_log(LOG_NOTICE, "failed to signal accesslog writer");
+}
+
+int
+kore_accesslog_reap(pid_t pid, int status)
+{
+	if (logger_pid == -1 || pid != logger_pid)
+		return (0);
+
+	logger_pid = -1;
+	(void)close(logger_pipe);
+	logger_pipe = -1;
+
+	kore_log(LOG_NOTICE,
+	    "accesslog writer (%d) exited with status %d", pid, status);
+
+	if (!kore_quit)
+		accesslog_spawn();
+
+	return (1);
+}
 
-		accesslog_lock(kw);
+static void
+accesslog_spawn(void)
+{
+	int		fds[2];
+
+	if (pipe(fds) == -1)
+		fatal("%s: pipe: %s", __func__, errno_s);
+
+	if ((logger_pid = fork()) == -1)
+		fatal("%s: fork: %s", __func__, errno_s);
+
+	if (logger_pid == 0) {
+		(void)close(fds[1]);
+		accesslog_writer(fds[0]);
+		exit(0);
+	}
+
+	(void)close(fds[0]);
+	logger_pipe = fds[1];
+
+	if (!kore_quiet) {
+		kore_log(LOG_INFO,
+		    "accesslog writer started (pid#%d)", logger_pid);
+	}
+}
+
+static void
+accesslog_writer(int fd)
+{
+	u_int16_t		idx;
+	struct pollfd		pfd;
+	struct kore_worker	*kw;
+	int			rotate, done;
+
+	kore_platform_proctitle("[accesslog]");
+
+	/* The parent tells us when to stop, after the workers are gone. */
+	(void)signal(SIGINT, SIG_IGN);
+	(void)signal(SIGHUP, SIG_IGN);
+	(void)signal(SIGQUIT, SIG_IGN);
+	(void)signal(SIGTERM, SIG_IGN);
+	(void)signal(SIGCHLD, SIG_DFL);
+	sig_recv = 0;
+
+	kore_server_closeall();
+
+	for (idx = 0; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+		if (kw->msg[0] != NULL)
+			(void)close(kw->msg[0]->fd);
+	}
 
-		if (force || kw->lb.offset >= KORE_ACCESSLOG_SYNC) {
-			kore_buf_append(logbuf, kw->lb.buf, kw->lb.offset);
-			kw->lb.offset = 0;
+	accesslog_targets();
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	done = 0;
+
+	while (!done) {
+		if (poll(&pfd, 1, ACCESSLOG_INTERVAL) == -1 && errno != EINTR)
+			fatal("accesslog writer: poll: %s", errno_s);
+
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+			done = 1;
+
+		rotate = 0;
+		if (sig_recv == SIGUSR1) {
+			sig_recv = 0;
+			rotate = 1;
 		}
 
-		accesslog_unlock(kw);
+		accesslog_drain(kore_time_ms());
+
+		if (rotate)
+			accesslog_reopen();
 	}
 
-	if (force || logbuf->offset >= LOGBUF_SIZE) {
-		off = 0;
-		remain = logbuf->offset;
+	accesslog_sync(kore_time_ms(), 1);
+}
 
-		while (remain > 0) {
-			if (remain < sizeof(*hdr)) {
-				kore_log(LOG_ERR,
-				    "invalid log buffer: (%zu remain)", remain);
+static void
+accesslog_targets(void)
+{
+	struct kore_server	*srv;
+	struct kore_domain	*dom;
+
+	targets_len = 0;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		TAILQ_FOREACH(dom, &srv->domains, list)
+			targets_len = MAX(targets_len, dom->id + 1);
+	}
+
+	targets = kore_calloc(targets_len, sizeof(*targets));
+
+	(void)snprintf(logprefix, sizeof(logprefix),
+	    "<%d>kore: ", LOG_LOCAL0 | LOG_INFO);
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		TAILQ_FOREACH(dom, &srv->domains, list) {
+			targets[dom->id].dom = dom;
+			targets[dom->id].fd = dom->accesslog;
+			targets[dom->id].ship = dom->accesslog_ship;
+		}
+	}
+}
+
+/*
+ * Queue the entries of all rings per domain, write them out and only
+ * then hand the space back to the workers.
+ */
+static void
+accesslog_drain(u_int64_t now)
+{
+	u_int16_t			idx;
+	struct kore_worker		*kw;
+	struct kore_alog_header		hdr;
+	struct accesslog_target		*t;
+	u_int64_t			pos, dropped;
+	u_int64_t			heads[KORE_WORKER_BASE + KORE_WORKER_MAX];
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+
+		pos = kw->lb.tail;
+		heads[idx] = __atomic_load_n(&kw->lb.head, __ATOMIC_ACQUIRE);
+
+		while (pos < heads[idx]) {
+			if (heads[idx] - pos < sizeof(hdr)) {
+				kore_log(LOG_ERR, "invalid accesslog ring");
 				break;
 			}
 
-			hdr = (struct kore_alog_header *)(logbuf->data + off);
-			off += sizeof(*hdr);
-			remain -= sizeof(*hdr);
+			accesslog_ring_get(kw, pos, &hdr, sizeof(hdr));
+			pos += sizeof(hdr);
 
-			if (hdr->loglen > remain) {
+			if (hdr.loglen > heads[idx] - pos) {
 				kore_log(LOG_ERR,
-				    "invalid log header: %u (%zu remain)",
-				    hdr->loglen, remain);
+				    "invalid log header: %u", hdr.loglen);
 				break;
 			}
 
-			if ((dom = kore_domain_byid(hdr->domain)) == NULL)
-				fatal("unknown domain id %u", hdr->domain);
+			if (hdr.domain < targets_len &&
+			    targets[hdr.domain].fd != -1) {
+				t = &targets[hdr.domain];
+				accesslog_add(t, kw, pos, hdr.loglen);
+			} else {
+				kore_log(LOG_ERR,
+				    "unknown domain id %u", hdr.domain);
+			}
+
+			pos += hdr.loglen;
+		}
+
+		dropped = kw->metrics.accesslog_dropped;
+		if (dropped != kw->lb.reported) {
+			if (dropped > kw->lb.reported) {
+				kore_log(LOG_WARNING,
+				    "worker %u dropped %" PRIu64
+				    " accesslog entries", kw->id,
+				    dropped - kw->lb.reported);
+			}
+			kw->lb.reported = dropped;
+		}
+	}
+
+	for (idx = 0; idx < targets_len; idx++)
+		accesslog_flush(&targets[idx], now);
 
-			if (dom->logbuf == NULL)
-				dom->logbuf = kore_buf_alloc(DOMAIN_LOGBUF_LEN);
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+		__atomic_store_n(&kw->lb.tail, heads[idx], __ATOMIC_RELEASE);
+	}
+
+	accesslog_sync(now, 0);
+}
+
+static void
+accesslog_reopen(void)
+{
+	u_int16_t			idx;
+	int				fd;
+	struct accesslog_target		*t;
 
-			kore_buf_append(dom->logbuf, &logbuf->data[off],
-			    hdr->loglen);
+	accesslog_sync(kore_time_ms(), 1);
 
-			off += hdr->loglen;
-			remain -= hdr->loglen;
+	for (idx = 0; idx < targets_len; idx++) {
+		t = &targets[idx];
+		if (t->fd == -1 || t->dom->accesslog_path == NULL)
+			continue;
 
-			accesslog_flush(dom, now, force);
+		fd = open(t->dom->accesslog_path,
+		    O_CREAT | O_APPEND | O_WRONLY,
+		    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (fd == -1) {
+			kore_log(LOG_ERR, "accesslog reopen(%s): %s",
+			    t->dom->accesslog_path, errno_s);
+			continue;
 		}
 
-		kore_buf_reset(logbuf);
+		(void)close(t->fd);
+		t->fd = fd;
 	}
 
-	if (force)
-		kore_domain_callback(accesslog_flush_cb);
+	kore_log(LOG_INFO, "accesslogs reopened");
 }
 
-void
-kore_accesslog_run(void *arg, u_int64_t now)
+/* Honour the accesslog_fsync policy, force is used on rotate and exit. */
+static void
+accesslog_sync(u_int64_t now, int force)
 {
-	static int	ticks = 0;
+	u_int16_t			idx;
+	struct accesslog_target		*t;
 
-	kore_accesslog_gather(arg, now, ticks++ % 100 ? 0 : 1);
+	if (kore_accesslog_fsync == 0)
+		return;
+
+	for (idx = 0; idx < targets_len; idx++) {
+		t = &targets[idx];
+		if (t->fd == -1 || !t->dirty)
+			continue;
+
+		if (!force &&
+		    now - t->synced < (u_int64_t)kore_accesslog_fsync * 1000)
+			continue;
+
+		if (fsync(t->fd) == -1 && errno != EINVAL) {
+			kore_log(LOG_NOTICE, "fsync of accesslog for %s: %s",
+			    t->dom->domain, errno_s);
+		}
+
+		t->dirty = 0;
+		t->synced = now;
+	}
 }
 
+/*
+ * An entry may wrap around the end of the ring, costing two iovecs.
+ * For remote targets each iovec set is sent as a single datagram.
+ */
 static void
-accesslog_flush_cb(struct kore_domain *dom)
+accesslog_add(struct accesslog_target *t, struct kore_worker *kw,
+    u_int64_t pos, size_t len)
 {
-	accesslog_flush(dom, 0, 1);
+	size_t		off, first;
+
+	if (t->iovcnt + 3 > ACCESSLOG_IOV_MAX ||
+	    (t->ship == KORE_ALOG_SHIP_DGRAM &&
+	    t->iovcnt > 0 && t->dglen + len > ACCESSLOG_DGRAM_MAX))
+		accesslog_flush(t, 0);
+
+	if (t->ship == KORE_ALOG_SHIP_SYSLOG) {
+		t->iov[t->iovcnt].iov_base = logprefix;
+		t->iov[t->iovcnt].iov_len = strlen(logprefix);
+		t->iovcnt++;
+	}
+
+	off = pos & RING_MASK;
+	first = MIN(len, KORE_ACCESSLOG_BUFLEN - off);
+
+	t->iov[t->iovcnt].iov_base = &kw->lb.buf[off];
+	t->iov[t->iovcnt].iov_len = first;
+	t->iovcnt++;
+
+	if (first < len) {
+		t->iov[t->iovcnt].iov_base = kw->lb.buf;
+		t->iov[t->iovcnt].iov_len = len - first;
+		t->iovcnt++;
+	}
+
+	t->dglen += len;
+
+	if (t->ship == KORE_ALOG_SHIP_SYSLOG) {
+		/* syslog does not want the trailing newline. */
+		if (--t->iov[t->iovcnt - 1].iov_len == 0)
+			t->iovcnt--;
+		accesslog_flush(t, 0);
+	}
 }
 
 static void
-accesslog_flush(struct kore_domain *dom, u_int64_t now, int force)
+accesslog_flush(struct accesslog_target *t, u_int64_t now)
 {
-	ssize_t		written;
+	struct msghdr	msg;
+	ssize_t		ret;
+	int		cnt;
+	struct iovec	*iov;
 
-	if (force && dom->logbuf == NULL)
-		return;
+	iov = t->iov;
+	cnt = t->iovcnt;
 
-	if (force || dom->logbuf->offset >= DOMAIN_LOGBUF_LEN) {
-		written = write(dom->accesslog, dom->logbuf->data,
-		    dom->logbuf->offset);
-		if (written == -1) {
+	while (cnt > 0) {
+		if (t->ship != KORE_ALOG_SHIP_NONE) {
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = cnt;
+			ret = sendmsg(t->fd, &msg, 0);
+		} else {
+			ret = writev(t->fd, iov, cnt);
+		}
+
+		if (ret == -1) {
 			if (errno == EINTR)
-				return;
-			if (dom->logwarn == 0 ||
-			    errno != dom->logerr) {
+				continue;
+			if (t->dom->logwarn == 0 ||
+			    errno != t->dom->logerr) {
 				kore_log(LOG_NOTICE,
 				    "error writing log for %s (%s)",
-				    dom->domain, errno_s);
-				dom->logwarn = now;
-				dom->logerr = errno;
+				    t->dom->domain, errno_s);
+				t->dom->logwarn = now;
+				t->dom->logerr = errno;
 			}
-			kore_buf_reset(dom->logbuf);
-			return;
+			break;
 		}
 
-		if ((size_t)written != dom->logbuf->offset) {
-			kore_log(LOG_ERR, "partial accesslog write for %s",
-			    dom->domain);
+		/* A datagram is sent in full or not at all. */
+		if (t->ship != KORE_ALOG_SHIP_NONE)
+			break;
+
+		while (cnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
 		}
 
-		kore_buf_reset(dom->logbuf);
+		if (cnt > 0) {
+			iov->iov_base = (u_int8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
 	}
+
+	if (t->iovcnt > 0 && t->ship == KORE_ALOG_SHIP_NONE)
+		t->dirty = 1;
+
+	t->dglen = 0;
+	t->iovcnt = 0;
+}
+
+static void
+accesslog_ring_put(struct kore_worker *kw, u_int64_t pos,
+    const void *data, size_t len)
+{
+	size_t		off, first;
+
+	off = pos & RING_MASK;
+	first = MIN(len, KORE_ACCESSLOG_BUFLEN - off);
+
+	memcpy(&kw->lb.buf[off], data, first);
+	if (first < len)
+		memcpy(kw->lb.buf, (const u_int8_t *)data + first, len - first);
 }
 
 static void
-accesslog_lock(struct kore_worker *kw)
+accesslog_ring_get(struct kore_worker *kw, u_int64_t pos,
+    void *data, size_t len)
+{
+	size_t		off, first;
+
+	off = pos & RING_MASK;
+	first = MIN(len, KORE_ACCESSLOG_BUFLEN - off);
+
+	memcpy(data, &kw->lb.buf[off], first);
+	if (first < len)
+		memcpy((u_int8_t *)data + first, kw->lb.buf, len - first);
+}
+
+static const char *
+accesslog_method(struct http_request *req)
+{
+	const char	*method;
+
+	method = http_method_text(req->method);
+	if (*method == '\0')
+		method = "UNKNOWN";
+
+	return (method);
+}
+
+static const char *
+accesslog_version(struct http_request *req)
+{
+	if (req->flags & HTTP_VERSION_1_0)
+		return ("HTTP/1.0");
+
+	if (req->flags & HTTP_VERSION_2)
+		return ("HTTP/2");
+
+	return ("HTTP/1.1");
+}
+
+static const char *
+accesslog_addr(struct http_request *req, char *addr, size_t len)
+{
+	const char	*ptr;
+
+	switch (req->owner->family) {
+	case AF_INET:
+		ptr = inet_ntop(req->owner->family,
+		    &(req->owner->addr.ipv4.sin_addr), addr, len);
+		break;
+	case AF_INET6:
+		ptr = inet_ntop(req->owner->family,
+		    &(req->owner->addr.ipv6.sin6_addr), addr, len);
+		break;
+	case AF_UNIX:
+		ptr = NULL;
+		break;
+	default:
+		fatal("unknown family %d", req->owner->family);
+	}
+
+	if (ptr == NULL)
+		return ("-");
+
+	return (addr);
+}
+
+/* Microseconds since the request came in, or the handler time. */
+static u_int64_t
+accesslog_duration(struct http_request *req)
 {
-	for (;;) {
-		if (__sync_bool_compare_and_swap(&kw->lb.lock, 0, 1))
+	if (req->t_created != 0)
+		return (kore_time_us() - req->t_created);
+
+	return (req->total * 1000);
+}
+
+static int
+accesslog_clf(struct http_request *req, const char *cn)
+{
+	int		len;
+	char		addr[INET6_ADDRSTRLEN];
+
+	len = snprintf(logline, sizeof(logline),
+	    "%s - %s [%s] \"%s %s %s\" %d %" PRIu64" \"%s\" \"%s\"\n",
+	    accesslog_addr(req, addr, sizeof(addr)), cn != NULL ? cn : "-",
+	    kore_clock.clf, accesslog_method(req), req->path,
+	    accesslog_version(req), req->status, req->content_length,
+	    req->referer != NULL ? req->referer : "-",
+	    req->agent != NULL ? req->agent : "-");
+
+	if (len == -1)
+		fatal("failed to create log entry");
+
+	if ((size_t)len >= sizeof(logline))
+		return (-1);
+
+	return (len);
+}
+
+static int
+accesslog_json(struct http_request *req, u_int32_t fields, const char *cn)
+{
+	char		addr[INET6_ADDRSTRLEN];
+
+	loglen = 0;
+	logfull = 0;
+
+	accesslog_append("{", 1);
+
+	if (fields & KORE_ALOG_FIELD_ADDR) {
+		accesslog_json_str("addr",
+		    accesslog_addr(req, addr, sizeof(addr)));
+	}
+	if (fields & KORE_ALOG_FIELD_CN)
+		accesslog_json_str("cn", cn);
+	if (fields & KORE_ALOG_FIELD_TIME)
+		accesslog_json_num("time", (u_int64_t)kore_clock.wall);
+	if (fields & KORE_ALOG_FIELD_METHOD)
+		accesslog_json_str("method", accesslog_method(req));
+	if (fields & KORE_ALOG_FIELD_PATH)
+		accesslog_json_str("path", req->path);
+	if (fields & KORE_ALOG_FIELD_VERSION)
+		accesslog_json_str("version", accesslog_version(req));
+	if (fields & KORE_ALOG_FIELD_STATUS)
+		accesslog_json_num("status", req->status);
+	if (fields & KORE_ALOG_FIELD_BYTES)
+		accesslog_json_num("bytes", req->content_length);
+	if (fields & KORE_ALOG_FIELD_BODY)
+		accesslog_json_num("body", req->http_body_length);
+	if (fields & KORE_ALOG_FIELD_REFERER)
+		accesslog_json_str("referer", req->referer);
+	if (fields & KORE_ALOG_FIELD_AGENT)
+		accesslog_json_str("agent", req->agent);
+	if (fields & KORE_ALOG_FIELD_HOST)
+		accesslog_json_str("host", req->host);
+	if (fields & KORE_ALOG_FIELD_DURATION)
+		accesslog_json_num("duration", accesslog_duration(req));
+	if (fields & KORE_ALOG_FIELD_ROUTE)
+		accesslog_json_str("route", req->rt->path);
+
+	/* Overwrite the trailing comma, if any. */
+	if (loglen > 1)
+		loglen--;
+
+	accesslog_append("}\n", 2);
+
+	if (logfull)
+		return (-1);
+
+	return ((int)loglen);
+}
+
+static int
+accesslog_binary(struct http_request *req, u_int32_t fields, const char *cn)
+{
+	int				i;
+	struct kore_alog_record		rec;
+	const char			*str[KORE_ALOG_STR_MAX];
+
+	memset(&rec, 0, sizeof(rec));
+	memset(str, 0, sizeof(str));
+
+	rec.fields = fields;
+	rec.family = req->owner->family;
+
+	if (fields & KORE_ALOG_FIELD_ADDR) {
+		switch (req->owner->family) {
+		case AF_INET:
+			memcpy(rec.addr, &req->owner->addr.ipv4.sin_addr,
+			    sizeof(req->owner->addr.ipv4.sin_addr));
 			break;
+		case AF_INET6:
+			memcpy(rec.addr, &req->owner->addr.ipv6.sin6_addr,
+			    sizeof(req->owner->addr.ipv6.sin6_addr));
+			break;
+		}
 	}
+
+	if (fields & KORE_ALOG_FIELD_TIME)
+		rec.time = (u_int64_t)kore_clock.wall;
+	if (fields & KORE_ALOG_FIELD_METHOD)
+		rec.method = req->method;
+	if (fields & KORE_ALOG_FIELD_VERSION) {
+		if (req->flags & HTTP_VERSION_1_0)
+			rec.version = 10;
+		else if (req->flags & HTTP_VERSION_2)
+			rec.version = 20;
+		else
+			rec.version = 11;
+	}
+	if (fields & KORE_ALOG_FIELD_STATUS)
+		rec.status = req->status;
+	if (fields & KORE_ALOG_FIELD_BYTES)
+		rec.bytes = req->content_length;
+	if (fields & KORE_ALOG_FIELD_BODY)
+		rec.body = req->http_body_length;
+	if (fields & KORE_ALOG_FIELD_DURATION)
+		rec.duration = MIN(accesslog_duration(req), UINT_MAX);
+
+	if (fields & KORE_ALOG_FIELD_PATH)
+		str[KORE_ALOG_STR_PATH] = req->path;
+	if (fields & KORE_ALOG_FIELD_HOST)
+		str[KORE_ALOG_STR_HOST] = req->host;
+	if (fields & KORE_ALOG_FIELD_AGENT)
+		str[KORE_ALOG_STR_AGENT] = req->agent;
+	if (fields & KORE_ALOG_FIELD_REFERER)
+		str[KORE_ALOG_STR_REFERER] = req->referer;
+	if (fields & KORE_ALOG_FIELD_CN)
+		str[KORE_ALOG_STR_CN] = cn;
+	if (fields & KORE_ALOG_FIELD_ROUTE)
+		str[KORE_ALOG_STR_ROUTE] = req->rt->path;
+
+	loglen = sizeof(rec);
+	logfull = 0;
+
+	for (i = 0; i < KORE_ALOG_STR_MAX; i++) {
+		if (str[i] == NULL)
+			continue;
+		rec.strlen[i] = strlen(str[i]);
+		accesslog_append(str[i], rec.strlen[i]);
+	}
+
+	if (logfull)
+		return (-1);
+
+	rec.length = loglen;
+	memcpy(logline, &rec, sizeof(rec));
+
+	return ((int)loglen);
+}
+
+static void
+accesslog_append(const void *data, size_t len)
+{
+	if (logfull || len > sizeof(logline) - loglen) {
+		logfull = 1;
+		return;
+	}
+
+	memcpy(&logline[loglen], data, len);
+	loglen += len;
+}
+
+static void
+accesslog_json_num(const char *key, u_int64_t value)
+{
+	int		len;
+	char		num[64];
+
+	len = snprintf(num, sizeof(num), "\"%s\":%" PRIu64 ",", key, value);
+	if (len == -1 || (size_t)len >= sizeof(num))
+		fatal("failed to create log entry");
+
+	accesslog_append(num, len);
 }
 
 static void
-accesslog_unlock(struct kore_worker *kw)
+accesslog_json_str(const char *key, const char *value)
 {
-	if (!__sync_bool_compare_and_swap(&kw->lb.lock, 1, 0))
-		fatal("accesslog_unlock: failed to release");
+	const char	*p;
+	char		esc[8];
+
+	accesslog_append("\"", 1);
+	accesslog_append(key, strlen(key));
+	accesslog_append("\":", 2);
+
+	if (value == NULL) {
+		accesslog_append("null,", 5);
+		return;
+	}
+
+	accesslog_append("\"", 1);
+
+	for (p = value; *p != '\0'; p++) {
+		switch (*p) {
+		case '"':
+			accesslog_append("\\\"", 2);
+			break;
+		case '\\':
+			accesslog_append("\\\\", 2);
+			break;
+		default:
+			if ((u_int8_t)*p < 0x20) {
+				(void)snprintf(esc, sizeof(esc),
+				    "\\u%04x", (u_int8_t)*p);
+				accesslog_append(esc, 6);
+			} else {
+				accesslog_append(p, 1);
+			}
+			break;
+		}
+	}
+
+	accesslog_append("\",", 2);
 }
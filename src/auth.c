@@ -22,14 +22,50 @@
 #include "kore.h"
 #include "http.h"
 
+/*
+ * Validator results for cookie and header authentication, kept per worker
+ * and keyed on the value the client presented. Authentication blocks opt
+ * in with a ttl, kore_auth_cache_size bounds the number of entries.
+ */
+struct auth_cache {
+	u_int64_t		hash;
+	u_int64_t		expires;
+	int			result;
+	struct kore_auth	*auth;
+	char			*value;
+	LIST_ENTRY(auth_cache)	hlist;
+	TAILQ_ENTRY(auth_cache)	lru;
+};
+
+#define AUTH_CACHE_BUCKETS	1024
+
+static int	auth_validate(struct http_request *, struct kore_auth *,
+		    const char *);
+static void	auth_cache_evict(struct auth_cache *);
+static void	auth_cache_purge(const char *);
+static void	auth_cache_purge_msg(struct kore_msg *, const void *);
+
 TAILQ_HEAD(, kore_auth)		auth_list;
 
+static u_int32_t			auth_cache_count = 0;
+static TAILQ_HEAD(, auth_cache)		auth_cache_lru =
+    TAILQ_HEAD_INITIALIZER(auth_cache_lru);
+static LIST_HEAD(, auth_cache)		auth_cache_buckets[AUTH_CACHE_BUCKETS];
+
+u_int32_t	kore_auth_cache_size = 4096;
+
 void
 kore_auth_init(void)
 {
 	TAILQ_INIT(&auth_list);
 }
 
+void
+kore_auth_worker_init(void)
+{
+	kore_msg_register(KORE_MSG_AUTH_CACHE_PURGE, auth_cache_purge_msg);
+}
+
 int
 kore_auth_new(const char *name)
 {
@@ -43,6 +79,8 @@ kore_auth_new(const char *name)
 	auth->value = NULL;
 	auth->redirect = NULL;
 	auth->validator = NULL;
+	auth->cache_ttl = 0;
+	auth->cache_fail_ttl = 0;
 	auth->name = kore_strdup(name);
 
 	TAILQ_INSERT_TAIL(&auth_list, auth, list);
@@ -135,7 +173,7 @@ kore_auth_cookie(struct http_request *req, struct kore_auth *auth)
 		return (KORE_RESULT_ERROR);
 	}
 
-	i = kore_validator_check(req, auth->validator, ++value);
+	i = auth_validate(req, auth, ++value);
 	kore_free(cookie);
 
 	return (i);
@@ -149,7 +187,7 @@ kore_auth_header(struct http_request *req, struct kore_auth *auth)
 	if (!http_request_header(req, auth->value, &header))
 		return (KORE_RESULT_ERROR);
 
-	return (kore_validator_check(req, auth->validator, header));
+	return (auth_validate(req, auth, header));
 }
 
 int
@@ -176,3 +214,135 @@ kore_auth_lookup(const char *name)
 
 	return (NULL);
 }
+
+/*
+ * Drop cached results for the given cookie or header value in all
+ * workers, or every cached result if value is NULL. Call this when a
+ * session is ended or its rights change.
+ */
+void
+kore_auth_cache_purge(const char *value)
+{
+	auth_cache_purge(value);
+
+	kore_msg_send(KORE_MSG_WORKER_ALL, KORE_MSG_AUTH_CACHE_PURGE,
+	    value, value != NULL ? strlen(value) : 0);
+}
+
+/*
+ * Run the validator for value unless a result for it is still cached.
+ * A cache hit does not call the validator at all, so it cannot be used
+ * to set up per request state on cached authentication blocks.
+ */
+static int
+auth_validate(struct http_request *req, struct kore_auth *auth,
+    const char *value)
+{
+	int			r;
+	const char		*p;
+	u_int64_t		hash, now, ttl;
+	struct auth_cache	*entry;
+
+	if (auth->cache_ttl == 0 || kore_auth_cache_size == 0)
+		return (kore_validator_check(req, auth->validator, value));
+
+	hash = 14695981039346656037ULL;
+	for (p = value; *p != '\0'; p++) {
+		hash ^= *(const u_int8_t *)p;
+		hash *= 1099511628211ULL;
+	}
+
+	now = kore_time_ms();
+
+	LIST_FOREACH(entry, &auth_cache_buckets[hash % AUTH_CACHE_BUCKETS],
+	    hlist) {
+		if (entry->hash != hash || entry->auth != auth ||
+		    strcmp(entry->value, value))
+			continue;
+
+		if (entry->expires > now) {
+			TAILQ_REMOVE(&auth_cache_lru, entry, lru);
+			TAILQ_INSERT_TAIL(&auth_cache_lru, entry, lru);
+			return (entry->result);
+		}
+
+		auth_cache_evict(entry);
+		break;
+	}
+
+	r = kore_validator_check(req, auth->validator, value);
+
+	switch (r) {
+	case KORE_RESULT_OK:
+		ttl = auth->cache_ttl;
+		break;
+	case KORE_RESULT_ERROR:
+		ttl = auth->cache_fail_ttl;
+		break;
+	default:
+		ttl = 0;
+		break;
+	}
+
+	if (ttl == 0)
+		return (r);
+
+	while (auth_cache_count >= kore_auth_cache_size)
+		auth_cache_evict(TAILQ_FIRST(&auth_cache_lru));
+
+	entry = kore_malloc(sizeof(*entry));
+	entry->hash = hash;
+	entry->auth = auth;
+	entry->result = r;
+	entry->expires = now + ttl;
+	entry->value = kore_strdup(value);
+
+	LIST_INSERT_HEAD(&auth_cache_buckets[hash % AUTH_CACHE_BUCKETS],
+	    entry, hlist);
+	TAILQ_INSERT_TAIL(&auth_cache_lru, entry, lru);
+	auth_cache_count++;
+
+	return (r);
+}
+
+static void
+auth_cache_evict(struct auth_cache *entry)
+{
+	LIST_REMOVE(entry, hlist);
+	TAILQ_REMOVE(&auth_cache_lru, entry, lru);
+	auth_cache_count--;
+
+	kore_free(entry->value);
+	kore_free(entry);
+}
+
+static void
+auth_cache_purge(const char *value)
+{
+	struct auth_cache	*entry, *next;
+
+	for (entry = TAILQ_FIRST(&auth_cache_lru); entry != NULL;
+	    entry = next) {
+		next = TAILQ_NEXT(entry, lru);
+		if (value == NULL || !strcmp(entry->value, value))
+			auth_cache_evict(entry);
+	}
+}
+
+static void
+auth_cache_purge_msg(struct kore_msg *msg, const void *data)
+{
+	char		*value;
+
+	if (msg->length == 0) {
+		auth_cache_purge(NULL);
+		return;
+	}
+
+	value = kore_malloc(msg->length + 1);
+	memcpy(value, data, msg->length);
+	value[msg->length] = '\0';
+
+	auth_cache_purge(value);
+	kore_free(value);
+}
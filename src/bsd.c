@@ -37,6 +37,10 @@
 #include "tasks.h"
 #endif
 
+#if defined(KORE_USE_PYTHON)
+#include "python_api.h"
+#endif
+
 static int			kfd = -1;
 static int			scheduled = 0;
 static struct kevent		*events = NULL;
@@ -76,6 +80,35 @@ kore_platform_worker_setcpu(struct kore_worker *kw)
 #endif /* __FreeBSD_version */
 }
 
+/* The cpu for the n-th worker, there is no numa placement here. */
+u_int16_t
+kore_platform_worker_cpu(u_int16_t n)
+{
+	return ((n + 1) % cpu_count);
+}
+
+void
+kore_platform_thread_setcpu(int cpu)
+{
+#if defined(__FreeBSD_version)
+	int		i;
+	cpuset_t	cpuset;
+
+	CPU_ZERO(&cpuset);
+
+	if (cpu == -1) {
+		for (i = 0; i < cpu_count; i++)
+			CPU_SET(i, &cpuset);
+	} else {
+		CPU_SET(cpu, &cpuset);
+	}
+
+	if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID,
+	    -1, sizeof(cpuset), &cpuset) == -1)
+		kore_debug("kore_platform_thread_setcpu(): %s", errno_s);
+#endif /* __FreeBSD_version */
+}
+
 void
 kore_platform_event_init(void)
 {
@@ -87,7 +120,10 @@ kore_platform_event_init(void)
 	if ((kfd = kqueue()) == -1)
 		fatal("kqueue(): %s", errno_s);
 
-	event_count = (worker_max_connections * 2) + nlisteners;
+	if (worker_event_batch != 0)
+		event_count = worker_event_batch;
+	else
+		event_count = (worker_max_connections * 2) + nlisteners;
 	events = kore_calloc(event_count, sizeof(struct kevent));
 }
 
@@ -105,11 +141,12 @@ kore_platform_event_cleanup(void)
 	}
 }
 
-void
+int
 kore_platform_event_wait(u_int64_t timer)
 {
 	u_int32_t		r;
 	struct kore_event	*evt;
+	u_int64_t		start;
 	int			n, i;
 	struct timespec		timeo, *ts;
 
@@ -121,15 +158,32 @@ kore_platform_event_wait(u_int64_t timer)
 		ts = &timeo;
 	}
 
+	start = (timer != 0) ? kore_time_us() : 0;
+
+#if defined(KORE_USE_PYTHON)
+	kore_python_gil_release();
+#endif
+
 	n = kevent(kfd, NULL, 0, events, event_count, ts);
+
+#if defined(KORE_USE_PYTHON)
+	kore_python_gil_acquire();
+#endif
+
+	if (timer != 0)
+		kore_evloop->idle_usec += kore_time_us() - start;
+
 	if (n == -1) {
 		if (errno == EINTR)
-			return;
+			return (0);
 		fatal("kevent(): %s", errno_s);
 	}
 
-	if (n > 0)
+	if (n > 0) {
 		kore_debug("main(): %d sockets available", n);
+		kore_evloop->wakeups++;
+		kore_evloop->events += n;
+	}
 
 	for (i = 0; i < n; i++) {
 		evt = (struct kore_event *)events[i].udata;
@@ -150,6 +204,8 @@ kore_platform_event_wait(u_int64_t timer)
 
 		evt->handle(evt, r);
 	}
+
+	return (n);
 }
 
 void
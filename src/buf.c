@@ -16,6 +16,7 @@
 
 #include <sys/types.h>
 
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -23,6 +24,10 @@
 
 #include "kore.h"
 
+#define BUF_GROWTH_MIN		64
+
+static struct kore_pool		rope_pool;
+
 struct kore_buf *
 kore_buf_alloc(size_t initial)
 {
@@ -68,11 +73,23 @@ kore_buf_free(struct kore_buf *buf)
 void
 kore_buf_append(struct kore_buf *buf, const void *data, size_t len)
 {
+	size_t		need;
+
 	if ((buf->offset + len) < len)
 		fatal("overflow in kore_buf_append");
 
+	/* Grow geometrically so many small appends stay linear. */
 	if ((buf->offset + len) > buf->length) {
-		buf->length += len;
+		need = buf->offset + len;
+		if (buf->length < BUF_GROWTH_MIN)
+			buf->length = BUF_GROWTH_MIN;
+		while (buf->length < need) {
+			if (buf->length > SIZE_MAX / 2) {
+				buf->length = need;
+				break;
+			}
+			buf->length *= 2;
+		}
 		buf->data = kore_realloc(buf->data, buf->length);
 	}
 
@@ -188,3 +205,123 @@ kore_buf_reset(struct kore_buf *buf)
 {
 	buf->offset = 0;
 }
+
+void
+kore_rope_pool_init(void)
+{
+	kore_pool_init(&rope_pool, "rope_pool", KORE_ROPE_CHUNK, 16);
+}
+
+void
+kore_rope_init(struct kore_rope *rope)
+{
+	rope->length = 0;
+	TAILQ_INIT(&rope->chunks);
+}
+
+void
+kore_rope_cleanup(struct kore_rope *rope)
+{
+	struct kore_rope_chunk		*chunk;
+
+	while ((chunk = TAILQ_FIRST(&rope->chunks)) != NULL) {
+		TAILQ_REMOVE(&rope->chunks, chunk, list);
+		kore_rope_chunk_free(chunk);
+	}
+
+	rope->length = 0;
+}
+
+void
+kore_rope_append(struct kore_rope *rope, const void *data, size_t len)
+{
+	size_t				avail;
+	const u_int8_t			*d;
+	struct kore_rope_chunk		*chunk;
+
+	if ((rope->length + len) < len)
+		fatal("overflow in kore_rope_append");
+
+	d = data;
+	chunk = TAILQ_LAST(&rope->chunks, kore_rope_chunk_head);
+
+	while (len > 0) {
+		if (chunk == NULL || chunk->len == KORE_ROPE_CHUNK_DATA) {
+			chunk = kore_pool_get(&rope_pool);
+			chunk->len = 0;
+			TAILQ_INSERT_TAIL(&rope->chunks, chunk, list);
+		}
+
+		avail = MIN(len, KORE_ROPE_CHUNK_DATA - chunk->len);
+		memcpy(chunk->data + chunk->len, d, avail);
+
+		chunk->len += avail;
+		rope->length += avail;
+
+		d += avail;
+		len -= avail;
+	}
+}
+
+void
+kore_rope_appendv(struct kore_rope *rope, const char *fmt, va_list args)
+{
+	int		l;
+	va_list		copy;
+	char		*b, sb[BUFSIZ];
+
+	va_copy(copy, args);
+
+	l = vsnprintf(sb, sizeof(sb), fmt, args);
+	if (l == -1)
+		fatal("kore_rope_appendv(): vsnprintf error");
+
+	if ((size_t)l >= sizeof(sb)) {
+		l = vasprintf(&b, fmt, copy);
+		if (l == -1)
+			fatal("kore_rope_appendv(): error or truncation");
+	} else {
+		b = sb;
+	}
+
+	kore_rope_append(rope, b, l);
+	if (b != sb)
+		free(b);
+
+	va_end(copy);
+}
+
+void
+kore_rope_appendf(struct kore_rope *rope, const char *fmt, ...)
+{
+	va_list		args;
+
+	va_start(args, fmt);
+	kore_rope_appendv(rope, fmt, args);
+	va_end(args);
+}
+
+/* Copy the rope contents to the end of buf, the rope is left as-is. */
+void
+kore_rope_tobuf(struct kore_rope *rope, struct kore_buf *buf)
+{
+	struct kore_rope_chunk		*chunk;
+
+	if (buf->length - buf->offset < rope->length) {
+		if (buf->offset + rope->length < rope->length)
+			fatal("overflow in kore_rope_tobuf");
+		buf->length = buf->offset + rope->length;
+		buf->data = kore_realloc(buf->data, buf->length);
+	}
+
+	TAILQ_FOREACH(chunk, &rope->chunks, list) {
+		memcpy(buf->data + buf->offset, chunk->data, chunk->len);
+		buf->offset += chunk->len;
+	}
+}
+
+void
+kore_rope_chunk_free(struct kore_rope_chunk *chunk)
+{
+	kore_pool_put(&rope_pool, chunk);
+}
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Per worker cache of responses to GET requests for routes that have a
+ * cache ttl configured.
+ *
+ * Entries are keyed on the domain, path, query string and the values of
+ * the request headers the route varies on. They hold the status, the
+ * response headers rendered as header lines and the body, so that a hit
+ * over HTTP/1.x costs a hash lookup and a single send buffer. Other
+ * requests replay the headers and body through http_response().
+ *
+ * The request that misses becomes the one filling the entry, others
+ * asking for the same entry in the meantime sleep on its runlock until
+ * the response is stored (or the request went away) instead of running
+ * the handler as well. Once expired an entry may still be served for
+ * its stale period to everyone but the single request refreshing it.
+ */
+
+#include <sys/types.h>
+
+#include "kore.h"
+#include "http.h"
+
+#define CACHE_BUCKETS		1024
+
+struct http_cache_entry {
+	u_int8_t			*key;
+	size_t				klen;
+	u_int64_t			hash;
+	int				status;
+	char				*type;
+	u_int64_t			expires;
+	struct kore_buf			*data;
+	size_t				hlen;
+	struct http_runlock		lock;
+	LIST_ENTRY(http_cache_entry)	hlist;
+	TAILQ_ENTRY(http_cache_entry)	list;
+};
+
+static u_int64_t	cache_hash(const void *, size_t);
+static void		cache_key(struct http_request *, struct kore_buf *);
+static int		cache_storable(struct http_request *, int);
+static void		cache_respond(struct http_request *,
+			    struct http_cache_entry *);
+static void		cache_remove(struct http_cache_entry *);
+static void		cache_evict(struct http_cache_entry *, size_t);
+
+static LIST_HEAD(, http_cache_entry)	cache[CACHE_BUCKETS];
+static TAILQ_HEAD(http_cache_lru, http_cache_entry)	cache_lru =
+    TAILQ_HEAD_INITIALIZER(cache_lru);
+static struct kore_buf			*cache_keybuf = NULL;
+static size_t				cache_bytes = 0;
+
+size_t		http_cache_size = HTTP_CACHE_SIZE;
+size_t		http_cache_max = HTTP_CACHE_MAX;
+
+/*
+ * Called before the handler of a route with a cache runs. Returns
+ * KORE_RESULT_OK if the request was answered from the cache,
+ * KORE_RESULT_RETRY if it is waiting for another request to fill it and
+ * KORE_RESULT_ERROR if the handler must run.
+ */
+int
+http_cache_serve(struct http_request *req)
+{
+	u_int64_t		hash;
+	struct http_cache_entry	*entry;
+	struct http_cache	*conf = req->rt->cache;
+
+	/* Already filling the entry, the handler is being run again. */
+	if (req->cache != NULL || http_cache_size == 0)
+		return (KORE_RESULT_ERROR);
+
+	if (req->method != HTTP_METHOD_GET && req->method != HTTP_METHOD_HEAD)
+		return (KORE_RESULT_ERROR);
+
+	if (cache_keybuf == NULL)
+		cache_keybuf = kore_buf_alloc(256);
+
+	cache_key(req, cache_keybuf);
+	hash = cache_hash(cache_keybuf->data, cache_keybuf->offset);
+
+	LIST_FOREACH(entry, &cache[hash & (CACHE_BUCKETS - 1)], hlist) {
+		if (entry->hash == hash &&
+		    entry->klen == cache_keybuf->offset &&
+		    !memcmp(entry->key, cache_keybuf->data, entry->klen))
+			break;
+	}
+
+	if (entry != NULL && entry->data != NULL) {
+		if (kore_clock.ms < entry->expires) {
+			cache_respond(req, entry);
+			return (KORE_RESULT_OK);
+		}
+
+		if (kore_clock.ms < entry->expires + conf->stale &&
+		    (entry->lock.owner != NULL ||
+		    req->method == HTTP_METHOD_HEAD)) {
+			cache_respond(req, entry);
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	/* A HEAD request never fills the cache, nor waits for it. */
+	if (req->method == HTTP_METHOD_HEAD)
+		return (KORE_RESULT_ERROR);
+
+	if (entry == NULL) {
+		entry = kore_calloc(1, sizeof(*entry));
+		entry->hash = hash;
+		entry->klen = cache_keybuf->offset;
+		entry->key = kore_malloc(entry->klen);
+		memcpy(entry->key, cache_keybuf->data, entry->klen);
+		http_runlock_init(&entry->lock);
+
+		LIST_INSERT_HEAD(&cache[hash & (CACHE_BUCKETS - 1)],
+		    entry, hlist);
+		TAILQ_INSERT_HEAD(&cache_lru, entry, list);
+	}
+
+	if (!http_runlock_acquire(&entry->lock, req))
+		return (KORE_RESULT_RETRY);
+
+	req->cache = entry;
+
+	return (KORE_RESULT_ERROR);
+}
+
+/*
+ * Called with the full response of a request that is filling an entry,
+ * before it is compressed or sent.
+ */
+void
+http_cache_store(struct http_request *req, int status, const void *d,
+    size_t len)
+{
+	struct http_header	*hdr;
+	struct http_cache_entry	*entry;
+	size_t			need;
+
+	entry = req->cache;
+
+	if (len > http_cache_max || !cache_storable(req, status)) {
+		http_cache_release(req);
+		return;
+	}
+
+	need = entry->klen + len + sizeof(*entry);
+	if (need > http_cache_size) {
+		http_cache_release(req);
+		return;
+	}
+
+	if (entry->data != NULL) {
+		cache_bytes -= entry->klen + entry->data->offset +
+		    sizeof(*entry);
+		kore_buf_free(entry->data);
+		kore_free(entry->type);
+	}
+
+	entry->type = NULL;
+	entry->status = status;
+	entry->data = kore_buf_alloc(len + 256);
+
+	TAILQ_FOREACH(hdr, &req->resp_headers, list) {
+		if (!strcasecmp(hdr->header, "date"))
+			continue;
+
+		if (!strcasecmp(hdr->header, "content-type"))
+			entry->type = kore_strdup(hdr->value);
+
+		kore_buf_appendf(entry->data, "%s: %s\r\n",
+		    hdr->header, hdr->value);
+	}
+
+	entry->hlen = entry->data->offset;
+	if (len > 0)
+		kore_buf_append(entry->data, d, len);
+
+	entry->expires = kore_clock.ms + req->rt->cache->ttl;
+
+	need = entry->klen + entry->data->offset + sizeof(*entry);
+	cache_evict(entry, need);
+	cache_bytes += need;
+
+	if (entry != TAILQ_FIRST(&cache_lru)) {
+		TAILQ_REMOVE(&cache_lru, entry, list);
+		TAILQ_INSERT_HEAD(&cache_lru, entry, list);
+	}
+
+	req->cache = NULL;
+	http_runlock_release_all(&entry->lock);
+}
+
+/*
+ * The request filling an entry is done without storing anything in it,
+ * wake up those waiting so one of them can try. An entry that was never
+ * filled goes away.
+ */
+void
+http_cache_release(struct http_request *req)
+{
+	struct http_cache_entry	*entry;
+
+	entry = req->cache;
+	req->cache = NULL;
+
+	http_runlock_release_all(&entry->lock);
+
+	if (entry->data == NULL)
+		cache_remove(entry);
+}
+
+void
+http_cache_conf_free(struct http_cache *conf)
+{
+	int		i;
+
+	if (conf == NULL)
+		return;
+
+	for (i = 0; i < conf->nvary; i++)
+		kore_free(conf->vary[i]);
+
+	kore_free(conf);
+}
+
+static void
+cache_respond(struct http_request *req, struct http_cache_entry *entry)
+{
+	char		*lines, *line, *next, *value;
+	size_t		blen;
+	const u_int8_t	*body;
+
+	if (entry != TAILQ_FIRST(&cache_lru)) {
+		TAILQ_REMOVE(&cache_lru, entry, list);
+		TAILQ_INSERT_HEAD(&cache_lru, entry, list);
+	}
+
+	body = entry->data->data + entry->hlen;
+	blen = entry->data->offset - entry->hlen;
+
+	if (req->owner->proto == CONN_PROTO_HTTP) {
+#if defined(KORE_USE_COMPRESS)
+		if (http_compress_select(req,
+		    entry->status, entry->type, blen) == -1) {
+#endif
+			http_response_block(req, entry->status,
+			    entry->data->data, entry->hlen, body, blen);
+			return;
+#if defined(KORE_USE_COMPRESS)
+		}
+#endif
+	}
+
+	lines = kore_malloc(entry->hlen + 1);
+	memcpy(lines, entry->data->data, entry->hlen);
+	lines[entry->hlen] = '\0';
+
+	for (line = lines; *line != '\0'; line = next) {
+		if ((next = strstr(line, "\r\n")) == NULL)
+			break;
+		*next = '\0';
+		next += 2;
+
+		if ((value = strstr(line, ": ")) == NULL)
+			continue;
+		*value = '\0';
+		value += 2;
+
+		http_response_header(req, line, value);
+	}
+
+	kore_free(lines);
+
+	http_response(req, entry->status, body, blen);
+}
+
+/*
+ * Only plain responses meant for everyone are kept, not those setting
+ * cookies or marked no-store or private by the handler.
+ */
+static int
+cache_storable(struct http_request *req, int status)
+{
+	const char		*p;
+	struct http_header	*hdr;
+
+	if (req->owner == NULL || req->method != HTTP_METHOD_GET)
+		return (KORE_RESULT_ERROR);
+
+	switch (status) {
+	case HTTP_STATUS_OK:
+	case HTTP_STATUS_NON_AUTHORITATIVE:
+	case HTTP_STATUS_NO_CONTENT:
+	case HTTP_STATUS_MOVED_PERMANENTLY:
+	case HTTP_STATUS_NOT_FOUND:
+	case HTTP_STATUS_GONE:
+		break;
+	default:
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!TAILQ_EMPTY(&req->resp_cookies))
+		return (KORE_RESULT_ERROR);
+
+	TAILQ_FOREACH(hdr, &req->resp_headers, list) {
+		if (!strcasecmp(hdr->header, "set-cookie"))
+			return (KORE_RESULT_ERROR);
+
+		if (strcasecmp(hdr->header, "cache-control"))
+			continue;
+
+		for (p = hdr->value; *p != '\0'; p++) {
+			if (!strncasecmp(p, "no-store", 8) ||
+			    !strncasecmp(p, "private", 7))
+				return (KORE_RESULT_ERROR);
+		}
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * The key is made up of the domain, the path and query string and the
+ * value of each header the route varies on, separated by NUL bytes.
+ */
+static void
+cache_key(struct http_request *req, struct kore_buf *buf)
+{
+	int			i;
+	const char		*value;
+	struct http_cache	*conf = req->rt->cache;
+
+	kore_buf_reset(buf);
+
+	kore_buf_append(buf, &req->rt->dom, sizeof(req->rt->dom));
+	kore_buf_append(buf, req->path, strlen(req->path) + 1);
+
+	if (req->query_string != NULL)
+		kore_buf_append(buf, req->query_string,
+		    strlen(req->query_string));
+
+	for (i = 0; i < conf->nvary; i++) {
+		kore_buf_append(buf, "", 1);
+		if (http_request_header(req, conf->vary[i], &value))
+			kore_buf_append(buf, value, strlen(value));
+	}
+}
+
+static void
+cache_remove(struct http_cache_entry *entry)
+{
+	if (entry->data != NULL) {
+		cache_bytes -= entry->klen + entry->data->offset +
+		    sizeof(*entry);
+		kore_buf_free(entry->data);
+	}
+
+	LIST_REMOVE(entry, hlist);
+	TAILQ_REMOVE(&cache_lru, entry, list);
+
+	kore_free(entry->type);
+	kore_free(entry->key);
+	kore_free(entry);
+}
+
+/*
+ * Make room for need more bytes, least recently used first. Entries that
+ * are being filled or have requests waiting on them are left alone.
+ */
+static void
+cache_evict(struct http_cache_entry *keep, size_t need)
+{
+	struct http_cache_entry	*entry, *prev;
+
+	entry = TAILQ_LAST(&cache_lru, http_cache_lru);
+
+	while (entry != NULL && cache_bytes + need > http_cache_size) {
+		prev = TAILQ_PREV(entry, http_cache_lru, list);
+
+		if (entry != keep && entry->lock.owner == NULL &&
+		    LIST_EMPTY(&entry->lock.queue))
+			cache_remove(entry);
+
+		entry = prev;
+	}
+}
+
+static u_int64_t
+cache_hash(const void *data, size_t len)
+{
+	size_t			idx;
+	u_int64_t		hash;
+	const u_int8_t		*p = data;
+
+	hash = 14695981039346656037ULL;
+
+	for (idx = 0; idx < len; idx++) {
+		hash ^= p[idx];
+		hash *= 1099511628211ULL;
+	}
+
+	return (hash);
+}
@@ -0,0 +1,580 @@
+/*
+ * Copyright (c) 2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Response compression.
+ *
+ * Responses are compressed in one go right before their headers are
+ * written so the content-length remains known up front. Compressed
+ * variants of filerefs are kept next to the fileref itself and are
+ * dropped together with it.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <limits.h>
+#include <unistd.h>
+
+#define ZLIB_CONST
+#include <zlib.h>
+
+#if defined(KORE_USE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#include "kore.h"
+#include "http.h"
+
+/* Files larger than this are sent as-is. */
+#define COMPRESS_FILE_MAX	(4 * 1024 * 1024)
+
+static struct http_compress	*compress_conf(struct http_request *);
+static const char	*compress_header(struct http_request *, const char *);
+static int		compress_type_match(struct http_compress *,
+			    const char *);
+static int		compress_type_equal(const char *, size_t,
+			    const char *);
+static int		compress_buf_release(struct netbuf *);
+static int		compress_fileref_release(struct netbuf *);
+static struct kore_buf	*compress_fileref_data(struct kore_fileref *, int);
+static struct kore_buf	*compress_gzip(const void *, size_t);
+#if defined(KORE_USE_BROTLI)
+static struct kore_buf	*compress_brotli(const void *, size_t);
+#endif
+
+static const char *compress_names[HTTP_COMPRESS_MAX] = {
+	"gzip",
+	"br",
+};
+
+/* Used when a configuration does not list any media types. */
+static const char *compress_default_types[] = {
+	"text/*",
+	"application/json",
+	"application/javascript",
+	"application/xml",
+	"image/svg+xml",
+	NULL
+};
+
+int	http_compress_gzip_level = HTTP_COMPRESS_GZIP_LEVEL;
+#if defined(KORE_USE_BROTLI)
+int	http_compress_brotli_quality = HTTP_COMPRESS_BROTLI_QUALITY;
+#endif
+
+/* The per-worker deflate context, reset between responses. */
+static z_stream		gzip_strm;
+static int		gzip_ready = 0;
+
+void
+http_compress_init(void)
+{
+	gzip_ready = 0;
+}
+
+void
+http_compress_cleanup(void)
+{
+	if (gzip_ready) {
+		(void)deflateEnd(&gzip_strm);
+		gzip_ready = 0;
+	}
+}
+
+int
+http_compress_encoding(const char *name)
+{
+	int		enc;
+
+	if (!strcmp(name, "brotli"))
+		name = "br";
+
+	for (enc = 0; enc < HTTP_COMPRESS_MAX; enc++) {
+		if (!strcmp(name, compress_names[enc]))
+			break;
+	}
+
+	if (enc == HTTP_COMPRESS_MAX)
+		return (-1);
+
+#if !defined(KORE_USE_BROTLI)
+	if (enc == HTTP_COMPRESS_BROTLI)
+		return (-1);
+#endif
+
+	return (enc);
+}
+
+struct http_compress *
+http_compress_conf_create(struct http_compress *parent)
+{
+	int			i;
+	struct http_compress	*conf;
+
+	conf = kore_calloc(1, sizeof(*conf));
+
+	if (parent == NULL) {
+		conf->min_size = HTTP_COMPRESS_MIN_SIZE;
+		return (conf);
+	}
+
+	conf->encodings = parent->encodings;
+	conf->min_size = parent->min_size;
+	conf->ntypes = parent->ntypes;
+
+	for (i = 0; i < parent->ntypes; i++)
+		conf->types[i] = kore_strdup(parent->types[i]);
+
+	return (conf);
+}
+
+void
+http_compress_conf_free(struct http_compress *conf)
+{
+	int		i;
+
+	if (conf == NULL)
+		return;
+
+	for (i = 0; i < conf->ntypes; i++)
+		kore_free(conf->types[i]);
+
+	kore_free(conf);
+}
+
+/*
+ * Returns the content coding to use for a response of the given media
+ * type and length, or -1 if it should go out as-is.
+ */
+int
+http_compress_select(struct http_request *req, int status, const char *type,
+    size_t len)
+{
+	struct http_compress	*conf;
+	int			enc, best, q, bestq;
+
+	if ((conf = compress_conf(req)) == NULL || conf->encodings == 0)
+		return (-1);
+
+	if (req->owner == NULL || req->owner->proto == CONN_PROTO_WEBSOCKET ||
+	    req->owner->proto == CONN_PROTO_SSE)
+		return (-1);
+
+	if (status < HTTP_STATUS_OK || status == HTTP_STATUS_NO_CONTENT ||
+	    status == HTTP_STATUS_PARTIAL_CONTENT ||
+	    status == HTTP_STATUS_NOT_MODIFIED)
+		return (-1);
+
+	if (type == NULL || !compress_type_match(conf, type))
+		return (-1);
+
+	if (compress_header(req, "content-encoding") != NULL)
+		return (-1);
+
+	/* Caches must key on accept-encoding, small responses included. */
+	http_response_vary(req, "accept-encoding");
+
+	if (len < conf->min_size)
+		return (-1);
+
+	best = -1;
+	bestq = 0;
+
+	/* Walk backwards so brotli wins over gzip at an equal weight. */
+	for (enc = HTTP_COMPRESS_MAX - 1; enc >= 0; enc--) {
+		if (!(conf->encodings & (1 << enc)))
+			continue;
+
+		q = http_accept_encoding(req, compress_names[enc]);
+		if (q > bestq) {
+			best = enc;
+			bestq = q;
+		}
+	}
+
+	return (best);
+}
+
+struct kore_buf *
+http_compress_data(int enc, const void *data, size_t len)
+{
+	switch (enc) {
+	case HTTP_COMPRESS_GZIP:
+		return (compress_gzip(data, len));
+#if defined(KORE_USE_BROTLI)
+	case HTTP_COMPRESS_BROTLI:
+		return (compress_brotli(data, len));
+#endif
+	default:
+		fatal("%s: unknown encoding %d", __func__, enc);
+	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+int
+http_compress_response(struct http_request *req, int status,
+    const void *data, size_t len)
+{
+	int			enc;
+	struct kore_buf		*buf;
+
+	if (data == NULL || len == 0)
+		return (KORE_RESULT_ERROR);
+
+	enc = http_compress_select(req, status,
+	    compress_header(req, "content-type"), len);
+	if (enc == -1)
+		return (KORE_RESULT_ERROR);
+
+	if ((buf = http_compress_data(enc, data, len)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (buf->offset >= len) {
+		kore_buf_free(buf);
+		return (KORE_RESULT_ERROR);
+	}
+
+	http_response_header(req, "content-encoding", compress_names[enc]);
+	http_response_stream(req, status, buf->data, buf->offset,
+	    compress_buf_release, buf);
+
+	return (KORE_RESULT_OK);
+}
+
+int
+http_compress_stream(struct http_request *req, int status, void *base,
+    size_t len, int (*cb)(struct netbuf *), void *arg)
+{
+	int			enc;
+	struct netbuf		nb;
+	struct kore_buf		*buf;
+
+	if (base == NULL || len == 0)
+		return (KORE_RESULT_ERROR);
+
+	enc = http_compress_select(req, status,
+	    compress_header(req, "content-type"), len);
+	if (enc == -1)
+		return (KORE_RESULT_ERROR);
+
+	if ((buf = http_compress_data(enc, base, len)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (buf->offset >= len) {
+		kore_buf_free(buf);
+		return (KORE_RESULT_ERROR);
+	}
+
+	/* The original data is no longer needed, let its owner know. */
+	if (cb != NULL) {
+		memset(&nb, 0, sizeof(nb));
+		nb.buf = base;
+		nb.b_len = len;
+		nb.m_len = len;
+		nb.s_off = len;
+		nb.type = NETBUF_SEND;
+		nb.flags = NETBUF_IS_STREAM;
+		nb.owner = req->owner;
+		nb.extra = arg;
+		nb.cb = cb;
+
+		(void)cb(&nb);
+	}
+
+	http_response_header(req, "content-encoding", compress_names[enc]);
+	http_response_stream(req, status, buf->data, buf->offset,
+	    compress_buf_release, buf);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Compress the contents of rope, which must be flattened first. On
+ * success the rope is emptied and the compressed copy is sent instead.
+ */
+int
+http_compress_rope(struct http_request *req, int status,
+    struct kore_rope *rope)
+{
+	int			enc;
+	struct kore_buf		flat, *buf;
+
+	if (rope->length == 0)
+		return (KORE_RESULT_ERROR);
+
+	enc = http_compress_select(req, status,
+	    compress_header(req, "content-type"), rope->length);
+	if (enc == -1)
+		return (KORE_RESULT_ERROR);
+
+	kore_buf_init(&flat, rope->length);
+	kore_rope_tobuf(rope, &flat);
+	buf = http_compress_data(enc, flat.data, flat.offset);
+	kore_buf_cleanup(&flat);
+
+	if (buf == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (buf->offset >= rope->length) {
+		kore_buf_free(buf);
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_rope_cleanup(rope);
+
+	http_response_header(req, "content-encoding", compress_names[enc]);
+	http_response_stream(req, status, buf->data, buf->offset,
+	    compress_buf_release, buf);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Serve a compressed variant of the fileref, compressing it the first
+ * time it is requested. On success the fileref reference is handed over
+ * and released once the response has been sent.
+ */
+int
+http_compress_fileref(struct http_request *req, int status,
+    struct kore_fileref *ref, const char *type)
+{
+	int			enc;
+	struct kore_buf		*buf;
+
+	if (ref->size == 0 || ref->size > COMPRESS_FILE_MAX)
+		return (KORE_RESULT_ERROR);
+
+	enc = http_compress_select(req, status, type, (size_t)ref->size);
+	if (enc == -1)
+		return (KORE_RESULT_ERROR);
+
+	if (ref->encoded[enc] == NULL) {
+		if ((buf = compress_fileref_data(ref, enc)) == NULL)
+			return (KORE_RESULT_ERROR);
+
+		/* Remember files that do not compress with an empty buffer. */
+		if (buf->offset >= (size_t)ref->size)
+			kore_buf_reset(buf);
+
+		ref->encoded[enc] = buf;
+	}
+
+	buf = ref->encoded[enc];
+	if (buf->offset == 0)
+		return (KORE_RESULT_ERROR);
+
+	http_response_header(req, "content-encoding", compress_names[enc]);
+	http_response_stream(req, status, buf->data, buf->offset,
+	    compress_fileref_release, ref);
+
+	return (KORE_RESULT_OK);
+}
+
+static struct http_compress *
+compress_conf(struct http_request *req)
+{
+	if (req->rt == NULL)
+		return (NULL);
+
+	if (req->rt->compress != NULL)
+		return (req->rt->compress);
+
+	return (req->rt->dom->compress);
+}
+
+static const char *
+compress_header(struct http_request *req, const char *name)
+{
+	struct http_header	*hdr;
+
+	TAILQ_FOREACH(hdr, &req->resp_headers, list) {
+		if (!strcasecmp(hdr->header, name))
+			return (hdr->value);
+	}
+
+	return (NULL);
+}
+
+static int
+compress_type_match(struct http_compress *conf, const char *type)
+{
+	int		i;
+	size_t		len;
+
+	len = strcspn(type, "; \t");
+
+	if (conf->ntypes == 0) {
+		for (i = 0; compress_default_types[i] != NULL; i++) {
+			if (compress_type_equal(type, len,
+			    compress_default_types[i]))
+				return (1);
+		}
+		return (0);
+	}
+
+	for (i = 0; i < conf->ntypes; i++) {
+		if (compress_type_equal(type, len, conf->types[i]))
+			return (1);
+	}
+
+	return (0);
+}
+
+/* A pattern ending in '*' matches any media type with that prefix. */
+static int
+compress_type_equal(const char *type, size_t len, const char *pattern)
+{
+	size_t		plen;
+
+	plen = strlen(pattern);
+
+	if (plen > 0 && pattern[plen - 1] == '*') {
+		plen--;
+		return (len >= plen && !strncasecmp(type, pattern, plen));
+	}
+
+	return (len == plen && !strncasecmp(type, pattern, len));
+}
+
+static int
+compress_buf_release(struct netbuf *nb)
+{
+	kore_buf_free(nb->extra);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+compress_fileref_release(struct netbuf *nb)
+{
+	kore_fileref_release(nb->extra);
+
+	return (KORE_RESULT_OK);
+}
+
+static struct kore_buf *
+compress_fileref_data(struct kore_fileref *ref, int enc)
+{
+	ssize_t			ret;
+	size_t			off, len;
+	struct kore_buf		*data, *buf;
+
+	if (ref->base != NULL)
+		return (http_compress_data(enc, ref->base, ref->size));
+
+	len = (size_t)ref->size;
+	data = kore_buf_alloc(len);
+
+	for (off = 0; off < len; off += (size_t)ret) {
+		ret = pread(ref->fd, data->data + off, len - off, (off_t)off);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			kore_log(LOG_ERR, "pread(%s): %s", ref->path, errno_s);
+			kore_buf_free(data);
+			return (NULL);
+		}
+
+		if (ret == 0) {
+			kore_log(LOG_ERR, "%s: short read", ref->path);
+			kore_buf_free(data);
+			return (NULL);
+		}
+	}
+
+	buf = http_compress_data(enc, data->data, len);
+	kore_buf_free(data);
+
+	return (buf);
+}
+
+static struct kore_buf *
+compress_gzip(const void *data, size_t len)
+{
+	size_t			bound;
+	struct kore_buf		*buf;
+
+	if (len > UINT_MAX)
+		return (NULL);
+
+	if (!gzip_ready) {
+		memset(&gzip_strm, 0, sizeof(gzip_strm));
+		if (deflateInit2(&gzip_strm, http_compress_gzip_level,
+		    Z_DEFLATED, MAX_WBITS + 16, 8,
+		    Z_DEFAULT_STRATEGY) != Z_OK) {
+			kore_log(LOG_ERR, "deflateInit2: %s",
+			    gzip_strm.msg != NULL ? gzip_strm.msg : "failed");
+			return (NULL);
+		}
+		gzip_ready = 1;
+	} else if (deflateReset(&gzip_strm) != Z_OK) {
+		return (NULL);
+	}
+
+	bound = deflateBound(&gzip_strm, len);
+	if (bound > UINT_MAX)
+		return (NULL);
+
+	buf = kore_buf_alloc(bound);
+
+	gzip_strm.next_in = data;
+	gzip_strm.avail_in = len;
+	gzip_strm.next_out = buf->data;
+	gzip_strm.avail_out = bound;
+
+	if (deflate(&gzip_strm, Z_FINISH) != Z_STREAM_END) {
+		kore_log(LOG_ERR, "deflate: %s",
+		    gzip_strm.msg != NULL ? gzip_strm.msg : "failed");
+		kore_buf_free(buf);
+		return (NULL);
+	}
+
+	buf->offset = bound - gzip_strm.avail_out;
+
+	return (buf);
+}
+
+#if defined(KORE_USE_BROTLI)
+static struct kore_buf *
+compress_brotli(const void *data, size_t len)
+{
+	size_t			bound, olen;
+	struct kore_buf		*buf;
+
+	if ((bound = BrotliEncoderMaxCompressedSize(len)) == 0)
+		return (NULL);
+
+	buf = kore_buf_alloc(bound);
+	olen = bound;
+
+	if (!BrotliEncoderCompress(http_compress_brotli_quality,
+	    BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, len, data,
+	    &olen, buf->data)) {
+		kore_log(LOG_ERR, "BrotliEncoderCompress failed");
+		kore_buf_free(buf);
+		return (NULL);
+	}
+
+	buf->offset = olen;
+
+	return (buf);
+}
+#endif
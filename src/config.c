@@ -77,6 +77,15 @@ static int		configure_tls(char *);
 static int		configure_server(char *);
 static int		configure_include(char *);
 static int		configure_bind(char *);
+static int		configure_proxy(char *);
+static int		configure_proxy_buffer(char *);
+static int		configure_proxy_connect_timeout(char *);
+static int		configure_proxy_idle_timeout(char *);
+static int		configure_ratelimit(char *);
+static int		configure_ratelimit_table_size(char *);
+static int		configure_upgrade_drain_timeout(char *);
+static int		configure_pool_idle_time(char *);
+static int		configure_pool_hugepages(char *);
 static int		configure_bind_unix(char *);
 static int		configure_attach(char *);
 static int		configure_domain(char *);
@@ -87,9 +96,19 @@ static int		configure_pidfile(char *);
 static int		configure_rlimit_nofiles(char *);
 static int		configure_max_connections(char *);
 static int		configure_accept_threshold(char *);
+static int		configure_accept_exclusive(char *);
+static int		configure_event_batch(char *);
+static int		configure_busy_poll(char *);
+static int		configure_msg_ring_size(char *);
+static int		configure_msg_flush_threshold(char *);
 static int		configure_death_policy(char *);
 static int		configure_set_affinity(char *);
+static int		configure_worker_numa(char *);
+static int		configure_worker_numa_nic(char *);
 static int		configure_socket_backlog(char *);
+static int		configure_socket_reuseport(char *);
+static int		configure_socket_zerocopy(char *);
+static int		configure_socket_busy_poll(char *);
 static int		configure_privsep_skip(char *);
 static int		configure_privsep_root(char *);
 static int		configure_privsep_runas(char *);
@@ -101,9 +120,17 @@ static int		configure_add_pledge(char *);
 static int		configure_rand_file(char *);
 static int		configure_certfile(char *);
 static int		configure_certkey(char *);
+static int		configure_certocsp(char *);
 static int		configure_tls_version(char *);
+static int		configure_tls_ktls(char *);
+static int		configure_tls_handshake_threads(char *);
 static int		configure_tls_cipher(char *);
 static int		configure_tls_dhparam(char *);
+static int		configure_tls_record_threshold(char *);
+static int		configure_tls_record_idle(char *);
+static int		configure_tls_session_cache(char *);
+static int		configure_tls_ticket_rotate(char *);
+static int		configure_tls_ticket_keyfile(char *);
 static int		configure_client_verify(char *);
 static int		configure_client_verify_depth(char *);
 
@@ -115,27 +142,66 @@ static int		configure_route_on_free(char *);
 static int		configure_route_on_headers(char *);
 static int		configure_route_authenticate(char *);
 static int		configure_route_on_body_chunk(char *);
+static int		configure_route_offload(char *);
+static int		configure_route_multipart_stream(char *);
+static int		configure_route_body_digest(char *);
+static int		configure_route_cache(char *);
+static int		configure_route_cache_vary(char *);
+static int		configure_route_priority(char *);
 static int		configure_filemap(char *);
+static int		configure_metrics(char *);
 static int		configure_return(char *);
 static int		configure_redirect(char *);
 static int		configure_static_handler(char *);
 static int		configure_dynamic_handler(char *);
 static int		configure_accesslog(char *);
+static int		configure_accesslog_fsync(char *);
+static int		configure_accesslog_format(char *);
+static int		configure_accesslog_fields(char *);
 static int		configure_http_header_max(char *);
 static int		configure_http_header_timeout(char *);
 static int		configure_http_body_max(char *);
 static int		configure_http_body_timeout(char *);
 static int		configure_filemap_ext(char *);
 static int		configure_filemap_index(char *);
+static int		configure_filemap_cache_size(char *);
+static int		configure_filemap_cache_max(char *);
+static int		configure_filemap_resolve_ttl(char *);
+static int		configure_filemap_precompressed(char *);
+static int		configure_fileref_timeout(char *);
+static int		configure_fileref_revalidate(char *);
+static int		configure_fileref_cache_size(char *);
 static int		configure_http_media_type(char *);
 static int		configure_http_hsts_enable(char *);
 static int		configure_http_keepalive_time(char *);
 static int		configure_http_request_ms(char *);
 static int		configure_http_request_limit(char *);
+static int		configure_http_overload_target(char *);
+static int		configure_http_overload_interval(char *);
+static int		configure_http_slow_request_ms(char *);
+static int		configure_http_slow_request_rate(char *);
+static int		configure_http_slow_request_sample(char *);
 static int		configure_http_body_disk_offload(char *);
+static int		configure_http_multipart_field_max(char *);
+static int		configure_http_cache_size(char *);
+static int		configure_http_cache_max(char *);
+static int		configure_http_body_disk_buffer(char *);
+static int		configure_http_body_disk_tmpfile(char *);
 static int		configure_http_body_disk_path(char *);
 static int		configure_http_server_version(char *);
 static int		configure_http_pretty_error(char *);
+static int		configure_http2_enable(char *);
+static int		configure_http2_max_streams(char *);
+#if defined(KORE_USE_COMPRESS)
+static int		configure_compress(char *);
+static int		configure_compress_min_size(char *);
+static int		configure_compress_types(char *);
+static int		configure_http_compress_gzip_level(char *);
+#if defined(KORE_USE_BROTLI)
+static int		configure_http_compress_brotli_quality(char *);
+#endif
+static struct http_compress	*configure_compress_current(const char *);
+#endif
 static int		configure_validator(char *);
 static int		configure_validate(char *);
 static int		configure_authentication(char *);
@@ -143,28 +209,62 @@ static int		configure_authentication_uri(char *);
 static int		configure_authentication_type(char *);
 static int		configure_authentication_value(char *);
 static int		configure_authentication_validator(char *);
+static int		configure_authentication_cache(char *);
+static int		configure_authentication_cache_size(char *);
+static int		configure_route_proxy(char *);
+static int		configure_route_ratelimit(char *);
+static int		configure_upstream(char *);
+static int		configure_upstream_server(char *);
+static int		configure_upstream_balance(char *);
+static int		configure_upstream_keepalive(char *);
+static int		configure_upstream_keepalive_timeout(char *);
+static int		configure_upstream_max_fails(char *);
+static int		configure_upstream_fail_timeout(char *);
+static int		configure_upstream_connect_timeout(char *);
+static int		configure_upstream_timeout(char *);
+static int		configure_upstream_buffer_max(char *);
+static int		configure_upstream_number(const char *, char *,
+			    long long, u_int32_t *);
 static int		configure_websocket_maxframe(char *);
 static int		configure_websocket_timeout(char *);
+static int		configure_sse_history(char *);
+static int		configure_sse_heartbeat(char *);
+#if defined(KORE_USE_COMPRESS)
+static int		configure_websocket_deflate(char *);
+static int		configure_websocket_deflate_window(char *);
+static int		configure_websocket_deflate_memlevel(char *);
+static int		configure_websocket_deflate_takeover(char *);
+static int		configure_websocket_deflate_min_size(char *);
+#endif
 #endif
 
 #if defined(KORE_USE_PGSQL)
+static int		configure_pgsql_conn_min(char *);
+static int		configure_pgsql_cache_size(char *);
 static int		configure_pgsql_conn_max(char *);
 static int		configure_pgsql_queue_limit(char *);
 #endif
 
 #if defined(KORE_USE_TASKS)
 static int		configure_task_threads(char *);
+static int		configure_task_affinity(char *);
 #endif
 
 #if defined(KORE_USE_PYTHON)
 static int		configure_deployment(char *);
 static int		configure_python_path(char *);
 static int		configure_python_import(char *);
+static int		configure_python_coro_budget(char *);
+static int		configure_python_coro_budget_time(char *);
+static int		configure_python_gc_freeze(char *);
 #endif
 
 #if defined(KORE_USE_CURL)
 static int		configure_curl_timeout(char *);
 static int		configure_curl_recv_max(char *);
+static int		configure_curl_max_conns(char *);
+static int		configure_curl_max_host_conns(char *);
+static int		configure_curl_http2(char *);
 #endif
 
 #if defined(__linux__)
@@ -180,6 +280,8 @@ static struct {
 	{ "acme",			configure_acme },
 #endif
 	{ "bind",			configure_bind },
+	{ "proxy",			configure_proxy },
+	{ "ratelimit",			configure_ratelimit },
 	{ "load",			configure_load },
 	{ "domain",			configure_domain },
 	{ "privsep",			configure_privsep },
@@ -187,6 +289,7 @@ static struct {
 	{ "attach",			configure_attach },
 	{ "certkey",			configure_certkey },
 	{ "certfile",			configure_certfile },
+	{ "certocsp",			configure_certocsp },
 	{ "include",			configure_include },
 	{ "unix",			configure_bind_unix },
 	{ "skip",			configure_privsep_skip },
@@ -206,12 +309,26 @@ static struct {
 	{ "on_free",			configure_route_on_free },
 	{ "methods",			configure_route_methods },
 	{ "authenticate",		configure_route_authenticate },
+	{ "offload",			configure_route_offload },
+	{ "multipart_stream",		configure_route_multipart_stream },
+	{ "body_digest",		configure_route_body_digest },
+	{ "cache",			configure_route_cache },
+	{ "cache_vary",			configure_route_cache_vary },
+	{ "priority",			configure_route_priority },
 	{ "filemap",			configure_filemap },
+	{ "metrics",			configure_metrics },
 	{ "redirect",			configure_redirect },
 	{ "return",			configure_return },
 	{ "static",			configure_static_handler },
 	{ "dynamic",			configure_dynamic_handler },
 	{ "accesslog",			configure_accesslog },
+	{ "accesslog_format",		configure_accesslog_format },
+	{ "accesslog_fields",		configure_accesslog_fields },
+#if defined(KORE_USE_COMPRESS)
+	{ "compress",			configure_compress },
+	{ "compress_min_size",		configure_compress_min_size },
+	{ "compress_types",		configure_compress_types },
+#endif
 	{ "validator",			configure_validator },
 	{ "validate",			configure_validate },
 	{ "authentication",		configure_authentication },
@@ -219,6 +336,17 @@ static struct {
 	{ "authentication_type",	configure_authentication_type },
 	{ "authentication_value",	configure_authentication_value },
 	{ "authentication_validator",	configure_authentication_validator },
+	{ "authentication_cache",	configure_authentication_cache },
+	{ "upstream",			configure_upstream },
+	{ "upstream_server",		configure_upstream_server },
+	{ "upstream_balance",		configure_upstream_balance },
+	{ "upstream_keepalive",		configure_upstream_keepalive },
+	{ "upstream_keepalive_timeout",	configure_upstream_keepalive_timeout },
+	{ "upstream_max_fails",		configure_upstream_max_fails },
+	{ "upstream_fail_timeout",	configure_upstream_fail_timeout },
+	{ "upstream_connect_timeout",	configure_upstream_connect_timeout },
+	{ "upstream_timeout",		configure_upstream_timeout },
+	{ "upstream_buffer_max",	configure_upstream_buffer_max },
 #endif
 	{ NULL,				NULL },
 };
@@ -232,13 +360,37 @@ static struct {
 	{ "worker_max_connections",	configure_max_connections },
 	{ "worker_rlimit_nofiles",	configure_rlimit_nofiles },
 	{ "worker_accept_threshold",	configure_accept_threshold },
+	{ "worker_accept_exclusive",	configure_accept_exclusive },
+	{ "worker_event_batch",		configure_event_batch },
+	{ "worker_busy_poll",		configure_busy_poll },
+	{ "worker_msg_ring_size",	configure_msg_ring_size },
+	{ "worker_msg_flush_threshold",	configure_msg_flush_threshold },
 	{ "worker_death_policy",	configure_death_policy },
 	{ "worker_set_affinity",	configure_set_affinity },
+	{ "worker_numa",		configure_worker_numa },
+	{ "worker_numa_nic",		configure_worker_numa_nic },
 	{ "pidfile",			configure_pidfile },
+	{ "upgrade_drain_timeout",	configure_upgrade_drain_timeout },
 	{ "socket_backlog",		configure_socket_backlog },
+	{ "socket_reuseport",		configure_socket_reuseport },
+	{ "socket_zerocopy",		configure_socket_zerocopy },
+	{ "socket_busy_poll",		configure_socket_busy_poll },
+	{ "proxy_buffer",		configure_proxy_buffer },
+	{ "proxy_connect_timeout",	configure_proxy_connect_timeout },
+	{ "proxy_idle_timeout",		configure_proxy_idle_timeout },
+	{ "ratelimit_table_size",	configure_ratelimit_table_size },
+	{ "pool_idle_time",		configure_pool_idle_time },
+	{ "pool_hugepages",		configure_pool_hugepages },
 	{ "tls_version",		configure_tls_version },
 	{ "tls_cipher",			configure_tls_cipher },
+	{ "tls_ktls",			configure_tls_ktls },
+	{ "tls_handshake_threads",	configure_tls_handshake_threads },
 	{ "tls_dhparam",		configure_tls_dhparam },
+	{ "tls_record_threshold",	configure_tls_record_threshold },
+	{ "tls_record_idle",		configure_tls_record_idle },
+	{ "tls_session_cache",		configure_tls_session_cache },
+	{ "tls_ticket_rotate",		configure_tls_ticket_rotate },
+	{ "tls_ticket_keyfile",		configure_tls_ticket_keyfile },
 	{ "rand_file",			configure_rand_file },
 #if defined(KORE_USE_ACME)
 	{ "acme_email",			configure_acme_email },
@@ -251,8 +403,16 @@ static struct {
 	{ "seccomp_tracing",		configure_seccomp_tracing },
 #endif
 #if !defined(KORE_NO_HTTP)
+	{ "accesslog_fsync",		configure_accesslog_fsync },
 	{ "filemap_ext",		configure_filemap_ext },
 	{ "filemap_index",		configure_filemap_index },
+	{ "filemap_cache_size",		configure_filemap_cache_size },
+	{ "filemap_cache_max",		configure_filemap_cache_max },
+	{ "filemap_resolve_ttl",	configure_filemap_resolve_ttl },
+	{ "filemap_precompressed",	configure_filemap_precompressed },
+	{ "fileref_timeout",		configure_fileref_timeout },
+	{ "fileref_revalidate",		configure_fileref_revalidate },
+	{ "fileref_cache_size",		configure_fileref_cache_size },
 	{ "http_media_type",		configure_http_media_type },
 	{ "http_header_max",		configure_http_header_max },
 	{ "http_header_timeout",	configure_http_header_timeout },
@@ -262,26 +422,64 @@ static struct {
 	{ "http_keepalive_time",	configure_http_keepalive_time },
 	{ "http_request_ms",		configure_http_request_ms },
 	{ "http_request_limit",		configure_http_request_limit },
+	{ "http_overload_target",	configure_http_overload_target },
+	{ "http_overload_interval",	configure_http_overload_interval },
+	{ "http_slow_request_ms",	configure_http_slow_request_ms },
+	{ "http_slow_request_rate",	configure_http_slow_request_rate },
+	{ "http_slow_request_sample",	configure_http_slow_request_sample },
 	{ "http_body_disk_offload",	configure_http_body_disk_offload },
 	{ "http_body_disk_path",	configure_http_body_disk_path },
+	{ "http_body_disk_buffer",	configure_http_body_disk_buffer },
+	{ "http_body_disk_tmpfile",	configure_http_body_disk_tmpfile },
+	{ "http_multipart_field_max",	configure_http_multipart_field_max },
+	{ "http_cache_size",		configure_http_cache_size },
+	{ "http_cache_max",		configure_http_cache_max },
+	{ "authentication_cache_size",	configure_authentication_cache_size },
 	{ "http_server_version",	configure_http_server_version },
 	{ "http_pretty_error",		configure_http_pretty_error },
+	{ "http2_enable",		configure_http2_enable },
+	{ "http2_max_streams",		configure_http2_max_streams },
+#if defined(KORE_USE_COMPRESS)
+	{ "http_compress_gzip_level",	configure_http_compress_gzip_level },
+#if defined(KORE_USE_BROTLI)
+	{ "http_compress_brotli_quality",
+	    configure_http_compress_brotli_quality },
+#endif
+#endif
 	{ "websocket_maxframe",		configure_websocket_maxframe },
 	{ "websocket_timeout",		configure_websocket_timeout },
+	{ "sse_history",		configure_sse_history },
+	{ "sse_heartbeat",		configure_sse_heartbeat },
+#if defined(KORE_USE_COMPRESS)
+	{ "websocket_deflate",		configure_websocket_deflate },
+	{ "websocket_deflate_window",	configure_websocket_deflate_window },
+	{ "websocket_deflate_memlevel",	configure_websocket_deflate_memlevel },
+	{ "websocket_deflate_takeover",	configure_websocket_deflate_takeover },
+	{ "websocket_deflate_min_size",	configure_websocket_deflate_min_size },
+#endif
 #endif
 #if defined(KORE_USE_PYTHON)
 	{ "deployment",			configure_deployment },
+	{ "python_coro_budget",		configure_python_coro_budget },
+	{ "python_coro_budget_time",	configure_python_coro_budget_time },
+	{ "python_gc_freeze",		configure_python_gc_freeze },
 #endif
 #if defined(KORE_USE_PGSQL)
+	{ "pgsql_conn_min",		configure_pgsql_conn_min },
+	{ "pgsql_cache_size",		configure_pgsql_cache_size },
 	{ "pgsql_conn_max",		configure_pgsql_conn_max },
 	{ "pgsql_queue_limit",		configure_pgsql_queue_limit },
 #endif
 #if defined(KORE_USE_TASKS)
 	{ "task_threads",		configure_task_threads },
+	{ "task_affinity",		configure_task_affinity },
 #endif
 #if defined(KORE_USE_CURL)
 	{ "curl_timeout",		configure_curl_timeout },
 	{ "curl_recv_max",		configure_curl_recv_max },
+	{ "curl_max_conns",		configure_curl_max_conns },
+	{ "curl_max_host_conns",	configure_curl_max_host_conns },
+	{ "curl_http2",			configure_curl_http2 },
 #endif
 #if !defined(KORE_SINGLE_BINARY) && defined(KORE_USE_PYTHON)
 	{ "file",			configure_file },
@@ -298,6 +496,7 @@ char					*config_file = NULL;
 #if !defined(KORE_NO_HTTP)
 static struct kore_auth			*current_auth = NULL;
 static struct kore_route		*current_route = NULL;
+static struct kore_upstream		*current_upstream = NULL;
 #endif
 
 extern const char			*__progname;
@@ -440,6 +639,15 @@ kore_parse_config_file(FILE *fp)
 			current_auth = NULL;
 			continue;
 		}
+
+		if (!strcmp(p, "}") && current_upstream != NULL) {
+			if (!kore_upstream_finalize(current_upstream))
+				fatal("bad upstream %s", current_upstream->name);
+
+			lineno++;
+			current_upstream = NULL;
+			continue;
+		}
 #endif
 
 		if (!strcmp(p, "}") && current_domain != NULL) {
@@ -721,6 +929,96 @@ configure_bind(char *options)
 	return (kore_server_bind(current_server, argv[0], argv[1], argv[2]));
 }
 
+static int
+configure_proxy(char *options)
+{
+	char		*argv[3];
+
+#if !defined(KORE_NO_HTTP)
+	if (current_route != NULL)
+		return (configure_route_proxy(options));
+#endif
+
+	if (current_server == NULL) {
+		kore_log(LOG_ERR, "proxy keyword not inside a server context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_split_string(options, " ", argv, 3);
+	if (argv[0] == NULL || argv[1] == NULL) {
+		kore_log(LOG_ERR, "proxy requires a host and port");
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (kore_proxy_configure(current_server, argv[0], argv[1]));
+}
+
+static int
+configure_ratelimit(char *options)
+{
+	int		err;
+	char		*argv[5];
+	u_int32_t	count, period, burst;
+
+#if !defined(KORE_NO_HTTP)
+	if (current_route != NULL)
+		return (configure_route_ratelimit(options));
+#endif
+
+	if (current_server != NULL) {
+		if (current_server->ratelimit != NULL) {
+			kore_log(LOG_ERR, "server '%s' already has a ratelimit",
+			    current_server->name);
+			return (KORE_RESULT_ERROR);
+		}
+
+		current_server->ratelimit = kore_ratelimit_lookup(options);
+		if (current_server->ratelimit == NULL) {
+			kore_log(LOG_ERR, "no such ratelimit '%s' for '%s'",
+			    options, current_server->name);
+			return (KORE_RESULT_ERROR);
+		}
+
+		return (KORE_RESULT_OK);
+	}
+
+	kore_split_string(options, " ", argv, 5);
+	if (argv[0] == NULL || argv[1] == NULL || argv[2] == NULL) {
+		kore_log(LOG_ERR,
+		    "ratelimit requires a name, count and period");
+		return (KORE_RESULT_ERROR);
+	}
+
+	count = kore_strtonum(argv[1], 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad ratelimit count '%s'", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	period = kore_strtonum(argv[2], 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad ratelimit period '%s'", argv[2]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (argv[3] != NULL) {
+		burst = kore_strtonum(argv[3], 10, 1, UINT_MAX, &err);
+		if (err != KORE_RESULT_OK) {
+			kore_log(LOG_ERR, "bad ratelimit burst '%s'", argv[3]);
+			return (KORE_RESULT_ERROR);
+		}
+	} else {
+		burst = count;
+	}
+
+	if (!kore_ratelimit_add(argv[0], count, period, burst)) {
+		kore_log(LOG_ERR, "ratelimit '%s' already exists", argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_bind_unix(char *options)
 {
@@ -826,6 +1124,48 @@ configure_tls_version(char *version)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_tls_ktls(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		kore_tls_ktls_set(0);
+	} else if (!strcmp(yesno, "yes")) {
+		kore_tls_ktls_set(1);
+	} else {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for yes|no tls_ktls option", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_tls_handshake_threads(char *option)
+{
+	int		err;
+	u_int16_t	threads;
+
+	threads = kore_strtonum(option, 10, 0, 64, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad tls_handshake_threads value: '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+#if !defined(KORE_USE_TASKS)
+	if (threads > 0) {
+		kore_log(LOG_ERR,
+		    "tls_handshake_threads requires a TASKS=1 build");
+		return (KORE_RESULT_ERROR);
+	}
+#endif
+
+	kore_tls_handshake_threads_set(threads);
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_tls_cipher(char *cipherlist)
 {
@@ -838,6 +1178,84 @@ configure_tls_dhparam(char *path)
 	return (kore_tls_dh_load(path));
 }
 
+static int
+configure_tls_record_threshold(char *option)
+{
+	int		err;
+	u_int32_t	bytes;
+
+	bytes = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad tls_record_threshold value: '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_tls_record_threshold_set(bytes);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_tls_record_idle(char *option)
+{
+	int		err;
+	u_int32_t	ms;
+
+	ms = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad tls_record_idle value: '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_tls_record_idle_set(ms);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_tls_session_cache(char *option)
+{
+	int		err;
+	u_int32_t	entries;
+
+	entries = kore_strtonum(option, 10, 0, 1 << 24, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad tls_session_cache value: '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_tls_session_cache_set(entries);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_tls_ticket_rotate(char *option)
+{
+	int		err;
+
+	kore_tls_ticket_rotate = kore_strtonum(option, 10, 0,
+	    UINT_MAX / 1000, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad tls_ticket_rotate value: '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_tls_ticket_keyfile(char *path)
+{
+	if (kore_tls_ticket_file != NULL)
+		kore_free(kore_tls_ticket_file);
+
+	kore_tls_ticket_file = kore_strdup(path);
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_client_verify_depth(char *value)
 {
@@ -929,6 +1347,20 @@ configure_certkey(char *path)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_certocsp(char *path)
+{
+	if (current_domain == NULL) {
+		kore_log(LOG_ERR,
+		    "certocsp keyword not specified in domain context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_free(current_domain->ocspfile);
+	current_domain->ocspfile = kore_strdup(path);
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_privsep(char *options)
 {
@@ -1225,75 +1657,70 @@ configure_route_authenticate(char *name)
 }
 
 static int
-configure_route_methods(char *options)
+configure_route_offload(char *yesno)
 {
-	int			i, cnt;
-	char			*argv[10];
-
 	if (current_route == NULL) {
 		kore_log(LOG_ERR,
-		    "methods keyword not inside of route context");
+		    "offload keyword not inside of route context");
 		return (KORE_RESULT_ERROR);
 	}
 
-	cnt = kore_split_string(options, " ", argv, 10);
-	if (cnt < 1) {
-		kore_log(LOG_ERR,
-		    "bad methods option '%s', missing methods", options);
+	if (!strcmp(yesno, "no")) {
+		current_route->offload = 0;
+	} else if (!strcmp(yesno, "yes")) {
+#if defined(KORE_USE_TASKS)
+		current_route->offload = 1;
+#else
+		kore_log(LOG_ERR, "offload requires a TASKS=1 build");
+		return (KORE_RESULT_ERROR);
+#endif
+	} else {
+		kore_log(LOG_ERR, "invalid '%s' for yes|no offload option",
+		    yesno);
 		return (KORE_RESULT_ERROR);
-	}
-
-	current_route->methods = 0;
-
-	for (i = 0; i < cnt; i++) {
-		if (!strcasecmp(argv[i], "post")) {
-			current_route->methods |= HTTP_METHOD_POST;
-		} else if (!strcasecmp(argv[i], "get")) {
-			current_route->methods |= HTTP_METHOD_GET;
-		} else if (!strcasecmp(argv[i], "put")) {
-			current_route->methods |= HTTP_METHOD_PUT;
-		} else if (!strcasecmp(argv[i], "delete")) {
-			current_route->methods |= HTTP_METHOD_DELETE;
-		} else if (!strcasecmp(argv[i], "head")) {
-			current_route->methods |= HTTP_METHOD_HEAD;
-		} else if (!strcasecmp(argv[i], "patch")) {
-			current_route->methods |= HTTP_METHOD_PATCH;
-		} else {
-			kore_log(LOG_ERR, "unknown method: %s in method for %s",
-			    argv[i], current_route->path);
-			return (KORE_RESULT_ERROR);
-		}
 	}
 
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_return(char *options)
+configure_route_multipart_stream(char *yesno)
 {
-	char		*argv[3];
-	int		elm, status, err;
-
-	if (current_domain == NULL) {
-		kore_log(LOG_ERR, "return keyword not in domain context");
+	if (current_route == NULL) {
+		kore_log(LOG_ERR,
+		    "multipart_stream keyword not inside of route context");
 		return (KORE_RESULT_ERROR);
 	}
 
-	elm = kore_split_string(options, " ", argv, 3);
-	if (elm != 2) {
-		kore_log(LOG_ERR, "missing parameters for return");
+	if (!strcmp(yesno, "no")) {
+		current_route->multipart = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		current_route->multipart = 1;
+	} else {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for yes|no multipart_stream option", yesno);
 		return (KORE_RESULT_ERROR);
 	}
 
-	status = kore_strtonum(argv[1], 10, 400, 600, &err);
-	if (err != KORE_RESULT_OK) {
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_route_body_digest(char *yesno)
+{
+	if (current_route == NULL) {
 		kore_log(LOG_ERR,
-		    "invalid status code on return (%s)", argv[1]);
+		    "body_digest keyword not inside of route context");
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (!http_redirect_add(current_domain, argv[0], status, NULL)) {
-		kore_log(LOG_ERR, "invalid regex on return path");
+	if (!strcmp(yesno, "no")) {
+		current_route->digest = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		current_route->digest = 1;
+	} else {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for yes|no body_digest option", yesno);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1301,32 +1728,197 @@ configure_return(char *options)
 }
 
 static int
-configure_redirect(char *options)
+configure_route_cache(char *options)
 {
-	char		*argv[4];
-	int		elm, status, err;
+	int		err;
+	char		*argv[3];
+	u_int64_t	ttl, stale;
 
-	if (current_domain == NULL) {
-		kore_log(LOG_ERR, "redirect keyword not in domain context");
+	if (current_route == NULL) {
+		kore_log(LOG_ERR,
+		    "cache keyword not inside of route context");
 		return (KORE_RESULT_ERROR);
 	}
 
-	elm = kore_split_string(options, " ", argv, 4);
-	if (elm != 3) {
-		kore_log(LOG_ERR, "missing parameters for redirect");
+	kore_split_string(options, " ", argv, 3);
+	if (argv[0] == NULL) {
+		kore_log(LOG_ERR, "cache requires a ttl");
 		return (KORE_RESULT_ERROR);
 	}
 
-	status = kore_strtonum(argv[1], 10, 300, 399, &err);
-	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR,
-		    "invalid status code on redirect (%s)", argv[1]);
+	ttl = kore_strtonum64(argv[0], 0, &err);
+	if (err != KORE_RESULT_OK || ttl == 0) {
+		kore_log(LOG_ERR, "bad cache ttl '%s'", argv[0]);
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (!http_redirect_add(current_domain, argv[0], status, argv[2])) {
-		kore_log(LOG_ERR, "invalid regex on redirect path");
-		return (KORE_RESULT_ERROR);
+	stale = 0;
+	if (argv[1] != NULL) {
+		stale = kore_strtonum64(argv[1], 0, &err);
+		if (err != KORE_RESULT_OK) {
+			kore_log(LOG_ERR, "bad cache stale '%s'", argv[1]);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (current_route->cache == NULL)
+		current_route->cache = kore_calloc(1, sizeof(struct http_cache));
+
+	current_route->cache->ttl = ttl;
+	current_route->cache->stale = stale;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_route_cache_vary(char *options)
+{
+	int			i, cnt;
+	struct http_cache	*conf;
+	char			*argv[HTTP_CACHE_VARY_MAX + 1];
+
+	if (current_route == NULL || current_route->cache == NULL) {
+		kore_log(LOG_ERR,
+		    "cache_vary keyword not after cache in a route");
+		return (KORE_RESULT_ERROR);
+	}
+
+	conf = current_route->cache;
+
+	cnt = kore_split_string(options, " ", argv, HTTP_CACHE_VARY_MAX + 1);
+	if (cnt < 1 || conf->nvary + cnt > HTTP_CACHE_VARY_MAX) {
+		kore_log(LOG_ERR, "cache_vary takes 1 to %d headers",
+		    HTTP_CACHE_VARY_MAX);
+		return (KORE_RESULT_ERROR);
+	}
+
+	for (i = 0; i < cnt; i++)
+		conf->vary[conf->nvary++] = kore_strdup(argv[i]);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_route_priority(char *option)
+{
+	if (current_route == NULL) {
+		kore_log(LOG_ERR,
+		    "priority keyword not inside of route context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if ((current_route->priority = http_overload_priority(option)) == -1) {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for low|normal|high priority option", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_route_methods(char *options)
+{
+	int			i, cnt;
+	char			*argv[10];
+
+	if (current_route == NULL) {
+		kore_log(LOG_ERR,
+		    "methods keyword not inside of route context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	cnt = kore_split_string(options, " ", argv, 10);
+	if (cnt < 1) {
+		kore_log(LOG_ERR,
+		    "bad methods option '%s', missing methods", options);
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_route->methods = 0;
+
+	for (i = 0; i < cnt; i++) {
+		if (!strcasecmp(argv[i], "post")) {
+			current_route->methods |= HTTP_METHOD_POST;
+		} else if (!strcasecmp(argv[i], "get")) {
+			current_route->methods |= HTTP_METHOD_GET;
+		} else if (!strcasecmp(argv[i], "put")) {
+			current_route->methods |= HTTP_METHOD_PUT;
+		} else if (!strcasecmp(argv[i], "delete")) {
+			current_route->methods |= HTTP_METHOD_DELETE;
+		} else if (!strcasecmp(argv[i], "head")) {
+			current_route->methods |= HTTP_METHOD_HEAD;
+		} else if (!strcasecmp(argv[i], "patch")) {
+			current_route->methods |= HTTP_METHOD_PATCH;
+		} else {
+			kore_log(LOG_ERR, "unknown method: %s in method for %s",
+			    argv[i], current_route->path);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_return(char *options)
+{
+	char		*argv[3];
+	int		elm, status, err;
+
+	if (current_domain == NULL) {
+		kore_log(LOG_ERR, "return keyword not in domain context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	elm = kore_split_string(options, " ", argv, 3);
+	if (elm != 2) {
+		kore_log(LOG_ERR, "missing parameters for return");
+		return (KORE_RESULT_ERROR);
+	}
+
+	status = kore_strtonum(argv[1], 10, 400, 600, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "invalid status code on return (%s)", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!http_redirect_add(current_domain, argv[0], status, NULL)) {
+		kore_log(LOG_ERR, "invalid regex on return path");
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_redirect(char *options)
+{
+	char		*argv[4];
+	int		elm, status, err;
+
+	if (current_domain == NULL) {
+		kore_log(LOG_ERR, "redirect keyword not in domain context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	elm = kore_split_string(options, " ", argv, 4);
+	if (elm != 3) {
+		kore_log(LOG_ERR, "missing parameters for redirect");
+		return (KORE_RESULT_ERROR);
+	}
+
+	status = kore_strtonum(argv[1], 10, 300, 399, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "invalid status code on redirect (%s)", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!http_redirect_add(current_domain, argv[0], status, argv[2])) {
+		kore_log(LOG_ERR, "invalid regex on redirect path");
+		return (KORE_RESULT_ERROR);
 	}
 
 	return (KORE_RESULT_OK);
@@ -1357,6 +1949,27 @@ configure_filemap(char *options)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_metrics(char *path)
+{
+	if (current_domain == NULL) {
+		kore_log(LOG_ERR, "metrics keyword not in domain context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (path[0] != '/') {
+		kore_log(LOG_ERR, "metrics path '%s' is not absolute", path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!kore_metrics_route(current_domain, path)) {
+		kore_log(LOG_ERR, "cannot create metrics route %s", path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_accesslog(char *path)
 {
@@ -1371,10 +1984,7 @@ configure_accesslog(char *path)
 		return (KORE_RESULT_ERROR);
 	}
 
-	current_domain->accesslog = open(path,
-	    O_CREAT | O_APPEND | O_WRONLY,
-	    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (current_domain->accesslog == -1) {
+	if (!kore_domain_accesslog(current_domain, path)) {
 		kore_log(LOG_ERR, "accesslog open(%s): %s", path, errno_s);
 		return (KORE_RESULT_ERROR);
 	}
@@ -1382,6 +1992,82 @@ configure_accesslog(char *path)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_accesslog_format(char *format)
+{
+	if (current_domain == NULL) {
+		kore_debug("accesslog_format not specified in domain\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!strcmp(format, "clf")) {
+		current_domain->accesslog_format = KORE_ALOG_FORMAT_CLF;
+	} else if (!strcmp(format, "json")) {
+		current_domain->accesslog_format = KORE_ALOG_FORMAT_JSON;
+	} else if (!strcmp(format, "binary")) {
+		if (current_domain->accesslog_ship == KORE_ALOG_SHIP_SYSLOG) {
+			kore_log(LOG_ERR,
+			    "binary accesslogs cannot go to syslog");
+			return (KORE_RESULT_ERROR);
+		}
+		current_domain->accesslog_format = KORE_ALOG_FORMAT_BINARY;
+	} else {
+		kore_log(LOG_ERR, "unknown accesslog_format '%s'", format);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_accesslog_fields(char *options)
+{
+	int			i, cnt;
+	u_int32_t		flag, fields;
+	char			*argv[KORE_ALOG_FIELDS_MAX + 2];
+
+	if (current_domain == NULL) {
+		kore_debug("accesslog_fields not specified in domain\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	cnt = kore_split_string(options, " ,", argv, KORE_ALOG_FIELDS_MAX + 2);
+	if (cnt < 1 || cnt > KORE_ALOG_FIELDS_MAX) {
+		kore_log(LOG_ERR, "accesslog_fields takes 1 to %d fields",
+		    KORE_ALOG_FIELDS_MAX);
+		return (KORE_RESULT_ERROR);
+	}
+
+	fields = 0;
+
+	for (i = 0; i < cnt; i++) {
+		if ((flag = kore_accesslog_field(argv[i])) == 0) {
+			kore_log(LOG_ERR,
+			    "unknown accesslog field '%s'", argv[i]);
+			return (KORE_RESULT_ERROR);
+		}
+		fields |= flag;
+	}
+
+	current_domain->accesslog_fields = fields;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_accesslog_fsync(char *option)
+{
+	int		err;
+
+	kore_accesslog_fsync = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad accesslog_fsync value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_filemap_ext(char *ext)
 {
@@ -1401,72 +2087,1128 @@ configure_filemap_index(char *index)
 }
 
 static int
-configure_http_media_type(char *type)
+configure_filemap_cache_size(char *option)
 {
-	int		i;
-	char		*extensions, *ext[10];
+	int	err;
 
-	extensions = strchr(type, ' ');
-	if (extensions == NULL) {
-		kore_log(LOG_ERR, "bad http_media_type value '%s'", type);
+	kore_filemap_cache_size = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad filemap_cache_size value '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
-	*(extensions)++ = '\0';
+	return (KORE_RESULT_OK);
+}
 
-	kore_split_string(extensions, " \t", ext, 10);
-	for (i = 0; ext[i] != NULL; i++) {
-		if (!http_media_register(ext[i], type)) {
-			kore_log(LOG_ERR,
-			    "duplicate extension found '%s'", ext[i]);
-			return (KORE_RESULT_ERROR);
-		}
+static int
+configure_filemap_cache_max(char *option)
+{
+	int	err;
+
+	kore_filemap_cache_max = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad filemap_cache_max value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_filemap_resolve_ttl(char *option)
+{
+	int	err;
+
+	kore_filemap_resolve_ttl = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad filemap_resolve_ttl value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_filemap_precompressed(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		kore_filemap_precompressed = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		kore_filemap_precompressed = 1;
+	} else {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for yes|no filemap_precompressed option",
+		    yesno);
+		return (KORE_RESULT_ERROR);
 	}
 
-	if (i == 0) {
-		kore_log(LOG_ERR, "missing extensions in '%s'", type);
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_fileref_timeout(char *option)
+{
+	int	err;
+
+	kore_fileref_timeout = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK || kore_fileref_timeout == 0) {
+		kore_log(LOG_ERR, "bad fileref_timeout value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_fileref_timeout = kore_fileref_timeout * 1000;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_fileref_revalidate(char *option)
+{
+	int	err;
+
+	kore_fileref_revalidate = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad fileref_revalidate value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_fileref_cache_size(char *option)
+{
+	int	err;
+
+	kore_fileref_cache_size = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad fileref_cache_size value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_media_type(char *type)
+{
+	int		i;
+	char		*extensions, *ext[10];
+
+	extensions = strchr(type, ' ');
+	if (extensions == NULL) {
+		kore_log(LOG_ERR, "bad http_media_type value '%s'", type);
+		return (KORE_RESULT_ERROR);
+	}
+
+	*(extensions)++ = '\0';
+
+	kore_split_string(extensions, " \t", ext, 10);
+	for (i = 0; ext[i] != NULL; i++) {
+		if (!http_media_register(ext[i], type)) {
+			kore_log(LOG_ERR,
+			    "duplicate extension found '%s'", ext[i]);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (i == 0) {
+		kore_log(LOG_ERR, "missing extensions in '%s'", type);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_header_max(char *option)
+{
+	int		err;
+
+	http_header_max = kore_strtonum(option, 10, 1, 65535, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad http_header_max value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_header_timeout(char *option)
+{
+	int		err;
+
+	http_header_timeout = kore_strtonum(option, 10, 1, 65535, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad http_header_timeout value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_body_max(char *option)
+{
+	int		err;
+
+	http_body_max = kore_strtonum(option, 10, 0, LONG_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad http_body_max value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_body_timeout(char *option)
+{
+	int		err;
+
+	http_body_timeout = kore_strtonum(option, 10, 1, 65535, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad http_body_timeout value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_body_disk_offload(char *option)
+{
+	int		err;
+
+	http_body_disk_offload = kore_strtonum(option, 10, 0, LONG_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_body_disk_offload value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_body_disk_buffer(char *option)
+{
+	int		err;
+
+	http_body_disk_buffer = kore_strtonum(option, 10, 0, INT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_body_disk_buffer value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_body_disk_tmpfile(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		http_body_disk_tmpfile = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		http_body_disk_tmpfile = 1;
+	} else {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for yes|no http_body_disk_tmpfile option",
+		    yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_multipart_field_max(char *option)
+{
+	int		err;
+
+	http_multipart_field_max = kore_strtonum(option, 10, 1, LONG_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_multipart_field_max value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_cache_size(char *option)
+{
+	int	err;
+
+	http_cache_size = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad http_cache_size value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_cache_max(char *option)
+{
+	int	err;
+
+	http_cache_max = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad http_cache_max value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_body_disk_path(char *path)
+{
+	if (strcmp(http_body_disk_path, HTTP_BODY_DISK_PATH))
+		kore_free(http_body_disk_path);
+
+	http_body_disk_path = kore_strdup(path);
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_server_version(char *version)
+{
+	http_server_version(version);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_pretty_error(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		http_pretty_error = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		http_pretty_error = 1;
+	} else {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for yes|no http_pretty_error option", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http2_enable(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		http2_enable = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		http2_enable = 1;
+	} else {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for yes|no http2_enable option", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http2_max_streams(char *option)
+{
+	int		err;
+
+	http2_max_streams = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad http2_max_streams value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+#if defined(KORE_USE_COMPRESS)
+/*
+ * Compression settings inside a route start from those of its domain
+ * at that point and apply to that route only.
+ */
+static struct http_compress *
+configure_compress_current(const char *keyword)
+{
+	if (current_domain == NULL) {
+		kore_log(LOG_ERR, "%s keyword not in domain context", keyword);
+		return (NULL);
+	}
+
+	if (current_route != NULL) {
+		if (current_route->compress == NULL) {
+			current_route->compress =
+			    http_compress_conf_create(current_domain->compress);
+		}
+		return (current_route->compress);
+	}
+
+	if (current_domain->compress == NULL)
+		current_domain->compress = http_compress_conf_create(NULL);
+
+	return (current_domain->compress);
+}
+
+static int
+configure_compress(char *options)
+{
+	int			i, cnt, enc;
+	struct http_compress	*conf;
+	char			*argv[HTTP_COMPRESS_MAX + 2];
+
+	if ((conf = configure_compress_current("compress")) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	cnt = kore_split_string(options, " ", argv, HTTP_COMPRESS_MAX + 2);
+	if (cnt < 1) {
+		kore_log(LOG_ERR, "missing encodings for compress");
+		return (KORE_RESULT_ERROR);
+	}
+
+	conf->encodings = 0;
+
+	if (cnt == 1 && !strcmp(argv[0], "no"))
+		return (KORE_RESULT_OK);
+
+	for (i = 0; i < cnt; i++) {
+		if ((enc = http_compress_encoding(argv[i])) == -1) {
+			kore_log(LOG_ERR,
+			    "unknown or unsupported encoding '%s'", argv[i]);
+			return (KORE_RESULT_ERROR);
+		}
+		conf->encodings |= (1 << enc);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_compress_min_size(char *option)
+{
+	int			err;
+	struct http_compress	*conf;
+
+	if ((conf = configure_compress_current("compress_min_size")) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	conf->min_size = kore_strtonum(option, 10, 0, LONG_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad compress_min_size value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_compress_types(char *options)
+{
+	int			i, cnt;
+	struct http_compress	*conf;
+	char			*argv[HTTP_COMPRESS_TYPES_MAX + 2];
+
+	if ((conf = configure_compress_current("compress_types")) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	cnt = kore_split_string(options, " ", argv,
+	    HTTP_COMPRESS_TYPES_MAX + 2);
+	if (cnt < 1 || cnt > HTTP_COMPRESS_TYPES_MAX) {
+		kore_log(LOG_ERR, "compress_types takes 1 to %d media types",
+		    HTTP_COMPRESS_TYPES_MAX);
+		return (KORE_RESULT_ERROR);
+	}
+
+	for (i = 0; i < conf->ntypes; i++)
+		kore_free(conf->types[i]);
+
+	for (i = 0; i < cnt; i++)
+		conf->types[i] = kore_strdup(argv[i]);
+
+	conf->ntypes = cnt;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_compress_gzip_level(char *option)
+{
+	int		err;
+
+	http_compress_gzip_level = kore_strtonum(option, 10, 1, 9, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_compress_gzip_level value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+#if defined(KORE_USE_BROTLI)
+static int
+configure_http_compress_brotli_quality(char *option)
+{
+	int		err;
+
+	http_compress_brotli_quality = kore_strtonum(option, 10, 0, 11, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_compress_brotli_quality value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+#endif
+#endif
+
+static int
+configure_http_hsts_enable(char *option)
+{
+	int		err;
+
+	http_hsts_enable = kore_strtonum(option, 10, 0, LONG_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad http_hsts_enable value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_keepalive_time(char *option)
+{
+	int		err;
+
+	http_keepalive_time = kore_strtonum(option, 10, 0, USHRT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_keepalive_time value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_request_ms(char *option)
+{
+	int		err;
+
+	http_request_ms = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad http_request_ms value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_request_limit(char *option)
+{
+	int		err;
+
+	http_request_limit = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad http_request_limit value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_overload_target(char *option)
+{
+	int		err;
+
+	http_overload_target = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_overload_target value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_overload_interval(char *option)
+{
+	int		err;
+
+	http_overload_interval = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_overload_interval value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_slow_request_ms(char *option)
+{
+	int		err;
+
+	http_slow_request_ms = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_slow_request_ms value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_slow_request_rate(char *option)
+{
+	int		err;
+
+	http_slow_request_rate = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_slow_request_rate value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_slow_request_sample(char *option)
+{
+	int		err;
+
+	http_slow_request_sample = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad http_slow_request_sample value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_validator(char *name)
+{
+	u_int8_t	type;
+	char		*tname, *value;
+
+	if ((tname = strchr(name, ' ')) == NULL) {
+		kore_log(LOG_ERR, "missing validator name");
+		return (KORE_RESULT_ERROR);
+	}
+
+	*(tname)++ = '\0';
+	tname = kore_text_trim(tname, strlen(tname));
+	if ((value = strchr(tname, ' ')) == NULL) {
+		kore_log(LOG_ERR, "missing validator value");
+		return (KORE_RESULT_ERROR);
+	}
+
+	*(value)++ = '\0';
+	value = kore_text_trim(value, strlen(value));
+
+	if (!strcmp(tname, "regex")) {
+		type = KORE_VALIDATOR_TYPE_REGEX;
+	} else if (!strcmp(tname, "function")) {
+		type = KORE_VALIDATOR_TYPE_FUNCTION;
+	} else {
+		kore_log(LOG_ERR,
+		    "bad type '%s' for validator '%s'", tname, name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!kore_validator_add(name, type, value)) {
+		kore_log(LOG_ERR, "bad validator specified for '%s'", name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_validate(char *options)
+{
+	struct kore_validator		*val;
+	struct kore_route_params	*param;
+	char				*method, *argv[4];
+	int				flags, http_method;
+
+	if (kore_split_string(options, " ", argv, 4) != 3) {
+		kore_log(LOG_ERR,
+		    "validate keyword needs 3 args: method param validator");
+		return (KORE_RESULT_ERROR);
+	}
+
+	flags = 0;
+
+	if ((method = strchr(argv[0], ':')) != NULL) {
+		*(method)++ = '\0';
+		if (!strcasecmp(argv[0], "qs")) {
+			flags = KORE_PARAMS_QUERY_STRING;
+		} else {
+			kore_log(LOG_ERR,
+			    "unknown validate method prefix '%s' for '%s'",
+			    argv[0], current_route->path);
+			return (KORE_RESULT_ERROR);
+		}
+	} else {
+		method = argv[0];
+	}
+
+	if ((val = kore_validator_lookup(argv[2])) == NULL) {
+		kore_log(LOG_ERR, "unknown validator '%s'", argv[2]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!strcasecmp(method, "post")) {
+		http_method = HTTP_METHOD_POST;
+	} else if (!strcasecmp(method, "get")) {
+		http_method = HTTP_METHOD_GET;
+		/* Let params get /foo {} imply qs:get automatically. */
+		flags |= KORE_PARAMS_QUERY_STRING;
+	} else if (!strcasecmp(method, "put")) {
+		http_method = HTTP_METHOD_PUT;
+	} else if (!strcasecmp(method, "delete")) {
+		http_method = HTTP_METHOD_DELETE;
+	} else if (!strcasecmp(method, "head")) {
+		http_method = HTTP_METHOD_HEAD;
+	} else if (!strcasecmp(method, "patch")) {
+		http_method = HTTP_METHOD_PATCH;
+	} else {
+		kore_log(LOG_ERR, "unknown method: %s in validator for %s",
+		    method, current_route->path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!(current_route->methods & http_method)) {
+		kore_log(LOG_ERR, "method '%s' not enabled for route '%s'",
+		    method, current_route->path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	param = kore_calloc(1, sizeof(*param));
+
+	param->flags = flags;
+	param->validator = val;
+	param->method = http_method;
+	param->name = kore_strdup(argv[1]);
+
+	TAILQ_INSERT_TAIL(&current_route->params, param, list);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_authentication(char *options)
+{
+	char		*argv[3];
+
+	if (current_auth != NULL) {
+		kore_log(LOG_ERR, "previous authentication block not closed");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_split_string(options, " ", argv, 3);
+	if (argv[1] == NULL) {
+		kore_log(LOG_ERR, "missing name for authentication block");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (strcmp(argv[1], "{")) {
+		kore_log(LOG_ERR, "missing { for authentication block");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!kore_auth_new(argv[0]))
+		return (KORE_RESULT_ERROR);
+
+	current_auth = kore_auth_lookup(argv[0]);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_authentication_type(char *option)
+{
+	if (current_auth == NULL) {
+		kore_log(LOG_ERR,
+		    "authentication_type keyword not in correct context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!strcmp(option, "cookie")) {
+		current_auth->type = KORE_AUTH_TYPE_COOKIE;
+	} else if (!strcmp(option, "header")) {
+		current_auth->type = KORE_AUTH_TYPE_HEADER;
+	} else if (!strcmp(option, "request")) {
+		current_auth->type = KORE_AUTH_TYPE_REQUEST;
+	} else {
+		kore_log(LOG_ERR, "unknown authentication type '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_authentication_value(char *option)
+{
+	if (current_auth == NULL) {
+		kore_log(LOG_ERR,
+		    "authentication_value keyword not in correct context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (current_auth->value != NULL)
+		kore_free(current_auth->value);
+	current_auth->value = kore_strdup(option);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_authentication_validator(char *validator)
+{
+	struct kore_validator		*val;
+
+	if (current_auth == NULL) {
+		kore_log(LOG_ERR,
+		    "authentication_validator not in correct context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if ((val = kore_validator_lookup(validator)) == NULL) {
+		kore_log(LOG_ERR,
+		    "authentication validator '%s' not found", validator);
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_auth->validator = val;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_authentication_cache(char *options)
+{
+	int		err;
+	char		*argv[3];
+
+	if (current_auth == NULL) {
+		kore_log(LOG_ERR,
+		    "authentication_cache keyword not in correct context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_split_string(options, " ", argv, 3);
+	if (argv[0] == NULL) {
+		kore_log(LOG_ERR, "authentication_cache needs a ttl");
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_auth->cache_ttl = kore_strtonum(argv[0], 10,
+	    0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad authentication_cache ttl '%s'", argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (argv[1] != NULL) {
+		current_auth->cache_fail_ttl = kore_strtonum(argv[1], 10,
+		    0, UINT_MAX, &err);
+		if (err != KORE_RESULT_OK) {
+			kore_log(LOG_ERR,
+			    "bad authentication_cache fail ttl '%s'", argv[1]);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_authentication_cache_size(char *option)
+{
+	int		err;
+
+	kore_auth_cache_size = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad authentication_cache_size value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_authentication_uri(char *uri)
+{
+	if (current_auth == NULL) {
+		kore_log(LOG_ERR,
+		    "authentication_uri keyword not in correct context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (current_auth->redirect != NULL)
+		kore_free(current_auth->redirect);
+	current_auth->redirect = kore_strdup(uri);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_route_proxy(char *name)
+{
+	if (current_route->upstream != NULL) {
+		kore_log(LOG_ERR, "route '%s' already has an upstream",
+		    current_route->path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if ((current_route->upstream = kore_upstream_lookup(name)) == NULL) {
+		kore_log(LOG_ERR, "no such upstream '%s' for '%s' found",
+		    name, current_route->path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_route_ratelimit(char *options)
+{
+	char		*argv[3];
+
+	kore_split_string(options, " ", argv, 3);
+	if (argv[0] == NULL) {
+		kore_log(LOG_ERR, "missing ratelimit name for '%s'",
+		    current_route->path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_route->ratelimit = kore_ratelimit_lookup(argv[0]);
+	if (current_route->ratelimit == NULL) {
+		kore_log(LOG_ERR, "no such ratelimit '%s' for '%s' found",
+		    argv[0], current_route->path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (argv[1] == NULL) {
+		current_route->ratelimit_key = KORE_RATELIMIT_KEY_ADDRESS;
+	} else if ((current_route->ratelimit_key =
+	    kore_ratelimit_key(argv[1])) == -1) {
+		kore_log(LOG_ERR, "unknown ratelimit key '%s' for '%s'",
+		    argv[1], current_route->path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream(char *options)
+{
+	char		*argv[3];
+
+	if (current_upstream != NULL) {
+		kore_log(LOG_ERR, "previous upstream block not closed");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_split_string(options, " ", argv, 3);
+	if (argv[1] == NULL) {
+		kore_log(LOG_ERR, "missing name for upstream block");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (strcmp(argv[1], "{")) {
+		kore_log(LOG_ERR, "missing { for upstream block");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if ((current_upstream = kore_upstream_create(argv[0])) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_server(char *options)
+{
+	char		*argv[3];
+
+	if (current_upstream == NULL) {
+		kore_log(LOG_ERR,
+		    "upstream_server keyword not in correct context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_split_string(options, " ", argv, 3);
+	if (argv[0] == NULL || argv[1] == NULL) {
+		kore_log(LOG_ERR, "upstream_server requires a host and port");
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (kore_upstream_server_add(current_upstream, argv[0], argv[1]));
+}
+
+static int
+configure_upstream_balance(char *option)
+{
+	if (current_upstream == NULL) {
+		kore_log(LOG_ERR,
+		    "upstream_balance keyword not in correct context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!strcmp(option, "round-robin")) {
+		current_upstream->balance = KORE_UPSTREAM_ROUND_ROBIN;
+	} else if (!strcmp(option, "least-conn")) {
+		current_upstream->balance = KORE_UPSTREAM_LEAST_CONN;
+	} else if (!strcmp(option, "hash-ip")) {
+		current_upstream->balance = KORE_UPSTREAM_HASH_IP;
+	} else if (!strcmp(option, "hash-uri")) {
+		current_upstream->balance = KORE_UPSTREAM_HASH_URI;
+	} else {
+		kore_log(LOG_ERR, "unknown upstream_balance '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_number(const char *name, char *option, long long min,
+    u_int32_t *out)
+{
+	int		err;
+
+	if (current_upstream == NULL) {
+		kore_log(LOG_ERR, "%s keyword not in correct context", name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	*out = kore_strtonum(option, 10, min, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad %s value: %s", name, option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_keepalive(char *option)
+{
+	u_int32_t	value;
+
+	if (!configure_upstream_number("upstream_keepalive", option, 0, &value))
+		return (KORE_RESULT_ERROR);
+
+	current_upstream->keepalive = value;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_keepalive_timeout(char *option)
+{
+	u_int32_t	value;
+
+	if (!configure_upstream_number("upstream_keepalive_timeout",
+	    option, 1, &value))
+		return (KORE_RESULT_ERROR);
+
+	current_upstream->keepalive_timeout = value;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_max_fails(char *option)
+{
+	u_int32_t	value;
+
+	if (!configure_upstream_number("upstream_max_fails", option, 0, &value))
+		return (KORE_RESULT_ERROR);
+
+	current_upstream->max_fails = value;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_fail_timeout(char *option)
+{
+	u_int32_t	value;
+
+	if (!configure_upstream_number("upstream_fail_timeout",
+	    option, 1, &value))
 		return (KORE_RESULT_ERROR);
-	}
+
+	current_upstream->fail_timeout = value;
 
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_http_header_max(char *option)
+configure_upstream_connect_timeout(char *option)
 {
-	int		err;
+	u_int32_t	value;
 
-	http_header_max = kore_strtonum(option, 10, 1, 65535, &err);
-	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR, "bad http_header_max value '%s'", option);
+	if (!configure_upstream_number("upstream_connect_timeout",
+	    option, 1, &value))
 		return (KORE_RESULT_ERROR);
-	}
+
+	current_upstream->connect_timeout = value;
 
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_http_header_timeout(char *option)
+configure_upstream_timeout(char *option)
 {
-	int		err;
+	u_int32_t	value;
 
-	http_header_timeout = kore_strtonum(option, 10, 1, 65535, &err);
-	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR, "bad http_header_timeout value '%s'", option);
+	if (!configure_upstream_number("upstream_timeout", option, 1, &value))
 		return (KORE_RESULT_ERROR);
-	}
+
+	current_upstream->timeout = value;
 
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_http_body_max(char *option)
+configure_upstream_buffer_max(char *option)
 {
 	int		err;
 
-	http_body_max = kore_strtonum(option, 10, 0, LONG_MAX, &err);
+	if (current_upstream == NULL) {
+		kore_log(LOG_ERR,
+		    "upstream_buffer_max keyword not in correct context");
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_upstream->buffer_max = kore_strtonum64(option, 0, &err);
 	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR, "bad http_body_max value '%s'", option);
+		kore_log(LOG_ERR, "bad upstream_buffer_max value: %s", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1474,13 +3216,14 @@ configure_http_body_max(char *option)
 }
 
 static int
-configure_http_body_timeout(char *option)
+configure_websocket_maxframe(char *option)
 {
-	int		err;
+	int	err;
 
-	http_body_timeout = kore_strtonum(option, 10, 1, 65535, &err);
+	kore_websocket_maxframe = kore_strtonum64(option, 1, &err);
 	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR, "bad http_body_timeout value '%s'", option);
+		kore_log(LOG_ERR,
+		    "bad kore_websocket_maxframe value '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1488,48 +3231,63 @@ configure_http_body_timeout(char *option)
 }
 
 static int
-configure_http_body_disk_offload(char *option)
+configure_websocket_timeout(char *option)
 {
-	int		err;
+	int	err;
 
-	http_body_disk_offload = kore_strtonum(option, 10, 0, LONG_MAX, &err);
+	kore_websocket_timeout = kore_strtonum64(option, 1, &err);
 	if (err != KORE_RESULT_OK) {
 		kore_log(LOG_ERR,
-		    "bad http_body_disk_offload value '%s'", option);
+		    "bad kore_websocket_timeout value '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
+	kore_websocket_timeout = kore_websocket_timeout * 1000;
+
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_http_body_disk_path(char *path)
+configure_sse_history(char *option)
 {
-	if (strcmp(http_body_disk_path, HTTP_BODY_DISK_PATH))
-		kore_free(http_body_disk_path);
+	int	err;
+
+	kore_sse_history = kore_strtonum(option, 10, 0, 65536, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad sse_history value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
 
-	http_body_disk_path = kore_strdup(path);
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_http_server_version(char *version)
+configure_sse_heartbeat(char *option)
 {
-	http_server_version(version);
+	int	err;
+
+	kore_sse_heartbeat = kore_strtonum(option, 10, 0, 3600, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad sse_heartbeat value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_sse_heartbeat = kore_sse_heartbeat * 1000;
 
 	return (KORE_RESULT_OK);
 }
 
+#if defined(KORE_USE_COMPRESS)
 static int
-configure_http_pretty_error(char *yesno)
+configure_websocket_deflate(char *yesno)
 {
 	if (!strcmp(yesno, "no")) {
-		http_pretty_error = 0;
+		kore_websocket_deflate = 0;
 	} else if (!strcmp(yesno, "yes")) {
-		http_pretty_error = 1;
+		kore_websocket_deflate = 1;
 	} else {
 		kore_log(LOG_ERR,
-		    "invalid '%s' for yes|no http_pretty_error option", yesno);
+		    "invalid '%s' for yes|no websocket_deflate option", yesno);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1537,13 +3295,14 @@ configure_http_pretty_error(char *yesno)
 }
 
 static int
-configure_http_hsts_enable(char *option)
+configure_websocket_deflate_window(char *option)
 {
 	int		err;
 
-	http_hsts_enable = kore_strtonum(option, 10, 0, LONG_MAX, &err);
+	kore_websocket_deflate_window = kore_strtonum(option, 10, 9, 15, &err);
 	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR, "bad http_hsts_enable value '%s'", option);
+		kore_log(LOG_ERR,
+		    "bad websocket_deflate_window value '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1551,14 +3310,14 @@ configure_http_hsts_enable(char *option)
 }
 
 static int
-configure_http_keepalive_time(char *option)
+configure_websocket_deflate_memlevel(char *option)
 {
 	int		err;
 
-	http_keepalive_time = kore_strtonum(option, 10, 0, USHRT_MAX, &err);
+	kore_websocket_deflate_memlevel = kore_strtonum(option, 10, 1, 9, &err);
 	if (err != KORE_RESULT_OK) {
 		kore_log(LOG_ERR,
-		    "bad http_keepalive_time value '%s'", option);
+		    "bad websocket_deflate_memlevel value '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1566,13 +3325,16 @@ configure_http_keepalive_time(char *option)
 }
 
 static int
-configure_http_request_ms(char *option)
+configure_websocket_deflate_takeover(char *yesno)
 {
-	int		err;
-
-	http_request_ms = kore_strtonum(option, 10, 0, UINT_MAX, &err);
-	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR, "bad http_request_ms value '%s'", option);
+	if (!strcmp(yesno, "no")) {
+		kore_websocket_deflate_takeover = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		kore_websocket_deflate_takeover = 1;
+	} else {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for yes|no websocket_deflate_takeover option",
+		    yesno);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1580,52 +3342,64 @@ configure_http_request_ms(char *option)
 }
 
 static int
-configure_http_request_limit(char *option)
+configure_websocket_deflate_min_size(char *option)
 {
 	int		err;
 
-	http_request_limit = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	kore_websocket_deflate_min_size = kore_strtonum(option, 10, 0,
+	    UINT_MAX, &err);
 	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR, "bad http_request_limit value '%s'", option);
+		kore_log(LOG_ERR,
+		    "bad websocket_deflate_min_size value '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
 	return (KORE_RESULT_OK);
 }
+#endif
+
+#endif /* !KORE_NO_HTTP */
 
 static int
-configure_validator(char *name)
+configure_logfile(char *path)
 {
-	u_int8_t	type;
-	char		*tname, *value;
+	kore_log_file(path);
+	return (KORE_RESULT_OK);
+}
 
-	if ((tname = strchr(name, ' ')) == NULL) {
-		kore_log(LOG_ERR, "missing validator name");
-		return (KORE_RESULT_ERROR);
-	}
+static int
+configure_workers(char *option)
+{
+	int		err;
 
-	*(tname)++ = '\0';
-	tname = kore_text_trim(tname, strlen(tname));
-	if ((value = strchr(tname, ' ')) == NULL) {
-		kore_log(LOG_ERR, "missing validator value");
+	worker_count = kore_strtonum(option, 10, 1, KORE_WORKER_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad value for worker '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
-	*(value)++ = '\0';
-	value = kore_text_trim(value, strlen(value));
+	return (KORE_RESULT_OK);
+}
 
-	if (!strcmp(tname, "regex")) {
-		type = KORE_VALIDATOR_TYPE_REGEX;
-	} else if (!strcmp(tname, "function")) {
-		type = KORE_VALIDATOR_TYPE_FUNCTION;
-	} else {
-		kore_log(LOG_ERR,
-		    "bad type '%s' for validator '%s'", tname, name);
-		return (KORE_RESULT_ERROR);
-	}
+static int
+configure_pidfile(char *path)
+{
+	if (strcmp(kore_pidfile, KORE_PIDFILE_DEFAULT))
+		kore_free(kore_pidfile);
+	kore_pidfile = kore_strdup(path);
 
-	if (!kore_validator_add(name, type, value)) {
-		kore_log(LOG_ERR, "bad validator specified for '%s'", name);
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_max_connections(char *option)
+{
+	int		err;
+
+	worker_max_connections = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad value for worker_max_connections '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1633,124 +3407,128 @@ configure_validator(char *name)
 }
 
 static int
-configure_validate(char *options)
+configure_rlimit_nofiles(char *option)
 {
-	struct kore_validator		*val;
-	struct kore_route_params	*param;
-	char				*method, *argv[4];
-	int				flags, http_method;
+	int		err;
 
-	if (kore_split_string(options, " ", argv, 4) != 3) {
+	worker_rlimit_nofiles = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
 		kore_log(LOG_ERR,
-		    "validate keyword needs 3 args: method param validator");
+		    "bad value for worker_rlimit_nofiles '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
-	flags = 0;
+	return (KORE_RESULT_OK);
+}
 
-	if ((method = strchr(argv[0], ':')) != NULL) {
-		*(method)++ = '\0';
-		if (!strcasecmp(argv[0], "qs")) {
-			flags = KORE_PARAMS_QUERY_STRING;
-		} else {
-			kore_log(LOG_ERR,
-			    "unknown validate method prefix '%s' for '%s'",
-			    argv[0], current_route->path);
-			return (KORE_RESULT_ERROR);
-		}
-	} else {
-		method = argv[0];
-	}
+static int
+configure_accept_threshold(char *option)
+{
+	int		err;
 
-	if ((val = kore_validator_lookup(argv[2])) == NULL) {
-		kore_log(LOG_ERR, "unknown validator '%s'", argv[2]);
+	worker_accept_threshold = kore_strtonum(option, 0, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad value for worker_accept_threshold '%s'\n", option);
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (!strcasecmp(method, "post")) {
-		http_method = HTTP_METHOD_POST;
-	} else if (!strcasecmp(method, "get")) {
-		http_method = HTTP_METHOD_GET;
-		/* Let params get /foo {} imply qs:get automatically. */
-		flags |= KORE_PARAMS_QUERY_STRING;
-	} else if (!strcasecmp(method, "put")) {
-		http_method = HTTP_METHOD_PUT;
-	} else if (!strcasecmp(method, "delete")) {
-		http_method = HTTP_METHOD_DELETE;
-	} else if (!strcasecmp(method, "head")) {
-		http_method = HTTP_METHOD_HEAD;
-	} else if (!strcasecmp(method, "patch")) {
-		http_method = HTTP_METHOD_PATCH;
-	} else {
-		kore_log(LOG_ERR, "unknown method: %s in validator for %s",
-		    method, current_route->path);
-		return (KORE_RESULT_ERROR);
-	}
+	return (KORE_RESULT_OK);
+}
 
-	if (!(current_route->methods & http_method)) {
-		kore_log(LOG_ERR, "method '%s' not enabled for route '%s'",
-		    method, current_route->path);
+static int
+configure_accept_exclusive(char *yesno)
+{
+#if defined(__linux__)
+	if (!strcmp(yesno, "no")) {
+		worker_accept_exclusive = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		worker_accept_exclusive = 1;
+	} else {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for yes|no worker_accept_exclusive", yesno);
 		return (KORE_RESULT_ERROR);
 	}
 
-	param = kore_calloc(1, sizeof(*param));
+	return (KORE_RESULT_OK);
+#else
+	kore_log(LOG_ERR, "worker_accept_exclusive is only supported on linux");
+	return (KORE_RESULT_ERROR);
+#endif
+}
 
-	param->flags = flags;
-	param->validator = val;
-	param->method = http_method;
-	param->name = kore_strdup(argv[1]);
+static int
+configure_event_batch(char *option)
+{
+	int		err;
 
-	TAILQ_INSERT_TAIL(&current_route->params, param, list);
+	worker_event_batch = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad value for worker_event_batch '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
 
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_authentication(char *options)
+configure_busy_poll(char *option)
 {
-	char		*argv[3];
+	int		err;
 
-	if (current_auth != NULL) {
-		kore_log(LOG_ERR, "previous authentication block not closed");
+	worker_busy_poll = kore_strtonum(option, 10, 0, 1000000, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad value for worker_busy_poll '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
-	kore_split_string(options, " ", argv, 3);
-	if (argv[1] == NULL) {
-		kore_log(LOG_ERR, "missing name for authentication block");
-		return (KORE_RESULT_ERROR);
-	}
+	return (KORE_RESULT_OK);
+}
 
-	if (strcmp(argv[1], "{")) {
-		kore_log(LOG_ERR, "missing { for authentication block");
-		return (KORE_RESULT_ERROR);
-	}
+static int
+configure_msg_ring_size(char *option)
+{
+	int		err;
 
-	if (!kore_auth_new(argv[0]))
+	kore_msg_ring_size = kore_strtonum(option, 10, 0,
+	    256 * 1024 * 1024, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad value for worker_msg_ring_size '%s'", option);
 		return (KORE_RESULT_ERROR);
-
-	current_auth = kore_auth_lookup(argv[0]);
+	}
 
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_authentication_type(char *option)
+configure_msg_flush_threshold(char *option)
 {
-	if (current_auth == NULL) {
+	int		err;
+
+	kore_msg_flush_threshold = kore_strtonum(option, 10, 0,
+	    UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
 		kore_log(LOG_ERR,
-		    "authentication_type keyword not in correct context");
+		    "bad value for worker_msg_flush_threshold '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (!strcmp(option, "cookie")) {
-		current_auth->type = KORE_AUTH_TYPE_COOKIE;
-	} else if (!strcmp(option, "header")) {
-		current_auth->type = KORE_AUTH_TYPE_HEADER;
-	} else if (!strcmp(option, "request")) {
-		current_auth->type = KORE_AUTH_TYPE_REQUEST;
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_death_policy(char *option)
+{
+	if (!strcmp(option, "restart")) {
+		worker_policy = KORE_WORKER_POLICY_RESTART;
+	} else if (!strcmp(option, "terminate")) {
+		worker_policy = KORE_WORKER_POLICY_TERMINATE;
 	} else {
-		kore_log(LOG_ERR, "unknown authentication type '%s'", option);
+		kore_log(LOG_ERR,
+		    "bad value for worker_death_policy '%s'\n", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1758,108 +3536,154 @@ configure_authentication_type(char *option)
 }
 
 static int
-configure_authentication_value(char *option)
+configure_set_affinity(char *option)
 {
-	if (current_auth == NULL) {
+	int		err;
+
+	worker_set_affinity = kore_strtonum(option, 10, 0, 1, &err);
+	if (err != KORE_RESULT_OK) {
 		kore_log(LOG_ERR,
-		    "authentication_value keyword not in correct context");
+		    "bad value for worker_set_affinity '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (current_auth->value != NULL)
-		kore_free(current_auth->value);
-	current_auth->value = kore_strdup(option);
-
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_authentication_validator(char *validator)
+configure_socket_backlog(char *option)
 {
-	struct kore_validator		*val;
+	int		err;
 
-	if (current_auth == NULL) {
-		kore_log(LOG_ERR,
-		    "authentication_validator not in correct context");
+	kore_socket_backlog = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad socket_backlog value: '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
-	if ((val = kore_validator_lookup(validator)) == NULL) {
-		kore_log(LOG_ERR,
-		    "authentication validator '%s' not found", validator);
-		return (KORE_RESULT_ERROR);
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_worker_numa(char *option)
+{
+	if (!strcmp(option, "no")) {
+		worker_numa = KORE_NUMA_OFF;
+		return (KORE_RESULT_OK);
 	}
 
-	current_auth->validator = val;
+#if defined(__linux__)
+	if (!strcmp(option, "yes")) {
+		worker_numa = KORE_NUMA_ON;
+		return (KORE_RESULT_OK);
+	}
 
-	return (KORE_RESULT_OK);
+	if (!strcmp(option, "bind")) {
+		worker_numa = KORE_NUMA_BIND;
+		return (KORE_RESULT_OK);
+	}
+
+	kore_log(LOG_ERR, "bad worker_numa value: '%s'", option);
+#else
+	kore_log(LOG_ERR, "worker_numa is only supported on linux");
+#endif
+
+	return (KORE_RESULT_ERROR);
 }
 
 static int
-configure_authentication_uri(char *uri)
+configure_worker_numa_nic(char *option)
 {
-	if (current_auth == NULL) {
-		kore_log(LOG_ERR,
-		    "authentication_uri keyword not in correct context");
+#if defined(__linux__)
+	if (strchr(option, '/') != NULL || *option == '.') {
+		kore_log(LOG_ERR, "bad worker_numa_nic value: '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (current_auth->redirect != NULL)
-		kore_free(current_auth->redirect);
-	current_auth->redirect = kore_strdup(uri);
+	kore_free(worker_numa_nic);
+	worker_numa_nic = kore_strdup(option);
 
 	return (KORE_RESULT_OK);
+#else
+	kore_log(LOG_ERR, "worker_numa_nic is only supported on linux");
+	return (KORE_RESULT_ERROR);
+#endif
 }
 
 static int
-configure_websocket_maxframe(char *option)
+configure_socket_reuseport(char *option)
 {
-	int	err;
+	if (!strcmp(option, "no")) {
+		kore_socket_reuseport = KORE_REUSEPORT_OFF;
+		return (KORE_RESULT_OK);
+	}
 
-	kore_websocket_maxframe = kore_strtonum64(option, 1, &err);
-	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR,
-		    "bad kore_websocket_maxframe value '%s'", option);
-		return (KORE_RESULT_ERROR);
+#if defined(__linux__)
+	if (!strcmp(option, "yes")) {
+		kore_socket_reuseport = KORE_REUSEPORT_ON;
+		return (KORE_RESULT_OK);
 	}
 
-	return (KORE_RESULT_OK);
+	if (!strcmp(option, "cpu")) {
+		kore_socket_reuseport = KORE_REUSEPORT_CPU;
+		return (KORE_RESULT_OK);
+	}
+
+	if (!strcmp(option, "node")) {
+		kore_socket_reuseport = KORE_REUSEPORT_NODE;
+		return (KORE_RESULT_OK);
+	}
+
+	kore_log(LOG_ERR, "bad socket_reuseport value: '%s'", option);
+#else
+	kore_log(LOG_ERR, "socket_reuseport is only supported on linux");
+#endif
+
+	return (KORE_RESULT_ERROR);
 }
 
 static int
-configure_websocket_timeout(char *option)
+configure_socket_busy_poll(char *option)
 {
-	int	err;
+#if defined(__linux__)
+	int		err;
 
-	kore_websocket_timeout = kore_strtonum64(option, 1, &err);
+	kore_socket_busy_poll = kore_strtonum(option, 10, 0, INT_MAX, &err);
 	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR,
-		    "bad kore_websocket_timeout value '%s'", option);
+		kore_log(LOG_ERR, "bad socket_busy_poll value: '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
-	kore_websocket_timeout = kore_websocket_timeout * 1000;
-
 	return (KORE_RESULT_OK);
+#else
+	kore_log(LOG_ERR, "socket_busy_poll is only supported on linux");
+	return (KORE_RESULT_ERROR);
+#endif
 }
 
-#endif /* !KORE_NO_HTTP */
-
 static int
-configure_logfile(char *path)
+configure_proxy_buffer(char *option)
 {
-	kore_log_file(path);
+	int		err;
+
+	proxy_buffer = kore_strtonum(option, 10, 4096, 16777216, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad proxy_buffer value: '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_workers(char *option)
+configure_proxy_connect_timeout(char *option)
 {
 	int		err;
 
-	worker_count = kore_strtonum(option, 10, 1, KORE_WORKER_MAX, &err);
+	proxy_connect_timeout = kore_strtonum(option, 10, 1, 3600, &err);
 	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR, "bad value for worker '%s'", option);
+		kore_log(LOG_ERR,
+		    "bad proxy_connect_timeout value: '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1867,24 +3691,29 @@ configure_workers(char *option)
 }
 
 static int
-configure_pidfile(char *path)
+configure_proxy_idle_timeout(char *option)
 {
-	if (strcmp(kore_pidfile, KORE_PIDFILE_DEFAULT))
-		kore_free(kore_pidfile);
-	kore_pidfile = kore_strdup(path);
+	int		err;
+
+	proxy_idle_timeout = kore_strtonum(option, 10, 1, 86400, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad proxy_idle_timeout value: '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
 
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_max_connections(char *option)
+configure_ratelimit_table_size(char *option)
 {
 	int		err;
 
-	worker_max_connections = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	kore_ratelimit_table_size = kore_strtonum(option, 10, 1024,
+	    1 << 26, &err);
 	if (err != KORE_RESULT_OK) {
 		kore_log(LOG_ERR,
-		    "bad value for worker_max_connections '%s'", option);
+		    "bad ratelimit_table_size value: '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1892,14 +3721,15 @@ configure_max_connections(char *option)
 }
 
 static int
-configure_rlimit_nofiles(char *option)
+configure_upgrade_drain_timeout(char *option)
 {
 	int		err;
 
-	worker_rlimit_nofiles = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	kore_upgrade_drain_timeout = kore_strtonum(option, 10, 0,
+	    UINT_MAX / 1000, &err);
 	if (err != KORE_RESULT_OK) {
 		kore_log(LOG_ERR,
-		    "bad value for worker_rlimit_nofiles '%s'", option);
+		    "bad upgrade_drain_timeout value: '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1907,14 +3737,13 @@ configure_rlimit_nofiles(char *option)
 }
 
 static int
-configure_accept_threshold(char *option)
+configure_pool_idle_time(char *option)
 {
 	int		err;
 
-	worker_accept_threshold = kore_strtonum(option, 0, 1, UINT_MAX, &err);
+	kore_pool_idle_time = kore_strtonum(option, 10, 0, 86400, &err);
 	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR,
-		    "bad value for worker_accept_threshold '%s'\n", option);
+		kore_log(LOG_ERR, "bad pool_idle_time value: '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1922,15 +3751,15 @@ configure_accept_threshold(char *option)
 }
 
 static int
-configure_death_policy(char *option)
+configure_pool_hugepages(char *yesno)
 {
-	if (!strcmp(option, "restart")) {
-		worker_policy = KORE_WORKER_POLICY_RESTART;
-	} else if (!strcmp(option, "terminate")) {
-		worker_policy = KORE_WORKER_POLICY_TERMINATE;
+	if (!strcmp(yesno, "no")) {
+		kore_pool_hugepages = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		kore_pool_hugepages = 1;
 	} else {
 		kore_log(LOG_ERR,
-		    "bad value for worker_death_policy '%s'\n", option);
+		    "invalid '%s' for yes|no pool_hugepages option", yesno);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1938,35 +3767,53 @@ configure_death_policy(char *option)
 }
 
 static int
-configure_set_affinity(char *option)
+configure_socket_zerocopy(char *option)
 {
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
 	int		err;
 
-	worker_set_affinity = kore_strtonum(option, 10, 0, 1, &err);
+	kore_socket_zerocopy = kore_strtonum(option, 10, 0, UINT_MAX, &err);
 	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR,
-		    "bad value for worker_set_affinity '%s'", option);
+		kore_log(LOG_ERR, "bad socket_zerocopy value: '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
 	return (KORE_RESULT_OK);
+#else
+	kore_log(LOG_ERR, "socket_zerocopy is only supported on linux");
+	return (KORE_RESULT_ERROR);
+#endif
 }
 
+#if defined(KORE_USE_PGSQL)
 static int
-configure_socket_backlog(char *option)
+configure_pgsql_conn_min(char *option)
 {
 	int		err;
 
-	kore_socket_backlog = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	pgsql_conn_min = kore_strtonum(option, 10, 0, USHRT_MAX, &err);
 	if (err != KORE_RESULT_OK) {
-		kore_log(LOG_ERR, "bad socket_backlog value: '%s'", option);
+		kore_log(LOG_ERR, "bad value for pgsql_conn_min '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_pgsql_cache_size(char *option)
+{
+	int		err;
+
+	pgsql_cache_size = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad value for pgsql_cache_size '%s'", option);
 		return (KORE_RESULT_ERROR);
 	}
 
 	return (KORE_RESULT_OK);
 }
 
-#if defined(KORE_USE_PGSQL)
 static int
 configure_pgsql_conn_max(char *option)
 {
@@ -2011,6 +3858,23 @@ configure_task_threads(char *option)
 
 	return (KORE_RESULT_OK);
 }
+
+static int
+configure_task_affinity(char *option)
+{
+	if (!strcmp(option, "inherit")) {
+		kore_task_affinity = KORE_TASK_AFFINITY_INHERIT;
+	} else if (!strcmp(option, "none")) {
+		kore_task_affinity = KORE_TASK_AFFINITY_NONE;
+	} else if (!strcmp(option, "spread")) {
+		kore_task_affinity = KORE_TASK_AFFINITY_SPREAD;
+	} else {
+		kore_log(LOG_ERR, "bad value for task_affinity: '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
 #endif
 
 #if defined(KORE_USE_PYTHON)
@@ -2058,6 +3922,53 @@ configure_python_import(char *module)
 	kore_module_load(argv[0], argv[1], KORE_MODULE_PYTHON);
 	return (KORE_RESULT_OK);
 }
+
+static int
+configure_python_coro_budget(char *option)
+{
+	int		err;
+
+	kore_python_coro_budget = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad value for python_coro_budget '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_python_coro_budget_time(char *option)
+{
+	int		err;
+
+	kore_python_coro_budget_time = kore_strtonum(option, 10, 0,
+	    1000000, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR,
+		    "bad value for python_coro_budget_time '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_python_gc_freeze(char *option)
+{
+	if (!strcmp(option, "yes")) {
+		kore_python_gc_freeze = 1;
+	} else if (!strcmp(option, "no")) {
+		kore_python_gc_freeze = 0;
+	} else {
+		kore_log(LOG_ERR,
+		    "invalid '%s' for yes|no python_gc_freeze", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
 #endif
 
 #if defined(KORE_USE_PLATFORM_PLEDGE)
@@ -2085,6 +3996,49 @@ configure_curl_recv_max(char *option)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_curl_max_conns(char *option)
+{
+	int		err;
+
+	kore_curl_max_conns = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad curl_max_conns value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_curl_max_host_conns(char *option)
+{
+	int		err;
+
+	kore_curl_max_host_conns = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		kore_log(LOG_ERR, "bad curl_max_host_conns value '%s'", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_curl_http2(char *option)
+{
+	if (!strcmp(option, "yes")) {
+		kore_curl_http2 = 1;
+	} else if (!strcmp(option, "no")) {
+		kore_curl_http2 = 0;
+	} else {
+		kore_log(LOG_ERR, "invalid '%s' for yes|no curl_http2", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_curl_timeout(char *option)
 {
@@ -25,10 +25,27 @@
 #include "kore.h"
 #include "http.h"
 
+/*
+ * Connection timeouts are tracked in buckets of CONN_TIMEOUT_TICK ms.
+ * A connection sits in the bucket of its earliest idle or http deadline
+ * and only the buckets that are due are looked at. Activity that pushes
+ * a deadline out does not move the connection, it is re-queued lazily
+ * once the old bucket comes up.
+ */
+#define CONN_TIMEOUT_TICK	500
+#define CONN_TIMEOUT_BUCKETS	256
+
+static void	connection_timeout_check(struct connection *, u_int64_t);
+static void	connection_timeout_queue(struct connection *, u_int64_t);
+static void	connection_timeout_unlink(struct connection *);
+
 struct kore_pool		connection_pool;
 struct connection_list		connections;
 struct connection_list		disconnected;
 
+static struct connection_list	timeout_buckets[CONN_TIMEOUT_BUCKETS];
+static u_int64_t		timeout_tick = 0;
+
 void
 kore_connection_init(void)
 {
@@ -37,6 +54,11 @@ kore_connection_init(void)
 	TAILQ_INIT(&connections);
 	TAILQ_INIT(&disconnected);
 
+	for (elm = 0; elm < CONN_TIMEOUT_BUCKETS; elm++)
+		TAILQ_INIT(&timeout_buckets[elm]);
+
+	timeout_tick = kore_time_ms() / CONN_TIMEOUT_TICK;
+
 	/* Add some overhead so we don't rollover for internal items. */
 	elm = worker_max_connections + 10;
 
@@ -50,6 +72,7 @@ kore_connection_cleanup(void)
 	kore_debug("connection_cleanup()");
 
 	/* Drop all connections */
+	kore_tls_handshake_drain();
 	kore_connection_prune(KORE_CONNECTION_PRUNE_ALL);
 	kore_pool_cleanup(&connection_pool);
 }
@@ -64,19 +87,26 @@ kore_connection_new(void *owner)
 	c->flags = 0;
 	c->rnb = NULL;
 	c->snb = NULL;
+	c->rpending = NULL;
+	c->rpending_off = 0;
+	c->rpending_last = 0;
 	c->owner = owner;
 	c->handle = NULL;
 
 	c->tls = NULL;
 	c->tls_cert = NULL;
 	c->tls_reneg = 0;
+	c->tls_wlast = 0;
+	c->tls_wbytes = 0;
 	c->tls_sni = NULL;
 
+	c->writev = NULL;
 	c->disconnect = NULL;
 	c->hdlr_extra = NULL;
 	c->proto = CONN_PROTO_UNKNOWN;
 	c->idle_timer.start = 0;
 	c->idle_timer.length = KORE_IDLE_TIMER_MAX;
+	c->timeout_tick = 0;
 
 	c->evt.type = KORE_TYPE_CONNECTION;
 	c->evt.handle = kore_connection_event;
@@ -85,12 +115,23 @@ kore_connection_new(void *owner)
 	c->ws_connect = NULL;
 	c->ws_message = NULL;
 	c->ws_disconnect = NULL;
+#if defined(KORE_USE_COMPRESS)
+	c->ws_deflate = NULL;
+#endif
+	LIST_INIT(&c->ws_subs);
+	c->sse = NULL;
 	c->http_start = kore_time_ms();
+	c->http_hdr_first = 0;
 	c->http_timeout = http_header_timeout * 1000;
+	c->h2 = NULL;
 	TAILQ_INIT(&(c->http_requests));
 #endif
 
 	TAILQ_INIT(&(c->send_queue));
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+	TAILQ_INIT(&(c->zc_queue));
+	c->zc_next = 0;
+#endif
 
 	return (c);
 }
@@ -126,12 +167,22 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 		fatal("unknown family type %d", c->family);
 	}
 
-	if ((c->fd = accept(listener->fd, s, &len)) == -1) {
+#if defined(__linux__)
+	/*
+	 * accept4() hands us a non-blocking close-on-exec socket and
+	 * TCP_NODELAY is inherited from the listener, no extra calls.
+	 */
+	c->fd = accept4(listener->fd, s, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	c->fd = accept(listener->fd, s, &len);
+#endif
+	if (c->fd == -1) {
 		kore_pool_put(&connection_pool, c);
 		kore_debug("accept(): %s", errno_s);
 		return (KORE_RESULT_ERROR);
 	}
 
+#if !defined(__linux__)
 	if (!kore_connection_nonblock(c->fd, listener->family != AF_UNIX)) {
 		close(c->fd);
 		kore_pool_put(&connection_pool, c);
@@ -143,6 +194,15 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 		kore_pool_put(&connection_pool, c);
 		return (KORE_RESULT_ERROR);
 	}
+#endif
+
+	/* Over the admission rate for this address, refuse it right away. */
+	if (listener->server->ratelimit != NULL &&
+	    !kore_ratelimit_connection(listener->server->ratelimit, c, NULL)) {
+		close(c->fd);
+		kore_pool_put(&connection_pool, c);
+		return (KORE_RESULT_RETRY);
+	}
 
 	c->handle = kore_connection_handle;
 	TAILQ_INSERT_TAIL(&connections, c, list);
@@ -150,14 +210,18 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 	if (listener->server->tls) {
 		c->state = CONN_STATE_TLS_SHAKE;
 		c->write = kore_tls_write;
+		c->writev = kore_tls_writev;
 		c->read = kore_tls_read;
 	} else {
 		c->state = CONN_STATE_ESTABLISHED;
 		c->write = net_write;
+		c->writev = net_writev;
 		c->read = net_read;
 
 		if (listener->connect != NULL) {
 			kore_runtime_connect(listener->connect, c);
+		} else if (listener->server->proxy != NULL) {
+			kore_proxy_start(c);
 		} else {
 #if !defined(KORE_NO_HTTP)
 			c->proto = CONN_PROTO_HTTP;
@@ -166,7 +230,8 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 				    http_keepalive_time * 1000;
 			}
 			net_recv_queue(c, http_header_max,
-			    NETBUF_CALL_CB_ALWAYS, http_header_recv);
+			    NETBUF_CALL_CB_ALWAYS | NETBUF_RECV_POOLED,
+			    http_header_recv);
 #endif
 		}
 	}
@@ -174,6 +239,8 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 	kore_connection_start_idletimer(c);
 	worker_active_connections++;
 
+	KORE_PROBE2(conn__accept, c, c->fd);
+
 	*out = c;
 	return (KORE_RESULT_OK);
 }
@@ -181,24 +248,39 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 void
 kore_connection_check_timeout(u_int64_t now)
 {
-	struct connection	*c, *next;
+	struct connection	*c;
+	u_int64_t		tick, last;
 
-	for (c = TAILQ_FIRST(&connections); c != NULL; c = next) {
-		next = TAILQ_NEXT(c, list);
-		if (c->proto == CONN_PROTO_MSG)
-			continue;
-#if !defined(KORE_NO_HTTP)
-		if (c->state == CONN_STATE_ESTABLISHED &&
-		    c->proto == CONN_PROTO_HTTP) {
-			if (!http_check_timeout(c, now))
-				continue;
-			if (!TAILQ_EMPTY(&c->http_requests))
-				continue;
+	last = now / CONN_TIMEOUT_TICK;
+	if (last - timeout_tick > CONN_TIMEOUT_BUCKETS)
+		last = timeout_tick + CONN_TIMEOUT_BUCKETS;
+
+	for (tick = timeout_tick + 1; tick <= last; tick++) {
+		/* Anything re-queued from here on goes in a later bucket. */
+		timeout_tick = tick;
+
+		while ((c = TAILQ_FIRST(&timeout_buckets[tick %
+		    CONN_TIMEOUT_BUCKETS])) != NULL) {
+			connection_timeout_unlink(c);
+			connection_timeout_check(c, now);
+
+			if (c->state != CONN_STATE_DISCONNECTING)
+				connection_timeout_queue(c, now);
 		}
-#endif
-		if (c->flags & CONN_IDLE_TIMER_ACT)
-			kore_connection_check_idletimer(now, c);
 	}
+
+	timeout_tick = MAX(timeout_tick, now / CONN_TIMEOUT_TICK);
+}
+
+/*
+ * Queue the connection according to its current deadlines, call this
+ * whenever a deadline may have moved closer. This is cheap when the
+ * connection is already queued in a bucket at or before the deadline.
+ */
+void
+kore_connection_timeout_update(struct connection *c)
+{
+	connection_timeout_queue(c, 0);
 }
 
 void
@@ -216,11 +298,50 @@ kore_connection_prune(int all)
 
 	for (c = TAILQ_FIRST(&disconnected); c != NULL; c = cnext) {
 		cnext = TAILQ_NEXT(c, list);
+		if (c->flags & CONN_TLS_SHAKING)
+			continue;
 		TAILQ_REMOVE(&disconnected, c, list);
 		kore_connection_remove(c);
 	}
 }
 
+/*
+ * Called by a draining worker: disconnect every HTTP connection that has
+ * nothing in flight. Anything else stays until it goes away by itself.
+ */
+void
+kore_connection_drain(void)
+{
+#if !defined(KORE_NO_HTTP)
+	struct connection	*c, *cnext;
+
+	for (c = TAILQ_FIRST(&connections); c != NULL; c = cnext) {
+		cnext = TAILQ_NEXT(c, list);
+
+		if (c->state != CONN_STATE_ESTABLISHED)
+			continue;
+
+		switch (c->proto) {
+		case CONN_PROTO_HTTP:
+		case CONN_PROTO_SSE:
+			break;
+		case CONN_PROTO_HTTP2:
+			if (!http2_session_drain(c))
+				continue;
+			break;
+		default:
+			continue;
+		}
+
+		if (!TAILQ_EMPTY(&c->http_requests) ||
+		    !TAILQ_EMPTY(&c->send_queue))
+			continue;
+
+		kore_connection_disconnect(c);
+	}
+#endif
+}
+
 void
 kore_connection_disconnect(struct connection *c)
 {
@@ -230,6 +351,7 @@ kore_connection_disconnect(struct connection *c)
 		if (c->disconnect)
 			c->disconnect(c);
 
+		connection_timeout_unlink(c);
 		TAILQ_REMOVE(&connections, c, list);
 		TAILQ_INSERT_TAIL(&disconnected, c, list);
 	}
@@ -240,9 +362,30 @@ kore_connection_event(void *arg, int error)
 {
 	struct connection	*c = arg;
 
+	/* A handshake thread has it, evt.flags tells it what it missed. */
+	if (c->flags & CONN_TLS_SHAKING)
+		return;
+
+	/* The proxy picks up end of stream and errors by itself. */
+	if (error && c->proto == CONN_PROTO_PROXY) {
+		c->evt.flags |= KORE_EVENT_READ | KORE_EVENT_WRITE;
+		error = 0;
+	}
+
 	if (error) {
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+		/* Zerocopy completions are reported on the error queue. */
+		if (!(c->evt.flags & KORE_EVENT_ERROR) ||
+		    !(c->flags & CONN_ZEROCOPY) ||
+		    !kore_platform_zerocopy_reap(c)) {
+			kore_connection_disconnect(c);
+			return;
+		}
+		c->evt.flags &= ~KORE_EVENT_ERROR;
+#else
 		kore_connection_disconnect(c);
 		return;
+#endif
 	}
 
 	if (!c->handle(c))
@@ -275,6 +418,12 @@ kore_connection_handle(struct connection *c)
 				kore_connection_start_idletimer(c);
 				return (KORE_RESULT_OK);
 			}
+
+			if (listener->server->proxy != NULL) {
+				c->state = CONN_STATE_ESTABLISHED;
+				kore_proxy_start(c);
+				return (KORE_RESULT_OK);
+			}
 		}
 
 #if !defined(KORE_NO_HTTP)
@@ -285,7 +434,11 @@ kore_connection_handle(struct connection *c)
 		}
 
 		net_recv_queue(c, http_header_max,
-		    NETBUF_CALL_CB_ALWAYS, http_header_recv);
+		    NETBUF_CALL_CB_ALWAYS | NETBUF_RECV_POOLED,
+		    http_header_recv);
+
+		if (c->flags & CONN_TLS_ALPN_H2)
+			http2_session_start(c);
 #endif
 
 		c->state = CONN_STATE_ESTABLISHED;
@@ -322,9 +475,13 @@ kore_connection_remove(struct connection *c)
 #endif
 
 	kore_debug("kore_connection_remove(%p)", c);
+	KORE_PROBE2(conn__remove, c, c->fd);
 
 	kore_tls_connection_cleanup(c);
 
+#if defined(KORE_USE_IO_URING)
+	kore_platform_disable_read(c->fd);
+#endif
 	close(c->fd);
 
 	if (c->hdlr_extra != NULL)
@@ -340,9 +497,13 @@ kore_connection_remove(struct connection *c)
 		http_request_wakeup(req);
 	}
 
+	http2_session_free(c);
+
 	kore_free(c->ws_connect);
 	kore_free(c->ws_message);
 	kore_free(c->ws_disconnect);
+	kore_websocket_cleanup(c);
+	kore_sse_cleanup(c);
 #endif
 
 	for (nb = TAILQ_FIRST(&(c->send_queue)); nb != NULL; nb = next) {
@@ -351,11 +512,24 @@ kore_connection_remove(struct connection *c)
 		net_remove_netbuf(c, nb);
 	}
 
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+	net_zerocopy_cleanup(c);
+#endif
+
 	if (c->rnb != NULL) {
-		kore_free(c->rnb->buf);
+		if (c->rnb->flags & NETBUF_RECV_POOLED)
+			net_recv_buffer_put(c->rnb->buf);
+		else
+			kore_free(c->rnb->buf);
 		kore_pool_put(&nb_pool, c->rnb);
 	}
 
+	if (c->flags & CONN_RECV_PENDING)
+		net_recv_pending_remove(c);
+
+	if (c->rpending != NULL)
+		kore_buf_free(c->rpending);
+
 	kore_pool_put(&connection_pool, c);
 	worker_active_connections--;
 }
@@ -383,6 +557,8 @@ kore_connection_start_idletimer(struct connection *c)
 
 	c->flags |= CONN_IDLE_TIMER_ACT;
 	c->idle_timer.start = kore_time_ms();
+
+	connection_timeout_queue(c, 0);
 }
 
 void
@@ -421,3 +597,77 @@ kore_connection_nonblock(int fd, int nodelay)
 
 	return (KORE_RESULT_OK);
 }
+
+static void
+connection_timeout_check(struct connection *c, u_int64_t now)
+{
+#if !defined(KORE_NO_HTTP)
+	if (c->state == CONN_STATE_ESTABLISHED &&
+	    (c->proto == CONN_PROTO_HTTP ||
+	    c->proto == CONN_PROTO_HTTP2)) {
+		if (!http_check_timeout(c, now))
+			return;
+		if (!TAILQ_EMPTY(&c->http_requests))
+			return;
+	}
+#endif
+	if (c->flags & CONN_IDLE_TIMER_ACT)
+		kore_connection_check_idletimer(now, c);
+}
+
+/*
+ * Put the connection in the bucket of its earliest deadline, but never
+ * before the bucket following the one for notbefore.
+ */
+static void
+connection_timeout_queue(struct connection *c, u_int64_t notbefore)
+{
+	u_int64_t	deadline, tick;
+
+	if (c->proto == CONN_PROTO_MSG || c->state == CONN_STATE_DISCONNECTING)
+		return;
+
+	deadline = KORE_WAIT_INFINITE;
+
+	if (c->flags & CONN_IDLE_TIMER_ACT &&
+	    c->idle_timer.length < KORE_WAIT_INFINITE - c->idle_timer.start)
+		deadline = c->idle_timer.start + c->idle_timer.length;
+
+#if !defined(KORE_NO_HTTP)
+	if (c->http_timeout != 0 &&
+	    c->http_timeout < KORE_WAIT_INFINITE - c->http_start)
+		deadline = MIN(deadline, c->http_start + c->http_timeout);
+#endif
+
+	if (deadline == KORE_WAIT_INFINITE) {
+		connection_timeout_unlink(c);
+		return;
+	}
+
+	tick = (deadline + CONN_TIMEOUT_TICK - 1) / CONN_TIMEOUT_TICK;
+	tick = MAX(tick, MAX(notbefore / CONN_TIMEOUT_TICK, timeout_tick) + 1);
+
+	/* Too far out, it is looked at again when this bucket comes up. */
+	tick = MIN(tick, timeout_tick + CONN_TIMEOUT_BUCKETS);
+
+	if (c->timeout_tick != 0) {
+		if (c->timeout_tick <= tick)
+			return;
+		connection_timeout_unlink(c);
+	}
+
+	c->timeout_tick = tick;
+	TAILQ_INSERT_TAIL(&timeout_buckets[tick % CONN_TIMEOUT_BUCKETS],
+	    c, tlist);
+}
+
+static void
+connection_timeout_unlink(struct connection *c)
+{
+	if (c->timeout_tick == 0)
+		return;
+
+	TAILQ_REMOVE(&timeout_buckets[c->timeout_tick % CONN_TIMEOUT_BUCKETS],
+	    c, tlist);
+	c->timeout_tick = 0;
+}
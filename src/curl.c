@@ -78,7 +78,37 @@ static int	curl_socket(CURL *, curl_socket_t, int, void *, void *);
 
 static struct fd_cache	*fd_cache_get(int);
 
+static CURL	*curl_handle_get(void);
+static void	curl_handle_put(CURL *);
+
+static size_t	curl_stream_write(char *, size_t, size_t, void *);
+static size_t	curl_stream_header(char *, size_t, size_t, void *);
+static int	curl_stream_headers(struct kore_curl *);
+static int	curl_stream_request(struct kore_curl *,
+		    const void *, size_t, void *);
+static int	curl_stream_sent(struct netbuf *);
+static void	curl_stream_detach(struct kore_curl *);
+
+/* Response headers that only make sense between us and the upstream. */
+static const char *stream_hop_headers[] = {
+	"connection",
+	"keep-alive",
+	"transfer-encoding",
+	"content-length",
+	"proxy-authenticate",
+	"proxy-connection",
+	"trailer",
+	"upgrade",
+	"server",
+	"date",
+	"te",
+	NULL
+};
+
+static char	stream_crlf[] = "\r\n";
+
 static TAILQ_HEAD(, curl_run)	runlist;
+static TAILQ_HEAD(, kore_curl)	resumelist;
 static struct kore_pool		run_pool;
 static int			running = 0;
 static CURLM			*multi = NULL;
@@ -87,9 +117,15 @@ static struct kore_pool		fd_cache_pool;
 static char			user_agent[64];
 static int			timeout_immediate = 0;
 static LIST_HEAD(, fd_cache)	cache[FD_CACHE_BUCKETS];
+static CURLSH			*share = NULL;
+static CURL			*handles[KORE_CURL_HANDLE_CACHE];
+static int			handles_free = 0;
 
 u_int16_t	kore_curl_timeout = KORE_CURL_TIMEOUT;
 u_int64_t	kore_curl_recv_max = KORE_CURL_RECV_MAX;
+u_int32_t	kore_curl_max_conns = KORE_CURL_MAX_CONNS;
+u_int32_t	kore_curl_max_host_conns = 0;
+int		kore_curl_http2 = 1;
 
 void
 kore_curl_sysinit(void)
@@ -103,8 +139,19 @@ kore_curl_sysinit(void)
 	if ((multi = curl_multi_init()) == NULL)
 		fatal("curl_multi_init(): failed");
 
-	/* XXX - make configurable? */
-	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, 500);
+	/*
+	 * Workers are single threaded so the share needs no locking, it
+	 * lets sync and async handles reuse the same DNS lookups, TLS
+	 * sessions and connections.
+	 */
+	if ((share = curl_share_init()) == NULL)
+		fatal("curl_share_init(): failed");
+
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
 
 	if ((res = curl_multi_setopt(multi,
 	    CURLMOPT_SOCKETFUNCTION, curl_socket)) != CURLM_OK)
@@ -118,6 +165,7 @@ kore_curl_sysinit(void)
 		LIST_INIT(&cache[i]);
 
 	TAILQ_INIT(&runlist);
+	TAILQ_INIT(&resumelist);
 
 	kore_pool_init(&fd_cache_pool, "fd_cache_pool", 100,
 	    sizeof(struct fd_cache));
@@ -135,6 +183,22 @@ kore_curl_sysinit(void)
 #endif
 }
 
+void
+kore_curl_worker_init(void)
+{
+	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS,
+	    (long)kore_curl_max_conns);
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+	    (long)kore_curl_max_host_conns);
+
+	if (kore_curl_http2) {
+		curl_multi_setopt(multi,
+		    CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	} else {
+		curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_NOTHING);
+	}
+}
+
 int
 kore_curl_init(struct kore_curl *client, const char *url, int flags)
 {
@@ -150,12 +214,13 @@ kore_curl_init(struct kore_curl *client, const char *url, int flags)
 
 	TAILQ_INIT(&client->http.resp_hdrs);
 
-	if ((handle = curl_easy_init()) == NULL) {
+	if ((handle = curl_handle_get()) == NULL) {
 		(void)kore_strlcpy(client->errbuf, "failed to setup curl",
 		    sizeof(client->errbuf));
 		return (KORE_RESULT_ERROR);
 	}
 
+	curl_easy_setopt(handle, CURLOPT_SHARE, share);
 	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &client->response);
 	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, kore_curl_tobuf);
 
@@ -166,6 +231,15 @@ kore_curl_init(struct kore_curl *client, const char *url, int flags)
 	curl_easy_setopt(handle, CURLOPT_TIMEOUT, kore_curl_timeout);
 	curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, client->errbuf);
 
+	if (kore_curl_http2) {
+		curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+		curl_easy_setopt(handle,
+		    CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+	} else {
+		curl_easy_setopt(handle,
+		    CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+	}
+
 	client->flags = flags;
 	client->handle = handle;
 	client->url = kore_strdup(url);
@@ -184,9 +258,14 @@ kore_curl_cleanup(struct kore_curl *client)
 	if (client->flags & KORE_CURL_FLAG_BOUND)
 		LIST_REMOVE(client, list);
 
+	if (client->flags & KORE_CURL_FLAG_RESUME)
+		TAILQ_REMOVE(&resumelist, client, stream.list);
+
+	curl_stream_detach(client);
+
 	if (client->handle != NULL) {
 		curl_multi_remove_handle(multi, client->handle);
-		curl_easy_cleanup(client->handle);
+		curl_handle_put(client->handle);
 	}
 
 	if (client->http.hdrlist != NULL)
@@ -209,6 +288,22 @@ kore_curl_cleanup(struct kore_curl *client)
 	}
 }
 
+int
+kore_curl_running(void)
+{
+	return (running);
+}
+
+/*
+ * Returns 1 if there is curl work to do right away, resumed transfers
+ * otherwise only get going on the next event.
+ */
+int
+kore_curl_pending(void)
+{
+	return (timeout_immediate || !TAILQ_EMPTY(&resumelist));
+}
+
 void
 kore_curl_do_timeout(void)
 {
@@ -223,6 +318,13 @@ void
 kore_curl_run_scheduled(void)
 {
 	struct curl_run		*run;
+	struct kore_curl	*client;
+
+	while ((client = TAILQ_FIRST(&resumelist))) {
+		TAILQ_REMOVE(&resumelist, client, stream.list);
+		client->flags &= ~KORE_CURL_FLAG_RESUME;
+		kore_curl_stream_resume(client);
+	}
 
 	while ((run = TAILQ_FIRST(&runlist))) {
 		TAILQ_REMOVE(&runlist, run, list);
@@ -319,6 +421,117 @@ kore_curl_bind_callback(struct kore_curl *client,
 	client->arg = arg;
 }
 
+/*
+ * Deliver the response body to cb as it arrives instead of buffering it.
+ *
+ * The callback is called once with no data when the response headers
+ * are in (before any body), then for each piece of the body. It returns
+ * KORE_RESULT_OK when it consumed the data, KORE_RESULT_ERROR to abort
+ * the transfer or KORE_RESULT_RETRY to pause it, in which case the same
+ * data is offered again after kore_curl_stream_resume().
+ */
+void
+kore_curl_stream(struct kore_curl *client,
+    int (*cb)(struct kore_curl *, const void *, size_t, void *), void *arg)
+{
+	if (client->handle == NULL)
+		fatal("%s: called without setup", __func__);
+
+	client->stream.cb = cb;
+	client->stream.arg = arg;
+	client->flags |= KORE_CURL_FLAG_STREAM;
+
+	curl_easy_setopt(client->handle, CURLOPT_WRITEDATA, client);
+	curl_easy_setopt(client->handle, CURLOPT_WRITEFUNCTION,
+	    curl_stream_write);
+
+	if (client->type == KORE_CURL_TYPE_HTTP_CLIENT) {
+		curl_easy_setopt(client->handle, CURLOPT_HEADERDATA, client);
+		curl_easy_setopt(client->handle, CURLOPT_HEADERFUNCTION,
+		    curl_stream_header);
+	}
+}
+
+void
+kore_curl_stream_resume(struct kore_curl *client)
+{
+	if (!(client->flags & KORE_CURL_FLAG_PAUSED) || client->handle == NULL)
+		return;
+
+	client->flags &= ~KORE_CURL_FLAG_PAUSED;
+	curl_easy_pause(client->handle, CURLPAUSE_CONT);
+}
+
+/*
+ * Stream the upstream response straight into the response for req.
+ *
+ * On HTTP/1.1 the status and headers go out as soon as they are known
+ * and the body follows as chunks, the transfer is paused while more
+ * than KORE_CURL_STREAM_PENDING_MAX bytes wait to be sent. Elsewhere
+ * the body is collected (up to curl_recv_max) and sent in one go.
+ *
+ * The page handler returns KORE_RESULT_RETRY until the transfer is
+ * done and then returns what kore_curl_stream_finish() returns.
+ */
+void
+kore_curl_stream_request(struct kore_curl *client, struct http_request *req)
+{
+	kore_curl_bind_request(client, req);
+	kore_curl_stream(client, curl_stream_request, NULL);
+}
+
+int
+kore_curl_stream_finish(struct kore_curl *client)
+{
+	struct connection	*c;
+	struct http_header	*hdr;
+	const char		**hop;
+
+	if ((c = client->req->owner) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (client->flags & KORE_CURL_FLAG_STREAM_CHUNKED) {
+		/* Headers are out, a truncated body is all we can signal. */
+		if (!kore_curl_success(client))
+			return (KORE_RESULT_ERROR);
+
+		net_send_queue(c, "0\r\n\r\n", 5);
+		c->flags &= ~CONN_IS_BUSY;
+		http_start_recv(c);
+
+		return (net_send_flush(c));
+	}
+
+	if (!kore_curl_success(client)) {
+		kore_curl_logerror(client);
+		http_response(client->req, HTTP_STATUS_BAD_GATEWAY, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	if (!(client->flags & KORE_CURL_FLAG_HTTP_PARSED_HEADERS))
+		kore_curl_http_parse_headers(client);
+
+	TAILQ_FOREACH(hdr, &client->http.resp_hdrs, list) {
+		for (hop = stream_hop_headers; *hop != NULL; hop++) {
+			if (!strcasecmp(hdr->header, *hop))
+				break;
+		}
+
+		if (*hop == NULL)
+			http_response_header(client->req,
+			    hdr->header, hdr->value);
+	}
+
+	if (client->response != NULL) {
+		http_response(client->req, client->http.status,
+		    client->response->data, client->response->offset);
+	} else {
+		http_response(client->req, client->http.status, NULL, 0);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 void
 kore_curl_run(struct kore_curl *client)
 {
@@ -332,7 +545,7 @@ kore_curl_run(struct kore_curl *client)
 	curl_easy_getinfo(client->handle,
 	    CURLINFO_RESPONSE_CODE, &client->http.status);
 
-	curl_easy_cleanup(client->handle);
+	curl_handle_put(client->handle);
 	client->handle = NULL;
 }
 
@@ -627,8 +840,13 @@ curl_process(void)
 			    CURLINFO_RESPONSE_CODE, &client->http.status);
 		}
 
+		if ((client->flags & KORE_CURL_FLAG_STREAM) &&
+		    client->result == CURLE_OK &&
+		    !curl_stream_headers(client))
+			client->result = CURLE_WRITE_ERROR;
+
 		curl_multi_remove_handle(multi, client->handle);
-		curl_easy_cleanup(client->handle);
+		curl_handle_put(client->handle);
 
 		client->handle = NULL;
 
@@ -748,3 +966,214 @@ fd_cache_get(int fd)
 
 	return (fdc);
 }
+
+static CURL *
+curl_handle_get(void)
+{
+	if (handles_free > 0)
+		return (handles[--handles_free]);
+
+	return (curl_easy_init());
+}
+
+static void
+curl_handle_put(CURL *handle)
+{
+	if (handles_free == KORE_CURL_HANDLE_CACHE) {
+		curl_easy_cleanup(handle);
+		return;
+	}
+
+	/* Drops all options but keeps the handle's caches around. */
+	curl_easy_reset(handle);
+	handles[handles_free++] = handle;
+}
+
+static size_t
+curl_stream_write(char *ptr, size_t size, size_t nmemb, void *udata)
+{
+	size_t			len;
+	struct kore_curl	*client;
+
+	if (SIZE_MAX / nmemb < size)
+		fatal("%s: %zu * %zu overflow", __func__, nmemb, size);
+
+	client = udata;
+	len = size * nmemb;
+
+	if (!curl_stream_headers(client))
+		return (0);
+
+	switch (client->stream.cb(client, ptr, len, client->stream.arg)) {
+	case KORE_RESULT_OK:
+		return (len);
+	case KORE_RESULT_RETRY:
+		client->flags |= KORE_CURL_FLAG_PAUSED;
+		return (CURL_WRITEFUNC_PAUSE);
+	default:
+		return (0);
+	}
+}
+
+static size_t
+curl_stream_header(char *ptr, size_t size, size_t nmemb, void *udata)
+{
+	size_t			len;
+	struct kore_curl	*client;
+
+	if (SIZE_MAX / nmemb < size)
+		fatal("%s: %zu * %zu overflow", __func__, nmemb, size);
+
+	client = udata;
+	len = size * nmemb;
+
+	/* Trailers, the headers were already handed out. */
+	if (client->flags & KORE_CURL_FLAG_STREAM_HEADERS)
+		return (len);
+
+	/* Only keep the last header block (redirects, 100-continue). */
+	if (len > 5 && !memcmp(ptr, "HTTP/", 5) && client->http.headers != NULL)
+		kore_buf_reset(client->http.headers);
+
+	return (kore_curl_tobuf(ptr, size, nmemb, &client->http.headers));
+}
+
+static int
+curl_stream_headers(struct kore_curl *client)
+{
+	if (client->flags & KORE_CURL_FLAG_STREAM_HEADERS)
+		return (KORE_RESULT_OK);
+
+	client->flags |= KORE_CURL_FLAG_STREAM_HEADERS;
+
+	if (client->type == KORE_CURL_TYPE_HTTP_CLIENT) {
+		curl_easy_getinfo(client->handle,
+		    CURLINFO_RESPONSE_CODE, &client->http.status);
+	}
+
+	return (client->stream.cb(client, NULL, 0, client->stream.arg) ==
+	    KORE_RESULT_OK);
+}
+
+static int
+curl_stream_request(struct kore_curl *client, const void *data, size_t len,
+    void *arg)
+{
+	int			hlen;
+	struct http_request	*req;
+	struct netbuf		*nb;
+	struct connection	*c;
+	struct http_header	*hdr;
+	const char		**hop;
+	char			chunk[32];
+
+	req = client->req;
+
+	if ((c = req->owner) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (data == NULL) {
+		if (c->proto != CONN_PROTO_HTTP ||
+		    (req->flags & HTTP_VERSION_1_0))
+			return (KORE_RESULT_OK);
+
+		kore_curl_http_parse_headers(client);
+
+		TAILQ_FOREACH(hdr, &client->http.resp_hdrs, list) {
+			for (hop = stream_hop_headers; *hop != NULL; hop++) {
+				if (!strcasecmp(hdr->header, *hop))
+					break;
+			}
+
+			if (*hop == NULL)
+				http_response_header(req,
+				    hdr->header, hdr->value);
+		}
+
+		client->flags |= KORE_CURL_FLAG_STREAM_CHUNKED;
+		req->flags |= HTTP_REQUEST_NO_CONTENT_LENGTH;
+		http_response_header(req, "transfer-encoding", "chunked");
+
+		/* We start receiving again in kore_curl_stream_finish(). */
+		c->flags |= CONN_IS_BUSY;
+		http_response(req, client->http.status, NULL, 0);
+
+		return (KORE_RESULT_OK);
+	}
+
+	if (!(client->flags & KORE_CURL_FLAG_STREAM_CHUNKED)) {
+		if (client->response == NULL)
+			client->response = kore_buf_alloc(len);
+
+		if (client->response->offset + len > kore_curl_recv_max) {
+			kore_log(LOG_ERR,
+			    "received too large transfer (%zu > %" PRIu64 ")",
+			    client->response->offset + len, kore_curl_recv_max);
+			return (KORE_RESULT_ERROR);
+		}
+
+		kore_buf_append(client->response, data, len);
+		return (KORE_RESULT_OK);
+	}
+
+	/* The client is not keeping up, wait for it. */
+	if (net_send_pending(c) >= KORE_CURL_STREAM_PENDING_MAX)
+		return (KORE_RESULT_RETRY);
+
+	hlen = snprintf(chunk, sizeof(chunk), "%zx\r\n", len);
+	if (hlen == -1 || (size_t)hlen >= sizeof(chunk))
+		fatal("%s: failed to create chunk header", __func__);
+
+	net_send_queue(c, chunk, hlen);
+	net_send_queue(c, data, len);
+
+	/* The chunk trailer tells us when this chunk went out. */
+	net_send_stream(c, stream_crlf, 2, curl_stream_sent, &nb);
+	nb->extra = client;
+
+	if (!net_send_flush(c)) {
+		kore_connection_disconnect(c);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+curl_stream_sent(struct netbuf *nb)
+{
+	struct kore_curl	*client;
+
+	if ((client = nb->extra) == NULL)
+		return (KORE_RESULT_OK);
+
+	/*
+	 * Never resume from here, libcurl would call back into the
+	 * send path we are in. kore_curl_run_scheduled() picks it up.
+	 */
+	if ((client->flags & KORE_CURL_FLAG_PAUSED) &&
+	    !(client->flags & KORE_CURL_FLAG_RESUME) &&
+	    net_send_pending(nb->owner) < KORE_CURL_STREAM_PENDING_MAX) {
+		client->flags |= KORE_CURL_FLAG_RESUME;
+		TAILQ_INSERT_TAIL(&resumelist, client, stream.list);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/* Chunks may still be queued after we are gone, unhook them. */
+static void
+curl_stream_detach(struct kore_curl *client)
+{
+	struct netbuf		*nb;
+
+	if (!(client->flags & KORE_CURL_FLAG_STREAM_CHUNKED) ||
+	    client->req == NULL || client->req->owner == NULL)
+		return;
+
+	TAILQ_FOREACH(nb, &client->req->owner->send_queue, list) {
+		if (nb->cb == curl_stream_sent && nb->extra == client)
+			nb->extra = NULL;
+	}
+}
+
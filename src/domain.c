@@ -16,8 +16,13 @@
 
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
+#include <ctype.h>
+#include <fcntl.h>
 #include <fnmatch.h>
+#include <limits.h>
+#include <stdlib.h>
 
 #include "kore.h"
 
@@ -31,6 +36,38 @@
 
 #define KORE_DOMAIN_CACHE	16
 
+#define DOMAIN_INDEX_EXACT	1
+#define DOMAIN_INDEX_SUFFIX	2
+
+/*
+ * Per server lookup index. Plain names and names of the form
+ * "*.example.com" are kept in a hash table keyed on the name, or on
+ * ".example.com" for the wildcards. A lookup hashes the host from right
+ * to left so every label boundary yields a suffix to probe. All other
+ * patterns are matched with fnmatch() as before.
+ */
+struct domain_entry {
+	int			type;
+	u_int32_t		hash;
+	u_int32_t		order;
+	size_t			len;
+	const char		*name;
+	struct kore_domain	*dom;
+};
+
+struct kore_domain_index {
+	size_t			mask;
+	struct domain_entry	*table;
+	size_t			nfallback;
+	struct domain_entry	*fallback;
+};
+
+static void	domain_index_build(struct kore_server *);
+static void	domain_index_add(struct kore_domain_index *, int,
+		    const char *, size_t, struct kore_domain *, u_int32_t);
+static struct domain_entry	*domain_index_find(struct kore_domain_index *,
+				    int, const char *, size_t, u_int32_t);
+
 static u_int16_t		domain_id = 0;
 struct kore_domain		*primary_dom = NULL;
 static struct kore_domain	*cached[KORE_DOMAIN_CACHE];
@@ -60,6 +97,7 @@ kore_domain_new(const char *domain)
 	dom->id = domain_id++;
 
 	dom->accesslog = -1;
+	dom->accesslog_fields = KORE_ALOG_FIELDS_ALL;
 	dom->x509_verify_depth = 1;
 
 	dom->domain = kore_strdup(domain);
@@ -96,6 +134,7 @@ kore_domain_attach(struct kore_domain *dom, struct kore_server *server)
 
 	dom->server = server;
 	TAILQ_INSERT_TAIL(&server->domains, dom, list);
+	kore_domain_index_free(server);
 
 	/* The primary domain should be attached to a TLS context. */
 	if (server->tls == 0 && dom == primary_dom)
@@ -118,6 +157,7 @@ kore_domain_free(struct kore_domain *dom)
 		primary_dom = NULL;
 
 	TAILQ_REMOVE(&dom->server->domains, dom, list);
+	kore_domain_index_free(dom->server);
 
 	if (dom->domain != NULL)
 		kore_free(dom->domain);
@@ -128,9 +168,16 @@ kore_domain_free(struct kore_domain *dom)
 	kore_free(dom->certkey);
 	kore_free(dom->certfile);
 	kore_free(dom->crlfile);
+	kore_free(dom->ocspfile);
+	kore_free(dom->accesslog_path);
+
+#if defined(KORE_USE_COMPRESS)
+	http_compress_conf_free(dom->compress);
+#endif
 
 #if !defined(KORE_NO_HTTP)
 	/* Drop all handlers associated with this domain */
+	kore_route_index_free(dom);
 	while ((rt = TAILQ_FIRST(&dom->routes)) != NULL) {
 		TAILQ_REMOVE(&dom->routes, rt, list);
 		kore_route_free(rt);
@@ -162,16 +209,64 @@ kore_domain_callback(void (*cb)(struct kore_domain *))
 struct kore_domain *
 kore_domain_lookup(struct kore_server *srv, const char *domain)
 {
-	struct kore_domain	*dom;
+	struct domain_entry		*ent, *best;
+	struct kore_domain_index	*idx;
+	size_t				len, i;
+	u_int32_t			hash;
 
-	TAILQ_FOREACH(dom, &srv->domains, list) {
-		if (!strcmp(dom->domain, domain))
-			return (dom);
-		if (!fnmatch(dom->domain, domain, FNM_CASEFOLD))
-			return (dom);
+	if (srv->dindex == NULL)
+		domain_index_build(srv);
+
+	idx = srv->dindex;
+	best = NULL;
+
+	len = strlen(domain);
+	hash = 2166136261;
+
+	/* The first configured domain that matches wins. */
+	for (i = len; i > 0; i--) {
+		hash ^= tolower(*(const u_int8_t *)(domain + i - 1));
+		hash *= 16777619;
+
+		if (domain[i - 1] != '.')
+			continue;
+
+		ent = domain_index_find(idx, DOMAIN_INDEX_SUFFIX,
+		    domain + i - 1, len - i + 1, hash);
+		if (ent != NULL && (best == NULL || ent->order < best->order))
+			best = ent;
 	}
 
-	return (NULL);
+	ent = domain_index_find(idx, DOMAIN_INDEX_EXACT, domain, len, hash);
+	if (ent != NULL && (best == NULL || ent->order < best->order))
+		best = ent;
+
+	for (i = 0; i < idx->nfallback; i++) {
+		ent = &idx->fallback[i];
+		if (best != NULL && ent->order > best->order)
+			break;
+
+		if (!strcmp(ent->name, domain) ||
+		    !fnmatch(ent->name, domain, FNM_CASEFOLD)) {
+			best = ent;
+			break;
+		}
+	}
+
+	return (best != NULL ? best->dom : NULL);
+}
+
+void
+kore_domain_index_free(struct kore_server *srv)
+{
+	if (srv->dindex == NULL)
+		return;
+
+	kore_free(srv->dindex->table);
+	kore_free(srv->dindex->fallback);
+	kore_free(srv->dindex);
+
+	srv->dindex = NULL;
 }
 
 struct kore_domain *
@@ -193,6 +288,37 @@ kore_domain_byid(u_int16_t id)
 	return (NULL);
 }
 
+/*
+ * Open the accesslog for a domain, its absolute path is kept around so
+ * the accesslog writer can reopen it when asked to rotate. Remote targets
+ * (udp://, unix:// or syslog) get a datagram socket instead.
+ */
+int
+kore_domain_accesslog(struct kore_domain *dom, const char *path)
+{
+	char		rpath[PATH_MAX];
+
+#if !defined(KORE_NO_HTTP)
+	if (!strncmp(path, "udp://", 6) || !strncmp(path, "unix://", 7) ||
+	    !strcmp(path, "syslog"))
+		return (kore_accesslog_ship(dom, path));
+#endif
+
+	dom->accesslog = open(path, O_CREAT | O_APPEND | O_WRONLY,
+	    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (dom->accesslog == -1)
+		return (KORE_RESULT_ERROR);
+
+	kore_free(dom->accesslog_path);
+
+	if (realpath(path, rpath) != NULL)
+		dom->accesslog_path = kore_strdup(rpath);
+	else
+		dom->accesslog_path = kore_strdup(path);
+
+	return (KORE_RESULT_OK);
+}
+
 /*
  * Called by the worker processes to close the file descriptor towards
  * the accesslog as they do not need it locally.
@@ -218,3 +344,96 @@ kore_domain_closelogs(void)
 		}
 	}
 }
+
+static void
+domain_index_build(struct kore_server *srv)
+{
+	struct kore_domain		*dom;
+	struct kore_domain_index	*idx;
+	size_t				cnt, size;
+	u_int32_t			order;
+	const char			*name;
+
+	cnt = 0;
+	TAILQ_FOREACH(dom, &srv->domains, list)
+		cnt++;
+
+	size = 16;
+	while (size < cnt * 2)
+		size <<= 1;
+
+	idx = kore_calloc(1, sizeof(*idx));
+	idx->mask = size - 1;
+	idx->table = kore_calloc(size, sizeof(struct domain_entry));
+	idx->fallback = kore_calloc(cnt + 1, sizeof(struct domain_entry));
+
+	order = 0;
+	TAILQ_FOREACH(dom, &srv->domains, list) {
+		name = dom->domain;
+
+		if (strpbrk(name, "*?[\\") == NULL) {
+			domain_index_add(idx, DOMAIN_INDEX_EXACT,
+			    name, strlen(name), dom, order++);
+		} else if (name[0] == '*' && name[1] == '.' &&
+		    strpbrk(name + 1, "*?[\\") == NULL) {
+			domain_index_add(idx, DOMAIN_INDEX_SUFFIX,
+			    name + 1, strlen(name + 1), dom, order++);
+		} else {
+			idx->fallback[idx->nfallback].name = name;
+			idx->fallback[idx->nfallback].dom = dom;
+			idx->fallback[idx->nfallback].order = order++;
+			idx->nfallback++;
+		}
+	}
+
+	srv->dindex = idx;
+}
+
+static void
+domain_index_add(struct kore_domain_index *idx, int type, const char *name,
+    size_t len, struct kore_domain *dom, u_int32_t order)
+{
+	size_t			i;
+	u_int32_t		hash;
+	struct domain_entry	*ent;
+
+	hash = 2166136261;
+	for (i = len; i > 0; i--) {
+		hash ^= tolower(*(const u_int8_t *)(name + i - 1));
+		hash *= 16777619;
+	}
+
+	/* Keep the earlier entry if a name shows up twice. */
+	if (domain_index_find(idx, type, name, len, hash) != NULL)
+		return;
+
+	for (i = hash & idx->mask; idx->table[i].dom != NULL;
+	    i = (i + 1) & idx->mask)
+		;
+
+	ent = &idx->table[i];
+	ent->dom = dom;
+	ent->len = len;
+	ent->type = type;
+	ent->hash = hash;
+	ent->name = name;
+	ent->order = order;
+}
+
+static struct domain_entry *
+domain_index_find(struct kore_domain_index *idx, int type, const char *name,
+    size_t len, u_int32_t hash)
+{
+	size_t			i;
+	struct domain_entry	*ent;
+
+	for (i = hash & idx->mask; idx->table[i].dom != NULL;
+	    i = (i + 1) & idx->mask) {
+		ent = &idx->table[i];
+		if (ent->hash == hash && ent->type == type && ent->len == len &&
+		    !strncasecmp(ent->name, name, len))
+			return (ent);
+	}
+
+	return (NULL);
+}
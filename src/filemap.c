@@ -20,6 +20,7 @@
 
 #include <fcntl.h>
 #include <dirent.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "kore.h"
@@ -37,19 +38,119 @@ struct filemap_entry {
 	TAILQ_ENTRY(filemap_entry)	list;
 };
 
+/*
+ * Small files are kept in memory together with their response headers
+ * (content-type, last-modified, etag and accept-ranges) already rendered,
+ * so serving them over HTTP/1.x costs a hash lookup and a single send
+ * buffer.
+ *
+ * Entries are keyed on the path as it was built from the request and
+ * hold on to their fileref, which tells us when the file has changed.
+ * All domains share the kore_filemap_cache_size budget per worker, the
+ * least recently used entries are evicted first.
+ */
+struct filemap_cached {
+	char				*path;
+	u_int32_t			hash;
+	int				ontls;
+	size_t				size;
+	char				*type;
+	struct kore_fileref		*ref;
+	struct kore_buf			data;
+	size_t				hlen;
+	LIST_ENTRY(filemap_cached)	hlist;
+	TAILQ_ENTRY(filemap_cached)	list;
+};
+
+/*
+ * Resolved request paths, mapping the path built from the request to
+ * the file realpath() ended up at (after the filemap_ext and index
+ * fallbacks) or to nothing at all for a 404.
+ *
+ * A positive entry is only used while the fileref for its file is still
+ * cached and valid, so it goes away together with it. Every entry is
+ * dropped after kore_filemap_resolve_ttl ms so that changes to the tree
+ * itself (new files, replaced directories) are picked up.
+ */
+struct filemap_resolved {
+	char				*path;
+	u_int32_t			hash;
+	int				ontls;
+	char				*rpath;
+	u_int64_t			expires;
+	LIST_ENTRY(filemap_resolved)	hlist;
+	TAILQ_ENTRY(filemap_resolved)	list;
+};
+
+#define FILEMAP_CACHE_BUCKETS		1024
+#define FILEMAP_RESOLVE_MAX		16384
+
+/*
+ * Precompressed siblings that are looked for next to a file, in order
+ * of preference when the client accepts several at the same weight.
+ */
+static const struct {
+	const char		*ext;
+	const char		*name;
+} filemap_encodings[] = {
+	{ ".br",	"br" },
+	{ ".gz",	"gzip" },
+	{ NULL,		NULL },
+};
+
 int	filemap_resolve(struct http_request *);
 
 static void	filemap_serve(struct http_request *, struct filemap_entry *);
 
+static int	filemap_cache_serve(struct http_request *, const char *);
+static int	filemap_cache_usable(struct http_request *, const char *,
+		    off_t);
+static void	filemap_cache_add(struct http_request *, const char *,
+		    struct kore_fileref *);
+static void	filemap_cache_remove(struct filemap_cached *);
+static u_int32_t	filemap_cache_hash(const char *, int);
+
+static struct filemap_resolved	*filemap_resolved_get(const char *, int);
+static void	filemap_resolved_add(const char *, int, const char *);
+static void	filemap_resolved_remove(struct filemap_resolved *);
+static void	filemap_not_found(struct http_request *, const char *);
+static void	filemap_respond(struct http_request *, struct filemap_entry *,
+		    struct kore_fileref *, const char *, int);
+static int	filemap_encoded(struct http_request *, struct filemap_entry *,
+		    struct kore_fileref *, struct kore_fileref **, int *);
+static struct kore_fileref	*filemap_sibling(struct http_request *,
+				    struct filemap_entry *, const char *,
+				    const char *);
+
 static TAILQ_HEAD(, filemap_entry)	maps;
+static TAILQ_HEAD(filemap_lru, filemap_cached)	cache_lru;
+static LIST_HEAD(, filemap_cached)	cache[FILEMAP_CACHE_BUCKETS];
+static size_t				cache_bytes = 0;
+
+static TAILQ_HEAD(resolved_lru, filemap_resolved)	resolved_lru;
+static LIST_HEAD(, filemap_resolved)	resolved[FILEMAP_CACHE_BUCKETS];
+static size_t				resolved_count = 0;
 
-char	*kore_filemap_ext = NULL;
-char	*kore_filemap_index = NULL;
+char		*kore_filemap_ext = NULL;
+char		*kore_filemap_index = NULL;
+size_t		kore_filemap_cache_size = KORE_FILEMAP_CACHE_SIZE;
+size_t		kore_filemap_cache_max = KORE_FILEMAP_CACHE_MAX;
+u_int64_t	kore_filemap_resolve_ttl = KORE_FILEMAP_RESOLVE_TTL;
+int		kore_filemap_precompressed = 0;
 
 void
 kore_filemap_init(void)
 {
+	int		i;
+
 	TAILQ_INIT(&maps);
+	TAILQ_INIT(&cache_lru);
+	TAILQ_INIT(&resolved_lru);
+
+	for (i = 0; i < FILEMAP_CACHE_BUCKETS; i++) {
+		LIST_INIT(&cache[i]);
+		LIST_INIT(&resolved[i]);
+	}
 }
 
 int
@@ -174,9 +275,11 @@ filemap_serve(struct http_request *req, struct filemap_entry *map)
 	struct connection	*c;
 	struct kore_fileref	*ref;
 	struct kore_server	*srv;
+	struct filemap_resolved	*res;
 	const char		*path;
 	int			len, fd, index;
 	char			fpath[PATH_MAX], rpath[PATH_MAX];
+	char			key[PATH_MAX];
 
 	path = req->path + map->root_len;
 
@@ -191,6 +294,29 @@ filemap_serve(struct http_request *req, struct filemap_entry *map)
 		return;
 	}
 
+	if (filemap_cache_serve(req, fpath))
+		return;
+
+	c = req->owner;
+	srv = c->owner->server;
+
+	if ((res = filemap_resolved_get(fpath, srv->tls)) != NULL) {
+		if (res->rpath == NULL) {
+			http_response(req, HTTP_STATUS_NOT_FOUND, NULL, 0);
+			return;
+		}
+
+		if ((ref = kore_fileref_get(res->rpath, srv->tls)) != NULL) {
+			filemap_respond(req, map, ref, fpath, 0);
+			return;
+		}
+
+		filemap_resolved_remove(res);
+	}
+
+	/* fpath is rewritten by the fallbacks, keep what we cache under. */
+	(void)kore_strlcpy(key, fpath, sizeof(key));
+
 	index = 0;
 
 lookup:
@@ -210,19 +336,18 @@ lookup:
 				index++;
 				goto lookup;
 			}
+			filemap_not_found(req, key);
+			return;
 		}
 		http_response(req, HTTP_STATUS_NOT_FOUND, NULL, 0);
 		return;
 	}
 
 	if (strncmp(rpath, fpath, map->ondisk_len)) {
-		http_response(req, HTTP_STATUS_NOT_FOUND, NULL, 0);
+		filemap_not_found(req, key);
 		return;
 	}
 
-	c = req->owner;
-	srv = c->owner->server;
-
 	if ((ref = kore_fileref_get(rpath, srv->tls)) == NULL) {
 		if ((fd = open(fpath, O_RDONLY | O_NOFOLLOW)) == -1) {
 			switch (errno) {
@@ -270,7 +395,7 @@ lookup:
 			}
 
 			/* kore_fileref_create() takes ownership of the fd. */
-			ref = kore_fileref_create(srv, fpath, fd,
+			ref = kore_fileref_create(srv, rpath, fd,
 			    st.st_size, &st.st_mtim);
 			if (ref == NULL) {
 				http_response(req,
@@ -305,7 +430,8 @@ lookup:
 	}
 
 	if (ref != NULL) {
-		http_response_fileref(req, HTTP_STATUS_OK, ref);
+		filemap_resolved_add(key, srv->tls, rpath);
+		filemap_respond(req, map, ref, key, index == 0);
 		fd = -1;
 	}
 
@@ -314,4 +440,410 @@ cleanup:
 		close(fd);
 }
 
+/*
+ * Send out a resolved file, or one of its precompressed siblings if the
+ * client accepts it. Only files without siblings end up in the cache as
+ * the cached headers do not carry a vary.
+ */
+static void
+filemap_respond(struct http_request *req, struct filemap_entry *map,
+    struct kore_fileref *ref, const char *key, int cacheable)
+{
+	struct kore_fileref	*encref;
+	int			enc;
+
+	enc = -1;
+
+	if (!kore_filemap_precompressed ||
+	    !filemap_encoded(req, map, ref, &encref, &enc)) {
+		if (cacheable)
+			filemap_cache_add(req, key, ref);
+		if (!filemap_cache_serve(req, key))
+			http_response_fileref(req, HTTP_STATUS_OK, ref);
+		else
+			kore_fileref_release(ref);
+		return;
+	}
+
+	http_response_vary(req, "accept-encoding");
+
+	if (encref == NULL) {
+		http_response_fileref(req, HTTP_STATUS_OK, ref);
+		return;
+	}
+
+	/* Set before the fileref response so it is not compressed again. */
+	http_response_header(req, "content-encoding",
+	    filemap_encodings[enc].name);
+	http_response_fileref_type(req, HTTP_STATUS_OK, encref,
+	    http_media_type(ref->path));
+
+	kore_fileref_release(ref);
+}
+
+/*
+ * Look for precompressed siblings of the given file. Returns the number
+ * found and hands out the one the client prefers (if any) in *out.
+ */
+static int
+filemap_encoded(struct http_request *req, struct filemap_entry *map,
+    struct kore_fileref *ref, struct kore_fileref **out, int *enc)
+{
+	struct kore_fileref	*sibling;
+	int			i, q, bestq, found;
+
+	found = 0;
+	bestq = 0;
+	*out = NULL;
+
+	for (i = 0; filemap_encodings[i].ext != NULL; i++) {
+		sibling = filemap_sibling(req, map, ref->path,
+		    filemap_encodings[i].ext);
+		if (sibling == NULL)
+			continue;
+
+		found++;
+
+		q = http_accept_encoding(req, filemap_encodings[i].name);
+		if (q > bestq) {
+			if (*out != NULL)
+				kore_fileref_release(*out);
+			*out = sibling;
+			*enc = i;
+			bestq = q;
+		} else {
+			kore_fileref_release(sibling);
+		}
+	}
+
+	return (found);
+}
+
+/*
+ * Returns a fileref for the sibling of path with the given extension,
+ * resolved through the same cache and root check as the file itself.
+ */
+static struct kore_fileref *
+filemap_sibling(struct http_request *req, struct filemap_entry *map,
+    const char *path, const char *ext)
+{
+	struct stat		st;
+	struct kore_server	*srv;
+	struct kore_fileref	*ref;
+	struct filemap_resolved	*res;
+	int			fd, len;
+	char			fpath[PATH_MAX], rpath[PATH_MAX];
+
+	srv = req->owner->owner->server;
+
+	len = snprintf(fpath, sizeof(fpath), "%s%s", path, ext);
+	if (len == -1 || (size_t)len >= sizeof(fpath))
+		return (NULL);
+
+	if ((res = filemap_resolved_get(fpath, srv->tls)) != NULL) {
+		if (res->rpath == NULL)
+			return (NULL);
+
+		if ((ref = kore_fileref_get(res->rpath, srv->tls)) != NULL)
+			return (ref);
+
+		filemap_resolved_remove(res);
+	}
+
+	if (realpath(fpath, rpath) == NULL ||
+	    strncmp(rpath, map->ondisk, map->ondisk_len)) {
+		filemap_resolved_add(fpath, srv->tls, NULL);
+		return (NULL);
+	}
+
+	if ((ref = kore_fileref_get(rpath, srv->tls)) == NULL) {
+		if ((fd = open(rpath, O_RDONLY | O_NOFOLLOW)) == -1) {
+			filemap_resolved_add(fpath, srv->tls, NULL);
+			return (NULL);
+		}
+
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+		    st.st_size <= 0) {
+			close(fd);
+			filemap_resolved_add(fpath, srv->tls, NULL);
+			return (NULL);
+		}
+
+		ref = kore_fileref_create(srv, rpath, fd,
+		    st.st_size, &st.st_mtim);
+		if (ref == NULL) {
+			close(fd);
+			return (NULL);
+		}
+	}
+
+	filemap_resolved_add(fpath, srv->tls, rpath);
+
+	return (ref);
+}
+
+/* Answer with a 404 and remember that this path does not resolve. */
+static void
+filemap_not_found(struct http_request *req, const char *key)
+{
+	filemap_resolved_add(key, req->owner->owner->server->tls, NULL);
+	http_response(req, HTTP_STATUS_NOT_FOUND, NULL, 0);
+}
+
+static struct filemap_resolved *
+filemap_resolved_get(const char *path, int ontls)
+{
+	struct filemap_resolved	*res;
+	u_int32_t		hash;
+
+	if (kore_filemap_resolve_ttl == 0)
+		return (NULL);
+
+	hash = filemap_cache_hash(path, ontls);
+
+	LIST_FOREACH(res, &resolved[hash & (FILEMAP_CACHE_BUCKETS - 1)],
+	    hlist) {
+		if (res->hash == hash && res->ontls == ontls &&
+		    !strcmp(res->path, path))
+			break;
+	}
+
+	if (res == NULL)
+		return (NULL);
+
+	if (res->expires <= kore_clock.ms) {
+		filemap_resolved_remove(res);
+		return (NULL);
+	}
+
+	if (res != TAILQ_FIRST(&resolved_lru)) {
+		TAILQ_REMOVE(&resolved_lru, res, list);
+		TAILQ_INSERT_HEAD(&resolved_lru, res, list);
+	}
+
+	return (res);
+}
+
+static void
+filemap_resolved_add(const char *path, int ontls, const char *rpath)
+{
+	struct filemap_resolved	*res;
+
+	if (kore_filemap_resolve_ttl == 0)
+		return;
+
+	if ((res = filemap_resolved_get(path, ontls)) != NULL)
+		filemap_resolved_remove(res);
+
+	if (resolved_count >= FILEMAP_RESOLVE_MAX) {
+		res = TAILQ_LAST(&resolved_lru, resolved_lru);
+		filemap_resolved_remove(res);
+	}
+
+	res = kore_malloc(sizeof(*res));
+	res->ontls = ontls;
+	res->path = kore_strdup(path);
+	res->hash = filemap_cache_hash(path, ontls);
+	res->rpath = rpath != NULL ? kore_strdup(rpath) : NULL;
+	res->expires = kore_clock.ms + kore_filemap_resolve_ttl;
+
+	TAILQ_INSERT_HEAD(&resolved_lru, res, list);
+	LIST_INSERT_HEAD(&resolved[res->hash & (FILEMAP_CACHE_BUCKETS - 1)],
+	    res, hlist);
+
+	resolved_count++;
+}
+
+static void
+filemap_resolved_remove(struct filemap_resolved *res)
+{
+	TAILQ_REMOVE(&resolved_lru, res, list);
+	LIST_REMOVE(res, hlist);
+
+	resolved_count--;
+
+	kore_free(res->rpath);
+	kore_free(res->path);
+	kore_free(res);
+}
+
+static int
+filemap_cache_serve(struct http_request *req, const char *path)
+{
+	struct filemap_cached	*entry;
+	u_int32_t		hash;
+	int			ontls;
+
+	if (kore_filemap_cache_size == 0)
+		return (KORE_RESULT_ERROR);
+
+	ontls = req->owner->owner->server->tls;
+	hash = filemap_cache_hash(path, ontls);
+
+	LIST_FOREACH(entry, &cache[hash & (FILEMAP_CACHE_BUCKETS - 1)], hlist) {
+		if (entry->hash == hash && entry->ontls == ontls &&
+		    !strcmp(entry->path, path))
+			break;
+	}
+
+	if (entry == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (!kore_fileref_valid(entry->ref)) {
+		filemap_cache_remove(entry);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!filemap_cache_usable(req, entry->type, entry->ref->size))
+		return (KORE_RESULT_ERROR);
+
+	if (entry != TAILQ_FIRST(&cache_lru)) {
+		TAILQ_REMOVE(&cache_lru, entry, list);
+		TAILQ_INSERT_HEAD(&cache_lru, entry, list);
+	}
+
+	http_response_block(req, HTTP_STATUS_OK, entry->data.data, entry->hlen,
+	    entry->data.data + entry->hlen, entry->data.offset - entry->hlen);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Requests that need more than the plain file (HTTP/2, conditionals,
+ * ranges, compression) go through http_response_fileref() instead.
+ */
+static int
+filemap_cache_usable(struct http_request *req, const char *type, off_t size)
+{
+	const char	*hdr;
+
+	if (req->owner->proto != CONN_PROTO_HTTP)
+		return (KORE_RESULT_ERROR);
+
+	if (http_request_header(req, "if-modified-since", &hdr) ||
+	    http_request_header(req, "if-none-match", &hdr) ||
+	    http_request_header(req, "range", &hdr))
+		return (KORE_RESULT_ERROR);
+
+#if defined(KORE_USE_COMPRESS)
+	if (http_compress_select(req, HTTP_STATUS_OK, type, (size_t)size) != -1)
+		return (KORE_RESULT_ERROR);
+#endif
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+filemap_cache_add(struct http_request *req, const char *path,
+    struct kore_fileref *ref)
+{
+	struct tm		*tm;
+	struct filemap_cached	*entry;
+	ssize_t			ret;
+	size_t			need;
+	u_int8_t		*data;
+	const char		*type;
+	char			tbuf[128];
+
+	if (kore_filemap_cache_size == 0 ||
+	    ref->size > (off_t)kore_filemap_cache_max)
+		return;
+
+	type = http_media_type(ref->path);
+	if (!filemap_cache_usable(req, type, ref->size))
+		return;
+
+	need = strlen(path) + (size_t)ref->size + sizeof(*entry) + 256;
+	if (need > kore_filemap_cache_size)
+		return;
+
+	while (cache_bytes + need > kore_filemap_cache_size &&
+	    !TAILQ_EMPTY(&cache_lru))
+		filemap_cache_remove(TAILQ_LAST(&cache_lru, filemap_lru));
+
+	entry = kore_calloc(1, sizeof(*entry));
+	entry->ontls = ref->ontls;
+	entry->path = kore_strdup(path);
+	entry->hash = filemap_cache_hash(path, ref->ontls);
+	entry->type = type != NULL ? kore_strdup(type) : NULL;
+
+	kore_buf_init(&entry->data, (size_t)ref->size + 256);
+
+	if (type != NULL)
+		kore_buf_appendf(&entry->data, "content-type: %s\r\n", type);
+
+	if ((tm = gmtime(&ref->mtime_sec)) != NULL) {
+		if (strftime(tbuf, sizeof(tbuf),
+		    "%a, %d %b %Y %H:%M:%S GMT", tm) > 0) {
+			kore_buf_appendf(&entry->data,
+			    "last-modified: %s\r\n", tbuf);
+		}
+	}
+
+	http_fileref_etag(ref, tbuf, sizeof(tbuf));
+	kore_buf_appendf(&entry->data, "etag: %s\r\n", tbuf);
+	kore_buf_appendf(&entry->data, "accept-ranges: bytes\r\n");
+
+	entry->hlen = entry->data.offset;
+
+	if (ref->base != NULL) {
+		kore_buf_append(&entry->data, ref->base, (size_t)ref->size);
+	} else {
+		data = kore_malloc((size_t)ref->size);
+		ret = pread(ref->fd, data, (size_t)ref->size, 0);
+		if (ret != (ssize_t)ref->size) {
+			kore_free(data);
+			kore_buf_cleanup(&entry->data);
+			kore_free(entry->type);
+			kore_free(entry->path);
+			kore_free(entry);
+			return;
+		}
+		kore_buf_append(&entry->data, data, (size_t)ref->size);
+		kore_free(data);
+	}
+
+	kore_fileref_retain(ref);
+	entry->ref = ref;
+
+	entry->size = strlen(path) + entry->data.length + sizeof(*entry);
+	cache_bytes += entry->size;
+
+	TAILQ_INSERT_HEAD(&cache_lru, entry, list);
+	LIST_INSERT_HEAD(&cache[entry->hash & (FILEMAP_CACHE_BUCKETS - 1)],
+	    entry, hlist);
+}
+
+static void
+filemap_cache_remove(struct filemap_cached *entry)
+{
+	TAILQ_REMOVE(&cache_lru, entry, list);
+	LIST_REMOVE(entry, hlist);
+
+	cache_bytes -= entry->size;
+
+	kore_fileref_release(entry->ref);
+	kore_buf_cleanup(&entry->data);
+	kore_free(entry->type);
+	kore_free(entry->path);
+	kore_free(entry);
+}
+
+static u_int32_t
+filemap_cache_hash(const char *path, int ontls)
+{
+	u_int32_t	hash;
+
+	hash = 2166136261;
+	while (*path != '\0') {
+		hash ^= *(const u_int8_t *)path++;
+		hash *= 16777619;
+	}
+
+	hash ^= (u_int32_t)ontls;
+	hash *= 16777619;
+
+	return (hash);
+}
+
 #endif
@@ -19,34 +19,111 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
 #include <stdint.h>
 
 #include "kore.h"
 
-/* cached filerefs expire after 30 seconds of inactivity. */
-#define FILEREF_EXPIRATION		(1000 * 30)
+/*
+ * Cached filerefs are indexed by a hash of their path and TLS flag,
+ * the refs list is kept in LRU order so the least recently used refs
+ * are evicted first once the kore_fileref_cache_size budget is hit.
+ *
+ * On Linux each ref its file is watched with inotify, a write, attribute
+ * change, rename or removal of the file drops the ref from the cache.
+ * Refs that could not be watched (or other platforms) are revalidated
+ * with a stat() at most once every kore_fileref_revalidate ms instead.
+ */
+
+#define FILEREF_BUCKETS_MIN		1024
+#define FILEREF_WATCH_BUCKETS		1024
+
+#define FILEREF_WATCH_MASK		\
+    (IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONESHOT)
+
+LIST_HEAD(fileref_list, kore_fileref);
 
 static void	fileref_timer_prime(void);
+static int	fileref_stale(struct kore_fileref *);
 static void	fileref_drop(struct kore_fileref *);
+static void	fileref_unlink(struct kore_fileref *);
+static void	fileref_evict(struct kore_fileref *);
+static void	fileref_grow(void);
 static void	fileref_soft_remove(struct kore_fileref *);
 static void	fileref_expiration_check(void *, u_int64_t);
+static u_int32_t	fileref_hash(const char *, int);
+
+#if defined(__linux__)
+static void	fileref_watch(struct kore_fileref *);
+static void	fileref_unwatch(struct kore_fileref *);
+static void	fileref_notify(void *, int);
+static void	fileref_notify_overflow(void);
+#endif
 
-static TAILQ_HEAD(, kore_fileref)	refs;
+static TAILQ_HEAD(fileref_head, kore_fileref)	refs;
+static struct fileref_list		*buckets = NULL;
+static size_t				buckets_len = 0;
+static size_t				refs_count = 0;
+static u_int64_t			refs_bytes = 0;
 static struct kore_pool			ref_pool;
 static struct kore_timer		*ref_timer = NULL;
 
+#if defined(__linux__)
+static struct {
+	struct kore_event		evt;
+	int				fd;
+} notify;
+
+static struct fileref_list		watches[FILEREF_WATCH_BUCKETS];
+static int				watches_full = 0;
+#endif
+
+u_int64_t	kore_fileref_timeout = KORE_FILEREF_TIMEOUT;
+u_int64_t	kore_fileref_revalidate = KORE_FILEREF_REVALIDATE;
+u_int64_t	kore_fileref_cache_size = 0;
+
 void
 kore_fileref_init(void)
 {
+	size_t		i;
+
 	TAILQ_INIT(&refs);
 	kore_pool_init(&ref_pool, "ref_pool", sizeof(struct kore_fileref), 100);
+
+	buckets_len = FILEREF_BUCKETS_MIN;
+	buckets = kore_calloc(buckets_len, sizeof(*buckets));
+	for (i = 0; i < buckets_len; i++)
+		LIST_INIT(&buckets[i]);
+
+#if defined(__linux__)
+	for (i = 0; i < FILEREF_WATCH_BUCKETS; i++)
+		LIST_INIT(&watches[i]);
+
+	notify.evt.type = KORE_TYPE_FILEREF;
+	notify.evt.flags = 0;
+	notify.evt.handle = fileref_notify;
+
+	if ((notify.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		kore_log(LOG_NOTICE,
+		    "inotify_init1: %s, revalidating filerefs", errno_s);
+	} else {
+		kore_platform_schedule_read(notify.fd, &notify);
+	}
+#endif
 }
 
 struct kore_fileref *
 kore_fileref_create(struct kore_server *srv, const char *path, int fd,
     off_t size, struct timespec *ts)
 {
+	struct stat		st;
 	struct kore_fileref	*ref;
+#if defined(KORE_USE_COMPRESS)
+	int			i;
+#endif
 
 	fileref_timer_prime();
 
@@ -56,12 +133,22 @@ kore_fileref_create(struct kore_server *srv, const char *path, int fd,
 	ref = kore_pool_get(&ref_pool);
 
 	ref->cnt = 1;
+	ref->fd = -1;
+	ref->wd = -1;
 	ref->flags = 0;
+	ref->base = NULL;
 	ref->size = size;
 	ref->ontls = srv->tls;
 	ref->path = kore_strdup(path);
+	ref->hash = fileref_hash(path, srv->tls);
+	ref->ino = fstat(fd, &st) == -1 ? 0 : st.st_ino;
+	ref->checked = kore_clock.ms;
 	ref->mtime_sec = ts->tv_sec;
 	ref->mtime = ((u_int64_t)(ts->tv_sec * 1000 + (ts->tv_nsec / 1000000)));
+#if defined(KORE_USE_COMPRESS)
+	for (i = 0; i < KORE_FILEREF_ENCODINGS; i++)
+		ref->encoded[i] = NULL;
+#endif
 
 #if !defined(KORE_USE_PLATFORM_SENDFILE)
 	if ((uintmax_t)size> SIZE_MAX) {
@@ -79,6 +166,7 @@ kore_fileref_create(struct kore_server *srv, const char *path, int fd,
 	if (srv->tls == 0) {
 		ref->fd = fd;
 	} else {
+		/* kTLS connections sendfile() from it, others use the map. */
 		if ((uintmax_t)size > SIZE_MAX) {
 			kore_pool_put(&ref_pool, ref);
 			return (NULL);
@@ -90,7 +178,11 @@ kore_fileref_create(struct kore_server *srv, const char *path, int fd,
 			fatal("net_send_file: mmap failed: %s", errno_s);
 		if (madvise(ref->base, (size_t)size, MADV_SEQUENTIAL) == -1)
 			fatal("net_send_file: madvise: %s", errno_s);
-		close(fd);
+
+		if (kore_tls_ktls_enabled())
+			ref->fd = fd;
+		else
+			close(fd);
 	}
 #endif
 
@@ -98,7 +190,21 @@ kore_fileref_create(struct kore_server *srv, const char *path, int fd,
 	kore_log(LOG_DEBUG, "ref:%p created", (void *)ref);
 #endif
 
-	TAILQ_INSERT_TAIL(&refs, ref, list);
+	if (refs_count >= buckets_len)
+		fileref_grow();
+
+	TAILQ_INSERT_HEAD(&refs, ref, list);
+	LIST_INSERT_HEAD(&buckets[ref->hash & (buckets_len - 1)], ref, hlist);
+
+	refs_count++;
+	refs_bytes += size;
+
+#if defined(__linux__)
+	fileref_watch(ref);
+#endif
+
+	if (kore_fileref_cache_size != 0)
+		fileref_evict(ref);
 
 	return (ref);
 }
@@ -110,43 +216,49 @@ kore_fileref_create(struct kore_server *srv, const char *path, int fd,
 struct kore_fileref *
 kore_fileref_get(const char *path, int ontls)
 {
-	struct stat		st;
 	struct kore_fileref	*ref;
-	u_int64_t		mtime;
+	u_int32_t		hash;
 
-	TAILQ_FOREACH(ref, &refs, list) {
-		if (!strcmp(ref->path, path) && ref->ontls == ontls) {
-			if (stat(ref->path, &st) == -1) {
-				if (errno != ENOENT) {
-					kore_log(LOG_ERR, "stat(%s): %s",
-					    ref->path, errno_s);
-				}
-				fileref_soft_remove(ref);
-				return (NULL);
-			}
+	if (buckets == NULL)
+		return (NULL);
 
-			mtime = ((u_int64_t)(st.st_mtim.tv_sec * 1000 +
-			    (st.st_mtim.tv_nsec / 1000000)));
+	hash = fileref_hash(path, ontls);
 
-			if (ref->mtime != mtime) {
-				fileref_soft_remove(ref);
-				return (NULL);
-			}
+	LIST_FOREACH(ref, &buckets[hash & (buckets_len - 1)], hlist) {
+		if (ref->hash != hash || ref->ontls != ontls ||
+		    strcmp(ref->path, path))
+			continue;
 
-			ref->cnt++;
+		if (fileref_stale(ref)) {
+			fileref_soft_remove(ref);
+			return (NULL);
+		}
+
+		ref->cnt++;
 #if defined(FILEREF_DEBUG)
-			kore_log(LOG_DEBUG, "ref:%p cnt:%d",
-			    (void *)ref, ref->cnt);
+		kore_log(LOG_DEBUG, "ref:%p cnt:%d", (void *)ref, ref->cnt);
 #endif
+		if (ref != TAILQ_FIRST(&refs)) {
 			TAILQ_REMOVE(&refs, ref, list);
 			TAILQ_INSERT_HEAD(&refs, ref, list);
-			return (ref);
 		}
+
+		return (ref);
 	}
 
 	return (NULL);
 }
 
+void
+kore_fileref_retain(struct kore_fileref *ref)
+{
+	ref->cnt++;
+
+#if defined(FILEREF_DEBUG)
+	kore_log(LOG_DEBUG, "ref:%p retained cnt:%d", (void *)ref, ref->cnt);
+#endif
+}
+
 void
 kore_fileref_release(struct kore_fileref *ref)
 {
@@ -165,10 +277,137 @@ kore_fileref_release(struct kore_fileref *ref)
 		if (ref->flags & KORE_FILEREF_SOFT_REMOVED)
 			fileref_drop(ref);
 		else
-			ref->expiration = kore_time_ms() + FILEREF_EXPIRATION;
+			ref->expiration = kore_time_ms() + kore_fileref_timeout;
 	}
 }
 
+/*
+ * Check if a ref held on to for a while still matches the file on disk,
+ * stale refs are taken out of the cache.
+ */
+int
+kore_fileref_valid(struct kore_fileref *ref)
+{
+	if (ref->flags & KORE_FILEREF_SOFT_REMOVED)
+		return (KORE_RESULT_ERROR);
+
+	if (fileref_stale(ref)) {
+		fileref_soft_remove(ref);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Watched refs are dropped by fileref_notify() the moment their file
+ * changes, all others are checked against the file on disk now and then.
+ */
+static int
+fileref_stale(struct kore_fileref *ref)
+{
+	struct stat		st;
+	u_int64_t		mtime;
+
+	if (ref->wd != -1)
+		return (0);
+
+	if (kore_fileref_revalidate != 0 &&
+	    kore_clock.ms - ref->checked < kore_fileref_revalidate)
+		return (0);
+
+	ref->checked = kore_clock.ms;
+
+	if (stat(ref->path, &st) == -1) {
+		if (errno != ENOENT)
+			kore_log(LOG_ERR, "stat(%s): %s", ref->path, errno_s);
+		return (1);
+	}
+
+	mtime = ((u_int64_t)(st.st_mtim.tv_sec * 1000 +
+	    (st.st_mtim.tv_nsec / 1000000)));
+
+	return (ref->mtime != mtime);
+}
+
+static u_int32_t
+fileref_hash(const char *path, int ontls)
+{
+	u_int32_t	hash;
+
+	hash = 2166136261;
+	while (*path != '\0') {
+		hash ^= *(const u_int8_t *)path++;
+		hash *= 16777619;
+	}
+
+	hash ^= (u_int32_t)ontls;
+	hash *= 16777619;
+
+	return (hash);
+}
+
+static void
+fileref_grow(void)
+{
+	size_t			i, len;
+	struct kore_fileref	*ref;
+	struct fileref_list	*list;
+
+	len = buckets_len * 2;
+	list = kore_calloc(len, sizeof(*list));
+
+	for (i = 0; i < len; i++)
+		LIST_INIT(&list[i]);
+
+	TAILQ_FOREACH(ref, &refs, list) {
+		LIST_REMOVE(ref, hlist);
+		LIST_INSERT_HEAD(&list[ref->hash & (len - 1)], ref, hlist);
+	}
+
+	kore_free(buckets);
+
+	buckets = list;
+	buckets_len = len;
+}
+
+/* Evict the least recently used refs until we are within budget. */
+static void
+fileref_evict(struct kore_fileref *keep)
+{
+	struct kore_fileref	*ref;
+
+	while (refs_bytes > kore_fileref_cache_size) {
+		if ((ref = TAILQ_LAST(&refs, fileref_head)) == NULL ||
+		    ref == keep)
+			break;
+
+#if defined(FILEREF_DEBUG)
+		kore_log(LOG_DEBUG, "ref:%p evicted", (void *)ref);
+#endif
+
+		if (ref->cnt == 0)
+			fileref_drop(ref);
+		else
+			fileref_soft_remove(ref);
+	}
+}
+
+/* Take the ref out of the cache, it remains usable for its holders. */
+static void
+fileref_unlink(struct kore_fileref *ref)
+{
+	TAILQ_REMOVE(&refs, ref, list);
+	LIST_REMOVE(ref, hlist);
+
+#if defined(__linux__)
+	fileref_unwatch(ref);
+#endif
+
+	refs_count--;
+	refs_bytes -= ref->size;
+}
+
 static void
 fileref_timer_prime(void)
 {
@@ -188,7 +427,7 @@ fileref_soft_remove(struct kore_fileref *ref)
 	kore_log(LOG_DEBUG, "ref:%p softremoved", (void *)ref);
 #endif
 
-	TAILQ_REMOVE(&refs, ref, list);
+	fileref_unlink(ref);
 	ref->flags |= KORE_FILEREF_SOFT_REMOVED;
 
 	if (ref->cnt == 0)
@@ -226,19 +465,165 @@ fileref_expiration_check(void *arg, u_int64_t now)
 static void
 fileref_drop(struct kore_fileref *ref)
 {
+#if defined(KORE_USE_COMPRESS)
+	int		i;
+#endif
+
 #if defined(FILEREF_DEBUG)
 	kore_log(LOG_DEBUG, "ref:%p dropped", (void *)ref);
 #endif
 
 	if (!(ref->flags & KORE_FILEREF_SOFT_REMOVED))
-		TAILQ_REMOVE(&refs, ref, list);
+		fileref_unlink(ref);
 
 	kore_free(ref->path);
 
+#if defined(KORE_USE_COMPRESS)
+	for (i = 0; i < KORE_FILEREF_ENCODINGS; i++) {
+		if (ref->encoded[i] != NULL)
+			kore_buf_free(ref->encoded[i]);
+	}
+#endif
+
 #if !defined(KORE_USE_PLATFORM_SENDFILE)
 	(void)munmap(ref->base, ref->size);
 #else
-	close(ref->fd);
+	if (ref->base != NULL)
+		(void)munmap(ref->base, ref->size);
+	if (ref->fd != -1)
+		close(ref->fd);
 #endif
 	kore_pool_put(&ref_pool, ref);
 }
+
+#if defined(__linux__)
+static void
+fileref_watch(struct kore_fileref *ref)
+{
+	struct stat		st;
+	u_int64_t		mtime;
+
+	if (notify.fd == -1)
+		return;
+
+	ref->wd = inotify_add_watch(notify.fd, ref->path, FILEREF_WATCH_MASK);
+	if (ref->wd == -1) {
+		/* Most likely out of watches, fall back to revalidation. */
+		if (errno != ENOSPC || !watches_full) {
+			kore_log(LOG_NOTICE, "inotify_add_watch(%s): %s",
+			    ref->path, errno_s);
+		}
+		if (errno == ENOSPC)
+			watches_full = 1;
+		return;
+	}
+
+	LIST_INSERT_HEAD(&watches[ref->wd % FILEREF_WATCH_BUCKETS],
+	    ref, wlist);
+
+	/* The file may have changed before the watch was in place. */
+	if (stat(ref->path, &st) == -1) {
+		fileref_unwatch(ref);
+		return;
+	}
+
+	mtime = ((u_int64_t)(st.st_mtim.tv_sec * 1000 +
+	    (st.st_mtim.tv_nsec / 1000000)));
+
+	if (mtime != ref->mtime)
+		fileref_unwatch(ref);
+}
+
+static void
+fileref_unwatch(struct kore_fileref *ref)
+{
+	struct kore_fileref	*other;
+
+	if (ref->wd == -1)
+		return;
+
+	LIST_REMOVE(ref, wlist);
+
+	/* Both the TLS and plain ref of a file share the same watch. */
+	LIST_FOREACH(other, &watches[ref->wd % FILEREF_WATCH_BUCKETS], wlist) {
+		if (other->wd == ref->wd)
+			break;
+	}
+
+	if (other == NULL) {
+		(void)inotify_rm_watch(notify.fd, ref->wd);
+		watches_full = 0;
+	}
+
+	ref->wd = -1;
+}
+
+static void
+fileref_notify(void *arg, int error)
+{
+	ssize_t				ret;
+	struct inotify_event		*ev;
+	struct kore_fileref		*ref, *next;
+	u_int8_t			*p, buf[8192]
+				    __attribute__((aligned(__alignof__(*ev))));
+
+	if (error)
+		fatal("fileref_notify: error on inotify descriptor");
+
+	for (;;) {
+		ret = read(notify.fd, buf, sizeof(buf));
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			fatal("fileref_notify: read: %s", errno_s);
+		}
+
+		if (ret == 0)
+			break;
+
+		for (p = buf; p < buf + ret; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				kore_log(LOG_NOTICE, "inotify queue overflow");
+				fileref_notify_overflow();
+				continue;
+			}
+
+			ref = LIST_FIRST(&watches[ev->wd %
+			    FILEREF_WATCH_BUCKETS]);
+
+			for (; ref != NULL; ref = next) {
+				next = LIST_NEXT(ref, wlist);
+				if (ref->wd != ev->wd)
+					continue;
+
+				/* IN_ONESHOT already removed the watch. */
+				LIST_REMOVE(ref, wlist);
+				ref->wd = -1;
+
+#if defined(FILEREF_DEBUG)
+				kore_log(LOG_DEBUG, "ref:%p changed",
+				    (void *)ref);
+#endif
+				fileref_soft_remove(ref);
+			}
+		}
+	}
+}
+
+/* Events were lost, nothing watched can be trusted anymore. */
+static void
+fileref_notify_overflow(void)
+{
+	struct kore_fileref	*ref, *next;
+
+	for (ref = TAILQ_FIRST(&refs); ref != NULL; ref = next) {
+		next = TAILQ_NEXT(ref, list);
+		if (ref->wd != -1)
+			fileref_soft_remove(ref);
+	}
+}
+#endif
@@ -28,6 +28,10 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined(TLS_BACKEND_OPENSSL)
+#include <openssl/evp.h>
+#endif
+
 #include "kore.h"
 #include "http.h"
 
@@ -47,6 +51,19 @@
 #include "curl.h"
 #endif
 
+#if defined(__linux__)
+#include "seccomp.h"
+
+/* For offloaded bodies, see http_body_disk_open() and http_body_persist(). */
+static struct sock_filter filter_http[] = {
+	KORE_SYSCALL_ALLOW(fallocate),
+	KORE_SYSCALL_ALLOW(linkat),
+#if defined(SYS_link)
+	KORE_SYSCALL_ALLOW(link),
+#endif
+};
+#endif
+
 static struct {
 	const char	*ext;
 	const char	*type;
@@ -68,6 +85,38 @@ static struct {
 
 #define HTTP_MAP_LIMIT		127
 
+/*
+ * Well-known request headers get a fixed slot in req->hdr_known, the
+ * slot is a perfect hash over the name length and its first and last
+ * character (see http_header_known_slot()).
+ */
+#define HTTP_HEADER_KNOWN_HASH(l, f, e)		\
+	((((l) * 26) + (f) + ((e) * 11)) & (HTTP_HEADER_KNOWN_MAX - 1))
+
+static const char *http_known_headers[HTTP_HEADER_KNOWN_MAX] = {
+	[0] = "sec-websocket-key",
+	[1] = "connection",
+	[2] = "upgrade",
+	[4] = "x-forwarded-for",
+	[5] = "origin",
+	[7] = "content-length",
+	[11] = "range",
+	[12] = "host",
+	[13] = "authorization",
+	[14] = "referer",
+	[15] = "sec-websocket-version",
+	[16] = "if-range",
+	[18] = "content-type",
+	[19] = "if-none-match",
+	[20] = "accept-encoding",
+	[21] = "user-agent",
+	[22] = "cookie",
+	[25] = "accept",
+	[26] = "if-modified-since",
+	[27] = "transfer-encoding",
+	[29] = "expect",
+};
+
 /*
  * token      = 1*<any CHAR except CTLs or separators>
  * separators = "(" | ")" | "<" | ">" | "@"
@@ -127,18 +176,99 @@ static const char *pretty_error_fmt =
 	"<h1>%d %s</h1>\n"
 	"</body>\n</html>\n";
 
+/*
+ * Ties a streaming JSON writer to its request, the chunks in flight hold
+ * a reference so they never touch the request once the writer let go.
+ */
+struct http_json_sink {
+	u_int32_t		refs;
+	int			flags;
+	int			status;
+	u_int32_t		inflight;
+	struct http_request	*req;
+};
+
+#define HTTP_JSON_SINK_CHUNKED		0x0001
+#define HTTP_JSON_SINK_CLOSE		0x0002
+#define HTTP_JSON_SINK_ERROR		0x0004
+#define HTTP_JSON_SINK_DONE		0x0008
+
+/* Chunks of about 16KB, at most 4 of them waiting on the client. */
+#define HTTP_JSON_FLUSH_SIZE		(KORE_ROPE_CHUNK_DATA * 2)
+#define HTTP_JSON_INFLIGHT_MAX		4
+
+static u_int8_t		http_json_crlf[] = { '\r', '\n' };
+
+/*
+ * Where a request body sent with chunked transfer-encoding is in its
+ * decoding, size lines and trailers may come in over several reads.
+ */
+#define HTTP_CHUNKED_LINE_MAX		256
+#define HTTP_CHUNKED_BODY_INIT		4096
+
+#define HTTP_CHUNKED_SIZE		1
+#define HTTP_CHUNKED_DATA		2
+#define HTTP_CHUNKED_DATA_END		3
+#define HTTP_CHUNKED_TRAILER		4
+#define HTTP_CHUNKED_DONE		5
+
+struct http_chunked {
+	int			state;
+	u_int64_t		left;
+	size_t			trailer;
+	size_t			llen;
+	char			line[HTTP_CHUNKED_LINE_MAX];
+};
+
 static int	http_body_recv(struct netbuf *);
+static void	http_request_receiving(struct http_request *);
 static int	http_release_buffer(struct netbuf *);
+static void	http_json_flush(struct kore_json_writer *);
+static void	http_json_detach(struct kore_json_writer *);
+static int	http_json_sent(struct netbuf *);
+static void	http_json_sink_release(struct http_json_sink *);
 static void	http_error_response(struct connection *, int);
+static void	*http_body_hash_new(void);
+static void	http_body_hash_update(void *, const void *, size_t);
+static void	http_body_hash_final(void *, u_int8_t *);
+static void	http_body_hash_free(void *);
+static int	http_body_hash_stored(struct http_request *);
+static int	http_body_store(struct http_request *, const void *, size_t,
+		    int);
+static int	http_body_complete(struct http_request *);
+static int	http_body_chunked_setup(struct http_request *,
+		    const u_int8_t *, size_t);
+static int	http_body_chunked_update(struct http_request *,
+		    const u_int8_t *, size_t);
+static int	http_body_disk_open(struct http_request *);
+static int	http_body_disk_write(struct http_request *, const void *,
+		    size_t, int);
+static int	http_body_disk_flush(struct http_request *, const void *,
+		    size_t);
 static int	http_data_convert(void *, void **, void *, int);
-static void	http_write_response_cookie(struct http_cookie *);
-static int	http_body_update(struct http_request *, const void *, size_t);
-static void	http_argument_add(struct http_request *, char *, char *,
-		    int, int);
+static size_t	http_data_convert_size(int);
+static void	http_arguments_parse(struct http_request *);
+static int	http_arguments_pending(struct http_request *, u_int8_t);
+static void	http_arguments_split(struct http_request *, char *, int);
+static void	http_argument_insert(struct http_request *, char *, char *,
+		    int, int, int);
 static int	http_check_redirect(struct http_request *,
 		    struct kore_domain *);
+static void	http_slow_request(struct http_request *);
 static void	http_response_normal(struct http_request *,
 		    struct connection *, int, const void *, size_t);
+static void	http_response_write(struct http_request *,
+		    struct connection *, int, const void *, size_t,
+		    const void *, size_t);
+static int	http_fileref_ranges(struct http_request *,
+		    struct kore_fileref *, const char *,
+		    struct http_range *, int);
+static int	http_range_number(const char **, u_int64_t *);
+static int	http_etag_match(const char *, const char *);
+static int	http_qvalue(const char *, const char *);
+static void	http_response_fileref_multi(struct http_request *,
+		    struct kore_fileref *, const char *,
+		    struct http_range *, int);
 static void	multipart_add_field(struct http_request *, struct kore_buf *,
 		    char *, const char *, const int);
 static void	multipart_file_add(struct http_request *, struct kore_buf *,
@@ -149,27 +279,97 @@ static int	multipart_parse_headers(struct http_request *,
 		    struct kore_buf *, struct kore_buf *,
 		    const char *, const int);
 
-static struct http_request	*http_request_new(struct connection *,
-				    const char *, const char *, char *,
+#if defined(KORE_USE_TASKS)
+static int	http_offload_run(struct http_request *);
+static int	http_offload_task(struct kore_task *);
+static void	http_offload_response(struct http_request *, int,
+		    const void *, size_t, int);
+#endif
+
+static u_int32_t	http_header_hash(const char *);
+static int	http_header_known_slot(const char *, size_t);
+static void	http_header_index(struct http_request *, struct http_header *);
+static struct http_header	*http_header_lookup(struct http_request *,
 				    const char *);
 
+/*
+ * Pre-rendered status line and fixed headers, one per status code and
+ * HTTP version, connection mode and HSTS combination.
+ */
+#define HTTP_TEMPLATE_STATUS_MIN	100
+#define HTTP_TEMPLATE_STATUS_MAX	599
+#define HTTP_TEMPLATE_VARIANTS		12
+
+#define HTTP_TEMPLATE_VERSION_1_0	0x01
+#define HTTP_TEMPLATE_HSTS		0x02
+#define HTTP_TEMPLATE_CLOSE		0x04
+#define HTTP_TEMPLATE_NOCONN		0x08
+
+struct http_template {
+	size_t		len;
+	char		*data;
+};
+
+/*
+ * Small per-request allocations are carved out of fixed size chunks
+ * taken from http_arena_pool and handed back in one go when the
+ * request is freed. Large allocations get a chunk of their own,
+ * marked by a zero len.
+ */
+struct http_arena_chunk {
+	size_t				len;
+	size_t				off;
+	struct http_arena_chunk		*next;
+	u_int8_t			data[];
+};
+
+#define HTTP_ARENA_ALIGN	16
+#define HTTP_ARENA_DATA		\
+	(HTTP_ARENA_CHUNK - sizeof(struct http_arena_chunk))
+
+static void			http_arena_free(struct http_request *);
+
+static struct http_template	*http_template_get(int, int);
+static void			http_template_flush(void);
+static size_t			http_write_uint(char *, u_int64_t);
+
+static struct http_template	*http_templates[HTTP_TEMPLATE_STATUS_MAX -
+				    HTTP_TEMPLATE_STATUS_MIN + 1];
+static u_int16_t		http_template_keepalive;
+static u_int64_t		http_template_hsts;
+
+/* Per request phase timings are only taken when something consumes them. */
+#define HTTP_TIMING_ENABLED()	\
+	(kore_metrics_enabled || http_slow_request_ms != 0)
+
+static u_int64_t		http_slow_seen;
+static u_int64_t		http_slow_second;
+static u_int32_t		http_slow_logged;
+static u_int32_t		http_slow_dropped;
+
 static struct kore_buf			*header_buf;
 static struct kore_buf			*ckhdr_buf;
 static char				http_version[64];
 static u_int16_t			http_version_len;
 static TAILQ_HEAD(, http_request)	http_requests;
 static TAILQ_HEAD(, http_request)	http_requests_sleeping;
+static TAILQ_HEAD(, http_request)	http_requests_receiving;
+static u_int32_t			http_requests_ready = 0;
 static LIST_HEAD(, http_media_type)	http_media_types;
 static struct kore_pool			http_request_pool;
 static struct kore_pool			http_cookie_pool;
 static struct kore_pool			http_body_path;
 static struct kore_pool			http_rlq_pool;
+static struct kore_pool			http_arena_pool;
 
 struct kore_pool			http_header_pool;
 
 int		http_pretty_error = 0;
 u_int32_t	http_request_count = 0;
 u_int32_t	http_request_ms = HTTP_REQUEST_MS;
+u_int32_t	http_slow_request_ms = 0;
+u_int32_t	http_slow_request_rate = HTTP_SLOW_REQUEST_RATE;
+u_int32_t	http_slow_request_sample = HTTP_SLOW_REQUEST_SAMPLE;
 u_int16_t	http_body_timeout = HTTP_BODY_TIMEOUT;
 u_int32_t	http_request_limit = HTTP_REQUEST_LIMIT;
 u_int64_t	http_hsts_enable = HTTP_HSTS_ENABLE;
@@ -180,11 +380,17 @@ u_int16_t	http_header_timeout = HTTP_HEADER_TIMEOUT;
 size_t		http_body_max = HTTP_BODY_MAX_LEN;
 char		*http_body_disk_path = HTTP_BODY_DISK_PATH;
 u_int64_t	http_body_disk_offload = HTTP_BODY_DISK_OFFLOAD;
+size_t		http_body_disk_buffer = HTTP_BODY_DISK_BUFFER;
+int		http_body_disk_tmpfile = 0;
 
 void
 http_parent_init(void)
 {
 	LIST_INIT(&http_media_types);
+
+#if defined(__linux__)
+	kore_seccomp_filter("http", filter_http, KORE_FILTER_LEN(filter_http));
+#endif
 }
 
 void
@@ -194,6 +400,7 @@ http_init(void)
 
 	TAILQ_INIT(&http_requests);
 	TAILQ_INIT(&http_requests_sleeping);
+	TAILQ_INIT(&http_requests_receiving);
 
 	header_buf = kore_buf_alloc(HTTP_HEADER_BUFSIZE);
 	ckhdr_buf = kore_buf_alloc(HTTP_COOKIE_BUFSIZE);
@@ -219,6 +426,16 @@ http_init(void)
 
 	kore_pool_init(&http_body_path,
 	    "http_body_path", HTTP_BODY_PATH_MAX, prealloc);
+	kore_pool_init(&http_arena_pool,
+	    "http_arena_pool", HTTP_ARENA_CHUNK, prealloc);
+
+	net_recv_buffers_init(http_header_max, worker_max_connections);
+
+	http2_init();
+	http_overload_init();
+#if defined(KORE_USE_COMPRESS)
+	http_compress_init();
+#endif
 
 	for (i = 0; builtin_media[i].ext != NULL; i++) {
 		if (!http_media_register(builtin_media[i].ext,
@@ -242,9 +459,16 @@ http_cleanup(void)
 		ckhdr_buf = NULL;
 	}
 
+	http_template_flush();
+	http2_cleanup();
+#if defined(KORE_USE_COMPRESS)
+	http_compress_cleanup();
+#endif
+
 	kore_pool_cleanup(&http_request_pool);
 	kore_pool_cleanup(&http_header_pool);
 	kore_pool_cleanup(&http_body_path);
+	kore_pool_cleanup(&http_arena_pool);
 }
 
 void
@@ -258,6 +482,16 @@ http_server_version(const char *version)
 		fatal("http_server_version(): http_version buffer too small");
 
 	http_version_len = l;
+	http_template_flush();
+}
+
+/* The value of the server header, without the name and line ending. */
+const char *
+http_server_header(size_t *len)
+{
+	*len = http_version_len - (sizeof("server: \r\n") - 1);
+
+	return (http_version + sizeof("server: ") - 1);
 }
 
 int
@@ -289,7 +523,15 @@ http_request_sleep(struct http_request *req)
 		kore_debug("http_request_sleep: %p napping", req);
 
 		req->flags |= HTTP_REQUEST_SLEEPING;
-		TAILQ_REMOVE(&http_requests, req, list);
+		if (req->t_created != 0)
+			req->t_slept = kore_time_us();
+		if (req->receiving) {
+			req->receiving = 0;
+			TAILQ_REMOVE(&http_requests_receiving, req, list);
+		} else {
+			TAILQ_REMOVE(&http_requests, req, list);
+			http_requests_ready--;
+		}
 		TAILQ_INSERT_TAIL(&http_requests_sleeping, req, list);
 	}
 }
@@ -301,41 +543,141 @@ http_request_wakeup(struct http_request *req)
 		kore_debug("http_request_wakeup: %p woke up", req);
 
 		req->flags &= ~HTTP_REQUEST_SLEEPING;
+		if (req->t_created != 0)
+			req->t_sleep += kore_time_us() - req->t_slept;
 		TAILQ_REMOVE(&http_requests_sleeping, req, list);
 		TAILQ_INSERT_TAIL(&http_requests, req, list);
+		http_requests_ready++;
+	} else if (req->receiving) {
+		req->receiving = 0;
+		TAILQ_REMOVE(&http_requests_receiving, req, list);
+		TAILQ_INSERT_TAIL(&http_requests, req, list);
+		http_requests_ready++;
+	}
+}
+
+/*
+ * Park a request that is waiting on the rest of its body so http_process()
+ * does not look at it until http_request_wakeup() is called for it, which
+ * happens once the body is complete or the request is to be deleted.
+ */
+static void
+http_request_receiving(struct http_request *req)
+{
+	if (req->receiving || (req->flags & HTTP_REQUEST_SLEEPING))
+		return;
+
+	req->receiving = 1;
+	TAILQ_REMOVE(&http_requests, req, list);
+	TAILQ_INSERT_TAIL(&http_requests_receiving, req, list);
+	http_requests_ready--;
+}
+
+/*
+ * Account for the request against the ratelimit of its route. When it is
+ * over the limit it is answered with a 429 and marked for deletion, the
+ * caller must not touch it any further.
+ */
+int
+http_ratelimit_check(struct http_request *req)
+{
+	u_int64_t		retry;
+	const char		*key;
+	char			secs[32];
+	struct kore_route	*rt = req->rt;
+
+	if (rt->ratelimit == NULL)
+		return (KORE_RESULT_OK);
+
+	key = NULL;
+
+	switch (rt->ratelimit_key) {
+	case KORE_RATELIMIT_KEY_ROUTE:
+		key = rt->path;
+		break;
+	case KORE_RATELIMIT_KEY_AUTH:
+		/* Falls back to the client address if there is no identity. */
+		if (rt->auth == NULL)
+			break;
+		if (rt->auth->type == KORE_AUTH_TYPE_HEADER)
+			(void)http_request_header(req, rt->auth->value, &key);
+		else if (rt->auth->type == KORE_AUTH_TYPE_COOKIE)
+			(void)http_request_header(req, "cookie", &key);
+		break;
+	}
+
+	if (key != NULL) {
+		if (kore_ratelimit_check(rt->ratelimit,
+		    key, strlen(key), &retry))
+			return (KORE_RESULT_OK);
+	} else if (kore_ratelimit_connection(rt->ratelimit,
+	    req->owner, &retry)) {
+		return (KORE_RESULT_OK);
 	}
+
+	(void)snprintf(secs, sizeof(secs), "%" PRIu64, (retry + 999) / 1000);
+	http_response_header(req, "retry-after", secs);
+	http_response_close(req, HTTP_STATUS_TOO_MANY_REQUESTS, NULL, 0);
+	req->flags |= HTTP_REQUEST_DELETE;
+
+	return (KORE_RESULT_ERROR);
 }
 
+/*
+ * Run the requests that are ready in round-robin order, anything that is
+ * still ready afterwards goes to the back of the queue so requests near
+ * the end get their turn when http_request_ms runs out. Requests that are
+ * receiving a body or sleeping are kept on their own lists.
+ */
 void
 http_process(void)
 {
+	u_int32_t			count;
 	u_int64_t			total;
-	struct http_request		*req, *next;
+	struct http_request		*req;
 
 	total = 0;
+	http_overload_sample();
 
-	for (req = TAILQ_FIRST(&http_requests); req != NULL; req = next) {
-		if (total >= http_request_ms)
-			break;
+	for (;;) {
+		count = http_requests_ready;
 
-		next = TAILQ_NEXT(req, list);
-		if (req->flags & HTTP_REQUEST_DELETE) {
-			http_request_free(req);
-			continue;
-		}
+		while (count > 0 && total < http_request_ms &&
+		    (req = TAILQ_FIRST(&http_requests)) != NULL) {
+			count--;
 
-		/* Sleeping requests should be in http_requests_sleeping. */
-		if (req->flags & HTTP_REQUEST_SLEEPING)
-			fatal("http_process: sleeping request on list");
+			if (req->flags & HTTP_REQUEST_DELETE) {
+				http_request_free(req);
+				continue;
+			}
 
-		if (!(req->flags & HTTP_REQUEST_COMPLETE))
-			continue;
+			/* Sleeping requests belong on http_requests_sleeping. */
+			if (req->flags & HTTP_REQUEST_SLEEPING)
+				fatal("http_process: sleeping request on list");
+
+			if (req->flags & HTTP_REQUEST_COMPLETE) {
+				http_process_request(req);
+				total += req->ms;
+			}
+
+			if (req->flags & HTTP_REQUEST_DELETE) {
+				http_request_free(req);
+			} else if (!(req->flags & HTTP_REQUEST_SLEEPING) &&
+			    !req->receiving) {
+				TAILQ_REMOVE(&http_requests, req, list);
+				TAILQ_INSERT_TAIL(&http_requests, req, list);
+			}
+		}
 
-		http_process_request(req);
-		total += req->ms;
+		/*
+		 * Responses sent above rearm pipelining connections, parse
+		 * their next request right away while we have time left
+		 * instead of waiting for another trip through the event loop.
+		 */
+		if (total >= http_request_ms || !net_recv_pending())
+			break;
 
-		if (req->flags & HTTP_REQUEST_DELETE)
-			http_request_free(req);
+		net_recv_pending_flush();
 	}
 }
 
@@ -343,6 +685,7 @@ void
 http_process_request(struct http_request *req)
 {
 	int		r;
+	u_int64_t	t, now;
 
 	kore_debug("http_process_request: %p->%p (%s)",
 	    req->owner, req, req->path);
@@ -350,15 +693,41 @@ http_process_request(struct http_request *req)
 	if (req->flags & HTTP_REQUEST_DELETE || req->rt == NULL)
 		return;
 
+	KORE_PROBE3(request__start, req, req->owner, req->path);
+
 	req->start = kore_time_ms();
-	if (req->rt->auth != NULL && !(req->flags & HTTP_REQUEST_AUTHED))
+	t = req->t_created != 0 ? kore_time_us() : 0;
+
+	http_overload_start(req);
+
+	if (req->rt->auth != NULL && !(req->flags & HTTP_REQUEST_AUTHED)) {
 		r = kore_auth_run(req, req->rt->auth);
-	else
+		if (t != 0) {
+			now = kore_time_us();
+			req->t_auth += now - t;
+			t = now;
+		}
+	} else {
 		r = KORE_RESULT_OK;
+	}
 
 	switch (r) {
 	case KORE_RESULT_OK:
-		r = kore_runtime_http_request(req->rt->rcall, req);
+		/* Answered from the cache, or waiting for it to be filled. */
+		if (req->rt->cache != NULL &&
+		    (r = http_cache_serve(req)) != KORE_RESULT_ERROR)
+			break;
+
+		if (req->rt->upstream != NULL)
+			r = kore_upstream_run(req);
+#if defined(KORE_USE_TASKS)
+		else if (req->rt->offload)
+			r = http_offload_run(req);
+#endif
+		else
+			r = kore_runtime_http_request(req->rt->rcall, req);
+		if (t != 0)
+			req->t_handler += kore_time_us() - t;
 		break;
 	case KORE_RESULT_RETRY:
 		break;
@@ -378,12 +747,17 @@ http_process_request(struct http_request *req)
 
 	switch (r) {
 	case KORE_RESULT_OK:
+		t = req->t_created != 0 ? kore_time_us() : 0;
 		r = net_send_flush(req->owner);
+		if (t != 0)
+			req->t_flush += kore_time_us() - t;
 		if (r == KORE_RESULT_ERROR)
 			kore_connection_disconnect(req->owner);
 		break;
 	case KORE_RESULT_ERROR:
-		kore_connection_disconnect(req->owner);
+		/* On HTTP/2 only the stream is reset, see http2_request_free. */
+		if (req->owner->proto != CONN_PROTO_HTTP2)
+			kore_connection_disconnect(req->owner);
 		break;
 	case KORE_RESULT_RETRY:
 		return;
@@ -394,6 +768,10 @@ http_process_request(struct http_request *req)
 	if (req->rt->dom->accesslog)
 		kore_accesslog(req);
 
+	if (http_slow_request_ms != 0 && req->t_created != 0)
+		http_slow_request(req);
+
+	kore_metrics_request(req);
 	req->flags |= HTTP_REQUEST_DELETE;
 }
 
@@ -409,8 +787,6 @@ http_response_header(struct http_request *req,
 	TAILQ_FOREACH(hdr, &req->resp_headers, list) {
 		if (!strcasecmp(hdr->header, header)) {
 			TAILQ_REMOVE(&req->resp_headers, hdr, list);
-			kore_free(hdr->header);
-			kore_free(hdr->value);
 			break;
 		}
 	}
@@ -418,12 +794,24 @@ http_response_header(struct http_request *req,
 	if (hdr == NULL)
 		hdr = kore_pool_get(&http_header_pool);
 
-	hdr->header = kore_strdup(header);
-	hdr->value = kore_strdup(value);
+	hdr->header = http_request_strdup(req, header);
+	hdr->value = http_request_strdup(req, value);
 
 	TAILQ_INSERT_TAIL(&(req->resp_headers), hdr, list);
 }
 
+void
+http_request_header_add(struct http_request *req, char *header, char *value)
+{
+	struct http_header	*hdr;
+
+	hdr = kore_pool_get(&http_header_pool);
+	hdr->header = header;
+	hdr->value = value;
+	TAILQ_INSERT_TAIL(&(req->req_headers), hdr, list);
+	http_header_index(req, hdr);
+}
+
 void
 http_request_free(struct http_request *req)
 {
@@ -437,19 +825,29 @@ http_request_free(struct http_request *req)
 #if defined(KORE_USE_CURL)
 	struct kore_curl	*client;
 #endif
-	struct http_file	*f, *fnext;
-	struct http_arg		*q, *qnext;
 	struct http_header	*hdr, *next;
 	struct http_cookie	*ck, *cknext;
+	struct http_file	*f;
+
+	KORE_PROBE3(request__done, req, req->status,
+	    req->rt != NULL ? req->rt->path : "");
 
 	if (req->rt != NULL && req->rt->on_free != NULL)
 		kore_runtime_http_request_free(req->rt->on_free, req);
 
+	if (req->onfree != NULL) {
+		req->onfree(req);
+		req->onfree = NULL;
+	}
+
 	if (req->runlock != NULL) {
 		LIST_REMOVE(req->runlock, list);
 		req->runlock = NULL;
 	}
 
+	if (req->cache != NULL)
+		http_cache_release(req);
+
 #if defined(KORE_USE_TASKS)
 	pending_tasks = 0;
 	for (t = LIST_FIRST(&(req->tasks)); t != NULL; t = nt) {
@@ -465,6 +863,13 @@ http_request_free(struct http_request *req)
 		kore_debug("http_request_free %d pending tasks", pending_tasks);
 		return;
 	}
+
+	/* Destroyed together with the other tasks above. */
+	kore_free(req->offload);
+	req->offload = NULL;
+
+	kore_free(req->offload_body);
+	req->offload_body = NULL;
 #endif
 
 #if defined(KORE_USE_PYTHON)
@@ -476,7 +881,7 @@ http_request_free(struct http_request *req)
 		kore_python_coro_delete(req->py_validator);
 		req->py_validator = NULL;
 	}
-	Py_XDECREF(req->py_req);
+	kore_python_http_request_release(req);
 #endif
 #if defined(KORE_USE_PGSQL)
 	while (!LIST_EMPTY(&(req->pgsqls))) {
@@ -490,22 +895,37 @@ http_request_free(struct http_request *req)
 		kore_curl_cleanup(client);
 	}
 #endif
+	if (req->upstream != NULL)
+		kore_upstream_cleanup(req);
+
 	kore_debug("http_request_free: %p->%p", req->owner, req);
-	kore_free(req->headers);
+	if (req->flags & HTTP_REQUEST_POOLED_HEADERS)
+		net_recv_buffer_put(req->headers);
+	else
+		kore_free(req->headers);
 
 	req->host = NULL;
 	req->path = NULL;
 	req->headers = NULL;
 
-	TAILQ_REMOVE(&http_requests, req, list);
+	if (req->stream != NULL)
+		http2_request_free(req);
+
+	if (req->flags & HTTP_REQUEST_SLEEPING) {
+		TAILQ_REMOVE(&http_requests_sleeping, req, list);
+	} else if (req->receiving) {
+		TAILQ_REMOVE(&http_requests_receiving, req, list);
+	} else {
+		TAILQ_REMOVE(&http_requests, req, list);
+		http_requests_ready--;
+	}
+
 	if (req->owner != NULL)
 		TAILQ_REMOVE(&(req->owner->http_requests), req, olist);
 
 	for (hdr = TAILQ_FIRST(&(req->resp_headers)); hdr != NULL; hdr = next) {
 		next = TAILQ_NEXT(hdr, list);
 		TAILQ_REMOVE(&(req->resp_headers), hdr, list);
-		kore_free(hdr->header);
-		kore_free(hdr->value);
 		kore_pool_put(&http_header_pool, hdr);
 	}
 
@@ -518,45 +938,42 @@ http_request_free(struct http_request *req)
 	for (ck = TAILQ_FIRST(&(req->resp_cookies)); ck != NULL; ck = cknext) {
 		cknext = TAILQ_NEXT(ck, list);
 		TAILQ_REMOVE(&(req->resp_cookies), ck, list);
-		kore_free(ck->name);
-		kore_free(ck->value);
-		kore_free(ck->path);
-		kore_free(ck->domain);
 		kore_pool_put(&http_cookie_pool, ck);
 	}
 
 	for (ck = TAILQ_FIRST(&(req->req_cookies)); ck != NULL; ck = cknext) {
 		cknext = TAILQ_NEXT(ck, list);
 		TAILQ_REMOVE(&(req->req_cookies), ck, list);
-		kore_free(ck->name);
-		kore_free(ck->value);
 		kore_pool_put(&http_cookie_pool, ck);
 	}
 
-	for (q = TAILQ_FIRST(&(req->arguments)); q != NULL; q = qnext) {
-		qnext = TAILQ_NEXT(q, list);
-		TAILQ_REMOVE(&(req->arguments), q, list);
-		kore_free(q->name);
-		kore_free(q->s_value);
-		kore_free(q);
-	}
-
-	for (f = TAILQ_FIRST(&(req->files)); f != NULL; f = fnext) {
-		fnext = TAILQ_NEXT(f, list);
-		TAILQ_REMOVE(&(req->files), f, list);
-		kore_free(f->filename);
-		kore_free(f->name);
-		kore_free(f);
-	}
-
 	if (req->http_body != NULL)
 		kore_buf_free(req->http_body);
 
 	if (req->http_body_fd != -1)
 		(void)close(req->http_body_fd);
 
+	TAILQ_FOREACH(f, &(req->files), list) {
+		if (f->fd == -1)
+			continue;
+		(void)close(f->fd);
+		if (unlink(f->path) == -1 && errno != ENOENT) {
+			kore_log(LOG_NOTICE, "failed to unlink %s: %s",
+			    f->path, errno_s);
+		}
+	}
+
+	http_multipart_free(req->multipart);
+
+	if (req->http_body_pending != NULL)
+		kore_buf_free(req->http_body_pending);
+
+	if (req->hashctx != NULL)
+		http_body_hash_free(req->hashctx);
+
 	if (req->http_body_path != NULL) {
-		if (unlink(req->http_body_path) == -1 && errno != ENOENT) {
+		if (!(req->flags & HTTP_REQUEST_BODY_TMPFILE) &&
+		    unlink(req->http_body_path) == -1 && errno != ENOENT) {
 			kore_log(LOG_NOTICE, "failed to unlink %s: %s",
 			    req->http_body_path, errno_s);
 		}
@@ -567,10 +984,73 @@ http_request_free(struct http_request *req)
 	    !(req->flags & HTTP_REQUEST_RETAIN_EXTRA))
 		kore_free(req->hdlr_extra);
 
+	http_overload_release(req);
+	http_arena_free(req);
 	kore_pool_put(&http_request_pool, req);
 	http_request_count--;
 }
 
+void *
+http_request_alloc(struct http_request *req, size_t len)
+{
+	struct http_arena_chunk		*chunk;
+	u_int8_t			*ptr;
+	size_t				pad;
+
+	if (len == 0 || len > SIZE_MAX - HTTP_ARENA_CHUNK)
+		fatal("http_request_alloc: invalid length %zu", len);
+
+	if (len > HTTP_ARENA_DATA / 4) {
+		chunk = kore_malloc(sizeof(*chunk) + len);
+		chunk->len = 0;
+		chunk->off = len;
+
+		if (req->arena != NULL) {
+			chunk->next = req->arena->next;
+			req->arena->next = chunk;
+		} else {
+			chunk->next = NULL;
+			req->arena = chunk;
+		}
+
+		return (chunk->data);
+	}
+
+	chunk = req->arena;
+	if (chunk != NULL) {
+		ptr = chunk->data + chunk->off;
+		pad = -(uintptr_t)ptr & (HTTP_ARENA_ALIGN - 1);
+		if (chunk->len != 0 && chunk->len - chunk->off >= pad + len) {
+			chunk->off += pad + len;
+			return (ptr + pad);
+		}
+	}
+
+	chunk = kore_pool_get(&http_arena_pool);
+	chunk->len = HTTP_ARENA_DATA;
+	chunk->next = req->arena;
+	req->arena = chunk;
+
+	ptr = chunk->data;
+	pad = -(uintptr_t)ptr & (HTTP_ARENA_ALIGN - 1);
+	chunk->off = pad + len;
+
+	return (ptr + pad);
+}
+
+char *
+http_request_strdup(struct http_request *req, const char *str)
+{
+	char		*nstr;
+	size_t		len;
+
+	len = strlen(str) + 1;
+	nstr = http_request_alloc(req, len);
+	memcpy(nstr, str, len);
+
+	return (nstr);
+}
+
 void
 http_serveable(struct http_request *req, const void *data, size_t len,
     const char *etag, const char *type)
@@ -598,6 +1078,13 @@ http_serveable(struct http_request *req, const void *data, size_t len,
 void
 http_response(struct http_request *req, int code, const void *d, size_t l)
 {
+#if defined(KORE_USE_TASKS)
+	if (req->flags & HTTP_REQUEST_OFFLOADED) {
+		http_offload_response(req, code, d, l, 0);
+		return;
+	}
+#endif
+
 	if (req->owner == NULL)
 		return;
 
@@ -605,9 +1092,19 @@ http_response(struct http_request *req, int code, const void *d, size_t l)
 
 	req->status = code;
 
+	if (req->cache != NULL)
+		http_cache_store(req, code, d, l);
+
+#if defined(KORE_USE_COMPRESS)
+	if (http_compress_response(req, code, d, l))
+		return;
+#endif
+
 	switch (req->owner->proto) {
 	case CONN_PROTO_HTTP:
+	case CONN_PROTO_HTTP2:
 	case CONN_PROTO_WEBSOCKET:
+	case CONN_PROTO_SSE:
 		http_response_normal(req, req->owner, code, d, l);
 		break;
 	default:
@@ -619,1017 +1116,1820 @@ http_response(struct http_request *req, int code, const void *d, size_t l)
 void
 http_response_close(struct http_request *req, int code, const void *d, size_t l)
 {
+#if defined(KORE_USE_TASKS)
+	if (req->flags & HTTP_REQUEST_OFFLOADED) {
+		http_offload_response(req, code, d, l, 1);
+		return;
+	}
+#endif
+
 	if (req->owner == NULL)
 		return;
 
 	kore_debug("%s(%p, %d, %p, %zu)", __func__, req, code, d, l);
 
 	req->status = code;
-	req->owner->flags |= CONN_CLOSE_EMPTY;
 
 	switch (req->owner->proto) {
 	case CONN_PROTO_HTTP:
 	case CONN_PROTO_WEBSOCKET:
-		http_response_normal(req, req->owner, code, d, l);
+	case CONN_PROTO_SSE:
+		req->owner->flags |= CONN_CLOSE_EMPTY;
+		break;
+	case CONN_PROTO_HTTP2:
+		/* Only the stream ends, the connection stays up. */
 		break;
 	default:
 		fatal("%s: bad proto %d", __func__, req->owner->proto);
 		/* NOTREACHED. */
 	}
+
+#if defined(KORE_USE_COMPRESS)
+	if (http_compress_response(req, code, d, l))
+		return;
+#endif
+
+	http_response_normal(req, req->owner, code, d, l);
 }
 
 void
 http_response_json(struct http_request *req, int status,
     struct kore_json_item *json)
 {
-	struct kore_buf		*buf;
+	struct kore_rope	rope;
 
 	if (req->owner == NULL)
 		return;
 
 	kore_debug("%s(%p, %d)", __func__, req, status);
 
-	buf = kore_buf_alloc(1024);
-	kore_json_item_tobuf(json, buf);
+	kore_rope_init(&rope);
+	kore_json_item_torope(json, &rope);
 	kore_json_item_free(json);
 
-	req->status = status;
 	http_response_header(req, "content-type", "application/json");
-
-	switch (req->owner->proto) {
-	case CONN_PROTO_HTTP:
-		http_response_stream(req, status, buf->data, buf->offset,
-		    http_release_buffer, buf);
-		break;
-	default:
-		fatal("%s: bad proto %d", __func__, req->owner->proto);
-		/* NOTREACHED. */
-	}
+	http_response_rope(req, status, &rope);
 }
 
+/*
+ * Send the contents of rope as the response body, the chunks are handed
+ * to the send queue directly on HTTP/1.x. The rope is left empty.
+ */
 void
-http_response_stream(struct http_request *req, int status, void *base,
-    size_t len, int (*cb)(struct netbuf *), void *arg)
+http_response_rope(struct http_request *req, int status,
+    struct kore_rope *rope)
 {
-	struct netbuf		*nb;
+	struct kore_buf		*buf;
 
-	if (req->owner == NULL)
+#if defined(KORE_USE_TASKS)
+	if (req->flags & HTTP_REQUEST_OFFLOADED) {
+		buf = kore_buf_alloc(rope->length);
+		kore_rope_tobuf(rope, buf);
+		kore_rope_cleanup(rope);
+		http_offload_response(req, status, buf->data, buf->offset, 0);
+		kore_buf_free(buf);
+		return;
+	}
+#endif
+
+	if (req->owner == NULL) {
+		kore_rope_cleanup(rope);
+		return;
+	}
+
+	if (rope->length == 0) {
+		http_response(req, status, NULL, 0);
 		return;
+	}
 
 	req->status = status;
 
 	switch (req->owner->proto) {
 	case CONN_PROTO_HTTP:
-		http_response_normal(req, req->owner, status, NULL, len);
+		/* A cache fill takes a copy, the chunks still go out as is. */
+		if (req->cache != NULL) {
+			buf = kore_buf_alloc(rope->length);
+			kore_rope_tobuf(rope, buf);
+			http_cache_store(req, status, buf->data, buf->offset);
+			kore_buf_free(buf);
+		}
+#if defined(KORE_USE_COMPRESS)
+		if (http_compress_rope(req, status, rope))
+			return;
+#endif
+		http_response_normal(req, req->owner, status,
+		    NULL, rope->length);
+
+		if (req->method == HTTP_METHOD_HEAD)
+			kore_rope_cleanup(rope);
+		else
+			net_send_queue_rope(req->owner, rope);
+		break;
+	case CONN_PROTO_HTTP2:
+		/* DATA frames are cut from a single buffer. */
+		buf = kore_buf_alloc(rope->length);
+		kore_rope_tobuf(rope, buf);
+		kore_rope_cleanup(rope);
+		http_response_stream(req, status, buf->data, buf->offset,
+		    http_release_buffer, buf);
 		break;
 	default:
 		fatal("%s: bad proto %d", __func__, req->owner->proto);
 		/* NOTREACHED. */
 	}
-
-	net_send_stream(req->owner, base, len, cb, &nb);
-	nb->extra = arg;
-
-	if (req->method == HTTP_METHOD_HEAD) {
-		nb->s_off = nb->b_len;
-		net_remove_netbuf(req->owner, nb);
-	}
 }
 
+/*
+ * Start a response that is written with the JSON writer w, which is
+ * initialized here. On HTTP/1.1 the output goes out as a chunked body
+ * while it is being written, everywhere else it is collected and sent
+ * by http_response_json_end().
+ *
+ * A handler that writes a lot should check http_response_json_busy()
+ * between values and return KORE_RESULT_RETRY while it says so, the
+ * request is woken up again once the client has caught up. The writer
+ * must be released with kore_json_writer_cleanup() in all cases.
+ */
 void
-http_response_fileref(struct http_request *req, int status,
-    struct kore_fileref *ref)
+http_response_json_begin(struct http_request *req, int status,
+    struct kore_json_writer *w)
 {
-	struct tm	*tm;
-	time_t		mtime;
-	char		tbuf[128];
-	const char	*media_type, *modified;
+	struct connection	*c;
+	struct http_json_sink	*sink;
 
-	if (req->owner == NULL)
-		return;
+	kore_json_writer_init(w);
 
-	media_type = http_media_type(ref->path);
-	if (media_type != NULL)
-		http_response_header(req, "content-type", media_type);
+	sink = kore_calloc(1, sizeof(*sink));
+	sink->refs = 1;
+	sink->req = req;
+	sink->status = status;
 
-	if (http_request_header(req, "if-modified-since", &modified)) {
-		mtime = kore_date_to_time(modified);
-		if (mtime == ref->mtime_sec) {
-			kore_fileref_release(ref);
-			http_response(req, HTTP_STATUS_NOT_MODIFIED, NULL, 0);
-			return;
-		}
-	}
+	w->arg = sink;
+	w->cleanup = http_json_detach;
 
-	if ((tm = gmtime(&ref->mtime_sec)) != NULL) {
-		if (strftime(tbuf, sizeof(tbuf),
-		    "%a, %d %b %Y %H:%M:%S GMT", tm) > 0) {
-			http_response_header(req, "last-modified", tbuf);
-		}
-	}
+	c = req->owner;
 
-	req->status = status;
-	switch (req->owner->proto) {
-	case CONN_PROTO_HTTP:
-		http_response_normal(req, req->owner, status, NULL, ref->size);
-		break;
-	default:
-		fatal("http_response_fd() bad proto %d", req->owner->proto);
-		/* NOTREACHED. */
-	}
+	if (c == NULL || c->proto != CONN_PROTO_HTTP ||
+	    req->method == HTTP_METHOD_HEAD ||
+	    (req->flags & HTTP_VERSION_1_0))
+		return;
 
-	if (req->method != HTTP_METHOD_HEAD)
-		net_send_fileref(req->owner, ref);
-	else
-		kore_fileref_release(ref);
-}
+#if defined(KORE_USE_TASKS)
+	if (req->flags & HTTP_REQUEST_OFFLOADED)
+		return;
+#endif
 
-int
-http_request_header(struct http_request *req, const char *header,
-    const char **out)
-{
-	struct http_header	*hdr;
+	sink->flags |= HTTP_JSON_SINK_CHUNKED;
+	w->flush = http_json_flush;
+	w->flush_size = HTTP_JSON_FLUSH_SIZE;
 
-	TAILQ_FOREACH(hdr, &(req->req_headers), list) {
-		if (!strcasecmp(hdr->header, header)) {
-			*out = hdr->value;
-			return (KORE_RESULT_OK);
-		}
-	}
+	req->flags |= HTTP_REQUEST_NO_CONTENT_LENGTH;
+	http_response_header(req, "content-type", "application/json");
+	http_response_header(req, "transfer-encoding", "chunked");
 
-	if (!strcasecmp(header, "host")) {
-		*out = req->host;
-		return (KORE_RESULT_OK);
-	}
+	/* We start receiving again once the body is complete. */
+	c->flags |= CONN_IS_BUSY;
+	http_response(req, status, NULL, 0);
 
-	return (KORE_RESULT_ERROR);
+	/* The body isn't queued yet, don't close after the headers. */
+	if (c->flags & CONN_CLOSE_EMPTY) {
+		c->flags &= ~CONN_CLOSE_EMPTY;
+		sink->flags |= HTTP_JSON_SINK_CLOSE;
+	}
 }
 
+/*
+ * Returns 1 and puts the request to sleep when enough of the streamed
+ * body is still waiting to be sent, the handler returns KORE_RESULT_RETRY.
+ */
 int
-http_request_header_get(struct http_request *req, const char *header,
-    void **out, void *nout, int type)
+http_response_json_busy(struct http_request *req, struct kore_json_writer *w)
 {
-	struct http_header	*hdr;
+	struct http_json_sink	*sink;
 
-	if (type == HTTP_ARG_TYPE_STRING)
-		fatal("%s: cannot be called with type string", __func__);
+	if ((sink = w->arg) == NULL)
+		return (0);
 
-	TAILQ_FOREACH(hdr, &req->req_headers, list) {
-		if (strcasecmp(hdr->header, header))
-			continue;
+	if (!(sink->flags & HTTP_JSON_SINK_CHUNKED) ||
+	    (sink->flags & HTTP_JSON_SINK_ERROR))
+		return (0);
 
-		if (http_data_convert(hdr->value, out, nout, type))
-			return (KORE_RESULT_OK);
+	if (sink->inflight < HTTP_JSON_INFLIGHT_MAX)
+		return (0);
 
-		return (KORE_RESULT_ERROR);
-	}
+	http_request_sleep(req);
 
-	return (KORE_RESULT_ERROR);
+	return (1);
 }
 
+/*
+ * Finish the response once the last value was written, returns
+ * KORE_RESULT_ERROR if the client went away while it was streamed.
+ */
 int
-http_request_cookie(struct http_request *req, const char *cookie, char **out)
+http_response_json_end(struct http_request *req, struct kore_json_writer *w)
 {
-	struct http_cookie	*ck;
+	struct connection	*c;
+	struct http_json_sink	*sink;
+	int			ret, status;
 
-	TAILQ_FOREACH(ck, &(req->req_cookies), list) {
-		if (!strcasecmp(ck->name, cookie)) {
-			*out = ck->value;
-			return (KORE_RESULT_OK);
-		}
-	}
+	if ((sink = w->arg) == NULL)
+		fatal("%s: writer was not started", __func__);
 
-	return (KORE_RESULT_ERROR);
-}
+	if (w->depth != 0 || (w->flags & KORE_JSON_WRITER_KEY))
+		fatal("%s: incomplete JSON document", __func__);
 
-int
-http_header_recv(struct netbuf *nb)
-{
-	struct connection	*c;
-	size_t			len;
-	struct http_header	*hdr;
-	struct http_request	*req;
-	u_int8_t		*end_headers;
-	int			h, i, v, skip, l;
-	char			*headers[HTTP_REQ_HEADER_MAX];
-	char			*value, *host, *request[4], *hbuf;
+	if (!(sink->flags & HTTP_JSON_SINK_CHUNKED)) {
+		status = sink->status;
+		http_json_detach(w);
 
-	c = nb->owner;
-	kore_debug("http_header_recv(%p)", nb);
+		http_response_header(req, "content-type", "application/json");
+		http_response_rope(req, status, &w->rope);
 
-	if (nb->b_len < 4)
 		return (KORE_RESULT_OK);
-
-	if (!isalpha(nb->buf[0])) {
-		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-		return (KORE_RESULT_ERROR);
 	}
 
-	skip = 4;
-	end_headers = kore_mem_find(nb->buf, nb->s_off, "\r\n\r\n", 4);
-	if (end_headers == NULL) {
-		end_headers = kore_mem_find(nb->buf, nb->s_off, "\n\n", 2);
-		if (end_headers == NULL)
-			return (KORE_RESULT_OK);
-		skip = 2;
-	}
+	ret = KORE_RESULT_ERROR;
+	w->flush = NULL;
 
-	*end_headers = '\0';
-	end_headers += skip;
-	len = end_headers - nb->buf;
-	hbuf = (char *)nb->buf;
+	if (!(sink->flags & HTTP_JSON_SINK_ERROR) && req->owner != NULL) {
+		c = req->owner;
 
-	h = kore_split_string(hbuf, "\r\n", headers, HTTP_REQ_HEADER_MAX);
-	if (h < 2) {
-		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-		return (KORE_RESULT_OK);
-	}
+		if (w->rope.length > 0)
+			http_json_flush(w);
 
-	v = kore_split_string(headers[0], " ", request, 4);
-	if (v != 3) {
-		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-		return (KORE_RESULT_OK);
-	}
+		if (!(sink->flags & HTTP_JSON_SINK_ERROR)) {
+			net_send_queue(c, "0\r\n\r\n", 5);
 
-	skip = 0;
-	host = NULL;
-	for (i = 0; i < h; i++) {
-		if (strncasecmp(headers[i], "host", 4))
-			continue;
+			if (sink->flags & HTTP_JSON_SINK_CLOSE)
+				c->flags |= CONN_CLOSE_EMPTY;
 
-		if ((host = http_validate_header(headers[i])) == NULL) {
-			http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-			return (KORE_RESULT_OK);
-		}
+			c->flags &= ~CONN_IS_BUSY;
 
-		if (*host == '\0') {
-			http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-			return (KORE_RESULT_OK);
+			if (net_send_flush(c)) {
+				http_start_recv(c);
+				ret = KORE_RESULT_OK;
+			}
 		}
-
-		skip = i;
-		break;
 	}
 
-	if (host == NULL) {
-		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-		return (KORE_RESULT_OK);
-	}
+	sink->flags |= HTTP_JSON_SINK_DONE;
+	http_json_detach(w);
 
-	req = http_request_new(c, host, request[0], request[1], request[2]);
-	if (req == NULL)
-		return (KORE_RESULT_OK);
+	return (ret);
+}
 
-	/* take full ownership of the buffer. */
-	req->headers = nb->buf;
-	nb->buf = NULL;
-	nb->m_len = 0;
+void
+http_response_stream(struct http_request *req, int status, void *base,
+    size_t len, int (*cb)(struct netbuf *), void *arg)
+{
+	struct netbuf		*nb;
 
-	for (i = 1; i < h; i++) {
-		if (i == skip)
-			continue;
+#if defined(KORE_USE_TASKS)
+	if (req->flags & HTTP_REQUEST_OFFLOADED)
+		fatal("%s: not available to offloaded handlers", __func__);
+#endif
 
-		if ((value = http_validate_header(headers[i])) == NULL) {
-			req->flags |= HTTP_REQUEST_DELETE;
-			http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-			return (KORE_RESULT_OK);
-		}
+	if (req->owner == NULL)
+		return;
 
-		if (*value == '\0') {
-			req->flags |= HTTP_REQUEST_DELETE;
-			http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-			return (KORE_RESULT_OK);
-		}
+	req->status = status;
 
-		hdr = kore_pool_get(&http_header_pool);
-		hdr->header = headers[i];
-		hdr->value = value;
-		TAILQ_INSERT_TAIL(&(req->req_headers), hdr, list);
+	if (req->cache != NULL)
+		http_cache_store(req, status, base, len);
 
-		if (req->agent == NULL &&
-		    !strcasecmp(hdr->header, "user-agent"))
-			req->agent = hdr->value;
+#if defined(KORE_USE_COMPRESS)
+	if (http_compress_stream(req, status, base, len, cb, arg))
+		return;
+#endif
 
-		if (req->referer == NULL &&
-		    !strcasecmp(hdr->header, "referer"))
-			req->referer = hdr->value;
+	switch (req->owner->proto) {
+	case CONN_PROTO_HTTP:
+		http_response_normal(req, req->owner, status, NULL, len);
+		break;
+	case CONN_PROTO_HTTP2:
+		http_response_normal(req, req->owner, status, NULL, len);
+		http2_response_stream(req, base, len, cb, arg);
+		return;
+	default:
+		fatal("%s: bad proto %d", __func__, req->owner->proto);
+		/* NOTREACHED. */
 	}
 
-	if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
-		if (http_body_max == 0) {
-			req->flags |= HTTP_REQUEST_DELETE;
-			http_error_response(req->owner,
-			    HTTP_STATUS_METHOD_NOT_ALLOWED);
-			return (KORE_RESULT_OK);
-		}
-
-		if (!http_request_header_uint64(req, "content-length",
-		    &req->content_length)) {
-			if (req->method == HTTP_METHOD_DELETE) {
-				req->flags |= HTTP_REQUEST_COMPLETE;
-				return (KORE_RESULT_OK);
-			}
+	net_send_stream(req->owner, base, len, cb, &nb);
+	nb->extra = arg;
 
-			req->flags |= HTTP_REQUEST_DELETE;
-			http_error_response(req->owner,
-			    HTTP_STATUS_LENGTH_REQUIRED);
-			return (KORE_RESULT_OK);
-		}
+	if (req->method == HTTP_METHOD_HEAD) {
+		nb->s_off = nb->b_len;
+		net_remove_netbuf(req->owner, nb);
+	}
+}
 
-		if (req->content_length == 0) {
-			req->flags |= HTTP_REQUEST_COMPLETE;
-			req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
-			return (KORE_RESULT_OK);
-		}
+void
+http_response_fileref(struct http_request *req, int status,
+    struct kore_fileref *ref)
+{
+	http_response_fileref_type(req, status, ref,
+	    http_media_type(ref->path));
+}
 
-		if (req->content_length > http_body_max) {
-			req->flags |= HTTP_REQUEST_DELETE;
-			http_error_response(req->owner,
-			    HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE);
-			return (KORE_RESULT_OK);
-		}
+/*
+ * Like http_response_fileref() but with the media type given by the
+ * caller, for files whose name does not tell what they contain.
+ */
+void
+http_response_fileref_type(struct http_request *req, int status,
+    struct kore_fileref *ref, const char *media_type)
+{
+	struct tm		*tm;
+	int			ranges;
+	struct http_range	range[HTTP_RANGES_MAX];
+	char			tbuf[128], etag[HTTP_FILEREF_ETAG_LEN];
 
-		req->http_body_length = req->content_length;
+#if defined(KORE_USE_TASKS)
+	if (req->flags & HTTP_REQUEST_OFFLOADED)
+		fatal("%s: not available to offloaded handlers", __func__);
+#endif
 
-		if (http_body_disk_offload > 0 &&
-		    req->content_length > http_body_disk_offload) {
-			req->http_body_path = kore_pool_get(&http_body_path);
-			l = snprintf(req->http_body_path, HTTP_BODY_PATH_MAX,
-			    "%s/http_body.XXXXXX", http_body_disk_path);
-			if (l == -1 || (size_t)l >= HTTP_BODY_PATH_MAX) {
-				req->flags |= HTTP_REQUEST_DELETE;
-				http_error_response(req->owner,
-				    HTTP_STATUS_INTERNAL_ERROR);
-				return (KORE_RESULT_ERROR);
-			}
+	if (req->owner == NULL)
+		return;
 
-			req->http_body = NULL;
-			req->http_body_fd = mkstemp(req->http_body_path);
-			if (req->http_body_fd == -1) {
-				req->flags |= HTTP_REQUEST_DELETE;
-				http_error_response(req->owner,
-				    HTTP_STATUS_INTERNAL_ERROR);
-				return (KORE_RESULT_OK);
-			}
-		} else {
-			req->http_body_fd = -1;
-			req->http_body = kore_buf_alloc(req->content_length);
-		}
+	http_fileref_etag(ref, etag, sizeof(etag));
 
-		SHA256Init(&req->hashctx);
-		c->http_timeout = http_body_timeout * 1000;
+	if (status == HTTP_STATUS_OK &&
+	    http_fileref_unmodified(req, ref, etag)) {
+		kore_fileref_release(ref);
+		http_response_header(req, "etag", etag);
+		http_response(req, HTTP_STATUS_NOT_MODIFIED, NULL, 0);
+		return;
+	}
 
-		if (!http_body_update(req, end_headers, nb->s_off - len)) {
-			req->flags |= HTTP_REQUEST_DELETE;
-			http_error_response(req->owner,
-			    HTTP_STATUS_INTERNAL_ERROR);
-			return (KORE_RESULT_OK);
-		}
-	} else {
-		c->http_timeout = 0;
+	ranges = 0;
+	if (status == HTTP_STATUS_OK) {
+		ranges = http_fileref_ranges(req, ref, etag, range,
+		    req->owner->proto == CONN_PROTO_HTTP ?
+		    HTTP_RANGES_MAX : 1);
 	}
 
-	if (req->rt->on_headers != NULL) {
-		if (!kore_runtime_http_request(req->rt->on_headers, req)) {
-			req->flags |= HTTP_REQUEST_DELETE;
-			return (KORE_RESULT_OK);
-		}
+	if (ranges == -1) {
+		kore_fileref_release(ref);
+		(void)snprintf(tbuf, sizeof(tbuf),
+		    "bytes */%" PRId64, (int64_t)ref->size);
+		http_response_header(req, "content-range", tbuf);
+		http_response(req, HTTP_STATUS_REQUEST_RANGE_INVALID, NULL, 0);
+		return;
 	}
 
-	return (KORE_RESULT_OK);
-}
+	if (media_type != NULL && ranges <= 1)
+		http_response_header(req, "content-type", media_type);
 
-int
-http_argument_get(struct http_request *req, const char *name,
-    void **out, void *nout, int type)
-{
-	struct http_arg		*q;
+	if ((tm = gmtime(&ref->mtime_sec)) != NULL) {
+		if (strftime(tbuf, sizeof(tbuf),
+		    "%a, %d %b %Y %H:%M:%S GMT", tm) > 0) {
+			http_response_header(req, "last-modified", tbuf);
+		}
+	}
 
-	TAILQ_FOREACH(q, &(req->arguments), list) {
-		if (strcmp(q->name, name))
-			continue;
+	http_response_header(req, "etag", etag);
 
-		if (http_data_convert(q->s_value, out, nout, type))
-			return (KORE_RESULT_OK);
+	if (status == HTTP_STATUS_OK)
+		http_response_header(req, "accept-ranges", "bytes");
 
-		break;
+	if (ranges > 1) {
+		http_response_fileref_multi(req, ref,
+		    media_type, range, ranges);
+		return;
 	}
 
-	return (KORE_RESULT_ERROR);
-}
-
-int
-http_argument_urldecode(char *arg)
-{
-	u_int8_t	v;
-	int		err;
-	size_t		len;
-	char		*p, *in, h[5];
-
-	p = arg;
-	in = arg;
-	len = strlen(arg);
-
-	while (*p != '\0' && p < (arg + len)) {
-		if (*p == '+')
-			*p = ' ';
-		if (*p != '%') {
-			*in++ = *p++;
-			continue;
-		}
-
-		if ((p + 2) >= (arg + len)) {
-			kore_debug("overflow in '%s'", arg);
-			return (KORE_RESULT_ERROR);
-		}
-
-		if (!isxdigit((unsigned char)*(p + 1)) ||
-		    !isxdigit((unsigned char)*(p + 2))) {
-			*in++ = *p++;
-			continue;
-		}
-
-		h[0] = '0';
-		h[1] = 'x';
-		h[2] = *(p + 1);
-		h[3] = *(p + 2);
-		h[4] = '\0';
+	if (ranges == 1) {
+		status = HTTP_STATUS_PARTIAL_CONTENT;
+		(void)snprintf(tbuf, sizeof(tbuf),
+		    "bytes %" PRId64 "-%" PRId64 "/%" PRId64,
+		    (int64_t)range[0].off,
+		    (int64_t)(range[0].off + range[0].len - 1),
+		    (int64_t)ref->size);
+		http_response_header(req, "content-range", tbuf);
+	} else {
+		range[0].off = 0;
+		range[0].len = ref->size;
+	}
 
-		v = kore_strtonum(h, 16, 0x0, 0xff, &err);
-		if (err != KORE_RESULT_OK)
-			return (err);
+	req->status = status;
 
-		if (v <= 0x1f || v == 0x7f)
-			return (KORE_RESULT_ERROR);
+#if defined(KORE_USE_COMPRESS)
+	if (ranges == 0 &&
+	    http_compress_fileref(req, status, ref, media_type))
+		return;
+#endif
 
-		*in++ = (char)v;
-		p += 3;
+	switch (req->owner->proto) {
+	case CONN_PROTO_HTTP:
+		http_response_normal(req, req->owner, status,
+		    NULL, range[0].len);
+		break;
+	case CONN_PROTO_HTTP2:
+		http_response_normal(req, req->owner, status,
+		    NULL, range[0].len);
+		http2_response_fileref_range(req, ref,
+		    range[0].off, range[0].len);
+		return;
+	default:
+		fatal("http_response_fd() bad proto %d", req->owner->proto);
+		/* NOTREACHED. */
 	}
 
-	*in = '\0';
-	return (KORE_RESULT_OK);
+	if (req->method != HTTP_METHOD_HEAD) {
+		net_send_fileref_range(req->owner, ref,
+		    range[0].off, range[0].len);
+	} else {
+		kore_fileref_release(ref);
+	}
 }
 
-struct http_file *
-http_file_lookup(struct http_request *req, const char *name)
+/*
+ * Check the conditional headers of a request for a fileref, returns 1
+ * if the client its copy is still fresh and should get a 304.
+ */
+int
+http_fileref_unmodified(struct http_request *req, struct kore_fileref *ref,
+    const char *etag)
 {
-	struct http_file	*f;
+	time_t		mtime;
+	const char	*hdr;
 
-	TAILQ_FOREACH(f, &(req->files), list) {
-		if (!strcmp(f->name, name))
-			return (f);
+	if (req->method != HTTP_METHOD_GET && req->method != HTTP_METHOD_HEAD)
+		return (0);
+
+	/* If-None-Match takes precedence over If-Modified-Since. */
+	if (http_request_header(req, "if-none-match", &hdr))
+		return (http_etag_match(hdr, etag));
+
+	if (http_request_header(req, "if-modified-since", &hdr)) {
+		mtime = kore_date_to_time(hdr);
+		if (mtime > 0 && ref->mtime_sec <= mtime)
+			return (1);
 	}
 
-	return (NULL);
+	return (0);
 }
 
-ssize_t
-http_file_read(struct http_file *file, void *buf, size_t len)
+/*
+ * Parse the Range header of a GET request for a fileref. Returns the
+ * number of ranges placed in out, 0 if the whole file is to be sent or
+ * -1 if none of the ranges can be satisfied.
+ */
+static int
+http_fileref_ranges(struct http_request *req, struct kore_fileref *ref,
+    const char *etag, struct http_range *out, int max)
 {
-	ssize_t		ret;
-	size_t		toread, off;
+	time_t		mtime;
+	const char	*hdr, *p;
+	int		cnt, specs;
+	u_int64_t	start, end, size;
 
-	if (file->length < file->offset)
-		return (-1);
-	if ((file->offset + len) < file->offset)
-		return (-1);
-	if ((file->position + file->offset) < file->position)
-		return (-1);
+	if (req->method != HTTP_METHOD_GET || ref->size <= 0)
+		return (0);
 
-	off = file->position + file->offset;
-	toread = MIN(len, (file->length - file->offset));
-	if (toread == 0)
+	if (!http_request_header(req, "range", &hdr))
 		return (0);
 
-	if (file->req->http_body_fd != -1) {
-		if (lseek(file->req->http_body_fd, off, SEEK_SET) == -1) {
-			kore_log(LOG_ERR, "http_file_read: lseek(%s): %s",
-			    file->req->http_body_path, errno_s);
-			return (-1);
+	/* A stale If-Range means the client wants the full file. */
+	if (http_request_header(req, "if-range", &p)) {
+		if (*p == '"') {
+			if (strcmp(p, etag))
+				return (0);
+		} else {
+			mtime = kore_date_to_time(p);
+			if (mtime <= 0 || mtime != ref->mtime_sec)
+				return (0);
 		}
+	}
 
-		for (;;) {
-			ret = read(file->req->http_body_fd, buf, toread);
-			if (ret == -1) {
-				if (errno == EINTR)
-					continue;
-				kore_log(LOG_ERR, "failed to read %s: %s",
-				    file->req->http_body_path, errno_s);
-				return (-1);
+	if (strncasecmp(hdr, "bytes=", 6))
+		return (0);
+
+	cnt = 0;
+	specs = 0;
+	p = hdr + 6;
+	size = (u_int64_t)ref->size;
+
+	for (;;) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		if (*p == '-') {
+			p++;
+			if (!http_range_number(&p, &end))
+				return (0);
+			/* A suffix of zero bytes can never be satisfied. */
+			if (end == 0)
+				start = size;
+			else
+				start = end < size ? size - end : 0;
+			end = size - 1;
+		} else {
+			if (!http_range_number(&p, &start) || *p != '-')
+				return (0);
+			p++;
+			if (*p >= '0' && *p <= '9') {
+				if (!http_range_number(&p, &end) || end < start)
+					return (0);
+				end = MIN(end, size - 1);
+			} else {
+				end = size - 1;
 			}
-			if (ret == 0)
+		}
+
+		specs++;
+
+		if (start < size) {
+			if (cnt == max)
 				return (0);
-			break;
+			out[cnt].off = (off_t)start;
+			out[cnt].len = (size_t)(end - start + 1);
+			cnt++;
 		}
-	} else if (file->req->http_body != NULL) {
-		if (off > file->req->http_body->length)
+
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		if (*p == '\0')
+			break;
+
+		if (*p++ != ',')
 			return (0);
-		memcpy(buf, file->req->http_body->data + off, toread);
-		ret = toread;
-	} else {
-		kore_log(LOG_ERR, "http_file_read: called without body");
-		return (-1);
 	}
 
-	file->offset += (size_t)ret;
-	return (ret);
-}
+	if (cnt == 0)
+		return (specs > 0 ? -1 : 0);
 
-void
-http_file_rewind(struct http_file *file)
-{
-	file->offset = 0;
+	return (cnt);
 }
 
-void
-http_response_cookie(struct http_request *req, const char *name,
-    const char *val, const char *path, time_t expires, u_int32_t maxage,
-    struct http_cookie **out)
+static int
+http_range_number(const char **p, u_int64_t *out)
 {
-	char			*p;
-	struct http_cookie	*ck;
-
-	if (name == NULL || val == NULL)
-		fatal("http_response_cookie: invalid parameters");
-
-	ck = kore_pool_get(&http_cookie_pool);
+	u_int64_t	v;
+	const char	*s;
 
-	ck->maxage = maxage;
-	ck->expires = expires;
-	ck->name = kore_strdup(name);
-	ck->value = kore_strdup(val);
-	ck->domain = kore_strdup(req->host);
-	ck->flags = HTTP_COOKIE_HTTPONLY | HTTP_COOKIE_SECURE;
+	v = 0;
+	s = *p;
 
-	if ((p = strrchr(ck->domain, ':')) != NULL)
-		*p = '\0';
+	while (**p >= '0' && **p <= '9') {
+		if (v > (INT64_MAX - 9) / 10)
+			return (KORE_RESULT_ERROR);
+		v = (v * 10) + (**p - '0');
+		(*p)++;
+	}
 
-	if (path != NULL)
-		ck->path = kore_strdup(path);
-	else
-		ck->path = NULL;
+	if (*p == s)
+		return (KORE_RESULT_ERROR);
 
-	TAILQ_INSERT_TAIL(&(req->resp_cookies), ck, list);
+	*out = v;
 
-	if (out != NULL)
-		*out = ck;
+	return (KORE_RESULT_OK);
 }
 
-void
-http_populate_cookies(struct http_request *req)
+/* Weak comparison of our etag against an If-None-Match list. */
+static int
+http_etag_match(const char *list, const char *etag)
 {
-	struct http_cookie	*ck;
-	const char		*hdr;
-	int			 i, v, n;
-	char			*c, *header, *pair[3];
-	char			*cookies[HTTP_MAX_COOKIES];
+	size_t		len;
+	const char	*p;
 
-	if (!http_request_header(req, "cookie", &hdr))
-		return;
+	p = list;
+	len = strlen(etag);
 
-	header = kore_strdup(hdr);
-	v = kore_split_string(header, ";", cookies, HTTP_MAX_COOKIES);
-	for (i = 0; i < v; i++) {
-		for (c = cookies[i]; isspace(*(unsigned char *)c); c++)
-			;
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
 
-		n = kore_split_string(c, "=", pair, 3);
-		if (n != 2)
-			continue;
+		if (*p == '*')
+			return (1);
 
-		ck = kore_pool_get(&http_cookie_pool);
-		ck->name = kore_strdup(pair[0]);
-		ck->value = kore_strdup(pair[1]);
-		TAILQ_INSERT_TAIL(&(req->req_cookies), ck, list);
+		if (!strncmp(p, "W/", 2))
+			p += 2;
+
+		if (!strncmp(p, etag, len) && (p[len] == '\0' ||
+		    p[len] == ',' || p[len] == ' ' || p[len] == '\t'))
+			return (1);
+
+		if (*p == '"' && (p = strchr(p + 1, '"')) == NULL)
+			return (0);
+
+		while (*p != '\0' && *p != ',')
+			p++;
 	}
 
-	kore_free(header);
+	return (0);
 }
 
-void
-http_populate_post(struct http_request *req)
+/* Send several ranges of a fileref as a multipart/byteranges body. */
+static void
+http_response_fileref_multi(struct http_request *req,
+    struct kore_fileref *ref, const char *type, struct http_range *range,
+    int cnt)
 {
-	ssize_t			ret;
-	int			i, v;
-	struct kore_buf		*body;
-	char			data[BUFSIZ];
-	char			*args[HTTP_MAX_QUERY_ARGS], *val[3], *string;
+	struct kore_buf		buf;
+	int			i;
+	size_t			total, off[HTTP_RANGES_MAX + 1];
+	char			boundary[40], ctype[80];
 
-	if (req->method != HTTP_METHOD_POST)
-		return;
+	(void)snprintf(boundary, sizeof(boundary), "%08x%016" PRIx64,
+	    http_header_hash(ref->path), kore_time_us());
+	(void)snprintf(ctype, sizeof(ctype),
+	    "multipart/byteranges; boundary=%s", boundary);
 
-	if (req->http_body != NULL) {
-		body = NULL;
-		req->http_body->offset = req->content_length;
-		string = kore_buf_stringify(req->http_body, NULL);
-		req->http_body_length = 0;
-		req->http_body_offset = 0;
-	} else {
-		body = kore_buf_alloc(128);
-		for (;;) {
-			ret = http_body_read(req, data, sizeof(data));
-			if (ret == -1)
-				goto out;
-			if (ret == 0)
-				break;
-			kore_buf_append(body, data, ret);
-		}
-		string = kore_buf_stringify(body, NULL);
+	kore_buf_init(&buf, 128 * (cnt + 1));
+
+	total = 0;
+	for (i = 0; i < cnt; i++) {
+		off[i] = buf.offset;
+		kore_buf_appendf(&buf, "\r\n--%s\r\n", boundary);
+		if (type != NULL)
+			kore_buf_appendf(&buf, "content-type: %s\r\n", type);
+		kore_buf_appendf(&buf,
+		    "content-range: bytes %" PRId64 "-%" PRId64 "/%" PRId64
+		    "\r\n\r\n", (int64_t)range[i].off,
+		    (int64_t)(range[i].off + range[i].len - 1),
+		    (int64_t)ref->size);
+		total += range[i].len;
 	}
 
-	v = kore_split_string(string, "&", args, HTTP_MAX_QUERY_ARGS);
-	for (i = 0; i < v; i++) {
-		kore_split_string(args[i], "=", val, 3);
-		if (val[0] != NULL && val[1] != NULL)
-			http_argument_add(req, val[0], val[1], 0, 1);
+	off[cnt] = buf.offset;
+	kore_buf_appendf(&buf, "\r\n--%s--\r\n", boundary);
+	total += buf.offset;
+
+	http_response_header(req, "content-type", ctype);
+
+	req->status = HTTP_STATUS_PARTIAL_CONTENT;
+	http_response_normal(req, req->owner, req->status, NULL, total);
+
+	for (i = 0; i < cnt; i++) {
+		net_send_queue(req->owner, buf.data + off[i],
+		    off[i + 1] - off[i]);
+		kore_fileref_retain(ref);
+		net_send_fileref_range(req->owner, ref,
+		    range[i].off, range[i].len);
 	}
 
-out:
-	if (body != NULL)
-		kore_buf_free(body);
+	net_send_queue(req->owner, buf.data + off[cnt], buf.offset - off[cnt]);
+
+	kore_fileref_release(ref);
+	kore_buf_cleanup(&buf);
 }
 
+/* A strong validator derived from the inode, size and mtime. */
 void
-http_populate_qs(struct http_request *req)
+http_fileref_etag(struct kore_fileref *ref, char *buf, size_t len)
 {
-	int		i, v;
-	char		*query, *args[HTTP_MAX_QUERY_ARGS], *val[3];
+	int		r;
+
+	r = snprintf(buf, len, "\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "\"",
+	    (u_int64_t)ref->ino, (u_int64_t)ref->size, ref->mtime);
+	if (r == -1 || (size_t)r >= len)
+		fatal("%s: buffer too small", __func__);
+}
 
-	if (req->query_string == NULL)
+/*
+ * Respond with a block of preformatted header lines, each terminated
+ * by a CRLF, followed by the body in a single send buffer.
+ * Only usable for HTTP/1.x connections.
+ */
+void
+http_response_block(struct http_request *req, int status,
+    const void *hdrs, size_t hlen, const void *d, size_t len)
+{
+	if (req->owner == NULL)
 		return;
 
-	query = kore_strdup(req->query_string);
-	v = kore_split_string(query, "&", args, HTTP_MAX_QUERY_ARGS);
-	for (i = 0; i < v; i++) {
-		kore_split_string(args[i], "=", val, 3);
-		if (val[0] != NULL && val[1] != NULL)
-			http_argument_add(req, val[0], val[1], 1, 1);
-	}
+	if (req->owner->proto != CONN_PROTO_HTTP)
+		fatal("%s: bad proto %d", __func__, req->owner->proto);
 
-	kore_free(query);
+	req->status = status;
+	http_response_write(req, req->owner, status, hdrs, hlen, d, len);
 }
 
-void
-http_populate_multipart_form(struct http_request *req)
+/*
+ * Returns the weight the client gave to the given content coding in
+ * its accept-encoding header, 0 meaning not acceptable.
+ */
+int
+http_accept_encoding(struct http_request *req, const char *name)
 {
-	const char		*hdr;
-	int			h, blen;
-	struct kore_buf		in, out;
-	char			*type, *val, *args[3];
-	char			boundary[HTTP_BOUNDARY_MAX];
+	const char	*accept, *p, *end;
+	size_t		len, nlen;
+	int		wildcard;
 
-	if (req->method != HTTP_METHOD_POST)
-		return;
+	if (!http_request_header(req, "accept-encoding", &accept))
+		return (0);
 
-	if (!http_request_header(req, "content-type", &hdr))
-		return;
+	wildcard = 0;
+	nlen = strlen(name);
 
-	kore_buf_init(&in, 128);
-	kore_buf_init(&out, 128);
+	for (p = accept; *p != '\0'; p = end) {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
 
-	type = kore_strdup(hdr);
-	h = kore_split_string(type, ";", args, 3);
-	if (h != 2)
-		goto cleanup;
+		if ((end = strchr(p, ',')) == NULL)
+			end = p + strlen(p);
 
-	if (strcasecmp(args[0], "multipart/form-data"))
-		goto cleanup;
+		len = strcspn(p, ",; \t");
+		if (len == 0)
+			continue;
 
-	if ((val = strchr(args[1], '=')) == NULL)
-		goto cleanup;
+		if (len == nlen && !strncasecmp(p, name, nlen))
+			return (http_qvalue(p + len, end));
 
-	val++;
-	blen = snprintf(boundary, sizeof(boundary), "--%s", val);
-	if (blen == -1 || (size_t)blen >= sizeof(boundary))
-		goto cleanup;
+		if (len == 1 && *p == '*')
+			wildcard = http_qvalue(p + len, end);
+	}
 
-	if (!multipart_find_data(&in, NULL, NULL, req, boundary, blen))
-		goto cleanup;
+	return (wildcard);
+}
 
-	for (;;) {
-		if (!multipart_find_data(&in, NULL, NULL, req, "\r\n", 2))
-			break;
-		if (in.offset < 4 && req->http_body_length == 0)
-			break;
-		if (!multipart_find_data(&in, &out, NULL, req, "\r\n\r\n", 4))
-			break;
-		if (!multipart_parse_headers(req, &in, &out, boundary, blen))
+/* Add the given request header to the vary header of the response. */
+void
+http_response_vary(struct http_request *req, const char *name)
+{
+	struct http_header	*hdr;
+	char			value[HTTP_HEADER_BUFSIZE];
+	int			len;
+
+	TAILQ_FOREACH(hdr, &req->resp_headers, list) {
+		if (!strcasecmp(hdr->header, "vary"))
 			break;
+	}
 
-		kore_buf_reset(&out);
+	if (hdr == NULL) {
+		http_response_header(req, "vary", name);
+		return;
 	}
 
-cleanup:
-	kore_free(type);
-	kore_buf_cleanup(&in);
-	kore_buf_cleanup(&out);
+	if (strcasestr(hdr->value, name) != NULL || !strcmp(hdr->value, "*"))
+		return;
+
+	len = snprintf(value, sizeof(value), "%s, %s", hdr->value, name);
+	if (len == -1 || (size_t)len >= sizeof(value))
+		return;
+
+	http_response_header(req, "vary", value);
 }
 
 int
-http_body_rewind(struct http_request *req)
+http_request_header(struct http_request *req, const char *header,
+    const char **out)
 {
-	if (req->http_body_fd != -1) {
-		if (lseek(req->http_body_fd, 0, SEEK_SET) == -1) {
-			kore_log(LOG_ERR, "lseek(%s) failed: %s",
-			    req->http_body_path, errno_s);
-			return (KORE_RESULT_ERROR);
-		}
-	} else if (req->http_body != NULL) {
-		kore_buf_reset(req->http_body);
+	struct http_header	*hdr;
+
+	if ((hdr = http_header_lookup(req, header)) != NULL) {
+		*out = hdr->value;
+		return (KORE_RESULT_OK);
 	}
 
-	req->http_body_offset = 0;
-	req->http_body_length = req->content_length;
+	if (!strcasecmp(header, "host")) {
+		*out = req->host;
+		return (KORE_RESULT_OK);
+	}
 
-	return (KORE_RESULT_OK);
+	return (KORE_RESULT_ERROR);
 }
 
 int
-http_body_digest(struct http_request *req, char *out, size_t len)
+http_request_header_get(struct http_request *req, const char *header,
+    void **out, void *nout, int type)
 {
-	size_t		idx;
-	int		slen;
+	struct http_header	*hdr;
 
-	if (len != HTTP_BODY_DIGEST_STRLEN) {
-		fatal("http_body_digest: bad len:%zu wanted:%zu",
-		    len, HTTP_BODY_DIGEST_STRLEN);
-	}
+	if (type == HTTP_ARG_TYPE_STRING)
+		fatal("%s: cannot be called with type string", __func__);
 
-	if (!(req->flags & HTTP_REQUEST_COMPLETE))
+	if ((hdr = http_header_lookup(req, header)) == NULL)
 		return (KORE_RESULT_ERROR);
 
-	for (idx = 0; idx < sizeof(req->http_body_digest); idx++) {
-		slen = snprintf(out + (idx * 2), len - (idx * 2), "%02x",
-		    req->http_body_digest[idx]);
-		if (slen == -1 || (size_t)slen >= len)
-			fatal("failed to create hex string");
-	}
+	if (http_data_convert(hdr->value, out, nout, type))
+		return (KORE_RESULT_OK);
 
-	return (KORE_RESULT_OK);
+	return (KORE_RESULT_ERROR);
 }
 
-ssize_t
-http_body_read(struct http_request *req, void *out, size_t len)
+int
+http_request_cookie(struct http_request *req, const char *cookie, char **out)
 {
-	ssize_t		ret;
-	size_t		toread;
-
-	toread = MIN(req->http_body_length, len);
-	if (toread == 0)
-		return (0);
+	struct http_cookie	*ck;
 
-	if (req->http_body_fd != -1) {
-		for (;;) {
-			ret = read(req->http_body_fd, out, toread);
-			if (ret == -1) {
-				if (errno == EINTR)
-					continue;
-				kore_log(LOG_ERR, "failed to read %s: %s",
-				    req->http_body_path, errno_s);
-				return (-1);
-			}
-			if (ret == 0)
-				return (0);
-			break;
+	TAILQ_FOREACH(ck, &(req->req_cookies), list) {
+		if (!strcasecmp(ck->name, cookie)) {
+			*out = ck->value;
+			return (KORE_RESULT_OK);
 		}
-	} else if (req->http_body != NULL) {
-		memcpy(out,
-		    (req->http_body->data + req->http_body->offset), toread);
-		req->http_body->offset += toread;
-		ret = toread;
-	} else {
-		kore_log(LOG_ERR, "http_body_read: called without body");
-		return (-1);
 	}
 
-	req->http_body_length -= (size_t)ret;
-	req->http_body_offset += (size_t)ret;
-
-	return (ret);
+	return (KORE_RESULT_ERROR);
 }
 
 int
-http_state_run(struct http_state *states, u_int8_t elm,
-    struct http_request *req)
+http_header_recv(struct netbuf *nb)
 {
-	int		r, done;
+	struct connection	*c;
+	struct http_header	*hdr, *te;
+	size_t			len, pos, start, avail, body;
+	struct http_request	*req;
+	u_int8_t		*end_headers;
+	int			h, i, v, skip;
+	char			*headers[HTTP_REQ_HEADER_MAX];
+	char			*value, *host, *request[4], *hbuf;
 
-	done = 0;
+	c = nb->owner;
+	kore_debug("http_header_recv(%p)", nb);
 
-	while (!done) {
-		if (req->fsm_state >= elm) {
-			fatal("http_state_run: fsm_state > elm (%d/%d)",
-			    req->fsm_state, elm);
+	/* Empty lines before the request-line are ignored (RFC 7230 3.5). */
+	if (nb->scan_off == 0) {
+		for (len = 0; len < nb->s_off; len++) {
+			if (nb->buf[len] != '\r' && nb->buf[len] != '\n')
+				break;
 		}
 
-		kore_debug("http_state_run: running %s",
-		    states[req->fsm_state].name);
+		if (len > 0) {
+			nb->s_off -= len;
+			memmove(nb->buf, nb->buf + len, nb->s_off);
+			if (nb->s_off == 0)
+				return (KORE_RESULT_OK);
+		}
+	}
 
-		r = states[req->fsm_state].cb(req);
-		switch (r) {
-		case HTTP_STATE_ERROR:
+	if (nb->b_len < 4)
+		return (KORE_RESULT_OK);
+
+	/* HTTP/2 with prior knowledge starts with the connection preface. */
+	if (http2_enable && nb->scan_off == 0 &&
+	    TAILQ_EMPTY(&c->http_requests)) {
+		len = MIN(nb->s_off, HTTP2_PREFACE_LEN);
+		if (!memcmp(nb->buf, HTTP2_PREFACE, len)) {
+			if (len == HTTP2_PREFACE_LEN) {
+				net_recv_pushback(c, nb->buf, nb->s_off);
+				http2_session_start(c);
+			}
 			return (KORE_RESULT_OK);
-		case HTTP_STATE_RETRY:
-			return (KORE_RESULT_RETRY);
-		case HTTP_STATE_CONTINUE:
-			break;
-		case HTTP_STATE_COMPLETE:
-			done = 1;
-			break;
-		default:
-			fatal("http_state_run: unknown return value %d", r);
 		}
 	}
 
-	req->fsm_state = 0;
-	kore_debug("http_state_run(%p): done", req);
-
-	return (KORE_RESULT_OK);
-}
+	if (!isalpha(nb->buf[0])) {
+		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+		return (KORE_RESULT_ERROR);
+	}
 
-int
-http_state_exists(struct http_request *req)
-{
-	return (req->hdlr_extra != NULL);
-}
+	if (nb->scan_off == 0) {
+		c->http_hdr_cnt = 0;
+		c->http_hdr_start = 0;
+		c->http_hdr_first = HTTP_TIMING_ENABLED() ? kore_time_us() : 0;
+	}
 
-void *
-http_state_create(struct http_request *req, size_t len)
-{
-	if (req->hdlr_extra != NULL)
-		fatal("http_state_create: state already exists");
+	/*
+	 * Resume scanning where the previous read left off, terminating
+	 * and recording each header line as we go. An empty line marks
+	 * the end of the headers.
+	 */
+	end_headers = NULL;
+	while (nb->scan_off < nb->s_off) {
+		pos = kore_mem_scan(nb->buf, nb->scan_off, nb->s_off, '\n');
+		nb->scan_off = pos;
+		if (pos == nb->s_off)
+			break;
 
-	req->state_len = len;
-	req->hdlr_extra = kore_calloc(1, len);
+		nb->scan_off++;
+		start = c->http_hdr_start;
+		c->http_hdr_start = nb->scan_off;
 
-	return (req->hdlr_extra);
-}
+		if (pos > start && nb->buf[pos - 1] == '\r')
+			pos--;
 
-void *
-http_state_get(struct http_request *req)
-{
-	return (req->hdlr_extra);
-}
+		nb->buf[pos] = '\0';
 
-void
-http_state_cleanup(struct http_request *req)
-{
-	kore_free(req->hdlr_extra);
-	req->hdlr_extra = NULL;
-}
+		if (pos == start) {
+			end_headers = nb->buf + nb->scan_off;
+			break;
+		}
 
-void
-http_start_recv(struct connection *c)
-{
-	c->http_start = kore_time_ms();
-	c->http_timeout = http_header_timeout * 1000;
-	net_recv_reset(c, http_header_max, http_header_recv);
-}
+		if (c->http_hdr_cnt < HTTP_REQ_HEADER_MAX - 1)
+			c->http_hdr_line[c->http_hdr_cnt++] = start;
+	}
 
-void
-http_runlock_init(struct http_runlock *lock)
-{
-	lock->owner = NULL;
-	LIST_INIT(&lock->queue);
-}
+	if (end_headers == NULL)
+		return (KORE_RESULT_OK);
 
-int
-http_runlock_acquire(struct http_runlock *lock, struct http_request *req)
-{
-	if (lock->owner != NULL) {
-		if (req->runlock != NULL)
-			fatal("%s: request already waiting on lock", __func__);
+	len = end_headers - nb->buf;
+	hbuf = (char *)nb->buf;
 
-		req->runlock = kore_pool_get(&http_rlq_pool);
-		req->runlock->req = req;
-		LIST_INSERT_HEAD(&lock->queue, req->runlock, list);
+	h = c->http_hdr_cnt;
+	for (i = 0; i < h; i++)
+		headers[i] = hbuf + c->http_hdr_line[i];
 
-		http_request_sleep(req);
-		return (KORE_RESULT_ERROR);
+	if (h < 2) {
+		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+		return (KORE_RESULT_OK);
 	}
 
-	lock->owner = req;
+	v = kore_split_string(headers[0], " ", request, 4);
+	if (v != 3) {
+		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+		return (KORE_RESULT_OK);
+	}
 
-	return (KORE_RESULT_OK);
-}
+	skip = 0;
+	host = NULL;
+	for (i = 0; i < h; i++) {
+		if (strncasecmp(headers[i], "host", 4))
+			continue;
 
-void
-http_runlock_release(struct http_runlock *lock, struct http_request *req)
-{
-	struct http_runlock_queue	*next;
-	struct http_request		*nextreq;
+		if ((host = http_validate_header(headers[i])) == NULL) {
+			http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+			return (KORE_RESULT_OK);
+		}
 
-	if (lock->owner != req)
-		fatal("%s: calling request != owner of runlock", __func__);
+		if (*host == '\0') {
+			http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+			return (KORE_RESULT_OK);
+		}
 
-	lock->owner = NULL;
+		skip = i;
+		break;
+	}
 
-	if ((next = LIST_FIRST(&lock->queue)) != NULL) {
-		LIST_REMOVE(next, list);
+	if (host == NULL) {
+		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+		return (KORE_RESULT_OK);
+	}
 
-		nextreq = next->req;
-		nextreq->runlock = NULL;
+	req = http_request_new(c, host, request[0], request[1], request[2]);
+	if (req == NULL)
+		return (KORE_RESULT_OK);
 
-		http_request_wakeup(nextreq);
-		kore_pool_put(&http_rlq_pool, next);
+	/* take full ownership of the buffer. */
+	req->headers = nb->buf;
+	nb->buf = NULL;
+	nb->m_len = 0;
+
+	if (nb->flags & NETBUF_RECV_POOLED)
+		req->flags |= HTTP_REQUEST_POOLED_HEADERS;
+
+	/*
+	 * Anything past the headers (and the body, see below) belongs to
+	 * the next pipelined request. It is handed back to the connection
+	 * and parsed once this request has been answered.
+	 */
+	avail = nb->s_off - len;
+
+	for (i = 1; i < h; i++) {
+		if (i == skip)
+			continue;
+
+		if ((value = http_validate_header(headers[i])) == NULL) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+			return (KORE_RESULT_OK);
+		}
+
+		if (*value == '\0') {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+			return (KORE_RESULT_OK);
+		}
+
+		http_request_header_add(req, headers[i], value);
+	}
+
+	if ((hdr = http_header_lookup(req, "user-agent")) != NULL)
+		req->agent = hdr->value;
+
+	if ((hdr = http_header_lookup(req, "referer")) != NULL)
+		req->referer = hdr->value;
+
+	if (!http_ratelimit_check(req))
+		return (KORE_RESULT_OK);
+
+	if (!http_overload_check(req))
+		return (KORE_RESULT_OK);
+
+	/* Both framings at once is how requests get smuggled. */
+	if ((te = http_header_lookup(req, "transfer-encoding")) != NULL) {
+		if (http_header_lookup(req, "content-length") != NULL) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+			return (KORE_RESULT_OK);
+		}
+
+		if (strcasecmp(te->value, "chunked")) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(c, HTTP_STATUS_NOT_IMPLEMENTED);
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
+		if (http_body_max == 0) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(req->owner,
+			    HTTP_STATUS_METHOD_NOT_ALLOWED);
+			return (KORE_RESULT_OK);
+		}
+
+		if (te != NULL) {
+			if (!http_body_chunked_setup(req, end_headers, avail))
+				return (KORE_RESULT_OK);
+		} else {
+			if (!http_request_header_uint64(req, "content-length",
+			    &req->content_length)) {
+				if (req->method == HTTP_METHOD_DELETE) {
+					req->flags |= HTTP_REQUEST_COMPLETE;
+					net_recv_pushback(c, end_headers,
+					    avail);
+					return (KORE_RESULT_OK);
+				}
+
+				req->flags |= HTTP_REQUEST_DELETE;
+				http_error_response(req->owner,
+				    HTTP_STATUS_LENGTH_REQUIRED);
+				return (KORE_RESULT_OK);
+			}
+
+			if (!http_body_setup(req))
+				return (KORE_RESULT_OK);
+
+			if (req->content_length == 0) {
+				net_recv_pushback(c, end_headers, avail);
+				return (KORE_RESULT_OK);
+			}
+
+			c->http_timeout = http_body_timeout * 1000;
+			kore_connection_timeout_update(c);
+
+			body = MIN(avail, req->content_length);
+			net_recv_pushback(c, end_headers + body, avail - body);
+
+			if (!http_body_update(req, end_headers, body)) {
+				req->flags |= HTTP_REQUEST_DELETE;
+				http_error_response(req->owner,
+				    HTTP_STATUS_INTERNAL_ERROR);
+				return (KORE_RESULT_OK);
+			}
+		}
+	} else {
+		/*
+		 * A body is never read for these methods, refuse one instead
+		 * of parsing it as the next request.
+		 */
+		if (te != NULL || (http_header_lookup(req,
+		    "content-length") != NULL &&
+		    (!http_request_header_uint64(req, "content-length",
+		    &req->content_length) || req->content_length != 0))) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+			return (KORE_RESULT_OK);
+		}
+
+		c->http_timeout = 0;
+		net_recv_pushback(c, end_headers, avail);
+	}
+
+	if (req->rt->on_headers != NULL) {
+		if (!kore_runtime_http_request(req->rt->on_headers, req)) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			return (KORE_RESULT_OK);
+		}
 	}
+
+	return (KORE_RESULT_OK);
 }
 
+/*
+ * Arguments from the query string and a urlencoded body are only split
+ * into the request its argument list on the first lookup, the result of
+ * the last typed conversion of an argument is kept with it.
+ */
 int
-http_redirect_add(struct kore_domain *dom, const char *path, int status,
-    const char *target)
+http_argument_get(struct http_request *req, const char *name,
+    void **out, void *nout, int type)
 {
-	struct http_redirect	*rdr;
+	struct http_arg		*q;
+	size_t			len;
 
-	rdr = kore_calloc(1, sizeof(*rdr));
+	if (req->args_npending > 0)
+		http_arguments_parse(req);
 
-	if (regcomp(&(rdr->rctx), path, REG_EXTENDED)) {
-		kore_free(rdr);
-		return (KORE_RESULT_ERROR);
+	TAILQ_FOREACH(q, &(req->arguments), list) {
+		if (strcmp(q->name, name))
+			continue;
+
+		len = http_data_convert_size(type);
+		if (len == 0 || nout == NULL)
+			return (http_data_convert(q->s_value, out, nout, type));
+
+		if (q->conv_type != type) {
+			q->conv_type = type;
+			q->conv_result = http_data_convert(q->s_value,
+			    NULL, &q->conv, type);
+		}
+
+		if (q->conv_result == KORE_RESULT_OK)
+			memcpy(nout, &q->conv, len);
+
+		return (q->conv_result);
 	}
 
-	rdr->status = status;
+	return (KORE_RESULT_ERROR);
+}
 
-	if (target != NULL)
-		rdr->target = kore_strdup(target);
-	else
-		rdr->target = NULL;
+int
+http_argument_urldecode(char *arg)
+{
+	u_int8_t	v;
+	int		err;
+	size_t		len;
+	char		*p, *in, h[5];
 
-	TAILQ_INSERT_TAIL(&dom->redirects, rdr, list);
+	p = arg;
+	in = arg;
+	len = strlen(arg);
+
+	while (*p != '\0' && p < (arg + len)) {
+		if (*p == '+')
+			*p = ' ';
+		if (*p != '%') {
+			*in++ = *p++;
+			continue;
+		}
+
+		if ((p + 2) >= (arg + len)) {
+			kore_debug("overflow in '%s'", arg);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (!isxdigit((unsigned char)*(p + 1)) ||
+		    !isxdigit((unsigned char)*(p + 2))) {
+			*in++ = *p++;
+			continue;
+		}
+
+		h[0] = '0';
+		h[1] = 'x';
+		h[2] = *(p + 1);
+		h[3] = *(p + 2);
+		h[4] = '\0';
+
+		v = kore_strtonum(h, 16, 0x0, 0xff, &err);
+		if (err != KORE_RESULT_OK)
+			return (err);
+
+		if (v <= 0x1f || v == 0x7f)
+			return (KORE_RESULT_ERROR);
+
+		*in++ = (char)v;
+		p += 3;
+	}
 
+	*in = '\0';
 	return (KORE_RESULT_OK);
 }
 
-const char *
-http_status_text(int status)
+struct http_file *
+http_file_lookup(struct http_request *req, const char *name)
 {
-	const char	*r;
+	struct http_file	*f;
 
-	switch (status) {
-	case HTTP_STATUS_CONTINUE:
-		r = "Continue";
-		break;
-	case HTTP_STATUS_SWITCHING_PROTOCOLS:
-		r = "Switching Protocols";
-		break;
-	case HTTP_STATUS_OK:
-		r = "OK";
-		break;
-	case HTTP_STATUS_CREATED:
-		r = "Created";
-		break;
-	case HTTP_STATUS_ACCEPTED:
-		r = "Accepted";
-		break;
-	case HTTP_STATUS_NON_AUTHORITATIVE:
-		r = "Non-Authoritative Information";
-		break;
-	case HTTP_STATUS_NO_CONTENT:
-		r = "No Content";
-		break;
-	case HTTP_STATUS_RESET_CONTENT:
-		r = "Reset Content";
-		break;
-	case HTTP_STATUS_PARTIAL_CONTENT:
-		r = "Partial Content";
-		break;
-	case HTTP_STATUS_MULTIPLE_CHOICES:
-		r = "Multiple Choices";
-		break;
-	case HTTP_STATUS_MOVED_PERMANENTLY:
-		r = "Moved Permanently";
-		break;
-	case HTTP_STATUS_FOUND:
-		r = "Found";
-		break;
-	case HTTP_STATUS_SEE_OTHER:
-		r = "See Other";
-		break;
-	case HTTP_STATUS_NOT_MODIFIED:
-		r = "Not Modified";
-		break;
-	case HTTP_STATUS_USE_PROXY:
-		r = "Use Proxy";
-		break;
-	case HTTP_STATUS_TEMPORARY_REDIRECT:
-		r = "Temporary Redirect";
-		break;
-	case HTTP_STATUS_BAD_REQUEST:
-		r = "Bad Request";
-		break;
-	case HTTP_STATUS_UNAUTHORIZED:
-		r = "Unauthorized";
-		break;
-	case HTTP_STATUS_PAYMENT_REQUIRED:
-		r = "Payment Required";
-		break;
-	case HTTP_STATUS_FORBIDDEN:
-		r = "Forbidden";
-		break;
-	case HTTP_STATUS_NOT_FOUND:
-		r = "Not Found";
-		break;
-	case HTTP_STATUS_METHOD_NOT_ALLOWED:
+	TAILQ_FOREACH(f, &(req->files), list) {
+		if (!strcmp(f->name, name))
+			return (f);
+	}
+
+	return (NULL);
+}
+
+ssize_t
+http_file_read(struct http_file *file, void *buf, size_t len)
+{
+	int		fd;
+	ssize_t		ret;
+	const char	*path;
+	size_t		toread, off;
+
+	if (file->length < file->offset)
+		return (-1);
+	if ((file->offset + len) < file->offset)
+		return (-1);
+	if ((file->position + file->offset) < file->position)
+		return (-1);
+
+	off = file->position + file->offset;
+	toread = MIN(len, (file->length - file->offset));
+	if (toread == 0)
+		return (0);
+
+	if (file->fd != -1) {
+		fd = file->fd;
+		path = file->path;
+	} else {
+		fd = file->req->http_body_fd;
+		path = file->req->http_body_path;
+	}
+
+	if (fd != -1) {
+		if (lseek(fd, off, SEEK_SET) == -1) {
+			kore_log(LOG_ERR, "http_file_read: lseek(%s): %s",
+			    path, errno_s);
+			return (-1);
+		}
+
+		for (;;) {
+			ret = read(fd, buf, toread);
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				kore_log(LOG_ERR, "failed to read %s: %s",
+				    path, errno_s);
+				return (-1);
+			}
+			if (ret == 0)
+				return (0);
+			break;
+		}
+	} else if (file->req->http_body != NULL) {
+		if (off > file->req->http_body->length)
+			return (0);
+		memcpy(buf, file->req->http_body->data + off, toread);
+		ret = toread;
+	} else {
+		kore_log(LOG_ERR, "http_file_read: called without body");
+		return (-1);
+	}
+
+	file->offset += (size_t)ret;
+	return (ret);
+}
+
+void
+http_file_rewind(struct http_file *file)
+{
+	file->offset = 0;
+}
+
+void
+http_response_cookie(struct http_request *req, const char *name,
+    const char *val, const char *path, time_t expires, u_int32_t maxage,
+    struct http_cookie **out)
+{
+	char			*p;
+	struct http_cookie	*ck;
+
+	if (name == NULL || val == NULL)
+		fatal("http_response_cookie: invalid parameters");
+
+	ck = kore_pool_get(&http_cookie_pool);
+
+	ck->maxage = maxage;
+	ck->expires = expires;
+	ck->name = http_request_strdup(req, name);
+	ck->value = http_request_strdup(req, val);
+	ck->domain = http_request_strdup(req, req->host);
+	ck->flags = HTTP_COOKIE_HTTPONLY | HTTP_COOKIE_SECURE;
+
+	if ((p = strrchr(ck->domain, ':')) != NULL)
+		*p = '\0';
+
+	if (path != NULL)
+		ck->path = http_request_strdup(req, path);
+	else
+		ck->path = NULL;
+
+	TAILQ_INSERT_TAIL(&(req->resp_cookies), ck, list);
+
+	if (out != NULL)
+		*out = ck;
+}
+
+void
+http_populate_cookies(struct http_request *req)
+{
+	struct http_cookie	*ck;
+	const char		*hdr;
+	int			 i, v, n;
+	char			*c, *header, *pair[3];
+	char			*cookies[HTTP_MAX_COOKIES];
+
+	if (!http_request_header(req, "cookie", &hdr))
+		return;
+
+	header = http_request_strdup(req, hdr);
+	v = kore_split_string(header, ";", cookies, HTTP_MAX_COOKIES);
+	for (i = 0; i < v; i++) {
+		for (c = cookies[i]; isspace(*(unsigned char *)c); c++)
+			;
+
+		n = kore_split_string(c, "=", pair, 3);
+		if (n != 2)
+			continue;
+
+		ck = kore_pool_get(&http_cookie_pool);
+		ck->name = pair[0];
+		ck->value = pair[1];
+		TAILQ_INSERT_TAIL(&(req->req_cookies), ck, list);
+	}
+}
+
+void
+http_populate_post(struct http_request *req)
+{
+	ssize_t			ret;
+	size_t			off;
+	char			*string;
+
+	if (req->method != HTTP_METHOD_POST ||
+	    http_arguments_pending(req, HTTP_ARGS_PENDING_POST))
+		return;
+
+	/*
+	 * The body is consumed right away as it always was, but only
+	 * split up into arguments when one is looked up.
+	 */
+	if (req->http_body != NULL) {
+		req->http_body->offset = req->content_length;
+		string = kore_buf_stringify(req->http_body, NULL);
+		req->http_body_length = 0;
+		req->http_body_offset = 0;
+	} else {
+		off = 0;
+		string = http_request_alloc(req, req->http_body_length + 1);
+
+		while (req->http_body_length > 0) {
+			ret = http_body_read(req, string + off,
+			    req->http_body_length);
+			if (ret == -1)
+				return;
+			if (ret == 0)
+				break;
+			off += (size_t)ret;
+		}
+
+		string[off] = '\0';
+	}
+
+	req->args_post = string;
+	req->args_pending[req->args_npending++] = HTTP_ARGS_PENDING_POST;
+}
+
+void
+http_populate_qs(struct http_request *req)
+{
+	if (req->query_string == NULL ||
+	    http_arguments_pending(req, HTTP_ARGS_PENDING_QS))
+		return;
+
+	req->args_pending[req->args_npending++] = HTTP_ARGS_PENDING_QS;
+}
+
+void
+http_populate_multipart_form(struct http_request *req)
+{
+	const char		*hdr;
+	int			h, blen;
+	struct kore_buf		in, out;
+	char			*type, *val, *args[3];
+	char			boundary[HTTP_BOUNDARY_MAX];
+
+	if (req->method != HTTP_METHOD_POST)
+		return;
+
+	/* Already parsed while the body came in. */
+	if (req->multipart != NULL)
+		return;
+
+	if (!http_request_header(req, "content-type", &hdr))
+		return;
+
+	kore_buf_init(&in, 128);
+	kore_buf_init(&out, 128);
+
+	type = kore_strdup(hdr);
+	h = kore_split_string(type, ";", args, 3);
+	if (h != 2)
+		goto cleanup;
+
+	if (strcasecmp(args[0], "multipart/form-data"))
+		goto cleanup;
+
+	if ((val = strchr(args[1], '=')) == NULL)
+		goto cleanup;
+
+	val++;
+	blen = snprintf(boundary, sizeof(boundary), "--%s", val);
+	if (blen == -1 || (size_t)blen >= sizeof(boundary))
+		goto cleanup;
+
+	if (!multipart_find_data(&in, NULL, NULL, req, boundary, blen))
+		goto cleanup;
+
+	for (;;) {
+		if (!multipart_find_data(&in, NULL, NULL, req, "\r\n", 2))
+			break;
+		if (in.offset < 4 && req->http_body_length == 0)
+			break;
+		if (!multipart_find_data(&in, &out, NULL, req, "\r\n\r\n", 4))
+			break;
+		if (!multipart_parse_headers(req, &in, &out, boundary, blen))
+			break;
+
+		kore_buf_reset(&out);
+	}
+
+cleanup:
+	kore_free(type);
+	kore_buf_cleanup(&in);
+	kore_buf_cleanup(&out);
+}
+
+/*
+ * Gives a completely received offloaded body a name at path without
+ * copying it, path must be on the same filesystem as http_body_disk_path.
+ * The request keeps its own reference, the body stays readable.
+ */
+int
+http_body_persist(struct http_request *req, const char *path)
+{
+	char		fdpath[32];
+	int		len, ret, saved;
+
+	if (!(req->flags & HTTP_REQUEST_COMPLETE) || req->http_body_fd == -1) {
+		errno = EINVAL;
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (req->flags & HTTP_REQUEST_BODY_TMPFILE) {
+		len = snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d",
+		    req->http_body_fd);
+		if (len == -1 || (size_t)len >= sizeof(fdpath)) {
+			errno = ENAMETOOLONG;
+			return (KORE_RESULT_ERROR);
+		}
+		ret = linkat(AT_FDCWD, fdpath, AT_FDCWD, path,
+		    AT_SYMLINK_FOLLOW);
+	} else {
+		ret = link(req->http_body_path, path);
+	}
+
+	if (ret == -1) {
+		saved = errno;
+		kore_log(LOG_NOTICE, "failed to persist body to %s: %s",
+		    path, errno_s);
+		errno = saved;
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+int
+http_body_rewind(struct http_request *req)
+{
+	if (req->http_body_fd != -1) {
+		if (lseek(req->http_body_fd, 0, SEEK_SET) == -1) {
+			kore_log(LOG_ERR, "lseek(%s) failed: %s",
+			    req->http_body_path, errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+	} else if (req->http_body != NULL) {
+		kore_buf_reset(req->http_body);
+	}
+
+	req->http_body_offset = 0;
+	req->http_body_length = req->content_length;
+
+	return (KORE_RESULT_OK);
+}
+
+int
+http_body_digest(struct http_request *req, char *out, size_t len)
+{
+	size_t		idx;
+	int		slen;
+
+	if (len != HTTP_BODY_DIGEST_STRLEN) {
+		fatal("http_body_digest: bad len:%zu wanted:%zu",
+		    len, HTTP_BODY_DIGEST_STRLEN);
+	}
+
+	if (http_body_digest_raw(req) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	for (idx = 0; idx < sizeof(req->http_body_digest); idx++) {
+		slen = snprintf(out + (idx * 2), len - (idx * 2), "%02x",
+		    req->http_body_digest[idx]);
+		if (slen == -1 || (size_t)slen >= len)
+			fatal("failed to create hex string");
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Returns the SHA256 digest of a completely received body, or NULL if
+ * there is none. Routes with body_digest hash the body as it comes in,
+ * for all others it is hashed here on first use.
+ */
+const u_int8_t *
+http_body_digest_raw(struct http_request *req)
+{
+	if (!(req->flags & HTTP_REQUEST_COMPLETE))
+		return (NULL);
+
+	if (!(req->flags & HTTP_REQUEST_BODY_DIGEST)) {
+		if (!http_body_hash_stored(req))
+			return (NULL);
+	}
+
+	return (req->http_body_digest);
+}
+
+ssize_t
+http_body_read(struct http_request *req, void *out, size_t len)
+{
+	ssize_t		ret;
+	size_t		toread;
+
+	toread = MIN(req->http_body_length, len);
+	if (toread == 0)
+		return (0);
+
+	if (req->http_body_fd != -1) {
+		for (;;) {
+			ret = read(req->http_body_fd, out, toread);
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				kore_log(LOG_ERR, "failed to read %s: %s",
+				    req->http_body_path, errno_s);
+				return (-1);
+			}
+			if (ret == 0)
+				return (0);
+			break;
+		}
+	} else if (req->http_body != NULL) {
+		memcpy(out,
+		    (req->http_body->data + req->http_body->offset), toread);
+		req->http_body->offset += toread;
+		ret = toread;
+	} else {
+		kore_log(LOG_ERR, "http_body_read: called without body");
+		return (-1);
+	}
+
+	req->http_body_length -= (size_t)ret;
+	req->http_body_offset += (size_t)ret;
+
+	return (ret);
+}
+
+int
+http_state_run(struct http_state *states, u_int8_t elm,
+    struct http_request *req)
+{
+	int		r, done;
+
+	done = 0;
+
+	while (!done) {
+		if (req->fsm_state >= elm) {
+			fatal("http_state_run: fsm_state > elm (%d/%d)",
+			    req->fsm_state, elm);
+		}
+
+		kore_debug("http_state_run: running %s",
+		    states[req->fsm_state].name);
+
+		r = states[req->fsm_state].cb(req);
+		switch (r) {
+		case HTTP_STATE_ERROR:
+			return (KORE_RESULT_OK);
+		case HTTP_STATE_RETRY:
+			return (KORE_RESULT_RETRY);
+		case HTTP_STATE_CONTINUE:
+			break;
+		case HTTP_STATE_COMPLETE:
+			done = 1;
+			break;
+		default:
+			fatal("http_state_run: unknown return value %d", r);
+		}
+	}
+
+	req->fsm_state = 0;
+	kore_debug("http_state_run(%p): done", req);
+
+	return (KORE_RESULT_OK);
+}
+
+int
+http_state_exists(struct http_request *req)
+{
+	return (req->hdlr_extra != NULL);
+}
+
+void *
+http_state_create(struct http_request *req, size_t len)
+{
+	if (req->hdlr_extra != NULL)
+		fatal("http_state_create: state already exists");
+
+	req->state_len = len;
+	req->hdlr_extra = kore_calloc(1, len);
+
+	return (req->hdlr_extra);
+}
+
+void *
+http_state_get(struct http_request *req)
+{
+	return (req->hdlr_extra);
+}
+
+void
+http_state_cleanup(struct http_request *req)
+{
+	kore_free(req->hdlr_extra);
+	req->hdlr_extra = NULL;
+}
+
+void
+http_start_recv(struct connection *c)
+{
+	c->http_start = kore_time_ms();
+	c->http_timeout = http_header_timeout * 1000;
+	kore_connection_timeout_update(c);
+	net_recv_pooled(c, http_header_recv);
+}
+
+void
+http_runlock_init(struct http_runlock *lock)
+{
+	lock->owner = NULL;
+	LIST_INIT(&lock->queue);
+}
+
+int
+http_runlock_acquire(struct http_runlock *lock, struct http_request *req)
+{
+	if (lock->owner != NULL) {
+		if (req->runlock != NULL)
+			fatal("%s: request already waiting on lock", __func__);
+
+		req->runlock = kore_pool_get(&http_rlq_pool);
+		req->runlock->req = req;
+		LIST_INSERT_HEAD(&lock->queue, req->runlock, list);
+
+		http_request_sleep(req);
+		return (KORE_RESULT_ERROR);
+	}
+
+	lock->owner = req;
+
+	return (KORE_RESULT_OK);
+}
+
+/* Release the lock regardless of its owner and wake up every waiter. */
+void
+http_runlock_release_all(struct http_runlock *lock)
+{
+	struct http_runlock_queue	*next;
+
+	lock->owner = NULL;
+
+	while ((next = LIST_FIRST(&lock->queue)) != NULL) {
+		LIST_REMOVE(next, list);
+
+		next->req->runlock = NULL;
+		http_request_wakeup(next->req);
+
+		kore_pool_put(&http_rlq_pool, next);
+	}
+}
+
+void
+http_runlock_release(struct http_runlock *lock, struct http_request *req)
+{
+	struct http_runlock_queue	*next;
+	struct http_request		*nextreq;
+
+	if (lock->owner != req)
+		fatal("%s: calling request != owner of runlock", __func__);
+
+	lock->owner = NULL;
+
+	if ((next = LIST_FIRST(&lock->queue)) != NULL) {
+		LIST_REMOVE(next, list);
+
+		nextreq = next->req;
+		nextreq->runlock = NULL;
+
+		http_request_wakeup(nextreq);
+		kore_pool_put(&http_rlq_pool, next);
+	}
+}
+
+int
+http_redirect_add(struct kore_domain *dom, const char *path, int status,
+    const char *target)
+{
+	struct http_redirect	*rdr;
+
+	rdr = kore_calloc(1, sizeof(*rdr));
+
+	if (regcomp(&(rdr->rctx), path, REG_EXTENDED)) {
+		kore_free(rdr);
+		return (KORE_RESULT_ERROR);
+	}
+
+	rdr->status = status;
+
+	if (target != NULL)
+		rdr->target = kore_strdup(target);
+	else
+		rdr->target = NULL;
+
+	TAILQ_INSERT_TAIL(&dom->redirects, rdr, list);
+
+	return (KORE_RESULT_OK);
+}
+
+const char *
+http_status_text(int status)
+{
+	const char	*r;
+
+	switch (status) {
+	case HTTP_STATUS_CONTINUE:
+		r = "Continue";
+		break;
+	case HTTP_STATUS_SWITCHING_PROTOCOLS:
+		r = "Switching Protocols";
+		break;
+	case HTTP_STATUS_OK:
+		r = "OK";
+		break;
+	case HTTP_STATUS_CREATED:
+		r = "Created";
+		break;
+	case HTTP_STATUS_ACCEPTED:
+		r = "Accepted";
+		break;
+	case HTTP_STATUS_NON_AUTHORITATIVE:
+		r = "Non-Authoritative Information";
+		break;
+	case HTTP_STATUS_NO_CONTENT:
+		r = "No Content";
+		break;
+	case HTTP_STATUS_RESET_CONTENT:
+		r = "Reset Content";
+		break;
+	case HTTP_STATUS_PARTIAL_CONTENT:
+		r = "Partial Content";
+		break;
+	case HTTP_STATUS_MULTIPLE_CHOICES:
+		r = "Multiple Choices";
+		break;
+	case HTTP_STATUS_MOVED_PERMANENTLY:
+		r = "Moved Permanently";
+		break;
+	case HTTP_STATUS_FOUND:
+		r = "Found";
+		break;
+	case HTTP_STATUS_SEE_OTHER:
+		r = "See Other";
+		break;
+	case HTTP_STATUS_NOT_MODIFIED:
+		r = "Not Modified";
+		break;
+	case HTTP_STATUS_USE_PROXY:
+		r = "Use Proxy";
+		break;
+	case HTTP_STATUS_TEMPORARY_REDIRECT:
+		r = "Temporary Redirect";
+		break;
+	case HTTP_STATUS_BAD_REQUEST:
+		r = "Bad Request";
+		break;
+	case HTTP_STATUS_UNAUTHORIZED:
+		r = "Unauthorized";
+		break;
+	case HTTP_STATUS_PAYMENT_REQUIRED:
+		r = "Payment Required";
+		break;
+	case HTTP_STATUS_FORBIDDEN:
+		r = "Forbidden";
+		break;
+	case HTTP_STATUS_NOT_FOUND:
+		r = "Not Found";
+		break;
+	case HTTP_STATUS_METHOD_NOT_ALLOWED:
 		r = "Method Not Allowed";
 		break;
 	case HTTP_STATUS_NOT_ACCEPTABLE:
@@ -1671,6 +2971,9 @@ http_status_text(int status)
 	case HTTP_STATUS_MISDIRECTED_REQUEST:
 		r = "Misdirected Request";
 		break;
+	case HTTP_STATUS_TOO_MANY_REQUESTS:
+		r = "Too Many Requests";
+		break;
 	case HTTP_STATUS_INTERNAL_ERROR:
 		r = "Internal Server Error";
 		break;
@@ -1690,723 +2993,1606 @@ http_status_text(int status)
 		r = "HTTP Version not supported";
 		break;
 	default:
-		r = "";
+		r = "";
+		break;
+	}
+
+	return (r);
+}
+
+const char *
+http_method_text(int method)
+{
+	char		*r;
+
+	switch(method) {
+	case HTTP_METHOD_GET:
+		r = "GET";
+		break;
+	case HTTP_METHOD_POST:
+		r = "POST";
+		break;
+	case HTTP_METHOD_PUT:
+		r = "PUT";
+		break;
+	case HTTP_METHOD_DELETE:
+		r = "DELETE";
+		break;
+	case HTTP_METHOD_HEAD:
+		r = "HEAD";
+		break;
+	case HTTP_METHOD_OPTIONS:
+		r = "OPTIONS";
+		break;
+	case HTTP_METHOD_PATCH:
+		r = "PATCH";
+		break;
+	default:
+		r = "";
+		break;
+	}
+
+	return (r);
+}
+
+int
+http_method_value(const char *method)
+{
+	if (!strcasecmp(method, "GET"))
+		return (HTTP_METHOD_GET);
+
+	if (!strcasecmp(method, "POST"))
+		return (HTTP_METHOD_POST);
+
+	if (!strcasecmp(method, "PUT"))
+		return (HTTP_METHOD_PUT);
+
+	if (!strcasecmp(method, "DELETE"))
+		return (HTTP_METHOD_DELETE);
+
+	if (!strcasecmp(method, "HEAD"))
+		return (HTTP_METHOD_HEAD);
+
+	if (!strcasecmp(method, "OPTIONS"))
+		return (HTTP_METHOD_OPTIONS);
+
+	if (!strcasecmp(method, "PATCH"))
+		return (HTTP_METHOD_PATCH);
+
+	return (0);
+}
+
+int
+http_media_register(const char *ext, const char *type)
+{
+	struct http_media_type	*media;
+
+	LIST_FOREACH(media, &http_media_types, list) {
+		if (!strcasecmp(media->ext, ext))
+			return (KORE_RESULT_ERROR);
+	}
+
+	media = kore_calloc(1, sizeof(*media));
+	media->ext = kore_strdup(ext);
+	media->type = kore_strdup(type);
+
+	LIST_INSERT_HEAD(&http_media_types, media, list);
+
+	return (KORE_RESULT_OK);
+}
+
+const char *
+http_media_type(const char *path)
+{
+	const char		*p;
+	struct http_media_type	*media;
+
+	if ((p = strrchr(path, '.')) == NULL)
+		return (NULL);
+
+	p++;
+	if (*p == '\0')
+		return (NULL);
+
+	LIST_FOREACH(media, &http_media_types, list) {
+		if (!strcasecmp(media->ext, p))
+			return (media->type);
+	}
+
+	return (NULL);
+}
+
+char *
+http_validate_header(char *header)
+{
+	u_int8_t	idx;
+	char		*p, *value;
+
+	for (p = header; *p != '\0'; p++) {
+		idx = *p;
+		if (idx > HTTP_MAP_LIMIT)
+			return (NULL);
+
+		if (*p == ':') {
+			*(p)++ = '\0';
+			break;
+		}
+
+		if (http_token[idx] == 0x00)
+			return (NULL);
+	}
+
+	while (isspace(*(unsigned char *)p))
+		p++;
+
+	if (*p == '\0')
+		return (NULL);
+
+	value = p;
+	while (*p != '\0') {
+		idx = *p;
+		if (idx > HTTP_MAP_LIMIT)
+			return (NULL);
+		if (http_field_content[idx] == 0x00)
+			return (NULL);
+		p++;
+	}
+
+	return (value);
+}
+
+static int
+http_header_known_slot(const char *name, size_t len)
+{
+	int		slot;
+
+	if (len == 0)
+		return (-1);
+
+	slot = HTTP_HEADER_KNOWN_HASH(len, tolower(*(const u_int8_t *)name),
+	    tolower(*(const u_int8_t *)(name + len - 1)));
+
+	if (http_known_headers[slot] == NULL ||
+	    strcasecmp(http_known_headers[slot], name))
+		return (-1);
+
+	return (slot);
+}
+
+static u_int32_t
+http_header_hash(const char *name)
+{
+	u_int32_t	hash;
+
+	hash = 2166136261;
+	while (*name != '\0') {
+		hash ^= tolower(*(const u_int8_t *)name++);
+		hash *= 16777619;
+	}
+
+	return (hash);
+}
+
+static void
+http_header_index(struct http_request *req, struct http_header *hdr)
+{
+	int		slot;
+	u_int32_t	idx, i;
+
+	if ((slot = http_header_known_slot(hdr->header,
+	    strlen(hdr->header))) != -1) {
+		if (req->hdr_known[slot] == NULL)
+			req->hdr_known[slot] = hdr;
+		return;
+	}
+
+	idx = http_header_hash(hdr->header);
+	for (i = 0; i < HTTP_HEADER_INDEX_MAX; i++) {
+		slot = (idx + i) & (HTTP_HEADER_INDEX_MAX - 1);
+		if (req->hdr_index[slot] == NULL) {
+			req->hdr_index[slot] = hdr;
+			return;
+		}
+
+		/* Keep the first occurrence, like the list does. */
+		if (!strcasecmp(req->hdr_index[slot]->header, hdr->header))
+			return;
+	}
+
+	/* Table is full, lookups have to walk the list from now on. */
+	req->hdr_overflow = 1;
+}
+
+static struct http_header *
+http_header_lookup(struct http_request *req, const char *name)
+{
+	int			slot;
+	u_int32_t		idx, i;
+	struct http_header	*hdr;
+
+	if ((slot = http_header_known_slot(name, strlen(name))) != -1)
+		return (req->hdr_known[slot]);
+
+	idx = http_header_hash(name);
+	for (i = 0; i < HTTP_HEADER_INDEX_MAX; i++) {
+		slot = (idx + i) & (HTTP_HEADER_INDEX_MAX - 1);
+		if ((hdr = req->hdr_index[slot]) == NULL)
+			break;
+
+		if (!strcasecmp(hdr->header, name))
+			return (hdr);
+	}
+
+	if (req->hdr_overflow) {
+		TAILQ_FOREACH(hdr, &(req->req_headers), list) {
+			if (!strcasecmp(hdr->header, name))
+				return (hdr);
+		}
+	}
+
+	return (NULL);
+}
+
+/* Sends what the writer has so far as one chunk of the body. */
+static void
+http_json_flush(struct kore_json_writer *w)
+{
+	int			len;
+	struct netbuf		*nb;
+	struct connection	*c;
+	struct http_json_sink	*sink;
+	char			hdr[32];
+
+	sink = w->arg;
+
+	if ((sink->flags & HTTP_JSON_SINK_ERROR) ||
+	    sink->req->owner == NULL) {
+		kore_rope_cleanup(&w->rope);
+		return;
+	}
+
+	c = sink->req->owner;
+
+	len = snprintf(hdr, sizeof(hdr), "%zx\r\n", w->rope.length);
+	if (len == -1 || (size_t)len >= sizeof(hdr))
+		fatal("%s: failed to create chunk header", __func__);
+
+	net_send_queue(c, hdr, len);
+	net_send_queue_rope(c, &w->rope);
+
+	/* Sent once the chunk before it is, tells us it was. */
+	net_send_stream(c, http_json_crlf, sizeof(http_json_crlf),
+	    http_json_sent, &nb);
+	nb->extra = sink;
+
+	sink->refs++;
+	sink->inflight++;
+
+	if (!net_send_flush(c)) {
+		sink->flags |= HTTP_JSON_SINK_ERROR;
+		kore_connection_disconnect(c);
+	}
+}
+
+static int
+http_json_sent(struct netbuf *nb)
+{
+	struct http_json_sink	*sink;
+
+	sink = nb->extra;
+	sink->inflight--;
+
+	if (sink->req != NULL && sink->inflight < HTTP_JSON_INFLIGHT_MAX)
+		http_request_wakeup(sink->req);
+
+	http_json_sink_release(sink);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Unhooks the writer from its request. A chunked response that did not
+ * finish can't be completed anymore so its connection is cut.
+ */
+static void
+http_json_detach(struct kore_json_writer *w)
+{
+	struct connection	*c;
+	struct http_json_sink	*sink;
+
+	if ((sink = w->arg) == NULL)
+		return;
+
+	w->arg = NULL;
+	w->flush = NULL;
+	w->cleanup = NULL;
+
+	if ((sink->flags & HTTP_JSON_SINK_CHUNKED) &&
+	    !(sink->flags & HTTP_JSON_SINK_DONE) &&
+	    (c = sink->req->owner) != NULL) {
+		c->flags &= ~CONN_IS_BUSY;
+		kore_connection_disconnect(c);
+	}
+
+	sink->req = NULL;
+	http_json_sink_release(sink);
+}
+
+static void
+http_json_sink_release(struct http_json_sink *sink)
+{
+	if (sink->refs == 0)
+		fatal("%s: no references left", __func__);
+
+	if (--sink->refs == 0)
+		kore_free(sink);
+}
+
+static int
+http_release_buffer(struct netbuf *nb)
+{
+	kore_buf_free(nb->extra);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_check_redirect(struct http_request *req, struct kore_domain *dom)
+{
+	int			idx;
+	struct http_redirect	*rdr;
+	const char		*uri;
+	char			key[4];
+	struct kore_buf		location;
+
+	TAILQ_FOREACH(rdr, &dom->redirects, list) {
+		if (!regexec(&(rdr->rctx), req->path,
+		    HTTP_CAPTURE_GROUPS, req->cgroups, 0))
+			break;
+	}
+
+	if (rdr == NULL)
+		return (KORE_RESULT_ERROR);
+
+	uri = NULL;
+	kore_buf_init(&location, 128);
+
+	if (rdr->target) {
+		kore_buf_appendf(&location, "%s", rdr->target);
+
+		if (req->query_string != NULL) {
+			kore_buf_replace_string(&location, "$qs",
+			    req->query_string, strlen(req->query_string));
+		}
+
+		/* Starts at 1 to skip the full path. */
+		for (idx = 1; idx < HTTP_CAPTURE_GROUPS - 1; idx++) {
+			if (req->cgroups[idx].rm_so == -1 ||
+			    req->cgroups[idx].rm_eo == -1)
+				break;
+
+			(void)snprintf(key, sizeof(key), "$%d", idx);
+
+			kore_buf_replace_string(&location, key,
+			    req->path + req->cgroups[idx].rm_so,
+			    req->cgroups[idx].rm_eo - req->cgroups[idx].rm_so);
+		}
+
+		uri = kore_buf_stringify(&location, NULL);
+	}
+
+	if (uri)
+		http_response_header(req, "location", uri);
+
+	http_response(req, rdr->status, NULL, 0);
+	kore_buf_cleanup(&location);
+
+	if (dom->accesslog)
+		kore_accesslog(req);
+
+	kore_metrics_request(req);
+
+	return (KORE_RESULT_OK);
+}
+
+struct http_request *
+http_request_new(struct connection *c, const char *host,
+    const char *method, char *path, const char *version)
+{
+	struct kore_domain		*dom;
+	struct http_request		*req;
+	size_t				qsoff;
+	char				*p, *hp;
+	int				m, flags, exists;
+
+	if (http_request_count >= http_request_limit) {
+		http_error_response(c, HTTP_STATUS_SERVICE_UNAVAILABLE);
+		return (NULL);
+	}
+
+	kore_debug("http_request_new(%p, %s, %s, %s, %s)", c, host,
+	    method, path, version);
+
+	if (strlen(host) >= KORE_DOMAINNAME_LEN - 1) {
+		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+		return (NULL);
+	}
+
+	if (strlen(path) >= HTTP_URI_LEN - 1) {
+		http_error_response(c, HTTP_STATUS_REQUEST_URI_TOO_LARGE);
+		return (NULL);
+	}
+
+	if (c->proto == CONN_PROTO_HTTP2) {
+		flags = HTTP_VERSION_2;
+	} else if (strcasecmp(version, "http/1.1")) {
+		if (strcasecmp(version, "http/1.0")) {
+			http_error_response(c, HTTP_STATUS_BAD_VERSION);
+			return (NULL);
+		}
+
+		flags = HTTP_VERSION_1_0;
+	} else {
+		flags = HTTP_VERSION_1_1;
+	}
+
+	if ((p = strchr(path, '?')) != NULL) {
+		qsoff = p - path;
+	} else {
+		qsoff = 0;
+	}
+
+	hp = NULL;
+
+	switch (c->family) {
+	case AF_INET6:
+		if (*host == '[') {
+			if ((hp = strrchr(host, ']')) == NULL) {
+				http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+				return (NULL);
+			}
+			hp++;
+			if (*hp == ':')
+				*hp = '\0';
+			else
+				hp = NULL;
+		}
+		break;
+	default:
+		if ((hp = strrchr(host, ':')) != NULL)
+			*hp = '\0';
 		break;
 	}
 
-	return (r);
+	if (c->owner->server->tls && c->tls_sni != NULL) {
+		if (strcasecmp(c->tls_sni, host)) {
+			http_error_response(c, HTTP_STATUS_MISDIRECTED_REQUEST);
+			return (NULL);
+		}
+	}
+
+	if ((dom = kore_domain_lookup(c->owner->server, host)) == NULL) {
+		http_error_response(c, HTTP_STATUS_NOT_FOUND);
+		return (NULL);
+	}
+
+	if (dom->cafile != NULL && c->tls_cert == NULL) {
+		http_error_response(c, HTTP_STATUS_FORBIDDEN);
+		return (NULL);
+	}
+
+	if (hp != NULL)
+		*hp = ':';
+
+	if (!strcasecmp(method, "get")) {
+		m = HTTP_METHOD_GET;
+		flags |= HTTP_REQUEST_COMPLETE;
+	} else if (!strcasecmp(method, "delete")) {
+		m = HTTP_METHOD_DELETE;
+		flags |= HTTP_REQUEST_EXPECT_BODY;
+	} else if (!strcasecmp(method, "post")) {
+		m = HTTP_METHOD_POST;
+		flags |= HTTP_REQUEST_EXPECT_BODY;
+	} else if (!strcasecmp(method, "put")) {
+		m = HTTP_METHOD_PUT;
+		flags |= HTTP_REQUEST_EXPECT_BODY;
+	} else if (!strcasecmp(method, "head")) {
+		m = HTTP_METHOD_HEAD;
+		flags |= HTTP_REQUEST_COMPLETE;
+	} else if (!strcasecmp(method, "options")) {
+		m = HTTP_METHOD_OPTIONS;
+		flags |= HTTP_REQUEST_COMPLETE;
+	} else if (!strcasecmp(method, "patch")) {
+		m = HTTP_METHOD_PATCH;
+		flags |= HTTP_REQUEST_EXPECT_BODY;
+	} else {
+		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
+		return (NULL);
+	}
+
+	if (flags & HTTP_VERSION_1_0) {
+		if (m != HTTP_METHOD_GET && m != HTTP_METHOD_POST &&
+		    m != HTTP_METHOD_HEAD) {
+			http_error_response(c, HTTP_STATUS_METHOD_NOT_ALLOWED);
+			return (NULL);
+		}
+	}
+
+	req = kore_pool_get(&http_request_pool);
+
+	req->end = 0;
+	req->total = 0;
+	req->start = 0;
+	req->owner = c;
+	req->status = 0;
+	req->method = m;
+	req->agent = NULL;
+	req->referer = NULL;
+	req->cache = NULL;
+	req->runlock = NULL;
+	req->flags = flags;
+	req->fsm_state = 0;
+	req->receiving = 0;
+	req->overload = 0;
+	req->t_ready = 0;
+	req->http_body = NULL;
+	req->http_body_fd = -1;
+	req->onfree = NULL;
+	req->hdlr_extra = NULL;
+	req->content_length = 0;
+	req->query_string = NULL;
+	req->args_post = NULL;
+	req->args_npending = 0;
+	req->http_body_length = 0;
+	req->http_body_offset = 0;
+	req->http_body_path = NULL;
+	req->http_body_pending = NULL;
+	req->hashctx = NULL;
+	req->arena = NULL;
+	req->upstream = NULL;
+	req->multipart = NULL;
+	req->chunked = NULL;
+	req->t_ttfb = 0;
+	req->t_sleep = 0;
+	req->t_body = 0;
+	req->t_auth = 0;
+	req->t_flush = 0;
+	req->t_handler = 0;
+	req->t_created = HTTP_TIMING_ENABLED() ? kore_time_us() : 0;
+
+	if (c->proto == CONN_PROTO_HTTP && req->t_created != 0 &&
+	    c->http_hdr_first != 0 && c->http_hdr_first <= req->t_created)
+		req->t_hdrs = req->t_created - c->http_hdr_first;
+	else
+		req->t_hdrs = 0;
+
+	req->host = host;
+	req->path = path;
+	req->stream = NULL;
+
+#if defined(KORE_USE_PYTHON)
+	req->py_req = NULL;
+	req->py_coro = NULL;
+	req->py_rqnext = NULL;
+	req->py_validator = NULL;
+#endif
+
+	if (qsoff > 0) {
+		req->query_string = path + qsoff;
+		*(req->query_string)++ = '\0';
+	} else {
+		req->query_string = NULL;
+	}
+
+	/* Checked further down below if we need to 404. */
+	exists = kore_route_lookup(req, dom, m, &req->rt);
+
+	TAILQ_INIT(&(req->resp_headers));
+	TAILQ_INIT(&(req->req_headers));
+	TAILQ_INIT(&(req->resp_cookies));
+	TAILQ_INIT(&(req->req_cookies));
+	TAILQ_INIT(&(req->arguments));
+	TAILQ_INIT(&(req->files));
+
+	memset(req->hdr_known, 0, sizeof(req->hdr_known));
+	memset(req->hdr_index, 0, sizeof(req->hdr_index));
+	req->hdr_overflow = 0;
+
+#if defined(KORE_USE_TASKS)
+	LIST_INIT(&(req->tasks));
+
+	req->offload = NULL;
+	req->offload_status = 0;
+	req->offload_close = 0;
+	req->offload_body = NULL;
+	req->offload_len = 0;
+#endif
+
+#if defined(KORE_USE_PGSQL)
+	LIST_INIT(&(req->pgsqls));
+#endif
+
+	http_request_count++;
+	http_requests_ready++;
+	TAILQ_INSERT_HEAD(&http_requests, req, list);
+	TAILQ_INSERT_TAIL(&(c->http_requests), req, olist);
+
+	if (c->proto == CONN_PROTO_HTTP2)
+		http2_request_attach(c, req);
+
+	if (http_check_redirect(req, dom)) {
+		http_request_free(req);
+		return (NULL);
+	}
+
+	if (exists == 0) {
+		http_error_response(c, HTTP_STATUS_NOT_FOUND);
+		http_request_free(req);
+		return (NULL);
+	}
+
+	if (req->rt == NULL) {
+		http_error_response(c, HTTP_STATUS_METHOD_NOT_ALLOWED);
+		http_request_free(req);
+		return (NULL);
+	}
+
+	return (req);
 }
 
-const char *
-http_method_text(int method)
+static int
+multipart_find_data(struct kore_buf *in, struct kore_buf *out,
+    size_t *olen, struct http_request *req, const void *needle, size_t len)
 {
-	char		*r;
+	ssize_t			ret;
+	size_t			left;
+	u_int8_t		*p, first, data[4096];
 
-	switch(method) {
-	case HTTP_METHOD_GET:
-		r = "GET";
-		break;
-	case HTTP_METHOD_POST:
-		r = "POST";
-		break;
-	case HTTP_METHOD_PUT:
-		r = "PUT";
-		break;
-	case HTTP_METHOD_DELETE:
-		r = "DELETE";
-		break;
-	case HTTP_METHOD_HEAD:
-		r = "HEAD";
-		break;
-	case HTTP_METHOD_OPTIONS:
-		r = "OPTIONS";
-		break;
-	case HTTP_METHOD_PATCH:
-		r = "PATCH";
-		break;
-	default:
-		r = "";
-		break;
+	if (olen != NULL)
+		*olen = 0;
+
+	first = *(const u_int8_t *)needle;
+	for (;;) {
+		if (in->offset < len) {
+			ret = http_body_read(req, data, sizeof(data));
+			if (ret == -1)
+				return (KORE_RESULT_ERROR);
+			if (ret == 0)
+				return (KORE_RESULT_ERROR);
+
+			kore_buf_append(in, data, ret);
+			continue;
+		}
+
+		p = kore_mem_find(in->data, in->offset, &first, 1);
+		if (p == NULL) {
+			if (out != NULL)
+				kore_buf_append(out, in->data, in->offset);
+			if (olen != NULL)
+				*olen += in->offset;
+			kore_buf_reset(in);
+			continue;
+		}
+
+		left = in->offset - (p - in->data);
+		if (left < len) {
+			if (out != NULL)
+				kore_buf_append(out, in->data, (p - in->data));
+			if (olen != NULL)
+				*olen += (p - in->data);
+			memmove(in->data, p, left);
+			in->offset = left;
+			continue;
+		}
+
+		if (!memcmp(p, needle, len)) {
+			if (out != NULL)
+				kore_buf_append(out, in->data, p - in->data);
+			if (olen != NULL)
+				*olen += (p - in->data);
+
+			in->offset = left - len;
+			if (in->offset > 0)
+				memmove(in->data, p + len, in->offset);
+			return (KORE_RESULT_OK);
+		}
+
+		if (out != NULL)
+			kore_buf_append(out, in->data, (p - in->data) + 1);
+		if (olen != NULL)
+			*olen += (p - in->data) + 1;
+
+		in->offset = left - 1;
+		if (in->offset > 0)
+			memmove(in->data, p + 1, in->offset);
 	}
 
-	return (r);
+	return (KORE_RESULT_ERROR);
 }
 
-int
-http_method_value(const char *method)
+static int
+multipart_parse_headers(struct http_request *req, struct kore_buf *in,
+    struct kore_buf *hbuf, const char *boundary, const int blen)
 {
-	if (!strcasecmp(method, "GET"))
-		return (HTTP_METHOD_GET);
+	int		h, c, i;
+	char		*headers[5], *args[5], *opt[5];
+	char		*d, *val, *name, *fname, *string;
 
-	if (!strcasecmp(method, "POST"))
-		return (HTTP_METHOD_POST);
+	string = kore_buf_stringify(hbuf, NULL);
+	h = kore_split_string(string, "\r\n", headers, 5);
+	for (i = 0; i < h; i++) {
+		c = kore_split_string(headers[i], ":", args, 5);
+		if (c != 2)
+			continue;
 
-	if (!strcasecmp(method, "PUT"))
-		return (HTTP_METHOD_PUT);
+		/* Ignore other headers for now. */
+		if (strcasecmp(args[0], "content-disposition"))
+			continue;
 
-	if (!strcasecmp(method, "DELETE"))
-		return (HTTP_METHOD_DELETE);
+		for (d = args[1]; isspace(*(unsigned char *)d); d++)
+			;
 
-	if (!strcasecmp(method, "HEAD"))
-		return (HTTP_METHOD_HEAD);
+		c = kore_split_string(d, ";", opt, 5);
+		if (c < 2)
+			continue;
 
-	if (!strcasecmp(method, "OPTIONS"))
-		return (HTTP_METHOD_OPTIONS);
+		if (strcasecmp(opt[0], "form-data"))
+			continue;
 
-	if (!strcasecmp(method, "PATCH"))
-		return (HTTP_METHOD_PATCH);
+		if ((val = strchr(opt[1], '=')) == NULL)
+			continue;
+		if (strlen(val) < 3)
+			continue;
 
-	return (0);
-}
+		val++;
+		kore_strip_chars(val, '"', &name);
 
-int
-http_media_register(const char *ext, const char *type)
-{
-	struct http_media_type	*media;
+		if (opt[2] == NULL) {
+			multipart_add_field(req, in, name, boundary, blen);
+			kore_free(name);
+			continue;
+		}
 
-	LIST_FOREACH(media, &http_media_types, list) {
-		if (!strcasecmp(media->ext, ext))
-			return (KORE_RESULT_ERROR);
-	}
+		for (d = opt[2]; isspace(*(unsigned char *)d); d++)
+			;
 
-	media = kore_calloc(1, sizeof(*media));
-	media->ext = kore_strdup(ext);
-	media->type = kore_strdup(type);
+		if (!strncasecmp(d, "filename=", 9)) {
+			if ((val = strchr(d, '=')) == NULL) {
+				kore_free(name);
+				continue;
+			}
 
-	LIST_INSERT_HEAD(&http_media_types, media, list);
+			val++;
+			kore_strip_chars(val, '"', &fname);
+			if (strlen(fname) > 0) {
+				multipart_file_add(req,
+				    in, name, fname, boundary, blen);
+			}
+			kore_free(fname);
+		} else {
+			kore_debug("got unknown: %s", opt[2]);
+		}
+
+		kore_free(name);
+	}
 
 	return (KORE_RESULT_OK);
 }
 
-const char *
-http_media_type(const char *path)
+static void
+multipart_add_field(struct http_request *req, struct kore_buf *in,
+    char *name, const char *boundary, const int blen)
 {
-	const char		*p;
-	struct http_media_type	*media;
+	struct kore_buf		*data;
+	char			*string;
 
-	if ((p = strrchr(path, '.')) == NULL)
-		return (NULL);
+	data = kore_buf_alloc(128);
 
-	p++;
-	if (*p == '\0')
-		return (NULL);
+	if (!multipart_find_data(in, data, NULL, req, boundary, blen)) {
+		kore_buf_free(data);
+		return;
+	}
 
-	LIST_FOREACH(media, &http_media_types, list) {
-		if (!strcasecmp(media->ext, p))
-			return (media->type);
+	if (data->offset < 3) {
+		kore_buf_free(data);
+		return;
 	}
 
-	return (NULL);
+	data->offset -= 2;
+	string = kore_buf_stringify(data, NULL);
+	http_argument_add(req, name, string, 0, 0);
+	kore_buf_free(data);
 }
 
-char *
-http_validate_header(char *header)
+static void
+multipart_file_add(struct http_request *req, struct kore_buf *in,
+    const char *name, const char *fname, const char *boundary, const int blen)
 {
-	u_int8_t	idx;
-	char		*p, *value;
-
-	for (p = header; *p != '\0'; p++) {
-		idx = *p;
-		if (idx > HTTP_MAP_LIMIT)
-			return (NULL);
-
-		if (*p == ':') {
-			*(p)++ = '\0';
-			break;
-		}
-
-		if (http_token[idx] == 0x00)
-			return (NULL);
-	}
+	struct http_file	*f;
+	size_t			position, len;
 
-	while (isspace(*(unsigned char *)p))
-		p++;
+	position = req->http_body_offset - in->offset;
+	if (!multipart_find_data(in, NULL, &len, req, boundary, blen))
+		return;
 
-	if (*p == '\0')
-		return (NULL);
+	if (len < 3)
+		return;
+	len -= 2;
 
-	value = p;
-	while (*p != '\0') {
-		idx = *p;
-		if (idx > HTTP_MAP_LIMIT)
-			return (NULL);
-		if (http_field_content[idx] == 0x00)
-			return (NULL);
-		p++;
-	}
+	f = http_request_alloc(req, sizeof(struct http_file));
+	f->req = req;
+	f->offset = 0;
+	f->length = len;
+	f->position = position;
+	f->fd = -1;
+	f->path = NULL;
+	f->name = http_request_strdup(req, name);
+	f->filename = http_request_strdup(req, fname);
 
-	return (value);
+	TAILQ_INSERT_TAIL(&(req->files), f, list);
 }
 
-static int
-http_release_buffer(struct netbuf *nb)
+void
+http_argument_add(struct http_request *req, char *name, char *value, int qs,
+    int decode)
 {
-	kore_buf_free(nb->extra);
+	/* Keep arguments in the order their sources were populated. */
+	if (req->args_npending > 0)
+		http_arguments_parse(req);
 
-	return (KORE_RESULT_OK);
+	http_argument_insert(req, name, value, qs, decode, 1);
 }
 
-static int
-http_check_redirect(struct http_request *req, struct kore_domain *dom)
+static void
+http_arguments_parse(struct http_request *req)
 {
-	int			idx;
-	struct http_redirect	*rdr;
-	const char		*uri;
-	char			key[4];
-	struct kore_buf		location;
-
-	TAILQ_FOREACH(rdr, &dom->redirects, list) {
-		if (!regexec(&(rdr->rctx), req->path,
-		    HTTP_CAPTURE_GROUPS, req->cgroups, 0))
+	u_int8_t	idx, npending;
+	char		*query;
+
+	npending = req->args_npending;
+	req->args_npending = 0;
+
+	for (idx = 0; idx < npending; idx++) {
+		switch (req->args_pending[idx]) {
+		case HTTP_ARGS_PENDING_QS:
+			/* The query string itself is still used after this. */
+			query = http_request_strdup(req, req->query_string);
+			http_arguments_split(req, query, 1);
+			break;
+		case HTTP_ARGS_PENDING_POST:
+			http_arguments_split(req, req->args_post, 0);
+			req->args_post = NULL;
 			break;
-	}
-
-	if (rdr == NULL)
-		return (KORE_RESULT_ERROR);
-
-	uri = NULL;
-	kore_buf_init(&location, 128);
-
-	if (rdr->target) {
-		kore_buf_appendf(&location, "%s", rdr->target);
-
-		if (req->query_string != NULL) {
-			kore_buf_replace_string(&location, "$qs",
-			    req->query_string, strlen(req->query_string));
 		}
+	}
+}
 
-		/* Starts at 1 to skip the full path. */
-		for (idx = 1; idx < HTTP_CAPTURE_GROUPS - 1; idx++) {
-			if (req->cgroups[idx].rm_so == -1 ||
-			    req->cgroups[idx].rm_eo == -1)
-				break;
-
-			(void)snprintf(key, sizeof(key), "$%d", idx);
-
-			kore_buf_replace_string(&location, key,
-			    req->path + req->cgroups[idx].rm_so,
-			    req->cgroups[idx].rm_eo - req->cgroups[idx].rm_so);
-		}
+static int
+http_arguments_pending(struct http_request *req, u_int8_t source)
+{
+	u_int8_t	idx;
 
-		uri = kore_buf_stringify(&location, NULL);
+	for (idx = 0; idx < req->args_npending; idx++) {
+		if (req->args_pending[idx] == source)
+			return (1);
 	}
 
-	if (uri)
-		http_response_header(req, "location", uri);
-
-	http_response(req, rdr->status, NULL, 0);
-	kore_buf_cleanup(&location);
+	return (0);
+}
 
-	if (dom->accesslog)
-		kore_accesslog(req);
+/* Split and decode the arguments in string in place. */
+static void
+http_arguments_split(struct http_request *req, char *string, int qs)
+{
+	int		i, v;
+	char		*args[HTTP_MAX_QUERY_ARGS], *val[3];
 
-	return (KORE_RESULT_OK);
+	v = kore_split_string(string, "&", args, HTTP_MAX_QUERY_ARGS);
+	for (i = 0; i < v; i++) {
+		kore_split_string(args[i], "=", val, 3);
+		if (val[0] != NULL && val[1] != NULL)
+			http_argument_insert(req, val[0], val[1], qs, 1, 0);
+	}
 }
 
-static struct http_request *
-http_request_new(struct connection *c, const char *host,
-    const char *method, char *path, const char *version)
+/*
+ * Add an argument if the route has a parameter for it that validates.
+ * Unless copy is set name and value are used as is and must remain valid
+ * for the lifetime of the request.
+ */
+static void
+http_argument_insert(struct http_request *req, char *name, char *value,
+    int qs, int decode, int copy)
 {
-	struct kore_domain		*dom;
-	struct http_request		*req;
-	size_t				qsoff;
-	char				*p, *hp;
-	int				m, flags, exists;
+	struct http_arg			*q;
+	struct kore_route_params	*p;
 
-	if (http_request_count >= http_request_limit) {
-		http_error_response(c, HTTP_STATUS_SERVICE_UNAVAILABLE);
-		return (NULL);
+	if (decode) {
+		if (!http_argument_urldecode(name))
+			return;
 	}
 
-	kore_debug("http_request_new(%p, %s, %s, %s, %s)", c, host,
-	    method, path, version);
+	TAILQ_FOREACH(p, &req->rt->params, list) {
+		if (qs == 1 && !(p->flags & KORE_PARAMS_QUERY_STRING))
+			continue;
+		if (qs == 0 && (p->flags & KORE_PARAMS_QUERY_STRING))
+			continue;
 
-	if (strlen(host) >= KORE_DOMAINNAME_LEN - 1) {
-		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-		return (NULL);
-	}
+		if (p->method != req->method)
+			continue;
 
-	if (strlen(path) >= HTTP_URI_LEN - 1) {
-		http_error_response(c, HTTP_STATUS_REQUEST_URI_TOO_LARGE);
-		return (NULL);
-	}
+		if (strcmp(p->name, name))
+			continue;
 
-	if (strcasecmp(version, "http/1.1")) {
-		if (strcasecmp(version, "http/1.0")) {
-			http_error_response(c, HTTP_STATUS_BAD_VERSION);
-			return (NULL);
+		if (decode) {
+			if (!http_argument_urldecode(value))
+				return;
 		}
 
-		flags = HTTP_VERSION_1_0;
-	} else {
-		flags = HTTP_VERSION_1_1;
-	}
-
-	if ((p = strchr(path, '?')) != NULL) {
-		qsoff = p - path;
-	} else {
-		qsoff = 0;
-	}
-
-	hp = NULL;
+		if (!kore_validator_check(req, p->validator, value))
+			break;
 
-	switch (c->family) {
-	case AF_INET6:
-		if (*host == '[') {
-			if ((hp = strrchr(host, ']')) == NULL) {
-				http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-				return (NULL);
-			}
-			hp++;
-			if (*hp == ':')
-				*hp = '\0';
-			else
-				hp = NULL;
+		q = http_request_alloc(req, sizeof(struct http_arg));
+		if (copy) {
+			q->name = http_request_strdup(req, name);
+			q->s_value = http_request_strdup(req, value);
+		} else {
+			q->name = name;
+			q->s_value = value;
 		}
-		break;
-	default:
-		if ((hp = strrchr(host, ':')) != NULL)
-			*hp = '\0';
+		q->conv_type = -1;
+		q->conv_result = KORE_RESULT_ERROR;
+		TAILQ_INSERT_TAIL(&(req->arguments), q, list);
 		break;
 	}
+}
 
-	if (c->owner->server->tls && c->tls_sni != NULL) {
-		if (strcasecmp(c->tls_sni, host)) {
-			http_error_response(c, HTTP_STATUS_MISDIRECTED_REQUEST);
-			return (NULL);
-		}
-	}
+static int
+http_body_recv(struct netbuf *nb)
+{
+	struct http_request	*req = (struct http_request *)nb->extra;
 
-	if ((dom = kore_domain_lookup(c->owner->server, host)) == NULL) {
-		http_error_response(c, HTTP_STATUS_NOT_FOUND);
-		return (NULL);
-	}
+	if (req->flags & HTTP_REQUEST_CHUNKED_BODY)
+		return (http_body_chunked_update(req, nb->buf, nb->s_off));
 
-	if (dom->cafile != NULL && c->tls_cert == NULL) {
-		http_error_response(c, HTTP_STATUS_FORBIDDEN);
-		return (NULL);
-	}
+	return (http_body_update(req, nb->buf, nb->s_off));
+}
 
-	if (hp != NULL)
-		*hp = ':';
+/*
+ * Prepare a request for receiving a body of req->content_length bytes.
+ * An error response has already been sent if this fails.
+ */
+int
+http_body_setup(struct http_request *req)
+{
+	if (req->content_length == 0) {
+		req->flags |= HTTP_REQUEST_COMPLETE;
+		req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
+		return (KORE_RESULT_OK);
+	}
 
-	if (!strcasecmp(method, "get")) {
-		m = HTTP_METHOD_GET;
-		flags |= HTTP_REQUEST_COMPLETE;
-	} else if (!strcasecmp(method, "delete")) {
-		m = HTTP_METHOD_DELETE;
-		flags |= HTTP_REQUEST_EXPECT_BODY;
-	} else if (!strcasecmp(method, "post")) {
-		m = HTTP_METHOD_POST;
-		flags |= HTTP_REQUEST_EXPECT_BODY;
-	} else if (!strcasecmp(method, "put")) {
-		m = HTTP_METHOD_PUT;
-		flags |= HTTP_REQUEST_EXPECT_BODY;
-	} else if (!strcasecmp(method, "head")) {
-		m = HTTP_METHOD_HEAD;
-		flags |= HTTP_REQUEST_COMPLETE;
-	} else if (!strcasecmp(method, "options")) {
-		m = HTTP_METHOD_OPTIONS;
-		flags |= HTTP_REQUEST_COMPLETE;
-	} else if (!strcasecmp(method, "patch")) {
-		m = HTTP_METHOD_PATCH;
-		flags |= HTTP_REQUEST_EXPECT_BODY;
-	} else {
-		http_error_response(c, HTTP_STATUS_BAD_REQUEST);
-		return (NULL);
+	if (req->content_length > http_body_max) {
+		req->flags |= HTTP_REQUEST_DELETE;
+		http_error_response(req->owner,
+		    HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE);
+		return (KORE_RESULT_ERROR);
 	}
 
-	if (flags & HTTP_VERSION_1_0) {
-		if (m != HTTP_METHOD_GET && m != HTTP_METHOD_POST &&
-		    m != HTTP_METHOD_HEAD) {
-			http_error_response(c, HTTP_STATUS_METHOD_NOT_ALLOWED);
-			return (NULL);
+	/*
+	 * Routes that stream multipart bodies parse them as they arrive,
+	 * nothing of the body itself is kept.
+	 */
+	if (req->rt != NULL && req->rt->multipart) {
+		req->multipart = http_multipart_create(req, NULL, NULL);
+		if (req->multipart != NULL) {
+			req->http_body_fd = -1;
+			req->http_body = NULL;
+			if (req->rt->digest)
+				req->hashctx = http_body_hash_new();
+			return (KORE_RESULT_OK);
 		}
 	}
 
-	req = kore_pool_get(&http_request_pool);
-
-	req->end = 0;
-	req->total = 0;
-	req->start = 0;
-	req->owner = c;
-	req->status = 0;
-	req->method = m;
-	req->agent = NULL;
-	req->referer = NULL;
-	req->runlock = NULL;
-	req->flags = flags;
-	req->fsm_state = 0;
-	req->http_body = NULL;
-	req->http_body_fd = -1;
-	req->hdlr_extra = NULL;
-	req->content_length = 0;
-	req->query_string = NULL;
-	req->http_body_length = 0;
-	req->http_body_offset = 0;
-	req->http_body_path = NULL;
-
-	req->host = host;
-	req->path = path;
-
-#if defined(KORE_USE_PYTHON)
-	req->py_req = NULL;
-	req->py_coro = NULL;
-	req->py_rqnext = NULL;
-	req->py_validator = NULL;
-#endif
+	req->http_body_length = req->content_length;
 
-	if (qsoff > 0) {
-		req->query_string = path + qsoff;
-		*(req->query_string)++ = '\0';
+	if (http_body_disk_offload > 0 &&
+	    req->content_length > http_body_disk_offload) {
+		req->http_body = NULL;
+		if (!http_body_disk_open(req)) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(req->owner,
+			    HTTP_STATUS_INTERNAL_ERROR);
+			return (KORE_RESULT_ERROR);
+		}
 	} else {
-		req->query_string = NULL;
+		req->http_body_fd = -1;
+		req->http_body = kore_buf_alloc(req->content_length);
 	}
 
-	/* Checked further down below if we need to 404. */
-	exists = kore_route_lookup(req, dom, m, &req->rt);
+	if (req->rt != NULL && req->rt->digest)
+		req->hashctx = http_body_hash_new();
 
-	TAILQ_INIT(&(req->resp_headers));
-	TAILQ_INIT(&(req->req_headers));
-	TAILQ_INIT(&(req->resp_cookies));
-	TAILQ_INIT(&(req->req_cookies));
-	TAILQ_INIT(&(req->arguments));
-	TAILQ_INIT(&(req->files));
+	return (KORE_RESULT_OK);
+}
 
-#if defined(KORE_USE_TASKS)
-	LIST_INIT(&(req->tasks));
-#endif
+/*
+ * SHA256 for body digests, through EVP when built against OpenSSL so it
+ * gets the SHA extensions of the CPU where there are any.
+ */
+static void *
+http_body_hash_new(void)
+{
+#if defined(TLS_BACKEND_OPENSSL)
+	EVP_MD_CTX	*ctx;
 
-#if defined(KORE_USE_PGSQL)
-	LIST_INIT(&(req->pgsqls));
+	if ((ctx = EVP_MD_CTX_new()) == NULL)
+		fatal("EVP_MD_CTX_new: failed");
+
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+		fatal("EVP_DigestInit_ex: failed");
+#else
+	SHA2_CTX	*ctx;
+
+	ctx = kore_malloc(sizeof(*ctx));
+	SHA256Init(ctx);
 #endif
 
-	http_request_count++;
-	TAILQ_INSERT_HEAD(&http_requests, req, list);
-	TAILQ_INSERT_TAIL(&(c->http_requests), req, olist);
+	return (ctx);
+}
 
-	if (http_check_redirect(req, dom)) {
-		http_request_free(req);
-		return (NULL);
-	}
+static void
+http_body_hash_update(void *ctx, const void *data, size_t len)
+{
+#if defined(TLS_BACKEND_OPENSSL)
+	if (!EVP_DigestUpdate(ctx, data, len))
+		fatal("EVP_DigestUpdate: failed");
+#else
+	SHA256Update(ctx, data, len);
+#endif
+}
 
-	if (exists == 0) {
-		http_request_free(req);
-		http_error_response(c, HTTP_STATUS_NOT_FOUND);
-		return (NULL);
-	}
+static void
+http_body_hash_final(void *ctx, u_int8_t *out)
+{
+#if defined(TLS_BACKEND_OPENSSL)
+	if (!EVP_DigestFinal_ex(ctx, out, NULL))
+		fatal("EVP_DigestFinal_ex: failed");
+#else
+	SHA256Final(out, ctx);
+#endif
 
-	if (req->rt == NULL) {
-		http_request_free(req);
-		http_error_response(c, HTTP_STATUS_METHOD_NOT_ALLOWED);
-		return (NULL);
-	}
+	http_body_hash_free(ctx);
+}
 
-	return (req);
+static void
+http_body_hash_free(void *ctx)
+{
+#if defined(TLS_BACKEND_OPENSSL)
+	EVP_MD_CTX_free(ctx);
+#else
+	kore_free(ctx);
+#endif
 }
 
+/* Hash a body that was received without digesting it. */
 static int
-multipart_find_data(struct kore_buf *in, struct kore_buf *out,
-    size_t *olen, struct http_request *req, const void *needle, size_t len)
+http_body_hash_stored(struct http_request *req)
 {
-	ssize_t			ret;
-	size_t			left;
-	u_int8_t		*p, first, data[4096];
+	void		*ctx;
+	ssize_t		ret;
+	off_t		off;
+	size_t		total;
+	u_int8_t	buf[16384];
 
-	if (olen != NULL)
-		*olen = 0;
+	/* A streamed multipart body is gone by now. */
+	if (req->multipart != NULL)
+		return (KORE_RESULT_ERROR);
 
-	first = *(const u_int8_t *)needle;
-	for (;;) {
-		if (in->offset < len) {
-			ret = http_body_read(req, data, sizeof(data));
-			if (ret == -1)
-				return (KORE_RESULT_ERROR);
-			if (ret == 0)
-				return (KORE_RESULT_ERROR);
+	ctx = http_body_hash_new();
+	total = req->http_body_offset + req->http_body_length;
 
-			kore_buf_append(in, data, ret);
-			continue;
+	if (req->http_body_fd != -1) {
+		off = 0;
+		while ((size_t)off < total) {
+			ret = pread(req->http_body_fd, buf,
+			    MIN(sizeof(buf), total - off), off);
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (ret == -1 || ret == 0) {
+				kore_log(LOG_ERR, "failed to read %s: %s",
+				    req->http_body_path,
+				    ret == 0 ? "short read" : errno_s);
+				http_body_hash_free(ctx);
+				return (KORE_RESULT_ERROR);
+			}
+			http_body_hash_update(ctx, buf, ret);
+			off += ret;
 		}
+	} else if (req->http_body != NULL) {
+		http_body_hash_update(ctx, req->http_body->data, total);
+	}
 
-		p = kore_mem_find(in->data, in->offset, &first, 1);
-		if (p == NULL) {
-			if (out != NULL)
-				kore_buf_append(out, in->data, in->offset);
-			if (olen != NULL)
-				*olen += in->offset;
-			kore_buf_reset(in);
-			continue;
-		}
+	http_body_hash_final(ctx, req->http_body_digest);
+	req->flags |= HTTP_REQUEST_BODY_DIGEST;
 
-		left = in->offset - (p - in->data);
-		if (left < len) {
-			if (out != NULL)
-				kore_buf_append(out, in->data, (p - in->data));
-			if (olen != NULL)
-				*olen += (p - in->data);
-			memmove(in->data, p, left);
-			in->offset = left;
-			continue;
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Opens the file an offloaded body is received into. Where possible this
+ * is an O_TMPFILE that never shows up in http_body_disk_path, it is given
+ * its full size up front so the writes do not have to allocate blocks.
+ */
+static int
+http_body_disk_open(struct http_request *req)
+{
+	int		l;
+	size_t		size;
+
+	req->http_body_path = kore_pool_get(&http_body_path);
+
+#if defined(O_TMPFILE)
+	if (http_body_disk_tmpfile) {
+		req->http_body_fd = open(http_body_disk_path,
+		    O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		if (req->http_body_fd != -1) {
+			req->flags |= HTTP_REQUEST_BODY_TMPFILE;
+			(void)kore_strlcpy(req->http_body_path,
+			    http_body_disk_path, HTTP_BODY_PATH_MAX);
+		} else if (errno != EOPNOTSUPP && errno != EISDIR) {
+			kore_log(LOG_ERR, "open(%s, O_TMPFILE): %s",
+			    http_body_disk_path, errno_s);
+			return (KORE_RESULT_ERROR);
 		}
+	}
+#endif
 
-		if (!memcmp(p, needle, len)) {
-			if (out != NULL)
-				kore_buf_append(out, in->data, p - in->data);
-			if (olen != NULL)
-				*olen += (p - in->data);
+	if (req->http_body_fd == -1) {
+		l = snprintf(req->http_body_path, HTTP_BODY_PATH_MAX,
+		    "%s/http_body.XXXXXX", http_body_disk_path);
+		if (l == -1 || (size_t)l >= HTTP_BODY_PATH_MAX)
+			return (KORE_RESULT_ERROR);
 
-			in->offset = left - len;
-			if (in->offset > 0)
-				memmove(in->data, p + len, in->offset);
-			return (KORE_RESULT_OK);
-		}
+		if ((req->http_body_fd = mkstemp(req->http_body_path)) == -1)
+			return (KORE_RESULT_ERROR);
+	}
 
-		if (out != NULL)
-			kore_buf_append(out, in->data, (p - in->data) + 1);
-		if (olen != NULL)
-			*olen += (p - in->data) + 1;
+#if defined(__linux__)
+	/*
+	 * Only running out of space is worth refusing the body for, there
+	 * is no length to reserve up front for a chunked body.
+	 */
+	if (!(req->flags & HTTP_REQUEST_CHUNKED_BODY) &&
+	    fallocate(req->http_body_fd, 0, 0, req->content_length) == -1 &&
+	    errno == ENOSPC) {
+		kore_log(LOG_NOTICE, "no space left for %" PRIu64
+		    " byte body in %s", req->content_length,
+		    http_body_disk_path);
+		return (KORE_RESULT_ERROR);
+	}
+#endif
 
-		in->offset = left - 1;
-		if (in->offset > 0)
-			memmove(in->data, p + 1, in->offset);
+	if (http_body_disk_buffer > 0) {
+		size = http_body_disk_buffer;
+		if (!(req->flags & HTTP_REQUEST_CHUNKED_BODY))
+			size = MIN(size, req->content_length);
+		req->http_body_pending = kore_buf_alloc(size);
 	}
 
-	return (KORE_RESULT_ERROR);
+	return (KORE_RESULT_OK);
 }
 
+/*
+ * Collects the body in http_body_pending so it goes out to disk in large
+ * writes instead of one per received chunk.
+ */
 static int
-multipart_parse_headers(struct http_request *req, struct kore_buf *in,
-    struct kore_buf *hbuf, const char *boundary, const int blen)
+http_body_disk_write(struct http_request *req, const void *data, size_t len,
+    int last)
 {
-	int		h, c, i;
-	char		*headers[5], *args[5], *opt[5];
-	char		*d, *val, *name, *fname, *string;
+	struct kore_buf		*buf;
 
-	string = kore_buf_stringify(hbuf, NULL);
-	h = kore_split_string(string, "\r\n", headers, 5);
-	for (i = 0; i < h; i++) {
-		c = kore_split_string(headers[i], ":", args, 5);
-		if (c != 2)
-			continue;
+	if ((buf = req->http_body_pending) == NULL)
+		return (http_body_disk_flush(req, data, len));
 
-		/* Ignore other headers for now. */
-		if (strcasecmp(args[0], "content-disposition"))
-			continue;
+	if (buf->offset + len > http_body_disk_buffer) {
+		if (!http_body_disk_flush(req, buf->data, buf->offset))
+			return (KORE_RESULT_ERROR);
+		kore_buf_reset(buf);
 
-		for (d = args[1]; isspace(*(unsigned char *)d); d++)
-			;
+		if (len >= http_body_disk_buffer)
+			return (http_body_disk_flush(req, data, len));
+	}
 
-		c = kore_split_string(d, ";", opt, 5);
-		if (c < 2)
-			continue;
+	kore_buf_append(buf, data, len);
 
-		if (strcasecmp(opt[0], "form-data"))
-			continue;
+	if (last) {
+		if (!http_body_disk_flush(req, buf->data, buf->offset))
+			return (KORE_RESULT_ERROR);
+		kore_buf_free(buf);
+		req->http_body_pending = NULL;
+	}
 
-		if ((val = strchr(opt[1], '=')) == NULL)
-			continue;
-		if (strlen(val) < 3)
-			continue;
+	return (KORE_RESULT_OK);
+}
 
-		val++;
-		kore_strip_chars(val, '"', &name);
+static int
+http_body_disk_flush(struct http_request *req, const void *data, size_t len)
+{
+	ssize_t			ret;
+	const u_int8_t		*p;
 
-		if (opt[2] == NULL) {
-			multipart_add_field(req, in, name, boundary, blen);
-			kore_free(name);
-			continue;
+	p = data;
+
+	while (len > 0) {
+		if ((ret = write(req->http_body_fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			kore_log(LOG_ERR, "write(%s): %s",
+			    req->http_body_path, errno_s);
+			return (KORE_RESULT_ERROR);
 		}
 
-		for (d = opt[2]; isspace(*(unsigned char *)d); d++)
-			;
+		p += ret;
+		len -= ret;
+	}
 
-		if (!strncasecmp(d, "filename=", 9)) {
-			if ((val = strchr(d, '=')) == NULL) {
-				kore_free(name);
-				continue;
-			}
+	return (KORE_RESULT_OK);
+}
 
-			val++;
-			kore_strip_chars(val, '"', &fname);
-			if (strlen(fname) > 0) {
-				multipart_file_add(req,
-				    in, name, fname, boundary, blen);
-			}
-			kore_free(fname);
-		} else {
-			kore_debug("got unknown: %s", opt[2]);
+int
+http_body_update(struct http_request *req, const void *data, size_t len)
+{
+	u_int64_t		bytes_left;
+
+	if (!http_body_store(req, data, len, req->content_length == len))
+		return (KORE_RESULT_ERROR);
+
+	req->content_length -= len;
+
+	if (req->content_length == 0) {
+		if (!http_body_complete(req))
+			return (KORE_RESULT_ERROR);
+	} else {
+		http_request_receiving(req);
+		if (req->owner->proto == CONN_PROTO_HTTP) {
+			bytes_left = req->content_length;
+			net_recv_reset(req->owner,
+			    MIN(bytes_left, NETBUF_SEND_PAYLOAD_MAX),
+			    http_body_recv);
+			req->owner->rnb->extra = req;
 		}
+	}
 
-		kore_free(name);
+	if (req->rt->on_body_chunk != NULL && len > 0) {
+		kore_runtime_http_body_chunk(req->rt->on_body_chunk,
+		    req, data, len);
 	}
 
 	return (KORE_RESULT_OK);
 }
 
-static void
-multipart_add_field(struct http_request *req, struct kore_buf *in,
-    char *name, const char *boundary, const int blen)
+/*
+ * Hand a piece of the body to wherever this request keeps it, last is set
+ * for the final piece. An error response has been sent if this fails.
+ */
+static int
+http_body_store(struct http_request *req, const void *data, size_t len,
+    int last)
 {
-	struct kore_buf		*data;
-	char			*string;
+	if (req->hashctx != NULL && len > 0)
+		http_body_hash_update(req->hashctx, data, len);
 
-	data = kore_buf_alloc(128);
-
-	if (!multipart_find_data(in, data, NULL, req, boundary, blen)) {
-		kore_buf_free(data);
-		return;
+	if (req->multipart != NULL) {
+		if (!http_multipart_feed(req->multipart, data, len) ||
+		    (last && !http_multipart_done(req->multipart))) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(req->owner,
+			    HTTP_STATUS_BAD_REQUEST);
+			return (KORE_RESULT_ERROR);
+		}
+	} else if (req->http_body_fd != -1) {
+		if (!http_body_disk_write(req, data, len, last)) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(req->owner,
+			    HTTP_STATUS_INTERNAL_ERROR);
+			return (KORE_RESULT_ERROR);
+		}
+	} else if (req->http_body != NULL) {
+		kore_buf_append(req->http_body, data, len);
+	} else {
+		req->flags |= HTTP_REQUEST_DELETE;
+		http_error_response(req->owner,
+		    HTTP_STATUS_INTERNAL_ERROR);
+		return (KORE_RESULT_ERROR);
 	}
 
-	if (data->offset < 3) {
-		kore_buf_free(data);
-		return;
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_body_complete(struct http_request *req)
+{
+	if (req->owner->proto == CONN_PROTO_HTTP)
+		req->owner->rnb->extra = NULL;
+	if (req->t_created != 0)
+		req->t_body = kore_time_us() - req->t_created;
+	http_overload_ready(req);
+	http_request_wakeup(req);
+	req->flags |= HTTP_REQUEST_COMPLETE;
+	req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
+	req->content_length = req->http_body_length;
+	if (!http_body_rewind(req)) {
+		req->flags |= HTTP_REQUEST_DELETE;
+		http_error_response(req->owner,
+		    HTTP_STATUS_INTERNAL_ERROR);
+		return (KORE_RESULT_ERROR);
+	}
+	if (req->hashctx != NULL) {
+		http_body_hash_final(req->hashctx,
+		    req->http_body_digest);
+		req->hashctx = NULL;
+		req->flags |= HTTP_REQUEST_BODY_DIGEST;
 	}
 
-	data->offset -= 2;
-	string = kore_buf_stringify(data, NULL);
-	http_argument_add(req, name, string, 0, 0);
-	kore_buf_free(data);
+	return (KORE_RESULT_OK);
 }
 
-static void
-multipart_file_add(struct http_request *req, struct kore_buf *in,
-    const char *name, const char *fname, const char *boundary, const int blen)
+/*
+ * Prepare a request for a body sent with chunked transfer-encoding and
+ * decode whatever of it came in with the headers. Its length is unknown
+ * until the last chunk so it starts out in memory and moves to disk once
+ * it grows past http_body_disk_offload. An error response has been sent
+ * if this fails.
+ */
+static int
+http_body_chunked_setup(struct http_request *req, const u_int8_t *data,
+    size_t len)
 {
-	struct http_file	*f;
-	size_t			position, len;
+	req->chunked = http_request_alloc(req, sizeof(*req->chunked));
+	req->chunked->state = HTTP_CHUNKED_SIZE;
+	req->chunked->left = 0;
+	req->chunked->llen = 0;
+	req->chunked->trailer = 0;
 
-	position = req->http_body_offset - in->offset;
-	if (!multipart_find_data(in, NULL, &len, req, boundary, blen))
-		return;
+	req->flags |= HTTP_REQUEST_CHUNKED_BODY;
+	req->content_length = 0;
+	req->http_body_length = 0;
+	req->http_body_fd = -1;
+	req->http_body = NULL;
 
-	if (len < 3)
-		return;
-	len -= 2;
+	if (req->rt != NULL && req->rt->multipart)
+		req->multipart = http_multipart_create(req, NULL, NULL);
 
-	f = kore_malloc(sizeof(struct http_file));
-	f->req = req;
-	f->offset = 0;
-	f->length = len;
-	f->position = position;
-	f->name = kore_strdup(name);
-	f->filename = kore_strdup(fname);
+	if (req->multipart == NULL)
+		req->http_body = kore_buf_alloc(HTTP_CHUNKED_BODY_INIT);
 
-	TAILQ_INSERT_TAIL(&(req->files), f, list);
+	if (req->rt != NULL && req->rt->digest)
+		req->hashctx = http_body_hash_new();
+
+	req->owner->http_timeout = http_body_timeout * 1000;
+	kore_connection_timeout_update(req->owner);
+
+	return (http_body_chunked_update(req, data, len));
 }
 
-static void
-http_argument_add(struct http_request *req, char *name, char *value, int qs,
-    int decode)
+/*
+ * Decode as much of a chunked body as data holds, storing each chunk as
+ * it comes in. Anything beyond the end of the body is handed back to the
+ * connection for the next request. An error response has been sent if
+ * this fails.
+ */
+static int
+http_body_chunked_update(struct http_request *req, const u_int8_t *data,
+    size_t len)
 {
-	struct http_arg			*q;
-	struct kore_route_params	*p;
+	struct kore_buf		*buf;
+	u_int64_t		size;
+	size_t			used;
+	char			*p, *ep;
+	struct http_chunked	*ck = req->chunked;
 
-	if (decode) {
-		if (!http_argument_urldecode(name))
-			return;
-	}
+	while (len > 0 && ck->state != HTTP_CHUNKED_DONE) {
+		if (ck->state == HTTP_CHUNKED_DATA) {
+			used = MIN(len, ck->left);
 
-	TAILQ_FOREACH(p, &req->rt->params, list) {
-		if (qs == 1 && !(p->flags & KORE_PARAMS_QUERY_STRING))
-			continue;
-		if (qs == 0 && (p->flags & KORE_PARAMS_QUERY_STRING))
-			continue;
+			if (req->http_body_length + used > http_body_max) {
+				req->flags |= HTTP_REQUEST_DELETE;
+				http_error_response(req->owner,
+				    HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE);
+				return (KORE_RESULT_ERROR);
+			}
 
-		if (p->method != req->method)
+			if (req->http_body != NULL &&
+			    http_body_disk_offload > 0 &&
+			    req->http_body_length + used >
+			    http_body_disk_offload) {
+				buf = req->http_body;
+				req->http_body = NULL;
+				if (!http_body_disk_open(req) ||
+				    !http_body_disk_write(req, buf->data,
+				    buf->offset, 0)) {
+					kore_buf_free(buf);
+					req->flags |= HTTP_REQUEST_DELETE;
+					http_error_response(req->owner,
+					    HTTP_STATUS_INTERNAL_ERROR);
+					return (KORE_RESULT_ERROR);
+				}
+				kore_buf_free(buf);
+			}
+
+			if (!http_body_store(req, data, used, 0))
+				return (KORE_RESULT_ERROR);
+
+			req->http_body_length += used;
+
+			if (req->rt->on_body_chunk != NULL) {
+				kore_runtime_http_body_chunk(
+				    req->rt->on_body_chunk, req, data, used);
+			}
+
+			data += used;
+			len -= used;
+			ck->left -= used;
+
+			if (ck->left == 0)
+				ck->state = HTTP_CHUNKED_DATA_END;
 			continue;
+		}
 
-		if (strcmp(p->name, name))
+		/* Everything else is a line, collect it up to its LF. */
+		if (*data != '\n') {
+			if (ck->llen == sizeof(ck->line) - 1)
+				goto bad;
+			ck->line[ck->llen++] = *data;
+			data++;
+			len--;
 			continue;
+		}
 
-		if (decode) {
-			if (!http_argument_urldecode(value))
-				return;
+		data++;
+		len--;
+
+		if (ck->llen > 0 && ck->line[ck->llen - 1] == '\r')
+			ck->llen--;
+		ck->line[ck->llen] = '\0';
+
+		switch (ck->state) {
+		case HTTP_CHUNKED_SIZE:
+			/* Chunk extensions are allowed but ignored. */
+			if ((p = strchr(ck->line, ';')) != NULL)
+				*p = '\0';
+			p = ck->line;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			if (!isxdigit((unsigned char)*p))
+				goto bad;
+			errno = 0;
+			size = strtoull(p, &ep, 16);
+			if (errno == ERANGE)
+				goto toolarge;
+			while (*ep == ' ' || *ep == '\t')
+				ep++;
+			if (*ep != '\0')
+				goto bad;
+			if (size > http_body_max)
+				goto toolarge;
+			ck->left = size;
+			if (size == 0)
+				ck->state = HTTP_CHUNKED_TRAILER;
+			else
+				ck->state = HTTP_CHUNKED_DATA;
+			break;
+		case HTTP_CHUNKED_DATA_END:
+			if (ck->llen != 0)
+				goto bad;
+			ck->state = HTTP_CHUNKED_SIZE;
+			break;
+		case HTTP_CHUNKED_TRAILER:
+			/* Trailer fields are read and dropped. */
+			if (ck->llen == 0) {
+				ck->state = HTTP_CHUNKED_DONE;
+				break;
+			}
+			ck->trailer += ck->llen;
+			if (ck->trailer > http_header_max)
+				goto bad;
+			break;
+		default:
+			fatal("http_body_chunked_update: bad state %d",
+			    ck->state);
 		}
 
-		if (!kore_validator_check(req, p->validator, value))
-			break;
+		ck->llen = 0;
+	}
 
-		q = kore_malloc(sizeof(struct http_arg));
-		q->name = kore_strdup(name);
-		q->s_value = kore_strdup(value);
-		TAILQ_INSERT_TAIL(&(req->arguments), q, list);
-		break;
+	if (ck->state != HTTP_CHUNKED_DONE) {
+		http_request_receiving(req);
+		if (req->owner->proto == CONN_PROTO_HTTP) {
+			net_recv_reset(req->owner, NETBUF_SEND_PAYLOAD_MAX,
+			    http_body_recv);
+			req->owner->rnb->extra = req;
+		}
+		return (KORE_RESULT_OK);
 	}
-}
 
-static int
-http_body_recv(struct netbuf *nb)
-{
-	struct http_request	*req = (struct http_request *)nb->extra;
+	net_recv_pushback(req->owner, data, len);
 
-	return (http_body_update(req, nb->buf, nb->s_off));
+	/* Stop reading from this connection until the request is done. */
+	if (req->owner->rnb->buf != NULL)
+		req->owner->rnb->b_len = req->owner->rnb->s_off;
+
+	if (!http_body_store(req, NULL, 0, 1))
+		return (KORE_RESULT_ERROR);
+
+	return (http_body_complete(req));
+
+toolarge:
+	req->flags |= HTTP_REQUEST_DELETE;
+	http_error_response(req->owner, HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE);
+	return (KORE_RESULT_ERROR);
+
+bad:
+	req->flags |= HTTP_REQUEST_DELETE;
+	http_error_response(req->owner, HTTP_STATUS_BAD_REQUEST);
+	return (KORE_RESULT_ERROR);
 }
 
-static int
-http_body_update(struct http_request *req, const void *data, size_t len)
+/*
+ * Log a breakdown of where the time went for requests that took longer
+ * than http_slow_request_ms, for one in every http_slow_request_sample
+ * and at most http_slow_request_rate per second per worker.
+ */
+static void
+http_slow_request(struct http_request *req)
 {
-	ssize_t			ret;
-	u_int64_t		bytes_left;
+	u_int64_t	now, total;
 
-	SHA256Update(&req->hashctx, data, len);
+	now = kore_time_us();
+	total = now - req->t_created;
 
-	if (req->http_body_fd != -1) {
-		ret = write(req->http_body_fd, data, len);
-		if (ret == -1 || (size_t)ret != len) {
-			req->flags |= HTTP_REQUEST_DELETE;
-			http_error_response(req->owner,
-			    HTTP_STATUS_INTERNAL_ERROR);
-			return (KORE_RESULT_ERROR);
-		}
-	} else if (req->http_body != NULL) {
-		kore_buf_append(req->http_body, data, len);
-	} else {
-		req->flags |= HTTP_REQUEST_DELETE;
-		http_error_response(req->owner,
-		    HTTP_STATUS_INTERNAL_ERROR);
-		return (KORE_RESULT_ERROR);
-	}
+	if (total < (u_int64_t)http_slow_request_ms * 1000)
+		return;
 
-	req->content_length -= len;
+	http_slow_seen++;
+	if (http_slow_request_sample > 1 &&
+	    (http_slow_seen % http_slow_request_sample) != 0)
+		return;
 
-	if (req->content_length == 0) {
-		req->owner->rnb->extra = NULL;
-		http_request_wakeup(req);
-		req->flags |= HTTP_REQUEST_COMPLETE;
-		req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
-		req->content_length = req->http_body_length;
-		if (!http_body_rewind(req)) {
-			req->flags |= HTTP_REQUEST_DELETE;
-			http_error_response(req->owner,
-			    HTTP_STATUS_INTERNAL_ERROR);
-			return (KORE_RESULT_ERROR);
-		}
-		SHA256Final(req->http_body_digest, &req->hashctx);
-	} else {
-		bytes_left = req->content_length;
-		net_recv_reset(req->owner,
-		    MIN(bytes_left, NETBUF_SEND_PAYLOAD_MAX),
-		    http_body_recv);
-		req->owner->rnb->extra = req;
+	if (now / 1000000 != http_slow_second) {
+		http_slow_second = now / 1000000;
+		http_slow_logged = 0;
 	}
 
-	if (req->rt->on_body_chunk != NULL && len > 0) {
-		kore_runtime_http_body_chunk(req->rt->on_body_chunk,
-		    req, data, len);
+	if (http_slow_logged >= http_slow_request_rate) {
+		http_slow_dropped++;
+		return;
 	}
 
-	return (KORE_RESULT_OK);
+	http_slow_logged++;
+
+	kore_log(LOG_NOTICE, "slow request: method=%s path=%s route=%s "
+	    "status=%d total_us=%" PRIu64 " headers_us=%" PRIu64
+	    " body_us=%" PRIu64 " auth_us=%" PRIu64 " handler_us=%" PRIu64
+	    " sleep_us=%" PRIu64 " flush_us=%" PRIu64 " suppressed=%u",
+	    http_method_text(req->method), req->path, req->rt->path,
+	    req->status, total, req->t_hdrs, req->t_body, req->t_auth,
+	    req->t_handler, req->t_sleep, req->t_flush, http_slow_dropped);
+
+	http_slow_dropped = 0;
 }
 
 static void
 http_error_response(struct connection *c, int status)
 {
 	kore_debug("http_error_response(%p, %d)", c, status);
-	c->flags |= CONN_CLOSE_EMPTY;
 
 	switch (c->proto) {
 	case CONN_PROTO_HTTP:
+		c->flags |= CONN_CLOSE_EMPTY;
+		http_response_normal(NULL, c, status, NULL, 0);
+		break;
+	case CONN_PROTO_HTTP2:
 		http_response_normal(NULL, c, status, NULL, 0);
 		break;
 	default:
@@ -2421,163 +4607,351 @@ http_error_response(struct connection *c, int status)
 static void
 http_response_normal(struct http_request *req, struct connection *c,
     int status, const void *d, size_t len)
+{
+	http_response_write(req, c, status, NULL, 0, d, len);
+}
+
+/*
+ * Writes the response headers, including elen bytes of preformatted
+ * header lines from extra. When extra is given the body is copied into
+ * the same send buffer as the headers.
+ */
+static void
+http_response_write(struct http_request *req, struct connection *c,
+    int status, const void *extra, size_t elen, const void *d, size_t len)
 {
 	struct kore_buf		buf;
+	struct netbuf		*nb;
 	struct http_cookie	*ck;
 	struct http_header	*hdr;
-	char			version;
+	struct http_template	*tpl;
+	char			*p;
 	const char		*conn, *text;
-	int			connection_close, send_body;
+	size_t			total, hlen, vlen, dlen, off;
+	int			variant, send_body, send_length;
 
 	send_body = 1;
-	text = http_status_text(status);
-
-	kore_buf_reset(header_buf);
-
-	if (req != NULL) {
-		if (req->flags & HTTP_VERSION_1_0)
-			version = '0';
-		else
-			version = '1';
-	} else {
-		version = '1';
-	}
+	variant = 0;
 
-	kore_buf_appendf(header_buf, "HTTP/1.%c %d %s\r\n",
-	    version, status, text);
+	if (req != NULL && (req->flags & HTTP_VERSION_1_0))
+		variant |= HTTP_TEMPLATE_VERSION_1_0;
 
 	if (status == 100) {
-		kore_buf_append(header_buf, "\r\n", 2);
+		text = http_status_text(status);
+		kore_buf_reset(header_buf);
+		kore_buf_appendf(header_buf, "HTTP/1.%c %d %s\r\n\r\n",
+		    (variant & HTTP_TEMPLATE_VERSION_1_0) ? '0' : '1',
+		    status, text);
 		net_send_queue(c, header_buf->data, header_buf->offset);
 		return;
 	}
 
-	kore_buf_append(header_buf, http_version, http_version_len);
+	if (req != NULL && req->t_ttfb == 0 && req->t_created != 0)
+		req->t_ttfb = kore_time_us();
+
+	kore_buf_init(&buf, 1024);
+
+	if (http_pretty_error && d == NULL && status >= 400) {
+		text = http_status_text(status);
+		kore_buf_appendf(&buf, pretty_error_fmt,
+		    status, text, status, text);
+
+		d = buf.data;
+		len = buf.offset;
+	}
+
+	if (c->proto == CONN_PROTO_HTTP2) {
+		http2_response(c, req, status, d, len);
+		goto cleanup;
+	}
 
 	if ((c->flags & CONN_CLOSE_EMPTY) ||
-	    (req != NULL && (req->flags & HTTP_VERSION_1_0))) {
-		connection_close = 1;
-	} else {
-		connection_close = 0;
+	    (variant & HTTP_TEMPLATE_VERSION_1_0)) {
+		variant |= HTTP_TEMPLATE_CLOSE;
 	}
 
-	if (connection_close == 0 && req != NULL) {
+	if (!(variant & HTTP_TEMPLATE_CLOSE) && req != NULL) {
 		if (http_request_header(req, "connection", &conn)) {
 			if ((*conn == 'c' || *conn == 'C') &&
 			    !strcasecmp(conn, "close")) {
-				connection_close = 1;
+				variant |= HTTP_TEMPLATE_CLOSE;
 			}
 		}
 	}
 
-	kore_buf_init(&buf, 1024);
-
 	/* Note that req CAN be NULL. */
-	if (req == NULL || req->owner->proto != CONN_PROTO_WEBSOCKET) {
-		if (http_keepalive_time && connection_close == 0) {
-			kore_buf_appendf(header_buf,
-			    "connection: keep-alive\r\n");
-			kore_buf_appendf(header_buf,
-			    "keep-alive: timeout=%d\r\n", http_keepalive_time);
-		} else {
+	if (req == NULL || (req->owner->proto != CONN_PROTO_WEBSOCKET &&
+	    req->owner->proto != CONN_PROTO_SSE)) {
+		if (http_keepalive_time == 0 || (variant & HTTP_TEMPLATE_CLOSE)) {
+			variant |= HTTP_TEMPLATE_CLOSE;
 			c->flags |= CONN_CLOSE_EMPTY;
-			kore_buf_appendf(header_buf, "connection: close\r\n");
 		}
+	} else {
+		variant = (variant & HTTP_TEMPLATE_VERSION_1_0) |
+		    HTTP_TEMPLATE_NOCONN;
 	}
 
-	if (c->tls && http_hsts_enable) {
-		kore_buf_appendf(header_buf, "strict-transport-security: ");
-		kore_buf_appendf(header_buf,
-		    "max-age=%" PRIu64 "; includeSubDomains\r\n",
-		    http_hsts_enable);
+	if (c->tls && http_hsts_enable)
+		variant |= HTTP_TEMPLATE_HSTS;
+
+	send_length = 0;
+	if (status != 204 && status >= 200) {
+		if (req == NULL ||
+		    !(req->flags & HTTP_REQUEST_NO_CONTENT_LENGTH))
+			send_length = 1;
 	}
 
-	if (http_pretty_error && d == NULL && status >= 400) {
-		kore_buf_appendf(&buf, pretty_error_fmt,
-		    status, text, status, text);
+	tpl = http_template_get(status, variant);
+	total = tpl->len + 2;
 
-		d = buf.data;
-		len = buf.offset;
-	}
+	if (send_length)
+		total += sizeof("content-length: \r\n") + 20;
 
-	if (req != NULL) {
-		TAILQ_FOREACH(ck, &(req->resp_cookies), list)
-			http_write_response_cookie(ck);
+	if (kore_clock.wall == 0)
+		kore_clock_tick();
 
-		TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
-			kore_buf_appendf(header_buf, "%s: %s\r\n",
-			    hdr->header, hdr->value);
-		}
+	dlen = strlen(kore_clock.date);
 
-		if (status != 204 && status >= 200 &&
-		    !(req->flags & HTTP_REQUEST_NO_CONTENT_LENGTH)) {
-			kore_buf_appendf(header_buf,
-			    "content-length: %zu\r\n", len);
+	if (req != NULL) {
+		kore_buf_reset(ckhdr_buf);
+		TAILQ_FOREACH(ck, &(req->resp_cookies), list) {
+			off = ckhdr_buf->offset;
+			kore_buf_append(ckhdr_buf, "set-cookie: ", 12);
+			if (!http_write_response_cookie(ckhdr_buf, ck)) {
+				ckhdr_buf->offset = off;
+				continue;
+			}
+			kore_buf_append(ckhdr_buf, "\r\n", 2);
 		}
-	} else {
-		if (status != 204 && status >= 200) {
-			kore_buf_appendf(header_buf,
-			    "content-length: %zu\r\n", len);
+		total += ckhdr_buf->offset;
+
+		TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
+			total += strlen(hdr->header) + strlen(hdr->value) + 4;
+			if (dlen > 0 && !strcasecmp(hdr->header, "date"))
+				dlen = 0;
 		}
 	}
 
-	kore_buf_append(header_buf, "\r\n", 2);
-	net_send_queue(c, header_buf->data, header_buf->offset);
+	if (dlen > 0)
+		total += sizeof("date: \r\n") + dlen;
 
 	if (req != NULL && req->method == HTTP_METHOD_HEAD)
 		send_body = 0;
 
+	if (extra != NULL) {
+		total += elen;
+		if (d != NULL && send_body)
+			total += len;
+	}
+
+	/* The header block is written straight into the send netbuf. */
+	nb = net_send_reserve(c, total);
+	p = (char *)nb->buf + nb->b_len;
+
+	memcpy(p, tpl->data, tpl->len);
+	p += tpl->len;
+
+	if (dlen > 0) {
+		memcpy(p, "date: ", 6);
+		p += 6;
+		memcpy(p, kore_clock.date, dlen);
+		p += dlen;
+		*(p)++ = '\r';
+		*(p)++ = '\n';
+	}
+
+	if (req != NULL) {
+		memcpy(p, ckhdr_buf->data, ckhdr_buf->offset);
+		p += ckhdr_buf->offset;
+
+		TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
+			hlen = strlen(hdr->header);
+			vlen = strlen(hdr->value);
+
+			memcpy(p, hdr->header, hlen);
+			p += hlen;
+			*(p)++ = ':';
+			*(p)++ = ' ';
+			memcpy(p, hdr->value, vlen);
+			p += vlen;
+			*(p)++ = '\r';
+			*(p)++ = '\n';
+		}
+	}
+
+	if (extra != NULL) {
+		memcpy(p, extra, elen);
+		p += elen;
+	}
+
+	if (send_length) {
+		memcpy(p, "content-length: ", 16);
+		p += 16;
+		p += http_write_uint(p, len);
+		*(p)++ = '\r';
+		*(p)++ = '\n';
+	}
+
+	*(p)++ = '\r';
+	*(p)++ = '\n';
+
+	if (extra != NULL && d != NULL && send_body) {
+		memcpy(p, d, len);
+		p += len;
+		d = NULL;
+	}
+
+	nb->b_len = (u_int8_t *)p - nb->buf;
+
 	if (d != NULL && send_body)
 		net_send_queue(c, d, len);
 
 	if (!(c->flags & CONN_CLOSE_EMPTY) && !(c->flags & CONN_IS_BUSY))
 		http_start_recv(c);
 
+cleanup:
 	if (req != NULL)
 		req->content_length = len;
 
 	kore_buf_cleanup(&buf);
 }
 
+static struct http_template *
+http_template_get(int status, int variant)
+{
+	struct http_template	*tpl;
+	struct kore_buf		buf;
+	int			idx;
+	static struct http_template	uncached;
+
+	if (http_template_keepalive != http_keepalive_time ||
+	    http_template_hsts != http_hsts_enable) {
+		http_template_flush();
+		http_template_keepalive = http_keepalive_time;
+		http_template_hsts = http_hsts_enable;
+	}
+
+	if (status >= HTTP_TEMPLATE_STATUS_MIN &&
+	    status <= HTTP_TEMPLATE_STATUS_MAX) {
+		idx = status - HTTP_TEMPLATE_STATUS_MIN;
+		if (http_templates[idx] == NULL) {
+			http_templates[idx] = kore_calloc(HTTP_TEMPLATE_VARIANTS,
+			    sizeof(struct http_template));
+		}
+
+		/* HTTP_TEMPLATE_NOCONN never goes with HTTP_TEMPLATE_CLOSE. */
+		tpl = &http_templates[idx][variant];
+		if (tpl->data != NULL)
+			return (tpl);
+	} else {
+		tpl = &uncached;
+		kore_free(tpl->data);
+	}
+
+	kore_buf_init(&buf, 256);
+	kore_buf_appendf(&buf, "HTTP/1.%c %d %s\r\n",
+	    (variant & HTTP_TEMPLATE_VERSION_1_0) ? '0' : '1',
+	    status, http_status_text(status));
+	kore_buf_append(&buf, http_version, http_version_len);
+
+	if (variant & HTTP_TEMPLATE_CLOSE) {
+		kore_buf_appendf(&buf, "connection: close\r\n");
+	} else if (!(variant & HTTP_TEMPLATE_NOCONN)) {
+		kore_buf_appendf(&buf, "connection: keep-alive\r\n");
+		kore_buf_appendf(&buf,
+		    "keep-alive: timeout=%d\r\n", http_keepalive_time);
+	}
+
+	if (variant & HTTP_TEMPLATE_HSTS) {
+		kore_buf_appendf(&buf, "strict-transport-security: ");
+		kore_buf_appendf(&buf,
+		    "max-age=%" PRIu64 "; includeSubDomains\r\n",
+		    http_hsts_enable);
+	}
+
+	tpl->data = (char *)kore_buf_release(&buf, &tpl->len);
+
+	return (tpl);
+}
+
 static void
-http_write_response_cookie(struct http_cookie *ck)
+http_template_flush(void)
+{
+	size_t		idx;
+	int		i;
+
+	for (idx = 0; idx < HTTP_TEMPLATE_STATUS_MAX -
+	    HTTP_TEMPLATE_STATUS_MIN + 1; idx++) {
+		if (http_templates[idx] == NULL)
+			continue;
+
+		for (i = 0; i < HTTP_TEMPLATE_VARIANTS; i++)
+			kore_free(http_templates[idx][i].data);
+
+		kore_free(http_templates[idx]);
+		http_templates[idx] = NULL;
+	}
+}
+
+static size_t
+http_write_uint(char *out, u_int64_t val)
+{
+	size_t		len, i;
+	char		tmp[20];
+
+	len = 0;
+	do {
+		tmp[len++] = '0' + (val % 10);
+		val /= 10;
+	} while (val != 0);
+
+	for (i = 0; i < len; i++)
+		out[i] = tmp[len - i - 1];
+
+	return (len);
+}
+
+int
+http_write_response_cookie(struct kore_buf *buf, struct http_cookie *ck)
 {
 	struct tm		tm;
+	size_t			off;
 	char			expires[HTTP_DATE_MAXSIZE];
 
-	kore_buf_reset(ckhdr_buf);
-	kore_buf_appendf(ckhdr_buf, "%s=%s", ck->name, ck->value);
+	off = buf->offset;
+	kore_buf_appendf(buf, "%s=%s", ck->name, ck->value);
 
 	if (ck->path != NULL)
-		kore_buf_appendf(ckhdr_buf, "; Path=%s", ck->path);
+		kore_buf_appendf(buf, "; Path=%s", ck->path);
 	if (ck->domain != NULL)
-		kore_buf_appendf(ckhdr_buf, "; Domain=%s", ck->domain);
+		kore_buf_appendf(buf, "; Domain=%s", ck->domain);
 
 	if (ck->expires > 0) {
 		if (gmtime_r(&ck->expires, &tm) == NULL) {
 			kore_log(LOG_ERR, "gmtime_r(): %s", errno_s);
-			return;
+			buf->offset = off;
+			return (KORE_RESULT_ERROR);
 		}
 
 		if (strftime(expires, sizeof(expires),
 		    "%a, %d %b %y %H:%M:%S GMT", &tm) == 0) {
 			kore_log(LOG_ERR, "strftime(): %s", errno_s);
-			return;
+			buf->offset = off;
+			return (KORE_RESULT_ERROR);
 		}
 
-		kore_buf_appendf(ckhdr_buf, "; Expires=%s", expires);
+		kore_buf_appendf(buf, "; Expires=%s", expires);
 	}
 
 	if (ck->maxage > 0)
-		kore_buf_appendf(ckhdr_buf, "; Max-Age=%u", ck->maxage);
+		kore_buf_appendf(buf, "; Max-Age=%u", ck->maxage);
 
 	if (ck->flags & HTTP_COOKIE_HTTPONLY)
-		kore_buf_appendf(ckhdr_buf, "; HttpOnly");
+		kore_buf_appendf(buf, "; HttpOnly");
 	if (ck->flags & HTTP_COOKIE_SECURE)
-		kore_buf_appendf(ckhdr_buf, "; Secure");
+		kore_buf_appendf(buf, "; Secure");
 
-	kore_buf_appendf(header_buf, "set-cookie: %s\r\n",
-	    kore_buf_stringify(ckhdr_buf, NULL));
+	return (KORE_RESULT_OK);
 }
 
 static int
@@ -2621,3 +4995,162 @@ http_data_convert(void *data, void **out, void *nout, int type)
 
 	return (KORE_RESULT_ERROR);
 }
+
+/* Size of the value http_data_convert() stores, 0 for pointer types. */
+static size_t
+http_data_convert_size(int type)
+{
+	switch (type) {
+	case HTTP_ARG_TYPE_BYTE:
+		return (sizeof(u_int8_t));
+	case HTTP_ARG_TYPE_INT16:
+	case HTTP_ARG_TYPE_UINT16:
+		return (sizeof(u_int16_t));
+	case HTTP_ARG_TYPE_INT32:
+	case HTTP_ARG_TYPE_UINT32:
+		return (sizeof(u_int32_t));
+	case HTTP_ARG_TYPE_INT64:
+	case HTTP_ARG_TYPE_UINT64:
+		return (sizeof(u_int64_t));
+	case HTTP_ARG_TYPE_FLOAT:
+		return (sizeof(float));
+	case HTTP_ARG_TYPE_DOUBLE:
+		return (sizeof(double));
+	default:
+		return (0);
+	}
+}
+
+static void
+http_arena_free(struct http_request *req)
+{
+	struct http_arena_chunk		*chunk, *next;
+
+	for (chunk = req->arena; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		if (chunk->len == 0)
+			kore_free(chunk);
+		else
+			kore_pool_put(&http_arena_pool, chunk);
+	}
+
+	req->arena = NULL;
+}
+
+/* Parse the weight of an accept-encoding element, in thousandths. */
+static int
+http_qvalue(const char *p, const char *end)
+{
+	int		q, digits;
+
+	while (p < end) {
+		if (*p == ';' || *p == ' ' || *p == '\t') {
+			p++;
+			continue;
+		}
+
+		if (end - p < 3 ||
+		    (p[0] != 'q' && p[0] != 'Q') || p[1] != '=') {
+			while (p < end && *p != ';')
+				p++;
+			continue;
+		}
+
+		p += 2;
+		if (*p != '0' && *p != '1')
+			return (0);
+
+		q = (*p++ - '0') * HTTP_QVALUE_MAX;
+		if (p < end && *p == '.') {
+			p++;
+			for (digits = 100; digits > 0 && p < end &&
+			    isdigit((unsigned char)*p); digits /= 10)
+				q += (*p++ - '0') * digits;
+		}
+
+		return (MIN(q, HTTP_QVALUE_MAX));
+	}
+
+	return (HTTP_QVALUE_MAX);
+}
+
+#if defined(KORE_USE_TASKS)
+/*
+ * Handlers on routes marked offload run on a task thread, the request
+ * sleeps in the meantime and is woken by the task finishing. Whatever
+ * response the handler produced is kept on the request and sent from
+ * here, the connection is never touched from the task thread.
+ */
+static int
+http_offload_run(struct http_request *req)
+{
+	int			r;
+	struct kore_task	*t;
+
+	if ((t = req->offload) == NULL) {
+		t = kore_malloc(sizeof(*t));
+		kore_task_create(t, http_offload_task);
+
+		req->offload = t;
+		req->offload_status = 0;
+		req->flags |= HTTP_REQUEST_OFFLOADED;
+
+		kore_task_bind_request(t, req);
+		kore_task_run(t);
+
+		return (KORE_RESULT_RETRY);
+	}
+
+	if (!kore_task_finished(t)) {
+		http_request_sleep(req);
+		return (KORE_RESULT_RETRY);
+	}
+
+	r = kore_task_result(t);
+
+	kore_task_destroy(t);
+	kore_free(t);
+
+	req->offload = NULL;
+	req->flags &= ~HTTP_REQUEST_OFFLOADED;
+
+	if (req->offload_status != 0) {
+		if (req->offload_close) {
+			http_response_close(req, req->offload_status,
+			    req->offload_body, req->offload_len);
+		} else {
+			http_response(req, req->offload_status,
+			    req->offload_body, req->offload_len);
+		}
+
+		kore_free(req->offload_body);
+		req->offload_body = NULL;
+		req->offload_len = 0;
+	}
+
+	return (r);
+}
+
+static int
+http_offload_task(struct kore_task *t)
+{
+	return (kore_runtime_http_request(t->req->rt->rcall, t->req));
+}
+
+static void
+http_offload_response(struct http_request *req, int code, const void *d,
+    size_t l, int closing)
+{
+	kore_free(req->offload_body);
+
+	req->offload_len = l;
+	req->offload_body = NULL;
+	req->offload_close = closing;
+	req->offload_status = code;
+
+	if (l > 0) {
+		req->offload_body = kore_malloc(l);
+		memcpy(req->offload_body, d, l);
+	}
+}
+#endif
@@ -0,0 +1,2194 @@
+/*
+ * Copyright (c) 2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * HTTP/2 (RFC 9113) server side, selected via ALPN "h2" on TLS listeners
+ * or by a client sending the connection preface on a plaintext one.
+ *
+ * Every stream is backed by a regular struct http_request that lives on
+ * the normal http_requests queue, so handlers, runtimes and filemaps are
+ * unaware of the protocol version. Responses are encoded here instead of
+ * in http_response_normal().
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "kore.h"
+#include "http.h"
+
+#define HTTP2_FRAME_HDR_LEN		9
+#define HTTP2_FRAME_MAX			16384
+#define HTTP2_FRAME_LIMIT		16777215
+#define HTTP2_WINDOW_INITIAL		65535
+#define HTTP2_WINDOW_MAX		0x7fffffff
+#define HTTP2_RECV_WINDOW		(1024 * 1024)
+#define HTTP2_HBLOCK_MAX		(64 * 1024)
+
+#define HTTP2_FRAME_DATA		0x00
+#define HTTP2_FRAME_HEADERS		0x01
+#define HTTP2_FRAME_PRIORITY		0x02
+#define HTTP2_FRAME_RST_STREAM		0x03
+#define HTTP2_FRAME_SETTINGS		0x04
+#define HTTP2_FRAME_PUSH_PROMISE	0x05
+#define HTTP2_FRAME_PING		0x06
+#define HTTP2_FRAME_GOAWAY		0x07
+#define HTTP2_FRAME_WINDOW_UPDATE	0x08
+#define HTTP2_FRAME_CONTINUATION	0x09
+
+#define HTTP2_FLAG_END_STREAM		0x01
+#define HTTP2_FLAG_ACK			0x01
+#define HTTP2_FLAG_END_HEADERS		0x04
+#define HTTP2_FLAG_PADDED		0x08
+#define HTTP2_FLAG_PRIORITY		0x20
+
+#define HTTP2_SETTING_HEADER_TABLE_SIZE	0x01
+#define HTTP2_SETTING_ENABLE_PUSH	0x02
+#define HTTP2_SETTING_MAX_STREAMS	0x03
+#define HTTP2_SETTING_INITIAL_WINDOW	0x04
+#define HTTP2_SETTING_MAX_FRAME_SIZE	0x05
+#define HTTP2_SETTING_MAX_HEADER_LIST	0x06
+
+#define HTTP2_NO_ERROR			0x00
+#define HTTP2_PROTOCOL_ERROR		0x01
+#define HTTP2_INTERNAL_ERROR		0x02
+#define HTTP2_FLOW_CONTROL_ERROR	0x03
+#define HTTP2_STREAM_CLOSED		0x05
+#define HTTP2_FRAME_SIZE_ERROR		0x06
+#define HTTP2_REFUSED_STREAM		0x07
+#define HTTP2_COMPRESSION_ERROR		0x09
+#define HTTP2_ENHANCE_YOUR_CALM		0x0b
+#define HTTP2_HTTP_1_1_REQUIRED		0x0d
+
+#define HTTP2_SESSION_PREFACE		0x0001
+#define HTTP2_SESSION_GOAWAY		0x0002
+
+#define HTTP2_STREAM_REMOTE_CLOSED	0x0001
+#define HTTP2_STREAM_LOCAL_CLOSED	0x0002
+#define HTTP2_STREAM_HEADERS_SENT	0x0004
+#define HTTP2_STREAM_BODY_BUFFER	0x0008
+#define HTTP2_STREAM_HTTP11		0x0010
+
+#define HTTP2_DATA_NONE			0
+#define HTTP2_DATA_COPY			1
+#define HTTP2_DATA_BUF			2
+#define HTTP2_DATA_PTR			3
+#define HTTP2_DATA_REF			4
+
+#define HPACK_TABLE_SIZE		4096
+#define HPACK_TABLE_ENTRIES		(HPACK_TABLE_SIZE / 32)
+#define HPACK_ENTRY_OVERHEAD		32
+#define HPACK_STATIC_ENTRIES		61
+#define HPACK_HUFFMAN_EOS		256
+#define HPACK_HUFFMAN_LEAF		0x8000
+
+#define HPACK_STATIC_STATUS		8
+#define HPACK_STATIC_CONTENT_LENGTH	28
+#define HPACK_STATIC_DATE		33
+#define HPACK_STATIC_SERVER		54
+#define HPACK_STATIC_SET_COOKIE		55
+#define HPACK_STATIC_HSTS		56
+
+struct hpack_entry {
+	char			*name;
+	char			*value;
+	size_t			nlen;
+	size_t			vlen;
+};
+
+struct hpack_table {
+	size_t			size;
+	size_t			max;
+	size_t			count;
+	size_t			head;
+	struct hpack_entry	entries[HPACK_TABLE_ENTRIES];
+};
+
+struct http2_stream {
+	u_int32_t		id;
+	int			flags;
+	int64_t			send_window;
+	int64_t			recv_window;
+	struct http_request	*req;
+	struct kore_buf		*body;
+
+	/* Response body that is waiting for flow control credit. */
+	int			data_kind;
+	const u_int8_t		*data_src;
+	u_int8_t		*data_ptr;
+	struct kore_buf		*data_buf;
+	struct kore_fileref	*data_ref;
+	size_t			data_off;
+	size_t			data_len;
+	int			(*data_cb)(struct netbuf *);
+	void			*data_arg;
+
+	TAILQ_ENTRY(http2_stream)	list;
+};
+
+struct http2_session {
+	int			flags;
+	u_int32_t		last_id;
+	u_int32_t		nstreams;
+	u_int32_t		cont_id;
+	int			cont_flags;
+	struct kore_buf		*hblock;
+	int64_t			send_window;
+	int64_t			recv_window;
+	u_int32_t		peer_window;
+	u_int32_t		peer_frame;
+	struct http2_stream	*cur;
+	struct hpack_table	dec;
+
+	TAILQ_HEAD(, http2_stream)	streams;
+};
+
+static int	http2_recv(struct netbuf *);
+static int	http2_frame(struct connection *, struct http2_session *,
+		    u_int8_t, u_int8_t, u_int32_t, u_int8_t *, size_t);
+static int	http2_frame_data(struct connection *, struct http2_session *,
+		    u_int8_t, u_int32_t, u_int8_t *, size_t);
+static int	http2_frame_headers(struct connection *,
+		    struct http2_session *, u_int8_t, u_int32_t,
+		    u_int8_t *, size_t);
+static int	http2_frame_continuation(struct connection *,
+		    struct http2_session *, u_int8_t, u_int32_t,
+		    u_int8_t *, size_t);
+static int	http2_frame_settings(struct connection *,
+		    struct http2_session *, u_int8_t, u_int32_t,
+		    u_int8_t *, size_t);
+static int	http2_frame_window_update(struct connection *,
+		    struct http2_session *, u_int32_t, u_int8_t *, size_t);
+static int	http2_frame_rst_stream(struct connection *,
+		    struct http2_session *, u_int32_t, u_int8_t *, size_t);
+static int	http2_headers_complete(struct connection *,
+		    struct http2_session *, u_int32_t, u_int8_t,
+		    const u_int8_t *, size_t);
+static void	http2_request_create(struct connection *,
+		    struct http2_session *, struct http2_stream *, u_int8_t,
+		    struct kore_buf *);
+static int	http2_goaway(struct connection *, struct http2_session *,
+		    u_int32_t);
+static void	http2_frame_send(struct connection *, u_int8_t, u_int8_t,
+		    u_int32_t, const void *, size_t);
+static void	http2_frame_header(u_int8_t *, u_int8_t, u_int8_t,
+		    u_int32_t, size_t);
+static void	http2_rst_send(struct connection *, u_int32_t, u_int32_t);
+static void	http2_window_update_send(struct connection *, u_int32_t,
+		    u_int32_t);
+
+static struct http2_stream	*http2_stream_new(struct http2_session *,
+				    u_int32_t);
+static struct http2_stream	*http2_stream_lookup(struct http2_session *,
+				    u_int32_t);
+static void	http2_stream_free(struct connection *, struct http2_session *,
+		    struct http2_stream *);
+static void	http2_stream_done(struct connection *, struct http2_session *,
+		    struct http2_stream *);
+static void	http2_stream_reset(struct connection *,
+		    struct http2_session *, struct http2_stream *, u_int32_t);
+static void	http2_stream_detach(struct http2_stream *);
+static void	http2_stream_body(struct connection *, struct http2_session *,
+		    struct http2_stream *, const u_int8_t *, size_t);
+static void	http2_stream_body_end(struct connection *,
+		    struct http2_session *, struct http2_stream *);
+static int	http2_stream_send(struct connection *, struct http2_session *,
+		    struct http2_stream *);
+static void	http2_stream_resume(struct connection *,
+		    struct http2_session *);
+static void	http2_stream_release(struct connection *,
+		    struct http2_stream *);
+static void	http2_stream_copy(struct connection *, struct http2_session *,
+		    struct http2_stream *, const void *, size_t);
+static void	http2_stream_callback(struct connection *,
+		    int (*)(struct netbuf *), void *);
+
+static int	hpack_decode(struct hpack_table *, const u_int8_t *, size_t,
+		    struct kore_buf *, int *);
+static int	hpack_decode_int(const u_int8_t **, const u_int8_t *, int,
+		    size_t *);
+static int	hpack_decode_string(const u_int8_t **, const u_int8_t *,
+		    struct kore_buf *);
+static int	hpack_huffman_decode(const u_int8_t *, size_t,
+		    struct kore_buf *);
+static int	hpack_lookup(struct hpack_table *, size_t,
+		    const char **, size_t *, const char **, size_t *);
+static void	hpack_table_add(struct hpack_table *, const char *, size_t,
+		    const char *, size_t);
+static void	hpack_table_evict(struct hpack_table *, size_t);
+static void	hpack_table_cleanup(struct hpack_table *);
+static int	hpack_field_valid(const char *, size_t, const char *, size_t);
+static int	hpack_static_name(const char *, size_t);
+static void	hpack_encode_int(struct kore_buf *, u_int8_t, int, size_t);
+static void	hpack_encode_field(struct kore_buf *, int, const char *,
+		    size_t, const char *, size_t);
+
+/* RFC 7541 Appendix B, indexed by symbol. */
+static const struct {
+	u_int32_t	code;
+	u_int8_t	len;
+} hpack_huffman[HPACK_HUFFMAN_EOS + 1] = {
+	{ 0x00001ff8, 13 }, { 0x007fffd8, 23 }, { 0x0fffffe2, 28 }, { 0x0fffffe3, 28 },
+	{ 0x0fffffe4, 28 }, { 0x0fffffe5, 28 }, { 0x0fffffe6, 28 }, { 0x0fffffe7, 28 },
+	{ 0x0fffffe8, 28 }, { 0x00ffffea, 24 }, { 0x3ffffffc, 30 }, { 0x0fffffe9, 28 },
+	{ 0x0fffffea, 28 }, { 0x3ffffffd, 30 }, { 0x0fffffeb, 28 }, { 0x0fffffec, 28 },
+	{ 0x0fffffed, 28 }, { 0x0fffffee, 28 }, { 0x0fffffef, 28 }, { 0x0ffffff0, 28 },
+	{ 0x0ffffff1, 28 }, { 0x0ffffff2, 28 }, { 0x3ffffffe, 30 }, { 0x0ffffff3, 28 },
+	{ 0x0ffffff4, 28 }, { 0x0ffffff5, 28 }, { 0x0ffffff6, 28 }, { 0x0ffffff7, 28 },
+	{ 0x0ffffff8, 28 }, { 0x0ffffff9, 28 }, { 0x0ffffffa, 28 }, { 0x0ffffffb, 28 },
+	{ 0x00000014,  6 }, { 0x000003f8, 10 }, { 0x000003f9, 10 }, { 0x00000ffa, 12 },
+	{ 0x00001ff9, 13 }, { 0x00000015,  6 }, { 0x000000f8,  8 }, { 0x000007fa, 11 },
+	{ 0x000003fa, 10 }, { 0x000003fb, 10 }, { 0x000000f9,  8 }, { 0x000007fb, 11 },
+	{ 0x000000fa,  8 }, { 0x00000016,  6 }, { 0x00000017,  6 }, { 0x00000018,  6 },
+	{ 0x00000000,  5 }, { 0x00000001,  5 }, { 0x00000002,  5 }, { 0x00000019,  6 },
+	{ 0x0000001a,  6 }, { 0x0000001b,  6 }, { 0x0000001c,  6 }, { 0x0000001d,  6 },
+	{ 0x0000001e,  6 }, { 0x0000001f,  6 }, { 0x0000005c,  7 }, { 0x000000fb,  8 },
+	{ 0x00007ffc, 15 }, { 0x00000020,  6 }, { 0x00000ffb, 12 }, { 0x000003fc, 10 },
+	{ 0x00001ffa, 13 }, { 0x00000021,  6 }, { 0x0000005d,  7 }, { 0x0000005e,  7 },
+	{ 0x0000005f,  7 }, { 0x00000060,  7 }, { 0x00000061,  7 }, { 0x00000062,  7 },
+	{ 0x00000063,  7 }, { 0x00000064,  7 }, { 0x00000065,  7 }, { 0x00000066,  7 },
+	{ 0x00000067,  7 }, { 0x00000068,  7 }, { 0x00000069,  7 }, { 0x0000006a,  7 },
+	{ 0x0000006b,  7 }, { 0x0000006c,  7 }, { 0x0000006d,  7 }, { 0x0000006e,  7 },
+	{ 0x0000006f,  7 }, { 0x00000070,  7 }, { 0x00000071,  7 }, { 0x00000072,  7 },
+	{ 0x000000fc,  8 }, { 0x00000073,  7 }, { 0x000000fd,  8 }, { 0x00001ffb, 13 },
+	{ 0x0007fff0, 19 }, { 0x00001ffc, 13 }, { 0x00003ffc, 14 }, { 0x00000022,  6 },
+	{ 0x00007ffd, 15 }, { 0x00000003,  5 }, { 0x00000023,  6 }, { 0x00000004,  5 },
+	{ 0x00000024,  6 }, { 0x00000005,  5 }, { 0x00000025,  6 }, { 0x00000026,  6 },
+	{ 0x00000027,  6 }, { 0x00000006,  5 }, { 0x00000074,  7 }, { 0x00000075,  7 },
+	{ 0x00000028,  6 }, { 0x00000029,  6 }, { 0x0000002a,  6 }, { 0x00000007,  5 },
+	{ 0x0000002b,  6 }, { 0x00000076,  7 }, { 0x0000002c,  6 }, { 0x00000008,  5 },
+	{ 0x00000009,  5 }, { 0x0000002d,  6 }, { 0x00000077,  7 }, { 0x00000078,  7 },
+	{ 0x00000079,  7 }, { 0x0000007a,  7 }, { 0x0000007b,  7 }, { 0x00007ffe, 15 },
+	{ 0x000007fc, 11 }, { 0x00003ffd, 14 }, { 0x00001ffd, 13 }, { 0x0ffffffc, 28 },
+	{ 0x000fffe6, 20 }, { 0x003fffd2, 22 }, { 0x000fffe7, 20 }, { 0x000fffe8, 20 },
+	{ 0x003fffd3, 22 }, { 0x003fffd4, 22 }, { 0x003fffd5, 22 }, { 0x007fffd9, 23 },
+	{ 0x003fffd6, 22 }, { 0x007fffda, 23 }, { 0x007fffdb, 23 }, { 0x007fffdc, 23 },
+	{ 0x007fffdd, 23 }, { 0x007fffde, 23 }, { 0x00ffffeb, 24 }, { 0x007fffdf, 23 },
+	{ 0x00ffffec, 24 }, { 0x00ffffed, 24 }, { 0x003fffd7, 22 }, { 0x007fffe0, 23 },
+	{ 0x00ffffee, 24 }, { 0x007fffe1, 23 }, { 0x007fffe2, 23 }, { 0x007fffe3, 23 },
+	{ 0x007fffe4, 23 }, { 0x001fffdc, 21 }, { 0x003fffd8, 22 }, { 0x007fffe5, 23 },
+	{ 0x003fffd9, 22 }, { 0x007fffe6, 23 }, { 0x007fffe7, 23 }, { 0x00ffffef, 24 },
+	{ 0x003fffda, 22 }, { 0x001fffdd, 21 }, { 0x000fffe9, 20 }, { 0x003fffdb, 22 },
+	{ 0x003fffdc, 22 }, { 0x007fffe8, 23 }, { 0x007fffe9, 23 }, { 0x001fffde, 21 },
+	{ 0x007fffea, 23 }, { 0x003fffdd, 22 }, { 0x003fffde, 22 }, { 0x00fffff0, 24 },
+	{ 0x001fffdf, 21 }, { 0x003fffdf, 22 }, { 0x007fffeb, 23 }, { 0x007fffec, 23 },
+	{ 0x001fffe0, 21 }, { 0x001fffe1, 21 }, { 0x003fffe0, 22 }, { 0x001fffe2, 21 },
+	{ 0x007fffed, 23 }, { 0x003fffe1, 22 }, { 0x007fffee, 23 }, { 0x007fffef, 23 },
+	{ 0x000fffea, 20 }, { 0x003fffe2, 22 }, { 0x003fffe3, 22 }, { 0x003fffe4, 22 },
+	{ 0x007ffff0, 23 }, { 0x003fffe5, 22 }, { 0x003fffe6, 22 }, { 0x007ffff1, 23 },
+	{ 0x03ffffe0, 26 }, { 0x03ffffe1, 26 }, { 0x000fffeb, 20 }, { 0x0007fff1, 19 },
+	{ 0x003fffe7, 22 }, { 0x007ffff2, 23 }, { 0x003fffe8, 22 }, { 0x01ffffec, 25 },
+	{ 0x03ffffe2, 26 }, { 0x03ffffe3, 26 }, { 0x03ffffe4, 26 }, { 0x07ffffde, 27 },
+	{ 0x07ffffdf, 27 }, { 0x03ffffe5, 26 }, { 0x00fffff1, 24 }, { 0x01ffffed, 25 },
+	{ 0x0007fff2, 19 }, { 0x001fffe3, 21 }, { 0x03ffffe6, 26 }, { 0x07ffffe0, 27 },
+	{ 0x07ffffe1, 27 }, { 0x03ffffe7, 26 }, { 0x07ffffe2, 27 }, { 0x00fffff2, 24 },
+	{ 0x001fffe4, 21 }, { 0x001fffe5, 21 }, { 0x03ffffe8, 26 }, { 0x03ffffe9, 26 },
+	{ 0x0ffffffd, 28 }, { 0x07ffffe3, 27 }, { 0x07ffffe4, 27 }, { 0x07ffffe5, 27 },
+	{ 0x000fffec, 20 }, { 0x00fffff3, 24 }, { 0x000fffed, 20 }, { 0x001fffe6, 21 },
+	{ 0x003fffe9, 22 }, { 0x001fffe7, 21 }, { 0x001fffe8, 21 }, { 0x007ffff3, 23 },
+	{ 0x003fffea, 22 }, { 0x003fffeb, 22 }, { 0x01ffffee, 25 }, { 0x01ffffef, 25 },
+	{ 0x00fffff4, 24 }, { 0x00fffff5, 24 }, { 0x03ffffea, 26 }, { 0x007ffff4, 23 },
+	{ 0x03ffffeb, 26 }, { 0x07ffffe6, 27 }, { 0x03ffffec, 26 }, { 0x03ffffed, 26 },
+	{ 0x07ffffe7, 27 }, { 0x07ffffe8, 27 }, { 0x07ffffe9, 27 }, { 0x07ffffea, 27 },
+	{ 0x07ffffeb, 27 }, { 0x0ffffffe, 28 }, { 0x07ffffec, 27 }, { 0x07ffffed, 27 },
+	{ 0x07ffffee, 27 }, { 0x07ffffef, 27 }, { 0x07fffff0, 27 }, { 0x03ffffee, 26 },
+	{ 0x3fffffff, 30 }
+};
+
+/* RFC 7541 Appendix A, index 0 is unused. */
+static const struct {
+	const char	*name;
+	const char	*value;
+} hpack_static[HPACK_STATIC_ENTRIES + 1] = {
+	{ NULL,				NULL },
+	{ ":authority",		"" },
+	{ ":method",		"GET" },
+	{ ":method",		"POST" },
+	{ ":path",		"/" },
+	{ ":path",		"/index.html" },
+	{ ":scheme",		"http" },
+	{ ":scheme",		"https" },
+	{ ":status",		"200" },
+	{ ":status",		"204" },
+	{ ":status",		"206" },
+	{ ":status",		"304" },
+	{ ":status",		"400" },
+	{ ":status",		"404" },
+	{ ":status",		"500" },
+	{ "accept-charset",	"" },
+	{ "accept-encoding",	"gzip, deflate" },
+	{ "accept-language",	"" },
+	{ "accept-ranges",	"" },
+	{ "accept",		"" },
+	{ "access-control-allow-origin",	"" },
+	{ "age",			"" },
+	{ "allow",		"" },
+	{ "authorization",	"" },
+	{ "cache-control",	"" },
+	{ "content-disposition",	"" },
+	{ "content-encoding",	"" },
+	{ "content-language",	"" },
+	{ "content-length",	"" },
+	{ "content-location",	"" },
+	{ "content-range",	"" },
+	{ "content-type",		"" },
+	{ "cookie",		"" },
+	{ "date",			"" },
+	{ "etag",			"" },
+	{ "expect",		"" },
+	{ "expires",		"" },
+	{ "from",			"" },
+	{ "host",			"" },
+	{ "if-match",		"" },
+	{ "if-modified-since",	"" },
+	{ "if-none-match",	"" },
+	{ "if-range",		"" },
+	{ "if-unmodified-since",	"" },
+	{ "last-modified",	"" },
+	{ "link",			"" },
+	{ "location",		"" },
+	{ "max-forwards",		"" },
+	{ "proxy-authenticate",	"" },
+	{ "proxy-authorization",	"" },
+	{ "range",		"" },
+	{ "referer",		"" },
+	{ "refresh",		"" },
+	{ "retry-after",		"" },
+	{ "server",		"" },
+	{ "set-cookie",		"" },
+	{ "strict-transport-security",	"" },
+	{ "transfer-encoding",	"" },
+	{ "user-agent",		"" },
+	{ "vary",			"" },
+	{ "via",			"" },
+	{ "www-authenticate",	"" }
+};
+
+static size_t			hpack_static_nlen[HPACK_STATIC_ENTRIES + 1];
+static size_t			hpack_static_vlen[HPACK_STATIC_ENTRIES + 1];
+static u_int16_t		hpack_tree[HPACK_HUFFMAN_EOS][2];
+
+static struct kore_pool		http2_stream_pool;
+static struct kore_buf		*http2_hbuf = NULL;
+static struct kore_buf		*http2_field = NULL;
+static struct kore_buf		*http2_cookie = NULL;
+
+int				http2_enable = 1;
+u_int32_t			http2_max_streams = HTTP2_MAX_STREAMS;
+
+void
+http2_init(void)
+{
+	int		sym, bit, node, nodes, b;
+
+	kore_pool_init(&http2_stream_pool, "http2_stream_pool",
+	    sizeof(struct http2_stream), http_request_limit);
+
+	http2_hbuf = kore_buf_alloc(HTTP_HEADER_BUFSIZE);
+	http2_field = kore_buf_alloc(HTTP_HEADER_BUFSIZE);
+	http2_cookie = kore_buf_alloc(HTTP_COOKIE_BUFSIZE);
+
+	for (sym = 1; sym <= HPACK_STATIC_ENTRIES; sym++) {
+		hpack_static_nlen[sym] = strlen(hpack_static[sym].name);
+		hpack_static_vlen[sym] = strlen(hpack_static[sym].value);
+	}
+
+	/* Build a binary tree out of the huffman codes for decoding. */
+	nodes = 0;
+	memset(hpack_tree, 0, sizeof(hpack_tree));
+
+	for (sym = 0; sym <= HPACK_HUFFMAN_EOS; sym++) {
+		node = 0;
+		for (bit = hpack_huffman[sym].len - 1; bit >= 0; bit--) {
+			b = (hpack_huffman[sym].code >> bit) & 0x01;
+			if (bit == 0) {
+				hpack_tree[node][b] = HPACK_HUFFMAN_LEAF | sym;
+				break;
+			}
+
+			if (hpack_tree[node][b] == 0) {
+				if (++nodes >= HPACK_HUFFMAN_EOS)
+					fatal("http2_init: huffman tree overflow");
+				hpack_tree[node][b] = nodes;
+			}
+
+			node = hpack_tree[node][b];
+		}
+	}
+}
+
+void
+http2_cleanup(void)
+{
+	if (http2_hbuf != NULL) {
+		kore_buf_free(http2_hbuf);
+		http2_hbuf = NULL;
+	}
+
+	if (http2_field != NULL) {
+		kore_buf_free(http2_field);
+		http2_field = NULL;
+	}
+
+	if (http2_cookie != NULL) {
+		kore_buf_free(http2_cookie);
+		http2_cookie = NULL;
+	}
+
+	kore_pool_cleanup(&http2_stream_pool);
+}
+
+void
+http2_session_start(struct connection *c)
+{
+	struct http2_session	*h2;
+	u_int8_t		settings[18];
+
+	h2 = kore_calloc(1, sizeof(*h2));
+	TAILQ_INIT(&h2->streams);
+
+	h2->send_window = HTTP2_WINDOW_INITIAL;
+	h2->recv_window = HTTP2_RECV_WINDOW;
+	h2->peer_window = HTTP2_WINDOW_INITIAL;
+	h2->peer_frame = HTTP2_FRAME_MAX;
+	h2->hblock = kore_buf_alloc(HTTP_HEADER_BUFSIZE);
+	h2->dec.max = HPACK_TABLE_SIZE;
+	h2->dec.head = HPACK_TABLE_ENTRIES - 1;
+
+	c->h2 = h2;
+	c->proto = CONN_PROTO_HTTP2;
+	c->http_timeout = 0;
+
+	net_write16(&settings[0], HTTP2_SETTING_MAX_STREAMS);
+	net_write32(&settings[2], http2_max_streams);
+	net_write16(&settings[6], HTTP2_SETTING_INITIAL_WINDOW);
+	net_write32(&settings[8], HTTP2_RECV_WINDOW);
+	net_write16(&settings[12], HTTP2_SETTING_MAX_HEADER_LIST);
+	net_write32(&settings[14], http_header_max);
+
+	http2_frame_send(c, HTTP2_FRAME_SETTINGS, 0, 0,
+	    settings, sizeof(settings));
+	http2_window_update_send(c, 0,
+	    HTTP2_RECV_WINDOW - HTTP2_WINDOW_INITIAL);
+
+	net_recv_reset(c, HTTP2_FRAME_HDR_LEN + HTTP2_FRAME_MAX, http2_recv);
+}
+
+void
+http2_session_free(struct connection *c)
+{
+	struct http2_stream	*st;
+	struct http2_session	*h2;
+
+	if ((h2 = c->h2) == NULL)
+		return;
+
+	while ((st = TAILQ_FIRST(&h2->streams)) != NULL) {
+		if (st->req != NULL)
+			st->req->stream = NULL;
+		st->req = NULL;
+		http2_stream_free(c, h2, st);
+	}
+
+	hpack_table_cleanup(&h2->dec);
+	kore_buf_free(h2->hblock);
+	kore_free(h2);
+
+	c->h2 = NULL;
+}
+
+/*
+ * Send a GOAWAY to a session on a draining worker so the peer stops
+ * opening streams, returns 1 once it has none left.
+ */
+int
+http2_session_drain(struct connection *c)
+{
+	struct http2_session	*h2;
+
+	if ((h2 = c->h2) == NULL)
+		return (1);
+
+	if (!(h2->flags & HTTP2_SESSION_GOAWAY))
+		(void)http2_goaway(c, h2, HTTP2_NO_ERROR);
+
+	return (TAILQ_EMPTY(&h2->streams));
+}
+
+void
+http2_request_attach(struct connection *c, struct http_request *req)
+{
+	struct http2_stream	*st;
+
+	if ((st = c->h2->cur) == NULL)
+		fatal("http2_request_attach: no current stream");
+
+	st->req = req;
+	req->stream = st;
+}
+
+/*
+ * The request can only be served over HTTP/1.1. Unless a response is sent
+ * after all its stream is reset with HTTP_1_1_REQUIRED once the request
+ * is freed, clients then retry it on a connection of its own.
+ */
+void
+http2_request_http11(struct http_request *req)
+{
+	if (req->stream != NULL)
+		req->stream->flags |= HTTP2_STREAM_HTTP11;
+}
+
+void
+http2_request_free(struct http_request *req)
+{
+	struct connection	*c;
+	struct http2_stream	*st;
+
+	st = req->stream;
+	c = req->owner;
+
+	st->req = NULL;
+	req->stream = NULL;
+
+	/* The handler never finished its response, cut the stream short. */
+	if (!(st->flags & HTTP2_STREAM_LOCAL_CLOSED) &&
+	    st->data_kind == HTTP2_DATA_NONE) {
+		http2_stream_reset(c, c->h2, st,
+		    (st->flags & HTTP2_STREAM_HTTP11) ?
+		    HTTP2_HTTP_1_1_REQUIRED : HTTP2_INTERNAL_ERROR);
+		if (!net_send_flush(c))
+			kore_connection_disconnect(c);
+		return;
+	}
+
+	http2_stream_done(c, c->h2, st);
+}
+
+void
+http2_response(struct connection *c, struct http_request *req, int status,
+    const void *d, size_t len)
+{
+	struct http_cookie	*ck;
+	struct http_header	*hdr;
+	struct http2_stream	*st;
+	struct http2_session	*h2;
+	const char		*server;
+	char			tmp[64];
+	size_t			slen, nlen;
+	int			idx, end, send_length, date;
+
+	h2 = c->h2;
+	st = (req != NULL) ? req->stream : h2->cur;
+
+	/* No interim responses, and only one response per stream. */
+	if (st == NULL || status < 200 ||
+	    (st->flags & (HTTP2_STREAM_HEADERS_SENT | HTTP2_STREAM_LOCAL_CLOSED)))
+		return;
+
+	kore_buf_reset(http2_hbuf);
+
+	switch (status) {
+	case HTTP_STATUS_OK:
+		idx = 8;
+		break;
+	case HTTP_STATUS_NO_CONTENT:
+		idx = 9;
+		break;
+	case HTTP_STATUS_PARTIAL_CONTENT:
+		idx = 10;
+		break;
+	case HTTP_STATUS_NOT_MODIFIED:
+		idx = 11;
+		break;
+	case HTTP_STATUS_BAD_REQUEST:
+		idx = 12;
+		break;
+	case HTTP_STATUS_NOT_FOUND:
+		idx = 13;
+		break;
+	case HTTP_STATUS_INTERNAL_ERROR:
+		idx = 14;
+		break;
+	default:
+		idx = 0;
+		break;
+	}
+
+	if (idx != 0) {
+		hpack_encode_int(http2_hbuf, 0x80, 7, idx);
+	} else {
+		slen = snprintf(tmp, sizeof(tmp), "%d", status);
+		hpack_encode_field(http2_hbuf, HPACK_STATIC_STATUS,
+		    NULL, 0, tmp, slen);
+	}
+
+	server = http_server_header(&slen);
+	hpack_encode_field(http2_hbuf, HPACK_STATIC_SERVER,
+	    NULL, 0, server, slen);
+
+	if (c->tls && http_hsts_enable) {
+		slen = snprintf(tmp, sizeof(tmp),
+		    "max-age=%" PRIu64 "; includeSubDomains", http_hsts_enable);
+		hpack_encode_field(http2_hbuf, HPACK_STATIC_HSTS,
+		    NULL, 0, tmp, slen);
+	}
+
+	date = 1;
+
+	if (req != NULL) {
+		TAILQ_FOREACH(ck, &(req->resp_cookies), list) {
+			kore_buf_reset(http2_cookie);
+			if (!http_write_response_cookie(http2_cookie, ck))
+				continue;
+			hpack_encode_field(http2_hbuf, HPACK_STATIC_SET_COOKIE,
+			    NULL, 0, (const char *)http2_cookie->data,
+			    http2_cookie->offset);
+		}
+
+		TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
+			/* Connection-specific headers are not allowed. */
+			if (!strcasecmp(hdr->header, "connection") ||
+			    !strcasecmp(hdr->header, "keep-alive") ||
+			    !strcasecmp(hdr->header, "proxy-connection") ||
+			    !strcasecmp(hdr->header, "transfer-encoding") ||
+			    !strcasecmp(hdr->header, "upgrade"))
+				continue;
+
+			if (!strcasecmp(hdr->header, "date"))
+				date = 0;
+
+			nlen = strlen(hdr->header);
+			hpack_encode_field(http2_hbuf,
+			    hpack_static_name(hdr->header, nlen),
+			    hdr->header, nlen, hdr->value, strlen(hdr->value));
+		}
+	}
+
+	if (date) {
+		if (kore_clock.wall == 0)
+			kore_clock_tick();
+		hpack_encode_field(http2_hbuf, HPACK_STATIC_DATE, NULL, 0,
+		    kore_clock.date, strlen(kore_clock.date));
+	}
+
+	send_length = 0;
+	if (status != HTTP_STATUS_NO_CONTENT) {
+		if (req == NULL ||
+		    !(req->flags & HTTP_REQUEST_NO_CONTENT_LENGTH))
+			send_length = 1;
+	}
+
+	if (send_length) {
+		slen = snprintf(tmp, sizeof(tmp), "%zu", len);
+		hpack_encode_field(http2_hbuf, HPACK_STATIC_CONTENT_LENGTH,
+		    NULL, 0, tmp, slen);
+	}
+
+	end = (len == 0 || (req != NULL && req->method == HTTP_METHOD_HEAD));
+
+	/* Split the block into CONTINUATION frames if it does not fit. */
+	slen = 0;
+	idx = HTTP2_FRAME_HEADERS;
+	do {
+		nlen = MIN(http2_hbuf->offset - slen, h2->peer_frame);
+		http2_frame_send(c, idx,
+		    ((slen + nlen == http2_hbuf->offset) ?
+		    HTTP2_FLAG_END_HEADERS : 0) |
+		    ((end && idx == HTTP2_FRAME_HEADERS) ?
+		    HTTP2_FLAG_END_STREAM : 0),
+		    st->id, http2_hbuf->data + slen, nlen);
+		slen += nlen;
+		idx = HTTP2_FRAME_CONTINUATION;
+	} while (slen < http2_hbuf->offset);
+
+	st->flags |= HTTP2_STREAM_HEADERS_SENT;
+
+	if (end) {
+		st->flags |= HTTP2_STREAM_LOCAL_CLOSED;
+		http2_stream_done(c, h2, st);
+		return;
+	}
+
+	if (d != NULL)
+		http2_stream_copy(c, h2, st, d, len);
+}
+
+void
+http2_response_stream(struct http_request *req, void *base, size_t len,
+    int (*cb)(struct netbuf *), void *arg)
+{
+	struct http2_stream	*st;
+	struct connection	*c;
+
+	c = req->owner;
+	st = req->stream;
+
+	if (st == NULL || (st->flags & HTTP2_STREAM_LOCAL_CLOSED) ||
+	    st->data_kind != HTTP2_DATA_NONE) {
+		if (cb != NULL)
+			http2_stream_callback(c, cb, arg);
+		return;
+	}
+
+	st->data_kind = HTTP2_DATA_PTR;
+	st->data_ptr = base;
+	st->data_off = 0;
+	st->data_len = len;
+	st->data_cb = cb;
+	st->data_arg = arg;
+
+	if (http2_stream_send(c, c->h2, st))
+		http2_stream_done(c, c->h2, st);
+}
+
+void
+http2_response_fileref(struct http_request *req, struct kore_fileref *ref)
+{
+	http2_response_fileref_range(req, ref, 0, ref->size);
+}
+
+void
+http2_response_fileref_range(struct http_request *req,
+    struct kore_fileref *ref, off_t off, size_t len)
+{
+	struct http2_stream	*st;
+	struct connection	*c;
+
+	c = req->owner;
+	st = req->stream;
+
+	if (st == NULL || (st->flags & HTTP2_STREAM_LOCAL_CLOSED) ||
+	    st->data_kind != HTTP2_DATA_NONE) {
+		kore_fileref_release(ref);
+		return;
+	}
+
+	/* Both are absolute offsets into the file. */
+	st->data_kind = HTTP2_DATA_REF;
+	st->data_ref = ref;
+	st->data_off = off;
+	st->data_len = off + len;
+
+	if (http2_stream_send(c, c->h2, st))
+		http2_stream_done(c, c->h2, st);
+}
+
+static int
+http2_recv(struct netbuf *nb)
+{
+	struct connection	*c;
+	struct http2_session	*h2;
+	u_int8_t		*p;
+	u_int32_t		id;
+	size_t			off, len;
+
+	c = nb->owner;
+	h2 = c->h2;
+	off = 0;
+
+	if (!(h2->flags & HTTP2_SESSION_PREFACE)) {
+		len = MIN(nb->s_off, HTTP2_PREFACE_LEN);
+		if (memcmp(nb->buf, HTTP2_PREFACE, len))
+			return (KORE_RESULT_ERROR);
+		if (len < HTTP2_PREFACE_LEN)
+			return (KORE_RESULT_OK);
+
+		h2->flags |= HTTP2_SESSION_PREFACE;
+		off = HTTP2_PREFACE_LEN;
+	}
+
+	while (nb->s_off - off >= HTTP2_FRAME_HDR_LEN) {
+		p = nb->buf + off;
+		len = (p[0] << 16) | (p[1] << 8) | p[2];
+
+		if (len > HTTP2_FRAME_MAX)
+			return (http2_goaway(c, h2, HTTP2_FRAME_SIZE_ERROR));
+
+		if (nb->s_off - off - HTTP2_FRAME_HDR_LEN < len)
+			break;
+
+		id = net_read32(p + 5) & HTTP2_WINDOW_MAX;
+		if (!http2_frame(c, h2, p[3], p[4], id,
+		    p + HTTP2_FRAME_HDR_LEN, len))
+			return (KORE_RESULT_ERROR);
+
+		off += HTTP2_FRAME_HDR_LEN + len;
+	}
+
+	/* Keep any partial frame at the start of the buffer. */
+	if (off > 0) {
+		memmove(nb->buf, nb->buf + off, nb->s_off - off);
+		nb->s_off -= off;
+	}
+
+	return (net_send_flush(c));
+}
+
+static int
+http2_frame(struct connection *c, struct http2_session *h2, u_int8_t type,
+    u_int8_t flags, u_int32_t id, u_int8_t *data, size_t len)
+{
+	struct http2_stream	*st;
+
+	if (h2->cont_id != 0 && type != HTTP2_FRAME_CONTINUATION)
+		return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+
+	switch (type) {
+	case HTTP2_FRAME_DATA:
+		return (http2_frame_data(c, h2, flags, id, data, len));
+	case HTTP2_FRAME_HEADERS:
+		return (http2_frame_headers(c, h2, flags, id, data, len));
+	case HTTP2_FRAME_CONTINUATION:
+		return (http2_frame_continuation(c, h2, flags, id, data, len));
+	case HTTP2_FRAME_SETTINGS:
+		return (http2_frame_settings(c, h2, flags, id, data, len));
+	case HTTP2_FRAME_WINDOW_UPDATE:
+		return (http2_frame_window_update(c, h2, id, data, len));
+	case HTTP2_FRAME_RST_STREAM:
+		return (http2_frame_rst_stream(c, h2, id, data, len));
+	case HTTP2_FRAME_PRIORITY:
+		if (id == 0)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+		if (len != 5) {
+			st = http2_stream_lookup(h2, id);
+			http2_stream_reset(c, h2, st, HTTP2_FRAME_SIZE_ERROR);
+			if (st == NULL)
+				http2_rst_send(c, id, HTTP2_FRAME_SIZE_ERROR);
+			break;
+		}
+		/* A stream cannot depend on itself. */
+		if ((net_read32(data) & HTTP2_WINDOW_MAX) == id) {
+			st = http2_stream_lookup(h2, id);
+			http2_stream_reset(c, h2, st, HTTP2_PROTOCOL_ERROR);
+			if (st == NULL)
+				http2_rst_send(c, id, HTTP2_PROTOCOL_ERROR);
+		}
+		break;
+	case HTTP2_FRAME_PING:
+		if (id != 0)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+		if (len != 8)
+			return (http2_goaway(c, h2, HTTP2_FRAME_SIZE_ERROR));
+		if (!(flags & HTTP2_FLAG_ACK)) {
+			http2_frame_send(c, HTTP2_FRAME_PING,
+			    HTTP2_FLAG_ACK, 0, data, len);
+		}
+		break;
+	case HTTP2_FRAME_GOAWAY:
+		if (id != 0)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+		if (len < 8)
+			return (http2_goaway(c, h2, HTTP2_FRAME_SIZE_ERROR));
+		h2->flags |= HTTP2_SESSION_GOAWAY;
+		break;
+	case HTTP2_FRAME_PUSH_PROMISE:
+		return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+	default:
+		/* Unknown frame types must be ignored. */
+		break;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_frame_data(struct connection *c, struct http2_session *h2,
+    u_int8_t flags, u_int32_t id, u_int8_t *data, size_t len)
+{
+	struct http2_stream	*st;
+	size_t			flen, pad;
+
+	if (id == 0)
+		return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+
+	/* The entire frame, including padding, counts towards the window. */
+	flen = len;
+	h2->recv_window -= flen;
+	if (h2->recv_window < 0)
+		return (http2_goaway(c, h2, HTTP2_FLOW_CONTROL_ERROR));
+
+	if (h2->recv_window < HTTP2_RECV_WINDOW / 2) {
+		http2_window_update_send(c, 0,
+		    HTTP2_RECV_WINDOW - h2->recv_window);
+		h2->recv_window = HTTP2_RECV_WINDOW;
+	}
+
+	if (flags & HTTP2_FLAG_PADDED) {
+		if (len < 1)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+		pad = data[0];
+		data++;
+		len--;
+		if (pad > len)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+		len -= pad;
+	}
+
+	if ((st = http2_stream_lookup(h2, id)) == NULL) {
+		if (id > h2->last_id)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+		http2_rst_send(c, id, HTTP2_STREAM_CLOSED);
+		return (KORE_RESULT_OK);
+	}
+
+	if (st->flags & HTTP2_STREAM_REMOTE_CLOSED) {
+		http2_stream_reset(c, h2, st, HTTP2_STREAM_CLOSED);
+		return (KORE_RESULT_OK);
+	}
+
+	st->recv_window -= flen;
+	if (st->recv_window < 0) {
+		http2_stream_reset(c, h2, st, HTTP2_FLOW_CONTROL_ERROR);
+		return (KORE_RESULT_OK);
+	}
+
+	if (!(flags & HTTP2_FLAG_END_STREAM) &&
+	    st->recv_window < HTTP2_RECV_WINDOW / 2) {
+		http2_window_update_send(c, st->id,
+		    HTTP2_RECV_WINDOW - st->recv_window);
+		st->recv_window = HTTP2_RECV_WINDOW;
+	}
+
+	http2_stream_body(c, h2, st, data, len);
+
+	/* The stream may have been reset while handling the body. */
+	if ((flags & HTTP2_FLAG_END_STREAM) &&
+	    (st = http2_stream_lookup(h2, id)) != NULL) {
+		st->flags |= HTTP2_STREAM_REMOTE_CLOSED;
+		http2_stream_body_end(c, h2, st);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_frame_headers(struct connection *c, struct http2_session *h2,
+    u_int8_t flags, u_int32_t id, u_int8_t *data, size_t len)
+{
+	size_t		pad;
+
+	if (id == 0)
+		return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+
+	pad = 0;
+	if (flags & HTTP2_FLAG_PADDED) {
+		if (len < 1)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+		pad = data[0];
+		data++;
+		len--;
+	}
+
+	/* Stream priorities are not used, skip them. */
+	if (flags & HTTP2_FLAG_PRIORITY) {
+		if (len < 5)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+		data += 5;
+		len -= 5;
+	}
+
+	if (pad > len)
+		return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+	len -= pad;
+
+	if (!(flags & HTTP2_FLAG_END_HEADERS)) {
+		h2->cont_id = id;
+		h2->cont_flags = flags;
+		kore_buf_reset(h2->hblock);
+		kore_buf_append(h2->hblock, data, len);
+		return (KORE_RESULT_OK);
+	}
+
+	return (http2_headers_complete(c, h2, id, flags, data, len));
+}
+
+static int
+http2_frame_continuation(struct connection *c, struct http2_session *h2,
+    u_int8_t flags, u_int32_t id, u_int8_t *data, size_t len)
+{
+	if (h2->cont_id == 0 || id != h2->cont_id)
+		return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+
+	if (h2->hblock->offset + len > HTTP2_HBLOCK_MAX)
+		return (http2_goaway(c, h2, HTTP2_ENHANCE_YOUR_CALM));
+
+	kore_buf_append(h2->hblock, data, len);
+
+	if (!(flags & HTTP2_FLAG_END_HEADERS))
+		return (KORE_RESULT_OK);
+
+	h2->cont_id = 0;
+
+	return (http2_headers_complete(c, h2, id, h2->cont_flags,
+	    h2->hblock->data, h2->hblock->offset));
+}
+
+static int
+http2_frame_settings(struct connection *c, struct http2_session *h2,
+    u_int8_t flags, u_int32_t id, u_int8_t *data, size_t len)
+{
+	struct http2_stream	*st;
+	size_t			off;
+	u_int16_t		setting;
+	u_int32_t		value;
+	int64_t			delta;
+
+	if (id != 0)
+		return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+
+	if (flags & HTTP2_FLAG_ACK) {
+		if (len != 0)
+			return (http2_goaway(c, h2, HTTP2_FRAME_SIZE_ERROR));
+		return (KORE_RESULT_OK);
+	}
+
+	if ((len % 6) != 0)
+		return (http2_goaway(c, h2, HTTP2_FRAME_SIZE_ERROR));
+
+	for (off = 0; off < len; off += 6) {
+		setting = net_read16(data + off);
+		value = net_read32(data + off + 2);
+
+		switch (setting) {
+		case HTTP2_SETTING_ENABLE_PUSH:
+			if (value > 1) {
+				return (http2_goaway(c, h2,
+				    HTTP2_PROTOCOL_ERROR));
+			}
+			break;
+		case HTTP2_SETTING_INITIAL_WINDOW:
+			if (value > HTTP2_WINDOW_MAX) {
+				return (http2_goaway(c, h2,
+				    HTTP2_FLOW_CONTROL_ERROR));
+			}
+
+			delta = (int64_t)value - h2->peer_window;
+			TAILQ_FOREACH(st, &h2->streams, list) {
+				st->send_window += delta;
+				if (st->send_window > HTTP2_WINDOW_MAX) {
+					return (http2_goaway(c, h2,
+					    HTTP2_FLOW_CONTROL_ERROR));
+				}
+			}
+
+			h2->peer_window = value;
+			break;
+		case HTTP2_SETTING_MAX_FRAME_SIZE:
+			if (value < HTTP2_FRAME_MAX ||
+			    value > HTTP2_FRAME_LIMIT) {
+				return (http2_goaway(c, h2,
+				    HTTP2_PROTOCOL_ERROR));
+			}
+			h2->peer_frame = value;
+			break;
+		default:
+			/*
+			 * The encoder never uses the dynamic table, so the
+			 * peer its table size does not matter to us.
+			 */
+			break;
+		}
+	}
+
+	http2_frame_send(c, HTTP2_FRAME_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+	http2_stream_resume(c, h2);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_frame_window_update(struct connection *c, struct http2_session *h2,
+    u_int32_t id, u_int8_t *data, size_t len)
+{
+	struct http2_stream	*st;
+	u_int32_t		inc;
+
+	if (len != 4)
+		return (http2_goaway(c, h2, HTTP2_FRAME_SIZE_ERROR));
+
+	inc = net_read32(data) & HTTP2_WINDOW_MAX;
+
+	if (id == 0) {
+		if (inc == 0)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+
+		h2->send_window += inc;
+		if (h2->send_window > HTTP2_WINDOW_MAX)
+			return (http2_goaway(c, h2, HTTP2_FLOW_CONTROL_ERROR));
+
+		http2_stream_resume(c, h2);
+		return (KORE_RESULT_OK);
+	}
+
+	if ((st = http2_stream_lookup(h2, id)) == NULL) {
+		if (id > h2->last_id)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+		return (KORE_RESULT_OK);
+	}
+
+	if (inc == 0) {
+		http2_stream_reset(c, h2, st, HTTP2_PROTOCOL_ERROR);
+		return (KORE_RESULT_OK);
+	}
+
+	st->send_window += inc;
+	if (st->send_window > HTTP2_WINDOW_MAX) {
+		http2_stream_reset(c, h2, st, HTTP2_FLOW_CONTROL_ERROR);
+		return (KORE_RESULT_OK);
+	}
+
+	if (st->data_kind != HTTP2_DATA_NONE && http2_stream_send(c, h2, st))
+		http2_stream_done(c, h2, st);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_frame_rst_stream(struct connection *c, struct http2_session *h2,
+    u_int32_t id, u_int8_t *data, size_t len)
+{
+	struct http2_stream	*st;
+
+	if (id == 0)
+		return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+
+	if (len != 4)
+		return (http2_goaway(c, h2, HTTP2_FRAME_SIZE_ERROR));
+
+	if ((st = http2_stream_lookup(h2, id)) == NULL) {
+		if (id > h2->last_id)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+		return (KORE_RESULT_OK);
+	}
+
+	http2_stream_detach(st);
+	http2_stream_free(c, h2, st);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_headers_complete(struct connection *c, struct http2_session *h2,
+    u_int32_t id, u_int8_t flags, const u_int8_t *block, size_t len)
+{
+	struct kore_buf		*out;
+	struct http2_stream	*st;
+	int			malformed;
+
+	malformed = 0;
+
+	/* Trailers, or headers for a stream we no longer care about. */
+	if ((st = http2_stream_lookup(h2, id)) != NULL ||
+	    id <= h2->last_id || (id & 0x01) == 0 ||
+	    (h2->flags & HTTP2_SESSION_GOAWAY) ||
+	    h2->nstreams >= http2_max_streams) {
+		if (!hpack_decode(&h2->dec, block, len, NULL, &malformed))
+			return (http2_goaway(c, h2, HTTP2_COMPRESSION_ERROR));
+
+		if (st != NULL) {
+			if ((st->flags & HTTP2_STREAM_REMOTE_CLOSED) ||
+			    !(flags & HTTP2_FLAG_END_STREAM)) {
+				http2_stream_reset(c, h2, st,
+				    HTTP2_PROTOCOL_ERROR);
+				return (KORE_RESULT_OK);
+			}
+
+			st->flags |= HTTP2_STREAM_REMOTE_CLOSED;
+			http2_stream_body_end(c, h2, st);
+			return (KORE_RESULT_OK);
+		}
+
+		/* Streams must be opened in order of their id. */
+		if ((id & 0x01) == 0 || id < h2->last_id)
+			return (http2_goaway(c, h2, HTTP2_PROTOCOL_ERROR));
+
+		if (id > h2->last_id) {
+			h2->last_id = id;
+			http2_rst_send(c, id, HTTP2_REFUSED_STREAM);
+		}
+
+		return (KORE_RESULT_OK);
+	}
+
+	h2->last_id = id;
+
+	out = kore_buf_alloc(len * 2);
+	if (!hpack_decode(&h2->dec, block, len, out, &malformed)) {
+		kore_buf_free(out);
+		return (http2_goaway(c, h2, HTTP2_COMPRESSION_ERROR));
+	}
+
+	st = http2_stream_new(h2, id);
+	if (flags & HTTP2_FLAG_END_STREAM)
+		st->flags |= HTTP2_STREAM_REMOTE_CLOSED;
+
+	if (malformed) {
+		kore_buf_free(out);
+		http2_stream_reset(c, h2, st, HTTP2_PROTOCOL_ERROR);
+		return (KORE_RESULT_OK);
+	}
+
+	http2_request_create(c, h2, st, flags, out);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+http2_request_create(struct connection *c, struct http2_session *h2,
+    struct http2_stream *st, u_int8_t flags, struct kore_buf *out)
+{
+	struct http_request	*req;
+	size_t			len;
+	int			regular, cnt;
+	char			*p, *end, *name, *value, *hbuf;
+	char			*method, *path, *scheme, *authority, *host;
+
+	method = NULL;
+	path = NULL;
+	scheme = NULL;
+	authority = NULL;
+	host = NULL;
+	regular = 0;
+
+	hbuf = (char *)kore_buf_release(out, &len);
+	p = hbuf;
+	end = hbuf + len;
+
+	/* Pseudo-headers first, exactly once each. */
+	while (p < end) {
+		name = p;
+		p += strlen(name) + 1;
+		value = p;
+		p += strlen(value) + 1;
+
+		if (*name != ':') {
+			regular = 1;
+			if (!strcmp(name, "host") && host == NULL)
+				host = value;
+			continue;
+		}
+
+		if (regular)
+			goto malformed;
+
+		if (!strcmp(name, ":method") && method == NULL)
+			method = value;
+		else if (!strcmp(name, ":path") && path == NULL)
+			path = value;
+		else if (!strcmp(name, ":scheme") && scheme == NULL)
+			scheme = value;
+		else if (!strcmp(name, ":authority") && authority == NULL)
+			authority = value;
+		else
+			goto malformed;
+	}
+
+	if (method == NULL || path == NULL || scheme == NULL || *path == '\0')
+		goto malformed;
+
+	if (authority != NULL && *authority != '\0')
+		host = authority;
+
+	h2->cur = st;
+
+	if (host == NULL || *host == '\0') {
+		kore_free(hbuf);
+		http2_response(c, NULL, HTTP_STATUS_BAD_REQUEST, NULL, 0);
+		h2->cur = NULL;
+		return;
+	}
+
+	/*
+	 * On failure http_request_new() already answered the stream and
+	 * it may have been released along with the request.
+	 */
+	if ((req = http_request_new(c, host, method, path, "HTTP/2")) == NULL) {
+		kore_free(hbuf);
+		h2->cur = NULL;
+		return;
+	}
+
+	req->headers = (u_int8_t *)hbuf;
+
+	/* Same cap as HTTP/1, anything past it is not looked at. */
+	cnt = 0;
+	for (p = hbuf; p < end && cnt < HTTP_REQ_HEADER_MAX - 1; ) {
+		name = p;
+		p += strlen(name) + 1;
+		value = p;
+		p += strlen(value) + 1;
+
+		if (*name == ':' || !strcmp(name, "host"))
+			continue;
+
+		http_request_header_add(req, name, value);
+		cnt++;
+	}
+
+	(void)http_request_header(req, "user-agent", &req->agent);
+	(void)http_request_header(req, "referer", &req->referer);
+
+	if (!http_ratelimit_check(req) || !http_overload_check(req)) {
+		h2->cur = NULL;
+		return;
+	}
+
+	if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
+		if (flags & HTTP2_FLAG_END_STREAM) {
+			req->content_length = 0;
+			(void)http_body_setup(req);
+		} else if (http_body_max == 0) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http2_response(c, NULL,
+			    HTTP_STATUS_METHOD_NOT_ALLOWED, NULL, 0);
+		} else if (http_request_header_uint64(req, "content-length",
+		    &req->content_length)) {
+			if (!http_body_setup(req))
+				req->flags |= HTTP_REQUEST_DELETE;
+		} else {
+			st->flags |= HTTP2_STREAM_BODY_BUFFER;
+		}
+	}
+
+	if (!(req->flags & HTTP_REQUEST_DELETE) &&
+	    req->rt->on_headers != NULL) {
+		if (!kore_runtime_http_request(req->rt->on_headers, req))
+			req->flags |= HTTP_REQUEST_DELETE;
+	}
+
+	h2->cur = NULL;
+	return;
+
+malformed:
+	kore_free(hbuf);
+	http2_stream_reset(c, h2, st, HTTP2_PROTOCOL_ERROR);
+}
+
+static int
+http2_goaway(struct connection *c, struct http2_session *h2, u_int32_t code)
+{
+	u_int8_t	data[8];
+
+	net_write32(&data[0], h2->last_id);
+	net_write32(&data[4], code);
+
+	http2_frame_send(c, HTTP2_FRAME_GOAWAY, 0, 0, data, sizeof(data));
+	h2->flags |= HTTP2_SESSION_GOAWAY;
+
+	(void)net_send_flush(c);
+
+	return (KORE_RESULT_ERROR);
+}
+
+static void
+http2_frame_send(struct connection *c, u_int8_t type, u_int8_t flags,
+    u_int32_t id, const void *data, size_t len)
+{
+	struct netbuf		*nb;
+	u_int8_t		*p;
+
+	nb = net_send_reserve(c, HTTP2_FRAME_HDR_LEN + len);
+	p = nb->buf + nb->b_len;
+
+	http2_frame_header(p, type, flags, id, len);
+	if (len > 0)
+		memcpy(p + HTTP2_FRAME_HDR_LEN, data, len);
+
+	nb->b_len += HTTP2_FRAME_HDR_LEN + len;
+}
+
+static void
+http2_frame_header(u_int8_t *p, u_int8_t type, u_int8_t flags, u_int32_t id,
+    size_t len)
+{
+	p[0] = (len >> 16) & 0xff;
+	p[1] = (len >> 8) & 0xff;
+	p[2] = len & 0xff;
+	p[3] = type;
+	p[4] = flags;
+	net_write32(&p[5], id);
+}
+
+static void
+http2_rst_send(struct connection *c, u_int32_t id, u_int32_t code)
+{
+	u_int8_t	data[4];
+
+	net_write32(data, code);
+	http2_frame_send(c, HTTP2_FRAME_RST_STREAM, 0, id, data, sizeof(data));
+}
+
+static void
+http2_window_update_send(struct connection *c, u_int32_t id, u_int32_t inc)
+{
+	u_int8_t	data[4];
+
+	net_write32(data, inc);
+	http2_frame_send(c, HTTP2_FRAME_WINDOW_UPDATE, 0, id,
+	    data, sizeof(data));
+}
+
+static struct http2_stream *
+http2_stream_new(struct http2_session *h2, u_int32_t id)
+{
+	struct http2_stream	*st;
+
+	st = kore_pool_get(&http2_stream_pool);
+	memset(st, 0, sizeof(*st));
+
+	st->id = id;
+	st->send_window = h2->peer_window;
+	st->recv_window = HTTP2_RECV_WINDOW;
+	st->data_kind = HTTP2_DATA_NONE;
+
+	h2->nstreams++;
+	TAILQ_INSERT_TAIL(&h2->streams, st, list);
+
+	return (st);
+}
+
+static struct http2_stream *
+http2_stream_lookup(struct http2_session *h2, u_int32_t id)
+{
+	struct http2_stream	*st;
+
+	TAILQ_FOREACH(st, &h2->streams, list) {
+		if (st->id == id)
+			return (st);
+	}
+
+	return (NULL);
+}
+
+static void
+http2_stream_free(struct connection *c, struct http2_session *h2,
+    struct http2_stream *st)
+{
+	http2_stream_release(c, st);
+
+	if (st->body != NULL)
+		kore_buf_free(st->body);
+
+	if (h2->cur == st)
+		h2->cur = NULL;
+
+	h2->nstreams--;
+	TAILQ_REMOVE(&h2->streams, st, list);
+	kore_pool_put(&http2_stream_pool, st);
+}
+
+/*
+ * A stream goes away once its request is gone and the response was
+ * fully queued. If the client is still sending we tell it to stop.
+ */
+static void
+http2_stream_done(struct connection *c, struct http2_session *h2,
+    struct http2_stream *st)
+{
+	if (st->req != NULL || !(st->flags & HTTP2_STREAM_LOCAL_CLOSED))
+		return;
+
+	if (!(st->flags & HTTP2_STREAM_REMOTE_CLOSED))
+		http2_rst_send(c, st->id, HTTP2_NO_ERROR);
+
+	http2_stream_free(c, h2, st);
+}
+
+static void
+http2_stream_reset(struct connection *c, struct http2_session *h2,
+    struct http2_stream *st, u_int32_t code)
+{
+	if (st == NULL)
+		return;
+
+	http2_rst_send(c, st->id, code);
+	http2_stream_detach(st);
+	http2_stream_free(c, h2, st);
+}
+
+/* Let go of the request, it is cleaned up by http_process(). */
+static void
+http2_stream_detach(struct http2_stream *st)
+{
+	struct http_request	*req;
+
+	if ((req = st->req) == NULL)
+		return;
+
+	TAILQ_REMOVE(&req->owner->http_requests, req, olist);
+
+	req->owner = NULL;
+	req->stream = NULL;
+	req->flags |= HTTP_REQUEST_DELETE;
+	http_request_wakeup(req);
+
+	st->req = NULL;
+}
+
+static void
+http2_stream_body(struct connection *c, struct http2_session *h2,
+    struct http2_stream *st, const u_int8_t *data, size_t len)
+{
+	struct http_request	*req;
+
+	req = st->req;
+	if (req == NULL || (req->flags & HTTP_REQUEST_DELETE) || len == 0)
+		return;
+
+	h2->cur = st;
+
+	if (st->flags & HTTP2_STREAM_BODY_BUFFER) {
+		if (st->body == NULL)
+			st->body = kore_buf_alloc(len);
+
+		if (st->body->offset + len > http_body_max) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http2_response(c, NULL,
+			    HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE, NULL, 0);
+		} else {
+			kore_buf_append(st->body, data, len);
+		}
+	} else if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
+		if (len > req->content_length) {
+			http2_stream_reset(c, h2, st, HTTP2_PROTOCOL_ERROR);
+			return;
+		}
+		(void)http_body_update(req, data, len);
+	} else if (req->http_body_length > 0) {
+		/* More data than the content-length announced. */
+		http2_stream_reset(c, h2, st, HTTP2_PROTOCOL_ERROR);
+		return;
+	}
+
+	h2->cur = NULL;
+}
+
+static void
+http2_stream_body_end(struct connection *c, struct http2_session *h2,
+    struct http2_stream *st)
+{
+	struct http_request	*req;
+
+	req = st->req;
+	if (req == NULL || (req->flags & HTTP_REQUEST_DELETE)) {
+		http2_stream_done(c, h2, st);
+		return;
+	}
+
+	h2->cur = st;
+
+	if (st->flags & HTTP2_STREAM_BODY_BUFFER) {
+		st->flags &= ~HTTP2_STREAM_BODY_BUFFER;
+		req->content_length = (st->body != NULL) ? st->body->offset : 0;
+
+		if (http_body_setup(req) && req->content_length > 0)
+			(void)http_body_update(req, st->body->data,
+			    st->body->offset);
+
+		if (st->body != NULL) {
+			kore_buf_free(st->body);
+			st->body = NULL;
+		}
+	} else if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
+		/* The stream ended before the announced content-length. */
+		http2_stream_reset(c, h2, st, HTTP2_PROTOCOL_ERROR);
+		return;
+	}
+
+	h2->cur = NULL;
+}
+
+/*
+ * Queue as much of the pending response body as the flow control windows
+ * allow. Returns 1 once the body has been queued completely.
+ */
+static int
+http2_stream_send(struct connection *c, struct http2_session *h2,
+    struct http2_stream *st)
+{
+	struct netbuf		*nb;
+	int64_t			window;
+	size_t			len;
+	u_int8_t		flags;
+	int			last;
+
+	while (st->data_off < st->data_len) {
+		window = MIN(st->send_window, h2->send_window);
+		if (window <= 0)
+			return (0);
+
+		len = MIN(st->data_len - st->data_off, h2->peer_frame);
+		len = MIN(len, (size_t)window);
+
+		last = (st->data_off + len == st->data_len);
+		flags = last ? HTTP2_FLAG_END_STREAM : 0;
+
+		switch (st->data_kind) {
+		case HTTP2_DATA_COPY:
+			http2_frame_send(c, HTTP2_FRAME_DATA, flags, st->id,
+			    st->data_src + st->data_off, len);
+			break;
+		case HTTP2_DATA_BUF:
+			http2_frame_send(c, HTTP2_FRAME_DATA, flags, st->id,
+			    st->data_ptr + st->data_off, len);
+			break;
+		case HTTP2_DATA_PTR:
+			nb = net_send_reserve(c, HTTP2_FRAME_HDR_LEN);
+			http2_frame_header(nb->buf + nb->b_len,
+			    HTTP2_FRAME_DATA, flags, st->id, len);
+			nb->b_len += HTTP2_FRAME_HDR_LEN;
+
+			/* The callback only fires for the final frame. */
+			net_send_stream(c, st->data_ptr + st->data_off, len,
+			    last ? st->data_cb : NULL, &nb);
+			nb->extra = st->data_arg;
+			if (last)
+				st->data_cb = NULL;
+			break;
+		case HTTP2_DATA_REF:
+			nb = net_send_reserve(c, HTTP2_FRAME_HDR_LEN);
+			http2_frame_header(nb->buf + nb->b_len,
+			    HTTP2_FRAME_DATA, flags, st->id, len);
+			nb->b_len += HTTP2_FRAME_HDR_LEN;
+
+			kore_fileref_retain(st->data_ref);
+			net_send_fileref_range(c, st->data_ref,
+			    st->data_off, len);
+			break;
+		default:
+			fatal("http2_stream_send: bad kind %d", st->data_kind);
+		}
+
+		st->data_off += len;
+		st->send_window -= len;
+		h2->send_window -= len;
+	}
+
+	http2_stream_release(c, st);
+	st->flags |= HTTP2_STREAM_LOCAL_CLOSED;
+
+	return (1);
+}
+
+static void
+http2_stream_resume(struct connection *c, struct http2_session *h2)
+{
+	struct http2_stream	*st, *next;
+
+	for (st = TAILQ_FIRST(&h2->streams); st != NULL; st = next) {
+		next = TAILQ_NEXT(st, list);
+
+		if (h2->send_window <= 0)
+			break;
+
+		if (st->data_kind == HTTP2_DATA_NONE)
+			continue;
+
+		if (http2_stream_send(c, h2, st))
+			http2_stream_done(c, h2, st);
+	}
+}
+
+static void
+http2_stream_release(struct connection *c, struct http2_stream *st)
+{
+	switch (st->data_kind) {
+	case HTTP2_DATA_BUF:
+		kore_buf_free(st->data_buf);
+		st->data_buf = NULL;
+		break;
+	case HTTP2_DATA_PTR:
+		if (st->data_cb != NULL)
+			http2_stream_callback(c, st->data_cb, st->data_arg);
+		st->data_cb = NULL;
+		break;
+	case HTTP2_DATA_REF:
+		kore_fileref_release(st->data_ref);
+		st->data_ref = NULL;
+		break;
+	default:
+		break;
+	}
+
+	st->data_kind = HTTP2_DATA_NONE;
+	st->data_src = NULL;
+	st->data_ptr = NULL;
+}
+
+/*
+ * Send what we can right away straight from the caller its memory and
+ * only copy the remainder if the windows are too small.
+ */
+static void
+http2_stream_copy(struct connection *c, struct http2_session *h2,
+    struct http2_stream *st, const void *d, size_t len)
+{
+	st->data_kind = HTTP2_DATA_COPY;
+	st->data_src = d;
+	st->data_off = 0;
+	st->data_len = len;
+
+	if (http2_stream_send(c, h2, st)) {
+		http2_stream_done(c, h2, st);
+		return;
+	}
+
+	st->data_buf = kore_buf_alloc(len - st->data_off);
+	kore_buf_append(st->data_buf, st->data_src + st->data_off,
+	    len - st->data_off);
+
+	st->data_kind = HTTP2_DATA_BUF;
+	st->data_ptr = st->data_buf->data;
+	st->data_len = st->data_buf->offset;
+	st->data_off = 0;
+}
+
+/* Run a send completion callback for data that never hit a netbuf. */
+static void
+http2_stream_callback(struct connection *c, int (*cb)(struct netbuf *),
+    void *arg)
+{
+	struct netbuf		nb;
+
+	memset(&nb, 0, sizeof(nb));
+
+	nb.owner = c;
+	nb.extra = arg;
+	nb.type = NETBUF_SEND;
+	nb.flags = NETBUF_IS_STREAM;
+
+	(void)cb(&nb);
+}
+
+/*
+ * Decode a header block into out as consecutive "name\0value\0" pairs.
+ * With out set to NULL the block is only decoded to keep the dynamic
+ * table in sync. Fields that are not acceptable set *malformed.
+ */
+static int
+hpack_decode(struct hpack_table *tbl, const u_int8_t *data, size_t len,
+    struct kore_buf *out, int *malformed)
+{
+	const u_int8_t		*p, *end;
+	size_t			idx, nlen, vlen, total;
+	const char		*name, *value;
+	int			cookies, prefix, add;
+
+	p = data;
+	end = data + len;
+	total = 0;
+	cookies = 0;
+
+	kore_buf_reset(http2_cookie);
+
+	while (p < end) {
+		add = 0;
+		kore_buf_reset(http2_field);
+
+		if (*p & 0x80) {
+			if (!hpack_decode_int(&p, end, 7, &idx))
+				return (KORE_RESULT_ERROR);
+			if (!hpack_lookup(tbl, idx, &name, &nlen,
+			    &value, &vlen))
+				return (KORE_RESULT_ERROR);
+		} else if ((*p & 0xe0) == 0x20) {
+			if (!hpack_decode_int(&p, end, 5, &idx))
+				return (KORE_RESULT_ERROR);
+			if (idx > HPACK_TABLE_SIZE)
+				return (KORE_RESULT_ERROR);
+			tbl->max = idx;
+			hpack_table_evict(tbl, 0);
+			continue;
+		} else {
+			if (*p & 0x40) {
+				prefix = 6;
+				add = 1;
+			} else {
+				prefix = 4;
+			}
+
+			if (!hpack_decode_int(&p, end, prefix, &idx))
+				return (KORE_RESULT_ERROR);
+
+			if (idx == 0) {
+				if (!hpack_decode_string(&p, end, http2_field))
+					return (KORE_RESULT_ERROR);
+				name = NULL;
+				nlen = http2_field->offset;
+			} else {
+				if (!hpack_lookup(tbl, idx, &name, &nlen,
+				    NULL, NULL))
+					return (KORE_RESULT_ERROR);
+				kore_buf_append(http2_field, name, nlen);
+			}
+
+			if (!hpack_decode_string(&p, end, http2_field))
+				return (KORE_RESULT_ERROR);
+
+			name = (const char *)http2_field->data;
+			value = name + nlen;
+			vlen = http2_field->offset - nlen;
+
+			if (add)
+				hpack_table_add(tbl, name, nlen, value, vlen);
+		}
+
+		if (out == NULL)
+			continue;
+
+		if (!hpack_field_valid(name, nlen, value, vlen)) {
+			*malformed = 1;
+			continue;
+		}
+
+		total += nlen + vlen + HPACK_ENTRY_OVERHEAD;
+		if (total > http_header_max) {
+			*malformed = 1;
+			continue;
+		}
+
+		/* Cookie crumbs are joined back into a single header. */
+		if (nlen == 6 && !memcmp(name, "cookie", 6)) {
+			if (cookies++ > 0)
+				kore_buf_append(http2_cookie, "; ", 2);
+			kore_buf_append(http2_cookie, value, vlen);
+			continue;
+		}
+
+		kore_buf_append(out, name, nlen);
+		kore_buf_append(out, "", 1);
+		kore_buf_append(out, value, vlen);
+		kore_buf_append(out, "", 1);
+	}
+
+	if (out != NULL && cookies > 0) {
+		kore_buf_append(out, "cookie", 7);
+		kore_buf_append(out, http2_cookie->data, http2_cookie->offset);
+		kore_buf_append(out, "", 1);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+hpack_decode_int(const u_int8_t **p, const u_int8_t *end, int prefix,
+    size_t *out)
+{
+	size_t		v, mask;
+	int		shift;
+	u_int8_t	b;
+
+	if (*p >= end)
+		return (KORE_RESULT_ERROR);
+
+	mask = (1 << prefix) - 1;
+	v = **p & mask;
+	(*p)++;
+
+	if (v < mask) {
+		*out = v;
+		return (KORE_RESULT_OK);
+	}
+
+	shift = 0;
+	do {
+		if (*p >= end || shift > 28)
+			return (KORE_RESULT_ERROR);
+		b = **p;
+		(*p)++;
+		v += (size_t)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	*out = v;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+hpack_decode_string(const u_int8_t **p, const u_int8_t *end,
+    struct kore_buf *out)
+{
+	size_t		len;
+	int		huffman;
+
+	if (*p >= end)
+		return (KORE_RESULT_ERROR);
+
+	huffman = **p & 0x80;
+	if (!hpack_decode_int(p, end, 7, &len))
+		return (KORE_RESULT_ERROR);
+
+	if (len > (size_t)(end - *p))
+		return (KORE_RESULT_ERROR);
+
+	if (huffman) {
+		if (!hpack_huffman_decode(*p, len, out))
+			return (KORE_RESULT_ERROR);
+	} else {
+		kore_buf_append(out, *p, len);
+	}
+
+	*p += len;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+hpack_huffman_decode(const u_int8_t *data, size_t len, struct kore_buf *out)
+{
+	size_t		i;
+	u_int16_t	next;
+	u_int8_t	sym;
+	int		bit, node, depth, ones;
+
+	node = 0;
+	depth = 0;
+	ones = 1;
+
+	for (i = 0; i < len; i++) {
+		for (bit = 7; bit >= 0; bit--) {
+			next = hpack_tree[node][(data[i] >> bit) & 0x01];
+			if (next == 0)
+				return (KORE_RESULT_ERROR);
+
+			depth++;
+			ones &= (data[i] >> bit) & 0x01;
+
+			if (next & HPACK_HUFFMAN_LEAF) {
+				if ((next & ~HPACK_HUFFMAN_LEAF) ==
+				    HPACK_HUFFMAN_EOS)
+					return (KORE_RESULT_ERROR);
+				sym = next & 0xff;
+				kore_buf_append(out, &sym, 1);
+				node = 0;
+				depth = 0;
+				ones = 1;
+			} else {
+				node = next;
+			}
+		}
+	}
+
+	/* Padding must be a prefix of EOS and shorter than 8 bits. */
+	if (depth > 7 || !ones)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+hpack_lookup(struct hpack_table *tbl, size_t idx, const char **name,
+    size_t *nlen, const char **value, size_t *vlen)
+{
+	struct hpack_entry	*ent;
+
+	if (idx == 0)
+		return (KORE_RESULT_ERROR);
+
+	if (idx <= HPACK_STATIC_ENTRIES) {
+		*name = hpack_static[idx].name;
+		*nlen = hpack_static_nlen[idx];
+		if (value != NULL) {
+			*value = hpack_static[idx].value;
+			*vlen = hpack_static_vlen[idx];
+		}
+		return (KORE_RESULT_OK);
+	}
+
+	idx -= HPACK_STATIC_ENTRIES + 1;
+	if (idx >= tbl->count)
+		return (KORE_RESULT_ERROR);
+
+	ent = &tbl->entries[(tbl->head + HPACK_TABLE_ENTRIES - idx) %
+	    HPACK_TABLE_ENTRIES];
+
+	*name = ent->name;
+	*nlen = ent->nlen;
+	if (value != NULL) {
+		*value = ent->value;
+		*vlen = ent->vlen;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+hpack_table_add(struct hpack_table *tbl, const char *name, size_t nlen,
+    const char *value, size_t vlen)
+{
+	struct hpack_entry	*ent;
+	size_t			size;
+
+	size = nlen + vlen + HPACK_ENTRY_OVERHEAD;
+	if (size > tbl->max) {
+		hpack_table_evict(tbl, tbl->max + 1);
+		return;
+	}
+
+	hpack_table_evict(tbl, size);
+
+	tbl->head = (tbl->head + 1) % HPACK_TABLE_ENTRIES;
+	ent = &tbl->entries[tbl->head];
+
+	ent->name = kore_malloc(nlen + vlen + 1);
+	memcpy(ent->name, name, nlen);
+	memcpy(ent->name + nlen, value, vlen);
+	ent->name[nlen + vlen] = '\0';
+
+	ent->value = ent->name + nlen;
+	ent->nlen = nlen;
+	ent->vlen = vlen;
+
+	tbl->size += size;
+	tbl->count++;
+}
+
+/* Evict the oldest entries until an entry of size would fit. */
+static void
+hpack_table_evict(struct hpack_table *tbl, size_t size)
+{
+	struct hpack_entry	*ent;
+
+	while (tbl->count > 0 && tbl->size + size > tbl->max) {
+		ent = &tbl->entries[(tbl->head + HPACK_TABLE_ENTRIES -
+		    (tbl->count - 1)) % HPACK_TABLE_ENTRIES];
+
+		tbl->size -= ent->nlen + ent->vlen + HPACK_ENTRY_OVERHEAD;
+		tbl->count--;
+
+		kore_free(ent->name);
+		ent->name = NULL;
+		ent->value = NULL;
+	}
+}
+
+static void
+hpack_table_cleanup(struct hpack_table *tbl)
+{
+	tbl->max = 0;
+	hpack_table_evict(tbl, 0);
+}
+
+static int
+hpack_field_valid(const char *name, size_t nlen, const char *value,
+    size_t vlen)
+{
+	size_t		i;
+
+	if (nlen == 0)
+		return (0);
+
+	for (i = 0; i < nlen; i++) {
+		if (name[i] == ':' && i == 0)
+			continue;
+		if (name[i] <= 0x20 || name[i] == 0x7f ||
+		    isupper((unsigned char)name[i]) || name[i] == ':')
+			return (0);
+	}
+
+	for (i = 0; i < vlen; i++) {
+		if (value[i] == '\0' || value[i] == '\r' || value[i] == '\n')
+			return (0);
+	}
+
+	/* No connection-specific header fields in HTTP/2. */
+	if ((nlen == 10 && !memcmp(name, "connection", 10)) ||
+	    (nlen == 10 && !memcmp(name, "keep-alive", 10)) ||
+	    (nlen == 16 && !memcmp(name, "proxy-connection", 16)) ||
+	    (nlen == 17 && !memcmp(name, "transfer-encoding", 17)) ||
+	    (nlen == 7 && !memcmp(name, "upgrade", 7)))
+		return (0);
+
+	if (nlen == 2 && !memcmp(name, "te", 2) &&
+	    (vlen != 8 || memcmp(value, "trailers", 8)))
+		return (0);
+
+	return (1);
+}
+
+static int
+hpack_static_name(const char *name, size_t len)
+{
+	int		idx;
+
+	for (idx = 1; idx <= HPACK_STATIC_ENTRIES; idx++) {
+		if (hpack_static_nlen[idx] == len &&
+		    !strncasecmp(hpack_static[idx].name, name, len))
+			return (idx);
+	}
+
+	return (0);
+}
+
+static void
+hpack_encode_int(struct kore_buf *buf, u_int8_t first, int prefix, size_t v)
+{
+	u_int8_t	b[16];
+	size_t		mask, n;
+
+	mask = (1 << prefix) - 1;
+
+	if (v < mask) {
+		b[0] = first | v;
+		kore_buf_append(buf, b, 1);
+		return;
+	}
+
+	n = 0;
+	b[n++] = first | mask;
+	v -= mask;
+
+	while (v >= 128) {
+		b[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+
+	b[n++] = v;
+	kore_buf_append(buf, b, n);
+}
+
+/*
+ * Encode a literal field without indexing, using the static table for
+ * the name when possible. Names are sent in lowercase as required.
+ */
+static void
+hpack_encode_field(struct kore_buf *buf, int idx, const char *name,
+    size_t nlen, const char *value, size_t vlen)
+{
+	size_t		i, off;
+
+	if (idx != 0) {
+		hpack_encode_int(buf, 0x00, 4, idx);
+	} else {
+		kore_buf_append(buf, "", 1);
+		hpack_encode_int(buf, 0x00, 7, nlen);
+
+		off = buf->offset;
+		kore_buf_append(buf, name, nlen);
+		for (i = off; i < buf->offset; i++)
+			buf->data[i] = tolower(buf->data[i]);
+	}
+
+	hpack_encode_int(buf, 0x00, 7, vlen);
+	kore_buf_append(buf, value, vlen);
+}
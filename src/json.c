@@ -18,13 +18,86 @@
 
 #include <float.h>
 #include <inttypes.h>
+#include <math.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__PCLMUL__)
+#include <wmmintrin.h>
+#endif
+
 #include "kore.h"
 
+/*
+ * The indexed parser classifies its input in blocks of 64 bytes so that
+ * every class of character fits in a single 64-bit mask. The working copy
+ * of the input is padded with one block worth of zeroes so the last block
+ * can always be loaded whole and so the scalar parsers may look ahead.
+ */
+#define JSON_BLOCK		64
+
+#if defined(__AVX2__)
+#define JSON_LANE		32
+typedef __m256i			json_vec;
+#define JSON_LOAD(p)		_mm256_loadu_si256((const __m256i *)(p))
+#define JSON_SET(c)		_mm256_set1_epi8((char)(c))
+#define JSON_EQ(v, c)		_mm256_cmpeq_epi8((v), JSON_SET(c))
+#define JSON_OR(a, b)		_mm256_or_si256((a), (b))
+#define JSON_MAX(a, b)		_mm256_max_epu8((a), (b))
+#define JSON_MASK(v)		\
+    ((u_int64_t)(u_int32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+#define JSON_LANE		16
+typedef __m128i			json_vec;
+#define JSON_LOAD(p)		_mm_loadu_si128((const __m128i *)(p))
+#define JSON_SET(c)		_mm_set1_epi8((char)(c))
+#define JSON_EQ(v, c)		_mm_cmpeq_epi8((v), JSON_SET(c))
+#define JSON_OR(a, b)		_mm_or_si128((a), (b))
+#define JSON_MAX(a, b)		_mm_max_epu8((a), (b))
+#define JSON_MASK(v)		((u_int64_t)(u_int16_t)_mm_movemask_epi8(v))
+#endif
+
+/* Character classes of a single block, one bit per input byte. */
+struct json_block {
+	u_int64_t	quote;
+	u_int64_t	bslash;
+	u_int64_t	op;
+	u_int64_t	open;
+	u_int64_t	ws;
+	u_int64_t	ctrl;
+	u_int64_t	high;
+};
+
+/* Offsets of all structural characters found by the first stage. */
+struct json_index {
+	u_int32_t	*pos;
+	size_t		len;
+	size_t		cap;
+	size_t		values;
+};
+
+/* Objects with fewer items than this are searched by walking them. */
+#define JSON_KEYS_MIN		8
+
+struct json_key_slot {
+	u_int32_t		hash;
+	struct kore_json_item	*item;
+};
+
+/* Open addressed index of the names in an object, the first name wins. */
+struct kore_json_keys {
+	u_int32_t		mask;
+	struct json_key_slot	slots[];
+};
+
 static int	json_guess_type(u_int8_t, u_int32_t *);
 static int	json_next(struct kore_json *, u_int8_t *);
 static int	json_peek(struct kore_json *, u_int8_t *);
@@ -40,16 +113,66 @@ static int	json_parse_string(struct kore_json *, struct kore_json_item *);
 static int	json_parse_number(struct kore_json *, struct kore_json_item *);
 static int	json_parse_literal(struct kore_json *, struct kore_json_item *);
 
+static int		json_index_build(struct kore_json *,
+			    struct json_index *);
+static void		json_index_classify(const u_int8_t *,
+			    struct json_block *);
+static u_int64_t	json_index_escaped(u_int64_t, u_int64_t *);
+static u_int64_t	json_index_prefix_xor(u_int64_t);
+static int		json_utf8_validate(const u_int8_t *, size_t);
+
+static int	json_tape_build(struct kore_json *, struct json_index *);
+static char	*json_tape_string(struct kore_json *, u_int32_t, u_int32_t);
+static int	json_tape_number(struct kore_json *,
+		    struct kore_json_item *, u_int32_t);
+static int	json_tape_literal(struct kore_json *,
+		    struct kore_json_item *, u_int32_t);
+static int	json_tape_hex(const u_int8_t *, u_int32_t *);
+static int	json_tape_delimiter(struct kore_json *, const u_int8_t *);
+
+static struct kore_json_item	*json_tape_item(struct kore_json *,
+				    u_int32_t, char *, struct kore_json_item *);
 static struct kore_json_item	*json_item_alloc(int, const char *,
 				    struct kore_json_item *);
+static struct kore_json_item	*json_item_new(void);
 static struct kore_json_item	*json_find_item(struct kore_json_item *,
-				    char **, u_int32_t, int);
+				    const struct kore_json_path *, u_int32_t, int);
+static struct kore_json_item	*json_find_child(struct kore_json_item *,
+				    const struct kore_json_path_seg *);
+
+static int		json_path_parse(struct kore_json_path *, const char *);
+static int		json_key_equal(const char *,
+			    const struct kore_json_path_seg *);
+static u_int32_t	json_key_hash(const char *, size_t);
+static void		json_keys_build(struct kore_json_item *);
+static void		json_keys_drop(struct kore_json_item *);
+
+static void	json_item_write(struct kore_json_item *,
+		    void (*)(void *, const void *, size_t), void *);
+static void	json_write_buf(void *, const void *, size_t);
+
+static void	json_writer_value(struct kore_json_writer *);
+static void	json_writer_out(struct kore_json_writer *,
+		    const void *, size_t);
+static void	json_writer_open(struct kore_json_writer *, int, u_int8_t);
+static void	json_writer_close(struct kore_json_writer *, int, u_int8_t);
+static void	json_writer_escaped(struct kore_json_writer *, const char *);
+static char	*json_writer_u64(char *, u_int64_t);
+static void	json_write_rope(void *, const void *, size_t);
 
 static u_int8_t		json_null_literal[] = { 'n', 'u', 'l', 'l' };
 static u_int8_t		json_true_literal[] = { 't', 'r', 'u', 'e' };
 static u_int8_t		json_false_literal[] = { 'f', 'a', 'l', 's', 'e' };
 
 static int		json_errno = 0;
+static struct kore_pool	json_item_pool;
+
+static const char	json_digits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
 
 static const char *json_errtab[] = {
 	"no error",
@@ -63,9 +186,17 @@ static const char *json_errtab[] = {
 	"invalid JSON",
 	"invalid search query specified",
 	"item not found",
-	"item found, but not expected value"
+	"item found, but not expected value",
+	"invalid UTF-8 in JSON"
 };
 
+void
+kore_json_pool_init(void)
+{
+	kore_pool_init(&json_item_pool, "json_item_pool",
+	    sizeof(struct kore_json_item), 256);
+}
+
 void
 kore_json_init(struct kore_json *json, const void *data, size_t len)
 {
@@ -119,24 +250,112 @@ kore_json_parse(struct kore_json *json)
 	return (KORE_RESULT_OK);
 }
 
+/*
+ * Parse the JSON document in two stages instead of byte by byte.
+ *
+ * The first stage classifies the input 64 bytes at a time with SIMD
+ * compares, works out which bytes are inside of strings and records the
+ * offset of every structural character. It also validates UTF-8.
+ *
+ * The second stage walks those offsets and lays the items out on a tape,
+ * a single array of items in document order that is linked into the
+ * regular kore_json_item tree. Strings and names point into a private
+ * copy of the input where they are unescaped in place.
+ *
+ * Tape items are owned by the kore_json and are released together with
+ * it in kore_json_cleanup().
+ */
+int
+kore_json_parse_indexed(struct kore_json *json)
+{
+	struct json_index	index;
+	int			ret;
+
+	if (json->root)
+		return (KORE_RESULT_OK);
+
+	json_errno = 0;
+
+	if (json->length > UINT32_MAX - JSON_BLOCK) {
+		json_errno = KORE_JSON_ERR_INVALID_JSON;
+		return (KORE_RESULT_ERROR);
+	}
+
+	json->copy = kore_malloc(json->length + JSON_BLOCK);
+	memcpy(json->copy, json->data, json->length);
+	memset(json->copy + json->length, 0, JSON_BLOCK);
+
+	memset(&index, 0, sizeof(index));
+
+	ret = KORE_RESULT_ERROR;
+	if (json_index_build(json, &index))
+		ret = json_tape_build(json, &index);
+
+	kore_free(index.pos);
+
+	if (ret == KORE_RESULT_ERROR) {
+		if (json_errno == 0)
+			json_errno = KORE_JSON_ERR_INVALID_JSON;
+
+		kore_free(json->tape);
+		kore_free(json->copy);
+
+		json->root = NULL;
+		json->tape = NULL;
+		json->copy = NULL;
+		json->tape_len = 0;
+	}
+
+	return (ret);
+}
+
 struct kore_json_item *
 kore_json_find(struct kore_json_item *root, const char *path, u_int32_t type)
 {
-	struct kore_json_item	*item;
-	char			*copy;
-	char			*tokens[KORE_JSON_DEPTH_MAX + 1];
+	struct kore_json_path	search;
+
+	if (!json_path_parse(&search, path)) {
+		json_errno = KORE_JSON_ERR_INVALID_SEARCH;
+		return (NULL);
+	}
+
+	search.path = NULL;
+
+	return (kore_json_path_find(root, &search, type));
+}
+
+/*
+ * Split up and hash a search path once so it can be used for any number
+ * of documents with kore_json_path_find(), the syntax is the same as
+ * for kore_json_find().
+ */
+struct kore_json_path *
+kore_json_path_compile(const char *str)
+{
+	struct kore_json_path	*path;
 
 	json_errno = 0;
-	copy = kore_strdup(path);
 
-	if (!kore_split_string(copy, "/", tokens, KORE_JSON_DEPTH_MAX)) {
-		kore_free(copy);
+	path = kore_calloc(1, sizeof(*path));
+	path->path = kore_strdup(str);
+
+	if (!json_path_parse(path, path->path)) {
+		kore_json_path_free(path);
 		json_errno = KORE_JSON_ERR_INVALID_SEARCH;
 		return (NULL);
 	}
 
-	item = json_find_item(root, tokens, type, 0);
-	kore_free(copy);
+	return (path);
+}
+
+struct kore_json_item *
+kore_json_path_find(struct kore_json_item *root,
+    const struct kore_json_path *path, u_int32_t type)
+{
+	struct kore_json_item	*item;
+
+	json_errno = 0;
+	item = json_find_item(root, path, type, 0);
 
 	if (item == NULL && json_errno == 0)
 		json_errno = KORE_JSON_ERR_INVALID_SEARCH;
@@ -144,6 +363,16 @@ kore_json_find(struct kore_json_item *root, const char *path, u_int32_t type)
 	return (item);
 }
 
+void
+kore_json_path_free(struct kore_json_path *path)
+{
+	if (path == NULL)
+		return;
+
+	kore_free(path->path);
+	kore_free(path);
+}
+
 void
 kore_json_cleanup(struct kore_json *json)
 {
@@ -152,6 +381,9 @@ kore_json_cleanup(struct kore_json *json)
 
 	kore_buf_cleanup(&json->tmpbuf);
 	kore_json_item_free(json->root);
+
+	kore_free(json->tape);
+	kore_free(json->copy);
 }
 
 int
@@ -177,7 +409,7 @@ kore_json_create_item(struct kore_json_item *parent, const char *name,
 	va_list				args;
 	struct kore_json_item		*item;
 
-	item = kore_calloc(1, sizeof(*item));
+	item = json_item_new();
 	item->type = type;
 
 	va_start(args, type);
@@ -219,6 +451,7 @@ kore_json_create_item(struct kore_json_item *parent, const char *name,
 			    __func__, parent->type);
 		}
 
+		json_keys_drop(parent);
 		TAILQ_INSERT_TAIL(&parent->data.items, item, list);
 	}
 
@@ -230,66 +463,13 @@ kore_json_create_item(struct kore_json_item *parent, const char *name,
 void
 kore_json_item_tobuf(struct kore_json_item *item, struct kore_buf *buf)
 {
-	struct kore_json_item	*nitem;
-
-	if (item->name)
-		kore_buf_appendf(buf, "\"%s\":", item->name);
-
-	switch (item->type) {
-	case KORE_JSON_TYPE_OBJECT:
-		kore_buf_appendf(buf, "{");
-		TAILQ_FOREACH(nitem, &item->data.items, list) {
-			kore_json_item_tobuf(nitem, buf);
-
-			if (TAILQ_NEXT(nitem, list))
-				kore_buf_appendf(buf, ",");
-		}
-		kore_buf_appendf(buf, "}");
-		break;
-	case KORE_JSON_TYPE_ARRAY:
-		kore_buf_appendf(buf, "[");
-		TAILQ_FOREACH(nitem, &item->data.items, list) {
-			kore_json_item_tobuf(nitem, buf);
+	json_item_write(item, json_write_buf, buf);
+}
 
-			if (TAILQ_NEXT(nitem, list))
-				kore_buf_appendf(buf, ",");
-		}
-		kore_buf_appendf(buf, "]");
-		break;
-	case KORE_JSON_TYPE_STRING:
-		kore_buf_appendf(buf, "\"%s\"", item->data.string);
-		break;
-	case KORE_JSON_TYPE_NUMBER:
-		kore_buf_appendf(buf, "%f", item->data.number);
-		break;
-	case KORE_JSON_TYPE_INTEGER:
-		kore_buf_appendf(buf, "%" PRId64, item->data.integer);
-		break;
-	case KORE_JSON_TYPE_INTEGER_U64:
-		kore_buf_appendf(buf, "%" PRIu64, item->data.u64);
-		break;
-	case KORE_JSON_TYPE_LITERAL:
-		switch (item->data.literal) {
-		case KORE_JSON_TRUE:
-			kore_buf_append(buf,
-			    json_true_literal, sizeof(json_true_literal));
-			break;
-		case KORE_JSON_FALSE:
-			kore_buf_append(buf,
-			    json_false_literal, sizeof(json_false_literal));
-			break;
-		case KORE_JSON_NULL:
-			kore_buf_append(buf,
-			    json_null_literal, sizeof(json_null_literal));
-			break;
-		default:
-			fatal("%s: unknown literal %d", __func__,
-			    item->data.literal);
-		}
-		break;
-	default:
-		fatal("%s: unknown type %d", __func__, item->type);
-	}
+void
+kore_json_item_torope(struct kore_json_item *item, struct kore_rope *rope)
+{
+	json_item_write(item, json_write_rope, rope);
 }
 
 void
@@ -307,181 +487,601 @@ kore_json_item_attach(struct kore_json_item *parent,
 		    __func__, parent->type);
 	}
 
+	json_keys_drop(parent);
 	TAILQ_INSERT_TAIL(&parent->data.items, item, list);
 }
 
-static struct kore_json_item *
-json_find_item(struct kore_json_item *object, char **tokens,
-    u_int32_t type, int pos)
+void
+kore_json_writer_init(struct kore_json_writer *w)
 {
-	char			*p, *str;
-	struct kore_json_item	*item, *nitem;
-	int			err, idx, spot;
+	memset(w, 0, sizeof(*w));
+	kore_rope_init(&w->rope);
+}
 
-	if (tokens[pos] == NULL)
-		return (NULL);
+void
+kore_json_writer_cleanup(struct kore_json_writer *w)
+{
+	if (w->cleanup != NULL)
+		w->cleanup(w);
 
-	if (object->type != KORE_JSON_TYPE_OBJECT &&
-	    object->type != KORE_JSON_TYPE_ARRAY)
-		return (NULL);
+	kore_rope_cleanup(&w->rope);
+}
 
-	if ((str = strchr(tokens[pos], '[')) != NULL) {
-		*(str)++ = '\0';
+void
+kore_json_write_key(struct kore_json_writer *w, const char *key)
+{
+	if (w->depth == 0 || !(w->object & ((u_int64_t)1 << (w->depth - 1))))
+		fatal("%s: key outside of an object", __func__);
 
-		if ((p = strchr(str, ']')) == NULL)
-			return (NULL);
+	if (w->flags & KORE_JSON_WRITER_KEY)
+		fatal("%s: key '%s' follows another key", __func__, key);
 
-		*p = '\0';
+	json_writer_value(w);
+	json_writer_escaped(w, key);
+	json_writer_out(w, ":", 1);
 
-		spot = kore_strtonum(str, 10, 0, USHRT_MAX, &err);
-		if (err != KORE_RESULT_OK)
-			return (NULL);
+	w->flags |= KORE_JSON_WRITER_KEY;
+}
+
+void
+kore_json_write_begin_object(struct kore_json_writer *w)
+{
+	json_writer_open(w, 1, '{');
+}
+
+void
+kore_json_write_end_object(struct kore_json_writer *w)
+{
+	json_writer_close(w, 1, '}');
+}
+
+void
+kore_json_write_begin_array(struct kore_json_writer *w)
+{
+	json_writer_open(w, 0, '[');
+}
+
+void
+kore_json_write_end_array(struct kore_json_writer *w)
+{
+	json_writer_close(w, 0, ']');
+}
+
+void
+kore_json_write_string(struct kore_json_writer *w, const char *str)
+{
+	json_writer_value(w);
+	json_writer_escaped(w, str);
+}
+
+void
+kore_json_write_integer(struct kore_json_writer *w, int64_t val)
+{
+	char		*p, num[24];
+
+	json_writer_value(w);
+
+	if (val < 0) {
+		p = json_writer_u64(num + sizeof(num), 0 - (u_int64_t)val);
+		*--p = '-';
 	} else {
-		spot = -1;
+		p = json_writer_u64(num + sizeof(num), (u_int64_t)val);
 	}
 
-	item = NULL;
+	json_writer_out(w, p, (num + sizeof(num)) - p);
+}
 
-	TAILQ_FOREACH(item, &object->data.items, list) {
-		if (item->name && strcmp(item->name, tokens[pos]))
-			continue;
+void
+kore_json_write_integer_u64(struct kore_json_writer *w, u_int64_t val)
+{
+	char		*p, num[24];
 
-		if (item->type == KORE_JSON_TYPE_ARRAY && spot != -1) {
-			idx = 0;
-			nitem = NULL;
-			TAILQ_FOREACH(nitem, &item->data.items, list) {
-				if (idx++ == spot)
-					break;
-			}
+	json_writer_value(w);
 
-			if (nitem == NULL) {
-				json_errno = KORE_JSON_ERR_NOT_FOUND;
-				return (NULL);
-			}
+	p = json_writer_u64(num + sizeof(num), val);
+	json_writer_out(w, p, (num + sizeof(num)) - p);
+}
+
+/*
+ * Numbers with at most six decimals, which is most of them, are written
+ * as an exact fixed point value without going through printf. All other
+ * numbers use the shortest %g that still holds every bit. Either way the
+ * output always has a fraction or exponent so it is read back as a
+ * number and not as an integer.
+ */
+void
+kore_json_write_number(struct kore_json_writer *w, double val)
+{
+	int		len, digits;
+	int64_t		scaled;
+	u_int64_t	frac, whole;
+	char		*p, num[48];
+
+	json_writer_value(w);
 
-			item = nitem;
-		}
-
-		if (tokens[pos + 1] == NULL) {
-			/*
-			 * If an uint64 was required and we find an item
-			 * with the same name but marked as an integer check
-			 * if it can be represented as a uint64.
-			 *
-			 * If it can, reduce the type to integer so we match
-			 * on it as well.
-			 */
-			if (type == KORE_JSON_TYPE_INTEGER_U64 &&
-			    item->type == KORE_JSON_TYPE_INTEGER) {
-				if (item->data.integer >= 0)
-					type = KORE_JSON_TYPE_INTEGER;
+	if (isnan(val) || isinf(val)) {
+		json_writer_out(w, json_null_literal,
+		    sizeof(json_null_literal));
+		return;
+	}
+
+	/* Keeps val * 1e6 within the exact integer range of a double. */
+	if (fabs(val) < 9007199254.0) {
+		scaled = (int64_t)(val * 1e6 + (val < 0 ? -0.5 : 0.5));
+		if ((double)scaled / 1e6 == val) {
+			if (scaled < 0)
+				whole = 0 - (u_int64_t)scaled;
+			else
+				whole = (u_int64_t)scaled;
+			frac = whole % 1000000;
+			whole = whole / 1000000;
+
+			p = num + sizeof(num);
+			if (frac == 0) {
+				*--p = '0';
+			} else {
+				digits = 6;
+				while (frac % 10 == 0) {
+					frac /= 10;
+					digits--;
+				}
+				p = json_writer_u64(p, frac);
+				while ((num + sizeof(num)) - p < digits)
+					*--p = '0';
 			}
 
-			if (item->type == type)
-				return (item);
+			*--p = '.';
+			p = json_writer_u64(p, whole);
+			if (scaled < 0)
+				*--p = '-';
 
-			json_errno = KORE_JSON_ERR_TYPE_MISMATCH;
-			return (NULL);
+			json_writer_out(w, p, (num + sizeof(num)) - p);
+			return;
 		}
+	}
 
-		if (item->type == KORE_JSON_TYPE_OBJECT ||
-		    item->type == KORE_JSON_TYPE_ARRAY) {
-			item = json_find_item(item, tokens, type, pos + 1);
-		} else {
-			item = NULL;
-		}
+	/* Prefer the short form when it survives the round trip. */
+	len = snprintf(num, sizeof(num), "%.15g", val);
+	if (len != -1 && strtod(num, NULL) != val)
+		len = snprintf(num, sizeof(num), "%.17g", val);
 
-		break;
-	}
+	if (len == -1 || (size_t)len >= sizeof(num) - 2)
+		fatal("%s: failed to format number", __func__);
 
-	if (item == NULL && json_errno == 0)
-		json_errno = KORE_JSON_ERR_NOT_FOUND;
+	if (strpbrk(num, ".e") == NULL) {
+		num[len++] = '.';
+		num[len++] = '0';
+	}
 
-	return (item);
+	json_writer_out(w, num, len);
 }
 
 void
-kore_json_item_free(struct kore_json_item *item)
+kore_json_write_literal(struct kore_json_writer *w, int literal)
 {
-	struct kore_json_item	*node;
-
-	if (item == NULL)
-		return;
+	json_writer_value(w);
 
-	switch (item->type) {
-	case KORE_JSON_TYPE_OBJECT:
-	case KORE_JSON_TYPE_ARRAY:
-		while ((node = TAILQ_FIRST(&item->data.items)) != NULL) {
-			TAILQ_REMOVE(&item->data.items, node, list);
-			kore_json_item_free(node);
-		}
+	switch (literal) {
+	case KORE_JSON_TRUE:
+		json_writer_out(w, json_true_literal,
+		    sizeof(json_true_literal));
 		break;
-	case KORE_JSON_TYPE_STRING:
-		kore_free(item->data.string);
+	case KORE_JSON_FALSE:
+		json_writer_out(w, json_false_literal,
+		    sizeof(json_false_literal));
 		break;
-	case KORE_JSON_TYPE_NUMBER:
-	case KORE_JSON_TYPE_LITERAL:
-	case KORE_JSON_TYPE_INTEGER:
-	case KORE_JSON_TYPE_INTEGER_U64:
+	case KORE_JSON_NULL:
+		json_writer_out(w, json_null_literal,
+		    sizeof(json_null_literal));
 		break;
 	default:
-		fatal("%s: unknown type %d", __func__, item->type);
+		fatal("%s: unknown literal %d", __func__, literal);
 	}
-
-	kore_free(item->name);
-	kore_free(item);
 }
 
-static struct kore_json_item *
-json_item_alloc(int type, const char *name, struct kore_json_item *parent)
+/* Writes an existing item tree, its names are used inside of objects. */
+void
+kore_json_write_item(struct kore_json_writer *w, struct kore_json_item *item)
 {
-	struct kore_json_item	*item;
+	struct kore_json_item	*nitem;
 
-	item = kore_calloc(1, sizeof(*item));
-	item->type = type;
-	item->parent = parent;
+	if (item->name != NULL && w->depth > 0 &&
+	    !(w->flags & KORE_JSON_WRITER_KEY) &&
+	    (w->object & ((u_int64_t)1 << (w->depth - 1))))
+		kore_json_write_key(w, item->name);
 
 	switch (item->type) {
 	case KORE_JSON_TYPE_OBJECT:
-		TAILQ_INIT(&item->data.items);
-		item->parse = json_parse_object;
+		kore_json_write_begin_object(w);
+		TAILQ_FOREACH(nitem, &item->data.items, list)
+			kore_json_write_item(w, nitem);
+		kore_json_write_end_object(w);
 		break;
 	case KORE_JSON_TYPE_ARRAY:
-		TAILQ_INIT(&item->data.items);
-		item->parse = json_parse_array;
+		kore_json_write_begin_array(w);
+		TAILQ_FOREACH(nitem, &item->data.items, list)
+			kore_json_write_item(w, nitem);
+		kore_json_write_end_array(w);
 		break;
 	case KORE_JSON_TYPE_STRING:
-		item->parse = json_parse_string;
+		kore_json_write_string(w, item->data.string);
 		break;
 	case KORE_JSON_TYPE_NUMBER:
+		kore_json_write_number(w, item->data.number);
+		break;
 	case KORE_JSON_TYPE_INTEGER:
+		kore_json_write_integer(w, item->data.integer);
+		break;
 	case KORE_JSON_TYPE_INTEGER_U64:
-		item->parse = json_parse_number;
+		kore_json_write_integer_u64(w, item->data.u64);
 		break;
 	case KORE_JSON_TYPE_LITERAL:
-		item->parse = json_parse_literal;
+		kore_json_write_literal(w, item->data.literal);
 		break;
 	default:
 		fatal("%s: unknown type %d", __func__, item->type);
 	}
+}
 
-	if (name)
-		item->name = kore_strdup(name);
+static struct kore_json_item *
+json_find_item(struct kore_json_item *object,
+    const struct kore_json_path *path, u_int32_t type, int pos)
+{
+	const struct kore_json_path_seg	*seg;
+	struct kore_json_item		*item, *nitem;
+	int				idx;
 
-	if (parent) {
-		if (parent->type != KORE_JSON_TYPE_OBJECT &&
-		    parent->type != KORE_JSON_TYPE_ARRAY) {
-			fatal("%s: invalid parent type (%d)",
-			    __func__, parent->type);
+	if (pos >= path->count)
+		return (NULL);
+
+	if (object->type != KORE_JSON_TYPE_OBJECT &&
+	    object->type != KORE_JSON_TYPE_ARRAY)
+		return (NULL);
+
+	seg = &path->segs[pos];
+
+	if ((item = json_find_child(object, seg)) == NULL) {
+		json_errno = KORE_JSON_ERR_NOT_FOUND;
+		return (NULL);
+	}
+
+	if (item->type == KORE_JSON_TYPE_ARRAY && seg->spot != -1) {
+		idx = 0;
+		nitem = NULL;
+		TAILQ_FOREACH(nitem, &item->data.items, list) {
+			if (idx++ == seg->spot)
+				break;
 		}
 
-		TAILQ_INSERT_TAIL(&parent->data.items, item, list);
+		if (nitem == NULL) {
+			json_errno = KORE_JSON_ERR_NOT_FOUND;
+			return (NULL);
+		}
+
+		item = nitem;
 	}
 
-	return (item);
-}
+	if (pos + 1 == path->count) {
+		/*
+		 * If an uint64 was required and we find an item
+		 * with the same name but marked as an integer check
+		 * if it can be represented as a uint64.
+		 *
+		 * If it can, reduce the type to integer so we match
+		 * on it as well.
+		 */
+		if (type == KORE_JSON_TYPE_INTEGER_U64 &&
+		    item->type == KORE_JSON_TYPE_INTEGER) {
+			if (item->data.integer >= 0)
+				type = KORE_JSON_TYPE_INTEGER;
+		}
 
-static int
+		if (item->type == type)
+			return (item);
+
+		json_errno = KORE_JSON_ERR_TYPE_MISMATCH;
+		return (NULL);
+	}
+
+	if (item->type == KORE_JSON_TYPE_OBJECT ||
+	    item->type == KORE_JSON_TYPE_ARRAY) {
+		item = json_find_item(item, path, type, pos + 1);
+	} else {
+		item = NULL;
+	}
+
+	if (item == NULL && json_errno == 0)
+		json_errno = KORE_JSON_ERR_NOT_FOUND;
+
+	return (item);
+}
+
+/*
+ * Unnamed items (array members) match any name, same as they always did.
+ * Objects that are large enough get a key index on their first search.
+ */
+static struct kore_json_item *
+json_find_child(struct kore_json_item *object,
+    const struct kore_json_path_seg *seg)
+{
+	u_int32_t		idx;
+	struct json_key_slot	*slot;
+	struct kore_json_item	*item;
+
+	if (object->type == KORE_JSON_TYPE_OBJECT && object->keys == NULL &&
+	    !(object->flags & KORE_JSON_ITEM_NOKEYS))
+		json_keys_build(object);
+
+	if (object->keys != NULL) {
+		idx = seg->hash & object->keys->mask;
+
+		for (;;) {
+			slot = &object->keys->slots[idx];
+			if (slot->item == NULL)
+				return (NULL);
+
+			if (slot->hash == seg->hash &&
+			    json_key_equal(slot->item->name, seg))
+				return (slot->item);
+
+			idx = (idx + 1) & object->keys->mask;
+		}
+	}
+
+	TAILQ_FOREACH(item, &object->data.items, list) {
+		if (item->name == NULL || json_key_equal(item->name, seg))
+			return (item);
+	}
+
+	return (NULL);
+}
+
+static void
+json_keys_build(struct kore_json_item *object)
+{
+	size_t			count, size;
+	u_int32_t		hash, idx;
+	struct kore_json_keys	*keys;
+	struct json_key_slot	*slot;
+	struct kore_json_item	*item;
+
+	count = 0;
+	TAILQ_FOREACH(item, &object->data.items, list) {
+		if (item->name == NULL) {
+			object->flags |= KORE_JSON_ITEM_NOKEYS;
+			return;
+		}
+		count++;
+	}
+
+	if (count < JSON_KEYS_MIN || count > UINT32_MAX / 4) {
+		object->flags |= KORE_JSON_ITEM_NOKEYS;
+		return;
+	}
+
+	/* Keep the load at or under one half so probe runs stay short. */
+	size = JSON_KEYS_MIN * 2;
+	while (size < count * 2)
+		size <<= 1;
+
+	keys = kore_calloc(1, sizeof(*keys) + (size * sizeof(*slot)));
+	keys->mask = size - 1;
+
+	TAILQ_FOREACH(item, &object->data.items, list) {
+		hash = json_key_hash(item->name, strlen(item->name));
+		idx = hash & keys->mask;
+
+		for (;;) {
+			slot = &keys->slots[idx];
+			if (slot->item == NULL) {
+				slot->hash = hash;
+				slot->item = item;
+				break;
+			}
+
+			if (slot->hash == hash &&
+			    !strcmp(slot->item->name, item->name))
+				break;
+
+			idx = (idx + 1) & keys->mask;
+		}
+	}
+
+	object->keys = keys;
+}
+
+static void
+json_keys_drop(struct kore_json_item *object)
+{
+	kore_free(object->keys);
+
+	object->keys = NULL;
+	object->flags &= ~KORE_JSON_ITEM_NOKEYS;
+}
+
+static int
+json_key_equal(const char *name, const struct kore_json_path_seg *seg)
+{
+	if (strncmp(name, seg->name, seg->len))
+		return (0);
+
+	return (name[seg->len] == '\0');
+}
+
+/* FNV-1a. */
+static u_int32_t
+json_key_hash(const char *name, size_t len)
+{
+	size_t		i;
+	u_int32_t	hash;
+
+	hash = 2166136261U;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (u_int8_t)name[i];
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+/*
+ * Split str into its "/" separated names, a name may end with [n] to
+ * select the n-th member of the array it names. The names are not copied,
+ * they point into str.
+ */
+static int
+json_path_parse(struct kore_json_path *path, const char *str)
+{
+	size_t				len;
+	struct kore_json_path_seg	*seg;
+	const char			*p, *end, *open, *close;
+
+	path->count = 0;
+
+	for (p = str; *p != '\0'; p = end) {
+		if (*p == '/') {
+			end = p + 1;
+			continue;
+		}
+
+		if (path->count == KORE_JSON_DEPTH_MAX)
+			return (KORE_RESULT_ERROR);
+
+		len = strcspn(p, "/");
+		end = p + len;
+
+		seg = &path->segs[path->count++];
+		seg->name = p;
+		seg->len = len;
+		seg->spot = -1;
+
+		if ((open = memchr(p, '[', len)) != NULL) {
+			seg->len = open - p;
+
+			close = memchr(open, ']', end - open);
+			if (close == NULL || close == open + 1)
+				return (KORE_RESULT_ERROR);
+
+			seg->spot = 0;
+			for (open++; open < close; open++) {
+				if (*open < '0' || *open > '9')
+					return (KORE_RESULT_ERROR);
+
+				seg->spot = (seg->spot * 10) + (*open - '0');
+				if (seg->spot > USHRT_MAX)
+					return (KORE_RESULT_ERROR);
+			}
+		}
+
+		seg->hash = json_key_hash(seg->name, seg->len);
+	}
+
+	if (path->count == 0)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+void
+kore_json_item_free(struct kore_json_item *item)
+{
+	struct kore_json_item	*node;
+
+	if (item == NULL)
+		return;
+
+	switch (item->type) {
+	case KORE_JSON_TYPE_OBJECT:
+	case KORE_JSON_TYPE_ARRAY:
+		while ((node = TAILQ_FIRST(&item->data.items)) != NULL) {
+			TAILQ_REMOVE(&item->data.items, node, list);
+			kore_json_item_free(node);
+		}
+		kore_free(item->keys);
+		break;
+	case KORE_JSON_TYPE_STRING:
+		if (!(item->flags & KORE_JSON_ITEM_TAPE))
+			kore_free(item->data.string);
+		break;
+	case KORE_JSON_TYPE_NUMBER:
+	case KORE_JSON_TYPE_LITERAL:
+	case KORE_JSON_TYPE_INTEGER:
+	case KORE_JSON_TYPE_INTEGER_U64:
+		break;
+	default:
+		fatal("%s: unknown type %d", __func__, item->type);
+	}
+
+	/* The tape and the strings it points to go with the kore_json. */
+	if (item->flags & KORE_JSON_ITEM_TAPE)
+		return;
+
+	kore_free(item->name);
+	kore_pool_put(&json_item_pool, item);
+}
+
+static struct kore_json_item *
+json_item_new(void)
+{
+	struct kore_json_item	*item;
+
+	item = kore_pool_get(&json_item_pool);
+	memset(item, 0, sizeof(*item));
+
+	return (item);
+}
+
+static struct kore_json_item *
+json_item_alloc(int type, const char *name, struct kore_json_item *parent)
+{
+	struct kore_json_item	*item;
+
+	item = json_item_new();
+	item->type = type;
+	item->parent = parent;
+
+	switch (item->type) {
+	case KORE_JSON_TYPE_OBJECT:
+		TAILQ_INIT(&item->data.items);
+		item->parse = json_parse_object;
+		break;
+	case KORE_JSON_TYPE_ARRAY:
+		TAILQ_INIT(&item->data.items);
+		item->parse = json_parse_array;
+		break;
+	case KORE_JSON_TYPE_STRING:
+		item->parse = json_parse_string;
+		break;
+	case KORE_JSON_TYPE_NUMBER:
+	case KORE_JSON_TYPE_INTEGER:
+	case KORE_JSON_TYPE_INTEGER_U64:
+		item->parse = json_parse_number;
+		break;
+	case KORE_JSON_TYPE_LITERAL:
+		item->parse = json_parse_literal;
+		break;
+	default:
+		fatal("%s: unknown type %d", __func__, item->type);
+	}
+
+	if (name)
+		item->name = kore_strdup(name);
+
+	if (parent) {
+		if (parent->type != KORE_JSON_TYPE_OBJECT &&
+		    parent->type != KORE_JSON_TYPE_ARRAY) {
+			fatal("%s: invalid parent type (%d)",
+			    __func__, parent->type);
+		}
+
+		TAILQ_INSERT_TAIL(&parent->data.items, item, list);
+	}
+
+	return (item);
+}
+
+static int
 json_peek(struct kore_json *json, u_int8_t *ch)
 {
 	return (json_next_byte(json, ch, 1));
@@ -958,3 +1558,936 @@ cleanup:
 
 	return (res);
 }
+
+static int
+json_index_build(struct kore_json *json, struct json_index *index)
+{
+	struct json_block	blk;
+	size_t			off, left, first;
+	u_int64_t		valid, escaped, quote, instring, scalar;
+	u_int64_t		starts, structural, carry_escape;
+	u_int64_t		carry_string, carry_scalar;
+
+	first = json->length;
+	carry_escape = 0;
+	carry_string = 0;
+	carry_scalar = 0;
+
+	index->cap = (json->length / 4) + JSON_BLOCK + 1;
+	index->pos = kore_calloc(index->cap, sizeof(u_int32_t));
+
+	for (off = 0; off < json->length; off += JSON_BLOCK) {
+		left = json->length - off;
+		if (left >= JSON_BLOCK)
+			valid = ~(u_int64_t)0;
+		else
+			valid = ((u_int64_t)1 << left) - 1;
+
+		json_index_classify(json->copy + off, &blk);
+
+		/*
+		 * Quotes that are not escaped toggle between inside and
+		 * outside of a string, the prefix xor turns them into a mask
+		 * covering the opening quote up to the closing one.
+		 */
+		escaped = json_index_escaped(blk.bslash, &carry_escape);
+		quote = blk.quote & ~escaped;
+		instring = json_index_prefix_xor(quote) ^ carry_string;
+		carry_string = (u_int64_t)((int64_t)instring >> 63);
+
+		if (blk.ctrl & instring & valid) {
+			json_errno = KORE_JSON_ERR_INVALID_STRING;
+			return (KORE_RESULT_ERROR);
+		}
+
+		if ((blk.high & valid) && first == json->length)
+			first = off;
+
+		/*
+		 * Numbers and literals are runs of anything else outside
+		 * of strings, only the first byte of a run is recorded.
+		 */
+		scalar = ~(blk.op | blk.ws | blk.quote | instring) & valid;
+		starts = scalar & ~((scalar << 1) | carry_scalar);
+		carry_scalar = scalar >> 63;
+
+		structural = (blk.op & ~instring) | starts | quote;
+		index->values += __builtin_popcountll(starts |
+		    (quote & instring) | (blk.open & ~instring));
+
+		if (index->cap - index->len < JSON_BLOCK + 1) {
+			index->cap *= 2;
+			index->pos = kore_realloc(index->pos,
+			    index->cap * sizeof(u_int32_t));
+		}
+
+		while (structural != 0) {
+			index->pos[index->len++] =
+			    off + __builtin_ctzll(structural);
+			structural &= structural - 1;
+		}
+	}
+
+	if (carry_string) {
+		json_errno = KORE_JSON_ERR_INVALID_STRING;
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (first != json->length &&
+	    !json_utf8_validate(json->copy + first, json->length - first)) {
+		json_errno = KORE_JSON_ERR_INVALID_UTF8;
+		return (KORE_RESULT_ERROR);
+	}
+
+	/* Points at the zeroed padding so the second stage hits a stop. */
+	index->pos[index->len] = json->length;
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+json_index_classify(const u_int8_t *p, struct json_block *blk)
+{
+#if defined(JSON_LANE)
+	int		i;
+	json_vec	v, lower, ctrl;
+
+	memset(blk, 0, sizeof(*blk));
+
+	for (i = 0; i < JSON_BLOCK; i += JSON_LANE) {
+		v = JSON_LOAD(p + i);
+
+		/* Folds [ and ] onto { and }. */
+		lower = JSON_OR(v, JSON_SET(0x20));
+		ctrl = JSON_EQ(JSON_MAX(v, JSON_SET(0x1f)), 0x1f);
+
+		blk->quote |= JSON_MASK(JSON_EQ(v, '"')) << i;
+		blk->bslash |= JSON_MASK(JSON_EQ(v, '\\')) << i;
+		blk->open |= JSON_MASK(JSON_EQ(lower, '{')) << i;
+		blk->op |= JSON_MASK(JSON_OR(
+		    JSON_OR(JSON_EQ(lower, '{'), JSON_EQ(lower, '}')),
+		    JSON_OR(JSON_EQ(v, ':'), JSON_EQ(v, ',')))) << i;
+		blk->ws |= JSON_MASK(JSON_OR(
+		    JSON_OR(JSON_EQ(v, ' '), JSON_EQ(v, '\t')),
+		    JSON_OR(JSON_EQ(v, '\n'), JSON_EQ(v, '\r')))) << i;
+		blk->ctrl |= JSON_MASK(ctrl) << i;
+		blk->high |= JSON_MASK(v) << i;
+	}
+#else
+	int		i;
+	u_int64_t	bit;
+
+	memset(blk, 0, sizeof(*blk));
+
+	for (i = 0; i < JSON_BLOCK; i++) {
+		bit = (u_int64_t)1 << i;
+
+		switch (p[i]) {
+		case '"':
+			blk->quote |= bit;
+			break;
+		case '\\':
+			blk->bslash |= bit;
+			break;
+		case '{':
+		case '[':
+			blk->open |= bit;
+			/* FALLTHROUGH */
+		case '}':
+		case ']':
+		case ':':
+		case ',':
+			blk->op |= bit;
+			break;
+		case '\t':
+		case '\n':
+		case '\r':
+			blk->ctrl |= bit;
+			/* FALLTHROUGH */
+		case ' ':
+			blk->ws |= bit;
+			break;
+		default:
+			if (p[i] <= 0x1f)
+				blk->ctrl |= bit;
+			else if (p[i] & 0x80)
+				blk->high |= bit;
+			break;
+		}
+	}
+#endif
+}
+
+/*
+ * Returns the mask of bytes that are escaped by a backslash. A backslash
+ * in the last byte of a block escapes the first byte of the next one,
+ * which is what carry tracks.
+ */
+static u_int64_t
+json_index_escaped(u_int64_t bslash, u_int64_t *carry)
+{
+	int		bit;
+	u_int64_t	escaped;
+
+	escaped = *carry;
+	bslash &= ~escaped;
+	*carry = 0;
+
+	while (bslash != 0) {
+		bit = __builtin_ctzll(bslash);
+		if (bit == 63) {
+			*carry = 1;
+			break;
+		}
+
+		escaped |= (u_int64_t)1 << (bit + 1);
+		bslash &= ~((u_int64_t)3 << bit);
+	}
+
+	return (escaped);
+}
+
+static u_int64_t
+json_index_prefix_xor(u_int64_t mask)
+{
+#if defined(__PCLMUL__)
+	return ((u_int64_t)_mm_cvtsi128_si64(_mm_clmulepi64_si128(
+	    _mm_set_epi64x(0, (long long)mask), _mm_set1_epi8((char)0xff), 0)));
+#else
+	mask ^= mask << 1;
+	mask ^= mask << 2;
+	mask ^= mask << 4;
+	mask ^= mask << 8;
+	mask ^= mask << 16;
+	mask ^= mask << 32;
+
+	return (mask);
+#endif
+}
+
+static int
+json_utf8_validate(const u_int8_t *p, size_t len)
+{
+	u_int64_t	word;
+	size_t		idx, need, i;
+	u_int32_t	cp, min;
+
+	idx = 0;
+
+	while (idx < len) {
+		if (len - idx >= sizeof(word)) {
+			memcpy(&word, p + idx, sizeof(word));
+			if ((word & 0x8080808080808080ULL) == 0) {
+				idx += sizeof(word);
+				continue;
+			}
+		}
+
+		if (p[idx] < 0x80) {
+			idx++;
+			continue;
+		}
+
+		if ((p[idx] & 0xe0) == 0xc0) {
+			need = 1;
+			min = 0x80;
+			cp = p[idx] & 0x1f;
+		} else if ((p[idx] & 0xf0) == 0xe0) {
+			need = 2;
+			min = 0x800;
+			cp = p[idx] & 0x0f;
+		} else if ((p[idx] & 0xf8) == 0xf0) {
+			need = 3;
+			min = 0x10000;
+			cp = p[idx] & 0x07;
+		} else {
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (len - idx <= need)
+			return (KORE_RESULT_ERROR);
+
+		for (i = 1; i <= need; i++) {
+			if ((p[idx + i] & 0xc0) != 0x80)
+				return (KORE_RESULT_ERROR);
+			cp = (cp << 6) | (p[idx + i] & 0x3f);
+		}
+
+		if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+			return (KORE_RESULT_ERROR);
+
+		idx += need + 1;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+json_tape_build(struct kore_json *json, struct json_index *index)
+{
+	u_int8_t		ch;
+	char			*name;
+	u_int32_t		type, off;
+	size_t			pos, depth;
+	struct kore_json_item	*item, *parent;
+	enum { TAPE_VALUE, TAPE_KEY, TAPE_NEXT } state;
+
+	json->tape = kore_calloc(index->values + 1, sizeof(*json->tape));
+
+	pos = 0;
+	depth = 0;
+	name = NULL;
+	parent = NULL;
+	state = TAPE_VALUE;
+
+	for (;;) {
+		if (state == TAPE_NEXT && parent == NULL) {
+			if (pos != index->len) {
+				json_errno = KORE_JSON_ERR_INVALID_JSON;
+				return (KORE_RESULT_ERROR);
+			}
+			return (KORE_RESULT_OK);
+		}
+
+		if (pos >= index->len) {
+			json_errno = KORE_JSON_ERR_EOF;
+			return (KORE_RESULT_ERROR);
+		}
+
+		off = index->pos[pos++];
+		ch = json->copy[off];
+
+		switch (state) {
+		case TAPE_VALUE:
+			if (!json_guess_type(ch, &type)) {
+				json_errno = KORE_JSON_ERR_INVALID_JSON;
+				return (KORE_RESULT_ERROR);
+			}
+
+			item = json_tape_item(json, type, name, parent);
+			name = NULL;
+			state = TAPE_NEXT;
+
+			switch (type) {
+			case KORE_JSON_TYPE_OBJECT:
+			case KORE_JSON_TYPE_ARRAY:
+				if (depth++ >= KORE_JSON_DEPTH_MAX) {
+					json_errno = KORE_JSON_ERR_DEPTH;
+					return (KORE_RESULT_ERROR);
+				}
+
+				parent = item;
+
+				/* Empty ones are closed by TAPE_NEXT. */
+				ch = json->copy[index->pos[pos]];
+				if (ch == '}' || ch == ']')
+					break;
+
+				if (type == KORE_JSON_TYPE_OBJECT)
+					state = TAPE_KEY;
+				else
+					state = TAPE_VALUE;
+				break;
+			case KORE_JSON_TYPE_STRING:
+				item->data.string = json_tape_string(json,
+				    off, index->pos[pos++]);
+				if (item->data.string == NULL)
+					return (KORE_RESULT_ERROR);
+				break;
+			case KORE_JSON_TYPE_LITERAL:
+				if (!json_tape_literal(json, item, off))
+					return (KORE_RESULT_ERROR);
+				break;
+			default:
+				if (!json_tape_number(json, item, off))
+					return (KORE_RESULT_ERROR);
+				break;
+			}
+			continue;
+		case TAPE_KEY:
+			if (ch != '"' || pos + 1 >= index->len)
+				break;
+
+			name = json_tape_string(json, off, index->pos[pos++]);
+			if (name == NULL)
+				return (KORE_RESULT_ERROR);
+
+			if (json->copy[index->pos[pos++]] != ':')
+				break;
+
+			state = TAPE_VALUE;
+			continue;
+		case TAPE_NEXT:
+			if (ch == ',') {
+				if (parent->type == KORE_JSON_TYPE_OBJECT)
+					state = TAPE_KEY;
+				else
+					state = TAPE_VALUE;
+				continue;
+			}
+
+			if ((ch == '}' &&
+			    parent->type == KORE_JSON_TYPE_OBJECT) ||
+			    (ch == ']' &&
+			    parent->type == KORE_JSON_TYPE_ARRAY)) {
+				depth--;
+				parent = parent->parent;
+				continue;
+			}
+			break;
+		}
+
+		if (parent->type == KORE_JSON_TYPE_OBJECT)
+			json_errno = KORE_JSON_ERR_INVALID_OBJECT;
+		else
+			json_errno = KORE_JSON_ERR_INVALID_ARRAY;
+
+		return (KORE_RESULT_ERROR);
+	}
+}
+
+static struct kore_json_item *
+json_tape_item(struct kore_json *json, u_int32_t type, char *name,
+    struct kore_json_item *parent)
+{
+	struct kore_json_item	*item;
+
+	item = &json->tape[json->tape_len++];
+	item->type = type;
+	item->name = name;
+	item->parent = parent;
+	item->flags = KORE_JSON_ITEM_TAPE;
+
+	if (type == KORE_JSON_TYPE_OBJECT || type == KORE_JSON_TYPE_ARRAY)
+		TAILQ_INIT(&item->data.items);
+
+	if (parent != NULL)
+		TAILQ_INSERT_TAIL(&parent->data.items, item, list);
+	else
+		json->root = item;
+
+	return (item);
+}
+
+/*
+ * Terminates the string between the quotes at open and close and undoes
+ * its escapes in place, the result never grows.
+ */
+static char *
+json_tape_string(struct kore_json *json, u_int32_t open, u_int32_t close)
+{
+	u_int32_t	cp, low;
+	u_int8_t	*start, *src, *dst, *end;
+
+	start = json->copy + open + 1;
+	end = json->copy + close;
+
+	if ((dst = memchr(start, '\\', end - start)) == NULL) {
+		*end = '\0';
+		return ((char *)start);
+	}
+
+	src = dst;
+
+	while (src < end) {
+		if (*src != '\\') {
+			*(dst)++ = *(src)++;
+			continue;
+		}
+
+		src++;
+
+		switch (*(src)++) {
+		case '"':
+			*(dst)++ = '"';
+			break;
+		case '\\':
+			*(dst)++ = '\\';
+			break;
+		case '/':
+			*(dst)++ = '/';
+			break;
+		case 'b':
+			*(dst)++ = '\b';
+			break;
+		case 'f':
+			*(dst)++ = '\f';
+			break;
+		case 'n':
+			*(dst)++ = '\n';
+			break;
+		case 'r':
+			*(dst)++ = '\r';
+			break;
+		case 't':
+			*(dst)++ = '\t';
+			break;
+		case 'u':
+			if (end - src < 4 || !json_tape_hex(src, &cp))
+				goto cleanup;
+			src += 4;
+
+			if (cp >= 0xdc00 && cp <= 0xdfff)
+				goto cleanup;
+
+			if (cp >= 0xd800 && cp <= 0xdbff) {
+				if (end - src < 6 || src[0] != '\\' ||
+				    src[1] != 'u' ||
+				    !json_tape_hex(src + 2, &low))
+					goto cleanup;
+				if (low < 0xdc00 || low > 0xdfff)
+					goto cleanup;
+				src += 6;
+				cp = 0x10000 + ((cp - 0xd800) << 10) +
+				    (low - 0xdc00);
+			}
+
+			/* Would silently cut the string short. */
+			if (cp == 0)
+				goto cleanup;
+
+			if (cp < 0x80) {
+				*(dst)++ = cp;
+			} else if (cp < 0x800) {
+				*(dst)++ = 0xc0 | (cp >> 6);
+				*(dst)++ = 0x80 | (cp & 0x3f);
+			} else if (cp < 0x10000) {
+				*(dst)++ = 0xe0 | (cp >> 12);
+				*(dst)++ = 0x80 | ((cp >> 6) & 0x3f);
+				*(dst)++ = 0x80 | (cp & 0x3f);
+			} else {
+				*(dst)++ = 0xf0 | (cp >> 18);
+				*(dst)++ = 0x80 | ((cp >> 12) & 0x3f);
+				*(dst)++ = 0x80 | ((cp >> 6) & 0x3f);
+				*(dst)++ = 0x80 | (cp & 0x3f);
+			}
+			break;
+		default:
+			goto cleanup;
+		}
+	}
+
+	*dst = '\0';
+
+	return ((char *)start);
+
+cleanup:
+	json_errno = KORE_JSON_ERR_INVALID_STRING;
+
+	return (NULL);
+}
+
+static int
+json_tape_number(struct kore_json *json, struct kore_json_item *number,
+    u_int32_t off)
+{
+	u_int64_t	val;
+	u_int8_t	*p, *str, ch, digit;
+	int		ret, neg, integer, overflow;
+
+	val = 0;
+	neg = 0;
+	overflow = 0;
+	integer = 1;
+	ret = KORE_RESULT_ERROR;
+	str = p = json->copy + off;
+
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+
+	if (*p == '0') {
+		p++;
+	} else if (*p >= '1' && *p <= '9') {
+		while (*p >= '0' && *p <= '9') {
+			digit = *(p)++ - '0';
+			if (val > (UINT64_MAX - digit) / 10)
+				overflow = 1;
+			val = (val * 10) + digit;
+		}
+	} else {
+		goto cleanup;
+	}
+
+	if (*p == '.') {
+		integer = 0;
+		if (*(++p) < '0' || *p > '9')
+			goto cleanup;
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		integer = 0;
+		if (*(++p) == '+' || *p == '-')
+			p++;
+		if (*p < '0' || *p > '9')
+			goto cleanup;
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+
+	if (!json_tape_delimiter(json, p))
+		goto cleanup;
+
+	if (!integer) {
+		ch = *p;
+		*p = '\0';
+		number->data.number = kore_strtodouble((const char *)str,
+		    -DBL_MAX, DBL_MAX, &ret);
+		*p = ch;
+		number->type = KORE_JSON_TYPE_NUMBER;
+		goto cleanup;
+	}
+
+	if (overflow)
+		goto cleanup;
+
+	if (neg) {
+		if (val > (u_int64_t)INT64_MAX + 1)
+			goto cleanup;
+		if (val == (u_int64_t)INT64_MAX + 1)
+			number->data.integer = INT64_MIN;
+		else
+			number->data.integer = -(int64_t)val;
+		number->type = KORE_JSON_TYPE_INTEGER;
+	} else if (val <= INT64_MAX) {
+		number->data.integer = (int64_t)val;
+		number->type = KORE_JSON_TYPE_INTEGER;
+	} else {
+		number->data.u64 = val;
+		number->type = KORE_JSON_TYPE_INTEGER_U64;
+	}
+
+	ret = KORE_RESULT_OK;
+
+cleanup:
+	if (ret == KORE_RESULT_ERROR && json_errno == 0)
+		json_errno = KORE_JSON_ERR_INVALID_NUMBER;
+
+	return (ret);
+}
+
+static int
+json_tape_literal(struct kore_json *json, struct kore_json_item *literal,
+    u_int32_t off)
+{
+	size_t		len;
+	u_int8_t	*p;
+
+	p = json->copy + off;
+
+	if (!memcmp(p, json_true_literal, sizeof(json_true_literal))) {
+		len = sizeof(json_true_literal);
+		literal->data.literal = KORE_JSON_TRUE;
+	} else if (!memcmp(p, json_false_literal, sizeof(json_false_literal))) {
+		len = sizeof(json_false_literal);
+		literal->data.literal = KORE_JSON_FALSE;
+	} else if (!memcmp(p, json_null_literal, sizeof(json_null_literal))) {
+		len = sizeof(json_null_literal);
+		literal->data.literal = KORE_JSON_NULL;
+	} else {
+		json_errno = KORE_JSON_ERR_INVALID_LITERAL;
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!json_tape_delimiter(json, p + len)) {
+		json_errno = KORE_JSON_ERR_INVALID_LITERAL;
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+json_tape_hex(const u_int8_t *p, u_int32_t *out)
+{
+	int		i;
+
+	*out = 0;
+
+	for (i = 0; i < 4; i++) {
+		*out <<= 4;
+
+		if (p[i] >= '0' && p[i] <= '9')
+			*out |= p[i] - '0';
+		else if (p[i] >= 'a' && p[i] <= 'f')
+			*out |= p[i] - 'a' + 10;
+		else if (p[i] >= 'A' && p[i] <= 'F')
+			*out |= p[i] - 'A' + 10;
+		else
+			return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+json_tape_delimiter(struct kore_json *json, const u_int8_t *p)
+{
+	switch (*p) {
+	case ' ':
+	case '\t':
+	case '\n':
+	case '\r':
+	case ',':
+	case ']':
+	case '}':
+		return (KORE_RESULT_OK);
+	case '\0':
+		/* Only the padding ends a token, not a NUL in the input. */
+		if (p == json->copy + json->length)
+			return (KORE_RESULT_OK);
+		break;
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
+static void
+json_item_write(struct kore_json_item *item,
+    void (*out)(void *, const void *, size_t), void *arg)
+{
+	int			len;
+	struct kore_json_item	*nitem;
+	char			num[400];
+
+	if (item->name) {
+		out(arg, "\"", 1);
+		out(arg, item->name, strlen(item->name));
+		out(arg, "\":", 2);
+	}
+
+	switch (item->type) {
+	case KORE_JSON_TYPE_OBJECT:
+		out(arg, "{", 1);
+		TAILQ_FOREACH(nitem, &item->data.items, list) {
+			json_item_write(nitem, out, arg);
+
+			if (TAILQ_NEXT(nitem, list))
+				out(arg, ",", 1);
+		}
+		out(arg, "}", 1);
+		return;
+	case KORE_JSON_TYPE_ARRAY:
+		out(arg, "[", 1);
+		TAILQ_FOREACH(nitem, &item->data.items, list) {
+			json_item_write(nitem, out, arg);
+
+			if (TAILQ_NEXT(nitem, list))
+				out(arg, ",", 1);
+		}
+		out(arg, "]", 1);
+		return;
+	case KORE_JSON_TYPE_STRING:
+		out(arg, "\"", 1);
+		out(arg, item->data.string, strlen(item->data.string));
+		out(arg, "\"", 1);
+		return;
+	case KORE_JSON_TYPE_NUMBER:
+		len = snprintf(num, sizeof(num), "%f", item->data.number);
+		break;
+	case KORE_JSON_TYPE_INTEGER:
+		len = snprintf(num, sizeof(num), "%" PRId64,
+		    item->data.integer);
+		break;
+	case KORE_JSON_TYPE_INTEGER_U64:
+		len = snprintf(num, sizeof(num), "%" PRIu64, item->data.u64);
+		break;
+	case KORE_JSON_TYPE_LITERAL:
+		switch (item->data.literal) {
+		case KORE_JSON_TRUE:
+			out(arg, json_true_literal, sizeof(json_true_literal));
+			break;
+		case KORE_JSON_FALSE:
+			out(arg, json_false_literal,
+			    sizeof(json_false_literal));
+			break;
+		case KORE_JSON_NULL:
+			out(arg, json_null_literal, sizeof(json_null_literal));
+			break;
+		default:
+			fatal("%s: unknown literal %d", __func__,
+			    item->data.literal);
+		}
+		return;
+	default:
+		fatal("%s: unknown type %d", __func__, item->type);
+	}
+
+	if (len == -1 || (size_t)len >= sizeof(num))
+		fatal("%s: failed to format number", __func__);
+
+	out(arg, num, len);
+}
+
+/*
+ * Emits the comma a key or value needs at the current position, a value
+ * that follows its key needs none.
+ */
+static void
+json_writer_value(struct kore_json_writer *w)
+{
+	u_int64_t	bit;
+
+	if (w->flags & KORE_JSON_WRITER_KEY) {
+		w->flags &= ~KORE_JSON_WRITER_KEY;
+		return;
+	}
+
+	if (w->depth == 0)
+		return;
+
+	bit = (u_int64_t)1 << (w->depth - 1);
+
+	if (w->next & bit)
+		json_writer_out(w, ",", 1);
+
+	w->next |= bit;
+}
+
+static void
+json_writer_open(struct kore_json_writer *w, int object, u_int8_t ch)
+{
+	u_int64_t	bit;
+
+	if (w->depth == KORE_JSON_WRITER_DEPTH)
+		fatal("json writer: nested too deep");
+
+	json_writer_value(w);
+	json_writer_out(w, &ch, sizeof(ch));
+
+	bit = (u_int64_t)1 << w->depth;
+	w->depth++;
+
+	w->next &= ~bit;
+	if (object)
+		w->object |= bit;
+	else
+		w->object &= ~bit;
+}
+
+static void
+json_writer_close(struct kore_json_writer *w, int object, u_int8_t ch)
+{
+	u_int64_t	bit;
+
+	if (w->depth == 0)
+		fatal("json writer: nothing to close");
+
+	bit = (u_int64_t)1 << (w->depth - 1);
+
+	if (!(w->object & bit) != !object)
+		fatal("json writer: mismatched close '%c'", ch);
+
+	if (w->flags & KORE_JSON_WRITER_KEY)
+		fatal("json writer: key without a value");
+
+	w->depth--;
+	json_writer_out(w, &ch, sizeof(ch));
+}
+
+static void
+json_writer_out(struct kore_json_writer *w, const void *data, size_t len)
+{
+	kore_rope_append(&w->rope, data, len);
+
+	if (w->flush != NULL && w->rope.length >= w->flush_size)
+		w->flush(w);
+}
+
+static void
+json_writer_escaped(struct kore_json_writer *w, const char *str)
+{
+	u_int8_t		ch;
+	const u_int8_t		*p, *run;
+	char			esc[6];
+
+	json_writer_out(w, "\"", 1);
+
+	for (run = p = (const u_int8_t *)str; *p != '\0'; p++) {
+		if (*p >= 0x20 && *p != '"' && *p != '\\')
+			continue;
+
+		if (p != run)
+			json_writer_out(w, run, p - run);
+		run = p + 1;
+
+		switch (*p) {
+		case '"':
+		case '\\':
+			ch = *p;
+			break;
+		case '\b':
+			ch = 'b';
+			break;
+		case '\f':
+			ch = 'f';
+			break;
+		case '\n':
+			ch = 'n';
+			break;
+		case '\r':
+			ch = 'r';
+			break;
+		case '\t':
+			ch = 't';
+			break;
+		default:
+			esc[0] = '\\';
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = "0123456789abcdef"[*p >> 4];
+			esc[5] = "0123456789abcdef"[*p & 0x0f];
+			json_writer_out(w, esc, sizeof(esc));
+			continue;
+		}
+
+		esc[0] = '\\';
+		esc[1] = ch;
+		json_writer_out(w, esc, 2);
+	}
+
+	if (p != run)
+		json_writer_out(w, run, p - run);
+
+	json_writer_out(w, "\"", 1);
+}
+
+/* Formats val backwards ending at end, returns where the digits start. */
+static char *
+json_writer_u64(char *end, u_int64_t val)
+{
+	size_t		idx;
+
+	while (val >= 100) {
+		idx = (val % 100) * 2;
+		val /= 100;
+		*--end = json_digits[idx + 1];
+		*--end = json_digits[idx];
+	}
+
+	if (val >= 10) {
+		idx = val * 2;
+		*--end = json_digits[idx + 1];
+		*--end = json_digits[idx];
+	} else {
+		*--end = '0' + val;
+	}
+
+	return (end);
+}
+
+static void
+json_write_buf(void *arg, const void *data, size_t len)
+{
+	kore_buf_append(arg, data, len);
+}
+
+static void
+json_write_rope(void *arg, const void *data, size_t len)
+{
+	kore_rope_append(arg, data, len);
+}
@@ -0,0 +1,670 @@
+/*
+ * Copyright (c) 2016 Raphaël Monrouzeau <raphael.monrouzeau@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * JSON-RPC 2.0 on top of the kore JSON parser and writer, selected with
+ * JSONRPC=native. Next to single requests it serves batches through
+ * jsonrpc_dispatch(), all calls of a batch are started together and the
+ * responses are sent in the order of the calls once the last one is done.
+ */
+
+#include <sys/types.h>
+
+#include <stdarg.h>
+
+#include "kore.h"
+#include "http.h"
+#include "jsonrpc.h"
+
+/* Request owns buf and json. */
+#define JSONRPC_REQ_BODY	0x0100
+/* Answer errors even without an id, the id is written as null. */
+#define JSONRPC_REQ_REPLY	0x0200
+/* Batch call has its response. */
+#define JSONRPC_REQ_DONE	0x0400
+
+struct jsonrpc_call {
+	struct jsonrpc_request		req;
+	const struct jsonrpc_method	*method;
+};
+
+struct jsonrpc_batch {
+	struct kore_buf			body;
+	struct kore_json		json;
+	int				array;
+	size_t				count;
+	size_t				pending;
+	struct jsonrpc_call		*calls;
+};
+
+static void	jsonrpc_init(struct jsonrpc_request *,
+		    struct http_request *);
+static int	jsonrpc_read_body(struct jsonrpc_request *,
+		    struct kore_buf *);
+static int	jsonrpc_parse(struct jsonrpc_request *,
+		    struct kore_json_item *);
+static void	jsonrpc_open(struct jsonrpc_request *);
+static void	jsonrpc_write_log(struct jsonrpc_request *);
+static void	jsonrpc_respond(struct jsonrpc_request *);
+static void	jsonrpc_log_free(struct jsonrpc_log *);
+static const char	*jsonrpc_known_msg(int);
+
+static struct kore_json_item	*jsonrpc_member(struct kore_json_item *,
+				    const char *);
+
+static struct jsonrpc_batch	*jsonrpc_batch_create(struct http_request *,
+				    const struct jsonrpc_method *);
+static void	jsonrpc_batch_call(struct jsonrpc_batch *,
+		    struct jsonrpc_call *, struct http_request *,
+		    struct kore_json_item *, const struct jsonrpc_method *);
+static void	jsonrpc_batch_respond(struct http_request *,
+		    struct jsonrpc_batch *);
+static void	jsonrpc_batch_free(struct http_request *);
+
+void
+jsonrpc_log(struct jsonrpc_request *req, int lvl, const char *fmt, ...)
+{
+	va_list			ap;
+	struct kore_buf		buf;
+	struct jsonrpc_log	*log;
+
+	kore_buf_init(&buf, 128);
+
+	va_start(ap, fmt);
+	kore_buf_appendv(&buf, fmt, ap);
+	va_end(ap);
+
+	log = kore_malloc(sizeof(*log));
+	log->lvl = lvl;
+	log->msg = kore_strdup(kore_buf_stringify(&buf, NULL));
+
+	kore_buf_cleanup(&buf);
+
+	log->prev = req->log.prev;
+	log->next = &req->log;
+	req->log.prev->next = log;
+	req->log.prev = log;
+}
+
+int
+jsonrpc_read_request(struct http_request *http_req, struct jsonrpc_request *req)
+{
+	int		ret;
+
+	jsonrpc_init(req, http_req);
+
+	req->flags |= JSONRPC_REQ_BODY;
+	kore_buf_init(&req->buf, 256);
+
+	if ((ret = jsonrpc_read_body(req, &req->buf)) != 0) {
+		req->flags |= JSONRPC_REQ_REPLY;
+		return (ret);
+	}
+
+	kore_json_init(&req->json, req->buf.data, req->buf.offset);
+
+	if (!kore_json_parse_indexed(&req->json)) {
+		jsonrpc_log(req, LOG_ERR, "Invalid json: %s",
+		    kore_json_strerror());
+		req->flags |= JSONRPC_REQ_REPLY;
+		return (JSONRPC_PARSE_ERROR);
+	}
+
+	if (req->json.root->type == KORE_JSON_TYPE_ARRAY) {
+		jsonrpc_log(req, LOG_ERR,
+		    "JSON-RPC batches are served by jsonrpc_dispatch()");
+		req->flags |= JSONRPC_REQ_REPLY;
+		return (JSONRPC_INVALID_REQUEST);
+	}
+
+	return (jsonrpc_parse(req, req->json.root));
+}
+
+void
+jsonrpc_destroy_request(struct jsonrpc_request *req)
+{
+	if (req->cleanup != NULL) {
+		req->cleanup(req);
+		req->cleanup = NULL;
+	}
+
+	kore_json_writer_cleanup(&req->writer);
+
+	if (req->flags & JSONRPC_REQ_BODY) {
+		kore_json_cleanup(&req->json);
+		kore_buf_cleanup(&req->buf);
+		req->flags &= ~JSONRPC_REQ_BODY;
+	}
+
+	jsonrpc_log_free(&req->log);
+}
+
+int
+jsonrpc_error(struct jsonrpc_request *req, int code, const char *msg)
+{
+	char		num[16];
+
+	if (req->id == NULL && !(req->flags & JSONRPC_REQ_REPLY)) {
+		jsonrpc_respond(req);
+		return (KORE_RESULT_OK);
+	}
+
+	if (msg == NULL)
+		msg = jsonrpc_known_msg(code);
+
+	if (msg == NULL) {
+		(void)snprintf(num, sizeof(num), "%d", code);
+		msg = num;
+	}
+
+	jsonrpc_open(req);
+
+	kore_json_write_key(&req->writer, "error");
+	kore_json_write_begin_object(&req->writer);
+	kore_json_write_key(&req->writer, "code");
+	kore_json_write_integer(&req->writer, code);
+	kore_json_write_key(&req->writer, "message");
+	kore_json_write_string(&req->writer, msg);
+	jsonrpc_write_log(req);
+	kore_json_write_end_object(&req->writer);
+
+	kore_json_write_end_object(&req->writer);
+	jsonrpc_respond(req);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Answer req with the value write_result() puts on req->writer, it must
+ * write exactly one value and return 0.
+ */
+int
+jsonrpc_result(struct jsonrpc_request *req,
+    int (*write_result)(struct jsonrpc_request *, void *), void *ctx)
+{
+	if (req->id == NULL) {
+		jsonrpc_respond(req);
+		return (KORE_RESULT_OK);
+	}
+
+	jsonrpc_open(req);
+	kore_json_write_key(&req->writer, "result");
+
+	if (write_result(req, ctx) != 0 || req->writer.depth != 1 ||
+	    (req->writer.flags & KORE_JSON_WRITER_KEY)) {
+		kore_log(LOG_ERR, "jsonrpc_result: failed to write result");
+
+		kore_json_writer_cleanup(&req->writer);
+		kore_json_writer_init(&req->writer);
+
+		if (req->batch != NULL) {
+			return (jsonrpc_error(req,
+			    JSONRPC_INTERNAL_ERROR, NULL));
+		}
+
+		http_response(req->http, HTTP_STATUS_INTERNAL_ERROR, NULL, 0);
+		jsonrpc_destroy_request(req);
+
+		return (KORE_RESULT_OK);
+	}
+
+	kore_json_write_end_object(&req->writer);
+	jsonrpc_respond(req);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Serve a JSON-RPC request or batch from the methods table, call it from
+ * the page handler and return what it returns. It keeps its state in
+ * http->hdlr_extra and http->onfree until the response was sent.
+ */
+int
+jsonrpc_dispatch(struct http_request *http,
+    const struct jsonrpc_method *methods)
+{
+	size_t			i;
+	struct jsonrpc_call	*call;
+	struct jsonrpc_batch	*batch;
+
+	if ((batch = http->hdlr_extra) == NULL) {
+		if ((batch = jsonrpc_batch_create(http, methods)) == NULL)
+			return (KORE_RESULT_OK);
+
+		http->hdlr_extra = batch;
+		http->onfree = jsonrpc_batch_free;
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		call = &batch->calls[i];
+		if (call->req.flags & JSONRPC_REQ_DONE)
+			continue;
+
+		if (call->method->cb(&call->req) == KORE_RESULT_RETRY)
+			continue;
+
+		if (!(call->req.flags & JSONRPC_REQ_DONE)) {
+			kore_log(LOG_ERR, "jsonrpc method '%s' did not answer",
+			    call->method->name);
+			call->req.flags |= JSONRPC_REQ_REPLY;
+			jsonrpc_error(&call->req, JSONRPC_INTERNAL_ERROR, NULL);
+		}
+	}
+
+	if (batch->pending > 0)
+		return (KORE_RESULT_RETRY);
+
+	jsonrpc_batch_respond(http, batch);
+	jsonrpc_batch_free(http);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+jsonrpc_init(struct jsonrpc_request *req, struct http_request *http)
+{
+	memset(req, 0, sizeof(*req));
+
+	req->http = http;
+	req->log.next = &req->log;
+	req->log.prev = &req->log;
+	req->log_levels = (1 << LOG_EMERG) | (1 << LOG_ERR) |
+	    (1 << LOG_WARNING) | (1 << LOG_NOTICE);
+
+	kore_json_writer_init(&req->writer);
+}
+
+static int
+jsonrpc_read_body(struct jsonrpc_request *req, struct kore_buf *buf)
+{
+	ssize_t		ret;
+	u_int8_t	data[BUFSIZ];
+
+	for (;;) {
+		ret = http_body_read(req->http, data, sizeof(data));
+		if (ret == -1) {
+			jsonrpc_log(req, LOG_CRIT,
+			    "Failed to read request body");
+			return (JSONRPC_SERVER_ERROR);
+		}
+
+		if (ret == 0)
+			break;
+
+		kore_buf_append(buf, data, ret);
+	}
+
+	return (0);
+}
+
+static int
+jsonrpc_parse(struct jsonrpc_request *req, struct kore_json_item *object)
+{
+	struct kore_json_item	*item;
+
+	/* Anything wrong with the request is answered, id or not. */
+	req->flags |= JSONRPC_REQ_REPLY;
+
+	if (object->type != KORE_JSON_TYPE_OBJECT) {
+		jsonrpc_log(req, LOG_ERR, "JSON-RPC request MUST be an Object");
+		return (JSONRPC_INVALID_REQUEST);
+	}
+
+	if ((item = jsonrpc_member(object, "id")) != NULL) {
+		switch (item->type) {
+		case KORE_JSON_TYPE_STRING:
+		case KORE_JSON_TYPE_INTEGER:
+		case KORE_JSON_TYPE_INTEGER_U64:
+			break;
+		case KORE_JSON_TYPE_LITERAL:
+			if (item->data.literal == KORE_JSON_NULL)
+				break;
+			/* FALLTHROUGH */
+		default:
+			jsonrpc_log(req, LOG_ERR,
+			    "JSON-RPC id MUST contain a String or Number"
+			    " without fractional parts");
+			return (JSONRPC_INVALID_REQUEST);
+		}
+
+		req->id = item;
+	}
+
+	item = jsonrpc_member(object, "jsonrpc");
+	if (item == NULL || item->type != KORE_JSON_TYPE_STRING ||
+	    strcmp(item->data.string, "2.0")) {
+		jsonrpc_log(req, LOG_ERR,
+		    "JSON-RPC protocol MUST be indicated and \"2.0\"");
+		return (JSONRPC_INVALID_REQUEST);
+	}
+
+	item = jsonrpc_member(object, "method");
+	if (item == NULL || item->type != KORE_JSON_TYPE_STRING) {
+		jsonrpc_log(req, LOG_ERR,
+		    "JSON-RPC method MUST exist and be a String");
+		return (JSONRPC_INVALID_REQUEST);
+	}
+
+	req->method = item->data.string;
+
+	req->params = jsonrpc_member(object, "params");
+	if (req->params != NULL &&
+	    req->params->type != KORE_JSON_TYPE_OBJECT &&
+	    req->params->type != KORE_JSON_TYPE_ARRAY) {
+		jsonrpc_log(req, LOG_ERR,
+		    "JSON-RPC params MUST be Object or Array");
+		return (JSONRPC_INVALID_REQUEST);
+	}
+
+	req->flags &= ~JSONRPC_REQ_REPLY;
+
+	return (0);
+}
+
+static struct kore_json_item *
+jsonrpc_member(struct kore_json_item *object, const char *name)
+{
+	struct kore_json_item	*item;
+
+	TAILQ_FOREACH(item, &object->data.items, list) {
+		if (item->name != NULL && !strcmp(item->name, name))
+			return (item);
+	}
+
+	return (NULL);
+}
+
+static void
+jsonrpc_open(struct jsonrpc_request *req)
+{
+	kore_json_write_begin_object(&req->writer);
+	kore_json_write_key(&req->writer, "jsonrpc");
+	kore_json_write_string(&req->writer, "2.0");
+	kore_json_write_key(&req->writer, "id");
+
+	if (req->id != NULL)
+		kore_json_write_item(&req->writer, req->id);
+	else
+		kore_json_write_literal(&req->writer, KORE_JSON_NULL);
+}
+
+static void
+jsonrpc_write_log(struct jsonrpc_request *req)
+{
+	int			wrote;
+	struct jsonrpc_log	*log;
+
+	wrote = 0;
+
+	for (log = req->log.next; log != &req->log; log = log->next) {
+		if (log->lvl >= 0 && log->lvl < 32 &&
+		    ((1 << log->lvl) & req->log_levels) == 0)
+			continue;
+
+		if (!wrote) {
+			kore_json_write_key(&req->writer, "data");
+			kore_json_write_begin_array(&req->writer);
+			wrote = 1;
+		}
+
+		kore_json_write_begin_array(&req->writer);
+		kore_json_write_integer(&req->writer, log->lvl);
+		kore_json_write_string(&req->writer, log->msg);
+		kore_json_write_end_array(&req->writer);
+	}
+
+	if (wrote)
+		kore_json_write_end_array(&req->writer);
+}
+
+/*
+ * A single request sends its response right away, a batch call keeps
+ * it on its writer until the whole batch is done.
+ */
+static void
+jsonrpc_respond(struct jsonrpc_request *req)
+{
+	if (req->batch != NULL) {
+		if (req->flags & JSONRPC_REQ_DONE)
+			fatal("jsonrpc: method '%s' answered twice",
+			    req->method != NULL ? req->method : "");
+
+		req->flags |= JSONRPC_REQ_DONE;
+		req->batch->pending--;
+		return;
+	}
+
+	if (req->writer.rope.length > 0) {
+		http_response_header(req->http,
+		    "content-type", "application/json");
+	}
+
+	http_response_rope(req->http, HTTP_STATUS_OK, &req->writer.rope);
+	jsonrpc_destroy_request(req);
+}
+
+static void
+jsonrpc_log_free(struct jsonrpc_log *root)
+{
+	struct jsonrpc_log	*log, *next;
+
+	for (log = root->next; log != root; log = next) {
+		next = log->next;
+		kore_free(log->msg);
+		kore_free(log);
+	}
+
+	root->next = root;
+	root->prev = root;
+}
+
+static const char *
+jsonrpc_known_msg(int code)
+{
+	switch (code) {
+	case JSONRPC_PARSE_ERROR:
+		return (JSONRPC_PARSE_ERROR_MSG);
+	case JSONRPC_INVALID_REQUEST:
+		return (JSONRPC_INVALID_REQUEST_MSG);
+	case JSONRPC_METHOD_NOT_FOUND:
+		return (JSONRPC_METHOD_NOT_FOUND_MSG);
+	case JSONRPC_INVALID_PARAMS:
+		return (JSONRPC_INVALID_PARAMS_MSG);
+	case JSONRPC_INTERNAL_ERROR:
+		return (JSONRPC_INTERNAL_ERROR_MSG);
+	case JSONRPC_SERVER_ERROR:
+		return (JSONRPC_SERVER_ERROR_MSG);
+	case JSONRPC_LIMIT_REACHED:
+		return (JSONRPC_LIMIT_REACHED_MSG);
+	default:
+		return (NULL);
+	}
+}
+
+/*
+ * Read and parse the body and set up a call for every request in it.
+ * Errors that concern the body as a whole are answered right away.
+ */
+static struct jsonrpc_batch *
+jsonrpc_batch_create(struct http_request *http,
+    const struct jsonrpc_method *methods)
+{
+	size_t			idx;
+	struct kore_json_item	*root, *item;
+	struct jsonrpc_request	req;
+	struct jsonrpc_batch	*batch;
+	int			ret;
+
+	jsonrpc_init(&req, http);
+	req.flags |= JSONRPC_REQ_REPLY;
+
+	batch = kore_calloc(1, sizeof(*batch));
+	kore_buf_init(&batch->body, 256);
+
+	if ((ret = jsonrpc_read_body(&req, &batch->body)) != 0)
+		goto fail;
+
+	kore_json_init(&batch->json, batch->body.data, batch->body.offset);
+
+	if (!kore_json_parse_indexed(&batch->json)) {
+		jsonrpc_log(&req, LOG_ERR, "Invalid json: %s",
+		    kore_json_strerror());
+		ret = JSONRPC_PARSE_ERROR;
+		goto fail;
+	}
+
+	root = batch->json.root;
+
+	if (root->type == KORE_JSON_TYPE_ARRAY) {
+		batch->array = 1;
+		TAILQ_FOREACH(item, &root->data.items, list)
+			batch->count++;
+
+		if (batch->count == 0) {
+			jsonrpc_log(&req, LOG_ERR, "JSON-RPC batch is empty");
+			ret = JSONRPC_INVALID_REQUEST;
+			goto fail;
+		}
+
+		if (batch->count > JSONRPC_BATCH_MAX) {
+			jsonrpc_log(&req, LOG_ERR,
+			    "JSON-RPC batch holds more than %d calls",
+			    JSONRPC_BATCH_MAX);
+			ret = JSONRPC_LIMIT_REACHED;
+			goto fail;
+		}
+	} else {
+		batch->count = 1;
+	}
+
+	batch->pending = batch->count;
+	batch->calls = kore_calloc(batch->count, sizeof(*batch->calls));
+
+	if (batch->array) {
+		idx = 0;
+		TAILQ_FOREACH(item, &root->data.items, list) {
+			jsonrpc_batch_call(batch, &batch->calls[idx++],
+			    http, item, methods);
+		}
+	} else {
+		jsonrpc_batch_call(batch, &batch->calls[0],
+		    http, root, methods);
+	}
+
+	jsonrpc_destroy_request(&req);
+
+	return (batch);
+
+fail:
+	kore_json_cleanup(&batch->json);
+	kore_buf_cleanup(&batch->body);
+	kore_free(batch);
+
+	jsonrpc_error(&req, ret, NULL);
+
+	return (NULL);
+}
+
+static void
+jsonrpc_batch_call(struct jsonrpc_batch *batch, struct jsonrpc_call *call,
+    struct http_request *http, struct kore_json_item *item,
+    const struct jsonrpc_method *methods)
+{
+	int				ret;
+	const struct jsonrpc_method	*method;
+
+	jsonrpc_init(&call->req, http);
+	call->req.batch = batch;
+
+	if ((ret = jsonrpc_parse(&call->req, item)) != 0) {
+		jsonrpc_error(&call->req, ret, NULL);
+		return;
+	}
+
+	for (method = methods; method->name != NULL; method++) {
+		if (!strcmp(method->name, call->req.method))
+			break;
+	}
+
+	if (method->name == NULL) {
+		jsonrpc_error(&call->req, JSONRPC_METHOD_NOT_FOUND, NULL);
+		return;
+	}
+
+	call->method = method;
+}
+
+/* Responses are linked together as they are, only separators are added. */
+static void
+jsonrpc_batch_respond(struct http_request *http, struct jsonrpc_batch *batch)
+{
+	size_t			i;
+	int			first;
+	struct kore_rope	rope, *part;
+
+	first = 1;
+	kore_rope_init(&rope);
+
+	if (batch->array)
+		kore_rope_append(&rope, "[", 1);
+
+	for (i = 0; i < batch->count; i++) {
+		part = &batch->calls[i].req.writer.rope;
+		if (part->length == 0)
+			continue;
+
+		if (!first)
+			kore_rope_append(&rope, ",", 1);
+
+		TAILQ_CONCAT(&rope.chunks, &part->chunks, list);
+		rope.length += part->length;
+		part->length = 0;
+
+		first = 0;
+	}
+
+	/* Only notifications, nothing is returned at all. */
+	if (first) {
+		kore_rope_cleanup(&rope);
+	} else {
+		if (batch->array)
+			kore_rope_append(&rope, "]", 1);
+		http_response_header(http, "content-type", "application/json");
+	}
+
+	http_response_rope(http, HTTP_STATUS_OK, &rope);
+}
+
+static void
+jsonrpc_batch_free(struct http_request *http)
+{
+	size_t			i;
+	struct jsonrpc_batch	*batch;
+
+	if ((batch = http->hdlr_extra) == NULL)
+		return;
+
+	for (i = 0; i < batch->count && batch->calls != NULL; i++)
+		jsonrpc_destroy_request(&batch->calls[i].req);
+
+	kore_free(batch->calls);
+	kore_json_cleanup(&batch->json);
+	kore_buf_cleanup(&batch->body);
+	kore_free(batch);
+
+	http->onfree = NULL;
+	http->hdlr_extra = NULL;
+}
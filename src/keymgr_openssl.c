@@ -30,6 +30,18 @@
  * it will send the newly loaded certificate chains to the worker processes
  * which will update their TLS contexts accordingly.
  *
+ * The keymgr also owns the TLS session ticket keys. It generates them and
+ * rotates them every tls_ticket_rotate seconds, or reads them from the
+ * tls_ticket_keyfile so that several hosts can share them. The workers
+ * get the current set in a KORE_MSG_TLS_TICKET_KEYS message, which makes
+ * a ticket issued by any worker usable on all of them.
+ *
+ * Domains with a certocsp file get their OCSP response stapled. The keymgr
+ * checks the file every minute and when it changed (or the response it
+ * holds went stale) it verifies it against the domain its certificate
+ * chain and sends it to the workers as KORE_MSG_OCSP, or an empty one
+ * so they stop stapling. The workers only ever staple from memory.
+ *
  * If ACME is turned on the keymgr will also hold all account and domain
  * keys and will initiate the process of acquiring new certificates against
  * the ACME provider that is configured if those certificates do not exist
@@ -42,6 +54,7 @@
 
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/ocsp.h>
 #include <openssl/rsa.h>
 #include <openssl/rand.h>
 #include <openssl/pem.h>
@@ -67,6 +80,11 @@
 #define RAND_POLL_INTERVAL	(1800 * 1000)
 #define RAND_FILE_SIZE		1024
 
+#define OCSP_CHECK_INTERVAL	(60 * 1000)
+
+/* Clock skew allowed for when looking at OCSP response times. */
+#define OCSP_MAX_SKEW		300
+
 #if defined(__linux__)
 #include "seccomp.h"
 
@@ -117,6 +135,9 @@ static struct sock_filter filter_keymgr[] = {
 	KORE_SYSCALL_ALLOW(epoll_wait),
 #endif
 	KORE_SYSCALL_ALLOW(epoll_pwait),
+#if defined(KORE_USE_IO_URING)
+	KORE_SYSCALL_ALLOW(io_uring_enter),
+#endif
 
 	/* Process things. */
 	KORE_SYSCALL_ALLOW(exit),
@@ -169,10 +190,29 @@ struct key {
 };
 
 char				*kore_rand_file = NULL;
+char				*kore_tls_ticket_file = NULL;
+u_int32_t			kore_tls_ticket_rotate = 3600;
 
 static TAILQ_HEAD(, key)	keys;
 static int			initialized = 0;
 
+/* Session ticket keys, newest (the one issuing tickets) first. */
+static u_int8_t		ticket_keys[KORE_TLS_TICKET_KEYS *
+			    KORE_TLS_TICKET_KEY_LEN];
+static size_t			ticket_count = 0;
+static struct kore_timer	*ticket_timer = NULL;
+
+/* What we last sent the workers for a domain its certocsp file. */
+struct ocsp_staple {
+	struct kore_domain		*dom;
+	time_t				mtime;
+	time_t				expires;
+	TAILQ_ENTRY(ocsp_staple)	list;
+};
+
+static TAILQ_HEAD(, ocsp_staple)	staples =
+    TAILQ_HEAD_INITIALIZER(staples);
+
 #if defined(KORE_USE_ACME)
 
 #define ACME_ORDER_STATE_INIT		1
@@ -234,6 +274,16 @@ static int	keymgr_asn1_convert_generalizedtime(const void *,
 #endif /* KORE_USE_ACME */
 
 static void	keymgr_reload(void);
+static void	keymgr_tickets_reload(void);
+static void	keymgr_tickets_rotate(void *, u_int64_t);
+static void	keymgr_tickets_generate(void);
+static int	keymgr_tickets_load(void);
+static void	keymgr_tickets_submit(u_int16_t);
+
+static void	keymgr_ocsp_check(void *, u_int64_t);
+static void	keymgr_submit_ocsp(struct kore_domain *, u_int16_t, int);
+static int	keymgr_ocsp_verify(struct kore_domain *,
+		    const u_int8_t *, size_t, time_t *);
 static void	keymgr_load_randfile(void);
 static void	keymgr_save_randfile(void);
 
@@ -248,10 +298,12 @@ static void	keymgr_submit_file(u_int8_t, struct kore_domain *,
 		    const char *, u_int16_t, int);
 static void	keymgr_x509_msg(const char *, const void *, size_t, int, int);
 
-static void	keymgr_rsa_encrypt(struct kore_msg *, const void *,
-		    struct key *);
-static void	keymgr_ecdsa_sign(struct kore_msg *, const void *,
-		    struct key *);
+static void	keymgr_key_request(struct kore_msg *,
+		    const struct kore_keyreq *, struct key *);
+static int	keymgr_rsa_encrypt(const struct kore_keyreq *, struct key *,
+		    u_int8_t *, size_t);
+static int	keymgr_ecdsa_sign(const struct kore_keyreq *, struct key *,
+		    u_int8_t *, size_t);
 
 #if defined(__OpenBSD__)
 #if defined(KORE_USE_ACME)
@@ -309,6 +361,8 @@ kore_keymgr_run(void)
 	initialized = 1;
 	keymgr_reload();
 
+	kore_timer_add(keymgr_ocsp_check, OCSP_CHECK_INTERVAL, NULL, 0);
+
 #if defined(__OpenBSD__)
 	if (pledge(keymgr_pledges, NULL) == -1)
 		fatalx("failed to pledge keymgr process");
@@ -376,6 +430,11 @@ kore_keymgr_cleanup(int final)
 		EVP_PKEY_free(key->pkey);
 		kore_free(key);
 	}
+
+	if (final) {
+		OPENSSL_cleanse(ticket_keys, sizeof(ticket_keys));
+		ticket_count = 0;
+	}
 }
 
 static void
@@ -403,6 +462,138 @@ keymgr_reload(void)
 		TAILQ_FOREACH(dom, &srv->domains, list)
 			keymgr_submit_certificates(dom, KORE_MSG_WORKER_ALL);
 	}
+
+	keymgr_tickets_reload();
+}
+
+static void
+keymgr_tickets_reload(void)
+{
+	if (kore_tls_ticket_file != NULL) {
+		if (!keymgr_tickets_load() && ticket_count == 0) {
+			fatalx("no session ticket keys in %s",
+			    kore_tls_ticket_file);
+		}
+	} else if (ticket_count == 0) {
+		keymgr_tickets_generate();
+	}
+
+	if (ticket_timer == NULL && kore_tls_ticket_rotate > 0) {
+		ticket_timer = kore_timer_add(keymgr_tickets_rotate,
+		    (u_int64_t)kore_tls_ticket_rotate * 1000, NULL, 0);
+	}
+
+	keymgr_tickets_submit(KORE_MSG_WORKER_ALL);
+}
+
+static void
+keymgr_tickets_rotate(void *unused, u_int64_t now)
+{
+	/* A keyfile is rotated by whoever writes it, we only reread it. */
+	if (kore_tls_ticket_file != NULL) {
+		if (!keymgr_tickets_load())
+			return;
+	} else {
+		keymgr_tickets_generate();
+	}
+
+	keymgr_tickets_submit(KORE_MSG_WORKER_ALL);
+}
+
+/*
+ * Push a fresh key in front, the older ones are kept around so the
+ * tickets they issued can still be used until they fall off the end.
+ */
+static void
+keymgr_tickets_generate(void)
+{
+	memmove(&ticket_keys[KORE_TLS_TICKET_KEY_LEN], ticket_keys,
+	    sizeof(ticket_keys) - KORE_TLS_TICKET_KEY_LEN);
+
+	if (RAND_bytes(ticket_keys, KORE_TLS_TICKET_KEY_LEN) != 1)
+		fatalx("RAND_bytes: %s", ssl_errno_s);
+
+	if (ticket_count < KORE_TLS_TICKET_KEYS)
+		ticket_count++;
+}
+
+/*
+ * The keyfile holds up to KORE_TLS_TICKET_KEYS keys of 80 bytes: name,
+ * HMAC secret and AES key, the same as an 80 byte nginx
+ * ssl_session_ticket_key file. The current keys are kept if it is bad.
+ */
+static int
+keymgr_tickets_load(void)
+{
+	int		fd, result;
+	struct stat	st;
+	ssize_t		ret;
+	size_t		total;
+	u_int8_t	buf[sizeof(ticket_keys)];
+
+	if ((fd = open(kore_tls_ticket_file, O_RDONLY)) == -1) {
+		kore_log(LOG_WARNING, "open(%s): %s",
+		    kore_tls_ticket_file, errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+
+	total = 0;
+	result = KORE_RESULT_ERROR;
+
+	if (fstat(fd, &st) == -1) {
+		kore_log(LOG_WARNING, "stat(%s): %s",
+		    kore_tls_ticket_file, errno_s);
+		goto cleanup;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0 ||
+	    st.st_size % KORE_TLS_TICKET_KEY_LEN ||
+	    (size_t)st.st_size > sizeof(buf)) {
+		kore_log(LOG_WARNING, "%s must hold 1 to %d keys of %d bytes",
+		    kore_tls_ticket_file, KORE_TLS_TICKET_KEYS,
+		    KORE_TLS_TICKET_KEY_LEN);
+		goto cleanup;
+	}
+
+	while (total != (size_t)st.st_size) {
+		ret = read(fd, buf + total, st.st_size - total);
+		if (ret == 0) {
+			kore_log(LOG_WARNING, "EOF on %s",
+			    kore_tls_ticket_file);
+			goto cleanup;
+		}
+
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			kore_log(LOG_WARNING, "read(%s): %s",
+			    kore_tls_ticket_file, errno_s);
+			goto cleanup;
+		}
+
+		total += (size_t)ret;
+	}
+
+	memcpy(ticket_keys, buf, total);
+	ticket_count = total / KORE_TLS_TICKET_KEY_LEN;
+	result = KORE_RESULT_OK;
+
+cleanup:
+	OPENSSL_cleanse(buf, sizeof(buf));
+	(void)close(fd);
+
+	return (result);
+}
+
+static void
+keymgr_tickets_submit(u_int16_t dst)
+{
+	if (ticket_count == 0)
+		return;
+
+	keymgr_x509_msg("", ticket_keys,
+	    ticket_count * KORE_TLS_TICKET_KEY_LEN, dst,
+	    KORE_MSG_TLS_TICKET_KEYS);
 }
 
 static void
@@ -421,6 +612,217 @@ keymgr_submit_certificates(struct kore_domain *dom, u_int16_t dst)
 
 	if (dom->crlfile != NULL)
 		keymgr_submit_file(KORE_MSG_CRL, dom, dom->crlfile, dst, 1);
+
+	keymgr_submit_ocsp(dom, dst, 1);
+}
+
+static void
+keymgr_ocsp_check(void *unused, u_int64_t now)
+{
+	struct kore_server	*srv;
+	struct kore_domain	*dom;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		if (srv->tls == 0)
+			continue;
+		TAILQ_FOREACH(dom, &srv->domains, list)
+			keymgr_submit_ocsp(dom, KORE_MSG_WORKER_ALL, 0);
+	}
+}
+
+/*
+ * Send the OCSP response for dom if its file changed or what we sent
+ * last has expired, or regardless if force is set. If there is no
+ * valid response the workers get an empty one.
+ */
+static void
+keymgr_submit_ocsp(struct kore_domain *dom, u_int16_t dst, int force)
+{
+	int			fd;
+	struct stat		st;
+	size_t			len;
+	time_t			expires;
+	struct ocsp_staple	*staple;
+	u_int8_t		*payload;
+
+	if (dom->ocspfile == NULL)
+		return;
+
+	TAILQ_FOREACH(staple, &staples, list) {
+		if (staple->dom == dom)
+			break;
+	}
+
+	if (staple == NULL) {
+		staple = kore_calloc(1, sizeof(*staple));
+		staple->dom = dom;
+		TAILQ_INSERT_TAIL(&staples, staple, list);
+	}
+
+	if ((fd = open(dom->ocspfile, O_RDONLY)) != -1) {
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+		    st.st_size == 0) {
+			(void)close(fd);
+			fd = -1;
+		}
+	}
+
+	if (fd == -1)
+		memset(&st, 0, sizeof(st));
+
+	if (!force && st.st_mtime == staple->mtime &&
+	    (staple->expires == 0 || time(NULL) < staple->expires)) {
+		if (fd != -1)
+			(void)close(fd);
+		return;
+	}
+
+	len = 0;
+	expires = 0;
+	payload = MAP_FAILED;
+
+	if (fd == -1) {
+		kore_log(LOG_WARNING, "%s: cannot read OCSP response %s",
+		    dom->domain, dom->ocspfile);
+	} else {
+		payload = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (payload == MAP_FAILED)
+			fatalx("mmap(): %s", errno_s);
+		if (keymgr_ocsp_verify(dom, payload, st.st_size, &expires))
+			len = st.st_size;
+	}
+
+	keymgr_x509_msg(dom->domain, len ? payload : (u_int8_t *)"", len,
+	    dst, KORE_MSG_OCSP);
+
+	staple->mtime = st.st_mtime;
+	staple->expires = expires;
+
+	if (payload != MAP_FAILED)
+		(void)munmap(payload, st.st_size);
+	if (fd != -1)
+		(void)close(fd);
+}
+
+/*
+ * Check that the response is a good one for the certificate of dom,
+ * signed by its issuer or a responder that issuer delegated to, and
+ * not stale. *expires is set to its nextUpdate if it has one.
+ */
+static int
+keymgr_ocsp_verify(struct kore_domain *dom, const u_int8_t *der, size_t len,
+    time_t *expires)
+{
+	BIO			*in;
+	const u_int8_t		*ptr;
+	X509_STORE		*store;
+	OCSP_CERTID		*id;
+	OCSP_BASICRESP		*basic;
+	OCSP_RESPONSE		*resp;
+	STACK_OF(X509)		*chain;
+	X509			*leaf, *x509;
+	ASN1_GENERALIZEDTIME	*thisupd, *nextupd;
+	int			i, ret, status, reason, days, secs;
+
+	id = NULL;
+	leaf = NULL;
+	resp = NULL;
+	basic = NULL;
+	ret = KORE_RESULT_ERROR;
+
+	if ((store = X509_STORE_new()) == NULL)
+		fatalx("X509_STORE_new(): %s", ssl_errno_s);
+	if ((chain = sk_X509_new_null()) == NULL)
+		fatalx("sk_X509_new_null(): %s", ssl_errno_s);
+
+	if ((in = BIO_new_file(dom->certfile, "r")) == NULL) {
+		kore_log(LOG_WARNING, "%s: %s", dom->certfile, ssl_errno_s);
+		goto cleanup;
+	}
+
+	leaf = PEM_read_bio_X509(in, NULL, NULL, NULL);
+	while ((x509 = PEM_read_bio_X509(in, NULL, NULL, NULL)) != NULL) {
+		if (!sk_X509_push(chain, x509))
+			fatalx("sk_X509_push(): %s", ssl_errno_s);
+	}
+
+	BIO_free(in);
+	ERR_clear_error();
+
+	if (leaf == NULL || sk_X509_num(chain) == 0) {
+		kore_log(LOG_WARNING,
+		    "%s: %s must hold the issuer to staple OCSP responses",
+		    dom->domain, dom->certfile);
+		goto cleanup;
+	}
+
+	/* Our own chain is what the responder has to chain up to. */
+	for (i = 0; i < sk_X509_num(chain); i++)
+		X509_STORE_add_cert(store, sk_X509_value(chain, i));
+	X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+
+	ptr = der;
+	if ((resp = d2i_OCSP_RESPONSE(NULL, &ptr, len)) == NULL) {
+		kore_log(LOG_WARNING, "%s: %s is not an OCSP response",
+		    dom->domain, dom->ocspfile);
+		goto cleanup;
+	}
+
+	if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL ||
+	    (basic = OCSP_response_get1_basic(resp)) == NULL) {
+		kore_log(LOG_WARNING, "%s: %s is not a successful response",
+		    dom->domain, dom->ocspfile);
+		goto cleanup;
+	}
+
+	if (OCSP_basic_verify(basic, chain, store, OCSP_NOEXPLICIT) != 1) {
+		kore_log(LOG_WARNING, "%s: %s does not verify: %s",
+		    dom->domain, dom->ocspfile, ssl_errno_s);
+		goto cleanup;
+	}
+
+	if ((id = OCSP_cert_to_id(NULL, leaf, sk_X509_value(chain, 0))) == NULL)
+		fatalx("OCSP_cert_to_id(): %s", ssl_errno_s);
+
+	if (!OCSP_resp_find_status(basic, id, &status, &reason, NULL,
+	    &thisupd, &nextupd)) {
+		kore_log(LOG_WARNING, "%s: %s is for another certificate",
+		    dom->domain, dom->ocspfile);
+		goto cleanup;
+	}
+
+	if (status != V_OCSP_CERTSTATUS_GOOD) {
+		kore_log(LOG_WARNING, "%s: certificate status is %s",
+		    dom->domain, OCSP_cert_status_str(status));
+		goto cleanup;
+	}
+
+	if (!OCSP_check_validity(thisupd, nextupd, OCSP_MAX_SKEW, -1)) {
+		kore_log(LOG_WARNING, "%s: %s is stale",
+		    dom->domain, dom->ocspfile);
+		goto cleanup;
+	}
+
+	*expires = 0;
+	if (nextupd != NULL) {
+		if (!ASN1_TIME_diff(&days, &secs, NULL, nextupd))
+			goto cleanup;
+		*expires = time(NULL) + (time_t)days * 86400 + secs;
+	}
+
+	ret = KORE_RESULT_OK;
+
+cleanup:
+	ERR_clear_error();
+
+	X509_free(leaf);
+	OCSP_CERTID_free(id);
+	X509_STORE_free(store);
+	OCSP_RESPONSE_free(resp);
+	OCSP_BASICRESP_free(basic);
+	sk_X509_pop_free(chain, X509_free);
+
+	return (ret);
 }
 
 static void
@@ -605,6 +1007,8 @@ keymgr_certificate_request(struct kore_msg *msg, const void *data)
 		TAILQ_FOREACH(dom, &srv->domains, list)
 			keymgr_submit_certificates(dom, msg->src);
 	}
+
+	keymgr_tickets_submit(msg->src);
 }
 
 static void
@@ -648,21 +1052,15 @@ keymgr_msg_recv(struct kore_msg *msg, const void *data)
 			break;
 	}
 
-	if (key == NULL)
+	if (key == NULL) {
+		if (msg->id == KORE_MSG_KEYMGR_REQ)
+			keymgr_key_request(msg, req, NULL);
 		return;
+	}
 
 	switch (msg->id) {
 	case KORE_MSG_KEYMGR_REQ:
-		switch (EVP_PKEY_id(key->pkey)) {
-		case EVP_PKEY_RSA:
-			keymgr_rsa_encrypt(msg, data, key);
-			break;
-		case EVP_PKEY_EC:
-			keymgr_ecdsa_sign(msg, data, key);
-			break;
-		default:
-			break;
-		}
+		keymgr_key_request(msg, req, key);
 		break;
 #if defined(KORE_USE_ACME)
 	case KORE_ACME_CSR_REQUEST:
@@ -682,53 +1080,81 @@ keymgr_msg_recv(struct kore_msg *msg, const void *data)
 }
 
 static void
-keymgr_rsa_encrypt(struct kore_msg *msg, const void *data, struct key *key)
+keymgr_key_request(struct kore_msg *msg, const struct kore_keyreq *req,
+    struct key *key)
 {
-	int				ret;
-	RSA				*rsa;
-	const struct kore_keyreq	*req;
-	size_t				keylen;
-	u_int8_t			buf[1024];
+	int			len;
+	struct kore_keyres	*res;
+	u_int8_t		buf[sizeof(*res) + 1024];
+
+	res = (struct kore_keyres *)buf;
+	res->id = req->id;
+
+	switch (key != NULL ? EVP_PKEY_id(key->pkey) : EVP_PKEY_NONE) {
+	case EVP_PKEY_RSA:
+		len = keymgr_rsa_encrypt(req, key, res->data,
+		    sizeof(buf) - sizeof(*res));
+		break;
+	case EVP_PKEY_EC:
+		len = keymgr_ecdsa_sign(req, key, res->data,
+		    sizeof(buf) - sizeof(*res));
+		break;
+	default:
+		len = -1;
+		break;
+	}
+
+	/* Always answer, the worker may have a handshake parked on it. */
+	if (len == -1)
+		len = 0;
+
+	kore_msg_send(msg->src, KORE_MSG_KEYMGR_RESP, buf, sizeof(*res) + len);
+}
+
+static int
+keymgr_rsa_encrypt(const struct kore_keyreq *req, struct key *key,
+    u_int8_t *out, size_t outlen)
+{
+	int		ret;
+	RSA		*rsa;
+	size_t		keylen;
 
-	req = (const struct kore_keyreq *)data;
 	rsa = EVP_PKEY_get0_RSA(key->pkey);
 
 	keylen = RSA_size(rsa);
-	if (req->data_len > keylen || keylen > sizeof(buf))
-		return;
+	if (req->data_len > keylen || keylen > outlen)
+		return (-1);
 
 	ret = RSA_private_encrypt(req->data_len, req->data,
-	    buf, rsa, req->padding);
+	    out, rsa, req->padding);
 	if (ret != RSA_size(rsa))
-		return;
+		return (-1);
 
-	kore_msg_send(msg->src, KORE_MSG_KEYMGR_RESP, buf, ret);
+	return (ret);
 }
 
-static void
-keymgr_ecdsa_sign(struct kore_msg *msg, const void *data, struct key *key)
+static int
+keymgr_ecdsa_sign(const struct kore_keyreq *req, struct key *key,
+    u_int8_t *out, size_t outlen)
 {
-	size_t				len;
-	EC_KEY				*ec;
-	const struct kore_keyreq	*req;
-	unsigned int			siglen;
-	u_int8_t			sig[1024];
+	size_t		len;
+	EC_KEY		*ec;
+	unsigned int	siglen;
 
-	req = (const struct kore_keyreq *)data;
 	ec = EVP_PKEY_get0_EC_KEY(key->pkey);
 
 	len = ECDSA_size(ec);
-	if (req->data_len > len || len > sizeof(sig))
-		return;
+	if (req->data_len > len || len > outlen)
+		return (-1);
 
 	if (ECDSA_sign(EVP_PKEY_NONE, req->data, req->data_len,
-	    sig, &siglen, ec) == 0)
-		return;
+	    out, &siglen, ec) == 0)
+		return (-1);
 
-	if (siglen > sizeof(sig))
-		return;
+	if (siglen > outlen)
+		return (-1);
 
-	kore_msg_send(msg->src, KORE_MSG_KEYMGR_RESP, sig, siglen);
+	return (siglen);
 }
 
 static void
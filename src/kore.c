@@ -21,6 +21,10 @@
 #include <sys/socket.h>
 #include <sys/resource.h>
 
+#if defined(__linux__)
+#include <linux/filter.h>
+#endif
+
 #include <libgen.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -66,10 +70,18 @@ char			**kore_argv = NULL;
 int			kore_foreground = 0;
 char			*kore_progname = NULL;
 u_int32_t		kore_socket_backlog = 5000;
+u_int8_t		kore_socket_reuseport = KORE_REUSEPORT_OFF;
+u_int32_t		kore_socket_busy_poll = 0;
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+size_t			kore_socket_zerocopy = 0;
+#endif
 char			*kore_pidfile = KORE_PIDFILE_DEFAULT;
 
 struct kore_privsep	worker_privsep;
 
+static struct kore_evloop	evloop;
+struct kore_evloop		*kore_evloop = &evloop;
+
 extern char		**environ;
 extern char		*__progname;
 static size_t		proctitle_maxlen = 0;
@@ -82,6 +94,8 @@ static void	kore_proctitle_setup(void);
 static void	kore_server_shutdown(void);
 static void	kore_server_start(int, char *[]);
 static void	kore_call_parent_configure(int, char **);
+static void	kore_listener_reuseport(struct listener *, u_int16_t);
+static int	kore_listener_busy_poll(int);
 
 #if !defined(KORE_SINGLE_BINARY) && defined(KORE_USE_PYTHON)
 static const char	*parent_config_hook = KORE_PYTHON_CONFIG_HOOK;
@@ -170,8 +184,11 @@ main(int argc, char *argv[])
 #endif
 
 	kore_mem_init();
+	kore_rope_pool_init();
+	kore_json_pool_init();
 	kore_msg_init();
 	kore_log_init();
+	kore_upgrade_init(argc, argv);
 
 	kore_progname = kore_strdup(argv[0]);
 	kore_proctitle_setup();
@@ -281,7 +298,9 @@ main(int argc, char *argv[])
 		kore_free(rcall);
 	}
 
-	if (unlink(kore_pidfile) == -1 && errno != ENOENT)
+	/* After an upgrade the pidfile belongs to the new process. */
+	if (!kore_upgrade_handover &&
+	    unlink(kore_pidfile) == -1 && errno != ENOENT)
 		kore_log(LOG_NOTICE, "failed to remove pidfile (%s)", errno_s);
 
 	kore_server_cleanup();
@@ -349,7 +368,7 @@ int
 kore_server_bind(struct kore_server *srv, const char *ip, const char *port,
     const char *ccb)
 {
-	int			r;
+	int			r, fd;
 	struct listener		*l;
 	struct addrinfo		hints, *results;
 
@@ -369,11 +388,20 @@ kore_server_bind(struct kore_server *srv, const char *ip, const char *port,
 	l->host = kore_strdup(ip);
 	l->port = kore_strdup(port);
 
+	fd = kore_upgrade_socket(results->ai_family, ip, port);
+	l->fd = fd;
+
 	if (!kore_listener_init(l, results->ai_family, ccb)) {
 		freeaddrinfo(results);
 		return (KORE_RESULT_ERROR);
 	}
 
+	/* Handed over by the process we replace, already listening. */
+	if (fd != -1) {
+		freeaddrinfo(results);
+		return (KORE_RESULT_OK);
+	}
+
 	if (bind(l->fd, results->ai_addr, results->ai_addrlen) == -1) {
 		kore_listener_free(l);
 		freeaddrinfo(results);
@@ -397,7 +425,7 @@ kore_server_bind_unix(struct kore_server *srv, const char *path,
     const char *ccb)
 {
 	struct listener		*l;
-	int			len;
+	int			len, fd;
 	struct sockaddr_un	sun;
 	socklen_t		socklen;
 
@@ -421,9 +449,15 @@ kore_server_bind_unix(struct kore_server *srv, const char *path,
 	l = kore_listener_create(srv);
 	l->host = kore_strdup(path);
 
+	fd = kore_upgrade_socket(AF_UNIX, path, NULL);
+	l->fd = fd;
+
 	if (!kore_listener_init(l, AF_UNIX, ccb))
 		return (KORE_RESULT_ERROR);
 
+	if (fd != -1)
+		return (KORE_RESULT_OK);
+
 	if (sun.sun_path[0] != '\0') {
 		if (unlink(sun.sun_path) == -1 && errno != ENOENT) {
 			kore_log(LOG_ERR, "unlink: %s: %s",
@@ -479,12 +513,21 @@ kore_server_finalize(struct kore_server *srv)
 		return;
 
 	LIST_FOREACH(l, &srv->listeners, list) {
-		if (srv->tls)
+		if (srv->proxy != NULL)
+			proto = srv->tls ? "tls proxy" : "tcp proxy";
+		else if (srv->tls)
 			proto = "https";
 		else
 			proto = "http";
 
-		if (l->family == AF_UNIX) {
+		if (srv->proxy != NULL && l->family == AF_UNIX) {
+			kore_log(LOG_INFO, "%s serving %s on %s to %s",
+			    srv->name, proto, l->host, srv->proxy->name);
+		} else if (srv->proxy != NULL) {
+			kore_log(LOG_INFO, "%s serving %s on %s:%s to %s",
+			    srv->name, proto, l->host, l->port,
+			    srv->proxy->name);
+		} else if (l->family == AF_UNIX) {
 			kore_log(LOG_INFO, "%s serving %s on %s",
 			    srv->name, proto, l->host);
 		} else {
@@ -540,7 +583,8 @@ kore_listener_init(struct listener *l, int family, const char *ccb)
 
 	l->family = family;
 
-	if ((l->fd = socket(family, SOCK_STREAM, 0)) == -1) {
+	/* A socket handed over on upgrade only needs its options again. */
+	if (l->fd == -1 && (l->fd = socket(family, SOCK_STREAM, 0)) == -1) {
 		kore_listener_free(l);
 		kore_log(LOG_ERR, "socket(): %s", errno_s);
 		return (KORE_RESULT_ERROR);
@@ -563,6 +607,18 @@ kore_listener_init(struct listener *l, int family, const char *ccb)
 		return (KORE_RESULT_ERROR);
 	}
 
+	if (kore_socket_reuseport != KORE_REUSEPORT_OFF && family != AF_UNIX) {
+		if (!kore_sockopt(l->fd, SOL_SOCKET, SO_REUSEPORT)) {
+			kore_listener_free(l);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (family != AF_UNIX && !kore_listener_busy_poll(l->fd)) {
+		kore_listener_free(l);
+		return (KORE_RESULT_ERROR);
+	}
+
 	if (ccb != NULL) {
 		if ((l->connect = kore_runtime_getcall(ccb)) == NULL) {
 			kore_log(LOG_ERR, "no such callback: '%s'", ccb);
@@ -587,6 +643,11 @@ kore_server_free(struct kore_server *srv)
 	while ((dom = TAILQ_FIRST(&srv->domains)) != NULL)
 		kore_domain_free(dom);
 
+	kore_domain_index_free(srv);
+
+	if (srv->proxy != NULL)
+		kore_proxy_free(srv->proxy);
+
 	while ((l = LIST_FIRST(&srv->listeners)) != NULL)
 		kore_listener_free(l);
 
@@ -597,13 +658,20 @@ kore_server_free(struct kore_server *srv)
 void
 kore_listener_free(struct listener *l)
 {
-	int	rm;
+	u_int16_t	i;
+	int		rm;
 
 	LIST_REMOVE(l, list);
 
 	if (l->fd != -1)
 		close(l->fd);
 
+	if (l->reuse_fds != NULL) {
+		for (i = 0; i < l->reuse_cnt; i++)
+			close(l->reuse_fds[i]);
+		kore_free(l->reuse_fds);
+	}
+
 	rm = 0;
 
 #if defined(__linux__)
@@ -613,6 +681,9 @@ kore_listener_free(struct listener *l)
 	if (worker == NULL && l->family == AF_UNIX)
 		rm++;
 #endif
+	if (kore_upgrade_handover)
+		rm = 0;
+
 	if (rm) {
 		if (unlink(l->host) == -1) {
 			kore_log(LOG_NOTICE,
@@ -632,7 +703,7 @@ kore_listener_accept(void *arg, int error)
 {
 	struct connection	*c;
 	struct listener		*l = arg;
-	u_int32_t		accepted;
+	u_int32_t		accepted, threshold;
 
 	if (error)
 		fatal("error on listening socket");
@@ -641,16 +712,26 @@ kore_listener_accept(void *arg, int error)
 		return;
 
 	accepted = 0;
+#if !defined(KORE_NO_HTTP)
+	threshold = http_overload_accept(worker_accept_threshold);
+#else
+	threshold = worker_accept_threshold;
+#endif
 
 	while (worker_active_connections < worker_max_connections) {
-		if (worker_accept_threshold != 0 &&
-		    accepted >= worker_accept_threshold) {
+		if (threshold != 0 && accepted >= threshold) {
 			kore_worker_make_busy();
 			break;
 		}
 
-		if (!kore_connection_accept(l, &c))
+		switch (kore_connection_accept(l, &c)) {
+		case KORE_RESULT_OK:
 			break;
+		case KORE_RESULT_RETRY:
+			continue;
+		default:
+			return;
+		}
 
 		if (c == NULL)
 			break;
@@ -681,6 +762,7 @@ kore_signal_setup(void)
 	kore_signal_trap(SIGQUIT);
 	kore_signal_trap(SIGTERM);
 	kore_signal_trap(SIGUSR1);
+	kore_signal_trap(SIGUSR2);
 	kore_signal_trap(SIGCHLD);
 
 	if (kore_foreground)
@@ -710,12 +792,109 @@ kore_signal_trap(int sig)
 void
 kore_server_closeall(void)
 {
+	u_int16_t		i;
 	struct listener		*l;
 	struct kore_server	*srv;
 
 	LIST_FOREACH(srv, &kore_servers, list) {
-		LIST_FOREACH(l, &srv->listeners, list)
+		LIST_FOREACH(l, &srv->listeners, list) {
 			l->fd = -1;
+			if (l->reuse_fds != NULL) {
+				for (i = 0; i < l->reuse_cnt; i++)
+					close(l->reuse_fds[i]);
+				kore_free(l->reuse_fds);
+				l->reuse_fds = NULL;
+				l->reuse_cnt = 0;
+			}
+		}
+	}
+}
+
+/*
+ * Give every worker its own SO_REUSEPORT listening socket for each
+ * listener, so the kernel spreads connections over the workers and
+ * the accept lock is no longer needed. All sockets are created here
+ * by the parent and kept open, a restarted worker picks up its own.
+ * Returns 1 if the sockets are in place, 0 if the accept lock is used.
+ */
+int
+kore_server_reuseport(u_int16_t workers)
+{
+	struct listener		*l;
+	struct kore_server	*srv;
+
+	if (kore_socket_reuseport == KORE_REUSEPORT_OFF || workers < 2)
+		return (0);
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list) {
+			if (l->family != AF_UNIX)
+				continue;
+			kore_log(LOG_NOTICE,
+			    "socket_reuseport: unix listener %s, using lock",
+			    l->host);
+			return (0);
+		}
+	}
+
+	if (kore_socket_reuseport == KORE_REUSEPORT_CPU &&
+	    (worker_set_affinity == 0 || workers != cpu_count)) {
+		kore_log(LOG_NOTICE, "socket_reuseport: cpu steering "
+		    "needs one pinned worker per cpu, hashing instead");
+		kore_socket_reuseport = KORE_REUSEPORT_ON;
+	}
+
+#if defined(__linux__)
+	if (kore_socket_reuseport == KORE_REUSEPORT_NODE &&
+	    (worker_set_affinity == 0 ||
+	    kore_platform_reuseport_node(workers) == NULL)) {
+		kore_log(LOG_NOTICE, "socket_reuseport: node steering "
+		    "needs pinned workers on several numa nodes, "
+		    "hashing instead");
+		kore_socket_reuseport = KORE_REUSEPORT_ON;
+	}
+#endif
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list)
+			kore_listener_reuseport(l, workers);
+	}
+
+	return (1);
+}
+
+/*
+ * Called in a worker: keep the socket that belongs to it and close the
+ * ones belonging to the other workers. For cpu steering the socket index
+ * is the cpu the worker is pinned to, otherwise it follows the worker id.
+ */
+void
+kore_server_reuseport_select(u_int16_t id)
+{
+	u_int16_t		i, idx;
+	struct listener		*l;
+	struct kore_server	*srv;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list) {
+			if (l->reuse_fds == NULL)
+				continue;
+
+			if (kore_socket_reuseport == KORE_REUSEPORT_CPU)
+				idx = worker->cpu % l->reuse_cnt;
+			else
+				idx = id % l->reuse_cnt;
+			for (i = 0; i < l->reuse_cnt; i++) {
+				if (i != idx)
+					close(l->reuse_fds[i]);
+			}
+
+			l->fd = l->reuse_fds[idx];
+
+			kore_free(l->reuse_fds);
+			l->reuse_fds = NULL;
+			l->reuse_cnt = 0;
+		}
 	}
 }
 
@@ -786,10 +965,6 @@ kore_server_start(int argc, char *argv[])
 	struct kore_server		*srv;
 	u_int64_t			netwait;
 	int				last_sig;
-#if !defined(KORE_NO_HTTP)
-	int				alog;
-	struct kore_domain		*dom;
-#endif
 #if defined(KORE_SINGLE_BINARY)
 	struct kore_runtime_call	*rcall;
 #endif
@@ -864,6 +1039,12 @@ kore_server_start(int argc, char *argv[])
 
 	kore_platform_proctitle("[parent]");
 
+#if defined(KORE_USE_PYTHON)
+	kore_python_fork_prepare();
+#endif
+
+	kore_upgrade_release();
+
 	if (!kore_worker_init()) {
 		kore_log(LOG_ERR, "last worker log lines:");
 		kore_log(LOG_ERR, "=====================================");
@@ -885,27 +1066,18 @@ kore_server_start(int argc, char *argv[])
 	kore_connection_init();
 	kore_platform_event_init();
 	kore_msg_parent_init();
+	kore_msg_register(KORE_MSG_POOL_STATS, kore_worker_pool_stats);
 
 	worker_max_connections = tmp;
 
 	kore_timer_init();
 
 #if !defined(KORE_NO_HTTP)
-	alog = 0;
-
-	LIST_FOREACH(srv, &kore_servers, list) {
-		TAILQ_FOREACH(dom, &srv->domains, list) {
-			if (dom->accesslog != -1)
-				alog = 1;
-		}
-	}
-
-	if (alog) {
-		kore_timer_add(kore_accesslog_run, 100, NULL, 0);
-		kore_log(LOG_INFO, "accesslog vacuum is enabled");
-	}
+	kore_accesslog_start();
 #endif
 
+	kore_upgrade_ready();
+
 #if defined(KORE_USE_PYTHON)
 	kore_msg_unregister(KORE_PYTHON_SEND_OBJ);
 #endif
@@ -926,7 +1098,15 @@ kore_server_start(int argc, char *argv[])
 				kore_worker_dispatch_signal(last_sig);
 				continue;
 			case SIGUSR1:
+				kore_worker_loop_report();
+				kore_worker_pool_stats_request();
 				kore_worker_dispatch_signal(last_sig);
+#if !defined(KORE_NO_HTTP)
+				kore_accesslog_rotate();
+#endif
+				break;
+			case SIGUSR2:
+				kore_upgrade_start();
 				break;
 			case SIGCHLD:
 				kore_worker_reap();
@@ -941,6 +1121,7 @@ kore_server_start(int argc, char *argv[])
 				continue;
 		}
 
+		kore_msg_flush();
 		netwait = kore_timer_next_run(kore_time_ms());
 		kore_platform_event_wait(netwait);
 		kore_connection_prune(KORE_CONNECTION_PRUNE_DISCONNECT);
@@ -960,7 +1141,7 @@ kore_server_shutdown(void)
 	kore_worker_shutdown();
 
 #if !defined(KORE_NO_HTTP)
-	kore_accesslog_gather(NULL, kore_time_ms(), 1);
+	kore_accesslog_stop();
 #endif
 
 	kore_platform_event_cleanup();
@@ -984,6 +1165,103 @@ kore_write_kore_pid(void)
 	}
 }
 
+static void
+kore_listener_reuseport(struct listener *l, u_int16_t count)
+{
+	u_int16_t		idx;
+	socklen_t		len;
+	struct sockaddr_storage	sst;
+	int			fd, opt;
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+	struct sock_fprog	prog;
+	struct sock_filter	code[] = {
+		/* Pick the socket with the index of the receiving cpu. */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+#endif
+
+	opt = 0;
+	len = sizeof(opt);
+
+	if (getsockopt(l->fd, SOL_SOCKET, SO_REUSEPORT, &opt, &len) == -1)
+		fatal("getsockopt(SO_REUSEPORT): %s", errno_s);
+
+	if (opt == 0)
+		fatal("socket_reuseport must be set before any bind directive");
+
+	len = sizeof(sst);
+	if (getsockname(l->fd, (struct sockaddr *)&sst, &len) == -1)
+		fatal("getsockname(): %s", errno_s);
+
+	l->reuse_cnt = count;
+	l->reuse_fds = kore_calloc(count, sizeof(int));
+
+	/* The socket bound from the configuration is the first member. */
+	l->reuse_fds[0] = l->fd;
+	l->fd = -1;
+
+	for (idx = 1; idx < count; idx++) {
+		if ((fd = socket(l->family, SOCK_STREAM, 0)) == -1)
+			fatal("socket(): %s", errno_s);
+
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+			fatal("fcntl(): %s", errno_s);
+
+		if (!kore_connection_nonblock(fd, 1) ||
+		    !kore_sockopt(fd, SOL_SOCKET, SO_REUSEADDR) ||
+		    !kore_sockopt(fd, SOL_SOCKET, SO_REUSEPORT) ||
+		    !kore_listener_busy_poll(fd))
+			fatal("failed to setup reuseport socket");
+
+		if (bind(fd, (struct sockaddr *)&sst, len) == -1)
+			fatal("bind(): %s", errno_s);
+
+		if (listen(fd, kore_socket_backlog) == -1)
+			fatal("listen(): %s", errno_s);
+
+		l->reuse_fds[idx] = fd;
+	}
+
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+	if (kore_socket_reuseport == KORE_REUSEPORT_CPU) {
+		prog.len = sizeof(code) / sizeof(code[0]);
+		prog.filter = code;
+	} else if (kore_socket_reuseport == KORE_REUSEPORT_NODE) {
+		prog = *kore_platform_reuseport_node(count);
+	}
+
+	if (kore_socket_reuseport == KORE_REUSEPORT_CPU ||
+	    kore_socket_reuseport == KORE_REUSEPORT_NODE) {
+		if (setsockopt(l->reuse_fds[0], SOL_SOCKET,
+		    SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+			fatal("setsockopt(SO_ATTACH_REUSEPORT_CBPF): %s",
+			    errno_s);
+	}
+#endif
+}
+
+/* Accepted sockets inherit the busy poll setting from their listener. */
+static int
+kore_listener_busy_poll(int fd)
+{
+#if defined(SO_BUSY_POLL)
+	int		usec;
+
+	if (kore_socket_busy_poll == 0)
+		return (KORE_RESULT_OK);
+
+	usec = kore_socket_busy_poll;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+	    &usec, sizeof(usec)) == -1) {
+		kore_log(LOG_ERR, "setsockopt(SO_BUSY_POLL): %s", errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+#endif
+
+	return (KORE_RESULT_OK);
+}
+
 static void
 kore_call_parent_configure(int argc, char **argv)
 {
@@ -19,6 +19,13 @@
 #include <sys/sendfile.h>
 #include <sys/syscall.h>
 
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sched.h>
 
 #include "kore.h"
@@ -32,9 +39,29 @@
 #include "tasks.h"
 #endif
 
+#if defined(KORE_USE_PYTHON)
+#include "python_api.h"
+#endif
+
+#define NUMA_SYSFS		"/sys/devices/system/node"
+
+static void	numa_init(void);
+static void	numa_mempolicy(u_int16_t);
+static int	numa_nic(u_int8_t *);
+static int	numa_cpulist(const char *, u_int8_t *);
+static int	numa_read(const char *, char *, size_t);
+
+static int			numa_done = 0;
+static u_int16_t		numa_nodes = 0;
+static u_int16_t		numa_ncpus = 0;
+static u_int16_t		*numa_node = NULL;
+static u_int16_t		*numa_order = NULL;
+
+#if !defined(KORE_USE_IO_URING)
 static int			efd = -1;
 static u_int32_t		event_count = 0;
 static struct epoll_event	*events = NULL;
+#endif
 
 void
 kore_platform_init(void)
@@ -64,8 +91,394 @@ kore_platform_worker_setcpu(struct kore_worker *kw)
 		kore_debug("kore_worker_setcpu(): worker %d on cpu %d",
 		    kw->id, kw->cpu);
 	}
+
+	if (worker_numa != KORE_NUMA_OFF)
+		numa_mempolicy(kw->cpu);
 }
 
+/* Pins the calling thread to the given cpu, -1 allows all of them. */
+void
+kore_platform_thread_setcpu(int cpu)
+{
+	int		i;
+	cpu_set_t	cpuset;
+
+	CPU_ZERO(&cpuset);
+
+	if (cpu == -1) {
+		for (i = 0; i < cpu_count; i++)
+			CPU_SET(i, &cpuset);
+	} else {
+		CPU_SET(cpu, &cpuset);
+	}
+
+	if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) == -1)
+		kore_debug("kore_platform_thread_setcpu(): %s", errno_s);
+}
+
+/*
+ * The cpu for the n-th worker. With worker_numa the workers take turns
+ * over the numa nodes so they are spread evenly, starting on the node
+ * of worker_numa_nic and on the cpus handling its interrupts.
+ */
+u_int16_t
+kore_platform_worker_cpu(u_int16_t n)
+{
+	if (worker_numa != KORE_NUMA_OFF) {
+		numa_init();
+		if (numa_order != NULL)
+			return (numa_order[n % numa_ncpus]);
+	}
+
+	return ((n + 1) % cpu_count);
+}
+
+/*
+ * Build the reuseport program for socket_reuseport node: a connection
+ * goes to a worker on the numa node of the cpu that received it, cpus
+ * are spread over the workers of their node. Returns NULL if the workers
+ * do not run on more than one node or there are too many cpus.
+ */
+struct sock_fprog *
+kore_platform_reuseport_node(u_int16_t workers)
+{
+	u_int16_t			cpu, idx, w, rank, local;
+	u_int32_t			sock;
+	struct sock_filter		*code;
+	static struct sock_fprog	prog;
+
+	if (prog.filter != NULL)
+		return (&prog);
+
+	numa_init();
+
+	if (numa_nodes < 2 || ((size_t)cpu_count * 2) + 2 > BPF_MAXINSNS)
+		return (NULL);
+
+	local = 0;
+	for (w = 1; w < workers; w++) {
+		if (numa_node[kore_platform_worker_cpu(w)] !=
+		    numa_node[kore_platform_worker_cpu(0)])
+			local++;
+	}
+
+	if (local == 0)
+		return (NULL);
+
+	code = kore_calloc((cpu_count * 2) + 2, sizeof(*code));
+
+	idx = 0;
+	code[idx++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+	    SKF_AD_OFF + SKF_AD_CPU);
+
+	for (cpu = 0; cpu < cpu_count; cpu++) {
+		rank = 0;
+		for (w = 0; w < cpu; w++) {
+			if (numa_node[w] == numa_node[cpu])
+				rank++;
+		}
+
+		local = 0;
+		for (w = 0; w < workers; w++) {
+			if (numa_node[kore_platform_worker_cpu(w)] ==
+			    numa_node[cpu])
+				local++;
+		}
+
+		/* An index out of range has the kernel hash instead. */
+		sock = UINT_MAX;
+
+		if (local > 0) {
+			rank = rank % local;
+			for (w = 0; w < workers; w++) {
+				if (numa_node[kore_platform_worker_cpu(w)] !=
+				    numa_node[cpu])
+					continue;
+				/* Worker w has id w + 1, see worker.c. */
+				if (rank-- == 0) {
+					sock = (w + 1) % workers;
+					break;
+				}
+			}
+		}
+
+		code[idx++] = (struct sock_filter)BPF_JUMP(BPF_JMP |
+		    BPF_JEQ | BPF_K, cpu, 0, 1);
+		code[idx++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+		    sock);
+	}
+
+	code[idx++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, UINT_MAX);
+
+	prog.len = idx;
+	prog.filter = code;
+
+	return (&prog);
+}
+
+/*
+ * Read the numa topology from sysfs, done once in the parent before
+ * the workers are started.
+ */
+static void
+numa_init(void)
+{
+	DIR			*dir;
+	struct dirent		*dp;
+	int			node, nic, err;
+	char			path[PATH_MAX];
+	u_int8_t		*cpus, *irq, pass;
+	u_int16_t		*nodes, *list, *start, *len;
+	u_int16_t		cpu, idx, tmp, n, round;
+
+	if (numa_done)
+		return;
+
+	numa_done = 1;
+	numa_node = kore_calloc(cpu_count, sizeof(u_int16_t));
+
+	if ((dir = opendir(NUMA_SYSFS)) == NULL) {
+		kore_log(LOG_NOTICE, "numa: %s: %s", NUMA_SYSFS, errno_s);
+		return;
+	}
+
+	cpus = kore_calloc(cpu_count, sizeof(u_int8_t));
+	nodes = kore_calloc(cpu_count, sizeof(u_int16_t));
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (strncmp(dp->d_name, "node", 4))
+			continue;
+
+		node = kore_strtonum(dp->d_name + 4, 10, 0, USHRT_MAX, &err);
+		if (err != KORE_RESULT_OK)
+			continue;
+
+		(void)snprintf(path, sizeof(path), "%s/%s/cpulist",
+		    NUMA_SYSFS, dp->d_name);
+
+		memset(cpus, 0, cpu_count);
+		if (!numa_cpulist(path, cpus))
+			continue;
+
+		n = 0;
+		for (cpu = 0; cpu < cpu_count; cpu++) {
+			if (cpus[cpu]) {
+				numa_node[cpu] = node;
+				n++;
+			}
+		}
+
+		/* Memory only nodes have no workers to place. */
+		if (n > 0 && numa_nodes < cpu_count)
+			nodes[numa_nodes++] = node;
+	}
+
+	closedir(dir);
+
+	if (numa_nodes < 2) {
+		kore_free(cpus);
+		kore_free(nodes);
+		return;
+	}
+
+	/* Sort the nodes, the one the NIC hangs off goes first. */
+	for (idx = 1; idx < numa_nodes; idx++) {
+		for (n = idx; n > 0 && nodes[n - 1] > nodes[n]; n--) {
+			tmp = nodes[n];
+			nodes[n] = nodes[n - 1];
+			nodes[n - 1] = tmp;
+		}
+	}
+
+	memset(cpus, 0, cpu_count);
+	if ((nic = numa_nic(cpus)) != -1) {
+		for (idx = 0; idx < numa_nodes; idx++) {
+			if (nodes[idx] != nic)
+				continue;
+			for (n = idx; n > 0; n--)
+				nodes[n] = nodes[n - 1];
+			nodes[0] = nic;
+			break;
+		}
+	}
+
+	irq = cpus;
+	list = kore_calloc(cpu_count, sizeof(u_int16_t));
+	start = kore_calloc(numa_nodes, sizeof(u_int16_t));
+	len = kore_calloc(numa_nodes, sizeof(u_int16_t));
+
+	/* The cpus of every node, those taking NIC interrupts first. */
+	n = 0;
+	for (idx = 0; idx < numa_nodes; idx++) {
+		start[idx] = n;
+		for (pass = 0; pass < 2; pass++) {
+			for (cpu = 0; cpu < cpu_count; cpu++) {
+				if (numa_node[cpu] != nodes[idx])
+					continue;
+				if (irq[cpu] != (pass == 0))
+					continue;
+				list[n++] = cpu;
+			}
+		}
+		len[idx] = n - start[idx];
+	}
+
+	numa_ncpus = n;
+	numa_order = kore_calloc(numa_ncpus, sizeof(u_int16_t));
+
+	n = 0;
+	for (round = 0; n < numa_ncpus; round++) {
+		for (idx = 0; idx < numa_nodes; idx++) {
+			if (round < len[idx])
+				numa_order[n++] = list[start[idx] + round];
+		}
+	}
+
+	if (!kore_quiet && worker_numa != KORE_NUMA_OFF) {
+		kore_log(LOG_INFO, "numa: %u nodes, first worker on node %u",
+		    numa_nodes, nodes[0]);
+	}
+
+	kore_free(len);
+	kore_free(start);
+	kore_free(list);
+	kore_free(nodes);
+	kore_free(cpus);
+}
+
+/* Have the memory the worker allocates from now on come from its node. */
+static void
+numa_mempolicy(u_int16_t cpu)
+{
+	int			mode;
+	unsigned long		mask;
+
+	if (numa_nodes < 2 || numa_node[cpu] >= sizeof(mask) * 8)
+		return;
+
+	mask = 1UL << numa_node[cpu];
+
+	if (worker_numa == KORE_NUMA_BIND)
+		mode = MPOL_BIND;
+	else
+		mode = MPOL_PREFERRED;
+
+	/*
+	 * The kernel wants one more than the number of bits in mask. This
+	 * runs before the worker can log through the parent.
+	 */
+	if (syscall(SYS_set_mempolicy, mode, &mask,
+	    sizeof(mask) * 8 + 1) == -1) {
+		kore_debug("set_mempolicy(node %u): %s",
+		    numa_node[cpu], errno_s);
+	}
+}
+
+/*
+ * Mark the cpus handling the interrupts of worker_numa_nic and return
+ * the node it is attached to, or -1.
+ */
+static int
+numa_nic(u_int8_t *cpus)
+{
+	DIR			*dir;
+	struct dirent		*dp;
+	int			node, err;
+	char			path[PATH_MAX], buf[32];
+
+	if (worker_numa_nic == NULL)
+		return (-1);
+
+	(void)snprintf(path, sizeof(path),
+	    "/sys/class/net/%s/device/msi_irqs", worker_numa_nic);
+
+	if ((dir = opendir(path)) != NULL) {
+		while ((dp = readdir(dir)) != NULL) {
+			if (dp->d_name[0] == '.')
+				continue;
+			(void)snprintf(path, sizeof(path),
+			    "/proc/irq/%s/smp_affinity_list", dp->d_name);
+			(void)numa_cpulist(path, cpus);
+		}
+		closedir(dir);
+	}
+
+	(void)snprintf(path, sizeof(path),
+	    "/sys/class/net/%s/device/numa_node", worker_numa_nic);
+
+	if (!numa_read(path, buf, sizeof(buf))) {
+		kore_log(LOG_NOTICE, "numa: no numa node for %s",
+		    worker_numa_nic);
+		return (-1);
+	}
+
+	node = kore_strtonum(buf, 10, -1, USHRT_MAX, &err);
+	if (err != KORE_RESULT_OK)
+		return (-1);
+
+	return (node);
+}
+
+/* Parse a cpu list such as "0-3,8-11" into cpus. */
+static int
+numa_cpulist(const char *path, u_int8_t *cpus)
+{
+	int		err;
+	char		buf[4096], *p, *range, *end;
+	u_int16_t	cpu, lo, hi;
+
+	if (!numa_read(path, buf, sizeof(buf)))
+		return (KORE_RESULT_ERROR);
+
+	p = buf;
+	while ((range = strsep(&p, ",")) != NULL) {
+		if (*range == '\0')
+			continue;
+
+		if ((end = strchr(range, '-')) != NULL)
+			*end++ = '\0';
+
+		lo = kore_strtonum(range, 10, 0, USHRT_MAX, &err);
+		if (err != KORE_RESULT_OK)
+			return (KORE_RESULT_ERROR);
+
+		if (end != NULL) {
+			hi = kore_strtonum(end, 10, lo, USHRT_MAX, &err);
+			if (err != KORE_RESULT_OK)
+				return (KORE_RESULT_ERROR);
+		} else {
+			hi = lo;
+		}
+
+		for (cpu = lo; cpu <= hi && cpu < cpu_count; cpu++)
+			cpus[cpu] = 1;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+numa_read(const char *path, char *buf, size_t len)
+{
+	int		fd;
+	ssize_t		ret;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return (KORE_RESULT_ERROR);
+
+	ret = read(fd, buf, len - 1);
+	close(fd);
+
+	if (ret <= 0)
+		return (KORE_RESULT_ERROR);
+
+	buf[ret] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return (KORE_RESULT_OK);
+}
+
+#if !defined(KORE_USE_IO_URING)
 void
 kore_platform_event_init(void)
 {
@@ -77,7 +490,11 @@ kore_platform_event_init(void)
 	if ((efd = epoll_create(10000)) == -1)
 		fatal("epoll_create(): %s", errno_s);
 
-	event_count = worker_max_connections + nlisteners;
+	if (worker_event_batch != 0)
+		event_count = worker_event_batch;
+	else
+		event_count = worker_max_connections + nlisteners;
+
 	events = kore_calloc(event_count, sizeof(struct epoll_event));
 }
 
@@ -95,11 +512,12 @@ kore_platform_event_cleanup(void)
 	}
 }
 
-void
+int
 kore_platform_event_wait(u_int64_t timer)
 {
 	u_int32_t		r;
 	struct kore_event	*evt;
+	u_int64_t		start;
 	int			n, i, timeo;
 
 	if (timer == KORE_WAIT_INFINITE)
@@ -107,15 +525,31 @@ kore_platform_event_wait(u_int64_t timer)
 	else
 		timeo = timer;
 
+	start = (timeo != 0) ? kore_time_us() : 0;
+
+#if defined(KORE_USE_PYTHON)
+	kore_python_gil_release();
+#endif
+
 	n = epoll_wait(efd, events, event_count, timeo);
+
+#if defined(KORE_USE_PYTHON)
+	kore_python_gil_acquire();
+#endif
+
+	if (timeo != 0)
+		kore_evloop->idle_usec += kore_time_us() - start;
+
 	if (n == -1) {
 		if (errno == EINTR)
-			return;
+			return (0);
 		fatal("epoll_wait(): %s", errno_s);
 	}
 
 	if (n > 0) {
 		kore_debug("main(): %d sockets available", n);
+		kore_evloop->wakeups++;
+		kore_evloop->events += n;
 	}
 
 	r = 0;
@@ -137,8 +571,15 @@ kore_platform_event_wait(u_int64_t timer)
 		    events[i].events & EPOLLRDHUP)
 			r = 1;
 
+		/* Only the error queue, the handler may drain it. */
+		if ((events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) ==
+		    EPOLLERR)
+			evt->flags |= KORE_EVENT_ERROR;
+
 		evt->handle(events[i].data.ptr, r);
 	}
+
+	return (n);
 }
 
 void
@@ -208,8 +649,11 @@ kore_platform_enable_accept(void)
 	kore_debug("kore_platform_enable_accept()");
 
 	LIST_FOREACH(srv, &kore_servers, list) {
-		LIST_FOREACH(l, &srv->listeners, list)
-			kore_platform_event_schedule(l->fd, EPOLLIN, 0, l);
+		LIST_FOREACH(l, &srv->listeners, list) {
+			kore_platform_event_schedule(l->fd, EPOLLIN |
+			    (worker_accept_exclusive ? EPOLLEXCLUSIVE : 0),
+			    0, l);
+		}
 	}
 }
 
@@ -231,6 +675,8 @@ kore_platform_disable_accept(void)
 	}
 }
 
+#endif
+
 void
 kore_platform_proctitle(const char *title)
 {
@@ -272,6 +718,112 @@ resend:
 }
 #endif
 
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+int
+kore_platform_zerocopy_send(struct connection *c, size_t len, size_t *written)
+{
+	ssize_t		r;
+	int		on;
+
+	if (!(c->flags & CONN_ZEROCOPY)) {
+		on = 1;
+		if (setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY,
+		    &on, sizeof(on)) == -1) {
+			kore_debug("SO_ZEROCOPY: %s", errno_s);
+			c->flags |= CONN_ZEROCOPY_OFF;
+			return (net_write(c, len, written));
+		}
+		c->flags |= CONN_ZEROCOPY;
+	}
+
+	r = send(c->fd, (c->snb->buf + c->snb->s_off), len, MSG_ZEROCOPY);
+	if (r == -1) {
+		switch (errno) {
+		case EINTR:
+			*written = 0;
+			return (KORE_RESULT_OK);
+		case EAGAIN:
+			c->evt.flags &= ~KORE_EVENT_WRITE;
+			return (KORE_RESULT_OK);
+		case ENOBUFS:
+			/* Out of option memory for pinning, copy instead. */
+			return (net_write(c, len, written));
+		default:
+			kore_debug("send: %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (!(c->snb->flags & NETBUF_ZEROCOPY)) {
+		c->snb->flags |= NETBUF_ZEROCOPY;
+		c->snb->zc_seq = c->zc_next;
+	}
+
+	c->zc_next++;
+	c->snb->zc_cnt++;
+	*written = (size_t)r;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Drain the socket error queue of zerocopy completions. Anything else
+ * showing up there, or a pending socket error, is a real error.
+ */
+int
+kore_platform_zerocopy_reap(struct connection *c)
+{
+	struct msghdr			msg;
+	struct cmsghdr			*cmsg;
+	struct sock_extended_err	*serr;
+	socklen_t			len;
+	int				err;
+	u_int8_t			control[128];
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(c->fd, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return (KORE_RESULT_ERROR);
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP &&
+			    cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == SOL_IPV6 &&
+			    cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				return (KORE_RESULT_ERROR);
+
+			/* The kernel copied anyway, stop bothering. */
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				c->flags |= CONN_ZEROCOPY_OFF;
+
+			net_zerocopy_complete(c, serr->ee_info, serr->ee_data);
+		}
+	}
+
+	err = 0;
+	len = sizeof(err);
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+	    err != 0)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+#endif
+
 void
 kore_platform_sandbox(void)
 {
@@ -21,6 +21,10 @@
 
 #include "kore.h"
 
+#if defined(KORE_USE_TASKS)
+#include "tasks.h"
+#endif
+
 struct kore_wlog {
 	int		prio;
 	u_int16_t	wid;
@@ -74,6 +78,21 @@ kore_log(int prio, const char *fmt, ...)
 	kore_buf_appendv(&buf, fmt, args);
 	va_end(args);
 
+#if defined(KORE_USE_TASKS)
+	/* The msg sockets belong to the worker, task threads log directly. */
+	if (worker != NULL && kore_task_thread()) {
+		str = kore_buf_stringify(&buf, NULL);
+
+		if (kore_foreground || fp != stdout)
+			log_print(prio, "[wrk %d]: %s\n", worker->id, str);
+		else
+			syslog(prio, "[wrk %d]: %s", worker->id, str);
+
+		kore_buf_cleanup(&buf);
+		return;
+	}
+#endif
+
 	if (worker != NULL) {
 		kore_buf_init(&pkt, sizeof(wlog) + buf.offset);
 
@@ -130,7 +149,7 @@ log_from_worker(struct kore_msg *msg, const void *data)
 static void
 log_print(int prio, const char *fmt, ...)
 {
-	struct tm		*t;
+	struct tm		*t, tm;
 	struct timespec		ts;
 	va_list			args;
 	char			tbuf[32];
@@ -147,7 +166,7 @@ log_print(int prio, const char *fmt, ...)
 	}
 
 	(void)clock_gettime(CLOCK_REALTIME, &ts);
-	t = gmtime(&ts.tv_sec);
+	t = gmtime_r(&ts.tv_sec, &tm);
 
 	if (strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", t) > 0)
 		fprintf(fp, "%s.%03ld UTC ", tbuf, ts.tv_nsec / 1000000);
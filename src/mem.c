@@ -54,11 +54,15 @@ struct tag {
 static inline struct memsize	*memsize(void *);
 static inline struct meminfo	*meminfo(void *);
 static size_t			memblock_index(size_t);
+static void			memstats_large(size_t, int);
 
 static TAILQ_HEAD(, tag)	tags;
 static struct kore_pool		tag_pool;
 static struct memblock		blocks[KORE_MEM_BLOCKS];
 
+/* Updated atomically, large allocations may come from task threads. */
+static struct kore_mem_stats	mem_stats;
+
 void
 kore_mem_init(void)
 {
@@ -115,6 +119,7 @@ kore_malloc(size_t len)
 		mlen = sizeof(struct memsize) + len + sizeof(struct meminfo);
 		if ((ptr = calloc(1, mlen)) == NULL)
 			fatal("kore_malloc(%zu): %d", len, errno);
+		memstats_large(len, 1);
 	}
 
 	size = (struct memsize *)ptr;
@@ -190,10 +195,20 @@ kore_free(void *ptr)
 		idx = memblock_index(size->len);
 		kore_pool_put(&blocks[idx].pool, addr);
 	} else {
+		memstats_large(size->len, 0);
 		free(addr);
 	}
 }
 
+void
+kore_mem_stats_get(struct kore_mem_stats *st)
+{
+	st->large_count = __sync_fetch_and_add(&mem_stats.large_count, 0);
+	st->large_bytes = __sync_fetch_and_add(&mem_stats.large_bytes, 0);
+	st->large_hwm = __sync_fetch_and_add(&mem_stats.large_hwm, 0);
+	st->large_allocs = __sync_fetch_and_add(&mem_stats.large_allocs, 0);
+}
+
 char *
 kore_strdup(const char *str)
 {
@@ -323,3 +338,25 @@ meminfo(void *ptr)
 
 	return (info);
 }
+
+static void
+memstats_large(size_t len, int alloc)
+{
+	u_int64_t	bytes, hwm;
+
+	if (alloc == 0) {
+		__sync_fetch_and_sub(&mem_stats.large_count, 1);
+		__sync_fetch_and_sub(&mem_stats.large_bytes, len);
+		return;
+	}
+
+	__sync_fetch_and_add(&mem_stats.large_count, 1);
+	__sync_fetch_and_add(&mem_stats.large_allocs, 1);
+	bytes = __sync_add_and_fetch(&mem_stats.large_bytes, len);
+
+	while ((hwm = mem_stats.large_hwm) < bytes) {
+		if (__sync_bool_compare_and_swap(&mem_stats.large_hwm,
+		    hwm, bytes))
+			break;
+	}
+}
@@ -0,0 +1,637 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Every worker keeps its counters in its own struct kore_worker, which
+ * lives in the shared memory segment set up by kore_worker_init(). Only
+ * the owning worker writes to them, so whichever worker receives a
+ * request for the metrics route can sum them up for all workers without
+ * talking to anyone.
+ */
+
+#include <sys/types.h>
+
+#include <inttypes.h>
+
+#include "kore.h"
+#include "http.h"
+
+#if defined(KORE_USE_PGSQL)
+#include "pgsql.h"
+#endif
+
+#if defined(KORE_USE_CURL)
+#include "curl.h"
+#endif
+
+#if defined(KORE_USE_PYTHON)
+#include "python_api.h"
+#endif
+
+/* How often the gauges are sampled and the loop lag is measured. */
+#define METRICS_SAMPLE_MS	250
+
+static void	metrics_sample(void *, u_int64_t);
+static void	metrics_render(struct kore_buf *);
+static void	metrics_label(struct kore_buf *, const char *);
+static void	metrics_routes(struct kore_buf *, struct kore_domain *,
+		    const struct kore_metrics *);
+static void	metrics_timings(struct kore_buf *, int, int,
+		    const struct kore_metrics *);
+static void	metrics_timing(struct kore_buf *, struct kore_buf *, int,
+		    struct kore_domain *, struct kore_route *,
+		    const struct kore_metrics *);
+static void	metrics_histogram(struct kore_buf *, const char *,
+		    const char *, const struct kore_histogram *);
+static void	metrics_histogram_sum(struct kore_histogram *,
+		    const struct kore_histogram *);
+static void	metrics_timing_add(struct kore_histogram *,
+		    struct http_request *, u_int64_t);
+static void	metrics_header(struct kore_buf *, const char *,
+		    const char *, const char *);
+
+int			kore_metrics_enabled = 0;
+
+static u_int64_t		metrics_last = 0;
+static struct kore_metrics	metrics_total;
+
+static const char *metrics_route_names[KORE_METRICS_TIMINGS] = {
+	"kore_http_route_ttfb_seconds",
+	"kore_http_route_duration_seconds",
+	"kore_http_route_sleep_seconds",
+};
+
+static const char *metrics_domain_names[KORE_METRICS_TIMINGS] = {
+	"kore_http_domain_ttfb_seconds",
+	"kore_http_domain_duration_seconds",
+	"kore_http_domain_sleep_seconds",
+};
+
+static const char *metrics_timing_help[KORE_METRICS_TIMINGS] = {
+	"Time until the response headers were queued.",
+	"Time until the request was done.",
+	"Time spent asleep, waiting on pgsql, curl or coroutines.",
+};
+
+void
+kore_metrics_init(void)
+{
+	if (!kore_metrics_enabled)
+		return;
+
+	metrics_last = kore_time_us();
+	kore_timer_add(metrics_sample, METRICS_SAMPLE_MS, NULL, 0);
+}
+
+int
+kore_metrics_route(struct kore_domain *dom, const char *path)
+{
+	struct kore_route	*rt;
+
+	if ((rt = kore_route_create(dom, path, HANDLER_TYPE_STATIC)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	kore_route_callback(rt, "kore_metrics_serve");
+	rt->methods = HTTP_METHOD_GET | HTTP_METHOD_HEAD;
+
+	kore_metrics_enabled = 1;
+
+	return (KORE_RESULT_OK);
+}
+
+void
+kore_metrics_request(struct http_request *req)
+{
+	u_int64_t		now;
+	struct kore_metrics	*m;
+
+	if (!kore_metrics_enabled || worker == NULL)
+		return;
+
+	m = &worker->metrics;
+
+	if (req->status < KORE_METRICS_STATUS_MAX)
+		m->status[req->status]++;
+	else
+		m->status[0]++;
+
+	m->bytes_in += req->http_body_length;
+	m->bytes_out += req->content_length;
+
+	if (req->rt == NULL)
+		return;
+
+	now = req->t_created != 0 ? kore_time_us() : 0;
+
+	if (req->rt->metrics_id < KORE_METRICS_ROUTES) {
+		m->routes[req->rt->metrics_id]++;
+		if (now != 0) {
+			metrics_timing_add(
+			    m->route_timings[req->rt->metrics_id], req, now);
+		}
+	}
+
+	if (now != 0 && req->rt->dom->id < KORE_METRICS_DOMAINS) {
+		metrics_timing_add(m->domain_timings[req->rt->dom->id],
+		    req, now);
+	}
+}
+
+/*
+ * Record in microseconds: every power of two is split in KORE_HISTO_SUB
+ * linear buckets, so this is just a bit scan and some shifting.
+ */
+void
+kore_histogram_add(struct kore_histogram *h, u_int64_t usec)
+{
+	int		idx, exp;
+
+	if (usec < KORE_HISTO_SUB) {
+		idx = (int)usec;
+	} else {
+		exp = 63 - __builtin_clzll(usec);
+		idx = ((exp - KORE_HISTO_SUB_BITS + 1) << KORE_HISTO_SUB_BITS) |
+		    ((usec >> (exp - KORE_HISTO_SUB_BITS)) &
+		    (KORE_HISTO_SUB - 1));
+		if (idx >= KORE_HISTO_BUCKETS)
+			idx = KORE_HISTO_BUCKETS - 1;
+	}
+
+	h->buckets[idx]++;
+	h->count++;
+	h->sum += usec;
+}
+
+/* The largest value in usec that still lands in bucket idx. */
+u_int64_t
+kore_histogram_bound(int idx)
+{
+	int		exp, sub;
+
+	if (idx < KORE_HISTO_SUB)
+		return ((u_int64_t)idx);
+
+	exp = (idx >> KORE_HISTO_SUB_BITS) + KORE_HISTO_SUB_BITS - 1;
+	sub = idx & (KORE_HISTO_SUB - 1);
+
+	return (((u_int64_t)(KORE_HISTO_SUB + sub + 1) <<
+	    (exp - KORE_HISTO_SUB_BITS)) - 1);
+}
+
+int
+kore_metrics_serve(struct http_request *req)
+{
+	struct kore_buf		buf;
+
+	kore_buf_init(&buf, 4096);
+	metrics_render(&buf);
+
+	http_response_header(req, "content-type", "text/plain; version=0.0.4");
+	http_response(req, HTTP_STATUS_OK, buf.data, buf.offset);
+	kore_buf_cleanup(&buf);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+metrics_sample(void *arg, u_int64_t now)
+{
+	u_int64_t		us, elapsed;
+	struct kore_metrics	*m;
+
+	m = &worker->metrics;
+
+	/* Anything past the timer interval was spent not getting to us. */
+	us = kore_time_us();
+	elapsed = us - metrics_last;
+	metrics_last = us;
+
+	if (elapsed > METRICS_SAMPLE_MS * 1000)
+		m->loop_lag_usec = elapsed - (METRICS_SAMPLE_MS * 1000);
+	else
+		m->loop_lag_usec = 0;
+
+	m->connections = worker_active_connections;
+#if defined(KORE_USE_PGSQL)
+	m->pgsql_queue = pgsql_queue_count;
+#endif
+#if defined(KORE_USE_CURL)
+	m->curl_running = kore_curl_running();
+#endif
+#if defined(KORE_USE_PYTHON)
+	m->coroutines = kore_python_coro_count();
+	m->coro_runnable = kore_python_coro_runnable();
+	m->coro_runnable_tasks = kore_python_coro_runnable_tasks();
+	m->coro_runnable_age = kore_python_coro_runnable_age();
+	m->coro_suspended_age = kore_python_coro_suspended_age();
+	m->coro_budget_hits = kore_python_coro_budget_hits();
+#endif
+}
+
+static void
+metrics_render(struct kore_buf *buf)
+{
+	u_int8_t			idx;
+	int				status, i, t;
+	struct kore_worker		*kw;
+	struct kore_server		*srv;
+	struct kore_domain		*dom;
+	struct kore_metrics		*total;
+
+	/* Too large for the stack with all the histograms in it. */
+	total = &metrics_total;
+	memset(total, 0, sizeof(*total));
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+
+		for (status = 0; status < KORE_METRICS_STATUS_MAX; status++)
+			total->status[status] += kw->metrics.status[status];
+
+		for (i = 0; i < KORE_METRICS_ROUTES; i++) {
+			total->routes[i] += kw->metrics.routes[i];
+			for (t = 0; t < KORE_METRICS_TIMINGS; t++) {
+				metrics_histogram_sum(
+				    &total->route_timings[i][t],
+				    &kw->metrics.route_timings[i][t]);
+			}
+		}
+
+		for (i = 0; i < KORE_METRICS_DOMAINS; i++) {
+			for (t = 0; t < KORE_METRICS_TIMINGS; t++) {
+				metrics_histogram_sum(
+				    &total->domain_timings[i][t],
+				    &kw->metrics.domain_timings[i][t]);
+			}
+		}
+
+		total->bytes_in += kw->metrics.bytes_in;
+		total->bytes_out += kw->metrics.bytes_out;
+		total->tls_handshakes += kw->metrics.tls_handshakes;
+		total->accesslog_dropped += kw->metrics.accesslog_dropped;
+		total->overload_shed += kw->metrics.overload_shed;
+
+		metrics_histogram_sum(&total->coro_slices,
+		    &kw->metrics.coro_slices);
+		metrics_histogram_sum(&total->coro_waits,
+		    &kw->metrics.coro_waits);
+		total->coro_budget_hits += kw->metrics.coro_budget_hits;
+
+		/* Gauges of workers that are gone no longer apply. */
+		if (kw->pid == -1 || kw->pid == 0)
+			continue;
+
+		total->connections += kw->metrics.connections;
+		total->pgsql_queue += kw->metrics.pgsql_queue;
+		total->curl_running += kw->metrics.curl_running;
+		total->coroutines += kw->metrics.coroutines;
+		total->coro_runnable += kw->metrics.coro_runnable;
+		total->coro_runnable_tasks += kw->metrics.coro_runnable_tasks;
+		total->coro_runnable_age = MAX(total->coro_runnable_age,
+		    kw->metrics.coro_runnable_age);
+		total->coro_suspended_age = MAX(total->coro_suspended_age,
+		    kw->metrics.coro_suspended_age);
+	}
+
+	metrics_header(buf, "kore_http_requests_total", "counter",
+	    "HTTP requests handled, by response status.");
+	for (status = 0; status < KORE_METRICS_STATUS_MAX; status++) {
+		if (total->status[status] == 0)
+			continue;
+		if (status == 0) {
+			kore_buf_appendf(buf, "kore_http_requests_total"
+			    "{status=\"other\"} %" PRIu64 "\n",
+			    total->status[0]);
+		} else {
+			kore_buf_appendf(buf, "kore_http_requests_total"
+			    "{status=\"%d\"} %" PRIu64 "\n", status,
+			    total->status[status]);
+		}
+	}
+
+	metrics_header(buf, "kore_http_route_requests_total", "counter",
+	    "HTTP requests handled, by route.");
+	LIST_FOREACH(srv, &kore_servers, list) {
+		TAILQ_FOREACH(dom, &srv->domains, list)
+			metrics_routes(buf, dom, total);
+	}
+
+	for (t = 0; t < KORE_METRICS_TIMINGS; t++)
+		metrics_timings(buf, t, 0, total);
+
+	for (t = 0; t < KORE_METRICS_TIMINGS; t++)
+		metrics_timings(buf, t, 1, total);
+
+	metrics_header(buf, "kore_http_request_bytes_total", "counter",
+	    "HTTP request body bytes received.");
+	kore_buf_appendf(buf, "kore_http_request_bytes_total %" PRIu64 "\n",
+	    total->bytes_in);
+
+	metrics_header(buf, "kore_http_response_bytes_total", "counter",
+	    "HTTP response body bytes sent.");
+	kore_buf_appendf(buf, "kore_http_response_bytes_total %" PRIu64 "\n",
+	    total->bytes_out);
+
+	metrics_header(buf, "kore_tls_handshakes_total", "counter",
+	    "Completed TLS handshakes.");
+	kore_buf_appendf(buf, "kore_tls_handshakes_total %" PRIu64 "\n",
+	    total->tls_handshakes);
+
+	metrics_header(buf, "kore_accesslog_dropped_total", "counter",
+	    "Accesslog entries dropped because the worker ring was full.");
+	kore_buf_appendf(buf, "kore_accesslog_dropped_total %" PRIu64 "\n",
+	    total->accesslog_dropped);
+
+	metrics_header(buf, "kore_http_requests_shed_total", "counter",
+	    "Requests answered with a 503 by the overload protection.");
+	kore_buf_appendf(buf, "kore_http_requests_shed_total %" PRIu64 "\n",
+	    total->overload_shed);
+
+	metrics_header(buf, "kore_connections", "gauge",
+	    "Active connections.");
+	kore_buf_appendf(buf, "kore_connections %" PRIu64 "\n",
+	    total->connections);
+
+#if defined(KORE_USE_PGSQL)
+	metrics_header(buf, "kore_pgsql_queue_depth", "gauge",
+	    "Requests waiting for a pgsql connection.");
+	kore_buf_appendf(buf, "kore_pgsql_queue_depth %" PRIu64 "\n",
+	    total->pgsql_queue);
+#endif
+
+#if defined(KORE_USE_CURL)
+	metrics_header(buf, "kore_curl_transfers", "gauge",
+	    "Running curl transfers.");
+	kore_buf_appendf(buf, "kore_curl_transfers %" PRIu64 "\n",
+	    total->curl_running);
+#endif
+
+#if defined(KORE_USE_PYTHON)
+	metrics_header(buf, "kore_python_coroutines", "gauge",
+	    "Live python coroutines.");
+	kore_buf_appendf(buf, "kore_python_coroutines %" PRIu64 "\n",
+	    total->coroutines);
+
+	metrics_header(buf, "kore_python_coroutines_runnable", "gauge",
+	    "Python coroutines waiting to run.");
+	kore_buf_appendf(buf, "kore_python_coroutines_runnable %" PRIu64 "\n",
+	    total->coro_runnable);
+
+	metrics_header(buf, "kore_python_coroutines_runnable_tasks", "gauge",
+	    "Runnable python coroutines not tied to a request.");
+	kore_buf_appendf(buf, "kore_python_coroutines_runnable_tasks %"
+	    PRIu64 "\n", total->coro_runnable_tasks);
+
+	metrics_header(buf, "kore_python_coroutine_runnable_age_seconds",
+	    "gauge", "Time the oldest runnable python coroutine has waited.");
+	kore_buf_appendf(buf, "kore_python_coroutine_runnable_age_seconds %"
+	    PRIu64 ".%06" PRIu64 "\n", total->coro_runnable_age / 1000000,
+	    total->coro_runnable_age % 1000000);
+
+	metrics_header(buf, "kore_python_coroutine_budget_exhausted_total",
+	    "counter", "Scheduler runs cut short by the coroutine budget.");
+	kore_buf_appendf(buf, "kore_python_coroutine_budget_exhausted_total %"
+	    PRIu64 "\n", total->coro_budget_hits);
+
+	metrics_header(buf, "kore_python_coroutine_suspended_age_seconds",
+	    "gauge", "Time the oldest suspended python coroutine has waited.");
+	kore_buf_appendf(buf, "kore_python_coroutine_suspended_age_seconds %"
+	    PRIu64 ".%06" PRIu64 "\n", total->coro_suspended_age / 1000000,
+	    total->coro_suspended_age % 1000000);
+
+	metrics_header(buf, "kore_python_coroutine_slice_seconds",
+	    "histogram", "Time a python coroutine ran before yielding.");
+	metrics_histogram(buf, "kore_python_coroutine_slice_seconds", "",
+	    &total->coro_slices);
+
+	metrics_header(buf, "kore_python_coroutine_wait_seconds",
+	    "histogram", "Time a python coroutine was suspended.");
+	metrics_histogram(buf, "kore_python_coroutine_wait_seconds", "",
+	    &total->coro_waits);
+#endif
+
+	metrics_header(buf, "kore_event_loop_lag_seconds", "gauge",
+	    "Delay in running a periodic timer, by worker.");
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+		if (kw->pid == -1 || kw->pid == 0)
+			continue;
+
+		kore_buf_appendf(buf, "kore_event_loop_lag_seconds"
+		    "{worker=\"%u\"} %" PRIu64 ".%06" PRIu64 "\n", kw->id,
+		    kw->metrics.loop_lag_usec / 1000000,
+		    kw->metrics.loop_lag_usec % 1000000);
+	}
+
+	if (http_overload_target == 0)
+		return;
+
+	metrics_header(buf, "kore_http_concurrency_limit", "gauge",
+	    "Requests a worker currently admits, see http_overload_target.");
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+		if (kw->pid == -1 || kw->pid == 0)
+			continue;
+
+		kore_buf_appendf(buf, "kore_http_concurrency_limit"
+		    "{worker=\"%u\"} %" PRIu64 "\n", kw->id,
+		    kw->metrics.overload_limit);
+	}
+}
+
+static void
+metrics_routes(struct kore_buf *buf, struct kore_domain *dom,
+    const struct kore_metrics *total)
+{
+	struct kore_route	*rt;
+
+	TAILQ_FOREACH(rt, &dom->routes, list) {
+		if (rt->metrics_id >= KORE_METRICS_ROUTES)
+			continue;
+
+		kore_buf_appendf(buf,
+		    "kore_http_route_requests_total{domain=\"");
+		metrics_label(buf, dom->domain);
+		kore_buf_appendf(buf, "\",route=\"");
+		metrics_label(buf, rt->path);
+		kore_buf_appendf(buf, "\"} %" PRIu64 "\n",
+		    total->routes[rt->metrics_id]);
+	}
+}
+
+static void
+metrics_timings(struct kore_buf *buf, int t, int domains,
+    const struct kore_metrics *total)
+{
+	struct kore_buf		labels;
+	struct kore_server	*srv;
+	struct kore_domain	*dom;
+	struct kore_route	*rt;
+
+	if (domains) {
+		metrics_header(buf, metrics_domain_names[t], "histogram",
+		    metrics_timing_help[t]);
+	} else {
+		metrics_header(buf, metrics_route_names[t], "histogram",
+		    metrics_timing_help[t]);
+	}
+
+	kore_buf_init(&labels, 128);
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		TAILQ_FOREACH(dom, &srv->domains, list) {
+			if (domains) {
+				metrics_timing(buf, &labels, t, dom,
+				    NULL, total);
+				continue;
+			}
+
+			TAILQ_FOREACH(rt, &dom->routes, list)
+				metrics_timing(buf, &labels, t, dom, rt, total);
+		}
+	}
+
+	kore_buf_cleanup(&labels);
+}
+
+/* Write out the histogram of a domain, or of a route if rt is set. */
+static void
+metrics_timing(struct kore_buf *buf, struct kore_buf *labels, int t,
+    struct kore_domain *dom, struct kore_route *rt,
+    const struct kore_metrics *total)
+{
+	const char			*name;
+	const struct kore_histogram	*h;
+
+	if (rt != NULL) {
+		if (rt->metrics_id >= KORE_METRICS_ROUTES)
+			return;
+		name = metrics_route_names[t];
+		h = &total->route_timings[rt->metrics_id][t];
+	} else {
+		if (dom->id >= KORE_METRICS_DOMAINS)
+			return;
+		name = metrics_domain_names[t];
+		h = &total->domain_timings[dom->id][t];
+	}
+
+	if (h->count == 0)
+		return;
+
+	kore_buf_reset(labels);
+	kore_buf_appendf(labels, "domain=\"");
+	metrics_label(labels, dom->domain);
+
+	if (rt != NULL) {
+		kore_buf_appendf(labels, "\",route=\"");
+		metrics_label(labels, rt->path);
+	}
+
+	kore_buf_appendf(labels, "\"");
+	metrics_histogram(buf, name, kore_buf_stringify(labels, NULL), h);
+}
+
+static void
+metrics_histogram(struct kore_buf *buf, const char *name,
+    const char *labels, const struct kore_histogram *h)
+{
+	int		idx;
+	const char	*sep;
+	u_int64_t	bound, count;
+
+	count = 0;
+	sep = (*labels == '\0') ? "" : ",";
+
+	for (idx = 0; idx < KORE_HISTO_BUCKETS - 1; idx++) {
+		count += h->buckets[idx];
+		bound = kore_histogram_bound(idx);
+		kore_buf_appendf(buf, "%s_bucket{%s%sle=\"%" PRIu64 ".%06"
+		    PRIu64 "\"} %" PRIu64 "\n", name, labels, sep,
+		    bound / 1000000, bound % 1000000, count);
+	}
+
+	/* Count from the buckets, h->count may have moved since. */
+	count += h->buckets[idx];
+
+	kore_buf_appendf(buf, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n",
+	    name, labels, sep, count);
+	kore_buf_appendf(buf, "%s_sum{%s} %" PRIu64 ".%06" PRIu64 "\n",
+	    name, labels, h->sum / 1000000, h->sum % 1000000);
+	kore_buf_appendf(buf, "%s_count{%s} %" PRIu64 "\n",
+	    name, labels, count);
+}
+
+static void
+metrics_histogram_sum(struct kore_histogram *dst,
+    const struct kore_histogram *src)
+{
+	int		idx;
+
+	if (src->count == 0)
+		return;
+
+	for (idx = 0; idx < KORE_HISTO_BUCKETS; idx++)
+		dst->buckets[idx] += src->buckets[idx];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+}
+
+static void
+metrics_timing_add(struct kore_histogram *timings, struct http_request *req,
+    u_int64_t now)
+{
+	u_int64_t	total, ttfb;
+
+	total = now - req->t_created;
+	ttfb = req->t_ttfb != 0 ? req->t_ttfb - req->t_created : total;
+
+	kore_histogram_add(&timings[KORE_METRICS_TTFB], ttfb);
+	kore_histogram_add(&timings[KORE_METRICS_TOTAL], total);
+	kore_histogram_add(&timings[KORE_METRICS_SLEEP], req->t_sleep);
+}
+
+static void
+metrics_header(struct kore_buf *buf, const char *name, const char *type,
+    const char *help)
+{
+	kore_buf_appendf(buf, "# HELP %s %s\n# TYPE %s %s\n",
+	    name, help, name, type);
+}
+
+/* Label values escape backslash, double quote and newline. */
+static void
+metrics_label(struct kore_buf *buf, const char *value)
+{
+	const char	*p;
+
+	for (p = value; *p != '\0'; p++) {
+		switch (*p) {
+		case '\\':
+			kore_buf_append(buf, "\\\\", 2);
+			break;
+		case '"':
+			kore_buf_append(buf, "\\\"", 2);
+			break;
+		case '\n':
+			kore_buf_append(buf, "\\n", 2);
+			break;
+		default:
+			kore_buf_append(buf, p, 1);
+			break;
+		}
+	}
+}
@@ -17,6 +17,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#endif
+
 #include <signal.h>
 
 #include "kore.h"
@@ -32,7 +37,66 @@ struct msg_type {
 	TAILQ_ENTRY(msg_type)	list;
 };
 
+#if defined(__linux__)
+/*
+ * Worker to worker messages (websocket broadcasts, python sendobj and
+ * application messages) skip the parent and go through a ring in shared
+ * memory owned by the receiving worker, any worker may write into it.
+ *
+ * Producers append under the ring lock and only owe the receiver a ring
+ * on its eventfd when the ring was empty. The receiver runs the callbacks
+ * in place and hands the space back by moving tail under the same lock,
+ * so a producer either sees the ring empty or the receiver sees its data.
+ *
+ * Owed rings are done once per event loop iteration by way of
+ * kore_msg_flush(), or right away once a ring is half full, so a
+ * burst of messages costs the receiver a single wakeup.
+ *
+ * A message that does not fit (too large or the ring is full) falls
+ * back to going through the parent, so ordering is only kept between
+ * messages that took the same path.
+ */
+struct kore_msg_ring {
+	volatile int		lock;
+	pid_t			owner;
+	int			efd;
+	u_int64_t		head;
+	u_int64_t		tail;
+	u_int8_t		data[];
+};
+
+/* Marks the rest of the ring as unused, the next message is at 0. */
+#define MSG_RING_WRAP		((size_t)-1)
+
+#define MSG_RING_ALIGN(x)	(((x) + 7) & ~((size_t)7))
+
+static int	msg_ring_eligible(u_int16_t, u_int8_t);
+static void	msg_ring_deliver(struct kore_msg *, const void *, size_t);
+static int	msg_ring_send(struct kore_worker *, struct kore_msg *,
+		    const void *, size_t);
+static void	msg_ring_doorbell(struct kore_msg_ring *);
+static void	msg_ring_lock(struct kore_msg_ring *);
+static void	msg_ring_unlock(struct kore_msg_ring *);
+static void	msg_ring_recv(void *, int);
+static void	msg_ring_dispatch(struct kore_msg *, const void *);
+static void	msg_ring_flush(void);
+
+static struct {
+	struct kore_event	evt;
+} ring_event;
+
+static size_t			ring_size = 0;
+static u_int16_t		ring_owed_cnt = 0;
+static struct kore_msg_ring	*ring_owed[KORE_WORKER_MAX];
+#endif
+
 static struct msg_type	*msg_type_lookup(u_int8_t);
+static void		msg_send_socket(struct connection *,
+			    struct kore_msg *, const void *, size_t);
+static void		msg_flush_later(struct connection *, u_int8_t, size_t);
+static int		msg_flush_now(u_int8_t);
+static void		msg_owed_remove(struct connection *);
+static void		msg_disconnected(struct connection *);
 static int		msg_recv_data(struct netbuf *);
 static int		msg_recv_packet(struct netbuf *);
 static void		msg_disconnected_worker(struct connection *);
@@ -40,18 +104,129 @@ static void		msg_type_shutdown(struct kore_msg *, const void *);
 
 #if !defined(KORE_NO_HTTP)
 static void		msg_type_websocket(struct kore_msg *, const void *);
+static void		msg_type_websocket_topic(struct kore_msg *,
+			    const void *);
 #endif
 
 static TAILQ_HEAD(, msg_type)	msg_types;
 static size_t			cacheidx = 0;
 static struct connection	**conncache = NULL;
 
+/*
+ * Messages on the msg sockets are queued and the sockets they went out
+ * on flushed once per event loop iteration by kore_msg_flush(), rather
+ * than costing a write for every message. Control messages that someone
+ * is waiting on are flushed right away, as is everything once more than
+ * kore_msg_flush_threshold bytes are queued.
+ */
+static size_t			msg_owed_len = 0;
+static u_int16_t		msg_owed_cnt = 0;
+static struct connection	*msg_owed[KORE_WORKER_MAX];
+
+u_int32_t			kore_msg_ring_size = KORE_MSG_RING_SIZE;
+u_int32_t			kore_msg_flush_threshold = KORE_MSG_FLUSH_THRESHOLD;
+
 void
 kore_msg_init(void)
 {
 	TAILQ_INIT(&msg_types);
 }
 
+/*
+ * Called by the parent before any worker is spawned so the rings and
+ * their eventfds are inherited by all of them.
+ */
+void
+kore_msg_ring_init(void)
+{
+#if defined(__linux__)
+	u_int8_t		*base;
+	size_t			len;
+	struct kore_worker	*kw;
+	u_int16_t		idx, cnt;
+
+	if (kore_msg_ring_size == 0)
+		return;
+
+	/* Positions are masked, so round up to a power of two. */
+	for (ring_size = 4096; ring_size < kore_msg_ring_size; ring_size <<= 1)
+		;
+
+	len = MSG_RING_ALIGN(sizeof(struct kore_msg_ring)) + ring_size;
+	cnt = worker_count - KORE_WORKER_BASE;
+
+	base = mmap(NULL, len * cnt, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		fatal("%s: mmap: %s", __func__, errno_s);
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+		kw->ring = (struct kore_msg_ring *)base;
+		base += len;
+
+		kw->ring->lock = 0;
+		kw->ring->owner = 0;
+		kw->ring->head = 0;
+		kw->ring->tail = 0;
+
+		kw->ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (kw->ring->efd == -1)
+			fatal("%s: eventfd: %s", __func__, errno_s);
+	}
+#endif
+}
+
+/*
+ * A worker that died while holding a ring lock would block every other
+ * worker writing into that ring, its half written message was never
+ * published so the lock can just be dropped.
+ */
+void
+kore_msg_ring_reap(pid_t pid)
+{
+#if defined(__linux__)
+	struct kore_worker	*kw;
+	u_int16_t		idx;
+
+	if (ring_size == 0)
+		return;
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+		if (kw->ring->lock && kw->ring->owner == pid) {
+			kw->ring->owner = 0;
+			(void)__sync_bool_compare_and_swap(&kw->ring->lock,
+			    1, 0);
+		}
+	}
+#endif
+}
+
+/*
+ * Flush the msg sockets we queued messages on and wake up the workers we
+ * wrote ring messages for since the last call.
+ */
+void
+kore_msg_flush(void)
+{
+	u_int16_t		i;
+	struct connection	*c;
+
+	for (i = 0; i < msg_owed_cnt; i++) {
+		c = msg_owed[i];
+		c->flags &= ~CONN_MSG_OWED;
+		net_send_flush(c);
+	}
+
+	msg_owed_cnt = 0;
+	msg_owed_len = 0;
+
+#if defined(__linux__)
+	msg_ring_flush();
+#endif
+}
+
 void
 kore_msg_parent_init(void)
 {
@@ -74,6 +249,7 @@ kore_msg_parent_add(struct kore_worker *kw)
 	kw->msg[0]->fd = kw->pipe[0];
 	kw->msg[0]->read = net_read;
 	kw->msg[0]->write = net_write;
+	kw->msg[0]->writev = net_writev;
 	kw->msg[0]->proto = CONN_PROTO_MSG;
 	kw->msg[0]->state = CONN_STATE_ESTABLISHED;
 	kw->msg[0]->hdlr_extra = &kw->id;
@@ -104,15 +280,18 @@ kore_msg_worker_init(void)
 {
 #if !defined(KORE_NO_HTTP)
 	kore_msg_register(KORE_MSG_WEBSOCKET, msg_type_websocket);
+	kore_msg_register(KORE_MSG_WEBSOCKET_TOPIC, msg_type_websocket_topic);
 #endif
 
 	worker->msg[1] = kore_connection_new(NULL);
 	worker->msg[1]->fd = worker->pipe[1];
 	worker->msg[1]->read = net_read;
 	worker->msg[1]->write = net_write;
+	worker->msg[1]->writev = net_writev;
 	worker->msg[1]->proto = CONN_PROTO_MSG;
 	worker->msg[1]->state = CONN_STATE_ESTABLISHED;
 	worker->msg[1]->handle = kore_connection_handle;
+	worker->msg[1]->disconnect = msg_disconnected;
 	worker->msg[1]->evt.flags = KORE_EVENT_WRITE;
 
 	TAILQ_INSERT_TAIL(&connections, worker->msg[1], list);
@@ -120,6 +299,18 @@ kore_msg_worker_init(void)
 
 	net_recv_queue(worker->msg[1],
 	    sizeof(struct kore_msg), 0, msg_recv_packet);
+
+#if defined(__linux__)
+	if (worker->ring != NULL) {
+		ring_event.evt.type = KORE_TYPE_MSG_RING;
+		ring_event.evt.flags = 0;
+		ring_event.evt.handle = msg_ring_recv;
+		kore_platform_schedule_read(worker->ring->efd, &ring_event);
+
+		/* Pick up whatever was left for our predecessor. */
+		msg_ring_recv(NULL, 0);
+	}
+#endif
 }
 
 void
@@ -157,6 +348,8 @@ kore_msg_send(u_int16_t dst, u_int8_t id, const void *data, size_t len)
 	struct connection	*c;
 	struct kore_worker	*kw;
 
+	KORE_PROBE3(msg__send, dst, id, len);
+
 	m.id = id;
 	m.dst = dst;
 	m.length = len;
@@ -174,13 +367,94 @@ kore_msg_send(u_int16_t dst, u_int8_t id, const void *data, size_t len)
 	} else {
 		m.src = worker->id;
 		c = worker->msg[1];
+
+#if defined(__linux__)
+		if (msg_ring_eligible(dst, id)) {
+			msg_ring_deliver(&m, data, len);
+			return;
+		}
+#endif
 	}
 
-	net_send_queue(c, &m, sizeof(m));
+	msg_send_socket(c, &m, data, len);
+}
+
+static void
+msg_send_socket(struct connection *c, struct kore_msg *m,
+    const void *data, size_t len)
+{
+	net_send_queue(c, m, sizeof(*m));
 	if (data != NULL && len > 0)
 		net_send_queue(c, data, len);
 
-	net_send_flush(c);
+	msg_flush_later(c, m->id, sizeof(*m) + len);
+}
+
+/*
+ * Have c flushed at the end of this event loop iteration. The keymgr
+ * and acme processes run their own loops and always flush right away.
+ */
+static void
+msg_flush_later(struct connection *c, u_int8_t id, size_t len)
+{
+	if (kore_msg_flush_threshold == 0 || msg_flush_now(id) ||
+	    (worker != NULL && (worker->id == KORE_WORKER_KEYMGR ||
+	    worker->id == KORE_WORKER_ACME))) {
+		net_send_flush(c);
+		return;
+	}
+
+	if (!(c->flags & CONN_MSG_OWED)) {
+		if (msg_owed_cnt == KORE_WORKER_MAX) {
+			net_send_flush(c);
+			return;
+		}
+
+		c->flags |= CONN_MSG_OWED;
+		msg_owed[msg_owed_cnt++] = c;
+	}
+
+	msg_owed_len += len;
+	if (msg_owed_len >= kore_msg_flush_threshold)
+		kore_msg_flush();
+}
+
+/* Messages that something is blocked on until they arrive. */
+static int
+msg_flush_now(u_int8_t id)
+{
+	switch (id) {
+	case KORE_MSG_KEYMGR_REQ:
+	case KORE_MSG_KEYMGR_RESP:
+	case KORE_MSG_SHUTDOWN:
+	case KORE_MSG_ENTROPY_REQ:
+	case KORE_MSG_ENTROPY_RESP:
+	case KORE_MSG_CERTIFICATE:
+	case KORE_MSG_CERTIFICATE_REQ:
+	case KORE_MSG_CRL:
+	case KORE_MSG_ACCEPT_AVAILABLE:
+		return (1);
+	}
+
+	return (id >= KORE_MSG_ACME_BASE && id < KORE_MSG_APP_BASE);
+}
+
+static void
+msg_owed_remove(struct connection *c)
+{
+	u_int16_t	i;
+
+	if (!(c->flags & CONN_MSG_OWED))
+		return;
+
+	c->flags &= ~CONN_MSG_OWED;
+
+	for (i = 0; i < msg_owed_cnt; i++) {
+		if (msg_owed[i] == c) {
+			msg_owed[i] = msg_owed[--msg_owed_cnt];
+			break;
+		}
+	}
 }
 
 static int
@@ -251,7 +525,7 @@ msg_recv_data(struct netbuf *nb)
 			msg->dst = *(u_int16_t *)c->hdlr_extra;
 
 			net_send_queue(c, nb->buf, nb->s_off);
-			net_send_flush(c);
+			msg_flush_later(c, msg->id, nb->s_off);
 		}
 	}
 
@@ -262,9 +536,16 @@ msg_recv_data(struct netbuf *nb)
 static void
 msg_disconnected_worker(struct connection *c)
 {
+	msg_owed_remove(c);
 	c->hdlr_extra = NULL;
 }
 
+static void
+msg_disconnected(struct connection *c)
+{
+	msg_owed_remove(c);
+}
+
 static void
 msg_type_shutdown(struct kore_msg *msg, const void *data)
 {
@@ -280,15 +561,246 @@ msg_type_shutdown(struct kore_msg *msg, const void *data)
 static void
 msg_type_websocket(struct kore_msg *msg, const void *data)
 {
-	struct connection	*c;
+	const u_int8_t		*op = data;
 
-	TAILQ_FOREACH(c, &connections, list) {
-		if (c->proto == CONN_PROTO_WEBSOCKET) {
-			net_send_queue(c, data, msg->length);
-			net_send_flush(c);
+	if (msg->length < 1)
+		return;
+
+	kore_websocket_broadcast(NULL, op[0], &op[1], msg->length - 1,
+	    WEBSOCKET_BROADCAST_LOCAL);
+}
+
+static void
+msg_type_websocket_topic(struct kore_msg *msg, const void *data)
+{
+	size_t			tlen;
+	const u_int8_t		*hdr = data;
+	char			topic[KORE_WEBSOCKET_TOPIC_MAX + 1];
+
+	if (msg->length < 2)
+		return;
+
+	tlen = hdr[1];
+	if (tlen == 0 || tlen > KORE_WEBSOCKET_TOPIC_MAX ||
+	    msg->length < 2 + tlen)
+		return;
+
+	memcpy(topic, &hdr[2], tlen);
+	topic[tlen] = '\0';
+
+	kore_websocket_publish(NULL, topic, hdr[0], &hdr[2 + tlen],
+	    msg->length - 2 - tlen, WEBSOCKET_BROADCAST_LOCAL);
+}
+#endif
+
+#if defined(__linux__)
+static int
+msg_ring_eligible(u_int16_t dst, u_int8_t id)
+{
+	if (ring_size == 0 || dst == KORE_MSG_PARENT)
+		return (0);
+
+	return (id == KORE_MSG_WEBSOCKET || id == KORE_MSG_WEBSOCKET_TOPIC ||
+	    id == KORE_MSG_SSE || id == KORE_PYTHON_SEND_OBJ ||
+	    id >= KORE_MSG_APP_BASE);
+}
+
+/*
+ * Put a message from this worker in the ring of each worker it is for,
+ * those whose ring cannot take it get it through the parent instead.
+ */
+static void
+msg_ring_deliver(struct kore_msg *m, const void *data, size_t len)
+{
+	struct kore_worker	*kw;
+	u_int16_t		idx;
+
+	if (m->dst != KORE_MSG_WORKER_ALL) {
+		kw = kore_worker_data_byid(m->dst);
+		if (kw == NULL || kw->ring == NULL ||
+		    !msg_ring_send(kw, m, data, len))
+			msg_send_socket(worker->msg[1], m, data, len);
+		return;
+	}
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+		if (!kw->running)
+			continue;
+
+		if (!msg_ring_send(kw, m, data, len)) {
+			m->dst = kw->id;
+			msg_send_socket(worker->msg[1], m, data, len);
+			m->dst = KORE_MSG_WORKER_ALL;
 		}
 	}
 }
+
+/* Append a message to the ring of the given worker, if it fits. */
+static int
+msg_ring_send(struct kore_worker *kw, struct kore_msg *m,
+    const void *data, size_t len)
+{
+	struct kore_msg		*hdr;
+	struct kore_msg_ring	*ring;
+	size_t			need, off, avail;
+	u_int64_t		head, used;
+	int			empty;
+
+	ring = kw->ring;
+	need = MSG_RING_ALIGN(sizeof(*m) + len);
+
+	if (need > ring_size / 4)
+		return (KORE_RESULT_ERROR);
+
+	msg_ring_lock(ring);
+
+	head = ring->head;
+	off = head & (ring_size - 1);
+	avail = ring_size - (head - ring->tail);
+
+	/* Messages are never split, skip the end of the ring if need be. */
+	if (ring_size - off < need) {
+		if (avail < (ring_size - off) + need) {
+			msg_ring_unlock(ring);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (ring_size - off >= sizeof(*hdr)) {
+			hdr = (struct kore_msg *)&ring->data[off];
+			hdr->length = MSG_RING_WRAP;
+		}
+
+		head += ring_size - off;
+		off = 0;
+	} else if (avail < need) {
+		msg_ring_unlock(ring);
+		return (KORE_RESULT_ERROR);
+	}
+
+	hdr = (struct kore_msg *)&ring->data[off];
+	memcpy(hdr, m, sizeof(*m));
+	hdr->dst = kw->id;
+
+	if (len > 0)
+		memcpy(&ring->data[off + sizeof(*hdr)], data, len);
+
+	empty = (ring->head == ring->tail);
+	ring->head = head + need;
+	used = ring->head - ring->tail;
+
+	msg_ring_unlock(ring);
+
+	if (used > ring_size / 2) {
+		msg_ring_doorbell(ring);
+	} else if (empty) {
+		if (ring_owed_cnt < KORE_WORKER_MAX)
+			ring_owed[ring_owed_cnt++] = ring;
+		else
+			msg_ring_doorbell(ring);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+msg_ring_doorbell(struct kore_msg_ring *ring)
+{
+	u_int64_t	one;
+
+	one = 1;
+
+	if (write(ring->efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		kore_log(LOG_NOTICE, "msg ring eventfd: %s", errno_s);
+}
+
+static void
+msg_ring_lock(struct kore_msg_ring *ring)
+{
+	while (!__sync_bool_compare_and_swap(&ring->lock, 0, 1))
+		;
+
+	ring->owner = worker->pid;
+}
+
+static void
+msg_ring_unlock(struct kore_msg_ring *ring)
+{
+	ring->owner = 0;
+
+	if (!__sync_bool_compare_and_swap(&ring->lock, 1, 0))
+		fatal("msg_ring_unlock: lock was not held");
+}
+
+static void
+msg_ring_recv(void *arg, int error)
+{
+	struct kore_msg		*msg;
+	struct kore_msg_ring	*ring;
+	size_t			off;
+	u_int64_t		cnt, head, tail;
+
+	if (error)
+		fatal("msg_ring_recv: error on eventfd");
+
+	ring = worker->ring;
+
+	if (read(ring->efd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN)
+		fatal("msg_ring_recv: read: %s", errno_s);
+
+	msg_ring_lock(ring);
+	head = ring->head;
+	tail = ring->tail;
+	msg_ring_unlock(ring);
+
+	while (tail != head) {
+		while (tail != head) {
+			off = tail & (ring_size - 1);
+
+			if (ring_size - off < sizeof(*msg)) {
+				tail += ring_size - off;
+				continue;
+			}
+
+			msg = (struct kore_msg *)&ring->data[off];
+			if (msg->length == MSG_RING_WRAP) {
+				tail += ring_size - off;
+				continue;
+			}
+
+			msg_ring_dispatch(msg, msg->length > 0 ?
+			    &ring->data[off + sizeof(*msg)] : NULL);
+
+			tail += MSG_RING_ALIGN(sizeof(*msg) + msg->length);
+		}
+
+		msg_ring_lock(ring);
+		ring->tail = tail;
+		head = ring->head;
+		msg_ring_unlock(ring);
+	}
+}
+
+/* Wake up the workers we wrote messages for since the last call. */
+static void
+msg_ring_flush(void)
+{
+	u_int16_t	i;
+
+	for (i = 0; i < ring_owed_cnt; i++)
+		msg_ring_doorbell(ring_owed[i]);
+
+	ring_owed_cnt = 0;
+}
+
+static void
+msg_ring_dispatch(struct kore_msg *msg, const void *data)
+{
+	struct msg_type		*type;
+
+	if ((type = msg_type_lookup(msg->id)) != NULL)
+		type->cb(msg, data);
+}
 #endif
 
 static struct msg_type *
@@ -0,0 +1,559 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Incremental multipart/form-data parser.
+ *
+ * The body is fed in whatever pieces it arrives in. The delimiter
+ * ("\r\n--" boundary) is searched for with Boyer-Moore-Horspool, a
+ * delimiter cut in half by the end of a piece is remembered by the
+ * number of bytes matched so far. Part data is handed to the callback
+ * as slices of the fed data, nothing is copied.
+ *
+ * Routes with multipart_stream enabled get the default callback: fields
+ * become arguments (up to http_multipart_field_max bytes) and files are
+ * written to their own temporary file under http_body_disk_path, the
+ * body itself is never kept around.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+
+#include "kore.h"
+#include "http.h"
+
+#define MULTIPART_STATE_PREAMBLE	1
+#define MULTIPART_STATE_TAIL		2
+#define MULTIPART_STATE_HEADERS		3
+#define MULTIPART_STATE_DATA		4
+#define MULTIPART_STATE_EPILOGUE	5
+
+static int	multipart_body(struct http_multipart *, const u_int8_t *,
+		    size_t, size_t *);
+static int	multipart_tail(struct http_multipart *, const u_int8_t *,
+		    size_t, size_t *);
+static int	multipart_headers(struct http_multipart *, const u_int8_t *,
+		    size_t, size_t *);
+static int	multipart_data(struct http_multipart *, const u_int8_t *,
+		    size_t);
+static int	multipart_delimiter(struct http_multipart *);
+static void	multipart_part_clear(struct http_multipart *);
+static ssize_t	multipart_search(struct http_multipart *, const u_int8_t *,
+		    size_t);
+static int	multipart_disposition(struct http_multipart *, char *);
+static char	*multipart_param(char **, char **);
+
+static int	multipart_default(struct http_multipart *, int,
+		    const u_int8_t *, size_t);
+
+size_t		http_multipart_field_max = HTTP_MULTIPART_FIELD_MAX;
+
+/*
+ * Returns NULL if the request is not a multipart/form-data one or its
+ * boundary is unusable. Without a callback the parts are turned into
+ * arguments and files on the request.
+ */
+struct http_multipart *
+http_multipart_create(struct http_request *req,
+    int (*cb)(struct http_multipart *, int, const u_int8_t *, size_t),
+    void *arg)
+{
+	size_t			i, len;
+	struct http_multipart	*mp;
+	const char		*hdr, *p, *end;
+
+	if (!http_request_header(req, "content-type", &hdr))
+		return (NULL);
+
+	if (strncasecmp(hdr, "multipart/form-data", 19))
+		return (NULL);
+
+	if ((p = strcasestr(hdr + 19, "boundary=")) == NULL)
+		return (NULL);
+
+	p += 9;
+	if (*p == '"') {
+		p++;
+		if ((end = strchr(p, '"')) == NULL)
+			return (NULL);
+	} else {
+		for (end = p; *end != '\0' && *end != ';' &&
+		    !isspace(*(const unsigned char *)end); end++)
+			;
+	}
+
+	len = end - p;
+	if (len == 0 || len > HTTP_MULTIPART_BOUNDARY_MAX)
+		return (NULL);
+
+	/* The tail search depends on there being no CR in the boundary. */
+	for (i = 0; i < len; i++) {
+		if (p[i] == '\r' || p[i] == '\n')
+			return (NULL);
+	}
+
+	mp = kore_calloc(1, sizeof(*mp));
+	mp->req = req;
+	mp->arg = arg;
+	mp->cb = (cb != NULL) ? cb : multipart_default;
+
+	memcpy(mp->delim, "\r\n--", 4);
+	memcpy(mp->delim + 4, p, len);
+	mp->dlen = len + 4;
+
+	for (i = 0; i < 256; i++)
+		mp->shift[i] = mp->dlen;
+	for (i = 0; i < mp->dlen - 1; i++)
+		mp->shift[mp->delim[i]] = mp->dlen - 1 - i;
+
+	kore_buf_init(&mp->hdrs, 256);
+	kore_buf_init(&mp->field, 128);
+
+	/*
+	 * The first delimiter has no CRLF in front of it, pretend we have
+	 * already seen one so it is matched like all the others.
+	 */
+	mp->held = 2;
+	mp->state = MULTIPART_STATE_PREAMBLE;
+
+	return (mp);
+}
+
+int
+http_multipart_feed(struct http_multipart *mp, const void *data, size_t len)
+{
+	int		ret;
+	size_t		used;
+	const u_int8_t	*p;
+
+	p = data;
+
+	while (len > 0) {
+		used = 0;
+
+		switch (mp->state) {
+		case MULTIPART_STATE_PREAMBLE:
+		case MULTIPART_STATE_DATA:
+			ret = multipart_body(mp, p, len, &used);
+			break;
+		case MULTIPART_STATE_TAIL:
+			ret = multipart_tail(mp, p, len, &used);
+			break;
+		case MULTIPART_STATE_HEADERS:
+			ret = multipart_headers(mp, p, len, &used);
+			break;
+		case MULTIPART_STATE_EPILOGUE:
+			return (KORE_RESULT_OK);
+		default:
+			fatal("http_multipart_feed: bad state %d", mp->state);
+		}
+
+		if (ret != KORE_RESULT_OK)
+			return (KORE_RESULT_ERROR);
+
+		p += used;
+		len -= used;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+int
+http_multipart_done(struct http_multipart *mp)
+{
+	return (mp->state == MULTIPART_STATE_EPILOGUE);
+}
+
+void
+http_multipart_free(struct http_multipart *mp)
+{
+	if (mp == NULL)
+		return;
+
+	multipart_part_clear(mp);
+	kore_buf_cleanup(&mp->hdrs);
+	kore_buf_cleanup(&mp->field);
+	kore_free(mp);
+}
+
+static int
+multipart_body(struct http_multipart *mp, const u_int8_t *p, size_t len,
+    size_t *used)
+{
+	ssize_t		off;
+	size_t		need, n, i;
+
+	/* Finish a delimiter that was cut off by the previous piece. */
+	if (mp->held > 0) {
+		need = mp->dlen - mp->held;
+		n = MIN(need, len);
+
+		if (!memcmp(p, mp->delim + mp->held, n)) {
+			*used = n;
+			if (n < need) {
+				mp->held += n;
+				return (KORE_RESULT_OK);
+			}
+			mp->held = 0;
+			return (multipart_delimiter(mp));
+		}
+
+		/* It was data after all, rescan this piece from the start. */
+		n = mp->held;
+		mp->held = 0;
+		*used = 0;
+
+		return (multipart_data(mp, mp->delim, n));
+	}
+
+	if ((off = multipart_search(mp, p, len)) != -1) {
+		if (!multipart_data(mp, p, off))
+			return (KORE_RESULT_ERROR);
+		*used = off + mp->dlen;
+		return (multipart_delimiter(mp));
+	}
+
+	/* Hold back a tail that may be the start of the next delimiter. */
+	i = (len >= mp->dlen) ? len - (mp->dlen - 1) : 0;
+	for (; i < len; i++) {
+		if (p[i] == '\r' && !memcmp(p + i, mp->delim, len - i))
+			break;
+	}
+
+	mp->held = len - i;
+	*used = len;
+
+	return (multipart_data(mp, p, i));
+}
+
+static int
+multipart_tail(struct http_multipart *mp, const u_int8_t *p, size_t len,
+    size_t *used)
+{
+	size_t		n;
+
+	n = MIN(len, sizeof(mp->tail) - mp->ntail);
+	memcpy(mp->tail + mp->ntail, p, n);
+	mp->ntail += n;
+	*used = n;
+
+	if (mp->ntail < sizeof(mp->tail))
+		return (KORE_RESULT_OK);
+
+	if (!memcmp(mp->tail, "--", 2)) {
+		mp->state = MULTIPART_STATE_EPILOGUE;
+		return (KORE_RESULT_OK);
+	}
+
+	if (memcmp(mp->tail, "\r\n", 2))
+		return (KORE_RESULT_ERROR);
+
+	/* Keep the CRLF so a part without headers ends at CRLFCRLF too. */
+	kore_buf_reset(&mp->hdrs);
+	kore_buf_append(&mp->hdrs, "\r\n", 2);
+	mp->state = MULTIPART_STATE_HEADERS;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+multipart_headers(struct http_multipart *mp, const u_int8_t *p, size_t len,
+    size_t *used)
+{
+	u_int8_t	*end;
+	size_t		from, prev;
+	char		*hdrs, *line, *next, *value;
+
+	prev = mp->hdrs.offset;
+	from = (prev > 3) ? prev - 3 : 0;
+
+	kore_buf_append(&mp->hdrs, p, len);
+
+	end = kore_mem_find(mp->hdrs.data + from, mp->hdrs.offset - from,
+	    "\r\n\r\n", 4);
+	if (end == NULL) {
+		if (mp->hdrs.offset > HTTP_MULTIPART_HEADER_MAX)
+			return (KORE_RESULT_ERROR);
+		*used = len;
+		return (KORE_RESULT_OK);
+	}
+
+	*used = (end - mp->hdrs.data) + 4 - prev;
+	mp->hdrs.offset = (end - mp->hdrs.data) + 2;
+	hdrs = kore_buf_stringify(&mp->hdrs, NULL) + 2;
+
+	for (line = hdrs; *line != '\0'; line = next) {
+		if ((next = strstr(line, "\r\n")) == NULL)
+			break;
+		*next = '\0';
+		next += 2;
+
+		if ((value = strchr(line, ':')) == NULL)
+			return (KORE_RESULT_ERROR);
+		*(value)++ = '\0';
+
+		while (isspace(*(unsigned char *)value))
+			value++;
+
+		if (!strcasecmp(line, "content-disposition")) {
+			if (!multipart_disposition(mp, value))
+				return (KORE_RESULT_ERROR);
+		} else if (!strcasecmp(line, "content-type")) {
+			kore_free(mp->type);
+			mp->type = kore_strdup(value);
+		}
+	}
+
+	if (mp->name == NULL)
+		return (KORE_RESULT_ERROR);
+
+	mp->state = MULTIPART_STATE_DATA;
+
+	return (mp->cb(mp, HTTP_MULTIPART_PART_START, NULL, 0));
+}
+
+static int
+multipart_data(struct http_multipart *mp, const u_int8_t *p, size_t len)
+{
+	if (mp->state != MULTIPART_STATE_DATA || len == 0)
+		return (KORE_RESULT_OK);
+
+	return (mp->cb(mp, HTTP_MULTIPART_PART_DATA, p, len));
+}
+
+static int
+multipart_delimiter(struct http_multipart *mp)
+{
+	int		ret;
+
+	ret = KORE_RESULT_OK;
+
+	if (mp->state == MULTIPART_STATE_DATA)
+		ret = mp->cb(mp, HTTP_MULTIPART_PART_END, NULL, 0);
+
+	multipart_part_clear(mp);
+
+	mp->ntail = 0;
+	mp->state = MULTIPART_STATE_TAIL;
+
+	return (ret);
+}
+
+static void
+multipart_part_clear(struct http_multipart *mp)
+{
+	kore_free(mp->name);
+	kore_free(mp->filename);
+	kore_free(mp->type);
+
+	mp->name = NULL;
+	mp->filename = NULL;
+	mp->type = NULL;
+}
+
+static ssize_t
+multipart_search(struct http_multipart *mp, const u_int8_t *p, size_t len)
+{
+	size_t		i, last;
+
+	if (len < mp->dlen)
+		return (-1);
+
+	last = mp->dlen - 1;
+
+	for (i = 0; i <= len - mp->dlen; i += mp->shift[p[i + last]]) {
+		if (p[i + last] == mp->delim[last] &&
+		    !memcmp(p + i, mp->delim, last))
+			return (i);
+	}
+
+	return (-1);
+}
+
+static int
+multipart_disposition(struct http_multipart *mp, char *value)
+{
+	char		*key, *val;
+
+	if (strncasecmp(value, "form-data", 9))
+		return (KORE_RESULT_ERROR);
+
+	value += 9;
+
+	while ((val = multipart_param(&value, &key)) != NULL) {
+		if (!strcasecmp(key, "name")) {
+			kore_free(mp->name);
+			mp->name = kore_strdup(val);
+		} else if (!strcasecmp(key, "filename")) {
+			kore_free(mp->filename);
+			mp->filename = kore_strdup(val);
+		}
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Pulls the next ;key=value pair out of a header value, dequoting the
+ * value in place. Returns NULL once there are none left.
+ */
+static char *
+multipart_param(char **str, char **key)
+{
+	char		*p, *val, *out;
+
+	p = *str;
+
+	while (*p == ';' || isspace(*(unsigned char *)p))
+		p++;
+
+	if (*p == '\0')
+		return (NULL);
+
+	*key = p;
+	while (*p != '\0' && *p != '=' && *p != ';')
+		p++;
+
+	if (*p != '=') {
+		if (*p == ';')
+			*(p)++ = '\0';
+		*str = p;
+		return ("");
+	}
+
+	*(p)++ = '\0';
+
+	if (*p != '"') {
+		val = p;
+		while (*p != '\0' && *p != ';')
+			p++;
+		if (*p == ';')
+			*(p)++ = '\0';
+		*str = p;
+		return (val);
+	}
+
+	val = out = ++p;
+	while (*p != '\0' && *p != '"') {
+		if (*p == '\\' && *(p + 1) != '\0')
+			p++;
+		*(out)++ = *(p)++;
+	}
+
+	if (*p == '"')
+		p++;
+
+	*out = '\0';
+	*str = p;
+
+	return (val);
+}
+
+static int
+multipart_default(struct http_multipart *mp, int event, const u_int8_t *data,
+    size_t len)
+{
+	int			l;
+	ssize_t			ret;
+	struct http_file	*f;
+	char			*string;
+
+	switch (event) {
+	case HTTP_MULTIPART_PART_START:
+		kore_buf_reset(&mp->field);
+		mp->file = NULL;
+
+		if (mp->filename == NULL)
+			break;
+
+		/* Like the buffered parser, parts with an empty filename go. */
+		if (mp->filename[0] == '\0') {
+			mp->skip = 1;
+			break;
+		}
+
+		f = http_request_alloc(mp->req, sizeof(*f));
+		f->req = mp->req;
+		f->offset = 0;
+		f->length = 0;
+		f->position = 0;
+		f->name = http_request_strdup(mp->req, mp->name);
+		f->filename = http_request_strdup(mp->req, mp->filename);
+		f->path = http_request_alloc(mp->req, HTTP_BODY_PATH_MAX);
+
+		l = snprintf(f->path, HTTP_BODY_PATH_MAX,
+		    "%s/http_part.XXXXXX", http_body_disk_path);
+		if (l == -1 || (size_t)l >= HTTP_BODY_PATH_MAX)
+			return (KORE_RESULT_ERROR);
+
+		if ((f->fd = mkstemp(f->path)) == -1) {
+			kore_log(LOG_ERR, "mkstemp(%s): %s", f->path, errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+
+		/* On the list right away so it is cleaned up whatever happens. */
+		TAILQ_INSERT_TAIL(&mp->req->files, f, list);
+		mp->file = f;
+		break;
+	case HTTP_MULTIPART_PART_DATA:
+		if (mp->skip)
+			break;
+
+		if (mp->file == NULL) {
+			if (mp->field.offset + len > http_multipart_field_max)
+				return (KORE_RESULT_ERROR);
+			kore_buf_append(&mp->field, data, len);
+			break;
+		}
+
+		while (len > 0) {
+			ret = write(mp->file->fd, data, len);
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				kore_log(LOG_ERR, "write(%s): %s",
+				    mp->file->path, errno_s);
+				return (KORE_RESULT_ERROR);
+			}
+
+			mp->file->length += ret;
+			data += ret;
+			len -= ret;
+		}
+		break;
+	case HTTP_MULTIPART_PART_END:
+		if (mp->skip) {
+			mp->skip = 0;
+			break;
+		}
+
+		if (mp->file == NULL) {
+			string = kore_buf_stringify(&mp->field, NULL);
+			http_argument_add(mp->req, mp->name, string, 0, 0);
+		}
+
+		mp->file = NULL;
+		break;
+	default:
+		fatal("multipart_default: unknown event %d", event);
+	}
+
+	return (KORE_RESULT_OK);
+}
@@ -17,6 +17,9 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#include <limits.h>
 
 #if defined(__linux__)
 #include <endian.h>
@@ -30,13 +33,40 @@
 
 #include "kore.h"
 
+#if !defined(IOV_MAX)
+#define IOV_MAX		1024
+#endif
+
+static int	net_send_vectored(struct connection *);
+static void	net_netbuf_free(struct netbuf *);
+static void	net_recv_unpool(struct netbuf *);
+static int	net_rope_release(struct netbuf *);
+static int	net_shared_netbuf_release(struct netbuf *);
+
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+static int	net_send_zerocopy(struct connection *);
+static int	net_zerocopy_eligible(struct connection *, struct netbuf *);
+#endif
+
 struct kore_pool		nb_pool;
 
+static TAILQ_HEAD(, connection)	net_pending;
+static struct iovec		net_iov[IOV_MAX];
+
+/*
+ * Fixed size receive buffers, see net_recv_pooled(). A connection only
+ * holds one while it has unparsed input.
+ */
+static struct kore_pool		rbuf_pool;
+static size_t			rbuf_len = 0;
+
 void
 net_init(void)
 {
 	u_int32_t	elm;
 
+	TAILQ_INIT(&net_pending);
+
 	/* Add some overhead so we don't roll over for internal items. */
 	elm = worker_max_connections + 10;
 	kore_pool_init(&nb_pool, "nb_pool", sizeof(struct netbuf), elm);
@@ -47,6 +77,28 @@ net_cleanup(void)
 {
 	kore_debug("net_cleanup()");
 	kore_pool_cleanup(&nb_pool);
+
+	if (rbuf_len != 0) {
+		kore_pool_cleanup(&rbuf_pool);
+		rbuf_len = 0;
+	}
+}
+
+void
+net_recv_buffers_init(size_t len, size_t elm)
+{
+	if (rbuf_len != 0)
+		kore_pool_cleanup(&rbuf_pool);
+
+	rbuf_len = len;
+	kore_pool_init(&rbuf_pool, "rbuf_pool", rbuf_len, elm);
+}
+
+void
+net_recv_buffer_put(void *buf)
+{
+	if (buf != NULL)
+		kore_pool_put(&rbuf_pool, buf);
 }
 
 struct netbuf *
@@ -67,12 +119,19 @@ net_netbuf_get(void)
 	nb->b_len = 0;
 	nb->m_len = 0;
 	nb->flags = 0;
+	nb->scan_off = 0;
 
 #if defined(KORE_USE_PLATFORM_SENDFILE)
 	nb->fd_off = -1;
 	nb->fd_len = -1;
 #endif
 
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+	nb->zc_seq = 0;
+	nb->zc_cnt = 0;
+	nb->zc_done = 0;
+#endif
+
 	return (nb);
 }
 
@@ -122,6 +181,51 @@ net_send_queue(struct connection *c, const void *data, size_t len)
 	TAILQ_INSERT_TAIL(&(c->send_queue), nb, list);
 }
 
+/*
+ * Returns a send netbuf with room for at least len bytes which the
+ * caller writes into directly, advancing b_len as it goes.
+ */
+struct netbuf *
+net_send_reserve(struct connection *c, size_t len)
+{
+	struct netbuf		*nb;
+
+	nb = TAILQ_LAST(&(c->send_queue), netbuf_head);
+	if (nb != NULL && !(nb->flags & NETBUF_IS_STREAM) &&
+	    (nb->m_len - nb->b_len) >= len)
+		return (nb);
+
+	nb = net_netbuf_get();
+
+	nb->owner = c;
+	nb->type = NETBUF_SEND;
+	nb->m_len = MAX(len, NETBUF_SEND_PAYLOAD_MAX);
+	nb->buf = kore_malloc(nb->m_len);
+
+	TAILQ_INSERT_TAIL(&(c->send_queue), nb, list);
+
+	return (nb);
+}
+
+/* Returns how many bytes are still waiting in the send queue. */
+size_t
+net_send_pending(struct connection *c)
+{
+	size_t			len;
+	struct netbuf		*nb;
+
+	len = 0;
+
+	TAILQ_FOREACH(nb, &c->send_queue, list) {
+		if (nb->file_ref != NULL)
+			len += nb->fd_len - nb->fd_off;
+		else
+			len += nb->b_len - nb->s_off;
+	}
+
+	return (len);
+}
+
 void
 net_send_stream(struct connection *c, void *data, size_t len,
     int (*cb)(struct netbuf *), struct netbuf **out)
@@ -145,8 +249,87 @@ net_send_stream(struct connection *c, void *data, size_t len,
 		*out = nb;
 }
 
+/*
+ * Hand the chunks of rope over to the send queue without copying them,
+ * they go back to their pool once sent. Small chunks are copied into
+ * the tail netbuf instead. The rope is left empty.
+ */
+void
+net_send_queue_rope(struct connection *c, struct kore_rope *rope)
+{
+	struct netbuf			*nb;
+	struct kore_rope_chunk		*chunk;
+
+	while ((chunk = TAILQ_FIRST(&rope->chunks)) != NULL) {
+		TAILQ_REMOVE(&rope->chunks, chunk, list);
+
+		if (chunk->len < NETBUF_ROPE_COPY_MAX) {
+			net_send_queue(c, chunk->data, chunk->len);
+			kore_rope_chunk_free(chunk);
+			continue;
+		}
+
+		net_send_stream(c, chunk->data, chunk->len,
+		    net_rope_release, &nb);
+		nb->extra = chunk;
+	}
+
+	rope->length = 0;
+}
+
+/* Returns a shared buffer of len bytes, the caller holds the reference. */
+struct netbuf_shared *
+net_shared_alloc(size_t len)
+{
+	struct netbuf_shared	*sh;
+
+	sh = kore_malloc(sizeof(*sh) + len);
+	sh->refs = 1;
+	sh->len = len;
+
+	return (sh);
+}
+
+void
+net_shared_release(struct netbuf_shared *sh)
+{
+	if (sh->refs == 0)
+		fatal("%s: no references left", __func__);
+
+	if (--sh->refs == 0)
+		kore_free(sh);
+}
+
+/*
+ * Queue a shared buffer on a connection by reference, small ones are
+ * cheaper to copy into the tail netbuf instead.
+ */
+void
+net_send_shared(struct connection *c, struct netbuf_shared *sh)
+{
+	struct netbuf		*nb;
+
+	if (sh->len < NETBUF_SHARED_COPY_MAX) {
+		net_send_queue(c, sh->data, sh->len);
+		return;
+	}
+
+	sh->refs++;
+
+	net_send_stream(c, sh->data, sh->len, net_shared_netbuf_release, &nb);
+	nb->extra = sh;
+}
+
 void
 net_send_fileref(struct connection *c, struct kore_fileref *ref)
+{
+	net_send_fileref_range(c, ref, 0, ref->size);
+}
+
+/* Queue len bytes of ref starting at off, the caller hands over its ref. */
+void
+net_send_fileref_range(struct connection *c, struct kore_fileref *ref,
+    off_t off, size_t len)
 {
 	struct netbuf		*nb;
 
@@ -157,18 +340,18 @@ net_send_fileref(struct connection *c, struct kore_fileref *ref)
 	nb->flags = NETBUF_IS_FILEREF;
 
 #if defined(KORE_USE_PLATFORM_SENDFILE)
-	if (c->owner->server->tls == 0) {
-		nb->fd_off = 0;
-		nb->fd_len = ref->size;
+	if (c->owner->server->tls == 0 || (c->flags & CONN_TLS_KTLS)) {
+		nb->fd_off = off;
+		nb->fd_len = off + len;
 	} else {
-		nb->buf = ref->base;
-		nb->b_len = ref->size;
+		nb->buf = (u_int8_t *)ref->base + off;
+		nb->b_len = len;
 		nb->m_len = nb->b_len;
 		nb->flags |= NETBUF_IS_STREAM;
 	}
 #else
-	nb->buf = ref->base;
-	nb->b_len = ref->size;
+	nb->buf = (u_int8_t *)ref->base + off;
+	nb->b_len = len;
 	nb->m_len = nb->b_len;
 	nb->flags |= NETBUF_IS_STREAM;
 #endif
@@ -184,14 +367,30 @@ net_recv_reset(struct connection *c, size_t len, int (*cb)(struct netbuf *))
 	c->rnb->cb = cb;
 	c->rnb->s_off = 0;
 	c->rnb->b_len = len;
+	c->rnb->scan_off = 0;
+
+	if (c->rnb->flags & NETBUF_RECV_POOLED) {
+		if (len <= rbuf_len) {
+			c->rnb->m_len = rbuf_len;
+			goto done;
+		}
+		net_recv_unpool(c->rnb);
+	}
 
 	if (c->rnb->buf != NULL && c->rnb->b_len <= c->rnb->m_len &&
 	    c->rnb->m_len < (NETBUF_SEND_PAYLOAD_MAX / 2))
-		return;
+		goto done;
 
 	kore_free(c->rnb->buf);
 	c->rnb->m_len = len;
 	c->rnb->buf = kore_malloc(c->rnb->m_len);
+
+done:
+	if (c->rpending != NULL && c->rpending_off < c->rpending->offset &&
+	    !(c->flags & CONN_RECV_PENDING)) {
+		c->flags |= CONN_RECV_PENDING;
+		TAILQ_INSERT_TAIL(&net_pending, c, rlist);
+	}
 }
 
 void
@@ -210,14 +409,53 @@ net_recv_queue(struct connection *c, size_t len, int flags,
 	c->rnb->m_len = len;
 	c->rnb->flags = flags;
 	c->rnb->type = NETBUF_RECV;
+
+	if ((flags & NETBUF_RECV_POOLED) && len <= rbuf_len) {
+		c->rnb->m_len = rbuf_len;
+		return;
+	}
+
+	c->rnb->flags &= ~NETBUF_RECV_POOLED;
 	c->rnb->buf = kore_malloc(c->rnb->b_len);
 }
 
+/*
+ * Rearm the receive netbuf to read up to a pool buffer worth of data.
+ * The buffer is only taken from the pool once the socket is readable
+ * and goes back to it when nothing arrived, so idle connections do not
+ * hold one. Callbacks may take ownership of nb->buf by clearing it and
+ * nb->m_len, which stops reading until the netbuf is rearmed. They give
+ * the buffer back with net_recv_buffer_put().
+ */
+void
+net_recv_pooled(struct connection *c, int (*cb)(struct netbuf *))
+{
+	if (rbuf_len == 0)
+		fatal("net_recv_pooled(): no receive buffers");
+
+	if (!(c->rnb->flags & NETBUF_RECV_POOLED)) {
+		kore_free(c->rnb->buf);
+		c->rnb->buf = NULL;
+		c->rnb->flags |= NETBUF_RECV_POOLED;
+	}
+
+	net_recv_reset(c, rbuf_len, cb);
+}
+
 void
 net_recv_expand(struct connection *c, size_t len, int (*cb)(struct netbuf *))
 {
 	kore_debug("net_recv_expand(): %p %d", c, len);
 
+	if (c->rnb->flags & NETBUF_RECV_POOLED) {
+		if (c->rnb->b_len + len <= rbuf_len) {
+			c->rnb->cb = cb;
+			c->rnb->b_len += len;
+			return;
+		}
+		net_recv_unpool(c->rnb);
+	}
+
 	c->rnb->cb = cb;
 	c->rnb->b_len += len;
 	c->rnb->m_len = c->rnb->b_len;
@@ -234,10 +472,21 @@ net_send(struct connection *c)
 #if defined(KORE_USE_PLATFORM_SENDFILE)
 	if ((c->snb->flags & NETBUF_IS_FILEREF) &&
 	    !(c->snb->flags & NETBUF_IS_STREAM)) {
+		if (c->flags & CONN_TLS_KTLS)
+			return (kore_tls_sendfile(c, c->snb));
 		return (kore_platform_sendfile(c, c->snb));
 	}
 #endif
 
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+	if (net_zerocopy_eligible(c, c->snb))
+		return (net_send_zerocopy(c));
+#endif
+
+	if (c->writev != NULL && TAILQ_NEXT(c->snb, list) != NULL &&
+	    !(c->snb->flags & NETBUF_FORCE_REMOVE))
+		return (net_send_vectored(c));
+
 	if (c->snb->b_len != 0) {
 		smin = c->snb->b_len - c->snb->s_off;
 		len = MIN(NETBUF_SEND_PAYLOAD_MAX, smin);
@@ -260,6 +509,62 @@ net_send(struct connection *c)
 	return (KORE_RESULT_OK);
 }
 
+/*
+ * Hand as many queued netbufs as possible to a single vectored write,
+ * stopping at the first one that must go out via sendfile, and advance
+ * through whatever was written.
+ */
+static int
+net_send_vectored(struct connection *c)
+{
+	struct netbuf		*nb, *next;
+	int			cnt;
+	size_t			r, len;
+
+	cnt = 0;
+	TAILQ_FOREACH(nb, &(c->send_queue), list) {
+		if (cnt == IOV_MAX || (nb->flags & NETBUF_FORCE_REMOVE))
+			break;
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+		if ((nb->flags & NETBUF_IS_FILEREF) &&
+		    !(nb->flags & NETBUF_IS_STREAM))
+			break;
+#endif
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+		if (cnt > 0 && net_zerocopy_eligible(c, nb))
+			break;
+#endif
+		net_iov[cnt].iov_base = nb->buf + nb->s_off;
+		net_iov[cnt].iov_len = nb->b_len - nb->s_off;
+		cnt++;
+	}
+
+	r = 0;
+	if (!c->writev(c, net_iov, cnt, &r))
+		return (KORE_RESULT_ERROR);
+	if (!(c->evt.flags & KORE_EVENT_WRITE))
+		return (KORE_RESULT_OK);
+
+	for (nb = c->snb; nb != NULL && cnt > 0; nb = next, cnt--) {
+		next = TAILQ_NEXT(nb, list);
+
+		if ((len = MIN(r, nb->b_len - nb->s_off)) > 0) {
+			nb->s_off += len;
+			nb->flags &= ~NETBUF_MUST_RESEND;
+			r -= len;
+		}
+
+		if (nb->s_off != nb->b_len)
+			break;
+
+		net_remove_netbuf(c, nb);
+	}
+
+	c->snb = NULL;
+
+	return (KORE_RESULT_OK);
+}
+
 int
 net_send_flush(struct connection *c)
 {
@@ -288,17 +593,40 @@ net_recv_flush(struct connection *c)
 	if (c->rnb == NULL)
 		return (KORE_RESULT_OK);
 
-	while (c->evt.flags & KORE_EVENT_READ) {
-		if (c->rnb->buf == NULL)
-			return (KORE_RESULT_OK);
+	while ((c->evt.flags & KORE_EVENT_READ) || (c->rpending != NULL &&
+	    c->rpending_off < c->rpending->offset)) {
+		if (c->rnb->buf == NULL) {
+			if (!(c->rnb->flags & NETBUF_RECV_POOLED) ||
+			    c->rnb->m_len == 0)
+				return (KORE_RESULT_OK);
+			c->rnb->buf = kore_pool_get(&rbuf_pool);
+		}
 
 		if ((c->rnb->b_len - c->rnb->s_off) == 0)
 			return (KORE_RESULT_OK);
 
-		if (!c->read(c, &r))
-			return (KORE_RESULT_ERROR);
-		if (!(c->evt.flags & KORE_EVENT_READ))
-			break;
+		/* Input handed back by net_recv_pushback() goes first. */
+		if (c->rpending != NULL &&
+		    c->rpending_off < c->rpending->offset) {
+			r = MIN(c->rpending->offset - c->rpending_off,
+			    c->rnb->b_len - c->rnb->s_off);
+			memcpy(c->rnb->buf + c->rnb->s_off,
+			    c->rpending->data + c->rpending_off, r);
+			c->rpending_off += r;
+			c->rpending_last = r;
+		} else {
+			if (!c->read(c, &r))
+				return (KORE_RESULT_ERROR);
+			if (!(c->evt.flags & KORE_EVENT_READ)) {
+				if ((c->rnb->flags & NETBUF_RECV_POOLED) &&
+				    c->rnb->s_off == 0) {
+					kore_pool_put(&rbuf_pool, c->rnb->buf);
+					c->rnb->buf = NULL;
+				}
+				break;
+			}
+			c->rpending_last = 0;
+		}
 
 		c->rnb->s_off += r;
 		if (c->rnb->s_off == c->rnb->b_len ||
@@ -312,6 +640,85 @@ net_recv_flush(struct connection *c)
 	return (KORE_RESULT_OK);
 }
 
+/*
+ * Hand back the trailing len bytes of the current receive buffer that
+ * its callback did not consume (eg: pipelined HTTP requests). They are
+ * delivered again, ahead of any new socket data, once the receive buffer
+ * is rearmed. If the bytes were copied from the backlog in the first place
+ * we merely rewind it, so a batch of requests is never shuffled around.
+ */
+void
+net_recv_pushback(struct connection *c, const void *data, size_t len)
+{
+	struct kore_buf		*buf;
+	size_t			left;
+
+	if (len == 0)
+		return;
+
+	if (c->rpending == NULL) {
+		c->rpending = kore_buf_alloc(len);
+		c->rpending_off = 0;
+		c->rpending_last = 0;
+	}
+
+	if (len <= c->rpending_last) {
+		c->rpending_off -= len;
+		c->rpending_last = 0;
+		return;
+	}
+
+	left = c->rpending->offset - c->rpending_off;
+	if (left == 0) {
+		kore_buf_reset(c->rpending);
+		kore_buf_append(c->rpending, data, len);
+	} else {
+		buf = kore_buf_alloc(len + left);
+		kore_buf_append(buf, data, len);
+		kore_buf_append(buf,
+		    c->rpending->data + c->rpending_off, left);
+		kore_buf_free(c->rpending);
+		c->rpending = buf;
+	}
+
+	c->rpending_off = 0;
+	c->rpending_last = 0;
+}
+
+int
+net_recv_pending(void)
+{
+	return (!TAILQ_EMPTY(&net_pending));
+}
+
+void
+net_recv_pending_remove(struct connection *c)
+{
+	TAILQ_REMOVE(&net_pending, c, rlist);
+	c->flags &= ~CONN_RECV_PENDING;
+}
+
+void
+net_recv_pending_flush(void)
+{
+	struct connection			*c;
+	TAILQ_HEAD(, connection)		list;
+
+	TAILQ_INIT(&list);
+	TAILQ_CONCAT(&list, &net_pending, rlist);
+
+	while ((c = TAILQ_FIRST(&list)) != NULL) {
+		TAILQ_REMOVE(&list, c, rlist);
+		c->flags &= ~CONN_RECV_PENDING;
+
+		if (c->state != CONN_STATE_ESTABLISHED)
+			continue;
+
+		if (!net_recv_flush(c))
+			kore_connection_disconnect(c);
+	}
+}
+
 void
 net_remove_netbuf(struct connection *c, struct netbuf *nb)
 {
@@ -326,6 +733,162 @@ net_remove_netbuf(struct connection *c, struct netbuf *nb)
 		return;
 	}
 
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+	/*
+	 * Stream data may still be pinned by the kernel, and later stream
+	 * netbufs may point into the same memory, so they are not released
+	 * before every zerocopy send ahead of them has completed.
+	 */
+	if ((nb->flags & NETBUF_IS_STREAM) &&
+	    (nb->zc_done != nb->zc_cnt || !TAILQ_EMPTY(&(c->zc_queue)))) {
+		TAILQ_REMOVE(&(c->send_queue), nb, list);
+		TAILQ_INSERT_TAIL(&(c->zc_queue), nb, list);
+		return;
+	}
+#endif
+
+	net_netbuf_free(nb);
+	TAILQ_REMOVE(&(c->send_queue), nb, list);
+
+	kore_pool_put(&nb_pool, nb);
+}
+
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+/*
+ * The kernel is done with zerocopy sends lo up to and including hi,
+ * release whatever netbufs no longer have any sends outstanding.
+ */
+void
+net_zerocopy_complete(struct connection *c, u_int32_t lo, u_int32_t hi)
+{
+	struct netbuf		*nb;
+	u_int32_t		first, last;
+
+	TAILQ_FOREACH(nb, &(c->zc_queue), list) {
+		if (!(nb->flags & NETBUF_ZEROCOPY))
+			continue;
+
+		first = MAX(lo, nb->zc_seq);
+		last = MIN(hi, nb->zc_seq + nb->zc_cnt - 1);
+		if (first <= last)
+			nb->zc_done += (last - first) + 1;
+	}
+
+	/* A partially sent netbuf can only ever be the head. */
+	if ((nb = TAILQ_FIRST(&(c->send_queue))) != NULL &&
+	    (nb->flags & NETBUF_ZEROCOPY)) {
+		first = MAX(lo, nb->zc_seq);
+		last = MIN(hi, nb->zc_seq + nb->zc_cnt - 1);
+		if (first <= last)
+			nb->zc_done += (last - first) + 1;
+	}
+
+	while ((nb = TAILQ_FIRST(&(c->zc_queue))) != NULL) {
+		if (nb->zc_done != nb->zc_cnt)
+			break;
+
+		TAILQ_REMOVE(&(c->zc_queue), nb, list);
+		net_netbuf_free(nb);
+		kore_pool_put(&nb_pool, nb);
+	}
+}
+
+/* The socket is gone, so is any reference the kernel held. */
+void
+net_zerocopy_cleanup(struct connection *c)
+{
+	struct netbuf		*nb;
+
+	while ((nb = TAILQ_FIRST(&(c->zc_queue))) != NULL) {
+		TAILQ_REMOVE(&(c->zc_queue), nb, list);
+		net_netbuf_free(nb);
+		kore_pool_put(&nb_pool, nb);
+	}
+}
+
+static int
+net_zerocopy_eligible(struct connection *c, struct netbuf *nb)
+{
+	if (kore_socket_zerocopy == 0 || c->write != net_write)
+		return (0);
+
+	if (c->flags & CONN_ZEROCOPY_OFF)
+		return (0);
+
+	if (!(nb->flags & NETBUF_IS_STREAM) ||
+	    (nb->flags & NETBUF_FORCE_REMOVE))
+		return (0);
+
+	return (nb->b_len >= kore_socket_zerocopy);
+}
+
+static int
+net_send_zerocopy(struct connection *c)
+{
+	size_t		r;
+
+	if (c->snb->b_len != 0) {
+		if (!kore_platform_zerocopy_send(c,
+		    c->snb->b_len - c->snb->s_off, &r))
+			return (KORE_RESULT_ERROR);
+		if (!(c->evt.flags & KORE_EVENT_WRITE))
+			return (KORE_RESULT_OK);
+
+		c->snb->s_off += r;
+	}
+
+	if (c->snb->s_off == c->snb->b_len) {
+		net_remove_netbuf(c, c->snb);
+		c->snb = NULL;
+	}
+
+	return (KORE_RESULT_OK);
+}
+#endif
+
+/*
+ * Move a pooled receive netbuf over to a heap buffer, its contents
+ * are carried over so it can be expanded past the pool buffer size.
+ */
+static void
+net_recv_unpool(struct netbuf *nb)
+{
+	u_int8_t	*buf;
+
+	nb->flags &= ~NETBUF_RECV_POOLED;
+
+	if (nb->buf == NULL) {
+		nb->m_len = 0;
+		return;
+	}
+
+	buf = kore_malloc(rbuf_len);
+	memcpy(buf, nb->buf, nb->s_off);
+	kore_pool_put(&rbuf_pool, nb->buf);
+
+	nb->buf = buf;
+	nb->m_len = rbuf_len;
+}
+
+static int
+net_rope_release(struct netbuf *nb)
+{
+	kore_rope_chunk_free(nb->extra);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+net_shared_netbuf_release(struct netbuf *nb)
+{
+	net_shared_release(nb->extra);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+net_netbuf_free(struct netbuf *nb)
+{
 	if (!(nb->flags & NETBUF_IS_STREAM)) {
 		kore_free(nb->buf);
 	} else if (nb->cb != NULL) {
@@ -334,10 +897,6 @@ net_remove_netbuf(struct connection *c, struct netbuf *nb)
 
 	if (nb->flags & NETBUF_IS_FILEREF)
 		kore_fileref_release(nb->file_ref);
-
-	TAILQ_REMOVE(&(c->send_queue), nb, list);
-
-	kore_pool_put(&nb_pool, nb);
 }
 
 int
@@ -365,6 +924,31 @@ net_write(struct connection *c, size_t len, size_t *written)
 	return (KORE_RESULT_OK);
 }
 
+int
+net_writev(struct connection *c, struct iovec *iov, int cnt, size_t *written)
+{
+	ssize_t		r;
+
+	r = writev(c->fd, iov, cnt);
+	if (r == -1) {
+		switch (errno) {
+		case EINTR:
+			*written = 0;
+			return (KORE_RESULT_OK);
+		case EAGAIN:
+			c->evt.flags &= ~KORE_EVENT_WRITE;
+			return (KORE_RESULT_OK);
+		default:
+			kore_debug("writev: %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	*written = (size_t)r;
+
+	return (KORE_RESULT_OK);
+}
+
 int
 net_read(struct connection *c, size_t *bytes)
 {
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Adaptive admission control, enabled by setting http_overload_target.
+ *
+ * Each worker keeps a concurrency limit driven by the queueing delay of
+ * its requests, the time between a request being ready to run and its
+ * handler being called. Admitted requests that are ready wait on a FIFO
+ * here and every pass through http_process() samples the age of the
+ * oldest one, new requests are run first so this is the only way to see
+ * the queue. Like CoDel the smallest sample over an interval is what
+ * counts: if even that one is above the target the worker has a
+ * standing queue and is overloaded, the limit is then cut back to below
+ * the concurrency it actually ran at. Otherwise the limit grows again
+ * towards http_request_limit.
+ *
+ * Routes have their own limit on top of that, following the gradient of
+ * their latency against a slowly moving baseline so that a route whose
+ * backend slows down cannot take all of the worker its requests.
+ *
+ * Requests over the limit are answered with a 503 right away. Routes
+ * with a low priority are shed first, they only get half of the limit
+ * and nothing at all while the worker is overloaded. High priority
+ * routes are only held to http_request_limit.
+ */
+
+#include <sys/types.h>
+
+#include <inttypes.h>
+
+#include "kore.h"
+#include "http.h"
+
+static void	overload_update(u_int64_t);
+static void	overload_route_update(struct kore_route *, u_int64_t);
+static void	overload_shed(struct http_request *);
+
+static TAILQ_HEAD(, http_request)	overload_queue =
+    TAILQ_HEAD_INITIALIZER(overload_queue);
+
+static u_int32_t	overload_limit = 0;
+static u_int32_t	overload_peak = 0;
+static int		overload_state = 0;
+static u_int64_t	overload_window = 0;
+static u_int64_t	overload_delay = 0;
+
+u_int32_t	http_overload_target = 0;
+u_int32_t	http_overload_interval = HTTP_OVERLOAD_INTERVAL;
+
+void
+http_overload_init(void)
+{
+	overload_limit = http_request_limit;
+	overload_state = 0;
+	overload_peak = 0;
+	overload_delay = UINT64_MAX;
+	overload_window = kore_time_us();
+
+	if (worker != NULL)
+		worker->metrics.overload_limit = overload_limit;
+}
+
+/* Returns the KORE_ROUTE_PRIORITY_* for the given name, or -1. */
+int
+http_overload_priority(const char *name)
+{
+	if (!strcmp(name, "low"))
+		return (KORE_ROUTE_PRIORITY_LOW);
+	if (!strcmp(name, "normal"))
+		return (KORE_ROUTE_PRIORITY_NORMAL);
+	if (!strcmp(name, "high"))
+		return (KORE_ROUTE_PRIORITY_HIGH);
+
+	return (-1);
+}
+
+/*
+ * Admit a request to its route, called once its headers are in. If the
+ * worker or route is over its limit it is answered with a 503 and marked
+ * for deletion, the caller must not touch it any further.
+ */
+int
+http_overload_check(struct http_request *req)
+{
+	u_int32_t			limit;
+	struct kore_route_overload	*ov;
+	struct kore_route		*rt = req->rt;
+
+	if (http_overload_target == 0)
+		return (KORE_RESULT_OK);
+
+	ov = &rt->overload;
+	if (ov->limit == 0)
+		ov->limit = http_request_limit;
+
+	if (rt->priority != KORE_ROUTE_PRIORITY_HIGH) {
+		limit = overload_limit;
+
+		if (rt->priority == KORE_ROUTE_PRIORITY_LOW) {
+			if (overload_state) {
+				overload_shed(req);
+				return (KORE_RESULT_ERROR);
+			}
+			limit = MAX(limit / 2, 1);
+		}
+
+		/* http_request_count already includes this request. */
+		if (http_request_count > limit || ov->inflight >= ov->limit) {
+			overload_shed(req);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	ov->inflight++;
+	overload_peak = MAX(overload_peak, http_request_count);
+
+	req->overload = HTTP_OVERLOAD_ADMITTED;
+	req->t_ready = kore_time_us();
+
+	/* Requests with a body are queued once it is in. */
+	if (req->flags & HTTP_REQUEST_COMPLETE)
+		http_overload_ready(req);
+
+	return (KORE_RESULT_OK);
+}
+
+/* An admitted request is ready to have its handler run. */
+void
+http_overload_ready(struct http_request *req)
+{
+	if (req->overload != HTTP_OVERLOAD_ADMITTED)
+		return;
+
+	req->overload = HTTP_OVERLOAD_QUEUED;
+	req->t_ready = kore_time_us();
+	TAILQ_INSERT_TAIL(&overload_queue, req, ovlist);
+}
+
+/* The handler of an admitted request is about to run for the first time. */
+void
+http_overload_start(struct http_request *req)
+{
+	if (req->overload == HTTP_OVERLOAD_QUEUED)
+		TAILQ_REMOVE(&overload_queue, req, ovlist);
+	else if (req->overload != HTTP_OVERLOAD_ADMITTED)
+		return;
+
+	req->overload = HTTP_OVERLOAD_RUNNING;
+}
+
+/* Called for every pass through http_process(). */
+void
+http_overload_sample(void)
+{
+	u_int64_t		now;
+	struct http_request	*req;
+
+	if (http_overload_target == 0)
+		return;
+
+	now = kore_time_us();
+
+	if ((req = TAILQ_FIRST(&overload_queue)) == NULL)
+		overload_delay = 0;
+	else if (now > req->t_ready)
+		overload_delay = MIN(overload_delay, now - req->t_ready);
+
+	if (now - overload_window >= http_overload_interval * 1000ULL)
+		overload_update(now);
+}
+
+/* The request is going away, account for its latency on the route. */
+void
+http_overload_release(struct http_request *req)
+{
+	u_int64_t			now;
+	struct kore_route_overload	*ov;
+
+	if (req->overload == 0)
+		return;
+
+	if (req->overload == HTTP_OVERLOAD_QUEUED)
+		TAILQ_REMOVE(&overload_queue, req, ovlist);
+
+	ov = &req->rt->overload;
+	ov->inflight--;
+
+	if (req->overload == HTTP_OVERLOAD_RUNNING) {
+		now = kore_time_us();
+		if (now > req->t_ready) {
+			ov->latency += now - req->t_ready;
+			ov->samples++;
+		}
+
+		if (now - ov->window >= http_overload_interval * 1000ULL)
+			overload_route_update(req->rt, now);
+	}
+
+	req->overload = 0;
+}
+
+int
+http_overload_active(void)
+{
+	return (overload_state);
+}
+
+/* The number of requests this worker is willing to take on right now. */
+u_int32_t
+http_overload_limit(void)
+{
+	if (http_overload_target == 0)
+		return (http_request_limit);
+
+	return (overload_limit);
+}
+
+/*
+ * Scale the number of connections accepted per wakeup by how far the
+ * limit has come down, only one at a time while overloaded.
+ */
+u_int32_t
+http_overload_accept(u_int32_t threshold)
+{
+	u_int64_t	scaled;
+
+	if (http_overload_target == 0 || threshold == 0 ||
+	    http_request_limit == 0)
+		return (threshold);
+
+	if (overload_state)
+		return (1);
+
+	scaled = ((u_int64_t)threshold * overload_limit) / http_request_limit;
+
+	return (MAX(scaled, 1));
+}
+
+static void
+overload_update(u_int64_t now)
+{
+	u_int32_t	cut;
+
+	if (overload_delay != UINT64_MAX &&
+	    overload_delay > http_overload_target * 1000ULL) {
+		if (!overload_state) {
+			kore_log(LOG_NOTICE,
+			    "overloaded, queueing delay %" PRIu64 "ms",
+			    overload_delay / 1000);
+		}
+
+		overload_state = 1;
+		cut = MIN(overload_limit, MAX(overload_peak, 1));
+		overload_limit = MAX(cut - (cut / 4), HTTP_OVERLOAD_MIN);
+	} else {
+		if (overload_state) {
+			kore_log(LOG_NOTICE,
+			    "no longer overloaded, limit %u", overload_limit);
+		}
+
+		overload_state = 0;
+		overload_limit += (overload_limit / 8) + 1;
+		overload_limit = MIN(overload_limit, http_request_limit);
+	}
+
+	overload_window = now;
+	overload_delay = UINT64_MAX;
+	overload_peak = http_request_count;
+
+	if (worker != NULL)
+		worker->metrics.overload_limit = overload_limit;
+}
+
+static void
+overload_route_update(struct kore_route *rt, u_int64_t now)
+{
+	u_int64_t			avg, next;
+	struct kore_route_overload	*ov = &rt->overload;
+
+	if (ov->samples == 0) {
+		ov->window = now;
+		return;
+	}
+
+	avg = MAX(ov->latency / ov->samples, 1);
+
+	/* The baseline drops right away but only creeps up. */
+	if (ov->baseline == 0 || avg < ov->baseline)
+		ov->baseline = avg;
+	else
+		ov->baseline += (avg - ov->baseline) / 64;
+
+	/*
+	 * Scale the limit by baseline / latency, no less than half, and
+	 * leave room for a small queue. Decreases are smoothed so one slow
+	 * window does not halve the route.
+	 */
+	next = ((u_int64_t)ov->limit * MAX(ov->baseline, avg / 2)) / avg;
+	next += HTTP_OVERLOAD_MIN;
+	if (next < ov->limit)
+		next = ((u_int64_t)ov->limit * 4 + next) / 5;
+
+	next = MAX(next, HTTP_OVERLOAD_MIN);
+	ov->limit = MIN(next, http_request_limit);
+
+	ov->window = now;
+	ov->latency = 0;
+	ov->samples = 0;
+}
+
+static void
+overload_shed(struct http_request *req)
+{
+	if (worker != NULL)
+		worker->metrics.overload_shed++;
+
+	http_response_header(req, "retry-after", "1");
+	http_response_close(req, HTTP_STATUS_SERVICE_UNAVAILABLE, NULL, 0);
+	req->flags |= HTTP_REQUEST_DELETE;
+}
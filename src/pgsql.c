@@ -46,6 +46,7 @@ static struct sock_filter filter_pgsql[] = {
 
 struct pgsql_wait {
 	struct kore_pgsql	*pgsql;
+	struct pgsql_db		*db;
 	TAILQ_ENTRY(pgsql_wait)	list;
 };
 
@@ -54,20 +55,96 @@ struct pgsql_job {
 	TAILQ_ENTRY(pgsql_job)	list;
 };
 
+/*
+ * An async execute of a statement that is not yet prepared on the
+ * connection. The parameters are copied as the execute is only sent
+ * once the server has answered the prepare.
+ */
+struct pgsql_prepare {
+	struct pgsql_statement	*stmt;
+	int			binary;
+	int			count;
+	char			**values;
+	int			*lengths;
+	int			*formats;
+};
+
+/*
+ * A cached result, shared by every kore_pgsql reading it. While the
+ * first query for a key is in flight the entry has no result and any
+ * identical query waits on it instead of going to the server.
+ */
+struct pgsql_cache {
+	u_int64_t			hash;
+	int				flags;
+	u_int32_t			refs;
+	u_int64_t			expires;
+	size_t				size;
+	struct pgsql_db			*db;
+	u_int8_t			*key;
+	size_t				klen;
+	PGresult			*result;
+	LIST_HEAD(, kore_pgsql)		waiters;
+	LIST_ENTRY(pgsql_cache)		hlist;
+	TAILQ_ENTRY(pgsql_cache)	lru;
+};
+
+#define PGSQL_CACHE_BUCKETS	1024
+#define PGSQL_CACHE_EVICTED	0x01
+
 #define PGSQL_CONN_MAX		2
 #define PGSQL_CONN_FREE		0x01
 #define PGSQL_LIST_INSERTED	0x0100
+#define PGSQL_CACHE_SERVED	0x0200
 #define PGSQL_QUEUE_LIMIT	1000
+#define PGSQL_CONN_CHECK	10000
 
-static void	pgsql_queue_wakeup(void);
+static void	pgsql_queue_wakeup(struct pgsql_db *);
 static void	pgsql_cancel(struct kore_pgsql *);
 static void	pgsql_set_error(struct kore_pgsql *, const char *);
-static void	pgsql_queue_add(struct kore_pgsql *);
+static void	pgsql_queue_add(struct kore_pgsql *, struct pgsql_db *);
 static void	pgsql_queue_remove(struct kore_pgsql *);
 static void	pgsql_conn_release(struct kore_pgsql *);
+static void	pgsql_conn_return(struct kore_pgsql *);
 static void	pgsql_conn_cleanup(struct pgsql_conn *);
+static void	pgsql_conn_check(void *, u_int64_t);
+static void	pgsql_conn_fill(struct pgsql_db *);
 static void	pgsql_read_result(struct kore_pgsql *);
 static void	pgsql_schedule(struct kore_pgsql *);
+static void	pgsql_prepare_read(struct kore_pgsql *);
+static void	pgsql_prepare_free(struct kore_pgsql *);
+static void	pgsql_prepare_defer(struct kore_pgsql *,
+		    struct pgsql_statement *, int, int, const char **,
+		    int *, int *);
+static int	pgsql_conn_prepared(struct pgsql_conn *,
+		    struct pgsql_statement *);
+static void	pgsql_conn_set_prepared(struct pgsql_conn *,
+		    struct pgsql_statement *);
+static void	pgsql_params_collect(int, va_list, const char ***,
+		    int **, int **);
+static void	pgsql_pipeline_push(struct kore_pgsql *,
+		    struct pgsql_statement *);
+static void	pgsql_pipeline_end(struct kore_pgsql *);
+static void	pgsql_single_row(struct kore_pgsql *);
+
+static int	pgsql_cache_start(struct kore_pgsql *, int, const char *,
+		    int, int, const char **, int *, int *);
+static void	pgsql_cache_done(struct kore_pgsql *);
+static void	pgsql_cache_release(struct kore_pgsql *);
+static void	pgsql_cache_abandon(struct pgsql_cache *);
+static void	pgsql_cache_evict(struct pgsql_cache *);
+static void	pgsql_cache_free(struct pgsql_cache *);
+static void	pgsql_cache_wakeup(struct kore_pgsql *);
+static void	pgsql_cache_purge(const char *);
+static void	pgsql_cache_purge_msg(struct kore_msg *, const void *);
+
+#if !defined(KORE_NO_HTTP)
+static int	pgsql_stream_sent(struct netbuf *);
+static int	pgsql_stream_abort(struct kore_pgsql_stream *);
+static int	pgsql_stream_flush(struct kore_pgsql_stream *, int);
+#endif
+static void	pgsql_conn_clear_prepared(struct pgsql_conn *,
+		    struct pgsql_statement *);
 
 static struct pgsql_conn	*pgsql_conn_create(struct kore_pgsql *,
 				    struct pgsql_db *);
@@ -76,19 +153,24 @@ static struct pgsql_conn	*pgsql_conn_next(struct kore_pgsql *,
 
 static struct kore_pool			pgsql_job_pool;
 static struct kore_pool			pgsql_wait_pool;
-static TAILQ_HEAD(, pgsql_conn)		pgsql_conn_free;
-static TAILQ_HEAD(, pgsql_wait)		pgsql_wait_queue;
 static LIST_HEAD(, pgsql_db)		pgsql_db_conn_strings;
 
+static size_t				pgsql_cache_bytes = 0;
+static struct kore_buf			*pgsql_cache_key = NULL;
+static TAILQ_HEAD(, pgsql_cache)	pgsql_cache_lru =
+    TAILQ_HEAD_INITIALIZER(pgsql_cache_lru);
+static LIST_HEAD(, pgsql_cache)		pgsql_cache_buckets[PGSQL_CACHE_BUCKETS];
+
+size_t		pgsql_cache_size = 0;
+
 u_int32_t	pgsql_queue_count = 0;
+u_int16_t	pgsql_conn_min = 0;
 u_int16_t	pgsql_conn_max = PGSQL_CONN_MAX;
 u_int32_t	pgsql_queue_limit = PGSQL_QUEUE_LIMIT;
 
 void
 kore_pgsql_sys_init(void)
 {
-	TAILQ_INIT(&pgsql_conn_free);
-	TAILQ_INIT(&pgsql_wait_queue);
 	LIST_INIT(&pgsql_db_conn_strings);
 
 	kore_pool_init(&pgsql_job_pool, "pgsql_job_pool",
@@ -105,17 +187,34 @@ kore_pgsql_sys_init(void)
 void
 kore_pgsql_sys_cleanup(void)
 {
+	struct pgsql_db		*db;
 	struct pgsql_conn	*conn, *next;
 
 	kore_pool_cleanup(&pgsql_job_pool);
 	kore_pool_cleanup(&pgsql_wait_pool);
 
-	for (conn = TAILQ_FIRST(&pgsql_conn_free); conn != NULL; conn = next) {
-		next = TAILQ_NEXT(conn, list);
-		pgsql_conn_cleanup(conn);
+	LIST_FOREACH(db, &pgsql_db_conn_strings, rlist) {
+		for (conn = TAILQ_FIRST(&db->conn_free);
+		    conn != NULL; conn = next) {
+			next = TAILQ_NEXT(conn, list);
+			pgsql_conn_cleanup(conn);
+		}
 	}
 }
 
+void
+kore_pgsql_worker_init(void)
+{
+	struct pgsql_db		*db;
+
+	/* Open conn_min connections up front, not on the first requests. */
+	LIST_FOREACH(db, &pgsql_db_conn_strings, rlist)
+		pgsql_conn_fill(db);
+
+	kore_timer_add(pgsql_conn_check, PGSQL_CONN_CHECK, NULL, 0);
+	kore_msg_register(KORE_MSG_PGSQL_CACHE_PURGE, pgsql_cache_purge_msg);
+}
+
 void
 kore_pgsql_init(struct kore_pgsql *pgsql)
 {
@@ -140,6 +239,27 @@ kore_pgsql_setup(struct kore_pgsql *pgsql, const char *dbname, int flags)
 		}
 	}
 
+	if (flags & KORE_PGSQL_PIPELINE) {
+#if PG_VERSION_NUM >= 140000
+		if (!(flags & KORE_PGSQL_ASYNC)) {
+			pgsql_set_error(pgsql, "pipeline mode requires async");
+			return (KORE_RESULT_ERROR);
+		}
+#else
+		pgsql_set_error(pgsql, "pipeline mode not supported");
+		return (KORE_RESULT_ERROR);
+#endif
+	}
+
+	if (flags & KORE_PGSQL_SINGLE_ROW) {
+		if (!(flags & KORE_PGSQL_ASYNC) ||
+		    (flags & KORE_PGSQL_PIPELINE)) {
+			pgsql_set_error(pgsql,
+			    "single row mode requires async without pipeline");
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
 	db = NULL;
 	pgsql->flags |= flags;
 
@@ -161,6 +281,15 @@ kore_pgsql_setup(struct kore_pgsql *pgsql, const char *dbname, int flags)
 		pgsql->conn->job->pgsql = pgsql;
 	}
 
+#if PG_VERSION_NUM >= 140000
+	if (pgsql->flags & KORE_PGSQL_PIPELINE) {
+		if (!PQenterPipelineMode(pgsql->conn->db)) {
+			pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+			return (KORE_RESULT_ERROR);
+		}
+	}
+#endif
+
 	return (KORE_RESULT_OK);
 }
 
@@ -200,8 +329,12 @@ kore_pgsql_query(struct kore_pgsql *pgsql, const void *query)
 		return (KORE_RESULT_ERROR);
 	}
 
+	if (pgsql_cache_start(pgsql, 'q', query, 0, 0, NULL, NULL, NULL))
+		return (KORE_RESULT_OK);
+
 	if (pgsql->flags & KORE_PGSQL_SYNC) {
 		pgsql->result = PQexec(pgsql->conn->db, query);
+		pgsql_cache_done(pgsql);
 		if ((PQresultStatus(pgsql->result) != PGRES_TUPLES_OK) &&
 		    (PQresultStatus(pgsql->result) != PGRES_COMMAND_OK)) {
 			pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
@@ -209,12 +342,22 @@ kore_pgsql_query(struct kore_pgsql *pgsql, const void *query)
 		}
 
 		pgsql->state = KORE_PGSQL_STATE_DONE;
+	} else if (pgsql->flags & KORE_PGSQL_PIPELINE) {
+		/* The simple query protocol is not allowed in a pipeline. */
+		if (!PQsendQueryParams(pgsql->conn->db, query, 0, NULL,
+		    NULL, NULL, NULL, 0)) {
+			pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+			return (KORE_RESULT_ERROR);
+		}
+
+		pgsql_pipeline_push(pgsql, NULL);
 	} else {
 		if (!PQsendQuery(pgsql->conn->db, query)) {
 			pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
 			return (KORE_RESULT_ERROR);
 		}
 
+		pgsql_single_row(pgsql);
 		pgsql_schedule(pgsql);
 	}
 
@@ -225,7 +368,6 @@ int
 kore_pgsql_v_query_params(struct kore_pgsql *pgsql,
     const void *query, int binary, int count, va_list args)
 {
-	int		i;
 	const char	**values;
 	int		*lengths, *formats, ret;
 
@@ -234,21 +376,7 @@ kore_pgsql_v_query_params(struct kore_pgsql *pgsql,
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (count > 0) {
-		lengths = kore_calloc(count, sizeof(int));
-		formats = kore_calloc(count, sizeof(int));
-		values = kore_calloc(count, sizeof(char *));
-
-		for (i = 0; i < count; i++) {
-			values[i] = va_arg(args, void *);
-			lengths[i] = va_arg(args, int);
-			formats[i] = va_arg(args, int);
-		}
-	} else {
-		lengths = NULL;
-		formats = NULL;
-		values = NULL;
-	}
+	pgsql_params_collect(count, args, &values, &lengths, &formats);
 
 	ret = kore_pgsql_query_param_fields(pgsql, query, binary, count,
 	    values, lengths, formats);
@@ -269,10 +397,15 @@ kore_pgsql_query_param_fields(struct kore_pgsql *pgsql, const void *query,
 		return (KORE_RESULT_ERROR);
 	}
 
+	if (pgsql_cache_start(pgsql, 'q', query, binary,
+	    count, values, lengths, formats))
+		return (KORE_RESULT_OK);
+
 	if (pgsql->flags & KORE_PGSQL_SYNC) {
 		pgsql->result = PQexecParams(pgsql->conn->db, query, count,
 		    NULL, (const char * const *)values, lengths, formats,
 		    binary);
+		pgsql_cache_done(pgsql);
 
 		if ((PQresultStatus(pgsql->result) != PGRES_TUPLES_OK) &&
 		    (PQresultStatus(pgsql->result) != PGRES_COMMAND_OK)) {
@@ -288,7 +421,12 @@ kore_pgsql_query_param_fields(struct kore_pgsql *pgsql, const void *query,
 			return (KORE_RESULT_ERROR);
 		}
 
-		pgsql_schedule(pgsql);
+		if (pgsql->flags & KORE_PGSQL_PIPELINE) {
+			pgsql_pipeline_push(pgsql, NULL);
+		} else {
+			pgsql_single_row(pgsql);
+			pgsql_schedule(pgsql);
+		}
 	}
 
 	return (KORE_RESULT_OK);
@@ -308,6 +446,218 @@ kore_pgsql_query_params(struct kore_pgsql *pgsql,
 	return (ret);
 }
 
+int
+kore_pgsql_execute(struct kore_pgsql *pgsql,
+    const char *name, int binary, int count, ...)
+{
+	int		ret;
+	va_list		args;
+
+	va_start(args, count);
+	ret = kore_pgsql_v_execute(pgsql, name, binary, count, args);
+	va_end(args);
+
+	return (ret);
+}
+
+int
+kore_pgsql_v_execute(struct kore_pgsql *pgsql,
+    const char *name, int binary, int count, va_list args)
+{
+	const char	**values;
+	int		*lengths, *formats, ret;
+
+	if (pgsql->conn == NULL) {
+		pgsql_set_error(pgsql, "no connection was set before query");
+		return (KORE_RESULT_ERROR);
+	}
+
+	pgsql_params_collect(count, args, &values, &lengths, &formats);
+
+	ret = kore_pgsql_execute_param_fields(pgsql, name, binary, count,
+	    values, lengths, formats);
+
+	kore_free(values);
+	kore_free(lengths);
+	kore_free(formats);
+
+	return (ret);
+}
+
+int
+kore_pgsql_execute_param_fields(struct kore_pgsql *pgsql, const char *name,
+    int binary, int count, const char **values, int *lengths, int *formats)
+{
+	struct pgsql_conn	*conn;
+	struct pgsql_statement	*stmt;
+
+	if ((conn = pgsql->conn) == NULL) {
+		pgsql_set_error(pgsql, "no connection was set before query");
+		return (KORE_RESULT_ERROR);
+	}
+
+	LIST_FOREACH(stmt, &conn->pgsqldb->statements, list) {
+		if (!strcmp(stmt->name, name))
+			break;
+	}
+
+	if (stmt == NULL) {
+		pgsql_set_error(pgsql, "no such statement");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (pgsql_cache_start(pgsql, 's', stmt->name, binary,
+	    count, values, lengths, formats))
+		return (KORE_RESULT_OK);
+
+	if (pgsql->flags & KORE_PGSQL_SYNC) {
+		if (!pgsql_conn_prepared(conn, stmt)) {
+			pgsql->result = PQprepare(conn->db,
+			    stmt->name, stmt->sql, 0, NULL);
+			if (PQresultStatus(pgsql->result) != PGRES_COMMAND_OK) {
+				pgsql_set_error(pgsql,
+				    PQerrorMessage(conn->db));
+				return (KORE_RESULT_ERROR);
+			}
+
+			PQclear(pgsql->result);
+			pgsql->result = NULL;
+			pgsql_conn_set_prepared(conn, stmt);
+		}
+
+		pgsql->result = PQexecPrepared(conn->db, stmt->name, count,
+		    (const char * const *)values, lengths, formats, binary);
+		pgsql_cache_done(pgsql);
+
+		if ((PQresultStatus(pgsql->result) != PGRES_TUPLES_OK) &&
+		    (PQresultStatus(pgsql->result) != PGRES_COMMAND_OK)) {
+			pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+			return (KORE_RESULT_ERROR);
+		}
+
+		pgsql->state = KORE_PGSQL_STATE_DONE;
+	} else if (pgsql->flags & KORE_PGSQL_PIPELINE) {
+		/* In a pipeline the prepare can go out right in front. */
+		if (!pgsql_conn_prepared(conn, stmt)) {
+			if (!PQsendPrepare(conn->db,
+			    stmt->name, stmt->sql, 0, NULL)) {
+				pgsql_set_error(pgsql,
+				    PQerrorMessage(conn->db));
+				return (KORE_RESULT_ERROR);
+			}
+
+			pgsql_conn_set_prepared(conn, stmt);
+			pgsql_pipeline_push(pgsql, stmt);
+		}
+
+		if (!PQsendQueryPrepared(conn->db, stmt->name, count,
+		    (const char * const *)values, lengths, formats, binary)) {
+			pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+			return (KORE_RESULT_ERROR);
+		}
+
+		pgsql_pipeline_push(pgsql, NULL);
+	} else {
+		if (!pgsql_conn_prepared(conn, stmt)) {
+			if (!PQsendPrepare(conn->db,
+			    stmt->name, stmt->sql, 0, NULL)) {
+				pgsql_set_error(pgsql,
+				    PQerrorMessage(conn->db));
+				return (KORE_RESULT_ERROR);
+			}
+
+			pgsql_prepare_defer(pgsql, stmt, binary, count,
+			    values, lengths, formats);
+		} else if (!PQsendQueryPrepared(conn->db, stmt->name, count,
+		    (const char * const *)values, lengths, formats, binary)) {
+			pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+			return (KORE_RESULT_ERROR);
+		} else {
+			pgsql_single_row(pgsql);
+		}
+
+		pgsql_schedule(pgsql);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_pgsql_pipeline_sync(struct kore_pgsql *pgsql)
+{
+	if (pgsql->conn == NULL) {
+		pgsql_set_error(pgsql, "no connection was set before query");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!(pgsql->flags & KORE_PGSQL_PIPELINE) ||
+	    pgsql->pipeline.length == 0) {
+		pgsql_set_error(pgsql, "no pipelined queries");
+		return (KORE_RESULT_ERROR);
+	}
+
+#if PG_VERSION_NUM >= 140000
+	if (!PQpipelineSync(pgsql->conn->db)) {
+		pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+		return (KORE_RESULT_ERROR);
+	}
+#endif
+
+	pgsql_schedule(pgsql);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Opt the next query on this kore_pgsql into the result cache, results
+ * are kept for ttl milliseconds. Only rows returned by a query are
+ * cached and only when pgsql_cache_size is set.
+ */
+void
+kore_pgsql_cache(struct kore_pgsql *pgsql, u_int32_t ttl)
+{
+	pgsql->cache_ttl = ttl;
+}
+
+/* Drop cached results for the given database (or all if NULL). */
+void
+kore_pgsql_cache_purge(const char *db)
+{
+	pgsql_cache_purge(db);
+
+	kore_msg_send(KORE_MSG_WORKER_ALL, KORE_MSG_PGSQL_CACHE_PURGE,
+	    db, db != NULL ? strlen(db) : 0);
+}
+
+int
+kore_pgsql_register_statement(const char *dbname, const char *name,
+    const char *sql)
+{
+	struct pgsql_db		*pgsqldb;
+	struct pgsql_statement	*stmt;
+
+	LIST_FOREACH(pgsqldb, &pgsql_db_conn_strings, rlist) {
+		if (!strcmp(pgsqldb->name, dbname))
+			break;
+	}
+
+	if (pgsqldb == NULL)
+		return (KORE_RESULT_ERROR);
+
+	LIST_FOREACH(stmt, &pgsqldb->statements, list) {
+		if (!strcmp(stmt->name, name))
+			return (KORE_RESULT_ERROR);
+	}
+
+	stmt = kore_malloc(sizeof(*stmt));
+	stmt->id = pgsqldb->stmt_count++;
+	stmt->name = kore_strdup(name);
+	stmt->sql = kore_strdup(sql);
+	LIST_INSERT_HEAD(&pgsqldb->statements, stmt, list);
+
+	return (KORE_RESULT_OK);
+}
+
 int
 kore_pgsql_register(const char *dbname, const char *connstring)
 {
@@ -321,8 +671,17 @@ kore_pgsql_register(const char *dbname, const char *connstring)
 	pgsqldb = kore_malloc(sizeof(*pgsqldb));
 	pgsqldb->name = kore_strdup(dbname);
 	pgsqldb->conn_count = 0;
+	pgsqldb->conn_min = pgsql_conn_min;
 	pgsqldb->conn_max = pgsql_conn_max;
 	pgsqldb->conn_string = kore_strdup(connstring);
+	pgsqldb->stmt_count = 0;
+	LIST_INIT(&pgsqldb->statements);
+	TAILQ_INIT(&pgsqldb->conn_free);
+	TAILQ_INIT(&pgsqldb->wait_queue);
+
+	if (pgsqldb->conn_max != 0 && pgsqldb->conn_min > pgsqldb->conn_max)
+		pgsqldb->conn_min = pgsqldb->conn_max;
+
 	LIST_INSERT_HEAD(&pgsql_db_conn_strings, pgsqldb, rlist);
 
 	return (KORE_RESULT_OK);
@@ -344,7 +703,10 @@ kore_pgsql_handle(void *c, int err)
 
 	pgsql = conn->job->pgsql;
 
-	pgsql_read_result(pgsql);
+	if (pgsql->prepare != NULL)
+		pgsql_prepare_read(pgsql);
+	else
+		pgsql_read_result(pgsql);
 
 	if (pgsql->state == KORE_PGSQL_STATE_WAIT) {
 #if !defined(KORE_NO_HTTP)
@@ -371,6 +733,17 @@ kore_pgsql_continue(struct kore_pgsql *pgsql)
 		pgsql->error = NULL;
 	}
 
+	/* Served from the cache, there is nothing left to read. */
+	if (pgsql->flags & PGSQL_CACHE_SERVED) {
+		pgsql_cache_release(pgsql);
+		pgsql->flags &= ~PGSQL_CACHE_SERVED;
+		pgsql->state = KORE_PGSQL_STATE_COMPLETE;
+
+		if (pgsql->cb != NULL)
+			pgsql->cb(pgsql, pgsql->arg);
+		return;
+	}
+
 	if (pgsql->result) {
 		PQclear(pgsql->result);
 		pgsql->result = NULL;
@@ -401,6 +774,10 @@ void
 kore_pgsql_cleanup(struct kore_pgsql *pgsql)
 {
 	pgsql_queue_remove(pgsql);
+	pgsql_prepare_free(pgsql);
+	pgsql_pipeline_end(pgsql);
+	pgsql_cache_release(pgsql);
+	pgsql->flags &= ~PGSQL_CACHE_SERVED;
 
 	if (pgsql->result != NULL)
 		PQclear(pgsql->result);
@@ -464,67 +841,209 @@ kore_pgsql_column_binary(struct kore_pgsql *pgsql, int col)
 	return (PQfformat(pgsql->result, col));
 }
 
-static struct pgsql_conn *
-pgsql_conn_next(struct kore_pgsql *pgsql, struct pgsql_db *db)
+/*
+ * Hand the current result to the caller, who must PQclear() it. This lets
+ * it outlive kore_pgsql_continue(). A result served from the cache is
+ * shared with other queries, so the caller gets a copy of it instead.
+ */
+PGresult *
+kore_pgsql_result_take(struct kore_pgsql *pgsql)
 {
-	PGTransactionStatusType		state;
-	struct pgsql_conn		*conn;
-	struct kore_pgsql		rollback;
+	PGresult	*result;
 
-rescan:
-	conn = NULL;
+	if (pgsql->result == NULL)
+		return (NULL);
 
-	TAILQ_FOREACH(conn, &pgsql_conn_free, list) {
-		if (!(conn->flags & PGSQL_CONN_FREE))
-			fatal("got a pgsql connection that was not free?");
-		if (!strcmp(conn->name, db->name))
-			break;
+	if (pgsql->flags & PGSQL_CACHE_SERVED) {
+		return (PQcopyResult(pgsql->result,
+		    PG_COPYRES_ATTRS | PG_COPYRES_TUPLES));
 	}
 
-	if (conn != NULL) {
-		state = PQtransactionStatus(conn->db);
-		if (state == PQTRANS_INERROR) {
-			conn->flags &= ~PGSQL_CONN_FREE;
-			TAILQ_REMOVE(&pgsql_conn_free, conn, list);
+	result = pgsql->result;
+	pgsql->result = NULL;
 
-			kore_pgsql_init(&rollback);
-			rollback.conn = conn;
-			rollback.flags = KORE_PGSQL_SYNC;
+	return (result);
+}
 
-			if (!kore_pgsql_query(&rollback, "ROLLBACK")) {
-				kore_pgsql_logerror(&rollback);
-				kore_pgsql_cleanup(&rollback);
-				pgsql_conn_cleanup(conn);
-			} else {
-				kore_pgsql_cleanup(&rollback);
-			}
+#if !defined(KORE_NO_HTTP)
+void
+kore_pgsql_stream_init(struct kore_pgsql_stream *stream,
+    struct kore_pgsql *pgsql, struct http_request *req, int status,
+    int (*row)(struct kore_pgsql *, int, struct kore_buf *, void *), void *arg)
+{
+	memset(stream, 0, sizeof(*stream));
 
-			goto rescan;
-		}
-	}
+	stream->req = req;
+	stream->row = row;
+	stream->arg = arg;
+	stream->pgsql = pgsql;
+	stream->status = status;
 
-	if (conn == NULL) {
-		if (db->conn_max != 0 &&
-		    db->conn_count >= db->conn_max) {
-			if ((pgsql->flags & KORE_PGSQL_ASYNC) &&
-			    pgsql_queue_count < pgsql_queue_limit) {
-				pgsql_queue_add(pgsql);
-			} else {
-				pgsql_set_error(pgsql,
-				    "no available connection");
-			}
+	kore_buf_init(&stream->bufs[0], KORE_PGSQL_STREAM_CHUNK);
+	kore_buf_init(&stream->bufs[1], KORE_PGSQL_STREAM_CHUNK);
+	stream->buf = &stream->bufs[0];
+}
 
-			return (NULL);
-		}
+/*
+ * Drives a streamed response from a page handler, call it until it no
+ * longer returns KORE_RESULT_RETRY and return what it returned.
+ *
+ * The query must have been sent with KORE_PGSQL_SINGLE_ROW. The row
+ * callback formats each row into the given buffer. On HTTP/1.1 those
+ * buffers go out as chunks of about KORE_PGSQL_STREAM_CHUNK bytes,
+ * elsewhere the body is collected and sent as one response.
+ */
+int
+kore_pgsql_stream_run(struct kore_pgsql_stream *stream)
+{
+	int			i;
+	struct connection	*c;
+	struct kore_pgsql	*pgsql;
 
-		if ((conn = pgsql_conn_create(pgsql, db)) == NULL)
-			return (NULL);
-	}
+	pgsql = stream->pgsql;
 
-	conn->flags &= ~PGSQL_CONN_FREE;
-	TAILQ_REMOVE(&pgsql_conn_free, conn, list);
+	if ((c = stream->req->owner) == NULL)
+		return (KORE_RESULT_ERROR);
 
-	return (conn);
+	if (!(stream->flags & KORE_PGSQL_STREAM_STARTED)) {
+		stream->flags |= KORE_PGSQL_STREAM_STARTED;
+
+		if (c->proto == CONN_PROTO_HTTP &&
+		    !(stream->req->flags & HTTP_VERSION_1_0)) {
+			stream->flags |= KORE_PGSQL_STREAM_CHUNKED;
+			stream->req->flags |= HTTP_REQUEST_NO_CONTENT_LENGTH;
+			http_response_header(stream->req,
+			    "transfer-encoding", "chunked");
+
+			/* We start receiving again once the stream is done. */
+			c->flags |= CONN_IS_BUSY;
+			http_response(stream->req, stream->status, NULL, 0);
+		}
+	}
+
+	for (;;) {
+		/* Stop reading rows until the chunk in flight was sent. */
+		if (stream->flags & KORE_PGSQL_STREAM_INFLIGHT) {
+			http_request_sleep(stream->req);
+			return (KORE_RESULT_RETRY);
+		}
+
+		if (stream->flags & KORE_PGSQL_STREAM_FINISHED)
+			break;
+
+		if ((stream->flags & KORE_PGSQL_STREAM_CHUNKED) &&
+		    stream->buf->offset >= KORE_PGSQL_STREAM_CHUNK) {
+			if (!pgsql_stream_flush(stream, 0))
+				return (KORE_RESULT_ERROR);
+			continue;
+		}
+
+		switch (pgsql->state) {
+		case KORE_PGSQL_STATE_WAIT:
+			return (KORE_RESULT_RETRY);
+		case KORE_PGSQL_STATE_RESULT:
+			for (i = 0; i < kore_pgsql_ntuples(pgsql); i++) {
+				if (!stream->row(pgsql, i,
+				    stream->buf, stream->arg))
+					return (pgsql_stream_abort(stream));
+			}
+			kore_pgsql_continue(pgsql);
+			break;
+		case KORE_PGSQL_STATE_ERROR:
+			kore_pgsql_logerror(pgsql);
+			return (pgsql_stream_abort(stream));
+		case KORE_PGSQL_STATE_COMPLETE:
+			stream->flags |= KORE_PGSQL_STREAM_FINISHED;
+			if (!(stream->flags & KORE_PGSQL_STREAM_CHUNKED))
+				break;
+			if (!pgsql_stream_flush(stream, 1))
+				return (KORE_RESULT_ERROR);
+			break;
+		case KORE_PGSQL_STATE_INIT:
+			fatal("%s: no query was sent", __func__);
+			/* NOTREACHED */
+		default:
+			kore_pgsql_continue(pgsql);
+			break;
+		}
+	}
+
+	if (stream->flags & KORE_PGSQL_STREAM_CHUNKED) {
+		c->flags &= ~CONN_IS_BUSY;
+		http_start_recv(c);
+	} else {
+		http_response(stream->req, stream->status,
+		    stream->buf->data, stream->buf->offset);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+void
+kore_pgsql_stream_cleanup(struct kore_pgsql_stream *stream)
+{
+	kore_buf_cleanup(&stream->bufs[0]);
+	kore_buf_cleanup(&stream->bufs[1]);
+}
+#endif
+
+static struct pgsql_conn *
+pgsql_conn_next(struct kore_pgsql *pgsql, struct pgsql_db *db)
+{
+	PGTransactionStatusType		state;
+	struct pgsql_conn		*conn;
+	struct kore_pgsql		rollback;
+
+rescan:
+	conn = NULL;
+
+	if ((conn = TAILQ_FIRST(&db->conn_free)) != NULL) {
+		if (!(conn->flags & PGSQL_CONN_FREE))
+			fatal("got a pgsql connection that was not free?");
+
+		state = PQtransactionStatus(conn->db);
+		if (state == PQTRANS_INERROR) {
+			conn->flags &= ~PGSQL_CONN_FREE;
+			TAILQ_REMOVE(&db->conn_free, conn, list);
+
+			kore_pgsql_init(&rollback);
+			rollback.conn = conn;
+			rollback.flags = KORE_PGSQL_SYNC;
+
+			if (!kore_pgsql_query(&rollback, "ROLLBACK")) {
+				kore_pgsql_logerror(&rollback);
+				kore_pgsql_cleanup(&rollback);
+				pgsql_conn_cleanup(conn);
+			} else {
+				kore_pgsql_cleanup(&rollback);
+			}
+
+			goto rescan;
+		}
+	}
+
+	if (conn == NULL) {
+		if (db->conn_max != 0 &&
+		    db->conn_count >= db->conn_max) {
+			if ((pgsql->flags & KORE_PGSQL_ASYNC) &&
+			    pgsql_queue_count < pgsql_queue_limit) {
+				pgsql_queue_add(pgsql, db);
+			} else {
+				pgsql_set_error(pgsql,
+				    "no available connection");
+			}
+
+			return (NULL);
+		}
+
+		if ((conn = pgsql_conn_create(pgsql, db)) == NULL)
+			return (NULL);
+	}
+
+	conn->flags &= ~PGSQL_CONN_FREE;
+	TAILQ_REMOVE(&db->conn_free, conn, list);
+
+	return (conn);
 }
 
 static void
@@ -559,7 +1078,7 @@ pgsql_schedule(struct kore_pgsql *pgsql)
 }
 
 static void
-pgsql_queue_add(struct kore_pgsql *pgsql)
+pgsql_queue_add(struct kore_pgsql *pgsql, struct pgsql_db *db)
 {
 	struct pgsql_wait	*pgw;
 
@@ -570,54 +1089,49 @@ pgsql_queue_add(struct kore_pgsql *pgsql)
 
 	pgw = kore_pool_get(&pgsql_wait_pool);
 	pgw->pgsql = pgsql;
+	pgw->db = db;
+	pgsql->wait = pgw;
 
 	pgsql_queue_count++;
-	TAILQ_INSERT_TAIL(&pgsql_wait_queue, pgw, list);
+	TAILQ_INSERT_TAIL(&db->wait_queue, pgw, list);
 }
 
 static void
 pgsql_queue_remove(struct kore_pgsql *pgsql)
 {
-	struct pgsql_wait	*pgw, *next;
-
-	for (pgw = TAILQ_FIRST(&pgsql_wait_queue); pgw != NULL; pgw = next) {
-		next = TAILQ_NEXT(pgw, list);
-		if (pgw->pgsql != pgsql)
-			continue;
+	struct pgsql_wait	*pgw;
 
-		pgsql_queue_count--;
-		TAILQ_REMOVE(&pgsql_wait_queue, pgw, list);
-		kore_pool_put(&pgsql_wait_pool, pgw);
+	if ((pgw = pgsql->wait) == NULL)
 		return;
-	}
+
+	pgsql_queue_count--;
+	TAILQ_REMOVE(&pgw->db->wait_queue, pgw, list);
+	kore_pool_put(&pgsql_wait_pool, pgw);
+
+	pgsql->wait = NULL;
 }
 
 static void
-pgsql_queue_wakeup(void)
+pgsql_queue_wakeup(struct pgsql_db *db)
 {
-	struct pgsql_wait	*pgw, *next;
+	struct kore_pgsql	*pgsql;
+	struct pgsql_wait	*pgw;
 
-	for (pgw = TAILQ_FIRST(&pgsql_wait_queue); pgw != NULL; pgw = next) {
-		next = TAILQ_NEXT(pgw, list);
+	while ((pgw = TAILQ_FIRST(&db->wait_queue)) != NULL) {
+		pgsql = pgw->pgsql;
+		pgsql_queue_remove(pgsql);
 
 #if !defined(KORE_NO_HTTP)
-		if (pgw->pgsql->req != NULL) {
-			if (pgw->pgsql->req->flags & HTTP_REQUEST_DELETE) {
-				pgsql_queue_count--;
-				TAILQ_REMOVE(&pgsql_wait_queue, pgw, list);
-				kore_pool_put(&pgsql_wait_pool, pgw);
+		if (pgsql->req != NULL) {
+			if (pgsql->req->flags & HTTP_REQUEST_DELETE)
 				continue;
-			}
 
-			http_request_wakeup(pgw->pgsql->req);
+			http_request_wakeup(pgsql->req);
 		}
 #endif
-		if (pgw->pgsql->cb != NULL)
-			pgw->pgsql->cb(pgw->pgsql, pgw->pgsql->arg);
+		if (pgsql->cb != NULL)
+			pgsql->cb(pgsql, pgsql->arg);
 
-		pgsql_queue_count--;
-		TAILQ_REMOVE(&pgsql_wait_queue, pgw, list);
-		kore_pool_put(&pgsql_wait_pool, pgw);
 		return;
 	}
 }
@@ -635,8 +1149,9 @@ pgsql_conn_create(struct kore_pgsql *pgsql, struct pgsql_db *db)
 	conn = kore_calloc(1, sizeof(*conn));
 	conn->job = NULL;
 	conn->flags = PGSQL_CONN_FREE;
+	conn->pgsqldb = db;
 	conn->name = kore_strdup(db->name);
-	TAILQ_INSERT_TAIL(&pgsql_conn_free, conn, list);
+	TAILQ_INSERT_TAIL(&db->conn_free, conn, list);
 
 	conn->evt.type = KORE_TYPE_PGSQL_CONN;
 	conn->evt.handle = kore_pgsql_handle;
@@ -653,12 +1168,27 @@ pgsql_conn_create(struct kore_pgsql *pgsql, struct pgsql_db *db)
 
 static void
 pgsql_conn_release(struct kore_pgsql *pgsql)
+{
+	if (pgsql->conn == NULL)
+		return;
+
+	pgsql_conn_return(pgsql);
+
+	pgsql->state = KORE_PGSQL_STATE_COMPLETE;
+
+	if (pgsql->cb != NULL)
+		pgsql->cb(pgsql, pgsql->arg);
+}
+
+/* Hand the connection back to the pool without touching the state. */
+static void
+pgsql_conn_return(struct kore_pgsql *pgsql)
 {
 	int		fd;
 	PGresult	*result;
+	struct pgsql_db	*db;
 
-	if (pgsql->conn == NULL)
-		return;
+	db = pgsql->conn->pgsqldb;
 
 	/* Async query cleanup */
 	if (pgsql->flags & KORE_PGSQL_ASYNC) {
@@ -672,31 +1202,37 @@ pgsql_conn_release(struct kore_pgsql *pgsql)
 		kore_pool_put(&pgsql_job_pool, pgsql->conn->job);
 	}
 
-	/* Drain just in case. */
-	while ((result = PQgetResult(pgsql->conn->db)) != NULL)
-		PQclear(result);
-
 	pgsql->conn->job = NULL;
-	pgsql->conn->flags |= PGSQL_CONN_FREE;
-	TAILQ_INSERT_TAIL(&pgsql_conn_free, pgsql->conn, list);
 
-	pgsql->conn = NULL;
-	pgsql->state = KORE_PGSQL_STATE_COMPLETE;
+#if PG_VERSION_NUM >= 140000
+	/* Abandoned in the middle of a pipeline, do not reuse it. */
+	if (PQpipelineStatus(pgsql->conn->db) != PQ_PIPELINE_OFF &&
+	    !PQexitPipelineMode(pgsql->conn->db)) {
+		pgsql_conn_cleanup(pgsql->conn);
+		pgsql->conn = NULL;
+	}
+#endif
 
-	if (pgsql->cb != NULL)
-		pgsql->cb(pgsql, pgsql->arg);
+	if (pgsql->conn != NULL) {
+		/* Drain just in case. */
+		while ((result = PQgetResult(pgsql->conn->db)) != NULL)
+			PQclear(result);
+
+		pgsql->conn->flags |= PGSQL_CONN_FREE;
+		TAILQ_INSERT_TAIL(&db->conn_free, pgsql->conn, list);
+	}
 
-	pgsql_queue_wakeup();
+	pgsql->conn = NULL;
+	pgsql_queue_wakeup(db);
 }
 
 static void
 pgsql_conn_cleanup(struct pgsql_conn *conn)
 {
 	struct kore_pgsql	*pgsql;
-	struct pgsql_db		*pgsqldb;
 
 	if (conn->flags & PGSQL_CONN_FREE)
-		TAILQ_REMOVE(&pgsql_conn_free, conn, list);
+		TAILQ_REMOVE(&conn->pgsqldb->conn_free, conn, list);
 
 	if (conn->job) {
 		pgsql = conn->job->pgsql;
@@ -714,13 +1250,9 @@ pgsql_conn_cleanup(struct pgsql_conn *conn)
 	if (conn->db != NULL)
 		PQfinish(conn->db);
 
-	LIST_FOREACH(pgsqldb, &pgsql_db_conn_strings, rlist) {
-		if (!strcmp(pgsqldb->name, conn->name)) {
-			pgsqldb->conn_count--;
-			break;
-		}
-	}
+	conn->pgsqldb->conn_count--;
 
+	kore_free(conn->prepared);
 	kore_free(conn->name);
 	kore_free(conn);
 }
@@ -731,9 +1263,15 @@ pgsql_read_result(struct kore_pgsql *pgsql)
 	struct pgsql_conn	*conn;
 	PGnotify		*notify;
 	int			saved_errno;
+#if PG_VERSION_NUM >= 140000
+	struct pgsql_statement	*stmt;
+#endif
 
 	conn = pgsql->conn;
 
+#if PG_VERSION_NUM >= 140000
+again:
+#endif
 	for (;;) {
 		if (!PQconsumeInput(conn->db)) {
 			pgsql->state = KORE_PGSQL_STATE_ERROR;
@@ -766,8 +1304,55 @@ pgsql_read_result(struct kore_pgsql *pgsql)
 	}
 
 	pgsql->result = PQgetResult(conn->db);
+
+#if PG_VERSION_NUM >= 140000
+	if (pgsql->flags & KORE_PGSQL_PIPELINE) {
+		/* End of the results for one query, on to the next. */
+		if (pgsql->result == NULL) {
+			pgsql->pipeline.next++;
+			goto again;
+		}
+
+		switch (PQresultStatus(pgsql->result)) {
+		case PGRES_PIPELINE_SYNC:
+			PQclear(pgsql->result);
+			pgsql->result = NULL;
+			pgsql_pipeline_end(pgsql);
+			(void)PQexitPipelineMode(conn->db);
+			pgsql->state = KORE_PGSQL_STATE_DONE;
+			KORE_PROBE3(pgsql__result, pgsql, -1, pgsql->state);
+			return;
+		case PGRES_PIPELINE_ABORTED:
+			pgsql_set_error(pgsql, "pipeline aborted");
+			return;
+		default:
+			break;
+		}
+
+		stmt = NULL;
+		if (pgsql->pipeline.next < pgsql->pipeline.length)
+			stmt = pgsql->pipeline.queue[pgsql->pipeline.next];
+
+		/* Implicit prepare, only surfaced if it failed. */
+		if (stmt != NULL) {
+			if (PQresultStatus(pgsql->result) == PGRES_COMMAND_OK) {
+				PQclear(pgsql->result);
+				pgsql->result = NULL;
+				goto again;
+			}
+
+			pgsql_conn_clear_prepared(conn, stmt);
+			pgsql_set_error(pgsql,
+			    PQresultErrorMessage(pgsql->result));
+			return;
+		}
+	}
+#endif
+
 	if (pgsql->result == NULL) {
+		pgsql_cache_done(pgsql);
 		pgsql->state = KORE_PGSQL_STATE_DONE;
+		KORE_PROBE3(pgsql__result, pgsql, -1, pgsql->state);
 		return;
 	}
 
@@ -782,7 +1367,11 @@ pgsql_read_result(struct kore_pgsql *pgsql)
 	case PGRES_COPY_BOTH:
 		break;
 	case PGRES_COMMAND_OK:
-		pgsql->state = KORE_PGSQL_STATE_DONE;
+		/* In a pipeline DONE only comes with the sync. */
+		if (pgsql->flags & KORE_PGSQL_PIPELINE)
+			pgsql->state = KORE_PGSQL_STATE_RESULT;
+		else
+			pgsql->state = KORE_PGSQL_STATE_DONE;
 		break;
 	case PGRES_TUPLES_OK:
 #if PG_VERSION_NUM >= 90200
@@ -796,6 +1385,11 @@ pgsql_read_result(struct kore_pgsql *pgsql)
 		pgsql_set_error(pgsql, PQresultErrorMessage(pgsql->result));
 		break;
 	}
+
+	pgsql_cache_done(pgsql);
+
+	KORE_PROBE3(pgsql__result, pgsql,
+	    PQresultStatus(pgsql->result), pgsql->state);
 }
 
 static void
@@ -810,3 +1404,625 @@ pgsql_cancel(struct kore_pgsql *pgsql)
 		PQfreeCancel(cancel);
 	}
 }
+
+static void
+pgsql_prepare_read(struct kore_pgsql *pgsql)
+{
+	struct pgsql_conn	*conn;
+	struct pgsql_prepare	*prep;
+	PGresult		*result;
+	int			saved_errno;
+
+	conn = pgsql->conn;
+	prep = pgsql->prepare;
+
+	/* Read the answer to the prepare, then send the actual execute. */
+	for (;;) {
+		if (!PQconsumeInput(conn->db)) {
+			pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+			pgsql_prepare_free(pgsql);
+			return;
+		}
+
+		saved_errno = errno;
+
+		if (PQisBusy(conn->db)) {
+			if (saved_errno != EAGAIN && saved_errno != EWOULDBLOCK)
+				continue;
+			pgsql->state = KORE_PGSQL_STATE_WAIT;
+			conn->evt.flags &= ~KORE_EVENT_READ;
+			return;
+		}
+
+		if ((result = PQgetResult(conn->db)) == NULL)
+			break;
+
+		if (PQresultStatus(result) != PGRES_COMMAND_OK &&
+		    pgsql->state != KORE_PGSQL_STATE_ERROR)
+			pgsql_set_error(pgsql, PQresultErrorMessage(result));
+
+		PQclear(result);
+	}
+
+	if (pgsql->state == KORE_PGSQL_STATE_ERROR) {
+		pgsql_prepare_free(pgsql);
+		return;
+	}
+
+	pgsql_conn_set_prepared(conn, prep->stmt);
+
+	if (!PQsendQueryPrepared(conn->db, prep->stmt->name, prep->count,
+	    (const char * const *)prep->values, prep->lengths,
+	    prep->formats, prep->binary)) {
+		pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+		pgsql_prepare_free(pgsql);
+		return;
+	}
+
+	pgsql_single_row(pgsql);
+	pgsql_prepare_free(pgsql);
+
+	pgsql->state = KORE_PGSQL_STATE_WAIT;
+	conn->evt.flags &= ~KORE_EVENT_READ;
+}
+
+static void
+pgsql_prepare_defer(struct kore_pgsql *pgsql, struct pgsql_statement *stmt,
+    int binary, int count, const char **values, int *lengths, int *formats)
+{
+	int			i;
+	struct pgsql_prepare	*prep;
+
+	prep = kore_calloc(1, sizeof(*prep));
+	prep->stmt = stmt;
+	prep->count = count;
+	prep->binary = binary;
+
+	if (count > 0) {
+		prep->values = kore_calloc(count, sizeof(char *));
+		prep->lengths = kore_calloc(count, sizeof(int));
+		prep->formats = kore_calloc(count, sizeof(int));
+	}
+
+	for (i = 0; i < count; i++) {
+		if (formats != NULL)
+			prep->formats[i] = formats[i];
+		if (lengths != NULL)
+			prep->lengths[i] = lengths[i];
+
+		if (values[i] == NULL)
+			continue;
+
+		if (prep->formats[i]) {
+			prep->values[i] = kore_malloc(prep->lengths[i] + 1);
+			memcpy(prep->values[i], values[i], prep->lengths[i]);
+		} else {
+			prep->values[i] = kore_strdup(values[i]);
+		}
+	}
+
+	pgsql->prepare = prep;
+}
+
+static void
+pgsql_prepare_free(struct kore_pgsql *pgsql)
+{
+	int			i;
+	struct pgsql_prepare	*prep;
+
+	if ((prep = pgsql->prepare) == NULL)
+		return;
+
+	for (i = 0; i < prep->count; i++)
+		kore_free(prep->values[i]);
+
+	kore_free(prep->values);
+	kore_free(prep->lengths);
+	kore_free(prep->formats);
+	kore_free(prep);
+
+	pgsql->prepare = NULL;
+}
+
+static int
+pgsql_conn_prepared(struct pgsql_conn *conn, struct pgsql_statement *stmt)
+{
+	size_t		idx;
+
+	idx = stmt->id / 8;
+	if (idx >= conn->prepared_len)
+		return (0);
+
+	return (conn->prepared[idx] & (1 << (stmt->id % 8)));
+}
+
+static void
+pgsql_conn_set_prepared(struct pgsql_conn *conn, struct pgsql_statement *stmt)
+{
+	size_t		idx, len;
+
+	idx = stmt->id / 8;
+
+	if (idx >= conn->prepared_len) {
+		len = conn->pgsqldb->stmt_count / 8 + 1;
+		conn->prepared = kore_realloc(conn->prepared, len);
+		memset(conn->prepared + conn->prepared_len, 0,
+		    len - conn->prepared_len);
+		conn->prepared_len = len;
+	}
+
+	conn->prepared[idx] |= 1 << (stmt->id % 8);
+}
+
+static void
+pgsql_conn_check(void *unused, u_int64_t now)
+{
+	struct pgsql_db		*db;
+	struct pgsql_conn	*conn, *next;
+
+	LIST_FOREACH(db, &pgsql_db_conn_strings, rlist) {
+		for (conn = TAILQ_FIRST(&db->conn_free);
+		    conn != NULL; conn = next) {
+			next = TAILQ_NEXT(conn, list);
+
+			/*
+			 * Idle connections are not in the event loop, pick up
+			 * anything the server sent meanwhile (such as it going
+			 * away) without blocking.
+			 */
+			if (PQconsumeInput(conn->db) &&
+			    PQstatus(conn->db) == CONNECTION_OK)
+				continue;
+
+			kore_log(LOG_NOTICE, "pgsql: dropping idle %s: %s",
+			    db->name, PQerrorMessage(conn->db));
+			pgsql_conn_cleanup(conn);
+		}
+
+		pgsql_conn_fill(db);
+	}
+}
+
+static void
+pgsql_conn_fill(struct pgsql_db *db)
+{
+	struct kore_pgsql	pgsql;
+
+	while (db->conn_count < db->conn_min) {
+		kore_pgsql_init(&pgsql);
+
+		if (pgsql_conn_create(&pgsql, db) == NULL) {
+			kore_log(LOG_NOTICE, "pgsql: failed to connect %s: %s",
+			    db->name, pgsql.error ? pgsql.error : "unknown");
+			kore_free(pgsql.error);
+			break;
+		}
+	}
+}
+
+static void
+pgsql_single_row(struct kore_pgsql *pgsql)
+{
+#if PG_VERSION_NUM >= 90200
+	if (!(pgsql->flags & KORE_PGSQL_SINGLE_ROW))
+		return;
+
+	/* Not fatal, the rows then simply arrive as one result. */
+	if (!PQsetSingleRowMode(pgsql->conn->db))
+		kore_log(LOG_NOTICE, "pgsql: failed to enter single row mode");
+#endif
+}
+
+static void
+pgsql_conn_clear_prepared(struct pgsql_conn *conn,
+    struct pgsql_statement *stmt)
+{
+	size_t		idx;
+
+	idx = stmt->id / 8;
+	if (idx < conn->prepared_len)
+		conn->prepared[idx] &= ~(1 << (stmt->id % 8));
+}
+
+static void
+pgsql_pipeline_push(struct kore_pgsql *pgsql, struct pgsql_statement *stmt)
+{
+	pgsql->pipeline.queue = kore_realloc(pgsql->pipeline.queue,
+	    (pgsql->pipeline.length + 1) * sizeof(stmt));
+	pgsql->pipeline.queue[pgsql->pipeline.length++] = stmt;
+}
+
+static void
+pgsql_pipeline_end(struct kore_pgsql *pgsql)
+{
+	kore_free(pgsql->pipeline.queue);
+
+	pgsql->pipeline.queue = NULL;
+	pgsql->pipeline.length = 0;
+	pgsql->pipeline.next = 0;
+}
+
+static void
+pgsql_params_collect(int count, va_list args, const char ***values,
+    int **lengths, int **formats)
+{
+	int		i;
+
+	if (count <= 0) {
+		*values = NULL;
+		*lengths = NULL;
+		*formats = NULL;
+		return;
+	}
+
+	*lengths = kore_calloc(count, sizeof(int));
+	*formats = kore_calloc(count, sizeof(int));
+	*values = kore_calloc(count, sizeof(char *));
+
+	for (i = 0; i < count; i++) {
+		(*values)[i] = va_arg(args, void *);
+		(*lengths)[i] = va_arg(args, int);
+		(*formats)[i] = va_arg(args, int);
+	}
+}
+
+#if !defined(KORE_NO_HTTP)
+static int
+pgsql_stream_flush(struct kore_pgsql_stream *stream, int last)
+{
+	int			len;
+	struct netbuf		*nb;
+	struct connection	*c;
+	char			hdr[32];
+
+	c = stream->req->owner;
+
+	if (stream->buf->offset > 0) {
+		len = snprintf(hdr, sizeof(hdr), "%zx\r\n",
+		    stream->buf->offset);
+		if (len == -1 || (size_t)len >= sizeof(hdr))
+			fatal("%s: failed to create chunk header", __func__);
+
+		net_send_queue(c, hdr, len);
+		net_send_stream(c, stream->buf->data, stream->buf->offset,
+		    pgsql_stream_sent, &nb);
+		net_send_queue(c, "\r\n", 2);
+
+		nb->extra = stream;
+		stream->flags |= KORE_PGSQL_STREAM_INFLIGHT;
+
+		/* Fill the other buffer meanwhile. */
+		if (stream->buf == &stream->bufs[0])
+			stream->buf = &stream->bufs[1];
+		else
+			stream->buf = &stream->bufs[0];
+
+		kore_buf_reset(stream->buf);
+	}
+
+	if (last)
+		net_send_queue(c, "0\r\n\r\n", 5);
+
+	return (net_send_flush(c));
+}
+
+static int
+pgsql_stream_sent(struct netbuf *nb)
+{
+	struct kore_pgsql_stream	*stream;
+
+	stream = nb->extra;
+	stream->flags &= ~KORE_PGSQL_STREAM_INFLIGHT;
+
+	http_request_wakeup(stream->req);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+pgsql_stream_abort(struct kore_pgsql_stream *stream)
+{
+	/* Once the headers are out all we can do is cut it short. */
+	if (stream->flags & KORE_PGSQL_STREAM_CHUNKED)
+		return (KORE_RESULT_ERROR);
+
+	http_response(stream->req, HTTP_STATUS_INTERNAL_ERROR, NULL, 0);
+
+	return (KORE_RESULT_OK);
+}
+#endif
+
+static int
+pgsql_cache_start(struct kore_pgsql *pgsql, int kind, const char *text,
+    int binary, int count, const char **values, int *lengths, int *formats)
+{
+	int			i;
+	u_int8_t		fmt;
+	u_int32_t		len;
+	size_t			idx;
+	u_int64_t		hash;
+	struct pgsql_cache	*entry;
+
+	/* A previous result on this kore_pgsql may still be borrowed. */
+	pgsql_cache_release(pgsql);
+	pgsql->flags &= ~PGSQL_CACHE_SERVED;
+
+	if (pgsql->cache_ttl == 0 || pgsql_cache_size == 0 ||
+	    (pgsql->flags & (KORE_PGSQL_PIPELINE | KORE_PGSQL_SINGLE_ROW)))
+		return (0);
+
+	if (pgsql_cache_key == NULL)
+		pgsql_cache_key = kore_buf_alloc(512);
+
+	kore_buf_reset(pgsql_cache_key);
+	kore_buf_appendf(pgsql_cache_key, "%s%c%c%c%s%c",
+	    pgsql->conn->pgsqldb->name, 0, kind, binary + '0', text, 0);
+
+	for (i = 0; i < count; i++) {
+		fmt = (formats != NULL) ? formats[i] : 0;
+
+		if (values[i] == NULL)
+			len = UINT_MAX;
+		else if (fmt)
+			len = lengths[i];
+		else
+			len = strlen(values[i]);
+
+		kore_buf_append(pgsql_cache_key, &fmt, sizeof(fmt));
+		kore_buf_append(pgsql_cache_key, &len, sizeof(len));
+
+		if (values[i] != NULL)
+			kore_buf_append(pgsql_cache_key, values[i], len);
+	}
+
+	hash = 14695981039346656037ULL;
+	for (idx = 0; idx < pgsql_cache_key->offset; idx++) {
+		hash ^= pgsql_cache_key->data[idx];
+		hash *= 1099511628211ULL;
+	}
+
+	LIST_FOREACH(entry, &pgsql_cache_buckets[hash % PGSQL_CACHE_BUCKETS],
+	    hlist) {
+		if (entry->hash == hash &&
+		    entry->klen == pgsql_cache_key->offset &&
+		    !memcmp(entry->key, pgsql_cache_key->data, entry->klen))
+			break;
+	}
+
+	if (entry != NULL && entry->result != NULL &&
+	    entry->expires <= kore_time_ms()) {
+		pgsql_cache_evict(entry);
+		entry = NULL;
+	}
+
+	/* Miss, this kore_pgsql runs the query for everyone. */
+	if (entry == NULL) {
+		entry = kore_calloc(1, sizeof(*entry));
+		entry->hash = hash;
+		entry->db = pgsql->conn->pgsqldb;
+		entry->klen = pgsql_cache_key->offset;
+		entry->key = kore_malloc(entry->klen);
+		memcpy(entry->key, pgsql_cache_key->data, entry->klen);
+		LIST_INIT(&entry->waiters);
+		LIST_INSERT_HEAD(&pgsql_cache_buckets[hash % PGSQL_CACHE_BUCKETS],
+		    entry, hlist);
+
+		pgsql->cache = entry;
+		return (0);
+	}
+
+	pgsql->cache = entry;
+	pgsql->flags |= PGSQL_CACHE_SERVED;
+
+	if (entry->result != NULL) {
+		entry->refs++;
+		pgsql->result = entry->result;
+
+		TAILQ_REMOVE(&pgsql_cache_lru, entry, lru);
+		TAILQ_INSERT_TAIL(&pgsql_cache_lru, entry, lru);
+	} else {
+		LIST_INSERT_HEAD(&entry->waiters, pgsql, cache_list);
+	}
+
+	/* Sync users may run more queries on their connection. */
+	if (pgsql->flags & KORE_PGSQL_SYNC) {
+		pgsql->state = KORE_PGSQL_STATE_DONE;
+		return (1);
+	}
+
+	pgsql_conn_return(pgsql);
+
+	if (pgsql->result != NULL) {
+		pgsql->state = KORE_PGSQL_STATE_RESULT;
+	} else {
+		pgsql->state = KORE_PGSQL_STATE_WAIT;
+#if !defined(KORE_NO_HTTP)
+		if (pgsql->req != NULL)
+			http_request_sleep(pgsql->req);
+#endif
+	}
+
+	if (pgsql->cb != NULL)
+		pgsql->cb(pgsql, pgsql->arg);
+
+	return (1);
+}
+
+static void
+pgsql_cache_done(struct kore_pgsql *pgsql)
+{
+	int			r, c;
+	struct kore_pgsql	*waiter;
+	struct pgsql_cache	*entry, *old;
+
+	if ((entry = pgsql->cache) == NULL ||
+	    (pgsql->flags & PGSQL_CACHE_SERVED))
+		return;
+
+	pgsql->cache = NULL;
+
+	if (pgsql->result == NULL ||
+	    PQresultStatus(pgsql->result) != PGRES_TUPLES_OK) {
+		pgsql_cache_abandon(entry);
+		return;
+	}
+
+	entry->result = PQcopyResult(pgsql->result,
+	    PG_COPYRES_ATTRS | PG_COPYRES_TUPLES);
+	if (entry->result == NULL) {
+		pgsql_cache_abandon(entry);
+		return;
+	}
+
+	entry->size = sizeof(*entry) + entry->klen;
+	for (r = 0; r < PQntuples(entry->result); r++) {
+		for (c = 0; c < PQnfields(entry->result); c++)
+			entry->size += PQgetlength(entry->result, r, c) + 16;
+	}
+
+	entry->expires = kore_time_ms() + pgsql->cache_ttl;
+
+	while ((waiter = LIST_FIRST(&entry->waiters)) != NULL) {
+		LIST_REMOVE(waiter, cache_list);
+		entry->refs++;
+		waiter->result = entry->result;
+		waiter->state = KORE_PGSQL_STATE_RESULT;
+		pgsql_cache_wakeup(waiter);
+	}
+
+	/* Purged while in flight, serve the waiters but keep nothing. */
+	if (entry->flags & PGSQL_CACHE_EVICTED) {
+		if (entry->refs == 0)
+			pgsql_cache_free(entry);
+		return;
+	}
+
+	TAILQ_INSERT_TAIL(&pgsql_cache_lru, entry, lru);
+	pgsql_cache_bytes += entry->size;
+
+	while (pgsql_cache_bytes > pgsql_cache_size &&
+	    (old = TAILQ_FIRST(&pgsql_cache_lru)) != NULL)
+		pgsql_cache_evict(old);
+}
+
+static void
+pgsql_cache_release(struct kore_pgsql *pgsql)
+{
+	struct pgsql_cache	*entry;
+
+	if ((entry = pgsql->cache) == NULL)
+		return;
+
+	pgsql->cache = NULL;
+
+	if (!(pgsql->flags & PGSQL_CACHE_SERVED)) {
+		pgsql_cache_abandon(entry);
+		return;
+	}
+
+	if (entry->result == NULL) {
+		LIST_REMOVE(pgsql, cache_list);
+		return;
+	}
+
+	pgsql->result = NULL;
+	entry->refs--;
+
+	if (entry->refs == 0 && (entry->flags & PGSQL_CACHE_EVICTED))
+		pgsql_cache_free(entry);
+}
+
+/* The query for a pending entry failed, so do its waiters. */
+static void
+pgsql_cache_abandon(struct pgsql_cache *entry)
+{
+	struct kore_pgsql	*waiter;
+
+	while ((waiter = LIST_FIRST(&entry->waiters)) != NULL) {
+		LIST_REMOVE(waiter, cache_list);
+		waiter->cache = NULL;
+		pgsql_set_error(waiter, "coalesced query failed");
+		pgsql_cache_wakeup(waiter);
+	}
+
+	if (!(entry->flags & PGSQL_CACHE_EVICTED))
+		LIST_REMOVE(entry, hlist);
+
+	pgsql_cache_free(entry);
+}
+
+static void
+pgsql_cache_evict(struct pgsql_cache *entry)
+{
+	if (entry->flags & PGSQL_CACHE_EVICTED)
+		return;
+
+	entry->flags |= PGSQL_CACHE_EVICTED;
+	LIST_REMOVE(entry, hlist);
+
+	if (entry->result == NULL)
+		return;
+
+	TAILQ_REMOVE(&pgsql_cache_lru, entry, lru);
+	pgsql_cache_bytes -= entry->size;
+
+	if (entry->refs == 0)
+		pgsql_cache_free(entry);
+}
+
+static void
+pgsql_cache_free(struct pgsql_cache *entry)
+{
+	if (entry->result != NULL)
+		PQclear(entry->result);
+
+	kore_free(entry->key);
+	kore_free(entry);
+}
+
+static void
+pgsql_cache_wakeup(struct kore_pgsql *pgsql)
+{
+#if !defined(KORE_NO_HTTP)
+	if (pgsql->req != NULL)
+		http_request_wakeup(pgsql->req);
+#endif
+	if (pgsql->cb != NULL)
+		pgsql->cb(pgsql, pgsql->arg);
+}
+
+static void
+pgsql_cache_purge(const char *db)
+{
+	size_t			i;
+	struct pgsql_cache	*entry, *next;
+
+	for (i = 0; i < PGSQL_CACHE_BUCKETS; i++) {
+		for (entry = LIST_FIRST(&pgsql_cache_buckets[i]);
+		    entry != NULL; entry = next) {
+			next = LIST_NEXT(entry, hlist);
+			if (db == NULL || !strcmp(entry->db->name, db))
+				pgsql_cache_evict(entry);
+		}
+	}
+}
+
+static void
+pgsql_cache_purge_msg(struct kore_msg *msg, const void *data)
+{
+	char		db[128];
+
+	if (msg->length == 0) {
+		pgsql_cache_purge(NULL);
+		return;
+	}
+
+	if (msg->length >= sizeof(db))
+		return;
+
+	memcpy(db, data, msg->length);
+	db[msg->length] = '\0';
+
+	pgsql_cache_purge(db);
+}
+
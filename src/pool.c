@@ -30,10 +30,45 @@
 #if defined(KORE_USE_TASKS)
 static void		pool_lock(struct kore_pool *);
 static void		pool_unlock(struct kore_pool *);
+
+static struct kore_pool_magazine	*pool_magazine(struct kore_pool *);
+static void		pool_magazine_fill(struct kore_pool *,
+			    struct kore_pool_magazine *);
+static void		pool_magazine_flush(struct kore_pool *,
+			    struct kore_pool_magazine *, u_int32_t);
+
+/*
+ * With tasks enabled every thread gets its own magazine of free elements
+ * per pool, so the common case needs no atomics. Magazines are refilled
+ * from and flushed to the shared freelist in batches under the pool lock.
+ *
+ * Threads claim a magazine slot on first use. The main thread is always
+ * first and forked processes inherit its slot. Threads past the last slot
+ * use the shared freelist directly.
+ */
+static __thread int		pool_thread = -1;
+static volatile int		pool_threads = 0;
 #endif
 
+static void		pool_register(struct kore_pool *);
+static void		pool_unregister(struct kore_pool *);
+static void		*pool_hugepage_map(size_t);
 static void		pool_region_create(struct kore_pool *, size_t);
 static void		pool_region_destroy(struct kore_pool *);
+static void		pool_region_reclaim(struct kore_pool *, u_int64_t);
+
+/*
+ * All initialized pools so kore_pool_reclaim() can walk them. Workers
+ * inherit this from the parent and may re-initialize the same pools.
+ */
+static struct kore_pool		**pools = NULL;
+static size_t			pools_len = 0;
+
+/* Seconds a region must be entirely free before it is unmapped. */
+u_int32_t			kore_pool_idle_time = 0;
+
+/* Align regions of at least KORE_POOL_HUGEPAGE_SIZE for hugepages. */
+u_int8_t			kore_pool_hugepages = 0;
 
 void
 kore_pool_init(struct kore_pool *pool, const char *name,
@@ -50,8 +85,13 @@ kore_pool_init(struct kore_pool *pool, const char *name,
 	len = (len + (8 - 1)) & ~(8 - 1);
 
 	pool->lock = 0;
+	pool->hwm = 0;
 	pool->elms = 0;
 	pool->inuse = 0;
+	pool->allocs = 0;
+	pool->nregions = 0;
+	pool->stats_allocs = 0;
+	pool->stats_ms = 0;
 	pool->elen = len;
 	pool->growth = elm * 0.25f;
 	pool->slen = pool->elen + sizeof(struct kore_pool_entry);
@@ -59,6 +99,14 @@ kore_pool_init(struct kore_pool *pool, const char *name,
 	LIST_INIT(&(pool->regions));
 	LIST_INIT(&(pool->freelist));
 
+#if defined(KORE_USE_TASKS)
+	pool->magazines = calloc(KORE_POOL_MAGAZINES,
+	    sizeof(struct kore_pool_magazine));
+	if (pool->magazines == NULL)
+		fatal("kore_pool_init: calloc: %s", errno_s);
+#endif
+
+	pool_register(pool);
 	pool_region_create(pool, elm);
 }
 
@@ -74,16 +122,56 @@ kore_pool_cleanup(struct kore_pool *pool)
 	free(pool->name);
 	pool->name = NULL;
 
+#if defined(KORE_USE_TASKS)
+	free(pool->magazines);
+	pool->magazines = NULL;
+#endif
+
+	pool_unregister(pool);
 	pool_region_destroy(pool);
 }
 
+void
+kore_pool_reclaim(void *unused, u_int64_t now)
+{
+	size_t		i;
+
+	if (kore_pool_idle_time == 0)
+		return;
+
+	for (i = 0; i < pools_len; i++) {
+#if defined(KORE_USE_TASKS)
+		pool_lock(pools[i]);
+#endif
+		pool_region_reclaim(pools[i], now);
+#if defined(KORE_USE_TASKS)
+		pool_unlock(pools[i]);
+#endif
+	}
+}
+
 void *
 kore_pool_get(struct kore_pool *pool)
 {
 	u_int8_t			*ptr;
 	struct kore_pool_entry		*entry;
-
 #if defined(KORE_USE_TASKS)
+	struct kore_pool_magazine	*mag;
+
+	if ((mag = pool_magazine(pool)) != NULL) {
+		if (mag->count == 0)
+			pool_magazine_fill(pool, mag);
+
+		entry = mag->entries[--mag->count];
+		if (entry->state != POOL_ELEMENT_FREE)
+			fatal("%s: element %p was not free", pool->name, entry);
+
+		entry->state = POOL_ELEMENT_BUSY;
+		mag->allocs++;
+
+		return ((u_int8_t *)entry + sizeof(struct kore_pool_entry));
+	}
+
 	pool_lock(pool);
 #endif
 
@@ -95,10 +183,15 @@ kore_pool_get(struct kore_pool *pool)
 		fatal("%s: element %p was not free", pool->name, entry);
 	LIST_REMOVE(entry, list);
 
+	if (entry->region->inuse++ == 0)
+		entry->region->idle = 0;
+
 	entry->state = POOL_ELEMENT_BUSY;
 	ptr = (u_int8_t *)entry + sizeof(struct kore_pool_entry);
 
-	pool->inuse++;
+	pool->allocs++;
+	if (++pool->inuse > pool->hwm)
+		pool->hwm = pool->inuse;
 
 #if defined(KORE_USE_TASKS)
 	pool_unlock(pool);
@@ -111,9 +204,8 @@ void
 kore_pool_put(struct kore_pool *pool, void *ptr)
 {
 	struct kore_pool_entry		*entry;
-
 #if defined(KORE_USE_TASKS)
-	pool_lock(pool);
+	struct kore_pool_magazine	*mag;
 #endif
 
 	entry = (struct kore_pool_entry *)
@@ -123,8 +215,24 @@ kore_pool_put(struct kore_pool *pool, void *ptr)
 		fatal("%s: element %p was not busy", pool->name, ptr);
 
 	entry->state = POOL_ELEMENT_FREE;
+
+#if defined(KORE_USE_TASKS)
+	if ((mag = pool_magazine(pool)) != NULL) {
+		if (mag->count == KORE_POOL_MAGAZINE_SIZE) {
+			pool_magazine_flush(pool, mag,
+			    KORE_POOL_MAGAZINE_SIZE / 2);
+		}
+
+		mag->entries[mag->count++] = entry;
+		return;
+	}
+
+	pool_lock(pool);
+#endif
+
 	LIST_INSERT_HEAD(&(pool->freelist), entry, list);
 
+	entry->region->inuse--;
 	pool->inuse--;
 
 #if defined(KORE_USE_TASKS)
@@ -132,6 +240,132 @@ kore_pool_put(struct kore_pool *pool, void *ptr)
 #endif
 }
 
+/*
+ * Fill in up to max entries of out with the counters of all pools and
+ * return how many pools there are. The rate is in allocations per
+ * second since the previous call.
+ */
+size_t
+kore_pool_stats_get(struct kore_pool_stats *out, size_t max)
+{
+	size_t				i;
+	struct kore_pool		*pool;
+	struct kore_pool_stats		*st;
+	u_int64_t			now, elapsed;
+#if defined(KORE_USE_TASKS)
+	int				m;
+#endif
+
+	now = kore_time_ms();
+
+	for (i = 0; i < pools_len && i < max; i++) {
+		st = &out[i];
+		pool = pools[i];
+
+#if defined(KORE_USE_TASKS)
+		pool_lock(pool);
+#endif
+		(void)kore_strlcpy(st->name, pool->name, sizeof(st->name));
+		st->elen = pool->elen;
+		st->elms = pool->elms;
+		st->inuse = pool->inuse;
+		st->hwm = pool->hwm;
+		st->regions = pool->nregions;
+		st->allocs = pool->allocs;
+
+#if defined(KORE_USE_TASKS)
+		/* Magazine contents are free, even if accounted as in use. */
+		for (m = 0; m < KORE_POOL_MAGAZINES; m++) {
+			st->inuse -= pool->magazines[m].count;
+			st->allocs += pool->magazines[m].allocs;
+		}
+#endif
+
+		elapsed = now - pool->stats_ms;
+		if (pool->stats_ms != 0 && elapsed > 0) {
+			st->rate = ((st->allocs - pool->stats_allocs) * 1000) /
+			    elapsed;
+		} else {
+			st->rate = 0;
+		}
+
+		pool->stats_ms = now;
+		pool->stats_allocs = st->allocs;
+#if defined(KORE_USE_TASKS)
+		pool_unlock(pool);
+#endif
+	}
+
+	return (pools_len);
+}
+
+static void
+pool_register(struct kore_pool *pool)
+{
+	size_t			i;
+	struct kore_pool	**np;
+
+	for (i = 0; i < pools_len; i++) {
+		if (pools[i] == pool)
+			return;
+	}
+
+	if ((np = realloc(pools, (pools_len + 1) * sizeof(*np))) == NULL)
+		fatal("pool_register: realloc: %s", errno_s);
+
+	pools = np;
+	pools[pools_len++] = pool;
+}
+
+static void
+pool_unregister(struct kore_pool *pool)
+{
+	size_t		i;
+
+	for (i = 0; i < pools_len; i++) {
+		if (pools[i] == pool) {
+			pools[i] = pools[--pools_len];
+			break;
+		}
+	}
+}
+
+/*
+ * Map len bytes on a hugepage boundary by over-allocating and trimming
+ * the excess on both sides, transparent hugepages do the rest.
+ */
+static void *
+pool_hugepage_map(size_t len)
+{
+	u_int8_t	*map, *start;
+	size_t		head, tail;
+
+	if (SIZE_MAX - len < KORE_POOL_HUGEPAGE_SIZE)
+		fatal("pool_hugepage_map: overflow");
+
+	map = mmap(NULL, len + KORE_POOL_HUGEPAGE_SIZE,
+	    PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (map == MAP_FAILED)
+		fatal("mmap: %s", errno_s);
+
+	start = (u_int8_t *)(((uintptr_t)map + KORE_POOL_HUGEPAGE_SIZE - 1) &
+	    ~((uintptr_t)KORE_POOL_HUGEPAGE_SIZE - 1));
+
+	head = start - map;
+	tail = KORE_POOL_HUGEPAGE_SIZE - head;
+
+	if (head > 0)
+		(void)munmap(map, head);
+	if (tail > 0)
+		(void)munmap(start + len, tail);
+
+#if defined(MADV_HUGEPAGE)
+	(void)madvise(start, len, MADV_HUGEPAGE);
+#endif
+
+	return (start);
+}
+
 static void
 pool_region_create(struct kore_pool *pool, size_t elms)
 {
@@ -145,17 +379,32 @@ pool_region_create(struct kore_pool *pool, size_t elms)
 	if ((reg = calloc(1, sizeof(struct kore_pool_region))) == NULL)
 		fatal("pool_region_create: calloc: %s", errno_s);
 
+	/* The initial region is never reclaimed. */
+	if (LIST_EMPTY(&(pool->regions)))
+		reg->flags |= KORE_POOL_REGION_KEEP;
+
 	LIST_INSERT_HEAD(&(pool->regions), reg, list);
 
 	if (SIZE_MAX / elms < pool->slen)
 		fatal("pool_region_create: overflow");
 
 	reg->length = elms * pool->slen;
-	reg->start = mmap(NULL, reg->length, PROT_READ | PROT_WRITE,
-	    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	if (reg->start == MAP_FAILED)
-		fatal("mmap: %s", errno_s);
 
+	if (kore_pool_hugepages && reg->length >= KORE_POOL_HUGEPAGE_SIZE) {
+		reg->length = (reg->length + KORE_POOL_HUGEPAGE_SIZE - 1) &
+		    ~((size_t)KORE_POOL_HUGEPAGE_SIZE - 1);
+		elms = reg->length / pool->slen;
+		reg->start = pool_hugepage_map(reg->length);
+		reg->flags |= KORE_POOL_REGION_HUGEPAGE;
+	} else {
+		reg->start = mmap(NULL, reg->length, PROT_READ | PROT_WRITE,
+		    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (reg->start == MAP_FAILED)
+			fatal("mmap: %s", errno_s);
+	}
+
+	reg->elms = elms;
+	pool->nregions++;
 	p = (u_int8_t *)reg->start;
 
 	for (i = 0; i < elms; i++) {
@@ -188,9 +437,117 @@ pool_region_destroy(struct kore_pool *pool)
 	/* Freelist references into the regions memory allocations */
 	LIST_INIT(&pool->freelist);
 	pool->elms = 0;
+	pool->nregions = 0;
+}
+
+/*
+ * Unmap regions that have had none of their elements handed out for at
+ * least kore_pool_idle_time seconds. Elements sitting in a magazine are
+ * accounted as in use, so every element of an idle region is guaranteed
+ * to be on the shared freelist.
+ */
+static void
+pool_region_reclaim(struct kore_pool *pool, u_int64_t now)
+{
+	size_t				i;
+	u_int8_t			*p;
+	struct kore_pool_entry		*entry;
+	struct kore_pool_region		*reg, *next;
+
+	for (reg = LIST_FIRST(&pool->regions); reg != NULL; reg = next) {
+		next = LIST_NEXT(reg, list);
+
+		if (reg->inuse != 0 || (reg->flags & KORE_POOL_REGION_KEEP))
+			continue;
+
+		if (reg->idle == 0) {
+			reg->idle = now;
+			continue;
+		}
+
+		if (now - reg->idle < (u_int64_t)kore_pool_idle_time * 1000)
+			continue;
+
+		p = (u_int8_t *)reg->start;
+		for (i = 0; i < reg->elms; i++) {
+			entry = (struct kore_pool_entry *)p;
+			LIST_REMOVE(entry, list);
+			p = p + pool->slen;
+		}
+
+		kore_debug("%s: reclaimed region of %zu elements",
+		    pool->name, reg->elms);
+
+		pool->elms -= reg->elms;
+		pool->nregions--;
+
+		LIST_REMOVE(reg, list);
+		(void)munmap(reg->start, reg->length);
+		free(reg);
+	}
 }
 
 #if defined(KORE_USE_TASKS)
+static struct kore_pool_magazine *
+pool_magazine(struct kore_pool *pool)
+{
+	if (pool_thread == -1)
+		pool_thread = __sync_fetch_and_add(&pool_threads, 1);
+
+	if (pool_thread >= KORE_POOL_MAGAZINES)
+		return (NULL);
+
+	return (&pool->magazines[pool_thread]);
+}
+
+/*
+ * Elements sitting in a magazine count as in use as far as the shared
+ * freelist is concerned.
+ */
+static void
+pool_magazine_fill(struct kore_pool *pool, struct kore_pool_magazine *mag)
+{
+	struct kore_pool_entry		*entry;
+
+	pool_lock(pool);
+
+	if (LIST_EMPTY(&(pool->freelist)))
+		pool_region_create(pool, pool->growth);
+
+	while (mag->count < KORE_POOL_MAGAZINE_SIZE / 2) {
+		if ((entry = LIST_FIRST(&(pool->freelist))) == NULL)
+			break;
+
+		LIST_REMOVE(entry, list);
+		mag->entries[mag->count++] = entry;
+
+		if (entry->region->inuse++ == 0)
+			entry->region->idle = 0;
+		if (++pool->inuse > pool->hwm)
+			pool->hwm = pool->inuse;
+	}
+
+	pool_unlock(pool);
+}
+
+static void
+pool_magazine_flush(struct kore_pool *pool, struct kore_pool_magazine *mag,
+    u_int32_t cnt)
+{
+	struct kore_pool_entry		*entry;
+
+	pool_lock(pool);
+
+	while (cnt-- > 0 && mag->count > 0) {
+		entry = mag->entries[--mag->count];
+		LIST_INSERT_HEAD(&(pool->freelist), entry, list);
+		entry->region->inuse--;
+		pool->inuse--;
+	}
+
+	pool_unlock(pool);
+}
+
 static void
 pool_lock(struct kore_pool *pool)
 {
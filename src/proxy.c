@@ -0,0 +1,607 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * TCP proxying for servers configured with a proxy directive.
+ *
+ * Every accepted connection (after its TLS handshake, if any) is paired
+ * with a fresh connection to the upstream and bytes are shuffled
+ * between the two until either side goes away.
+ *
+ * Each direction buffers at most proxy_buffer bytes, once full we stop
+ * reading from its source until the destination drained some of it.
+ * On Linux a direction whose source is plaintext and whose destination
+ * is plaintext or kTLS moves its bytes with splice(2) through a pipe,
+ * they never enter userspace. Anything else is copied through a buffer
+ * using the connection its read and write callbacks.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <fcntl.h>
+#include <netdb.h>
+
+#include "kore.h"
+
+#if defined(__linux__)
+#include "seccomp.h"
+
+static struct sock_filter filter_proxy[] = {
+	KORE_SYSCALL_ALLOW(pipe2),
+	KORE_SYSCALL_ALLOW(splice),
+	KORE_SYSCALL_ALLOW(connect),
+	KORE_SYSCALL_ALLOW(shutdown),
+	KORE_SYSCALL_ALLOW(getsockopt),
+	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_INET),
+	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_INET6),
+};
+#endif
+
+struct proxy_session;
+
+struct proxy_dir {
+	struct proxy_session	*session;
+	struct connection	*src;
+	struct connection	*dst;
+
+	size_t			max;
+	size_t			pending;
+	int			eof;
+	int			shut;
+
+	/* splice(2) mode. */
+	int			pipe[2];
+
+	/* Copy mode, data sits between snb.s_off and rnb.s_off. */
+	u_int8_t		*buf;
+	struct netbuf		rnb;
+	struct netbuf		snb;
+};
+
+struct proxy_session {
+	int			busy;
+	int			connected;
+	struct kore_proxy	*proxy;
+	struct connection	*client;
+	struct connection	*upstream;
+
+	/* client -> upstream and upstream -> client. */
+	struct proxy_dir	up;
+	struct proxy_dir	down;
+};
+
+static int	proxy_handle(struct connection *);
+static void	proxy_disconnect(struct connection *);
+static void	proxy_session_free(struct proxy_session *);
+static int	proxy_connected(struct proxy_session *);
+static void	proxy_pump(struct proxy_session *);
+static void	proxy_forward(struct proxy_dir *);
+static int	proxy_dir_init(struct proxy_dir *);
+static int	proxy_dir_read(struct proxy_dir *);
+static int	proxy_dir_write(struct proxy_dir *);
+
+u_int32_t	proxy_buffer = 65536;
+u_int32_t	proxy_connect_timeout = 5;
+u_int32_t	proxy_idle_timeout = 60;
+
+int
+kore_proxy_configure(struct kore_server *srv, const char *host,
+    const char *port)
+{
+	int			r;
+	struct addrinfo		hints, *res;
+	struct kore_proxy	*px;
+	char			name[256];
+#if defined(__linux__)
+	static int		filter = 0;
+#endif
+
+	if (srv->proxy != NULL) {
+		kore_log(LOG_ERR, "server '%s' already has a proxy", srv->name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((r = getaddrinfo(host, port, &hints, &res)) != 0) {
+		kore_log(LOG_ERR, "proxy: getaddrinfo(%s): %s",
+		    host, gai_strerror(r));
+		return (KORE_RESULT_ERROR);
+	}
+
+	if ((res->ai_family != AF_INET && res->ai_family != AF_INET6) ||
+	    res->ai_addrlen > sizeof(px->addr)) {
+		kore_log(LOG_ERR, "proxy: unsupported address for %s", host);
+		freeaddrinfo(res);
+		return (KORE_RESULT_ERROR);
+	}
+
+	r = snprintf(name, sizeof(name), "%s:%s", host, port);
+	if (r == -1 || (size_t)r >= sizeof(name)) {
+		kore_log(LOG_ERR, "proxy: upstream name too long");
+		freeaddrinfo(res);
+		return (KORE_RESULT_ERROR);
+	}
+
+	px = kore_calloc(1, sizeof(*px));
+	px->name = kore_strdup(name);
+	px->family = res->ai_family;
+	px->addrlen = res->ai_addrlen;
+	memcpy(&px->addr, res->ai_addr, res->ai_addrlen);
+
+	freeaddrinfo(res);
+	srv->proxy = px;
+
+#if defined(__linux__)
+	if (filter == 0) {
+		kore_seccomp_filter("proxy",
+		    filter_proxy, KORE_FILTER_LEN(filter_proxy));
+		filter = 1;
+	}
+#endif
+
+	return (KORE_RESULT_OK);
+}
+
+void
+kore_proxy_free(struct kore_proxy *px)
+{
+	kore_free(px->name);
+	kore_free(px);
+}
+
+/*
+ * Called once the client connection is established, pairs it with a new
+ * connection towards the upstream of its server.
+ */
+void
+kore_proxy_start(struct connection *c)
+{
+	int			fd;
+	struct kore_proxy	*px;
+	struct proxy_session	*s;
+	struct connection	*up;
+
+	px = c->owner->server->proxy;
+
+	if ((fd = socket(px->family, SOCK_STREAM, 0)) == -1) {
+		kore_log(LOG_ERR, "proxy: socket: %s", errno_s);
+		kore_connection_disconnect(c);
+		return;
+	}
+
+	if (!kore_connection_nonblock(fd, 1) ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		close(fd);
+		kore_connection_disconnect(c);
+		return;
+	}
+
+	up = kore_connection_new(NULL);
+	up->fd = fd;
+	up->family = px->family;
+	memcpy(&up->addr, &px->addr, px->addrlen);
+
+	up->read = net_read;
+	up->write = net_write;
+	up->writev = net_writev;
+	up->state = CONN_STATE_ESTABLISHED;
+
+	TAILQ_INSERT_TAIL(&connections, up, list);
+	worker_active_connections++;
+
+	s = kore_calloc(1, sizeof(*s));
+	s->proxy = px;
+	s->client = c;
+	s->upstream = up;
+
+	s->up.session = s;
+	s->up.src = c;
+	s->up.dst = up;
+	s->up.pipe[0] = -1;
+	s->up.pipe[1] = -1;
+
+	s->down.session = s;
+	s->down.src = up;
+	s->down.dst = c;
+	s->down.pipe[0] = -1;
+	s->down.pipe[1] = -1;
+
+	c->proto = CONN_PROTO_PROXY;
+	c->hdlr_extra = s;
+	c->handle = proxy_handle;
+	c->disconnect = proxy_disconnect;
+	c->idle_timer.length = proxy_idle_timeout * 1000;
+
+	up->proto = CONN_PROTO_PROXY;
+	up->hdlr_extra = s;
+	up->handle = proxy_handle;
+	up->disconnect = proxy_disconnect;
+	up->idle_timer.length = proxy_connect_timeout * 1000;
+
+	if (!proxy_dir_init(&s->up) || !proxy_dir_init(&s->down)) {
+		kore_connection_disconnect(c);
+		return;
+	}
+
+	if (connect(fd, (struct sockaddr *)&px->addr, px->addrlen) == -1 &&
+	    errno != EINPROGRESS) {
+		kore_log(LOG_NOTICE, "proxy: connect to %s: %s",
+		    px->name, errno_s);
+		kore_connection_disconnect(c);
+		return;
+	}
+
+	kore_platform_event_all(up->fd, up);
+	kore_connection_start_idletimer(up);
+
+	/* The TLS handshake may have left data in the library buffers. */
+	c->evt.flags |= KORE_EVENT_READ;
+	proxy_pump(s);
+}
+
+static int
+proxy_handle(struct connection *c)
+{
+	struct proxy_session	*s = c->hdlr_extra;
+
+	if (s == NULL || c->state == CONN_STATE_DISCONNECTING)
+		return (KORE_RESULT_OK);
+
+	if (c == s->upstream && !s->connected) {
+		if (!(c->evt.flags & KORE_EVENT_WRITE))
+			return (KORE_RESULT_OK);
+		if (!proxy_connected(s))
+			return (KORE_RESULT_ERROR);
+	}
+
+	proxy_pump(s);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+proxy_connected(struct proxy_session *s)
+{
+	int		err;
+	socklen_t	len;
+
+	len = sizeof(err);
+	if (getsockopt(s->upstream->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		err = errno;
+
+	if (err != 0) {
+		kore_log(LOG_NOTICE, "proxy: connect to %s: %s",
+		    s->proxy->name, strerror(err));
+		return (KORE_RESULT_ERROR);
+	}
+
+	s->connected = 1;
+	s->upstream->idle_timer.length = proxy_idle_timeout * 1000;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Either side went away. Whatever it still had queued towards the other
+ * side is delivered before that one is disconnected as well.
+ */
+static void
+proxy_disconnect(struct connection *c)
+{
+	struct proxy_session	*s = c->hdlr_extra;
+	struct proxy_dir	*in, *out;
+
+	c->hdlr_extra = NULL;
+
+	if (c == s->client) {
+		s->client = NULL;
+		in = &s->down;
+		out = &s->up;
+	} else {
+		s->upstream = NULL;
+		in = &s->up;
+		out = &s->down;
+	}
+
+	in->dst = NULL;
+	in->pending = 0;
+	out->src = NULL;
+	out->eof = 1;
+
+	s->busy++;
+
+	if (s->connected)
+		proxy_forward(out);
+	else
+		out->pending = 0;
+
+	if (out->dst != NULL && out->pending == 0)
+		kore_connection_disconnect(out->dst);
+
+	s->busy--;
+
+	if (s->busy == 0 && s->client == NULL && s->upstream == NULL)
+		proxy_session_free(s);
+}
+
+static void
+proxy_session_free(struct proxy_session *s)
+{
+	struct proxy_dir	*d;
+	int			i;
+
+	for (i = 0; i < 2; i++) {
+		d = (i == 0) ? &s->up : &s->down;
+		if (d->pipe[0] != -1)
+			close(d->pipe[0]);
+		if (d->pipe[1] != -1)
+			close(d->pipe[1]);
+		kore_free(d->buf);
+	}
+
+	kore_free(s);
+}
+
+/*
+ * The session is only released once both connections are gone and no
+ * pump or disconnect callback is running for it, as disconnecting one
+ * side can drag the other along from deep within proxy_forward().
+ */
+static void
+proxy_pump(struct proxy_session *s)
+{
+	s->busy++;
+
+	proxy_forward(&s->up);
+	proxy_forward(&s->down);
+
+	/* Both directions are done, nothing left to proxy. */
+	if (s->up.shut && s->down.shut) {
+		if (s->client != NULL)
+			kore_connection_disconnect(s->client);
+		if (s->upstream != NULL)
+			kore_connection_disconnect(s->upstream);
+	}
+
+	if (s->client != NULL)
+		kore_connection_start_idletimer(s->client);
+	if (s->upstream != NULL && s->connected)
+		kore_connection_start_idletimer(s->upstream);
+
+	s->busy--;
+
+	if (s->busy == 0 && s->client == NULL && s->upstream == NULL)
+		proxy_session_free(s);
+}
+
+/*
+ * Move as much as possible from src to dst without having more than
+ * d->max bytes in flight. A source that reached its end of stream has
+ * its destination shut down for writing once everything was delivered.
+ */
+static void
+proxy_forward(struct proxy_dir *d)
+{
+	int			progress;
+	struct proxy_session	*s = d->session;
+
+	if (d->dst == NULL || d->shut)
+		return;
+
+	do {
+		progress = 0;
+
+		if (d->pending > 0 && s->connected &&
+		    (d->dst->evt.flags & KORE_EVENT_WRITE)) {
+			if (!proxy_dir_write(d)) {
+				kore_connection_disconnect(d->dst);
+				return;
+			}
+			if (d->dst->evt.flags & KORE_EVENT_WRITE)
+				progress = 1;
+		}
+
+		if (!d->eof && d->src != NULL && d->pending < d->max &&
+		    (d->src->evt.flags & KORE_EVENT_READ)) {
+			if (!proxy_dir_read(d)) {
+				kore_connection_disconnect(d->src);
+				return;
+			}
+			if (d->dst == NULL)
+				return;
+			if (!d->eof && (d->src->evt.flags & KORE_EVENT_READ))
+				progress = 1;
+		}
+	} while (progress);
+
+	if (!d->eof || d->pending != 0 || !s->connected)
+		return;
+
+	d->shut = 1;
+
+	if (d->dst->tls != NULL || d->src == NULL) {
+		kore_connection_disconnect(d->dst);
+		return;
+	}
+
+	(void)shutdown(d->dst->fd, SHUT_WR);
+}
+
+static int
+proxy_dir_init(struct proxy_dir *d)
+{
+#if defined(__linux__)
+	int		sz;
+#endif
+
+	d->max = proxy_buffer;
+
+#if defined(__linux__)
+	if (d->src->tls == NULL &&
+	    (d->dst->tls == NULL || (d->dst->flags & CONN_TLS_KTLS))) {
+		if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+			kore_log(LOG_ERR, "proxy: pipe2: %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+
+		/* The kernel may round up, or refuse larger pipes. */
+		(void)fcntl(d->pipe[1], F_SETPIPE_SZ, proxy_buffer);
+		if ((sz = fcntl(d->pipe[1], F_GETPIPE_SZ)) > 0)
+			d->max = MIN(d->max, (size_t)sz);
+		return (KORE_RESULT_OK);
+	}
+#endif
+
+	d->buf = kore_malloc(d->max);
+
+	d->rnb.buf = d->buf;
+	d->rnb.b_len = d->max;
+	d->rnb.type = NETBUF_RECV;
+
+	d->snb.buf = d->buf;
+	d->snb.type = NETBUF_SEND;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+proxy_dir_read(struct proxy_dir *d)
+{
+	size_t			r;
+	ssize_t			n;
+	struct connection	*src = d->src;
+
+#if defined(__linux__)
+	if (d->pipe[1] != -1) {
+		n = splice(src->fd, NULL, d->pipe[1], NULL, d->max - d->pending,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n == -1) {
+			if (errno == EINTR)
+				return (KORE_RESULT_OK);
+			if (errno == EAGAIN) {
+				src->evt.flags &= ~KORE_EVENT_READ;
+				return (KORE_RESULT_OK);
+			}
+			kore_debug("proxy: splice: %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (n == 0)
+			d->eof = 1;
+
+		d->pending += n;
+		return (KORE_RESULT_OK);
+	}
+#endif
+
+	/* Reclaim the space of what was already sent. */
+	if (d->snb.s_off > 0) {
+		memmove(d->buf, d->buf + d->snb.s_off, d->pending);
+		d->rnb.s_off = d->pending;
+		d->snb.s_off = 0;
+	}
+
+	/* Plaintext is read here as net_read() disconnects on EOF. */
+	if (src->tls == NULL) {
+		n = recv(src->fd, d->buf + d->rnb.s_off,
+		    d->max - d->pending, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				return (KORE_RESULT_OK);
+			if (errno == EAGAIN) {
+				src->evt.flags &= ~KORE_EVENT_READ;
+				return (KORE_RESULT_OK);
+			}
+			kore_debug("proxy: recv: %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (n == 0)
+			d->eof = 1;
+
+		d->rnb.s_off += n;
+		d->pending += n;
+		return (KORE_RESULT_OK);
+	}
+
+	r = 0;
+	src->rnb = &d->rnb;
+
+	if (!src->read(src, &r)) {
+		src->rnb = NULL;
+		return (KORE_RESULT_ERROR);
+	}
+
+	src->rnb = NULL;
+
+	d->rnb.s_off += r;
+	d->pending += r;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+proxy_dir_write(struct proxy_dir *d)
+{
+	size_t			w;
+	struct connection	*dst = d->dst;
+#if defined(__linux__)
+	ssize_t			n;
+
+	if (d->pipe[0] != -1) {
+		n = splice(d->pipe[0], NULL, dst->fd, NULL, d->pending,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n == -1) {
+			if (errno == EINTR)
+				return (KORE_RESULT_OK);
+			if (errno == EAGAIN) {
+				dst->evt.flags &= ~KORE_EVENT_WRITE;
+				return (KORE_RESULT_OK);
+			}
+			kore_debug("proxy: splice: %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+
+		d->pending -= n;
+		return (KORE_RESULT_OK);
+	}
+#endif
+
+	w = 0;
+	dst->snb = &d->snb;
+
+	if (!dst->write(dst, d->pending, &w)) {
+		dst->snb = NULL;
+		return (KORE_RESULT_ERROR);
+	}
+
+	dst->snb = NULL;
+
+	d->snb.s_off += w;
+	d->pending -= w;
+
+	if (d->pending == 0) {
+		d->snb.s_off = 0;
+		d->rnb.s_off = 0;
+	}
+
+	return (KORE_RESULT_OK);
+}
@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/un.h>
 
 #include <ctype.h>
@@ -55,6 +56,13 @@
 
 #include <frameobject.h>
 
+#if PY_VERSION_HEX < 0x03090000
+#define PyObject_Vectorcall	_PyObject_Vectorcall
+#endif
+
+/* Number of released http_request objects kept around for reuse. */
+#define PYHTTP_REQUEST_FREELIST		64
+
 struct reqcall {
 	PyObject		*f;
 	TAILQ_ENTRY(reqcall)	list;
@@ -76,6 +84,8 @@ static int		python_bool_from_dict(PyObject *, const char *, int *);
 static int		python_long_from_dict(PyObject *, const char *, long *);
 
 static int		pyhttp_response_sent(struct netbuf *);
+static int		pyhttp_response_collect(struct http_request *, int,
+			    PyObject *);
 static PyObject		*pyhttp_file_alloc(struct http_file *);
 static PyObject		*pyhttp_request_alloc(const struct http_request *);
 
@@ -90,13 +100,18 @@ static int		python_route_methods(PyObject *, PyObject *,
 			    struct kore_route *);
 static int		python_route_auth(PyObject *, struct kore_route *);
 static int		python_route_hooks(PyObject *, struct kore_route *);
+static int		python_route_ratelimit(PyObject *, struct kore_route *);
+static int		python_route_cache(PyObject *, struct kore_route *);
 static int		python_route_hook_set(PyObject *, const char *,
 			    struct kore_runtime_call **);
 
 static int		python_coro_run(struct python_coro *);
 static void		python_coro_wakeup(struct python_coro *);
 static void		python_coro_suspend(struct python_coro *);
-static void		python_coro_trace(const char *, struct python_coro *);
+static void		python_coro_trace(u_int32_t, struct python_coro *,
+			    u_int32_t);
+static u_int32_t	python_coro_slice(struct python_coro *, u_int64_t);
+static void		python_coro_prio(struct python_coro *, int);
 
 static void		pysocket_evt_handle(void *, int);
 static void		pysocket_op_timeout(void *, u_int64_t);
@@ -130,11 +145,19 @@ static int		pyconnection_x509_cb(void *, int, int, const char *,
 static int		pykore_pgsql_result(struct pykore_pgsql *);
 static void		pykore_pgsql_callback(struct kore_pgsql *, void *);
 static int		pykore_pgsql_params(struct pykore_pgsql *, PyObject *);
-static int		pykore_pgsql_params(struct pykore_pgsql *, PyObject *);
+static PyObject		*pykore_pgsql_stream_next(struct pykore_pgsql *);
+
+static PyObject		*pykore_pgsql_result_alloc(struct kore_pgsql *);
+static PyObject		*pykore_pgsql_result_field(
+			    struct pykore_pgsql_result *, int, int);
+static int		pykore_pgsql_result_index(
+			    struct pykore_pgsql_result *, PyObject *);
 #endif
 
 #if defined(KORE_USE_CURL)
 static void		python_curl_http_callback(struct kore_curl *, void *);
+static int		python_curl_stream_callback(struct kore_curl *,
+			    const void *, size_t, void *);
 static void		python_curl_handle_callback(struct kore_curl *, void *);
 static PyObject		*pyhttp_client_request(struct pyhttp_client *, int,
 			    PyObject *);
@@ -150,6 +173,9 @@ static void	python_push_type(const char *, PyObject *, PyTypeObject *);
 
 static int	python_validator_check(PyObject *);
 static int	python_runtime_http_request(void *, struct http_request *);
+#if defined(KORE_USE_TASKS)
+static int	python_runtime_http_offloaded(void *, struct http_request *);
+#endif
 static void	python_runtime_http_request_free(void *, struct http_request *);
 static void	python_runtime_http_body_chunk(void *, struct http_request *,
 		    const void *, size_t);
@@ -210,8 +236,10 @@ static struct {
 	{ "MODULE_UNLOAD", KORE_MODULE_UNLOAD },
 	{ "TIMER_ONESHOT", KORE_TIMER_ONESHOT },
 	{ "CONN_PROTO_HTTP", CONN_PROTO_HTTP },
+	{ "CONN_PROTO_HTTP2", CONN_PROTO_HTTP2 },
 	{ "CONN_PROTO_UNKNOWN", CONN_PROTO_UNKNOWN },
 	{ "CONN_PROTO_WEBSOCKET", CONN_PROTO_WEBSOCKET },
+	{ "CONN_PROTO_SSE", CONN_PROTO_SSE },
 	{ "CONN_STATE_ESTABLISHED", CONN_STATE_ESTABLISHED },
 	{ "HTTP_METHOD_GET", HTTP_METHOD_GET },
 	{ "HTTP_METHOD_PUT", HTTP_METHOD_PUT },
@@ -224,6 +252,8 @@ static struct {
 	{ "WEBSOCKET_OP_BINARY", WEBSOCKET_OP_BINARY },
 	{ "WEBSOCKET_BROADCAST_LOCAL", WEBSOCKET_BROADCAST_LOCAL },
 	{ "WEBSOCKET_BROADCAST_GLOBAL", WEBSOCKET_BROADCAST_GLOBAL },
+	{ "SSE_PUBLISH_LOCAL", SSE_PUBLISH_LOCAL },
+	{ "SSE_PUBLISH_GLOBAL", SSE_PUBLISH_GLOBAL },
 	{ NULL, -1 }
 };
 
@@ -297,9 +327,24 @@ static struct kore_pool			gather_result_pool;
 static u_int64_t			coro_id;
 static int				coro_count;
 static int				coro_tracing;
-static struct coro_list			coro_runnable;
+static int				coro_runnable_count;
+static u_int64_t			coro_budget_hits;
+static u_int64_t			coro_trace_seq;
+static struct python_coro_event		*coro_trace = NULL;
+static int				coro_queued[CORO_PRIO_MAX];
+static struct coro_list			coro_runnable[CORO_PRIO_MAX];
 static struct coro_list			coro_suspended;
 
+static const char *coro_trace_names[] = {
+	"unknown",
+	"created",
+	"running",
+	"suspended",
+	"wokeup",
+	"deleted",
+	"killed",
+};
+
 extern const char *__progname;
 
 static PyObject		*pickle = NULL;
@@ -311,26 +356,55 @@ static PyObject		*python_tracer = NULL;
 /* XXX */
 static struct python_coro		*coro_running = NULL;
 
+/*
+ * Set once a route is offloaded, the worker then lets go of the GIL
+ * while it waits for events so the task threads can run Python.
+ */
+static int				python_gil_release = 0;
+static PyThreadState			*python_gil_state = NULL;
+
+static int				pyhttp_request_freecnt = 0;
+static struct pyhttp_request
+			*pyhttp_request_freelist[PYHTTP_REQUEST_FREELIST];
+
+static PyObject				*pyhttp_proto_http = NULL;
+static PyObject				*pyhttp_proto_https = NULL;
+
 #if !defined(KORE_SINGLE_BINARY)
 const char	*kore_pymodule = NULL;
 #endif
 
+/* Per event loop iteration limits for running coroutines, 0 is none. */
+u_int32_t	kore_python_coro_budget = 256;
+u_int32_t	kore_python_coro_budget_time = 5000;
+
+/* Move the objects of the parent out of reach of the GC before forking. */
+int		kore_python_gc_freeze = 1;
+
 void
 kore_python_init(void)
 {
+	int				i;
 	struct kore_runtime_call	*rcall;
 
 	coro_id = 0;
 	coro_count = 0;
 	coro_tracing = 0;
+	coro_trace_seq = 0;
+	coro_budget_hits = 0;
+	coro_runnable_count = 0;
 
 	TAILQ_INIT(&prereq);
 
 	TAILQ_INIT(&procs);
 	TAILQ_INIT(&routes);
-	TAILQ_INIT(&coro_runnable);
 	TAILQ_INIT(&coro_suspended);
 
+	for (i = 0; i < CORO_PRIO_MAX; i++) {
+		coro_queued[i] = 0;
+		TAILQ_INIT(&coro_runnable[i]);
+	}
+
 	kore_pool_init(&coro_pool, "coropool", sizeof(struct python_coro), 100);
 
 	kore_pool_init(&iterobj_pool, "iterobj_pool",
@@ -391,11 +465,65 @@ void
 kore_python_cleanup(void)
 {
 	if (Py_IsInitialized()) {
+		while (pyhttp_request_freecnt > 0) {
+			PyObject_Del((PyObject *)
+			    pyhttp_request_freelist[--pyhttp_request_freecnt]);
+		}
+
+		Py_CLEAR(pyhttp_proto_http);
+		Py_CLEAR(pyhttp_proto_https);
+
 		PyErr_Clear();
 		Py_Finalize();
 	}
 }
 
+/*
+ * Called in the parent once the application is imported and configured,
+ * right before the workers are forked off. The workers start out sharing
+ * every page of the parent interpreter copy-on-write, but a collection
+ * in a worker walks and writes to the GC header of all those objects and
+ * ends up copying most of them. Collect the garbage once and freeze what
+ * remains so the workers' collector leaves it alone.
+ */
+void
+kore_python_fork_prepare(void)
+{
+	Py_ssize_t	count;
+	PyObject	*gc, *ret;
+
+	if (!kore_python_gc_freeze)
+		return;
+
+	if ((gc = PyImport_ImportModule("gc")) == NULL) {
+		kore_python_log_error("gc");
+		return;
+	}
+
+	if ((ret = PyObject_CallMethod(gc, "collect", NULL)) == NULL)
+		goto out;
+	Py_DECREF(ret);
+
+	if ((ret = PyObject_CallMethod(gc, "freeze", NULL)) == NULL)
+		goto out;
+	Py_DECREF(ret);
+
+	if ((ret = PyObject_CallMethod(gc, "get_freeze_count", NULL)) == NULL)
+		goto out;
+
+	count = PyLong_AsSsize_t(ret);
+	Py_DECREF(ret);
+
+	kore_log(LOG_INFO, "python: froze %zd objects shared with workers",
+	    count);
+
+out:
+	if (PyErr_Occurred())
+		kore_python_log_error("gc");
+
+	Py_DECREF(gc);
+}
+
 void
 kore_python_path(const char *path)
 {
@@ -407,11 +535,59 @@ kore_python_coro_run(void)
 {
 	struct pygather_op	*op;
 	struct python_coro	*coro;
+	u_int64_t		deadline;
+	u_int32_t		steps, tasks;
+	int			prio, batch[CORO_PRIO_MAX];
+
+	/*
+	 * Only run what was runnable when we got here, anything woken up
+	 * along the way waits for the next iteration of the event loop
+	 * so that network I/O gets a look in between batches.
+	 */
+	for (prio = 0; prio < CORO_PRIO_MAX; prio++)
+		batch[prio] = coro_queued[prio];
+
+	deadline = 0;
+	if (kore_python_coro_budget_time != 0)
+		deadline = kore_time_us() + kore_python_coro_budget_time;
+
+	steps = 0;
+	tasks = 0;
+
+	for (;;) {
+		if (batch[CORO_PRIO_TASK] > 0 &&
+		    (batch[CORO_PRIO_REQUEST] == 0 ||
+		    (tasks + 1) * CORO_TASK_SHARE <= steps + 1))
+			prio = CORO_PRIO_TASK;
+		else if (batch[CORO_PRIO_REQUEST] > 0)
+			prio = CORO_PRIO_REQUEST;
+		else
+			break;
+
+		if ((coro = TAILQ_FIRST(&coro_runnable[prio])) == NULL) {
+			batch[prio] = 0;
+			continue;
+		}
+
+		if (kore_python_coro_budget != 0 &&
+		    steps >= kore_python_coro_budget) {
+			coro_budget_hits++;
+			break;
+		}
+
+		if (deadline != 0 && steps > 0 && kore_time_us() >= deadline) {
+			coro_budget_hits++;
+			break;
+		}
 
-	while ((coro = TAILQ_FIRST(&coro_runnable)) != NULL) {
 		if (coro->state != CORO_STATE_RUNNABLE)
 			fatal("non-runnable coro on coro_runnable");
 
+		steps++;
+		batch[prio]--;
+		if (prio == CORO_PRIO_TASK)
+			tasks++;
+
 		if (python_coro_run(coro) == KORE_RESULT_OK) {
 			if (coro->gatherop != NULL) {
 				op = coro->gatherop;
@@ -426,6 +602,15 @@ kore_python_coro_run(void)
 		}
 	}
 
+#if defined(KORE_USE_CURL)
+	/*
+	 * If a coroutine fired off or resumed a curl instance, immediately
+	 * let it make progress. This goes first as it may wake up requests
+	 * that would otherwise sit until the next tick of the event loop.
+	 */
+	kore_curl_do_timeout();
+#endif
+
 	/*
 	 * Let Kore do HTTP processing so awoken coroutines run asap without
 	 * having to wait for a tick from the event loop.
@@ -434,14 +619,6 @@ kore_python_coro_run(void)
 	 * to HTTP requests was awoken and only run if true?
 	 */
 	http_process();
-
-#if defined(KORE_USE_CURL)
-	/*
-	 * If a coroutine fired off a curl instance, immediately
-	 * let it make progress.
-	 */
-	kore_curl_do_timeout();
-#endif
 }
 
 void
@@ -452,7 +629,8 @@ kore_python_coro_delete(void *obj)
 	coro = obj;
 	coro_count--;
 
-	python_coro_trace(coro->killed ? "killed" : "deleted", coro);
+	python_coro_trace(coro->killed ? CORO_TRACE_KILL : CORO_TRACE_DELETE,
+	    coro, 0);
 
 	coro_running = coro;
 
@@ -466,10 +644,13 @@ kore_python_coro_delete(void *obj)
 	Py_DECREF(coro->obj);
 	coro_running = NULL;
 
-	if (coro->state == CORO_STATE_RUNNABLE)
-		TAILQ_REMOVE(&coro_runnable, coro, list);
-	else
+	if (coro->state == CORO_STATE_RUNNABLE) {
+		coro_runnable_count--;
+		coro_queued[coro->prio]--;
+		TAILQ_REMOVE(&coro_runnable[coro->prio], coro, list);
+	} else {
 		TAILQ_REMOVE(&coro_suspended, coro, list);
+	}
 
 	kore_free(coro->name);
 	Py_XDECREF(coro->result);
@@ -480,13 +661,99 @@ kore_python_coro_delete(void *obj)
 int
 kore_python_coro_pending(void)
 {
-	return (!TAILQ_EMPTY(&coro_runnable));
+	return (coro_runnable_count > 0);
+}
+
+int
+kore_python_coro_count(void)
+{
+	return (coro_count);
+}
+
+int
+kore_python_coro_runnable(void)
+{
+	return (coro_runnable_count);
+}
+
+int
+kore_python_coro_runnable_tasks(void)
+{
+	return (coro_queued[CORO_PRIO_TASK]);
+}
+
+u_int64_t
+kore_python_coro_budget_hits(void)
+{
+	return (coro_budget_hits);
+}
+
+/* How long the longest waiting runnable coroutine has been queued. */
+u_int64_t
+kore_python_coro_runnable_age(void)
+{
+	int			prio;
+	struct python_coro	*coro;
+	u_int64_t		now, age;
+
+	age = 0;
+	now = kore_time_us();
+
+	for (prio = 0; prio < CORO_PRIO_MAX; prio++) {
+		coro = TAILQ_FIRST(&coro_runnable[prio]);
+		if (coro == NULL || coro->queued == 0 || coro->queued > now)
+			continue;
+		age = MAX(age, now - coro->queued);
+	}
+
+	return (age);
+}
+
+/* Coroutines are suspended at the tail, the oldest is at the head. */
+u_int64_t
+kore_python_coro_suspended_age(void)
+{
+	struct python_coro	*coro;
+
+	coro = TAILQ_FIRST(&coro_suspended);
+	if (coro == NULL || coro->suspended == 0)
+		return (0);
+
+	return (kore_time_us() - coro->suspended);
+}
+
+void
+kore_python_coro_trace_dump(void)
+{
+	u_int64_t			seq;
+	struct python_coro_event	*ev;
+
+	if (coro_trace == NULL)
+		return;
+
+	seq = 0;
+	if (coro_trace_seq > CORO_TRACE_RING)
+		seq = coro_trace_seq - CORO_TRACE_RING;
+
+	kore_log(LOG_NOTICE, "coroutine trace, %" PRIu64 " events",
+	    coro_trace_seq - seq);
+
+	for (; seq < coro_trace_seq; seq++) {
+		ev = &coro_trace[seq & (CORO_TRACE_RING - 1)];
+		kore_log(LOG_NOTICE, "%" PRIu64 " coro %" PRIu64 " %s %u",
+		    ev->ts, ev->id, coro_trace_names[ev->type], ev->arg);
+	}
 }
 
 void
 kore_python_routes_resolve(void)
 {
 	struct pyroute		*route;
+#if defined(KORE_USE_TASKS)
+	struct kore_server	*srv;
+	struct kore_domain	*dom;
+	struct kore_route	*rt;
+#endif
 
 	while ((route = TAILQ_FIRST(&routes)) != NULL) {
 		TAILQ_REMOVE(&routes, route, list);
@@ -494,6 +761,35 @@ kore_python_routes_resolve(void)
 			fatalx("failed to install route for %s", route->path);
 		Py_DECREF((PyObject *)route);
 	}
+
+#if defined(KORE_USE_TASKS)
+	/* Covers offloaded routes from the decorator and from kore.conf. */
+	LIST_FOREACH(srv, &kore_servers, list) {
+		TAILQ_FOREACH(dom, &srv->domains, list) {
+			TAILQ_FOREACH(rt, &dom->routes, list) {
+				if (rt->offload && rt->rcall != NULL &&
+				    rt->rcall->runtime == &kore_python_runtime)
+					python_gil_release = 1;
+			}
+		}
+	}
+#endif
+}
+
+void
+kore_python_gil_release(void)
+{
+	if (python_gil_release && python_gil_state == NULL)
+		python_gil_state = PyEval_SaveThread();
+}
+
+void
+kore_python_gil_acquire(void)
+{
+	if (python_gil_state != NULL) {
+		PyEval_RestoreThread(python_gil_state);
+		python_gil_state = NULL;
+	}
 }
 
 void
@@ -1058,16 +1354,25 @@ python_coro_create(PyObject *obj, struct http_request *req)
 
 	coro->obj = obj;
 	coro->killed = 0;
+	coro->queued = 0;
+	coro->started = 0;
+	coro->suspended = 0;
 	coro->request = req;
 	coro->id = coro_id++;
 	coro->state = CORO_STATE_RUNNABLE;
+	coro->prio = req != NULL ? CORO_PRIO_REQUEST : CORO_PRIO_TASK;
+
+	if (coro_tracing || kore_metrics_enabled)
+		coro->queued = kore_time_us();
 
-	TAILQ_INSERT_TAIL(&coro_runnable, coro, list);
+	coro_runnable_count++;
+	coro_queued[coro->prio]++;
+	TAILQ_INSERT_TAIL(&coro_runnable[coro->prio], coro, list);
 
 	if (coro->request != NULL)
 		http_request_sleep(coro->request);
 
-	python_coro_trace("created", coro);
+	python_coro_trace(CORO_TRACE_CREATE, coro, coro_runnable_count);
 
 	return (coro);
 }
@@ -1083,9 +1388,12 @@ python_coro_run(struct python_coro *coro)
 
 	coro_running = coro;
 
-	for (;;) {
-		python_coro_trace("running", coro);
+	if (coro_tracing || kore_metrics_enabled)
+		coro->started = kore_time_us();
+
+	python_coro_trace(CORO_TRACE_RUN, coro, coro_runnable_count);
 
+	for (;;) {
 		PyErr_Clear();
 #if PY_VERSION_HEX < 0x030a00a1
 		item = _PyGen_Send((PyGenObject *)coro->obj, NULL);
@@ -1100,7 +1408,11 @@ python_coro_run(struct python_coro *coro)
 				PyErr_Fetch(&type, &coro->result, &traceback);
 				Py_DECREF(type);
 				Py_XDECREF(traceback);
-			} else {
+			} else if (PyErr_Occurred()) {
+				/*
+				 * PyIter_Send() sets no exception at all for
+				 * a coroutine that returned None.
+				 */
 				kore_python_log_error("coroutine");
 
 				if (coro->request != NULL) {
@@ -1110,6 +1422,9 @@ python_coro_run(struct python_coro *coro)
 				}
 			}
 
+			if (coro->started != 0)
+				(void)python_coro_slice(coro, kore_time_us());
+
 			coro_running = NULL;
 			return (KORE_RESULT_OK);
 		}
@@ -1134,68 +1449,107 @@ python_coro_run(struct python_coro *coro)
 static void
 python_coro_wakeup(struct python_coro *coro)
 {
+	u_int64_t	wait;
+
 	if (coro->state != CORO_STATE_SUSPENDED)
 		return;
 
 	coro->state = CORO_STATE_RUNNABLE;
 	TAILQ_REMOVE(&coro_suspended, coro, list);
-	TAILQ_INSERT_TAIL(&coro_runnable, coro, list);
+	TAILQ_INSERT_TAIL(&coro_runnable[coro->prio], coro, list);
+	coro_queued[coro->prio]++;
+	coro_runnable_count++;
 
-	python_coro_trace("wokeup", coro);
+	wait = 0;
+	if (coro->suspended != 0) {
+		coro->queued = kore_time_us();
+		wait = coro->queued - coro->suspended;
+		coro->suspended = 0;
+
+		if (kore_metrics_enabled && worker != NULL)
+			kore_histogram_add(&worker->metrics.coro_waits, wait);
+	}
+
+	python_coro_trace(CORO_TRACE_WAKEUP, coro, MIN(wait, UINT32_MAX));
 }
 
 static void
 python_coro_suspend(struct python_coro *coro)
 {
+	u_int64_t	now;
+	u_int32_t	slice;
+
 	if (coro->state != CORO_STATE_RUNNABLE)
 		return;
 
 	coro->state = CORO_STATE_SUSPENDED;
-	TAILQ_REMOVE(&coro_runnable, coro, list);
+	TAILQ_REMOVE(&coro_runnable[coro->prio], coro, list);
 	TAILQ_INSERT_TAIL(&coro_suspended, coro, list);
+	coro_queued[coro->prio]--;
+	coro_runnable_count--;
+
+	slice = 0;
+	coro->suspended = 0;
+
+	if (coro_tracing || kore_metrics_enabled) {
+		now = kore_time_us();
+		coro->suspended = now;
+		if (coro->started != 0)
+			slice = python_coro_slice(coro, now);
+	}
 
-	python_coro_trace("suspended", coro);
+	python_coro_trace(CORO_TRACE_SUSPEND, coro, slice);
 }
 
 static void
-python_coro_trace(const char *label, struct python_coro *coro)
+python_coro_prio(struct python_coro *coro, int prio)
 {
-	int			line;
-	PyGenObject		*gen;
-	PyCodeObject		*code;
-	const char		*func, *fname, *file;
-
-	if (coro_tracing == 0)
+	if (coro->prio == prio)
 		return;
 
-	gen = (PyGenObject *)coro->obj;
+	if (coro->state == CORO_STATE_RUNNABLE) {
+		TAILQ_REMOVE(&coro_runnable[coro->prio], coro, list);
+		coro_queued[coro->prio]--;
+		TAILQ_INSERT_TAIL(&coro_runnable[prio], coro, list);
+		coro_queued[prio]++;
+	}
+
+	coro->prio = prio;
+}
 
-	if (gen->gi_frame != NULL && gen->gi_frame->f_code != NULL) {
-		code = gen->gi_frame->f_code;
-		func = PyUnicode_AsUTF8AndSize(code->co_name, NULL);
-		file = PyUnicode_AsUTF8AndSize(code->co_filename, NULL);
+/* End the current run slice of a coroutine and account for it. */
+static u_int32_t
+python_coro_slice(struct python_coro *coro, u_int64_t now)
+{
+	u_int64_t	slice;
 
-		if ((fname = strrchr(file, '/')) == NULL)
-			fname = file;
-		else
-			fname++;
-	} else {
-		func = "unknown";
-		fname = "unknown";
-	}
+	slice = now - coro->started;
+	coro->started = 0;
 
-	if (gen->gi_frame != NULL)
-		line = PyFrame_GetLineNumber(gen->gi_frame);
-	else
-		line = -1;
+	if (kore_metrics_enabled && worker != NULL)
+		kore_histogram_add(&worker->metrics.coro_slices, slice);
 
-	if (coro->name) {
-		kore_log(LOG_NOTICE, "coro '%s' %s <%s> @ [%s:%d]",
-		    coro->name, label, func, fname, line);
-	} else {
-		kore_log(LOG_NOTICE, "coro %" PRIu64 " %s <%s> @ [%s:%d]",
-		    coro->id, label, func, fname, line);
-	}
+	return (MIN(slice, UINT32_MAX));
+}
+
+/*
+ * Record an event in the trace ring, cheap enough to leave on under load.
+ * The ring is dumped from kore.corodump() or on SIGUSR1.
+ */
+static void
+python_coro_trace(u_int32_t type, struct python_coro *coro, u_int32_t arg)
+{
+	struct python_coro_event	*ev;
+
+	if (coro_tracing == 0)
+		return;
+
+	ev = &coro_trace[coro_trace_seq++ & (CORO_TRACE_RING - 1)];
+
+	ev->ts = kore_time_us();
+	ev->id = coro->id;
+	ev->type = type;
+	ev->arg = arg;
 }
 
 static void
@@ -1207,11 +1561,33 @@ pyconnection_dealloc(struct pyconnection *pyc)
 static void
 pyhttp_dealloc(struct pyhttp_request *pyreq)
 {
-	Py_XDECREF(pyreq->dict);
-	Py_XDECREF(pyreq->data);
+	Py_CLEAR(pyreq->dict);
+	Py_CLEAR(pyreq->data);
+	Py_CLEAR(pyreq->body);
+	Py_CLEAR(pyreq->args);
+	Py_CLEAR(pyreq->headers);
+
+	if (pyhttp_request_freecnt < PYHTTP_REQUEST_FREELIST &&
+	    Py_TYPE(pyreq) == &pyhttp_request_type) {
+		pyhttp_request_freelist[pyhttp_request_freecnt++] = pyreq;
+		return;
+	}
+
 	PyObject_Del((PyObject *)pyreq);
 }
 
+static void
+pyhttp_body_dealloc(struct pyhttp_body *body)
+{
+	if (body->map != NULL)
+		(void)munmap(body->map, body->length);
+
+	if (body->owned)
+		kore_buf_free(body->buf);
+
+	PyObject_Del((PyObject *)body);
+}
+
 static void
 pyhttp_file_dealloc(struct pyhttp_file *pyfile)
 {
@@ -1222,9 +1598,14 @@ static int
 python_runtime_http_request(void *addr, struct http_request *req)
 {
 	int			ret, idx, cnt;
-	PyObject		*pyret, *args, *callable;
+	PyObject		*pyret, *callable;
 	PyObject		*cargs[HTTP_CAPTURE_GROUPS + 1];
 
+#if defined(KORE_USE_TASKS)
+	if ((req->flags & HTTP_REQUEST_OFFLOADED) && !PyGILState_Check())
+		return (python_runtime_http_offloaded(addr, req));
+#endif
+
 	if (req->py_coro != NULL) {
 		python_coro_wakeup(req->py_coro);
 		if (python_coro_run(req->py_coro) == KORE_RESULT_OK) {
@@ -1264,9 +1645,15 @@ python_runtime_http_request(void *addr, struct http_request *req)
 		break;
 	}
 
-	cnt = 0;
+	cnt = 1;
 	callable = (PyObject *)addr;
 
+	/*
+	 * The handler is called through vectorcall with its arguments on
+	 * the stack, the request followed by any capture groups.
+	 */
+	cargs[0] = req->py_req;
+
 	/* starts at 1 to skip the full path. */
 	if (req->rt->type == HANDLER_TYPE_DYNAMIC) {
 		for (idx = 1; idx < HTTP_CAPTURE_GROUPS - 1; idx++) {
@@ -1279,8 +1666,8 @@ python_runtime_http_request(void *addr, struct http_request *req)
 			    req->cgroups[idx].rm_eo - req->cgroups[idx].rm_so);
 
 			if (cargs[cnt] == NULL) {
-				while (cnt >= 0)
-					Py_XDECREF(cargs[cnt--]);
+				while (--cnt > 0)
+					Py_DECREF(cargs[cnt]);
 				kore_python_log_error("http request");
 				http_response(req,
 				    HTTP_STATUS_INTERNAL_ERROR, NULL, 0);
@@ -1291,23 +1678,11 @@ python_runtime_http_request(void *addr, struct http_request *req)
 		}
 	}
 
-	cargs[cnt] = NULL;
-
-	if ((args = PyTuple_New(cnt + 1)) == NULL)
-		fatal("%s: PyTuple_New failed", __func__);
-
-	Py_INCREF(req->py_req);
-	if (PyTuple_SetItem(args, 0, req->py_req) != 0)
-		fatal("python_runtime_http_request: PyTuple_SetItem failed");
-
-	for (idx = 0; cargs[idx] != NULL; idx++) {
-		if (PyTuple_SetItem(args, 1 + idx, cargs[idx]) != 0)
-			fatal("%s: PyTuple_SetItem failed (%d)", __func__, idx);
-	}
-
 	PyErr_Clear();
-	pyret = PyObject_Call(callable, args, NULL);
-	Py_DECREF(args);
+	pyret = PyObject_Vectorcall(callable, cargs, cnt, NULL);
+
+	for (idx = 1; idx < cnt; idx++)
+		Py_DECREF(cargs[idx]);
 
 	if (pyret == NULL) {
 		kore_python_log_error("python_runtime_http_request");
@@ -1315,6 +1690,14 @@ python_runtime_http_request(void *addr, struct http_request *req)
 		return (KORE_RESULT_OK);
 	}
 
+	if (PyCoro_CheckExact(pyret) && (req->flags & HTTP_REQUEST_OFFLOADED)) {
+		Py_DECREF(pyret);
+		kore_log(LOG_ERR, "offloaded handler for '%s' is a coroutine",
+		    req->path);
+		http_response(req, HTTP_STATUS_INTERNAL_ERROR, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
 	if (PyCoro_CheckExact(pyret)) {
 		req->py_coro = python_coro_create(pyret, req);
 		if (python_coro_run(req->py_coro) == KORE_RESULT_OK) {
@@ -1334,6 +1717,34 @@ python_runtime_http_request(void *addr, struct http_request *req)
 	return (KORE_RESULT_OK);
 }
 
+#if defined(KORE_USE_TASKS)
+/*
+ * Called on a task thread for offloaded routes, the worker only drops
+ * the GIL while waiting for events. Prerequest hooks and the handler
+ * cannot suspend here, there is no event loop to resume them.
+ */
+static int
+python_runtime_http_offloaded(void *addr, struct http_request *req)
+{
+	int			ret;
+	PyGILState_STATE	gil;
+
+	gil = PyGILState_Ensure();
+
+	ret = python_runtime_http_request(addr, req);
+	if (ret == KORE_RESULT_RETRY) {
+		kore_log(LOG_ERR, "offloaded route '%s' cannot suspend",
+		    req->path);
+		http_response(req, HTTP_STATUS_INTERNAL_ERROR, NULL, 0);
+		ret = KORE_RESULT_OK;
+	}
+
+	PyGILState_Release(gil);
+
+	return (ret);
+}
+#endif
+
 static void
 python_runtime_http_request_free(void *addr, struct http_request *req)
 {
@@ -1383,8 +1794,9 @@ static int
 python_runtime_validator(void *addr, struct http_request *req, const void *data)
 {
 	int			ret;
+	size_t			nargs;
 	struct python_coro	*coro;
-	PyObject		*pyret, *args, *callable, *arg;
+	PyObject		*pyret, *callable, *args[2];
 
 	if (req->py_req == NULL) {
 		if ((req->py_req = pyhttp_request_alloc(req)) == NULL)
@@ -1404,31 +1816,21 @@ python_runtime_validator(void *addr, struct http_request *req, const void *data)
 		return (KORE_RESULT_RETRY);
 	}
 
+	nargs = 1;
+	args[0] = req->py_req;
 	callable = (PyObject *)addr;
 
-	if (req->flags & HTTP_VALIDATOR_IS_REQUEST) {
-		if ((args = PyTuple_New(1)) == NULL)
-			fatal("%s: PyTuple_New failed", __func__);
-
-		Py_INCREF(req->py_req);
-		if (PyTuple_SetItem(args, 0, req->py_req) != 0)
-			fatal("%s: PyTuple_SetItem failed", __func__);
-	} else {
-		if ((arg = PyUnicode_FromString(data)) == NULL)
+	if (!(req->flags & HTTP_VALIDATOR_IS_REQUEST)) {
+		if ((args[1] = PyUnicode_FromString(data)) == NULL)
 			fatal("python_runtime_validator: PyUnicode failed");
-
-		if ((args = PyTuple_New(2)) == NULL)
-			fatal("%s: PyTuple_New failed", __func__);
-
-		Py_INCREF(req->py_req);
-		if (PyTuple_SetItem(args, 0, req->py_req) != 0 ||
-		    PyTuple_SetItem(args, 1, arg) != 0)
-			fatal("%s: PyTuple_SetItem failed", __func__);
+		nargs++;
 	}
 
 	PyErr_Clear();
-	pyret = PyObject_Call(callable, args, NULL);
-	Py_DECREF(args);
+	pyret = PyObject_Vectorcall(callable, args, nargs, NULL);
+
+	if (nargs > 1)
+		Py_DECREF(args[1]);
 
 	if (pyret == NULL) {
 		kore_python_log_error("python_runtime_validator");
@@ -1677,6 +2079,12 @@ python_module_init(void)
 	if ((pykore = PyModule_Create(&pykore_module)) == NULL)
 		fatal("python_module_init: failed to setup pykore module");
 
+	pyhttp_proto_http = PyUnicode_InternFromString("http");
+	pyhttp_proto_https = PyUnicode_InternFromString("https");
+
+	if (pyhttp_proto_http == NULL || pyhttp_proto_https == NULL)
+		fatal("python_module_init: failed to intern strings");
+
 	python_push_type("pyproc", pykore, &pyproc_type);
 	python_push_type("pylock", pykore, &pylock_type);
 	python_push_type("pytimer", pykore, &pytimer_type);
@@ -1693,6 +2101,7 @@ python_module_init(void)
 #if defined(KORE_USE_CURL)
 	python_push_type("pycurlhandle", pykore, &pycurl_handle_type);
 	python_push_type("pyhttpclient", pykore, &pyhttp_client_type);
+	python_push_type("pyhttpclientop", pykore, &pyhttp_client_op_type);
 
 	for (i = 0; py_curlopt[i].name != NULL; i++) {
 		python_push_integer(pykore, py_curlopt[i].name,
@@ -1700,6 +2109,12 @@ python_module_init(void)
 	}
 #endif
 
+#if defined(KORE_USE_PGSQL)
+	python_push_type("pgsql_result", pykore, &pykore_pgsql_result_type);
+	python_push_type("pgsql_value", pykore, &pykore_pgsql_value_type);
+#endif
+
+	python_push_type("pyhttp_body", pykore, &pyhttp_body_type);
 	python_push_type("pyhttp_file", pykore, &pyhttp_file_type);
 	python_push_type("pyhttp_request", pykore, &pyhttp_request_type);
 
@@ -1811,6 +2226,23 @@ python_kore_pgsql_register(PyObject *self, PyObject *args)
 
 	Py_RETURN_TRUE;
 }
+
+static PyObject *
+python_kore_pgsql_prepare(PyObject *self, PyObject *args)
+{
+	const char	*db, *name, *sql;
+
+	if (!PyArg_ParseTuple(args, "sss", &db, &name, &sql))
+		return (NULL);
+
+	if (!kore_pgsql_register_statement(db, name, sql)) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "pgsql: failed to register statement '%s'", name);
+		return (NULL);
+	}
+
+	Py_RETURN_TRUE;
+}
 #endif
 
 static PyObject *
@@ -1861,27 +2293,86 @@ python_kore_time(PyObject *self, PyObject *args)
 }
 
 static PyObject *
-python_kore_server(PyObject *self, PyObject *args, PyObject *kwargs)
+python_kore_httpdate(PyObject *self, PyObject *args)
 {
-	struct kore_server	*srv;
-	const char		*name, *ip, *port, *path;
+	if (kore_clock.wall == 0)
+		kore_clock_tick();
 
-	if (kwargs == NULL) {
-		PyErr_SetString(PyExc_RuntimeError, "missing keyword args");
-		return (NULL);
-	}
+	return (PyUnicode_FromString(kore_clock.date));
+}
 
-	ip = python_string_from_dict(kwargs, "ip");
-	path = python_string_from_dict(kwargs, "path");
+static PyObject *
+python_kore_pool_stats(PyObject *self, PyObject *args)
+{
+	size_t				i, cnt, total;
+	struct kore_mem_stats		mem;
+	struct kore_pool_stats		*st;
+	PyObject			*result, *pools, *entry;
 
-	if (ip == NULL && path == NULL) {
-		PyErr_SetString(PyExc_RuntimeError,
-		    "missing ip or path keywords");
+	cnt = kore_pool_stats_get(NULL, 0);
+	st = kore_calloc(cnt ? cnt : 1, sizeof(*st));
+	total = kore_pool_stats_get(st, cnt);
+	cnt = MIN(cnt, total);
+
+	kore_mem_stats_get(&mem);
+
+	if ((pools = PyList_New(0)) == NULL) {
+		kore_free(st);
 		return (NULL);
 	}
 
-	if (ip != NULL && path != NULL) {
-		PyErr_SetString(PyExc_RuntimeError, "ip/path are exclusive");
+	for (i = 0; i < cnt; i++) {
+		entry = Py_BuildValue("{s:s,s:n,s:n,s:n,s:n,s:n,s:K,s:K}",
+		    "name", st[i].name, "size", (Py_ssize_t)st[i].elen,
+		    "capacity", (Py_ssize_t)st[i].elms,
+		    "inuse", (Py_ssize_t)st[i].inuse,
+		    "hwm", (Py_ssize_t)st[i].hwm,
+		    "regions", (Py_ssize_t)st[i].regions,
+		    "allocs", (unsigned long long)st[i].allocs,
+		    "rate", (unsigned long long)st[i].rate);
+		if (entry == NULL || PyList_Append(pools, entry) == -1) {
+			Py_XDECREF(entry);
+			Py_DECREF(pools);
+			kore_free(st);
+			return (NULL);
+		}
+
+		Py_DECREF(entry);
+	}
+
+	kore_free(st);
+
+	result = Py_BuildValue("{s:N,s:{s:K,s:K,s:K,s:K}}", "pools", pools,
+	    "large", "count", (unsigned long long)mem.large_count,
+	    "bytes", (unsigned long long)mem.large_bytes,
+	    "hwm", (unsigned long long)mem.large_hwm,
+	    "allocs", (unsigned long long)mem.large_allocs);
+
+	return (result);
+}
+
+static PyObject *
+python_kore_server(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	struct kore_server	*srv;
+	const char		*name, *ip, *port, *path, *rl;
+
+	if (kwargs == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "missing keyword args");
+		return (NULL);
+	}
+
+	ip = python_string_from_dict(kwargs, "ip");
+	path = python_string_from_dict(kwargs, "path");
+
+	if (ip == NULL && path == NULL) {
+		PyErr_SetString(PyExc_RuntimeError,
+		    "missing ip or path keywords");
+		return (NULL);
+	}
+
+	if (ip != NULL && path != NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "ip/path are exclusive");
 		return (NULL);
 	}
 
@@ -1898,6 +2389,15 @@ python_kore_server(PyObject *self, PyObject *args, PyObject *kwargs)
 	srv = kore_server_create(name);
 	python_bool_from_dict(kwargs, "tls", &srv->tls);
 
+	if ((rl = python_string_from_dict(kwargs, "ratelimit")) != NULL) {
+		if ((srv->ratelimit = kore_ratelimit_lookup(rl)) == NULL) {
+			kore_server_free(srv);
+			PyErr_Format(PyExc_RuntimeError,
+			    "no such ratelimit '%s'", rl);
+			return (NULL);
+		}
+	}
+
 	if (srv->tls && !kore_tls_supported()) {
 		kore_server_free(srv);
 		PyErr_SetString(PyExc_RuntimeError,
@@ -2049,6 +2549,7 @@ python_kore_task_id(PyObject *self, PyObject *args)
 static PyObject *
 python_kore_task_kill(PyObject *self, PyObject *args)
 {
+	int			prio;
 	u_int64_t		id;
 	struct python_coro	*coro, *active;
 
@@ -2064,12 +2565,14 @@ python_kore_task_kill(PyObject *self, PyObject *args)
 	/* Remember active coro, as delete sets coro_running to NULL. */
 	active = coro_running;
 
-	TAILQ_FOREACH(coro, &coro_runnable, list) {
-		if (coro->id == id) {
-			coro->killed++;
-			kore_python_coro_delete(coro);
-			coro_running = active;
-			Py_RETURN_TRUE;
+	for (prio = 0; prio < CORO_PRIO_MAX; prio++) {
+		TAILQ_FOREACH(coro, &coro_runnable[prio], list) {
+			if (coro->id == id) {
+				coro->killed++;
+				kore_python_coro_delete(coro);
+				coro_running = active;
+				Py_RETURN_TRUE;
+			}
 		}
 	}
 
@@ -2199,7 +2702,7 @@ python_kore_domain(PyObject *self, PyObject *args, PyObject *kwargs)
 	long			depth;
 	const char		*name;
 	struct pydomain		*domain;
-	const char		*cert, *key, *ca, *attach;
+	const char		*cert, *key, *ca, *attach, *ocsp;
 
 	ca = NULL;
 	depth = -1;
@@ -2286,6 +2789,9 @@ python_kore_domain(PyObject *self, PyObject *args, PyObject *kwargs)
 		domain->config->certkey = kore_strdup(key);
 		domain->config->certfile = kore_strdup(cert);
 
+		if ((ocsp = python_string_from_dict(kwargs, "ocsp")) != NULL)
+			domain->config->ocspfile = kore_strdup(ocsp);
+
 #if defined(KORE_USE_ACME)
 		domain->config->acme = acme;
 
@@ -2402,6 +2908,10 @@ python_kore_gather(PyObject *self, PyObject *args, PyObject *kwargs)
 		coro = kore_pool_get(&gather_coro_pool);
 		coro->coro = python_coro_create(obj, NULL);
 		coro->coro->gatherop = op;
+
+		/* Gathered coroutines run at the priority of their caller. */
+		if (op->coro != NULL)
+			python_coro_prio(coro->coro, op->coro->prio);
 		TAILQ_INSERT_TAIL(&op->coroutines, coro, list);
 
 		if (idx > concurrency - 1)
@@ -2582,6 +3092,74 @@ python_kore_suspend(PyObject *self, PyObject *args)
 	return ((PyObject *)op);
 }
 
+static PyObject *
+python_kore_auth_cache_purge(PyObject *self, PyObject *args)
+{
+	const char		*value;
+
+	value = NULL;
+
+	if (!PyArg_ParseTuple(args, "|z", &value))
+		return (NULL);
+
+	kore_auth_cache_purge(value);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+python_kore_ratelimit_add(PyObject *self, PyObject *args)
+{
+	const char		*name;
+	unsigned int		count, period, burst;
+
+	burst = 0;
+
+	if (!PyArg_ParseTuple(args, "sII|I", &name, &count, &period, &burst))
+		return (NULL);
+
+	if (worker != NULL) {
+		PyErr_SetString(PyExc_RuntimeError,
+		    "ratelimits can only be added before workers start");
+		return (NULL);
+	}
+
+	if (burst == 0)
+		burst = count;
+
+	if (!kore_ratelimit_add(name, count, period, burst)) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "invalid or duplicate ratelimit '%s'", name);
+		return (NULL);
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+python_kore_ratelimit(PyObject *self, PyObject *args)
+{
+	Py_buffer		key;
+	const char		*name;
+	u_int64_t		retry;
+	struct kore_ratelimit	*rl;
+
+	if (!PyArg_ParseTuple(args, "ss*", &name, &key))
+		return (NULL);
+
+	if ((rl = kore_ratelimit_lookup(name)) == NULL) {
+		PyBuffer_Release(&key);
+		PyErr_Format(PyExc_RuntimeError,
+		    "no such ratelimit '%s'", name);
+		return (NULL);
+	}
+
+	(void)kore_ratelimit_check(rl, key.buf, key.len, &retry);
+	PyBuffer_Release(&key);
+
+	return (PyLong_FromUnsignedLongLong(retry));
+}
+
 static PyObject *
 python_kore_shutdown(PyObject *self, PyObject *args)
 {
@@ -2616,9 +3194,64 @@ python_kore_corotrace(PyObject *self, PyObject *args)
 	if (!PyArg_ParseTuple(args, "b", &coro_tracing))
 		return (NULL);
 
+	if (coro_tracing && coro_trace == NULL) {
+		coro_trace = kore_calloc(CORO_TRACE_RING,
+		    sizeof(struct python_coro_event));
+	}
+
 	Py_RETURN_NONE;
 }
 
+static PyObject *
+python_kore_corodump(PyObject *self, PyObject *args)
+{
+	u_int64_t			seq;
+	struct python_coro_event	*ev;
+	PyObject			*list, *entry;
+
+	if ((list = PyList_New(0)) == NULL)
+		return (NULL);
+
+	if (coro_trace == NULL)
+		return (list);
+
+	seq = 0;
+	if (coro_trace_seq > CORO_TRACE_RING)
+		seq = coro_trace_seq - CORO_TRACE_RING;
+
+	for (; seq < coro_trace_seq; seq++) {
+		ev = &coro_trace[seq & (CORO_TRACE_RING - 1)];
+		entry = Py_BuildValue("(KKsI)", (unsigned long long)ev->ts,
+		    (unsigned long long)ev->id, coro_trace_names[ev->type],
+		    ev->arg);
+		if (entry == NULL || PyList_Append(list, entry) == -1) {
+			Py_XDECREF(entry);
+			Py_DECREF(list);
+			return (NULL);
+		}
+
+		Py_DECREF(entry);
+	}
+
+	return (list);
+}
+
+static PyObject *
+python_kore_corostats(PyObject *self, PyObject *args)
+{
+	return (Py_BuildValue("{s:i,s:i,s:i,s:i,s:K,s:K,s:K,s:K}",
+	    "count", coro_count,
+	    "runnable", coro_runnable_count,
+	    "runnable_tasks", coro_queued[CORO_PRIO_TASK],
+	    "suspended", coro_count - coro_runnable_count,
+	    "suspended_age", (unsigned long long)
+	    kore_python_coro_suspended_age(),
+	    "runnable_age", (unsigned long long)
+	    kore_python_coro_runnable_age(),
+	    "budget_hits", (unsigned long long)coro_budget_hits,
+	    "traced", (unsigned long long)coro_trace_seq));
+}
+
 static PyObject *
 python_kore_timer(PyObject *self, PyObject *args, PyObject *kwargs)
 {
@@ -4605,9 +5238,15 @@ pyhttp_request_alloc(const struct http_request *req)
 	union { const void *cp; void *p; }	ptr;
 	struct pyhttp_request			*pyreq;
 
-	pyreq = PyObject_New(struct pyhttp_request, &pyhttp_request_type);
-	if (pyreq == NULL)
-		return (NULL);
+	if (pyhttp_request_freecnt > 0) {
+		pyreq = pyhttp_request_freelist[--pyhttp_request_freecnt];
+		(void)PyObject_Init((PyObject *)pyreq, &pyhttp_request_type);
+	} else {
+		pyreq = PyObject_New(struct pyhttp_request,
+		    &pyhttp_request_type);
+		if (pyreq == NULL)
+			return (NULL);
+	}
 
 	/*
 	 * Hack around all http apis taking a non-const pointer and us having
@@ -4619,10 +5258,108 @@ pyhttp_request_alloc(const struct http_request *req)
 	pyreq->req = ptr.p;
 	pyreq->data = NULL;
 	pyreq->dict = NULL;
+	pyreq->body = NULL;
+	pyreq->args = NULL;
+	pyreq->headers = NULL;
 
 	return ((PyObject *)pyreq);
 }
 
+static PyObject *
+pyhttp_body_alloc(struct http_request *req)
+{
+	size_t			length;
+	struct pyhttp_body	*body;
+
+	if (!(req->flags & HTTP_REQUEST_COMPLETE)) {
+		PyErr_SetString(PyExc_RuntimeError,
+		    "request body is not complete");
+		return (NULL);
+	}
+
+	body = PyObject_New(struct pyhttp_body, &pyhttp_body_type);
+	if (body == NULL)
+		return (NULL);
+
+	length = req->http_body_offset + req->http_body_length;
+
+	body->buf = NULL;
+	body->map = NULL;
+	body->owned = 0;
+	body->length = length;
+
+	if (req->http_body_fd != -1 && length > 0) {
+		body->map = mmap(NULL, length, PROT_READ, MAP_PRIVATE,
+		    req->http_body_fd, 0);
+		if (body->map == MAP_FAILED) {
+			body->map = NULL;
+			Py_DECREF((PyObject *)body);
+			return (PyErr_SetFromErrno(PyExc_OSError));
+		}
+	} else if (req->http_body != NULL) {
+		body->buf = req->http_body;
+	} else {
+		body->length = 0;
+	}
+
+	return ((PyObject *)body);
+}
+
+static int
+pyhttp_body_getbuffer(struct pyhttp_body *body, Py_buffer *view, int flags)
+{
+	void		*data;
+
+	if (body->map != NULL)
+		data = body->map;
+	else if (body->buf != NULL)
+		data = body->buf->data;
+	else
+		data = NULL;
+
+	return (PyBuffer_FillInfo(view, (PyObject *)body, data,
+	    body->length, 1, flags));
+}
+
+static PyObject *
+pyhttp_body_object(struct pyhttp_request *pyreq)
+{
+	if (pyreq->body == NULL) {
+		if ((pyreq->body = pyhttp_body_alloc(pyreq->req)) == NULL)
+			return (NULL);
+	}
+
+	return (pyreq->body);
+}
+
+void
+kore_python_http_request_release(struct http_request *req)
+{
+	struct pyhttp_body	*body;
+	struct pyhttp_request	*pyreq;
+
+	if (req->py_req == NULL)
+		return;
+
+	pyreq = (struct pyhttp_request *)req->py_req;
+
+	/*
+	 * Python may still hold views on the body after the request is
+	 * gone, so hand it the kore_buf instead of freeing it from under
+	 * them. The mapping of an offloaded body outlives the fd anyway.
+	 */
+	if (pyreq->body != NULL) {
+		body = (struct pyhttp_body *)pyreq->body;
+		if (body->buf != NULL && body->buf == req->http_body) {
+			body->owned = 1;
+			req->http_body = NULL;
+		}
+	}
+
+	Py_DECREF(req->py_req);
+	req->py_req = NULL;
+}
+
 static PyObject *
 pyhttp_file_alloc(struct http_file *file)
 {
@@ -4705,12 +5442,30 @@ pyhttp_response(struct pyhttp_request *pyreq, PyObject *args)
 			return (NULL);
 		}
 
+#if defined(KORE_USE_TASKS)
+		/* Copied, the worker sends it after the handler returned. */
+		if (pyreq->req->flags & HTTP_REQUEST_OFFLOADED) {
+			http_response(pyreq->req, status, ptr, length);
+			Py_RETURN_TRUE;
+		}
+#endif
+
 		Py_INCREF(obj);
 
 		http_response_stream(pyreq->req, status, ptr, length,
 		    pyhttp_response_sent, obj);
 	} else if (obj == Py_None) {
 		http_response(pyreq->req, status, NULL, 0);
+#if defined(KORE_USE_TASKS)
+	} else if (pyreq->req->flags & HTTP_REQUEST_OFFLOADED) {
+		PyErr_SetString(PyExc_RuntimeError,
+		    "offloaded handlers can only respond with bytes");
+		return (NULL);
+#endif
+	} else if (pyreq->req->owner != NULL &&
+	    pyreq->req->owner->proto == CONN_PROTO_HTTP2) {
+		if (!pyhttp_response_collect(pyreq->req, status, obj))
+			return (NULL);
 	} else {
 		c = pyreq->req->owner;
 		if (c->state == CONN_STATE_DISCONNECTING) {
@@ -4742,6 +5497,48 @@ pyhttp_response(struct pyhttp_request *pyreq, PyObject *args)
 	Py_RETURN_TRUE;
 }
 
+/*
+ * HTTP/2 has its own framing instead of chunked encoding, so gather
+ * everything the iterator yields and send it as a single response.
+ */
+static int
+pyhttp_response_collect(struct http_request *req, int status, PyObject *obj)
+{
+	struct kore_buf		buf;
+	PyObject		*iterator, *item;
+	const char		*ptr;
+	Py_ssize_t		length;
+
+	if ((iterator = PyObject_GetIter(obj)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	kore_buf_init(&buf, 4096);
+
+	while ((item = PyIter_Next(iterator)) != NULL) {
+		if ((ptr = PyUnicode_AsUTF8AndSize(item, &length)) == NULL) {
+			Py_DECREF(item);
+			Py_DECREF(iterator);
+			kore_buf_cleanup(&buf);
+			return (KORE_RESULT_ERROR);
+		}
+
+		kore_buf_append(&buf, ptr, length);
+		Py_DECREF(item);
+	}
+
+	Py_DECREF(iterator);
+
+	if (PyErr_Occurred()) {
+		kore_buf_cleanup(&buf);
+		return (KORE_RESULT_ERROR);
+	}
+
+	http_response(req, status, buf.data, buf.offset);
+	kore_buf_cleanup(&buf);
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 pyhttp_response_sent(struct netbuf *nb)
 {
@@ -4858,17 +5655,38 @@ pyhttp_request_header(struct pyhttp_request *pyreq, PyObject *args)
 {
 	const char		*value;
 	const char		*header;
-	PyObject		*result;
+	PyObject		*name, *result;
 
-	if (!PyArg_ParseTuple(args, "s", &header))
+	if (!PyArg_ParseTuple(args, "U", &name))
 		return (NULL);
 
-	if (!http_request_header(pyreq->req, header, &value)) {
-		Py_RETURN_NONE;
+	if (pyreq->headers == NULL) {
+		if ((pyreq->headers = PyDict_New()) == NULL)
+			return (NULL);
 	}
 
-	if ((result = PyUnicode_FromString(value)) == NULL)
+	if ((result = PyDict_GetItemWithError(pyreq->headers, name)) != NULL) {
+		Py_INCREF(result);
+		return (result);
+	}
+
+	if (PyErr_Occurred())
+		return (NULL);
+
+	if ((header = PyUnicode_AsUTF8(name)) == NULL)
+		return (NULL);
+
+	if (!http_request_header(pyreq->req, header, &value)) {
+		result = Py_None;
+		Py_INCREF(result);
+	} else if ((result = PyUnicode_FromString(value)) == NULL) {
 		return (PyErr_NoMemory());
+	}
+
+	if (PyDict_SetItem(pyreq->headers, name, result) == -1) {
+		Py_DECREF(result);
+		return (NULL);
+	}
 
 	return (result);
 }
@@ -4904,10 +5722,27 @@ pyhttp_body_read(struct pyhttp_request *pyreq, PyObject *args)
 	return (result);
 }
 
+static PyObject *
+pyhttp_body_persist(struct pyhttp_request *pyreq, PyObject *args)
+{
+	const char		*path;
+
+	if (!PyArg_ParseTuple(args, "s", &path))
+		return (NULL);
+
+	if (!http_body_persist(pyreq->req, path))
+		return (PyErr_SetFromErrnoWithFilename(PyExc_OSError, path));
+
+	Py_RETURN_NONE;
+}
+
 static PyObject *
 pyhttp_populate_get(struct pyhttp_request *pyreq, PyObject *args)
 {
 	http_populate_get(pyreq->req);
+	if (pyreq->args != NULL)
+		PyDict_Clear(pyreq->args);
+
 	Py_RETURN_TRUE;
 }
 
@@ -4915,6 +5750,9 @@ static PyObject *
 pyhttp_populate_post(struct pyhttp_request *pyreq, PyObject *args)
 {
 	http_populate_post(pyreq->req);
+	if (pyreq->args != NULL)
+		PyDict_Clear(pyreq->args);
+
 	Py_RETURN_TRUE;
 }
 
@@ -4922,6 +5760,9 @@ static PyObject *
 pyhttp_populate_multi(struct pyhttp_request *pyreq, PyObject *args)
 {
 	http_populate_multipart_form(pyreq->req);
+	if (pyreq->args != NULL)
+		PyDict_Clear(pyreq->args);
+
 	Py_RETURN_TRUE;
 }
 
@@ -4936,18 +5777,39 @@ static PyObject *
 pyhttp_argument(struct pyhttp_request *pyreq, PyObject *args)
 {
 	const char	*name;
-	PyObject	*value;
+	PyObject	*key, *value;
 	char		*string;
 
-	if (!PyArg_ParseTuple(args, "s", &name))
+	if (!PyArg_ParseTuple(args, "U", &key))
 		return (NULL);
 
-	if (!http_argument_get_string(pyreq->req, name, &string)) {
-		Py_RETURN_NONE;
+	if (pyreq->args == NULL) {
+		if ((pyreq->args = PyDict_New()) == NULL)
+			return (NULL);
 	}
 
-	if ((value = PyUnicode_FromString(string)) == NULL)
+	if ((value = PyDict_GetItemWithError(pyreq->args, key)) != NULL) {
+		Py_INCREF(value);
+		return (value);
+	}
+
+	if (PyErr_Occurred())
+		return (NULL);
+
+	if ((name = PyUnicode_AsUTF8(key)) == NULL)
+		return (NULL);
+
+	if (!http_argument_get_string(pyreq->req, name, &string)) {
+		value = Py_None;
+		Py_INCREF(value);
+	} else if ((value = PyUnicode_FromString(string)) == NULL) {
 		return (PyErr_NoMemory());
+	}
+
+	if (PyDict_SetItem(pyreq->args, key, value) == -1) {
+		Py_DECREF(value);
+		return (NULL);
+	}
 
 	return (value);
 }
@@ -5094,19 +5956,103 @@ pyconnection_websocket_send(struct pyconnection *pyc, PyObject *args)
 }
 
 static PyObject *
-python_websocket_broadcast(PyObject *self, PyObject *args)
+pyconnection_websocket_subscribe(struct pyconnection *pyc, PyObject *args)
 {
-	struct connection	*c;
-	ssize_t			len;
-	struct pyconnection	*pyc;
-	const char		*data;
-	PyObject		*pysrc;
-	int			op, broadcast;
+	const char	*topic;
 
-	len = -1;
+	if (pyc->c->proto != CONN_PROTO_WEBSOCKET) {
+		PyErr_SetString(PyExc_TypeError, "not a websocket connection");
+		return (NULL);
+	}
 
-	if (!PyArg_ParseTuple(args, "Oiy#i", &pysrc, &op, &data, &len,
-	    &broadcast))
+	if (!PyArg_ParseTuple(args, "s", &topic))
+		return (NULL);
+
+	if (!kore_websocket_subscribe(pyc->c, topic)) {
+		PyErr_SetString(PyExc_ValueError, "invalid topic");
+		return (NULL);
+	}
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject *
+pyconnection_websocket_unsubscribe(struct pyconnection *pyc, PyObject *args)
+{
+	const char	*topic;
+
+	if (!PyArg_ParseTuple(args, "s", &topic))
+		return (NULL);
+
+	if (!kore_websocket_unsubscribe(pyc->c, topic))
+		Py_RETURN_FALSE;
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject *
+python_websocket_publish(PyObject *self, PyObject *args)
+{
+	struct connection	*c;
+	ssize_t			len;
+	struct pyconnection	*pyc;
+	const char		*data, *topic;
+	PyObject		*pysrc;
+	int			op, broadcast;
+
+	len = -1;
+
+	if (!PyArg_ParseTuple(args, "Osiy#i", &pysrc, &topic, &op, &data,
+	    &len, &broadcast))
+		return (NULL);
+
+	if (len < 0) {
+		PyErr_SetString(PyExc_TypeError, "invalid length");
+		return (NULL);
+	}
+
+	switch (op) {
+	case WEBSOCKET_OP_TEXT:
+	case WEBSOCKET_OP_BINARY:
+		break;
+	default:
+		PyErr_SetString(PyExc_TypeError, "invalid op parameter");
+		return (NULL);
+	}
+
+	if (strlen(topic) == 0 || strlen(topic) > KORE_WEBSOCKET_TOPIC_MAX) {
+		PyErr_SetString(PyExc_ValueError, "invalid topic");
+		return (NULL);
+	}
+
+	if (pysrc == Py_None) {
+		c = NULL;
+	} else {
+		if (!PyObject_TypeCheck(pysrc, &pyconnection_type))
+			return (NULL);
+		pyc = (struct pyconnection *)pysrc;
+		c = pyc->c;
+	}
+
+	kore_websocket_publish(c, topic, op, data, len, broadcast);
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject *
+python_websocket_broadcast(PyObject *self, PyObject *args)
+{
+	struct connection	*c;
+	ssize_t			len;
+	struct pyconnection	*pyc;
+	const char		*data;
+	PyObject		*pysrc;
+	int			op, broadcast;
+
+	len = -1;
+
+	if (!PyArg_ParseTuple(args, "Oiy#i", &pysrc, &op, &data, &len,
+	    &broadcast))
 		return (NULL);
 
 	if (len < 0) {
@@ -5137,6 +6083,139 @@ python_websocket_broadcast(PyObject *self, PyObject *args)
 	Py_RETURN_TRUE;
 }
 
+static PyObject *
+pyhttp_sse_handshake(struct pyhttp_request *pyreq, PyObject *args)
+{
+	struct connection	*c;
+	PyObject		*onconnect, *ondisconnect;
+
+	onconnect = Py_None;
+	ondisconnect = Py_None;
+
+	if (!PyArg_ParseTuple(args, "|OO", &onconnect, &ondisconnect))
+		return (NULL);
+
+	kore_sse_handshake(pyreq->req, NULL, NULL);
+
+	c = pyreq->req->owner;
+	if (c->proto != CONN_PROTO_SSE)
+		Py_RETURN_FALSE;
+
+	if (ondisconnect != Py_None) {
+		Py_INCREF(ondisconnect);
+		c->ws_disconnect = kore_calloc(1, sizeof(struct kore_runtime_call));
+		c->ws_disconnect->addr = ondisconnect;
+		c->ws_disconnect->runtime = &kore_python_runtime;
+	}
+
+	if (onconnect != Py_None) {
+		Py_INCREF(onconnect);
+		c->ws_connect = kore_calloc(1, sizeof(struct kore_runtime_call));
+		c->ws_connect->addr = onconnect;
+		c->ws_connect->runtime = &kore_python_runtime;
+		python_runtime_connect(onconnect, c);
+	}
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject *
+pyconnection_sse_send(struct pyconnection *pyc, PyObject *args,
+    PyObject *kwargs)
+{
+	Py_ssize_t	len;
+	const char	*data, *event;
+
+	if (pyc->c->proto != CONN_PROTO_SSE) {
+		PyErr_SetString(PyExc_TypeError, "not an sse connection");
+		return (NULL);
+	}
+
+	if (!PyArg_ParseTuple(args, "s#", &data, &len))
+		return (NULL);
+
+	event = NULL;
+	if (kwargs != NULL)
+		event = python_string_from_dict(kwargs, "event");
+
+	if (event != NULL && (strlen(event) == 0 ||
+	    strlen(event) > KORE_SSE_EVENT_MAX || strpbrk(event, "\r\n"))) {
+		PyErr_SetString(PyExc_ValueError, "invalid event");
+		return (NULL);
+	}
+
+	kore_sse_send(pyc->c, event, data, len);
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject *
+pyconnection_sse_subscribe(struct pyconnection *pyc, PyObject *args)
+{
+	const char	*channel;
+
+	if (pyc->c->proto != CONN_PROTO_SSE) {
+		PyErr_SetString(PyExc_TypeError, "not an sse connection");
+		return (NULL);
+	}
+
+	if (!PyArg_ParseTuple(args, "s", &channel))
+		return (NULL);
+
+	if (!kore_sse_subscribe(pyc->c, channel)) {
+		PyErr_SetString(PyExc_ValueError, "invalid channel");
+		return (NULL);
+	}
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject *
+pyconnection_sse_unsubscribe(struct pyconnection *pyc, PyObject *args)
+{
+	const char	*channel;
+
+	if (!PyArg_ParseTuple(args, "s", &channel))
+		return (NULL);
+
+	if (!kore_sse_unsubscribe(pyc->c, channel))
+		Py_RETURN_FALSE;
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject *
+python_sse_publish(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	long		scope;
+	u_int64_t	id;
+	Py_ssize_t	len;
+	const char	*channel, *data, *event;
+
+	if (!PyArg_ParseTuple(args, "ss#", &channel, &data, &len))
+		return (NULL);
+
+	event = NULL;
+	scope = SSE_PUBLISH_LOCAL;
+
+	if (kwargs != NULL) {
+		event = python_string_from_dict(kwargs, "event");
+		(void)python_long_from_dict(kwargs, "scope", &scope);
+	}
+
+	if (scope != SSE_PUBLISH_LOCAL && scope != SSE_PUBLISH_GLOBAL) {
+		PyErr_SetString(PyExc_ValueError, "invalid scope");
+		return (NULL);
+	}
+
+	if ((id = kore_sse_publish(channel, event, data, len, scope)) == 0) {
+		PyErr_SetString(PyExc_ValueError, "invalid channel or event");
+		return (NULL);
+	}
+
+	return (PyLong_FromUnsignedLongLong(id));
+}
+
 static PyObject *
 pyhttp_get_host(struct pyhttp_request *pyreq, void *closure)
 {
@@ -5164,9 +6243,21 @@ pyhttp_get_body(struct pyhttp_request *pyreq, void *closure)
 {
 	ssize_t			ret;
 	struct kore_buf		buf;
+	Py_buffer		view;
 	PyObject		*body;
 	u_int8_t		data[BUFSIZ];
 
+	/* A complete body can be copied out in one go. */
+	if (pyreq->req->flags & HTTP_REQUEST_COMPLETE) {
+		if ((body = pyhttp_body_object(pyreq)) == NULL)
+			return (NULL);
+		if (PyObject_GetBuffer(body, &view, PyBUF_SIMPLE) == -1)
+			return (NULL);
+		body = PyBytes_FromStringAndSize(view.buf, view.len);
+		PyBuffer_Release(&view);
+		return (body);
+	}
+
 	kore_buf_init(&buf, 1024);
 	if (!http_body_rewind(pyreq->req)) {
 		PyErr_SetString(PyExc_RuntimeError,
@@ -5198,6 +6289,17 @@ pyhttp_get_body(struct pyhttp_request *pyreq, void *closure)
 	return (body);
 }
 
+static PyObject *
+pyhttp_get_body_view(struct pyhttp_request *pyreq, void *closure)
+{
+	PyObject	*body;
+
+	if ((body = pyhttp_body_object(pyreq)) == NULL)
+		return (NULL);
+
+	return (PyMemoryView_FromObject(body));
+}
+
 static PyObject *
 pyhttp_get_agent(struct pyhttp_request *pyreq, void *closure)
 {
@@ -5213,23 +6315,26 @@ pyhttp_get_method(struct pyhttp_request *pyreq, void *closure)
 static PyObject *
 pyhttp_get_protocol(struct pyhttp_request *pyreq, void *closure)
 {
+	PyObject		*proto;
 	struct connection	*c;
-	const char		*proto;
 
 	c = pyreq->req->owner;
 
 	if (c->owner->server->tls)
-		proto = "https";
+		proto = pyhttp_proto_https;
 	else
-		proto = "http";
+		proto = pyhttp_proto_http;
+
+	Py_INCREF(proto);
 
-	return (PyUnicode_FromString(proto));
+	return (proto);
 }
 
 static PyObject *
 pyhttp_get_body_path(struct pyhttp_request *pyreq, void *closure)
 {
-	if (pyreq->req->http_body_path == NULL) {
+	if (pyreq->req->http_body_path == NULL ||
+	    (pyreq->req->flags & HTTP_REQUEST_BODY_TMPFILE)) {
 		Py_RETURN_NONE;
 	}
 
@@ -5239,12 +6344,13 @@ pyhttp_get_body_path(struct pyhttp_request *pyreq, void *closure)
 static PyObject *
 pyhttp_get_body_digest(struct pyhttp_request *pyreq, void *closure)
 {
-	PyObject	*digest;
+	const u_int8_t	*digest;
 
-	digest = PyBytes_FromStringAndSize((char *)pyreq->req->http_body_digest,
-	    sizeof(pyreq->req->http_body_digest));
+	if ((digest = http_body_digest_raw(pyreq->req)) == NULL)
+		Py_RETURN_NONE;
 
-	return (digest);
+	return (PyBytes_FromStringAndSize((const char *)digest,
+	    HTTP_BODY_DIGEST_LEN));
 }
 
 static PyObject *
@@ -5336,11 +6442,7 @@ pydomain_set_accesslog(struct pydomain *domain, PyObject *arg, void *closure)
 
 	path = PyUnicode_AsUTF8(arg);
 
-	domain->config->accesslog = open(path,
-	    O_CREAT | O_APPEND | O_WRONLY,
-	    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
-	if (domain->config->accesslog == -1) {
+	if (!kore_domain_accesslog(domain->config, path)) {
 		PyErr_Format(PyExc_RuntimeError,
 		    "failed to open accesslog for %s (%s:%s)",
 		    domain->config->domain, path, errno_s);
@@ -5474,6 +6576,48 @@ python_route_install(struct pyroute *route)
 				return (KORE_RESULT_ERROR);
 			}
 		}
+
+		if (!python_route_ratelimit(kwargs, rt)) {
+			kore_python_log_error("python_route_install");
+			kore_route_free(rt);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (!python_route_cache(kwargs, rt)) {
+			kore_python_log_error("python_route_install");
+			kore_route_free(rt);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if ((val = python_string_from_dict(kwargs, "priority")) != NULL) {
+			rt->priority = http_overload_priority(val);
+			if (rt->priority == -1) {
+				kore_log(LOG_ERR,
+				    "invalid priority '%s' for '%s'", val,
+				    rt->path);
+				kore_route_free(rt);
+				return (KORE_RESULT_ERROR);
+			}
+		}
+
+		if ((obj = PyDict_GetItemString(kwargs, "multipart")) != NULL)
+			rt->multipart = PyObject_IsTrue(obj);
+
+		if ((obj = PyDict_GetItemString(kwargs, "digest")) != NULL)
+			rt->digest = PyObject_IsTrue(obj);
+
+		if ((obj = PyDict_GetItemString(kwargs, "offload")) != NULL) {
+#if defined(KORE_USE_TASKS)
+			rt->offload = PyObject_IsTrue(obj);
+#else
+			if (PyObject_IsTrue(obj)) {
+				kore_log(LOG_ERR,
+				    "offload requires a TASKS=1 build");
+				kore_route_free(rt);
+				return (KORE_RESULT_ERROR);
+			}
+#endif
+		}
 	}
 
 	if (rt->path[0] == '/') {
@@ -5491,6 +6635,7 @@ python_route_install(struct pyroute *route)
 	}
 
 	TAILQ_INSERT_TAIL(&domain->routes, rt, list);
+	kore_route_index_free(domain);
 
 	return (KORE_RESULT_OK);
 }
@@ -5613,8 +6758,7 @@ python_route_params(PyObject *kwargs, struct kore_route *rt,
 
 		if (vtype == KORE_VALIDATOR_TYPE_REGEX) {
 			val = PyUnicode_AsUTF8(item);
-			if (regcomp(&(vldr->rctx),
-			    val, REG_EXTENDED | REG_NOSUB)) {
+			if (!kore_validator_compile(vldr, val)) {
 				PyErr_Format(PyExc_RuntimeError,
 				    "Invalid regex (%s)", val);
 				kore_free(vldr);
@@ -5649,6 +6793,7 @@ static int
 python_route_auth(PyObject *dict, struct kore_route *rt)
 {
 	int			type;
+	long			ttl, fail_ttl;
 	struct kore_auth	*auth;
 	struct kore_validator	*vldr;
 	PyObject		*obj, *repr;
@@ -5682,6 +6827,19 @@ python_route_auth(PyObject *dict, struct kore_route *rt)
 
 	redir = python_string_from_dict(dict, "redirect");
 
+	ttl = 0;
+	fail_ttl = 0;
+
+	if ((PyDict_GetItemString(dict, "cache") != NULL &&
+	    !python_long_from_dict(dict, "cache", &ttl)) ||
+	    (PyDict_GetItemString(dict, "cache_fail") != NULL &&
+	    !python_long_from_dict(dict, "cache_fail", &fail_ttl)) ||
+	    ttl < 0 || ttl > UINT_MAX || fail_ttl < 0 || fail_ttl > UINT_MAX) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "invalid 'cache' in auth dictionary for '%s'", rt->path);
+		return (KORE_RESULT_ERROR);
+	}
+
 	if ((obj = PyDict_GetItemString(dict, "verify")) == NULL ||
 	    !PyCallable_Check(obj)) {
 		PyErr_Format(PyExc_RuntimeError,
@@ -5692,6 +6850,8 @@ python_route_auth(PyObject *dict, struct kore_route *rt)
 	auth = kore_calloc(1, sizeof(*auth));
 	auth->type = type;
 	auth->value = kore_strdup(value);
+	auth->cache_ttl = ttl;
+	auth->cache_fail_ttl = fail_ttl;
 
 	if (redir != NULL)
 		auth->redirect = kore_strdup(redir);
@@ -5721,6 +6881,89 @@ python_route_auth(PyObject *dict, struct kore_route *rt)
 	return (KORE_RESULT_OK);
 }
 
+static int
+python_route_ratelimit(PyObject *kwargs, struct kore_route *rt)
+{
+	const char		*name, *key;
+
+	if ((name = python_string_from_dict(kwargs, "ratelimit")) == NULL)
+		return (KORE_RESULT_OK);
+
+	if ((rt->ratelimit = kore_ratelimit_lookup(name)) == NULL) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "no such ratelimit '%s'", name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	rt->ratelimit_key = KORE_RATELIMIT_KEY_ADDRESS;
+
+	if ((key = python_string_from_dict(kwargs, "ratelimit_key")) == NULL)
+		return (KORE_RESULT_OK);
+
+	if ((rt->ratelimit_key = kore_ratelimit_key(key)) == -1) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "unknown ratelimit_key '%s'", key);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+python_route_cache(PyObject *kwargs, struct kore_route *rt)
+{
+	Py_ssize_t		idx;
+	PyObject		*obj, *item;
+	const char		*header;
+
+	if ((obj = PyDict_GetItemString(kwargs, "cache")) == NULL)
+		return (KORE_RESULT_OK);
+
+	rt->cache = kore_calloc(1, sizeof(*rt->cache));
+
+	rt->cache->ttl = PyLong_AsUnsignedLongLong(obj);
+	if (PyErr_Occurred() || rt->cache->ttl == 0) {
+		PyErr_Clear();
+		PyErr_SetString(PyExc_RuntimeError, "invalid cache ttl");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if ((obj = PyDict_GetItemString(kwargs, "cache_stale")) != NULL) {
+		rt->cache->stale = PyLong_AsUnsignedLongLong(obj);
+		if (PyErr_Occurred()) {
+			PyErr_Clear();
+			PyErr_SetString(PyExc_RuntimeError,
+			    "invalid cache_stale");
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if ((obj = PyDict_GetItemString(kwargs, "cache_vary")) == NULL)
+		return (KORE_RESULT_OK);
+
+	if (!PyList_CheckExact(obj) ||
+	    PyList_Size(obj) > HTTP_CACHE_VARY_MAX) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "cache_vary must be a list of up to %d headers",
+		    HTTP_CACHE_VARY_MAX);
+		return (KORE_RESULT_ERROR);
+	}
+
+	for (idx = 0; idx < PyList_Size(obj); idx++) {
+		item = PyList_GET_ITEM(obj, idx);
+		if (!PyUnicode_CheckExact(item) ||
+		    (header = PyUnicode_AsUTF8(item)) == NULL) {
+			PyErr_SetString(PyExc_RuntimeError,
+			    "cache_vary must contain header names");
+			return (KORE_RESULT_ERROR);
+		}
+
+		rt->cache->vary[rt->cache->nvary++] = kore_strdup(header);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 python_route_hooks(PyObject *dict, struct kore_route *rt)
 {
@@ -5781,7 +7024,13 @@ python_kore_pgsql_query(PyObject *self, PyObject *args, PyObject *kwargs)
 	if (op == NULL)
 		return (NULL);
 
+	op->lazy = 0;
+	op->stream = 0;
 	op->binary = 0;
+	op->prepared = 0;
+	op->cache = 0;
+	op->cursor = NULL;
+	op->cursor_row = 0;
 	op->param.count = 0;
 	op->param.objs = NULL;
 	op->param.values = NULL;
@@ -5816,6 +7065,70 @@ python_kore_pgsql_query(PyObject *self, PyObject *args, PyObject *kwargs)
 				return (NULL);
 			}
 		}
+
+		/* The query is the name of a registered statement. */
+		if ((obj = PyDict_GetItemString(kwargs, "prepared")) != NULL) {
+			if (obj == Py_True) {
+				op->prepared = 1;
+			} else if (obj == Py_False) {
+				op->prepared = 0;
+			} else {
+				Py_DECREF((PyObject *)op);
+				PyErr_SetString(PyExc_RuntimeError,
+				    "pgsql: prepared not True or False");
+				return (NULL);
+			}
+		}
+
+		/* Hand back a kore.pgsql_result instead of a list. */
+		if ((obj = PyDict_GetItemString(kwargs, "lazy")) != NULL) {
+			if (obj == Py_True) {
+				op->lazy = 1;
+			} else if (obj == Py_False) {
+				op->lazy = 0;
+			} else {
+				Py_DECREF((PyObject *)op);
+				PyErr_SetString(PyExc_RuntimeError,
+				    "pgsql: lazy not True or False");
+				return (NULL);
+			}
+		}
+
+		/* Rows are consumed one at a time with async for. */
+		if ((obj = PyDict_GetItemString(kwargs, "stream")) != NULL) {
+			if (obj == Py_True) {
+				op->stream = 1;
+			} else if (obj == Py_False) {
+				op->stream = 0;
+			} else {
+				Py_DECREF((PyObject *)op);
+				PyErr_SetString(PyExc_RuntimeError,
+				    "pgsql: stream not True or False");
+				return (NULL);
+			}
+		}
+
+		/* Serve from the result cache for this many milliseconds. */
+		if ((obj = PyDict_GetItemString(kwargs, "cache")) != NULL) {
+			if (!PyLong_CheckExact(obj)) {
+				Py_DECREF((PyObject *)op);
+				PyErr_SetString(PyExc_RuntimeError,
+				    "pgsql: cache not an integer");
+				return (NULL);
+			}
+			op->cache = PyLong_AsUnsignedLong(obj);
+			if (PyErr_Occurred()) {
+				Py_DECREF((PyObject *)op);
+				return (NULL);
+			}
+		}
+	}
+
+	if (op->stream && op->cache != 0) {
+		Py_DECREF((PyObject *)op);
+		PyErr_SetString(PyExc_RuntimeError,
+		    "pgsql: stream cannot be combined with cache");
+		return (NULL);
 	}
 
 	return ((PyObject *)op);
@@ -5895,8 +7208,8 @@ pykore_pgsql_dealloc(struct pykore_pgsql *pysql)
 	kore_free(pysql->query);
 	kore_pgsql_cleanup(&pysql->sql);
 
-	if (pysql->result != NULL)
-		Py_DECREF(pysql->result);
+	Py_XDECREF(pysql->result);
+	Py_XDECREF(pysql->cursor);
 
 	for (i = 0; i < pysql->param.count; i++)
 		Py_XDECREF(pysql->param.objs[i]);
@@ -5912,6 +7225,8 @@ pykore_pgsql_dealloc(struct pykore_pgsql *pysql)
 static PyObject *
 pykore_pgsql_iternext(struct pykore_pgsql *pysql)
 {
+	int		flags;
+
 	switch (pysql->state) {
 	case PYKORE_PGSQL_PREINIT:
 		kore_pgsql_init(&pysql->sql);
@@ -5920,8 +7235,11 @@ pykore_pgsql_iternext(struct pykore_pgsql *pysql)
 		pysql->state = PYKORE_PGSQL_INITIALIZE;
 		/* fallthrough */
 	case PYKORE_PGSQL_INITIALIZE:
-		if (!kore_pgsql_setup(&pysql->sql, pysql->db,
-		    KORE_PGSQL_ASYNC)) {
+		flags = KORE_PGSQL_ASYNC;
+		if (pysql->stream)
+			flags |= KORE_PGSQL_SINGLE_ROW;
+
+		if (!kore_pgsql_setup(&pysql->sql, pysql->db, flags)) {
 			if (pysql->sql.state == KORE_PGSQL_STATE_INIT)
 				break;
 			PyErr_Format(PyExc_RuntimeError, "pgsql error: %s",
@@ -5930,7 +7248,17 @@ pykore_pgsql_iternext(struct pykore_pgsql *pysql)
 		}
 		/* fallthrough */
 	case PYKORE_PGSQL_QUERY:
-		if (pysql->param.count > 0) {
+		kore_pgsql_cache(&pysql->sql, pysql->cache);
+		if (pysql->prepared) {
+			if (!kore_pgsql_execute_param_fields(&pysql->sql,
+			    pysql->query, pysql->binary,
+			    pysql->param.count, pysql->param.values,
+			    pysql->param.lengths, pysql->param.formats)) {
+				PyErr_Format(PyExc_RuntimeError,
+				    "pgsql error: %s", pysql->sql.error);
+				return (NULL);
+			}
+		} else if (pysql->param.count > 0) {
 			if (!kore_pgsql_query_param_fields(&pysql->sql,
 			    pysql->query, pysql->binary,
 			    pysql->param.count, pysql->param.values,
@@ -5950,6 +7278,9 @@ pykore_pgsql_iternext(struct pykore_pgsql *pysql)
 		break;
 wait_again:
 	case PYKORE_PGSQL_WAIT:
+		if (pysql->stream)
+			return (pykore_pgsql_stream_next(pysql));
+
 		switch (pysql->sql.state) {
 		case KORE_PGSQL_STATE_WAIT:
 			break;
@@ -6004,6 +7335,70 @@ pykore_pgsql_await(PyObject *obj)
 	return (obj);
 }
 
+static PyObject *
+pykore_pgsql_aiter(struct pykore_pgsql *pysql)
+{
+	if (!pysql->stream) {
+		PyErr_SetString(PyExc_TypeError,
+		    "pgsql: async for requires stream=True");
+		return (NULL);
+	}
+
+	Py_INCREF((PyObject *)pysql);
+	return ((PyObject *)pysql);
+}
+
+/*
+ * Each __anext__ awaits the query object itself, we land here once the
+ * query is in flight. Rows are handed out one per StopIteration from the
+ * result currently held, the next one is pulled from libpq once that runs
+ * dry. In single row mode that is exactly one row per result.
+ */
+static PyObject *
+pykore_pgsql_stream_next(struct pykore_pgsql *pysql)
+{
+	PyObject			*row;
+	struct pykore_pgsql_result	*res;
+
+	for (;;) {
+		if (pysql->cursor != NULL) {
+			res = (struct pykore_pgsql_result *)pysql->cursor;
+			if (pysql->cursor_row < res->rows) {
+				row = pykore_pgsql_result_item(res,
+				    pysql->cursor_row++);
+				if (row == NULL)
+					return (NULL);
+				PyErr_SetObject(PyExc_StopIteration, row);
+				Py_DECREF(row);
+				return (NULL);
+			}
+			Py_CLEAR(pysql->cursor);
+		}
+
+		switch (pysql->sql.state) {
+		case KORE_PGSQL_STATE_WAIT:
+			Py_RETURN_NONE;
+		case KORE_PGSQL_STATE_COMPLETE:
+			PyErr_SetNone(PyExc_StopAsyncIteration);
+			return (NULL);
+		case KORE_PGSQL_STATE_ERROR:
+			PyErr_Format(PyExc_RuntimeError,
+			    "failed to perform query: %s", pysql->sql.error);
+			return (NULL);
+		case KORE_PGSQL_STATE_RESULT:
+			pysql->cursor = pykore_pgsql_result_alloc(&pysql->sql);
+			if (pysql->cursor == NULL)
+				return (NULL);
+			pysql->cursor_row = 0;
+			kore_pgsql_continue(&pysql->sql);
+			break;
+		default:
+			kore_pgsql_continue(&pysql->sql);
+			break;
+		}
+	}
+}
+
 static int
 pykore_pgsql_result(struct pykore_pgsql *pysql)
 {
@@ -6012,6 +7407,14 @@ pykore_pgsql_result(struct pykore_pgsql *pysql)
 	PyObject	*list, *pyrow, *pyval;
 	int		rows, row, field, fields, len;
 
+	if (pysql->lazy) {
+		if ((list = pykore_pgsql_result_alloc(&pysql->sql)) == NULL)
+			return (KORE_RESULT_ERROR);
+		Py_XSETREF(pysql->result, list);
+		kore_pgsql_continue(&pysql->sql);
+		return (KORE_RESULT_OK);
+	}
+
 	if ((list = PyList_New(0)) == NULL) {
 		PyErr_SetNone(PyExc_MemoryError);
 		return (KORE_RESULT_ERROR);
@@ -6070,11 +7473,265 @@ pykore_pgsql_result(struct pykore_pgsql *pysql)
 		Py_DECREF(pyrow);
 	}
 
-	pysql->result = list;
+	Py_XSETREF(pysql->result, list);
 	kore_pgsql_continue(&pysql->sql);
 
 	return (KORE_RESULT_OK);
 }
+
+static PyObject *
+pykore_pgsql_result_alloc(struct kore_pgsql *sql)
+{
+	int				i;
+	PyObject			*name;
+	struct pykore_pgsql_result	*res;
+
+	res = PyObject_New(struct pykore_pgsql_result,
+	    &pykore_pgsql_result_type);
+	if (res == NULL)
+		return (NULL);
+
+	res->names = NULL;
+
+	if ((res->result = kore_pgsql_result_take(sql)) == NULL) {
+		Py_DECREF((PyObject *)res);
+		return (PyErr_NoMemory());
+	}
+
+	res->rows = PQntuples(res->result);
+	res->fields = PQnfields(res->result);
+
+	if ((res->names = PyTuple_New(res->fields)) == NULL) {
+		Py_DECREF((PyObject *)res);
+		return (NULL);
+	}
+
+	/* Interned so every row dict shares the same key objects. */
+	for (i = 0; i < res->fields; i++) {
+		name = PyUnicode_InternFromString(PQfname(res->result, i));
+		if (name == NULL) {
+			Py_DECREF((PyObject *)res);
+			return (NULL);
+		}
+		PyTuple_SET_ITEM(res->names, i, name);
+	}
+
+	return ((PyObject *)res);
+}
+
+static void
+pykore_pgsql_result_dealloc(struct pykore_pgsql_result *res)
+{
+	if (res->result != NULL)
+		PQclear(res->result);
+
+	Py_XDECREF(res->names);
+	PyObject_Del((PyObject *)res);
+}
+
+static PyObject *
+pykore_pgsql_result_field(struct pykore_pgsql_result *res, int row, int field)
+{
+	const char	*val;
+	int		len;
+
+	if (PQgetisnull(res->result, row, field))
+		Py_RETURN_NONE;
+
+	val = PQgetvalue(res->result, row, field);
+	len = PQgetlength(res->result, row, field);
+
+	if (PQfformat(res->result, field) == KORE_PGSQL_FORMAT_BINARY)
+		return (PyBytes_FromStringAndSize(val, len));
+
+	return (PyUnicode_FromStringAndSize(val, len));
+}
+
+static int
+pykore_pgsql_result_index(struct pykore_pgsql_result *res, PyObject *key)
+{
+	long		idx;
+	const char	*name;
+
+	if (PyLong_Check(key)) {
+		idx = PyLong_AsLong(key);
+		if (idx == -1 && PyErr_Occurred())
+			return (-1);
+		if (idx < 0 || idx >= res->fields) {
+			PyErr_SetString(PyExc_IndexError,
+			    "pgsql: field index out of range");
+			return (-1);
+		}
+		return ((int)idx);
+	}
+
+	if (!PyUnicode_Check(key)) {
+		PyErr_SetString(PyExc_TypeError,
+		    "pgsql: field must be a name or index");
+		return (-1);
+	}
+
+	if ((name = PyUnicode_AsUTF8(key)) == NULL)
+		return (-1);
+
+	if ((idx = PQfnumber(res->result, name)) == -1) {
+		PyErr_Format(PyExc_KeyError, "pgsql: no field '%s'", name);
+		return (-1);
+	}
+
+	return ((int)idx);
+}
+
+static Py_ssize_t
+pykore_pgsql_result_length(struct pykore_pgsql_result *res)
+{
+	return (res->rows);
+}
+
+static PyObject *
+pykore_pgsql_result_item(struct pykore_pgsql_result *res, Py_ssize_t row)
+{
+	int		field;
+	PyObject	*dict, *val;
+
+	if (row < 0 || row >= res->rows) {
+		PyErr_SetString(PyExc_IndexError, "pgsql: row out of range");
+		return (NULL);
+	}
+
+	if ((dict = _PyDict_NewPresized(res->fields)) == NULL)
+		return (NULL);
+
+	for (field = 0; field < res->fields; field++) {
+		val = pykore_pgsql_result_field(res, row, field);
+		if (val == NULL) {
+			Py_DECREF(dict);
+			return (NULL);
+		}
+
+		if (PyDict_SetItem(dict,
+		    PyTuple_GET_ITEM(res->names, field), val) == -1) {
+			Py_DECREF(val);
+			Py_DECREF(dict);
+			return (NULL);
+		}
+
+		Py_DECREF(val);
+	}
+
+	return (dict);
+}
+
+static PyObject *
+pykore_pgsql_result_value(struct pykore_pgsql_result *res, PyObject *args)
+{
+	int		field;
+	int		row;
+	PyObject	*key;
+
+	if (!PyArg_ParseTuple(args, "iO", &row, &key))
+		return (NULL);
+
+	if (row < 0 || row >= res->rows) {
+		PyErr_SetString(PyExc_IndexError, "pgsql: row out of range");
+		return (NULL);
+	}
+
+	if ((field = pykore_pgsql_result_index(res, key)) == -1)
+		return (NULL);
+
+	return (pykore_pgsql_result_field(res, row, field));
+}
+
+static PyObject *
+pykore_pgsql_result_column(struct pykore_pgsql_result *res, PyObject *args)
+{
+	PyObject	*key, *list, *val;
+	int		row, field;
+
+	if (!PyArg_ParseTuple(args, "O", &key))
+		return (NULL);
+
+	if ((field = pykore_pgsql_result_index(res, key)) == -1)
+		return (NULL);
+
+	if ((list = PyList_New(res->rows)) == NULL)
+		return (NULL);
+
+	for (row = 0; row < res->rows; row++) {
+		if ((val = pykore_pgsql_result_field(res, row, field)) == NULL) {
+			Py_DECREF(list);
+			return (NULL);
+		}
+		PyList_SET_ITEM(list, row, val);
+	}
+
+	return (list);
+}
+
+/*
+ * Returns a memoryview straight over the value as libpq stored it, no copy
+ * is made and the result stays alive for as long as the view does.
+ */
+static PyObject *
+pykore_pgsql_result_buffer(struct pykore_pgsql_result *res, PyObject *args)
+{
+	int				field;
+	int				row;
+	PyObject			*key, *view;
+	struct pykore_pgsql_value	*value;
+
+	if (!PyArg_ParseTuple(args, "iO", &row, &key))
+		return (NULL);
+
+	if (row < 0 || row >= res->rows) {
+		PyErr_SetString(PyExc_IndexError, "pgsql: row out of range");
+		return (NULL);
+	}
+
+	if ((field = pykore_pgsql_result_index(res, key)) == -1)
+		return (NULL);
+
+	if (PQgetisnull(res->result, row, field))
+		Py_RETURN_NONE;
+
+	value = PyObject_New(struct pykore_pgsql_value,
+	    &pykore_pgsql_value_type);
+	if (value == NULL)
+		return (NULL);
+
+	value->owner = (PyObject *)res;
+	value->data = PQgetvalue(res->result, row, field);
+	value->length = PQgetlength(res->result, row, field);
+	Py_INCREF(value->owner);
+
+	view = PyMemoryView_FromObject((PyObject *)value);
+	Py_DECREF((PyObject *)value);
+
+	return (view);
+}
+
+static PyObject *
+pykore_pgsql_result_get_fields(struct pykore_pgsql_result *res, void *unused)
+{
+	Py_INCREF(res->names);
+	return (res->names);
+}
+
+static void
+pykore_pgsql_value_dealloc(struct pykore_pgsql_value *value)
+{
+	Py_XDECREF(value->owner);
+	PyObject_Del((PyObject *)value);
+}
+
+static int
+pykore_pgsql_value_getbuffer(struct pykore_pgsql_value *value,
+    Py_buffer *view, int flags)
+{
+	return (PyBuffer_FillInfo(view, (PyObject *)value, value->data,
+	    value->length, 1, flags));
+}
 #endif
 
 #if defined(KORE_USE_CURL)
@@ -6583,7 +8240,9 @@ pyhttp_client_request(struct pyhttp_client *client, int m, PyObject *kwargs)
 		return (NULL);
 	}
 
+	op->stream = 0;
 	op->headers = 0;
+	op->chunk = NULL;
 	op->coro = coro_running;
 	op->state = CURL_CLIENT_OP_RUN;
 	LIST_INIT(&op->data.slists);
@@ -6662,6 +8321,12 @@ pyhttp_client_request(struct pyhttp_client *client, int m, PyObject *kwargs)
 		}
 
 		python_bool_from_dict(kwargs, "return_headers", &op->headers);
+		python_bool_from_dict(kwargs, "stream", &op->stream);
+	}
+
+	if (op->stream) {
+		kore_curl_stream(&op->data.curl,
+		    python_curl_stream_callback, op);
 	}
 
 	return ((PyObject *)op);
@@ -6680,6 +8345,10 @@ pyhttp_client_op_dealloc(struct pyhttp_client_op *op)
 
 	Py_DECREF(op->client);
 	kore_curl_cleanup(&op->data.curl);
+
+	if (op->chunk != NULL)
+		kore_buf_free(op->chunk);
+
 	PyObject_Del((PyObject *)op);
 }
 
@@ -6690,13 +8359,119 @@ pyhttp_client_op_await(PyObject *op)
 	return (op);
 }
 
+static PyObject *
+pyhttp_client_op_aiter(struct pyhttp_client_op *op)
+{
+	if (!op->stream) {
+		PyErr_SetString(PyExc_TypeError,
+		    "httpclient request was not started with stream=True");
+		return (NULL);
+	}
+
+	Py_INCREF((PyObject *)op);
+	return ((PyObject *)op);
+}
+
+static PyObject *
+pyhttp_client_op_anext(struct pyhttp_client_op *op)
+{
+	Py_INCREF((PyObject *)op);
+	return ((PyObject *)op);
+}
+
+static PyObject *
+pyhttp_client_op_get_status(struct pyhttp_client_op *op, void *closure)
+{
+	return (PyLong_FromLong(op->data.curl.http.status));
+}
+
+static PyObject *
+pyhttp_client_op_get_headers(struct pyhttp_client_op *op, void *closure)
+{
+	if (op->stream &&
+	    !(op->data.curl.flags & KORE_CURL_FLAG_STREAM_HEADERS))
+		Py_RETURN_NONE;
+
+	if (!op->stream && op->data.curl.handle != NULL)
+		Py_RETURN_NONE;
+
+	return (pyhttp_client_op_headers(op));
+}
+
+static PyObject *
+pyhttp_client_op_headers(struct pyhttp_client_op *op)
+{
+	struct http_header	*hdr;
+	PyObject		*dict, *value;
+
+	if (!(op->data.curl.flags & KORE_CURL_FLAG_HTTP_PARSED_HEADERS))
+		kore_curl_http_parse_headers(&op->data.curl);
+
+	if ((dict = PyDict_New()) == NULL)
+		return (NULL);
+
+	TAILQ_FOREACH(hdr, &op->data.curl.http.resp_hdrs, list) {
+		value = PyUnicode_FromString(hdr->value);
+		if (value == NULL) {
+			Py_DECREF(dict);
+			return (NULL);
+		}
+
+		if (PyDict_SetItemString(dict, hdr->header, value) == -1) {
+			Py_DECREF(dict);
+			Py_DECREF(value);
+			return (NULL);
+		}
+
+		Py_DECREF(value);
+	}
+
+	return (dict);
+}
+
+/*
+ * One step of "async for chunk in op", returns the next piece of the
+ * body or raises StopAsyncIteration once the transfer is done.
+ */
+static PyObject *
+pyhttp_client_op_stream_next(struct pyhttp_client_op *op)
+{
+	PyObject	*chunk;
+
+	if (op->chunk != NULL && op->chunk->offset > 0) {
+		chunk = PyBytes_FromStringAndSize((const char *)op->chunk->data,
+		    op->chunk->offset);
+		if (chunk == NULL)
+			return (NULL);
+
+		kore_buf_reset(op->chunk);
+		kore_curl_stream_resume(&op->data.curl);
+
+		PyErr_SetObject(PyExc_StopIteration, chunk);
+		Py_DECREF(chunk);
+		return (NULL);
+	}
+
+	if (op->data.curl.handle != NULL)
+		Py_RETURN_NONE;
+
+	if (!kore_curl_success(&op->data.curl)) {
+		PyErr_Format(PyExc_RuntimeError, "request to '%s' failed: %s",
+		    op->data.curl.url, kore_curl_strerror(&op->data.curl));
+		return (NULL);
+	}
+
+	PyErr_SetNone(PyExc_StopAsyncIteration);
+
+	return (NULL);
+}
+
 static PyObject *
 pyhttp_client_op_iternext(struct pyhttp_client_op *op)
 {
 	size_t			len;
-	struct http_header	*hdr;
 	const u_int8_t		*response;
-	PyObject		*result, *tuple, *dict, *value;
+	PyObject		*result, *tuple, *dict;
 
 	if (op->state == CURL_CLIENT_OP_RUN) {
 		kore_curl_run(&op->data.curl);
@@ -6704,6 +8479,9 @@ pyhttp_client_op_iternext(struct pyhttp_client_op *op)
 		Py_RETURN_NONE;
 	}
 
+	if (op->stream)
+		return (pyhttp_client_op_stream_next(op));
+
 	if (!kore_curl_success(&op->data.curl)) {
 		PyErr_Format(PyExc_RuntimeError, "request to '%s' failed: %s",
 		    op->data.curl.url, kore_curl_strerror(&op->data.curl));
@@ -6713,28 +8491,9 @@ pyhttp_client_op_iternext(struct pyhttp_client_op *op)
 	kore_curl_response_as_bytes(&op->data.curl, &response, &len);
 
 	if (op->headers) {
-		kore_curl_http_parse_headers(&op->data.curl);
-
-		if ((dict = PyDict_New()) == NULL)
+		if ((dict = pyhttp_client_op_headers(op)) == NULL)
 			return (NULL);
 
-		TAILQ_FOREACH(hdr, &op->data.curl.http.resp_hdrs, list) {
-			value = PyUnicode_FromString(hdr->value);
-			if (value == NULL) {
-				Py_DECREF(dict);
-				return (NULL);
-			}
-
-			if (PyDict_SetItemString(dict,
-			    hdr->header, value) == -1) {
-				Py_DECREF(dict);
-				Py_DECREF(value);
-				return (NULL);
-			}
-
-			Py_DECREF(value);
-		}
-
 		if ((tuple = Py_BuildValue("(iOy#)", op->data.curl.http.status,
 		    dict, (const char *)response, len)) == NULL)
 			return (NULL);
@@ -6770,6 +8529,32 @@ python_curl_http_callback(struct kore_curl *curl, void *arg)
 		python_coro_wakeup(op->coro);
 }
 
+static int
+python_curl_stream_callback(struct kore_curl *curl, const void *data,
+    size_t len, void *arg)
+{
+	struct pyhttp_client_op		*op = arg;
+
+	if (data != NULL) {
+		/* Let the coroutine catch up before reading more. */
+		if (op->chunk != NULL &&
+		    op->chunk->offset >= CURL_CLIENT_STREAM_MAX)
+			return (KORE_RESULT_RETRY);
+
+		if (op->chunk == NULL)
+			op->chunk = kore_buf_alloc(len);
+
+		kore_buf_append(op->chunk, data, len);
+	}
+
+	if (op->coro->request != NULL)
+		http_request_wakeup(op->coro->request);
+	else
+		python_coro_wakeup(op->coro);
+
+	return (KORE_RESULT_OK);
+}
+
 static void
 python_curl_handle_callback(struct kore_curl *curl, void *arg)
 {
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Rate limiting shared by all workers.
+ *
+ * Each limiter is a GCRA (generic cell rate algorithm): every key has a
+ * theoretical arrival time (TAT) that moves forward by the emission
+ * interval for each request let through, a request is refused when the
+ * TAT is further ahead of now than the burst allows.
+ *
+ * The TATs live in an open addressed table in anonymous shared memory
+ * that the parent maps before forking the workers. Slots hold a 64-bit
+ * hash of limiter and key plus the TAT and are only ever updated with
+ * compare-and-swap, no locks. A slot whose TAT is in the past carries no
+ * state at all so it can be taken over by any key, which is also how
+ * entries expire. Two keys whose hashes collide share a budget.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include "kore.h"
+
+#define RATELIMIT_PROBES	8
+
+struct ratelimit_slot {
+	volatile u_int64_t	key;
+	volatile u_int64_t	tat;
+};
+
+static u_int64_t	ratelimit_hash(u_int64_t, const void *, size_t);
+
+static TAILQ_HEAD(, kore_ratelimit)	ratelimits =
+    TAILQ_HEAD_INITIALIZER(ratelimits);
+static struct ratelimit_slot		*ratelimit_table = NULL;
+static size_t				ratelimit_mask = 0;
+
+u_int32_t	kore_ratelimit_table_size = 65536;
+
+/*
+ * Define a limiter allowing count requests per period milliseconds per
+ * key, of which up to burst may come in at once.
+ */
+int
+kore_ratelimit_add(const char *name, u_int32_t count, u_int32_t period,
+    u_int32_t burst)
+{
+	struct kore_ratelimit	*rl;
+
+	if (count == 0 || period == 0 || burst == 0)
+		return (KORE_RESULT_ERROR);
+
+	if (kore_ratelimit_lookup(name) != NULL)
+		return (KORE_RESULT_ERROR);
+
+	rl = kore_calloc(1, sizeof(*rl));
+	rl->name = kore_strdup(name);
+	rl->seed = ratelimit_hash(14695981039346656037ULL, name, strlen(name));
+	rl->interval = ((u_int64_t)period * 1000) / count;
+	if (rl->interval == 0)
+		rl->interval = 1;
+	rl->tolerance = rl->interval * (burst - 1);
+
+	TAILQ_INSERT_TAIL(&ratelimits, rl, list);
+
+	return (KORE_RESULT_OK);
+}
+
+struct kore_ratelimit *
+kore_ratelimit_lookup(const char *name)
+{
+	struct kore_ratelimit	*rl;
+
+	TAILQ_FOREACH(rl, &ratelimits, list) {
+		if (!strcmp(rl->name, name))
+			return (rl);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Called by the parent before any worker is spawned, the table is only
+ * created if there is a limiter to keep state for.
+ */
+void
+kore_ratelimit_init(void)
+{
+	size_t		slots, len;
+
+	if (TAILQ_EMPTY(&ratelimits) || kore_ratelimit_table_size == 0)
+		return;
+
+	slots = 1;
+	while (slots < kore_ratelimit_table_size)
+		slots <<= 1;
+
+	len = slots * sizeof(struct ratelimit_slot);
+
+	ratelimit_table = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ratelimit_table == MAP_FAILED)
+		fatal("%s: mmap: %s", __func__, errno_s);
+
+	memset(ratelimit_table, 0, len);
+	ratelimit_mask = slots - 1;
+}
+
+/*
+ * Account for a request with the given key. Returns KORE_RESULT_ERROR if
+ * it goes over the limit, *retry is then set to the number of
+ * milliseconds until a request with this key will be let through again.
+ */
+int
+kore_ratelimit_check(struct kore_ratelimit *rl, const void *key, size_t len,
+    u_int64_t *retry)
+{
+	size_t			idx, probe;
+	struct ratelimit_slot	*slot, *free;
+	u_int64_t		hash, now, tat, next, cur;
+
+	if (retry != NULL)
+		*retry = 0;
+
+	if (ratelimit_table == NULL)
+		return (KORE_RESULT_OK);
+
+	/* A zero key marks an unused slot. */
+	if ((hash = ratelimit_hash(rl->seed, key, len)) == 0)
+		hash = 1;
+
+	now = kore_time_us();
+
+again:
+	free = NULL;
+	slot = NULL;
+	idx = hash & ratelimit_mask;
+
+	for (probe = 0; probe < RATELIMIT_PROBES; probe++) {
+		cur = ratelimit_table[(idx + probe) & ratelimit_mask].key;
+		if (cur == hash) {
+			slot = &ratelimit_table[(idx + probe) & ratelimit_mask];
+			break;
+		}
+
+		if (free == NULL &&
+		    ratelimit_table[(idx + probe) & ratelimit_mask].tat <= now)
+			free = &ratelimit_table[(idx + probe) & ratelimit_mask];
+	}
+
+	if (slot == NULL) {
+		/* Every slot we may use is busy, let the request through. */
+		if (free == NULL)
+			return (KORE_RESULT_OK);
+
+		cur = free->key;
+		if (free->tat > now ||
+		    !__sync_bool_compare_and_swap(&free->key, cur, hash))
+			goto again;
+
+		slot = free;
+	}
+
+	for (;;) {
+		tat = slot->tat;
+		next = MAX(tat, now);
+
+		if (next - now > rl->tolerance) {
+			if (retry != NULL) {
+				*retry = next - now - rl->tolerance;
+				*retry = (*retry + 999) / 1000;
+			}
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (__sync_bool_compare_and_swap(&slot->tat, tat,
+		    next + rl->interval))
+			break;
+	}
+
+	/* Someone took the slot over between finding it and updating it. */
+	if (slot->key != hash)
+		goto again;
+
+	return (KORE_RESULT_OK);
+}
+
+/* Returns the KORE_RATELIMIT_KEY_* for the given name, or -1. */
+int
+kore_ratelimit_key(const char *name)
+{
+	if (!strcmp(name, "address"))
+		return (KORE_RATELIMIT_KEY_ADDRESS);
+	if (!strcmp(name, "route"))
+		return (KORE_RATELIMIT_KEY_ROUTE);
+	if (!strcmp(name, "auth"))
+		return (KORE_RATELIMIT_KEY_AUTH);
+
+	return (-1);
+}
+
+/* Account for a new connection or request from the address of c. */
+int
+kore_ratelimit_connection(struct kore_ratelimit *rl, struct connection *c,
+    u_int64_t *retry)
+{
+	switch (c->family) {
+	case AF_INET:
+		return (kore_ratelimit_check(rl, &c->addr.ipv4.sin_addr,
+		    sizeof(c->addr.ipv4.sin_addr), retry));
+	case AF_INET6:
+		return (kore_ratelimit_check(rl, &c->addr.ipv6.sin6_addr,
+		    sizeof(c->addr.ipv6.sin6_addr), retry));
+	default:
+		if (retry != NULL)
+			*retry = 0;
+		return (KORE_RESULT_OK);
+	}
+}
+
+/* FNV-1a, finished with the murmur3 mixer so the low bits spread well. */
+static u_int64_t
+ratelimit_hash(u_int64_t hash, const void *data, size_t len)
+{
+	size_t			idx;
+	const u_int8_t		*p = data;
+
+	for (idx = 0; idx < len; idx++) {
+		hash ^= p[idx];
+		hash *= 1099511628211ULL;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return (hash);
+}
@@ -17,11 +17,66 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <ctype.h>
 #include <dlfcn.h>
 
 #include "kore.h"
 #include "http.h"
 
+#define ROUTE_SEG_LITERAL	1
+#define ROUTE_SEG_DIGITS	2
+#define ROUTE_SEG_ANY		3
+
+/*
+ * A dynamic route whose regex is made up only of literals and whole
+ * path segments matching [0-9]+ or [^/]+ is compiled into segments
+ * and matched without regexec().
+ */
+struct kore_route_seg {
+	int			type;
+	int			capture;
+	size_t			len;
+	char			*data;
+};
+
+struct route_list {
+	size_t			cnt;
+	struct kore_route	**routes;
+};
+
+/*
+ * Radix tree node. Static routes hang off the node matching their path
+ * exactly, dynamic routes off the node matching their literal prefix.
+ */
+struct route_node {
+	char			*label;
+	size_t			len;
+	struct route_list	exact;
+	struct route_list	prefix;
+	size_t			nchild;
+	struct route_node	**child;
+};
+
+struct kore_router {
+	struct route_node	*root;
+	struct kore_route	**cands;
+};
+
+static void	route_index_build(struct kore_domain *);
+static void	route_typed_compile(struct kore_route *);
+static int	route_typed_match(struct kore_route *, struct http_request *);
+static size_t	route_regex_prefix(const char *, char *);
+static void	route_list_add(struct route_list *, struct kore_route *);
+static void	route_list_collect(struct route_list *, struct kore_route **,
+		    size_t *);
+static void	route_node_free(struct route_node *);
+static struct route_node	*route_node_new(const char *, size_t);
+static struct route_node	*route_node_child(struct route_node *, char);
+static struct route_node	*route_node_insert(struct route_node *,
+				    const char *, size_t);
+
+static u_int32_t		route_metrics_next = 0;
+
 struct kore_route *
 kore_route_create(struct kore_domain *dom, const char *path, int type)
 {
@@ -33,6 +88,15 @@ kore_route_create(struct kore_domain *dom, const char *path, int type)
 	rt->path = kore_strdup(path);
 	rt->methods = HTTP_METHOD_ALL;
 
+	/*
+	 * Only routes known before the workers fork have the same metrics
+	 * slot in all of them, anything created later is not tracked.
+	 */
+	if (worker == NULL && route_metrics_next < KORE_METRICS_ROUTES)
+		rt->metrics_id = route_metrics_next++;
+	else
+		rt->metrics_id = KORE_METRICS_ROUTES;
+
 	TAILQ_INIT(&rt->params);
 
 	if (rt->type == HANDLER_TYPE_DYNAMIC) {
@@ -43,6 +107,7 @@ kore_route_create(struct kore_domain *dom, const char *path, int type)
 	}
 
 	TAILQ_INSERT_TAIL(&dom->routes, rt, list);
+	kore_route_index_free(dom);
 
 	return (rt);
 }
@@ -50,6 +115,7 @@ kore_route_create(struct kore_domain *dom, const char *path, int type)
 void
 kore_route_free(struct kore_route *rt)
 {
+	size_t				idx;
 	struct kore_route_params	*param;
 
 	if (rt == NULL)
@@ -61,6 +127,15 @@ kore_route_free(struct kore_route *rt)
 	if (rt->type == HANDLER_TYPE_DYNAMIC)
 		regfree(&rt->rctx);
 
+	for (idx = 0; idx < rt->nsegs; idx++)
+		kore_free(rt->segs[idx].data);
+	kore_free(rt->segs);
+
+#if defined(KORE_USE_COMPRESS)
+	http_compress_conf_free(rt->compress);
+#endif
+	http_cache_conf_free(rt->cache);
+
 	/* Drop all validators associated with this handler */
 	while ((param = TAILQ_FIRST(&rt->params)) != NULL) {
 		TAILQ_REMOVE(&rt->params, param, list);
@@ -85,36 +160,92 @@ int
 kore_route_lookup(struct http_request *req, struct kore_domain *dom,
     int method, struct kore_route **out)
 {
-	struct kore_route	*rt;
+	struct route_node	*node, *child;
+	struct kore_route	*rt, **cands;
+	const char		*path;
+	size_t			len, cnt, i, j;
 	int			exists;
 
 	exists = 0;
 	*out = NULL;
 
-	TAILQ_FOREACH(rt, &dom->routes, list) {
-		if (rt->type == HANDLER_TYPE_STATIC) {
-			if (!strcmp(rt->path, req->path)) {
-				if (rt->methods & method) {
-					*out = rt;
-					return (1);
-				}
-				exists++;
-			}
-		} else {
-			if (!regexec(&rt->rctx, req->path,
+	if (dom->router == NULL)
+		route_index_build(dom);
+
+	cnt = 0;
+	path = req->path;
+	len = strlen(path);
+	node = dom->router->root;
+	cands = dom->router->cands;
+
+	/* Collect all routes on the branch that can still match. */
+	for (;;) {
+		route_list_collect(&node->prefix, cands, &cnt);
+
+		if (len == 0) {
+			route_list_collect(&node->exact, cands, &cnt);
+			break;
+		}
+
+		if ((child = route_node_child(node, *path)) == NULL)
+			break;
+
+		if (child->len > len || memcmp(child->label, path, child->len))
+			break;
+
+		path += child->len;
+		len -= child->len;
+		node = child;
+	}
+
+	/* Candidates are tried in the order they were configured. */
+	for (i = 1; i < cnt; i++) {
+		rt = cands[i];
+		for (j = i; j > 0 && cands[j - 1]->order > rt->order; j--)
+			cands[j] = cands[j - 1];
+		cands[j] = rt;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		rt = cands[i];
+
+		if (rt->type == HANDLER_TYPE_DYNAMIC) {
+			if (rt->segs != NULL) {
+				if (!route_typed_match(rt, req))
+					continue;
+			} else if (regexec(&rt->rctx, req->path,
 			    HTTP_CAPTURE_GROUPS, req->cgroups, 0)) {
-				if (rt->methods & method) {
-					*out = rt;
-					return (1);
-				}
-				exists++;
+				continue;
 			}
 		}
+
+		if (rt->methods & method) {
+			KORE_PROBE3(route__lookup, req, req->path, rt->path);
+			*out = rt;
+			return (1);
+		}
+
+		exists++;
 	}
 
+	KORE_PROBE3(route__lookup, req, req->path, "");
+
 	return (exists);
 }
 
+void
+kore_route_index_free(struct kore_domain *dom)
+{
+	if (dom->router == NULL)
+		return;
+
+	route_node_free(dom->router->root);
+	kore_free(dom->router->cands);
+	kore_free(dom->router);
+
+	dom->router = NULL;
+}
+
 void
 kore_route_reload(void)
 {
@@ -125,6 +256,9 @@ kore_route_reload(void)
 	LIST_FOREACH(srv, &kore_servers, list) {
 		TAILQ_FOREACH(dom, &srv->domains, list) {
 			TAILQ_FOREACH(rt, &dom->routes, list) {
+				/* Proxy routes have no callback of their own. */
+				if (rt->func == NULL && rt->upstream != NULL)
+					continue;
 				kore_free(rt->rcall);
 				rt->rcall = kore_runtime_getcall(rt->func);
 				if (rt->rcall == NULL) {
@@ -136,3 +270,352 @@ kore_route_reload(void)
 		}
 	}
 }
+
+static void
+route_index_build(struct kore_domain *dom)
+{
+	struct kore_router	*router;
+	struct route_node	*node;
+	struct kore_route	*rt;
+	char			*prefix;
+	size_t			len;
+	u_int32_t		order;
+
+	router = kore_calloc(1, sizeof(*router));
+	router->root = route_node_new(NULL, 0);
+
+	order = 0;
+	TAILQ_FOREACH(rt, &dom->routes, list) {
+		rt->order = order++;
+
+		if (rt->type == HANDLER_TYPE_STATIC) {
+			node = route_node_insert(router->root,
+			    rt->path, strlen(rt->path));
+			route_list_add(&node->exact, rt);
+			continue;
+		}
+
+		if (rt->segs == NULL)
+			route_typed_compile(rt);
+
+		prefix = kore_malloc(strlen(rt->path) + 1);
+		len = route_regex_prefix(rt->path, prefix);
+		node = route_node_insert(router->root, prefix, len);
+		route_list_add(&node->prefix, rt);
+		kore_free(prefix);
+	}
+
+	router->cands = kore_calloc(order + 1, sizeof(struct kore_route *));
+	dom->router = router;
+}
+
+/*
+ * Returns the literal prefix every path matched by an anchored regex
+ * must start with. Anything we cannot reason about yields an empty
+ * prefix, which places the route at the root of the tree.
+ */
+static size_t
+route_regex_prefix(const char *regex, char *out)
+{
+	size_t		len;
+	const char	*p;
+
+	if (*regex != '^' || strchr(regex, '|') != NULL)
+		return (0);
+
+	len = 0;
+	p = regex + 1;
+
+	while (*p != '\0') {
+		if (*p == '\\') {
+			if (p[1] == '\0' || isalnum(*(const u_int8_t *)(p + 1)))
+				break;
+			out[len++] = p[1];
+			p += 2;
+		} else if (strchr(".[]()*+?{}^$", *p) != NULL) {
+			break;
+		} else {
+			out[len++] = *p++;
+		}
+
+		/* The last literal may be optional. */
+		if (*p == '*' || *p == '?' || *p == '{') {
+			len--;
+			break;
+		}
+	}
+
+	return (len);
+}
+
+static void
+route_typed_compile(struct kore_route *rt)
+{
+	struct kore_route_seg	*segs;
+	const char		*p, *q;
+	char			*lit;
+	size_t			nsegs, len, idx;
+	int			type, capture;
+
+	if (*rt->path != '^')
+		return;
+
+	len = 0;
+	nsegs = 0;
+	lit = kore_malloc(strlen(rt->path) + 1);
+	segs = kore_calloc(strlen(rt->path), sizeof(*segs));
+
+	p = rt->path + 1;
+	while (*p != '$') {
+		if (*p == '\0')
+			goto fail;
+
+		if (*p == '(' || *p == '[') {
+			capture = (*p == '(');
+			q = p + capture;
+
+			if (!strncmp(q, "[0-9]+", 6)) {
+				type = ROUTE_SEG_DIGITS;
+				q += 6;
+			} else if (!strncmp(q, "[^/]+", 5)) {
+				type = ROUTE_SEG_ANY;
+				q += 5;
+			} else {
+				goto fail;
+			}
+
+			if (capture) {
+				if (*q != ')')
+					goto fail;
+				q++;
+			}
+
+			/* Only whole path segments are supported. */
+			if (len == 0 || lit[len - 1] != '/')
+				goto fail;
+			if (*q != '/' && *q != '$')
+				goto fail;
+
+			segs[nsegs].type = ROUTE_SEG_LITERAL;
+			segs[nsegs].len = len;
+			segs[nsegs].data = kore_malloc(len);
+			memcpy(segs[nsegs].data, lit, len);
+			nsegs++;
+
+			segs[nsegs].type = type;
+			segs[nsegs].capture = capture;
+			nsegs++;
+
+			len = 0;
+			p = q;
+			continue;
+		}
+
+		if (*p == '\\') {
+			if (p[1] == '\0' || isalnum(*(const u_int8_t *)(p + 1)))
+				goto fail;
+			lit[len++] = p[1];
+			p += 2;
+		} else if (strchr(".[]()*+?{}|^", *p) != NULL) {
+			goto fail;
+		} else {
+			lit[len++] = *p++;
+		}
+	}
+
+	if (p[1] != '\0')
+		goto fail;
+
+	if (len > 0) {
+		segs[nsegs].type = ROUTE_SEG_LITERAL;
+		segs[nsegs].len = len;
+		segs[nsegs].data = kore_malloc(len);
+		memcpy(segs[nsegs].data, lit, len);
+		nsegs++;
+	}
+
+	kore_free(lit);
+
+	rt->segs = segs;
+	rt->nsegs = nsegs;
+
+	return;
+
+fail:
+	for (idx = 0; idx < nsegs; idx++)
+		kore_free(segs[idx].data);
+
+	kore_free(segs);
+	kore_free(lit);
+}
+
+static int
+route_typed_match(struct kore_route *rt, struct http_request *req)
+{
+	struct kore_route_seg	*seg;
+	const char		*p;
+	size_t			idx, len, i;
+	int			grp;
+	regmatch_t		groups[HTTP_CAPTURE_GROUPS];
+
+	grp = 1;
+	p = req->path;
+
+	for (idx = 0; idx < rt->nsegs; idx++) {
+		seg = &rt->segs[idx];
+
+		if (seg->type == ROUTE_SEG_LITERAL) {
+			if (strncmp(p, seg->data, seg->len))
+				return (0);
+			p += seg->len;
+			continue;
+		}
+
+		if ((len = strcspn(p, "/")) == 0)
+			return (0);
+
+		if (seg->type == ROUTE_SEG_DIGITS) {
+			for (i = 0; i < len; i++) {
+				if (p[i] < '0' || p[i] > '9')
+					return (0);
+			}
+		}
+
+		if (seg->capture && grp < HTTP_CAPTURE_GROUPS) {
+			groups[grp].rm_so = p - req->path;
+			groups[grp].rm_eo = groups[grp].rm_so + len;
+			grp++;
+		}
+
+		p += len;
+	}
+
+	if (*p != '\0')
+		return (0);
+
+	req->cgroups[0].rm_so = 0;
+	req->cgroups[0].rm_eo = p - req->path;
+
+	for (i = 1; i < HTTP_CAPTURE_GROUPS; i++) {
+		if ((int)i < grp) {
+			req->cgroups[i] = groups[i];
+		} else {
+			req->cgroups[i].rm_so = -1;
+			req->cgroups[i].rm_eo = -1;
+		}
+	}
+
+	return (1);
+}
+
+static void
+route_list_add(struct route_list *list, struct kore_route *rt)
+{
+	list->routes = kore_realloc(list->routes,
+	    (list->cnt + 1) * sizeof(struct kore_route *));
+	list->routes[list->cnt++] = rt;
+}
+
+static void
+route_list_collect(struct route_list *list, struct kore_route **cands,
+    size_t *cnt)
+{
+	size_t		i;
+
+	for (i = 0; i < list->cnt; i++)
+		cands[(*cnt)++] = list->routes[i];
+}
+
+static struct route_node *
+route_node_new(const char *label, size_t len)
+{
+	struct route_node	*node;
+
+	node = kore_calloc(1, sizeof(*node));
+
+	if (len > 0) {
+		node->len = len;
+		node->label = kore_malloc(len);
+		memcpy(node->label, label, len);
+	}
+
+	return (node);
+}
+
+static struct route_node *
+route_node_child(struct route_node *node, char ch)
+{
+	size_t		i;
+
+	for (i = 0; i < node->nchild; i++) {
+		if (node->child[i]->label[0] == ch)
+			return (node->child[i]);
+	}
+
+	return (NULL);
+}
+
+static struct route_node *
+route_node_insert(struct route_node *node, const char *key, size_t len)
+{
+	size_t			i, n;
+	char			*label;
+	struct route_node	*child, *split;
+
+	while (len > 0) {
+		if ((child = route_node_child(node, *key)) == NULL) {
+			child = route_node_new(key, len);
+			node->child = kore_realloc(node->child,
+			    (node->nchild + 1) * sizeof(struct route_node *));
+			node->child[node->nchild++] = child;
+			return (child);
+		}
+
+		for (n = 0; n < child->len && n < len; n++) {
+			if (child->label[n] != key[n])
+				break;
+		}
+
+		/* Split the edge so the new key ends on a node. */
+		if (n < child->len) {
+			split = route_node_new(child->label, n);
+			split->child = kore_malloc(sizeof(struct route_node *));
+			split->child[0] = child;
+			split->nchild = 1;
+
+			label = kore_malloc(child->len - n);
+			memcpy(label, child->label + n, child->len - n);
+			kore_free(child->label);
+			child->label = label;
+			child->len -= n;
+
+			for (i = 0; i < node->nchild; i++) {
+				if (node->child[i] == child)
+					node->child[i] = split;
+			}
+
+			child = split;
+		}
+
+		node = child;
+		key += n;
+		len -= n;
+	}
+
+	return (node);
+}
+
+static void
+route_node_free(struct route_node *node)
+{
+	size_t		i;
+
+	for (i = 0; i < node->nchild; i++)
+		route_node_free(node->child[i]);
+
+	kore_free(node->child);
+	kore_free(node->label);
+	kore_free(node->exact.routes);
+	kore_free(node->prefix.routes);
+	kore_free(node);
+}
@@ -55,6 +55,9 @@ static struct sock_filter filter_kore[] = {
 	KORE_SYSCALL_ALLOW(open),
 #endif
 	KORE_SYSCALL_ALLOW(read),
+#if defined(SYS_pread64)
+	KORE_SYSCALL_ALLOW(pread64),
+#endif
 #if defined(SYS_stat)
 	KORE_SYSCALL_ALLOW(stat),
 #endif
@@ -67,6 +70,9 @@ static struct sock_filter filter_kore[] = {
 	KORE_SYSCALL_ALLOW(fstat),
 #if defined(SYS_fstat64)
 	KORE_SYSCALL_ALLOW(fstat64),
+#endif
+#if defined(SYS_newfstatat)
+	KORE_SYSCALL_ALLOW(newfstatat),
 #endif
 	KORE_SYSCALL_ALLOW(write),
 	KORE_SYSCALL_ALLOW(fcntl),
@@ -93,6 +99,9 @@ static struct sock_filter filter_kore[] = {
 #if defined(SYS_readlinkat)
 	KORE_SYSCALL_ALLOW(readlinkat),
 #endif
+	KORE_SYSCALL_ALLOW(inotify_init1),
+	KORE_SYSCALL_ALLOW(inotify_add_watch),
+	KORE_SYSCALL_ALLOW(inotify_rm_watch),
 
 	/* Process related. */
 	KORE_SYSCALL_ALLOW(exit),
@@ -141,6 +150,7 @@ static struct sock_filter filter_kore[] = {
 #endif
 	KORE_SYSCALL_ALLOW(sendto),
 	KORE_SYSCALL_ALLOW(accept),
+	KORE_SYSCALL_ALLOW(accept4),
 	KORE_SYSCALL_ALLOW(sendfile),
 #if defined(SYS_recv)
 	KORE_SYSCALL_ALLOW(recv),
@@ -148,10 +158,19 @@ static struct sock_filter filter_kore[] = {
 	KORE_SYSCALL_ALLOW(recvfrom),
 	KORE_SYSCALL_ALLOW(epoll_ctl),
 	KORE_SYSCALL_ALLOW(setsockopt),
+	KORE_SYSCALL_ALLOW(sendmsg),
+	KORE_SYSCALL_ALLOW(recvmsg),
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+	KORE_SYSCALL_ALLOW(getsockopt),
+#endif
 #if defined(SYS_epoll_wait)
 	KORE_SYSCALL_ALLOW(epoll_wait),
 #endif
 	KORE_SYSCALL_ALLOW(epoll_pwait),
+#if defined(KORE_USE_IO_URING)
+	KORE_SYSCALL_ALLOW(io_uring_setup),
+	KORE_SYSCALL_ALLOW(io_uring_enter),
+#endif
 
 	/* Signal related. */
 	KORE_SYSCALL_ALLOW(sigaltstack),
@@ -0,0 +1,646 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Server-Sent Events (text/event-stream).
+ *
+ * After kore_sse_handshake() a connection only carries events, it can be
+ * subscribed to any number of channels. An event published on a channel
+ * is formatted once into a shared buffer that is queued by reference on
+ * all of its subscribers.
+ *
+ * Every channel keeps its last kore_sse_history events so that a client
+ * reconnecting with a Last-Event-ID gets what it missed replayed when it
+ * subscribes again. Event ids come from a counter shared by all workers,
+ * seeded from the wall clock so they keep going up across restarts. A
+ * global publish is passed on to all other workers, not only the ones
+ * with subscribers, so their history is complete when a client lands on
+ * another worker after reconnecting.
+ *
+ * Connections that did not get an event for half of kore_sse_heartbeat
+ * are sent a comment line by a single timer per worker, keeping proxies
+ * from timing the stream out.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "kore.h"
+#include "http.h"
+
+#define SSE_CHANNEL_BUCKETS	256
+
+struct sse_event {
+	u_int64_t		id;
+	struct netbuf_shared	*buf;
+};
+
+struct sse_channel {
+	char				*name;
+	u_int32_t			hash;
+	struct sse_event		*history;
+	u_int32_t			head;
+	u_int32_t			count;
+	TAILQ_HEAD(, sse_sub)		subs;
+	LIST_ENTRY(sse_channel)		list;
+};
+
+struct sse_sub {
+	struct sse_client		*client;
+	struct sse_channel		*channel;
+	TAILQ_ENTRY(sse_sub)		tlist;
+	LIST_ENTRY(sse_sub)		clist;
+};
+
+struct sse_client {
+	struct connection		*c;
+	u_int64_t			last_id;
+	u_int64_t			last_send;
+	LIST_HEAD(, sse_sub)		subs;
+	TAILQ_ENTRY(sse_client)		list;
+};
+
+static int	sse_recv(struct netbuf *);
+static void	sse_disconnect(struct connection *);
+static void	sse_heartbeat(void *, u_int64_t);
+static void	sse_msg(struct kore_msg *, const void *);
+static void	sse_deliver(const char *, u_int32_t, u_int64_t,
+		    const char *, const void *, size_t);
+static int	sse_event_valid(const char *);
+static void	sse_client_send(struct sse_client *, struct netbuf_shared *,
+		    u_int64_t);
+static void	sse_sub_remove(struct sse_sub *);
+static void	sse_channel_free(struct sse_channel *);
+static void	sse_channel_record(struct sse_channel *, u_int64_t,
+		    struct netbuf_shared *);
+static void	sse_channel_replay(struct sse_channel *, struct sse_client *);
+static u_int32_t		sse_channel_hash(const char *, size_t);
+static struct sse_channel	*sse_channel_lookup(const char *, u_int32_t);
+static struct netbuf_shared	*sse_event_format(u_int64_t, const char *,
+				    const void *, size_t);
+
+static const char	sse_ping[] = ":\n\n";
+
+static LIST_HEAD(, sse_channel)	channels[SSE_CHANNEL_BUCKETS];
+static TAILQ_HEAD(, sse_client)	clients = TAILQ_HEAD_INITIALIZER(clients);
+static struct kore_timer	*heartbeat = NULL;
+static struct kore_buf		sse_buf;
+static volatile u_int64_t	*sse_sequence = NULL;
+static u_int64_t		sse_local_sequence = 0;
+
+u_int32_t	kore_sse_history = 64;
+u_int32_t	kore_sse_heartbeat = 15000;
+
+/*
+ * Called by the parent before any worker is spawned so the event id
+ * counter is shared by all of them.
+ */
+void
+kore_sse_init(void)
+{
+	sse_sequence = mmap(NULL, sizeof(*sse_sequence),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sse_sequence == MAP_FAILED)
+		fatal("%s: mmap: %s", __func__, errno_s);
+
+	*sse_sequence = (u_int64_t)time(NULL) * 1000000;
+}
+
+void
+kore_sse_worker_init(void)
+{
+	kore_buf_init(&sse_buf, 1024);
+	kore_msg_register(KORE_MSG_SSE, sse_msg);
+}
+
+/*
+ * Turn the request into an event stream. Over HTTP/2 the stream is reset
+ * with HTTP_1_1_REQUIRED instead, an event stream cannot be carried by it
+ * here, and clients retry on an HTTP/1.1 connection.
+ */
+void
+kore_sse_handshake(struct http_request *req, const char *onconnect,
+    const char *ondisconnect)
+{
+	int			err;
+	struct sse_client	*client;
+	const char		*hdr;
+	struct connection	*c = req->owner;
+
+	if (c->proto == CONN_PROTO_HTTP2) {
+		http2_request_http11(req);
+		return;
+	}
+
+	if (req->method != HTTP_METHOD_GET) {
+		http_response_header(req, "allow", "get");
+		http_response(req, HTTP_STATUS_METHOD_NOT_ALLOWED, NULL, 0);
+		return;
+	}
+
+	client = kore_malloc(sizeof(*client));
+	client->c = c;
+	client->last_id = 0;
+	client->last_send = kore_time_ms();
+	LIST_INIT(&client->subs);
+
+	if (http_request_header(req, "last-event-id", &hdr)) {
+		client->last_id = kore_strtonum64(hdr, 0, &err);
+		if (err != KORE_RESULT_OK)
+			client->last_id = 0;
+	}
+
+	TAILQ_INSERT_TAIL(&clients, client, list);
+	c->sse = client;
+
+	kore_debug("%p: new sse connection", c);
+
+	req->flags |= HTTP_REQUEST_NO_CONTENT_LENGTH;
+	http_response_header(req, "content-type", "text/event-stream");
+	http_response_header(req, "cache-control", "no-cache");
+
+	c->proto = CONN_PROTO_SSE;
+	http_response(req, HTTP_STATUS_OK, NULL, 0);
+	net_recv_pooled(c, sse_recv);
+
+	c->disconnect = sse_disconnect;
+	c->http_timeout = 0;
+	c->idle_timer.length = KORE_WAIT_INFINITE;
+	kore_connection_timeout_update(c);
+
+	if (heartbeat == NULL && kore_sse_heartbeat > 0)
+		heartbeat = kore_timer_add(sse_heartbeat, kore_sse_heartbeat,
+		    NULL, 0);
+
+	if (onconnect != NULL) {
+		c->ws_connect = kore_runtime_getcall(onconnect);
+		if (c->ws_connect == NULL)
+			fatal("no symbol '%s' for sse connect", onconnect);
+	} else {
+		c->ws_connect = NULL;
+	}
+
+	if (ondisconnect != NULL) {
+		c->ws_disconnect = kore_runtime_getcall(ondisconnect);
+		if (c->ws_disconnect == NULL)
+			fatal("no symbol '%s' for sse disconnect", ondisconnect);
+	} else {
+		c->ws_disconnect = NULL;
+	}
+
+	if (c->ws_connect != NULL)
+		kore_runtime_wsconnect(c->ws_connect, c);
+}
+
+/* Send an event to a single connection, it gets no id. */
+void
+kore_sse_send(struct connection *c, const char *event, const void *data,
+    size_t len)
+{
+	struct netbuf_shared	*sh;
+
+	if (c->sse == NULL || !sse_event_valid(event))
+		return;
+
+	sh = sse_event_format(0, event, data, len);
+	sse_client_send(c->sse, sh, kore_time_ms());
+	net_shared_release(sh);
+}
+
+int
+kore_sse_subscribe(struct connection *c, const char *channel)
+{
+	size_t			len;
+	u_int32_t		hash;
+	struct sse_sub		*sub;
+	struct sse_channel	*ch;
+	struct sse_client	*client = c->sse;
+
+	if (c->proto != CONN_PROTO_SSE || client == NULL)
+		return (KORE_RESULT_ERROR);
+
+	len = strlen(channel);
+	if (len == 0 || len > KORE_SSE_CHANNEL_MAX)
+		return (KORE_RESULT_ERROR);
+
+	hash = sse_channel_hash(channel, len);
+
+	LIST_FOREACH(sub, &client->subs, clist) {
+		if (sub->channel->hash == hash &&
+		    !strcmp(sub->channel->name, channel))
+			return (KORE_RESULT_OK);
+	}
+
+	if ((ch = sse_channel_lookup(channel, hash)) == NULL) {
+		ch = kore_calloc(1, sizeof(*ch));
+		ch->hash = hash;
+		ch->name = kore_strdup(channel);
+		TAILQ_INIT(&ch->subs);
+		LIST_INSERT_HEAD(&channels[hash & (SSE_CHANNEL_BUCKETS - 1)],
+		    ch, list);
+	}
+
+	sub = kore_malloc(sizeof(*sub));
+	sub->client = client;
+	sub->channel = ch;
+
+	TAILQ_INSERT_TAIL(&ch->subs, sub, tlist);
+	LIST_INSERT_HEAD(&client->subs, sub, clist);
+
+	if (client->last_id != 0)
+		sse_channel_replay(ch, client);
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_sse_unsubscribe(struct connection *c, const char *channel)
+{
+	u_int32_t		hash;
+	struct sse_sub		*sub;
+
+	if (c->sse == NULL)
+		return (KORE_RESULT_ERROR);
+
+	hash = sse_channel_hash(channel, strlen(channel));
+
+	LIST_FOREACH(sub, &c->sse->subs, clist) {
+		if (sub->channel->hash == hash &&
+		    !strcmp(sub->channel->name, channel)) {
+			sse_sub_remove(sub);
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
+/*
+ * Publish an event on a channel, event may be NULL for the default
+ * "message" type. With SSE_PUBLISH_GLOBAL it goes out on all workers.
+ * Returns the id of the event or 0 if it was not valid.
+ */
+u_int64_t
+kore_sse_publish(const char *channel, const char *event, const void *data,
+    size_t len, int scope)
+{
+	u_int8_t	*msg;
+	u_int64_t	id;
+	size_t		clen, elen, mlen;
+
+	clen = strlen(channel);
+	if (clen == 0 || clen > KORE_SSE_CHANNEL_MAX)
+		return (0);
+
+	if (!sse_event_valid(event))
+		return (0);
+
+	if (sse_sequence != NULL)
+		id = __sync_add_and_fetch(sse_sequence, 1);
+	else
+		id = ++sse_local_sequence;
+
+	sse_deliver(channel, sse_channel_hash(channel, clen), id,
+	    event, data, len);
+
+	if (scope == SSE_PUBLISH_GLOBAL && worker != NULL) {
+		elen = (event != NULL) ? strlen(event) : 0;
+		mlen = sizeof(id) + 2 + clen + elen + len;
+		msg = kore_malloc(mlen);
+
+		memcpy(msg, &id, sizeof(id));
+		msg[sizeof(id)] = (u_int8_t)clen;
+		msg[sizeof(id) + 1] = (u_int8_t)elen;
+		memcpy(&msg[sizeof(id) + 2], channel, clen);
+		if (elen > 0)
+			memcpy(&msg[sizeof(id) + 2 + clen], event, elen);
+		if (data != NULL && len > 0)
+			memcpy(&msg[sizeof(id) + 2 + clen + elen], data, len);
+
+		kore_msg_send(KORE_MSG_WORKER_ALL, KORE_MSG_SSE, msg, mlen);
+		kore_free(msg);
+	}
+
+	return (id);
+}
+
+void
+kore_sse_cleanup(struct connection *c)
+{
+	struct sse_sub		*sub;
+	struct sse_client	*client;
+
+	if ((client = c->sse) == NULL)
+		return;
+
+	while ((sub = LIST_FIRST(&client->subs)) != NULL)
+		sse_sub_remove(sub);
+
+	TAILQ_REMOVE(&clients, client, list);
+	kore_free(client);
+
+	c->sse = NULL;
+}
+
+/* Clients have nothing to say on an event stream, drop what they send. */
+static int
+sse_recv(struct netbuf *nb)
+{
+	nb->s_off = 0;
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+sse_disconnect(struct connection *c)
+{
+	kore_sse_cleanup(c);
+
+	if (c->ws_disconnect != NULL)
+		kore_runtime_wsdisconnect(c->ws_disconnect, c);
+}
+
+static void
+sse_heartbeat(void *arg, u_int64_t now)
+{
+	struct sse_client	*client, *next;
+
+	for (client = TAILQ_FIRST(&clients); client != NULL; client = next) {
+		next = TAILQ_NEXT(client, list);
+
+		if (now - client->last_send < kore_sse_heartbeat / 2)
+			continue;
+
+		client->last_send = now;
+		net_send_queue(client->c, sse_ping, sizeof(sse_ping) - 1);
+		if (!net_send_flush(client->c))
+			kore_connection_disconnect(client->c);
+	}
+}
+
+/*
+ * A global publish from another worker: the id, the lengths of channel
+ * and event name, both of those and the data.
+ */
+static void
+sse_msg(struct kore_msg *msg, const void *data)
+{
+	u_int64_t		id;
+	size_t			clen, elen, off;
+	const u_int8_t		*hdr = data;
+	char			channel[KORE_SSE_CHANNEL_MAX + 1];
+	char			event[KORE_SSE_EVENT_MAX + 1];
+
+	if (msg->src == worker->id || msg->length < sizeof(id) + 2)
+		return;
+
+	memcpy(&id, hdr, sizeof(id));
+	clen = hdr[sizeof(id)];
+	elen = hdr[sizeof(id) + 1];
+	off = sizeof(id) + 2;
+
+	if (clen == 0 || clen > KORE_SSE_CHANNEL_MAX ||
+	    elen > KORE_SSE_EVENT_MAX || msg->length < off + clen + elen)
+		return;
+
+	memcpy(channel, &hdr[off], clen);
+	channel[clen] = '\0';
+	off += clen;
+
+	memcpy(event, &hdr[off], elen);
+	event[elen] = '\0';
+	off += elen;
+
+	sse_deliver(channel, sse_channel_hash(channel, clen), id,
+	    elen > 0 ? event : NULL, &hdr[off], msg->length - off);
+}
+
+static void
+sse_deliver(const char *channel, u_int32_t hash, u_int64_t id,
+    const char *event, const void *data, size_t len)
+{
+	u_int64_t		now;
+	struct sse_channel	*ch;
+	struct netbuf_shared	*sh;
+	struct sse_sub		*sub, *next;
+
+	ch = sse_channel_lookup(channel, hash);
+	if (ch == NULL) {
+		if (kore_sse_history == 0)
+			return;
+
+		ch = kore_calloc(1, sizeof(*ch));
+		ch->hash = hash;
+		ch->name = kore_strdup(channel);
+		TAILQ_INIT(&ch->subs);
+		LIST_INSERT_HEAD(&channels[hash & (SSE_CHANNEL_BUCKETS - 1)],
+		    ch, list);
+	}
+
+	sh = sse_event_format(id, event, data, len);
+	now = kore_time_ms();
+
+	for (sub = TAILQ_FIRST(&ch->subs); sub != NULL; sub = next) {
+		next = TAILQ_NEXT(sub, tlist);
+		sse_client_send(sub->client, sh, now);
+	}
+
+	sse_channel_record(ch, id, sh);
+	net_shared_release(sh);
+}
+
+static int
+sse_event_valid(const char *event)
+{
+	size_t		len;
+
+	if (event == NULL)
+		return (KORE_RESULT_OK);
+
+	len = strlen(event);
+	if (len == 0 || len > KORE_SSE_EVENT_MAX ||
+	    strpbrk(event, "\r\n") != NULL)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+sse_client_send(struct sse_client *client, struct netbuf_shared *sh,
+    u_int64_t now)
+{
+	struct connection	*c = client->c;
+
+	if (c->state == CONN_STATE_DISCONNECTING)
+		return;
+
+	client->last_send = now;
+
+	net_send_shared(c, sh);
+	if (!net_send_flush(c))
+		kore_connection_disconnect(c);
+}
+
+static void
+sse_sub_remove(struct sse_sub *sub)
+{
+	struct sse_channel	*ch = sub->channel;
+
+	TAILQ_REMOVE(&ch->subs, sub, tlist);
+	LIST_REMOVE(sub, clist);
+	kore_free(sub);
+
+	if (TAILQ_EMPTY(&ch->subs) && ch->count == 0)
+		sse_channel_free(ch);
+}
+
+static void
+sse_channel_free(struct sse_channel *ch)
+{
+	LIST_REMOVE(ch, list);
+	kore_free(ch->history);
+	kore_free(ch->name);
+	kore_free(ch);
+}
+
+static void
+sse_channel_record(struct sse_channel *ch, u_int64_t id,
+    struct netbuf_shared *sh)
+{
+	struct sse_event	*ev;
+
+	if (kore_sse_history == 0)
+		return;
+
+	if (ch->history == NULL) {
+		ch->history = kore_calloc(kore_sse_history,
+		    sizeof(*ch->history));
+	}
+
+	ev = &ch->history[(ch->head + ch->count) % kore_sse_history];
+
+	if (ch->count == kore_sse_history) {
+		net_shared_release(ev->buf);
+		ch->head = (ch->head + 1) % kore_sse_history;
+	} else {
+		ch->count++;
+	}
+
+	sh->refs++;
+	ev->id = id;
+	ev->buf = sh;
+}
+
+/* Send the events in the history the client has not seen yet. */
+static void
+sse_channel_replay(struct sse_channel *ch, struct sse_client *client)
+{
+	u_int32_t		idx;
+	u_int64_t		now;
+	struct sse_event	*ev;
+
+	now = kore_time_ms();
+
+	for (idx = 0; idx < ch->count; idx++) {
+		ev = &ch->history[(ch->head + idx) % kore_sse_history];
+		if (ev->id <= client->last_id)
+			continue;
+
+		sse_client_send(client, ev->buf, now);
+		if (client->c->state == CONN_STATE_DISCONNECTING)
+			break;
+	}
+}
+
+static u_int32_t
+sse_channel_hash(const char *channel, size_t len)
+{
+	size_t		i;
+	u_int32_t	hash;
+
+	hash = 2166136261;
+	for (i = 0; i < len; i++) {
+		hash ^= (u_int8_t)channel[i];
+		hash *= 16777619;
+	}
+
+	return (hash);
+}
+
+static struct sse_channel *
+sse_channel_lookup(const char *channel, u_int32_t hash)
+{
+	struct sse_channel	*ch;
+
+	LIST_FOREACH(ch, &channels[hash & (SSE_CHANNEL_BUCKETS - 1)], list) {
+		if (ch->hash == hash && !strcmp(ch->name, channel))
+			return (ch);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Every line of the data becomes a field of its own, a CR, LF or CRLF
+ * all end one.
+ */
+static struct netbuf_shared *
+sse_event_format(u_int64_t id, const char *event, const void *data,
+    size_t len)
+{
+	struct netbuf_shared	*sh;
+	const u_int8_t		*p, *end, *line;
+
+	kore_buf_reset(&sse_buf);
+
+	if (id != 0)
+		kore_buf_appendf(&sse_buf, "id: %" PRIu64 "\n", id);
+
+	if (event != NULL)
+		kore_buf_appendf(&sse_buf, "event: %s\n", event);
+
+	p = data;
+	end = p + len;
+	line = p;
+
+	for (;;) {
+		if (p != end && *p != '\r' && *p != '\n') {
+			p++;
+			continue;
+		}
+
+		kore_buf_append(&sse_buf, "data: ", 6);
+		kore_buf_append(&sse_buf, line, p - line);
+		kore_buf_append(&sse_buf, "\n", 1);
+
+		if (p == end)
+			break;
+
+		if (*p == '\r' && p + 1 != end && p[1] == '\n')
+			p++;
+		line = ++p;
+	}
+
+	kore_buf_append(&sse_buf, "\n", 1);
+
+	sh = net_shared_alloc(sse_buf.offset);
+	memcpy(sh->data, sse_buf.data, sse_buf.offset);
+
+	return (sh);
+}
@@ -18,6 +18,12 @@
 #include <sys/queue.h>
 #include <sys/socket.h>
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,35 +37,88 @@
 
 static struct sock_filter filter_task[] = {
 	KORE_SYSCALL_ALLOW(clone),
-	KORE_SYSCALL_ALLOW(socketpair),
+	KORE_SYSCALL_ALLOW(eventfd2),
+	KORE_SYSCALL_ALLOW(gettid),
 	KORE_SYSCALL_ALLOW(set_robust_list),
+	KORE_SYSCALL_ALLOW(sched_setaffinity),
 };
 #endif
 
-static u_int8_t				threads;
-static TAILQ_HEAD(, kore_task_thread)	task_threads;
+/*
+ * Tasks run on a fixed pool of threads that is started the first time a
+ * task is run. Every thread has a queue per priority class, tasks started
+ * by the worker are spread over those round robin.
+ *
+ * A thread takes work from the head of its own queues and, once those run
+ * dry, steals from the tail of the queues of the others, so a long running
+ * task only holds up the thread it runs on. Higher priority classes are
+ * always drained first, from any thread, before lower ones are looked at.
+ *
+ * Threads with nothing to do sleep on the pool until queued goes up.
+ */
+/*
+ * A task channel is a pair of single producer, single consumer rings
+ * inside of the task, rings[0] carries messages to the worker and
+ * rings[1] to the task thread. Small messages are copied into a slot,
+ * larger ones travel as a pointer to a kore_malloc() buffer that the
+ * reader ends up owning.
+ *
+ * Both sides have a doorbell fd, the worker's sits in its event loop
+ * and the task thread polls its own. A writer only rings the reader
+ * if it parked itself, a reader only rings a writer that is waiting
+ * for room, so a busy channel does not cost any syscalls.
+ *
+ * The worker never blocks on a full ring, what does not fit yet is
+ * kept on the task its backlog until the task thread makes room.
+ */
+struct kore_task_pending {
+	void				*ptr;
+	u_int32_t			len;
+	TAILQ_ENTRY(kore_task_pending)	list;
+};
 
-u_int16_t	kore_task_threads = KORE_TASK_THREADS;
+#define TASK_WORKER		0
+#define TASK_THREAD		1
+
+static u_int8_t				threads;
+static u_int8_t				next_thread;
+static struct kore_task_thread		**task_threads;
 
-static void	*task_thread(void *);
-static void	task_channel_read(int, void *, u_int32_t);
-static void	task_channel_write(int, void *, u_int32_t);
-static void	task_thread_spawn(struct kore_task_thread **);
+static pthread_t			task_main;
+static pthread_mutex_t			pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			pool_cond = PTHREAD_COND_INITIALIZER;
+static u_int32_t			pool_idle = 0;
+static volatile u_int32_t		pool_queued = 0;
 
-#define THREAD_FD_ASSIGN(t, f, i, o)				\
-	do {							\
-		if (pthread_self() == t) {			\
-			f = i;					\
-		} else {					\
-			f = o;					\
-		}						\
-	} while (0);
+u_int16_t	kore_task_threads = KORE_TASK_THREADS;
+u_int8_t	kore_task_affinity = KORE_TASK_AFFINITY_INHERIT;
+
+static void		*task_thread(void *);
+static int		task_side(void);
+static int		task_closed(struct kore_task *);
+static void		task_channel_send(struct kore_task *, void *,
+			    const void *, u_int32_t);
+static struct kore_task_msg	*task_channel_recv(struct kore_task *);
+static void		task_channel_done(struct kore_task *);
+static void		task_backlog_flush(struct kore_task *);
+static int		task_ring_put(struct kore_task_ring *, void *,
+			    const void *, u_int32_t);
+static struct kore_task_msg	*task_ring_peek(struct kore_task_ring *);
+static void		task_ring_free(struct kore_task_ring *);
+static void		task_doorbell_ring(struct kore_task *, int);
+static void		task_doorbell_clear(struct kore_task *, int);
+static void		task_doorbell_wait(struct kore_task *, int);
+static void		task_pool_start(void);
+static void		task_thread_setcpu(struct kore_task_thread *);
+static struct kore_task	*task_thread_next(struct kore_task_thread *);
 
 void
 kore_task_init(void)
 {
 	threads = 0;
-	TAILQ_INIT(&task_threads);
+	next_thread = 0;
+	task_threads = NULL;
+	task_main = pthread_self();
 
 #if defined(__linux__)
 	kore_seccomp_filter("task", filter_task, KORE_FILTER_LEN(filter_task));
@@ -77,11 +136,42 @@ kore_task_create(struct kore_task *t, int (*entry)(struct kore_task *))
 	t->evt.handle = kore_task_handle;
 
 	t->entry = entry;
+	t->thread = NULL;
+	t->prio = KORE_TASK_PRIO_NORMAL;
 	t->state = KORE_TASK_STATE_CREATED;
 	pthread_rwlock_init(&(t->lock), NULL);
 
+	t->rings[TASK_WORKER] = kore_calloc(1, sizeof(struct kore_task_ring));
+	t->rings[TASK_THREAD] = kore_calloc(1, sizeof(struct kore_task_ring));
+
+	/* The worker is always waiting in its event loop. */
+	t->rings[TASK_WORKER]->parked = 1;
+
+	TAILQ_INIT(&(t->backlog));
+
+#if defined(__linux__)
+	if ((t->fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		fatal("kore_task_create: eventfd() %s", errno_s);
+	if ((t->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		fatal("kore_task_create: eventfd() %s", errno_s);
+#else
 	if (socketpair(AF_UNIX, SOCK_STREAM, 0, t->fds) == -1)
 		fatal("kore_task_create: socketpair() %s", errno_s);
+
+	if (!kore_connection_nonblock(t->fds[0], 0) ||
+	    !kore_connection_nonblock(t->fds[1], 0))
+		fatal("kore_task_create: failed to make doorbell nonblocking");
+#endif
+}
+
+/* Must be called before kore_task_run(). */
+void
+kore_task_set_priority(struct kore_task *t, u_int8_t prio)
+{
+	if (prio >= KORE_TASK_PRIO_MAX)
+		fatal("%s: bad priority %u", __func__, prio);
+
+	t->prio = prio;
 }
 
 void
@@ -90,23 +180,25 @@ kore_task_run(struct kore_task *t)
 	struct kore_task_thread		*tt;
 
 	kore_platform_schedule_read(t->fds[0], t);
-	if (threads < kore_task_threads) {
-		/* task_thread_spawn() will lock tt->lock for us. */
-		task_thread_spawn(&tt);
-	} else {
-		/* Cycle task around. */
-		if ((tt = TAILQ_FIRST(&task_threads)) == NULL)
-			fatal("no available tasks threads?");
-		pthread_mutex_lock(&(tt->lock));
-		TAILQ_REMOVE(&task_threads, tt, list);
-		TAILQ_INSERT_TAIL(&task_threads, tt, list);
-	}
 
-	t->thread = tt;
-	TAILQ_INSERT_TAIL(&(tt->tasks), t, list);
+	if (threads == 0)
+		task_pool_start();
 
+	tt = task_threads[next_thread];
+	next_thread = (next_thread + 1) % threads;
+
+	/* Count it first so a thief never takes pool_queued below zero. */
+	(void)__sync_fetch_and_add(&pool_queued, 1);
+
+	pthread_mutex_lock(&(tt->lock));
+	TAILQ_INSERT_TAIL(&(tt->tasks[t->prio]), t, list);
+	tt->queued++;
 	pthread_mutex_unlock(&(tt->lock));
-	pthread_cond_signal(&(tt->cond));
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_idle > 0)
+		pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
 }
 
 #if !defined(KORE_NO_HTTP)
@@ -138,6 +230,8 @@ kore_task_bind_callback(struct kore_task *t, void (*cb)(struct kore_task *))
 void
 kore_task_destroy(struct kore_task *t)
 {
+	struct kore_task_pending	*p;
+
 	kore_debug("kore_task_destroy: %p", t);
 
 #if !defined(KORE_NO_HTTP)
@@ -161,6 +255,22 @@ kore_task_destroy(struct kore_task *t)
 
 	pthread_rwlock_unlock(&(t->lock));
 	pthread_rwlock_destroy(&(t->lock));
+
+	while ((p = TAILQ_FIRST(&(t->backlog))) != NULL) {
+		TAILQ_REMOVE(&(t->backlog), p, list);
+		kore_free(p->ptr);
+		kore_free(p);
+	}
+
+	if (t->rings[TASK_WORKER] != NULL) {
+		task_ring_free(t->rings[TASK_WORKER]);
+		t->rings[TASK_WORKER] = NULL;
+	}
+
+	if (t->rings[TASK_THREAD] != NULL) {
+		task_ring_free(t->rings[TASK_THREAD]);
+		t->rings[TASK_THREAD] = NULL;
+	}
 }
 
 int
@@ -169,16 +279,19 @@ kore_task_finished(struct kore_task *t)
 	return ((kore_task_state(t) == KORE_TASK_STATE_FINISHED));
 }
 
+/*
+ * Tells the worker there is nothing more to come, under the lock so
+ * that it cannot tear down the doorbell while we are ringing it.
+ */
 void
 kore_task_finish(struct kore_task *t)
 {
 	kore_debug("kore_task_finished: %p (%d)", t, t->result);
 	pthread_rwlock_wrlock(&(t->lock));
 
-	if (t->fds[1] != -1) {
-		(void)close(t->fds[1]);
-		t->fds[1] = -1;
-	}
+	t->rings[TASK_WORKER]->closed = 1;
+	__sync_synchronize();
+	task_doorbell_ring(t, TASK_WORKER);
 
 	pthread_rwlock_unlock(&(t->lock));
 }
@@ -186,43 +299,106 @@ kore_task_finish(struct kore_task *t)
 void
 kore_task_channel_write(struct kore_task *t, void *data, u_int32_t len)
 {
-	int		fd;
+	void		*ptr;
+
+	kore_debug("kore_task_channel_write: %p <- %p (%u)", t, data, len);
+
+	if (len > KORE_TASK_MSG_INLINE) {
+		ptr = kore_malloc(len);
+		memcpy(ptr, data, len);
+		task_channel_send(t, ptr, NULL, len);
+	} else {
+		task_channel_send(t, NULL, data, len);
+	}
+}
 
-	kore_debug("kore_task_channel_write: %p <- %p (%ld)", t, data, len);
+/* Hands data, which must come from kore_malloc(), to the other side. */
+void
+kore_task_channel_give(struct kore_task *t, void *data, u_int32_t len)
+{
+	kore_debug("kore_task_channel_give: %p <- %p (%u)", t, data, len);
 
-	THREAD_FD_ASSIGN(t->thread->tid, fd, t->fds[1], t->fds[0]);
-	task_channel_write(fd, &len, sizeof(len));
-	task_channel_write(fd, data, len);
+	task_channel_send(t, data, NULL, len);
 }
 
 u_int32_t
 kore_task_channel_read(struct kore_task *t, void *out, u_int32_t len)
 {
-	int		fd;
-	u_int32_t	dlen, bytes;
+	struct kore_task_msg	*msg;
+	u_int32_t		dlen, bytes;
 
-	kore_debug("kore_task_channel_read: %p -> %p (%ld)", t, out, len);
+	kore_debug("kore_task_channel_read: %p -> %p (%u)", t, out, len);
 
-	THREAD_FD_ASSIGN(t->thread->tid, fd, t->fds[1], t->fds[0]);
-	task_channel_read(fd, &dlen, sizeof(dlen));
+	msg = task_channel_recv(t);
+	dlen = msg->len;
 
 	if (dlen > len)
 		bytes = len;
 	else
 		bytes = dlen;
 
-	task_channel_read(fd, out, bytes);
+	/* Whatever does not fit in out is dropped with the message. */
+	if (msg->ptr != NULL) {
+		memcpy(out, msg->ptr, bytes);
+		kore_free(msg->ptr);
+	} else {
+		memcpy(out, msg->data, bytes);
+	}
+
+	task_channel_done(t);
 
 	return (dlen);
 }
 
+/* Returns the next message as a buffer the caller must kore_free(). */
+void *
+kore_task_channel_take(struct kore_task *t, u_int32_t *len)
+{
+	void			*ptr;
+	struct kore_task_msg	*msg;
+
+	msg = task_channel_recv(t);
+	*len = msg->len;
+
+	if (msg->ptr != NULL) {
+		ptr = msg->ptr;
+	} else {
+		ptr = kore_malloc(msg->len > 0 ? msg->len : 1);
+		memcpy(ptr, msg->data, msg->len);
+	}
+
+	task_channel_done(t);
+
+	kore_debug("kore_task_channel_take: %p -> %p (%u)", t, ptr, *len);
+
+	return (ptr);
+}
+
 void
 kore_task_handle(void *arg, int finished)
 {
 	struct kore_task	*t = arg;
+	struct kore_task_ring	*ring;
+	u_int32_t		head, tail;
 
 	kore_debug("kore_task_handle: %p, %d", t, finished);
 
+	ring = t->rings[TASK_WORKER];
+
+	task_doorbell_clear(t, TASK_WORKER);
+	ring->parked = 0;
+	__sync_synchronize();
+	head = ring->head;
+
+	task_backlog_flush(t);
+
+	if (task_closed(t))
+		finished = 1;
+
+	/* Rung for room on the backlog only, or the data was read already. */
+	if (!finished && ring->tail == head)
+		goto park;
+
 #if !defined(KORE_NO_HTTP)
 	if (t->req != NULL)
 		http_request_wakeup(t->req);
@@ -237,10 +413,26 @@ kore_task_handle(void *arg, int finished)
 				kore_task_destroy(t);
 		}
 #endif
+		/* The callback may free the task, do not touch it after. */
+		if (t->cb != NULL)
+			t->cb(t);
+		return;
 	}
 
-	if (t->cb != NULL)
-		t->cb(t);
+	/* Keep calling the callback for as long as it consumes messages. */
+	if (t->cb != NULL) {
+		do {
+			tail = ring->tail;
+			t->cb(t);
+		} while (ring->tail != tail && ring->tail != ring->head);
+	}
+
+park:
+	/* Anything that came in without ringing us gets handled again. */
+	ring->parked = 1;
+	__sync_synchronize();
+	if (ring->head != head)
+		task_doorbell_ring(t, TASK_WORKER);
 }
 
 int
@@ -283,65 +475,357 @@ kore_task_set_result(struct kore_task *t, int result)
 	pthread_rwlock_unlock(&(t->lock));
 }
 
+/* Returns 1 if called from one of the task threads. */
+int
+kore_task_thread(void)
+{
+	return (task_side() == TASK_THREAD);
+}
+
+static int
+task_side(void)
+{
+	if (pthread_equal(pthread_self(), task_main))
+		return (TASK_WORKER);
+
+	return (TASK_THREAD);
+}
+
+static int
+task_closed(struct kore_task *t)
+{
+	int	closed;
+
+	pthread_rwlock_rdlock(&(t->lock));
+	closed = t->rings[TASK_WORKER]->closed;
+	pthread_rwlock_unlock(&(t->lock));
+
+	return (closed);
+}
+
 static void
-task_channel_write(int fd, void *data, u_int32_t len)
+task_channel_send(struct kore_task *t, void *ptr, const void *data,
+    u_int32_t len)
 {
-	ssize_t		r;
-	u_int8_t	*d;
-	u_int32_t	offset;
+	struct kore_task_ring		*ring;
+	struct kore_task_pending	*p;
 
-	d = data;
-	offset = 0;
-	while (offset != len) {
-		r = send(fd, d + offset, len - offset, 0);
-		if (r == -1 && errno == EINTR)
-			continue;
-		if (r == -1)
-			fatal("task_channel_write: %s", errno_s);
-		offset += r;
+	if (task_side() == TASK_WORKER) {
+		ring = t->rings[TASK_THREAD];
+
+		if (TAILQ_EMPTY(&(t->backlog)) &&
+		    task_ring_put(ring, ptr, data, len)) {
+			if (ring->parked)
+				task_doorbell_ring(t, TASK_THREAD);
+			return;
+		}
+
+		p = kore_malloc(sizeof(*p));
+		p->len = len;
+
+		if (ptr != NULL) {
+			p->ptr = ptr;
+		} else {
+			p->ptr = kore_malloc(len > 0 ? len : 1);
+			memcpy(p->ptr, data, len);
+		}
+
+		TAILQ_INSERT_TAIL(&(t->backlog), p, list);
+
+		/* The task thread may have made room before seeing this. */
+		ring->waiting = 1;
+		__sync_synchronize();
+		task_backlog_flush(t);
+		return;
+	}
+
+	ring = t->rings[TASK_WORKER];
+
+	while (!task_ring_put(ring, ptr, data, len)) {
+		ring->waiting = 1;
+		__sync_synchronize();
+		if (ring->head - ring->tail == KORE_TASK_RING_SLOTS)
+			task_doorbell_wait(t, TASK_THREAD);
+	}
+
+	if (ring->parked)
+		task_doorbell_ring(t, TASK_WORKER);
+}
+
+static struct kore_task_msg *
+task_channel_recv(struct kore_task *t)
+{
+	int			side;
+	struct kore_task_msg	*msg;
+	struct kore_task_ring	*ring;
+	int			parked;
+
+	side = task_side();
+	ring = t->rings[side];
+
+	if ((msg = task_ring_peek(ring)) != NULL)
+		return (msg);
+
+	parked = ring->parked;
+
+	for (;;) {
+		ring->parked = 1;
+		__sync_synchronize();
+
+		if ((msg = task_ring_peek(ring)) != NULL)
+			break;
+
+		if (side == TASK_WORKER && task_closed(t))
+			fatal("kore_task_channel_read: unexpected eof");
+
+		task_doorbell_wait(t, side);
+	}
+
+	ring->parked = parked;
+
+	/* The doorbell was eaten here, let the event loop look again. */
+	if (side == TASK_WORKER)
+		task_doorbell_ring(t, TASK_WORKER);
+
+	return (msg);
+}
+
+static void
+task_channel_done(struct kore_task *t)
+{
+	int			side;
+	struct kore_task_ring	*ring;
+
+	side = task_side();
+	ring = t->rings[side];
+
+	__sync_synchronize();
+	ring->tail++;
+	__sync_synchronize();
+
+	if (ring->waiting) {
+		ring->waiting = 0;
+		task_doorbell_ring(t, !side);
 	}
 }
 
 static void
-task_channel_read(int fd, void *out, u_int32_t len)
+task_backlog_flush(struct kore_task *t)
+{
+	struct kore_task_ring		*ring;
+	struct kore_task_pending	*p;
+	int				pushed;
+
+	pushed = 0;
+	ring = t->rings[TASK_THREAD];
+
+	while ((p = TAILQ_FIRST(&(t->backlog))) != NULL) {
+		if (!task_ring_put(ring, p->ptr, NULL, p->len))
+			break;
+
+		pushed = 1;
+		TAILQ_REMOVE(&(t->backlog), p, list);
+		kore_free(p);
+	}
+
+	if (pushed && ring->parked)
+		task_doorbell_ring(t, TASK_THREAD);
+}
+
+static int
+task_ring_put(struct kore_task_ring *ring, void *ptr, const void *data,
+    u_int32_t len)
+{
+	struct kore_task_msg	*msg;
+
+	if (ring->head - ring->tail == KORE_TASK_RING_SLOTS)
+		return (KORE_RESULT_ERROR);
+
+	msg = &ring->msgs[ring->head & (KORE_TASK_RING_SLOTS - 1)];
+	msg->len = len;
+	msg->ptr = ptr;
+
+	if (ptr == NULL && len > 0)
+		memcpy(msg->data, data, len);
+
+	__sync_synchronize();
+	ring->head++;
+	__sync_synchronize();
+
+	return (KORE_RESULT_OK);
+}
+
+static struct kore_task_msg *
+task_ring_peek(struct kore_task_ring *ring)
+{
+	if (ring->head == ring->tail)
+		return (NULL);
+
+	__sync_synchronize();
+
+	return (&ring->msgs[ring->tail & (KORE_TASK_RING_SLOTS - 1)]);
+}
+
+static void
+task_ring_free(struct kore_task_ring *ring)
+{
+	struct kore_task_msg	*msg;
+
+	while ((msg = task_ring_peek(ring)) != NULL) {
+		kore_free(msg->ptr);
+		ring->tail++;
+	}
+
+	kore_free(ring);
+}
+
+static void
+task_doorbell_ring(struct kore_task *t, int side)
 {
 	ssize_t		r;
-	u_int8_t	*d;
-	u_int32_t	offset;
+#if defined(__linux__)
+	u_int64_t	one = 1;
+
+	r = write(t->fds[side], &one, sizeof(one));
+#else
+	u_int8_t	one = 1;
 
-	d = out;
-	offset = 0;
-	while (offset != len) {
-		r = read(fd, d + offset, len - offset);
+	/* Either end of the socketpair rings the other. */
+	r = write(t->fds[!side], &one, sizeof(one));
+#endif
+
+	if (r == -1 && errno != EAGAIN && errno != EINTR)
+		fatal("task_doorbell_ring: %s", errno_s);
+}
+
+static void
+task_doorbell_clear(struct kore_task *t, int side)
+{
+	ssize_t		r;
+	u_int8_t	buf[64];
+
+	for (;;) {
+		r = read(t->fds[side], buf, sizeof(buf));
 		if (r == -1 && errno == EINTR)
 			continue;
+		if (r == -1 && errno == EAGAIN)
+			break;
 		if (r == -1)
-			fatal("task_channel_read: %s", errno_s);
+			fatal("task_doorbell_clear: %s", errno_s);
+#if defined(__linux__)
+		break;
+#else
 		if (r == 0)
-			fatal("task_channel_read: unexpected eof");
+			break;
+#endif
+	}
+}
 
-		offset += r;
+static void
+task_doorbell_wait(struct kore_task *t, int side)
+{
+	struct pollfd		pfd;
+
+	pfd.fd = t->fds[side];
+	pfd.events = POLLIN;
+
+	while (poll(&pfd, 1, -1) == -1) {
+		if (errno != EINTR)
+			fatal("task_doorbell_wait: %s", errno_s);
 	}
+
+	task_doorbell_clear(t, side);
 }
 
 static void
-task_thread_spawn(struct kore_task_thread **out)
+task_pool_start(void)
 {
 	struct kore_task_thread		*tt;
+	u_int8_t			idx, prio;
 
-	tt = kore_malloc(sizeof(*tt));
-	tt->idx = threads++;
+	if (kore_task_threads == 0)
+		fatal("no available tasks threads?");
 
-	TAILQ_INIT(&(tt->tasks));
-	pthread_cond_init(&(tt->cond), NULL);
-	pthread_mutex_init(&(tt->lock), NULL);
-	pthread_mutex_lock(&(tt->lock));
-	TAILQ_INSERT_TAIL(&task_threads, tt, list);
+	threads = kore_task_threads;
+	task_threads = kore_calloc(threads, sizeof(*task_threads));
 
-	if (pthread_create(&(tt->tid), NULL, task_thread, tt) != 0)
-		fatal("pthread_create: %s", errno_s);
+	/* All threads must exist before any of them can steal. */
+	for (idx = 0; idx < threads; idx++) {
+		tt = kore_malloc(sizeof(*tt));
+		tt->idx = idx;
+		tt->queued = 0;
 
-	*out = tt;
+		for (prio = 0; prio < KORE_TASK_PRIO_MAX; prio++)
+			TAILQ_INIT(&(tt->tasks[prio]));
+
+		pthread_mutex_init(&(tt->lock), NULL);
+		task_threads[idx] = tt;
+	}
+
+	for (idx = 0; idx < threads; idx++) {
+		tt = task_threads[idx];
+		if (pthread_create(&(tt->tid), NULL, task_thread, tt) != 0)
+			fatal("pthread_create: %s", errno_s);
+	}
+}
+
+static void
+task_thread_setcpu(struct kore_task_thread *tt)
+{
+	switch (kore_task_affinity) {
+	case KORE_TASK_AFFINITY_NONE:
+		kore_platform_thread_setcpu(-1);
+		break;
+	case KORE_TASK_AFFINITY_SPREAD:
+		/* Start next to the cpu the worker itself runs on. */
+		kore_platform_thread_setcpu((worker->cpu + 1 + tt->idx) %
+		    cpu_count);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Returns the next task for tt to run, its own oldest one or the newest
+ * one of another thread, highest priority first.
+ */
+static struct kore_task *
+task_thread_next(struct kore_task_thread *tt)
+{
+	struct kore_task		*t;
+	struct kore_task_thread		*victim;
+	u_int8_t			i, prio;
+
+	for (prio = 0; prio < KORE_TASK_PRIO_MAX; prio++) {
+		for (i = 0; i < threads; i++) {
+			victim = task_threads[(tt->idx + i) % threads];
+			if (__sync_fetch_and_add(&victim->queued, 0) == 0)
+				continue;
+
+			pthread_mutex_lock(&(victim->lock));
+
+			if (victim == tt)
+				t = TAILQ_FIRST(&(victim->tasks[prio]));
+			else
+				t = TAILQ_LAST(&(victim->tasks[prio]),
+				    kore_task_queue);
+
+			if (t != NULL) {
+				TAILQ_REMOVE(&(victim->tasks[prio]), t, list);
+				victim->queued--;
+			}
+
+			pthread_mutex_unlock(&(victim->lock));
+
+			if (t != NULL) {
+				(void)__sync_fetch_and_sub(&pool_queued, 1);
+				return (t);
+			}
+		}
+	}
+
+	return (NULL);
 }
 
 static void *
@@ -352,25 +836,26 @@ task_thread(void *arg)
 
 	kore_debug("task_thread: #%d starting", tt->idx);
 
-	pthread_mutex_lock(&(tt->lock));
+	task_thread_setcpu(tt);
 
 	for (;;) {
-		if (TAILQ_EMPTY(&(tt->tasks)))
-			pthread_cond_wait(&(tt->cond), &(tt->lock));
-
-		kore_debug("task_thread#%d: woke up", tt->idx);
-
-		t = TAILQ_FIRST(&(tt->tasks));
-		TAILQ_REMOVE(&(tt->tasks), t, list);
-		pthread_mutex_unlock(&(tt->lock));
+		if ((t = task_thread_next(tt)) == NULL) {
+			pthread_mutex_lock(&pool_lock);
+			while (__sync_fetch_and_add(&pool_queued, 0) == 0) {
+				pool_idle++;
+				pthread_cond_wait(&pool_cond, &pool_lock);
+				pool_idle--;
+			}
+			pthread_mutex_unlock(&pool_lock);
+			continue;
+		}
 
 		kore_debug("task_thread#%d: executing %p", tt->idx, t);
 
+		t->thread = tt;
 		kore_task_set_state(t, KORE_TASK_STATE_RUNNING);
 		kore_task_set_result(t, t->entry(t));
 		kore_task_finish(t);
-
-		pthread_mutex_lock(&(tt->lock));
 	}
 
 	pthread_exit(NULL);
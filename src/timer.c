@@ -14,27 +14,82 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/*
+ * Timers live in a hierarchical timing wheel with a 1ms resolution.
+ *
+ * Level 0 has 256 slots of 1ms each, every other level has 64 slots
+ * covering 64 slots of the level below it. A timer is queued in the
+ * lowest level whose range covers its expiry and moves one level down
+ * each time the slot it sits in is reached (cascading). This gives
+ * O(1) add and remove and expiring only touches timers that are due.
+ *
+ * A bitmap of non-empty slots lets kore_timer_next_run() and
+ * kore_timer_run() jump straight to the next slot that needs work
+ * instead of stepping through every millisecond.
+ */
+
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/queue.h>
 
 #include "kore.h"
 
-TAILQ_HEAD(timerlist, kore_timer)	kore_timers;
+#define TIMER_L0_BITS		8
+#define TIMER_LN_BITS		6
+#define TIMER_LEVELS		5
+#define TIMER_L0_SIZE		(1 << TIMER_L0_BITS)
+#define TIMER_LN_SIZE		(1 << TIMER_LN_BITS)
+#define TIMER_SLOTS		(TIMER_L0_SIZE + \
+				    ((TIMER_LEVELS - 1) * TIMER_LN_SIZE))
+#define TIMER_RANGE		\
+	(1ULL << (TIMER_L0_BITS + ((TIMER_LEVELS - 1) * TIMER_LN_BITS)))
+#define TIMER_POOL_ELEMENTS	512
+
+#define TIMER_STATE_WHEEL	1
+#define TIMER_STATE_EXPIRED	2
+#define TIMER_STATE_RUNNING	3
+#define TIMER_STATE_REMOVED	4
+
+TAILQ_HEAD(timerlist, kore_timer);
+
+static void		timer_insert(struct kore_timer *);
+static void		timer_unlink(struct kore_timer *);
+static void		timer_cascade(u_int16_t);
+static u_int64_t	timer_next_event(void);
+static int		timer_slot_first(u_int16_t, u_int16_t, u_int16_t);
+
+static struct timerlist		timer_wheel[TIMER_SLOTS];
+static struct timerlist		timer_expired;
+static u_int64_t		timer_bits[TIMER_SLOTS / 64];
+static struct kore_pool		timer_pool;
+static u_int64_t		timer_now = 0;
+static u_int32_t		timer_count = 0;
 
 void
 kore_timer_init(void)
 {
-	TAILQ_INIT(&kore_timers);
+	u_int16_t	i;
+
+	for (i = 0; i < TIMER_SLOTS; i++)
+		TAILQ_INIT(&timer_wheel[i]);
+
+	TAILQ_INIT(&timer_expired);
+	memset(timer_bits, 0, sizeof(timer_bits));
+
+	kore_pool_init(&timer_pool, "timer_pool",
+	    sizeof(struct kore_timer), TIMER_POOL_ELEMENTS);
+
+	timer_count = 0;
+	timer_now = kore_time_ms();
 }
 
 struct kore_timer *
 kore_timer_add(void (*cb)(void *, u_int64_t), u_int64_t interval,
     void *arg, int flags)
 {
-	struct kore_timer	*timer, *t;
+	struct kore_timer	*timer;
 
-	timer = kore_malloc(sizeof(*timer));
+	timer = kore_pool_get(&timer_pool);
 
 	timer->cb = cb;
 	timer->arg = arg;
@@ -42,69 +97,229 @@ kore_timer_add(void (*cb)(void *, u_int64_t), u_int64_t interval,
 	timer->interval = interval;
 	timer->nextrun = kore_time_ms() + timer->interval;
 
-	TAILQ_FOREACH(t, &kore_timers, list) {
-		if (t->nextrun > timer->nextrun) {
-			TAILQ_INSERT_BEFORE(t, timer, list);
-			return (timer);
-		}
-	}
+	timer_count++;
+	timer_insert(timer);
 
-	TAILQ_INSERT_TAIL(&kore_timers, timer, list);
 	return (timer);
 }
 
 void
 kore_timer_remove(struct kore_timer *timer)
 {
-	TAILQ_REMOVE(&kore_timers, timer, list);
-	kore_free(timer);
+	/* Removing itself from its callback, freed once it returns. */
+	if (timer->state == TIMER_STATE_RUNNING) {
+		timer->state = TIMER_STATE_REMOVED;
+		return;
+	}
+
+	timer_unlink(timer);
+
+	timer_count--;
+	kore_pool_put(&timer_pool, timer);
 }
 
 u_int64_t
 kore_timer_next_run(u_int64_t now)
 {
-	struct kore_timer	*timer;
+	u_int64_t	next;
 
-	if ((timer = TAILQ_FIRST(&kore_timers)) != NULL) {
-		if (timer->nextrun > now)
-			return (timer->nextrun - now);
-		return (0);
-	}
+	if ((next = timer_next_event()) == KORE_WAIT_INFINITE)
+		return (KORE_WAIT_INFINITE);
+
+	if (next > now)
+		return (next - now);
 
-	return (KORE_WAIT_INFINITE);
+	return (0);
 }
 
 void
 kore_timer_run(u_int64_t now)
 {
-	struct kore_timer	*timer, *t, *prev;
-
-	prev = NULL;
-
-	while ((timer = TAILQ_FIRST(&kore_timers)) != NULL) {
-		if (timer == prev)
-			break;
-
-		if (timer->nextrun > now)
-			break;
-
-		TAILQ_REMOVE(&kore_timers, timer, list);
-		timer->cb(timer->arg, now);
-
-		if (timer->flags & KORE_TIMER_ONESHOT) {
-			kore_free(timer);
-		} else {
-			prev = timer;
-			timer->nextrun = now + timer->interval;
-			TAILQ_FOREACH(t, &kore_timers, list) {
-				if (t->nextrun > timer->nextrun) {
-					TAILQ_INSERT_BEFORE(t, timer, list);
-					break;
-				}
+	u_int64_t		next;
+	u_int16_t		level, shift, slot;
+	struct kore_timer	*timer;
+
+	while ((next = timer_next_event()) <= now) {
+		timer_now = next;
+
+		/* Pull down every level whose slot boundary we are on. */
+		shift = TIMER_L0_BITS;
+		for (level = 1; level < TIMER_LEVELS; level++) {
+			if (next & ((1ULL << shift) - 1))
+				break;
+			timer_cascade(TIMER_L0_SIZE +
+			    ((level - 1) * TIMER_LN_SIZE) +
+			    ((next >> shift) & (TIMER_LN_SIZE - 1)));
+			shift += TIMER_LN_BITS;
+		}
+
+		/*
+		 * Move the due timers aside before running them, anything
+		 * a callback adds that is already due gets picked up by
+		 * the next pass through this loop.
+		 */
+		slot = next & (TIMER_L0_SIZE - 1);
+		while ((timer = TAILQ_FIRST(&timer_wheel[slot])) != NULL) {
+			timer_unlink(timer);
+			timer->state = TIMER_STATE_EXPIRED;
+			TAILQ_INSERT_TAIL(&timer_expired, timer, list);
+		}
+
+		while ((timer = TAILQ_FIRST(&timer_expired)) != NULL) {
+			TAILQ_REMOVE(&timer_expired, timer, list);
+
+			timer->state = TIMER_STATE_RUNNING;
+			timer->cb(timer->arg, now);
+
+			if (timer->state == TIMER_STATE_REMOVED ||
+			    (timer->flags & KORE_TIMER_ONESHOT)) {
+				timer_count--;
+				kore_pool_put(&timer_pool, timer);
+				continue;
 			}
 
-			if (t == NULL)
-				TAILQ_INSERT_TAIL(&kore_timers, timer, list);
+			/* Never again in this run, even with no interval. */
+			timer->nextrun = MAX(now + timer->interval, now + 1);
+			timer_insert(timer);
 		}
 	}
+
+	/* Nothing is due up to now, the wheel can skip ahead. */
+	if (timer_now < now)
+		timer_now = now;
+}
+
+static void
+timer_insert(struct kore_timer *timer)
+{
+	u_int16_t	level, shift;
+	u_int64_t	delta, expires;
+
+	expires = MAX(timer->nextrun, timer_now);
+	delta = expires - timer_now;
+
+	/* Too far out, park it at the end and cascade it again later. */
+	if (delta >= TIMER_RANGE) {
+		delta = TIMER_RANGE - 1;
+		expires = timer_now + delta;
+	}
+
+	if (delta < TIMER_L0_SIZE) {
+		timer->slot = expires & (TIMER_L0_SIZE - 1);
+	} else {
+		shift = TIMER_L0_BITS;
+		for (level = 1; level < TIMER_LEVELS - 1; level++) {
+			if (delta < (1ULL << (shift + TIMER_LN_BITS)))
+				break;
+			shift += TIMER_LN_BITS;
+		}
+
+		timer->slot = TIMER_L0_SIZE + ((level - 1) * TIMER_LN_SIZE) +
+		    ((expires >> shift) & (TIMER_LN_SIZE - 1));
+	}
+
+	timer->state = TIMER_STATE_WHEEL;
+	TAILQ_INSERT_TAIL(&timer_wheel[timer->slot], timer, list);
+	timer_bits[timer->slot / 64] |= 1ULL << (timer->slot % 64);
+}
+
+static void
+timer_unlink(struct kore_timer *timer)
+{
+	switch (timer->state) {
+	case TIMER_STATE_WHEEL:
+		TAILQ_REMOVE(&timer_wheel[timer->slot], timer, list);
+		if (TAILQ_EMPTY(&timer_wheel[timer->slot])) {
+			timer_bits[timer->slot / 64] &=
+			    ~(1ULL << (timer->slot % 64));
+		}
+		break;
+	case TIMER_STATE_EXPIRED:
+		TAILQ_REMOVE(&timer_expired, timer, list);
+		break;
+	default:
+		fatal("%s: timer %p in bad state %d", __func__,
+		    (void *)timer, timer->state);
+	}
+}
+
+static void
+timer_cascade(u_int16_t slot)
+{
+	struct kore_timer	*timer;
+	struct timerlist	list;
+
+	TAILQ_INIT(&list);
+	TAILQ_CONCAT(&list, &timer_wheel[slot], list);
+	timer_bits[slot / 64] &= ~(1ULL << (slot % 64));
+
+	while ((timer = TAILQ_FIRST(&list)) != NULL) {
+		TAILQ_REMOVE(&list, timer, list);
+		timer_insert(timer);
+	}
+}
+
+/*
+ * Returns the absolute time at which the next slot needs attention,
+ * either because its timers expire (level 0) or because it must be
+ * cascaded. This is never later than the earliest timer expiry.
+ */
+static u_int64_t
+timer_next_event(void)
+{
+	int		idx;
+	u_int16_t	level, shift;
+	u_int64_t	base, at, next;
+
+	if (timer_count == 0)
+		return (KORE_WAIT_INFINITE);
+
+	next = KORE_WAIT_INFINITE;
+
+	idx = timer_slot_first(0, TIMER_L0_SIZE,
+	    timer_now & (TIMER_L0_SIZE - 1));
+	if (idx != -1)
+		next = timer_now + idx;
+
+	shift = TIMER_L0_BITS;
+	for (level = 1; level < TIMER_LEVELS; level++) {
+		base = (timer_now + (1ULL << shift) - 1) >> shift;
+		idx = timer_slot_first(TIMER_L0_SIZE +
+		    ((level - 1) * TIMER_LN_SIZE), TIMER_LN_SIZE,
+		    base & (TIMER_LN_SIZE - 1));
+
+		if (idx != -1) {
+			at = (base + idx) << shift;
+			if (at < next)
+				next = at;
+		}
+
+		shift += TIMER_LN_BITS;
+	}
+
+	return (next);
+}
+
+/*
+ * Find the first non-empty slot in the level starting at offset,
+ * returning the distance from start or -1 if the level is empty.
+ * Every level starts on a 64 bit boundary in timer_bits.
+ */
+static int
+timer_slot_first(u_int16_t offset, u_int16_t size, u_int16_t start)
+{
+	u_int64_t	word;
+	u_int16_t	i, idx, bit;
+
+	for (i = 0; i < size; i += 64 - bit) {
+		idx = offset + ((start + i) & (size - 1));
+		bit = idx % 64;
+
+		if ((word = timer_bits[idx / 64] >> bit) != 0) {
+			i += __builtin_ctzll(word);
+			return (i < size ? i : -1);
+		}
+	}
+
+	return (-1);
 }
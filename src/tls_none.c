@@ -25,6 +25,8 @@
 
 struct kore_privsep	keymgr_privsep;
 char			*kore_rand_file = NULL;
+char			*kore_tls_ticket_file = NULL;
+u_int32_t		kore_tls_ticket_rotate = 3600;
 int			kore_keymgr_active = 0;
 
 int
@@ -86,6 +88,57 @@ kore_tls_version_set(int version)
 	fatal("%s: not supported", __func__);
 }
 
+void
+kore_tls_ktls_set(int enable)
+{
+	fatal("%s: not supported", __func__);
+}
+
+int
+kore_tls_ktls_enabled(void)
+{
+	return (0);
+}
+
+void
+kore_tls_handshake_threads_set(u_int16_t threads)
+{
+	fatal("%s: not supported", __func__);
+}
+
+void
+kore_tls_handshake_drain(void)
+{
+}
+
+void
+kore_tls_record_threshold_set(u_int32_t bytes)
+{
+	fatal("%s: not supported", __func__);
+}
+
+void
+kore_tls_record_idle_set(u_int32_t ms)
+{
+	fatal("%s: not supported", __func__);
+}
+
+void
+kore_tls_session_cache_set(u_int32_t entries)
+{
+	fatal("%s: not supported", __func__);
+}
+
+void
+kore_tls_session_cache_init(void)
+{
+}
+
+void
+kore_tls_ticket_keys(const void *data, size_t len)
+{
+}
+
 int
 kore_tls_dh_load(const char *path)
 {
@@ -98,6 +151,12 @@ kore_tls_ciphersuite_set(const char *list)
 	fatal("%s: not supported", __func__);
 }
 
+void
+kore_tls_domain_ocsp(struct kore_domain *dom, const void *data, size_t len)
+{
+	fatal("%s: not supported", __func__);
+}
+
 void
 kore_tls_domain_setup(struct kore_domain *dom, int type,
     const void *data, size_t datalen)
@@ -129,6 +188,21 @@ kore_tls_write(struct connection *c, size_t len, size_t *written)
 	fatal("%s: not supported", __func__);
 }
 
+int
+kore_tls_writev(struct connection *c, struct iovec *iov, int cnt,
+    size_t *written)
+{
+	fatal("%s: not supported", __func__);
+}
+
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+int
+kore_tls_sendfile(struct connection *c, struct netbuf *nb)
+{
+	fatal("%s: not supported", __func__);
+}
+#endif
+
 KORE_PRIVATE_KEY *
 kore_tls_rsakey_load(const char *path)
 {
@@ -19,6 +19,8 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include <openssl/bio.h>
 #include <openssl/dh.h>
@@ -31,19 +33,154 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 
+#if defined(SSL_MODE_ASYNC) && !defined(OPENSSL_NO_ASYNC)
+#include <openssl/async.h>
+#define TLS_KEYMGR_ASYNC	1
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+#include <openssl/core_names.h>
+#define TLS_TICKET_EVP_MAC	1
+#else
+#include <openssl/hmac.h>
+#endif
+
+#if defined(KORE_USE_TASKS)
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#endif
+
 #include <poll.h>
 
 #include "kore.h"
 #include "http.h"
 
+#if defined(KORE_USE_TASKS)
+#include "tasks.h"
+#endif
+
 #define TLS_SESSION_ID		"kore_tls_sessionid"
 
+/* Maximum TLS plaintext record size. */
+#define TLS_RECORD_MAX		16384
+
+/*
+ * A record that still fits in a single TCP segment on a 1500 byte MTU
+ * path once IPv6, TCP options and the TLS framing are accounted for.
+ */
+#define TLS_RECORD_SMALL	1369
+
+/* Slots tried per session id, and the largest session we will store. */
+#define TLS_SESSION_PROBES	4
+#define TLS_SESSION_DATA_MAX	1024
+
+/* A session ticket key from the keymgr, see KORE_TLS_TICKET_KEY_LEN. */
+struct tls_ticket_key {
+	u_int8_t		name[16];
+	u_int8_t		hmac[32];
+	u_int8_t		aes[32];
+};
+
+/*
+ * The session cache shared by all workers for TLS 1.2 clients resuming
+ * by session id. The parent maps an array of these before forking the
+ * workers, a session may live in any of TLS_SESSION_PROBES slots after
+ * the one its id hashes to.
+ *
+ * Every slot is a seqlock: a writer makes seq odd while it fills in the
+ * slot and even again when done, a reader copies the session out and
+ * only uses it if seq did not change meanwhile. Nobody ever waits on a
+ * busy slot, the session simply is not stored or not found.
+ */
+struct tls_session_slot {
+	volatile u_int32_t	seq;
+	u_int32_t		len;
+	u_int64_t		expires;
+	u_int32_t		id_len;
+	u_int8_t		id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	u_int8_t		data[TLS_SESSION_DATA_MAX];
+};
+
+/*
+ * A private key operation handed to the keymgr. Answers carry the id of
+ * the request they belong to.
+ *
+ * Handshakes run from the event loop do so inside of an OpenSSL async
+ * job, a call made from one is parked: the job pauses and SSL_accept()
+ * returns SSL_ERROR_WANT_ASYNC until the answer comes in through the
+ * normal KORE_MSG_KEYMGR_RESP callback, which then resumes it.
+ */
+struct tls_keymgr_call {
+	u_int32_t		id;
+	u_int8_t		buf[2048];
+	size_t			len;
+	int			sent;
+	int			parked;
+	int			response;
+	struct connection	*c;
+	SSL			*ssl;
+	TAILQ_ENTRY(tls_keymgr_call)	list;
+};
+
+#if defined(KORE_USE_TASKS)
+/*
+ * With tls_handshake_threads set, SSL_accept() for new connections runs
+ * on a small per worker pool of threads. The worker hands a connection
+ * to the pool and leaves it alone (see CONN_TLS_SHAKING) until a thread
+ * returns it, for every step of the handshake. Events arriving on the
+ * connection in the meantime are only remembered in its evt.flags.
+ *
+ * Keymgr signing requests from those threads are sent by the worker
+ * from its event loop while the thread waits for the answer.
+ */
+struct tls_shake {
+	struct connection	*c;
+	int			error;
+	unsigned long		reason;
+	TAILQ_ENTRY(tls_shake)	list;
+};
+
+TAILQ_HEAD(tls_shake_queue, tls_shake);
+
+static void	tls_shake_start(void);
+static void	tls_shake_ring(void);
+static void	tls_shake_clear(void);
+static void	*tls_shake_thread(void *);
+static void	tls_shake_event(void *, int);
+static int	tls_shake_queue(struct connection *);
+static void	tls_shake_keymgr_wait(struct tls_keymgr_call *, size_t);
+#endif
+
 static int	tls_domain_x509_verify(int, X509_STORE_CTX *);
 static X509	*tls_domain_load_certificate_chain(SSL_CTX *,
 		    const void *, size_t);
 
 static int	tls_sni_cb(SSL *, int *, void *);
+#if defined(TLS_TICKET_EVP_MAC)
+static int	tls_ticket_cb(SSL *, unsigned char *, unsigned char *,
+		    EVP_CIPHER_CTX *, EVP_MAC_CTX *, int);
+#else
+static int	tls_ticket_cb(SSL *, unsigned char *, unsigned char *,
+		    EVP_CIPHER_CTX *, HMAC_CTX *, int);
+#endif
+static int	tls_ticket_key(const unsigned char *,
+		    struct tls_ticket_key *);
+static int	tls_ocsp_staple(SSL *, void *);
+static int	tls_session_new(SSL *, SSL_SESSION *);
+static void	tls_session_remove(SSL_CTX *, SSL_SESSION *);
+static SSL_SESSION *tls_session_get(SSL *, const unsigned char *, int, int *);
+static struct tls_session_slot	*tls_session_slot(const unsigned char *,
+				    unsigned int, int);
 static void	tls_info_callback(const SSL *, int, int);
+static int	tls_write(struct connection *, const void *, size_t,
+		    size_t *);
+static size_t	tls_record_size(struct connection *);
+static int	tls_alpn_select(SSL *, const unsigned char **,
+		    unsigned char *, const unsigned char *, unsigned int, void *);
 
 #if defined(KORE_USE_ACME)
 static void	tls_acme_challenge_set_cert(SSL *, struct kore_domain *);
@@ -51,6 +188,20 @@ static int	tls_acme_alpn(SSL *, const unsigned char **, unsigned char *,
 		    const unsigned char *, unsigned int, void *);
 #endif
 
+static int	tls_accept_result(struct connection *, int, unsigned long);
+
+static struct tls_keymgr_call	*tls_keymgr_call_get(void);
+static void	tls_keymgr_call_run(struct tls_keymgr_call *, size_t);
+static void	tls_keymgr_call_put(struct tls_keymgr_call *);
+static void	tls_keymgr_call_done(struct tls_keymgr_call *,
+		    const void *, size_t);
+
+#if defined(TLS_KEYMGR_ASYNC)
+static void	tls_keymgr_park(struct tls_keymgr_call *, size_t);
+static int	tls_keymgr_unpark(u_int32_t, const void *, size_t);
+static int	tls_keymgr_orphan(struct connection *);
+#endif
+
 static void	tls_keymgr_await_data(void);
 static void	tls_keymgr_msg_response(struct kore_msg *, const void *);
 
@@ -67,17 +218,61 @@ static EC_KEY_METHOD	*keymgr_ec_meth = NULL;
 
 static DH		*dh_params = NULL;
 static int		tls_version = KORE_TLS_VERSION_BOTH;
+static int		tls_ktls = 0;
 static char		*tls_cipher_list = KORE_DEFAULT_CIPHER_LIST;
 
-static u_int8_t		keymgr_buf[2048];
-static size_t		keymgr_buflen = 0;
-static int		keymgr_response = 0;
+static u_int8_t		tls_wbuf[TLS_RECORD_MAX];
+
+static u_int32_t		tls_record_threshold = 65536;
+static u_int32_t		tls_record_idle = 1000;
+
+static struct tls_ticket_key	tls_tickets[KORE_TLS_TICKET_KEYS];
+static size_t			tls_ticket_count = 0;
+#if defined(KORE_USE_TASKS)
+static pthread_mutex_t		tls_ticket_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t		tls_ocsp_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static u_int32_t		tls_session_entries = 0;
+static struct tls_session_slot	*tls_session_table = NULL;
+static size_t			tls_session_mask = 0;
+
+static u_int32_t		keymgr_id = 0;
+static struct tls_keymgr_call	keymgr_call;
+
+#if defined(TLS_KEYMGR_ASYNC)
+static int			tls_async = 0;
+static struct connection	*tls_accepting = NULL;
+static TAILQ_HEAD(, tls_keymgr_call)	keymgr_parked =
+    TAILQ_HEAD_INITIALIZER(keymgr_parked);
+#endif
+
+#if defined(KORE_USE_TASKS)
+static u_int16_t		tls_shake_threads = 0;
+static int			shake_started = 0;
+static u_int32_t		shake_inflight = 0;
+static int			shake_fds[2] = { -1, -1 };
+static struct kore_event	shake_evt;
+static struct tls_shake_queue	shake_pending;
+static struct tls_shake_queue	shake_done;
+static struct tls_keymgr_call	*shake_keymgr = NULL;
+static pthread_mutex_t		shake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		shake_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t		shake_keymgr_cond = PTHREAD_COND_INITIALIZER;
+#endif
 
 #if defined(KORE_USE_ACME)
 static u_int8_t acme_alpn_name[] =
     { 0xa, 'a', 'c', 'm', 'e', '-', 't', 'l', 's', '/', '1' };
 #endif
 
+#if !defined(KORE_NO_HTTP)
+static u_int8_t http_alpn_names[] = {
+	0x2, 'h', '2',
+	0x8, 'h', 't', 't', 'p', '/', '1', '.', '1'
+};
+#endif
+
 struct kore_privsep	keymgr_privsep;
 int			kore_keymgr_active = 0;
 
@@ -108,6 +303,10 @@ kore_tls_init(void)
 	EC_KEY_METHOD_set_sign(keymgr_ec_meth,
 	    NULL, NULL, tls_keymgr_ecdsa_sign);
 
+#if defined(TLS_KEYMGR_ASYNC)
+	tls_async = ASYNC_is_capable();
+#endif
+
 	kore_log(LOG_NOTICE, "TLS backend %s", OPENSSL_VERSION_TEXT);
 #if !defined(TLS1_3_VERSION)
 	if (!kore_quiet) {
@@ -131,6 +330,124 @@ kore_tls_version_set(int version)
 	tls_version = version;
 }
 
+void
+kore_tls_ktls_set(int enable)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	tls_ktls = enable;
+#else
+	if (enable) {
+		kore_log(LOG_NOTICE,
+		    "%s has no kTLS support, tls_ktls ignored",
+		    OPENSSL_VERSION_TEXT);
+	}
+#endif
+}
+
+int
+kore_tls_ktls_enabled(void)
+{
+	return (tls_ktls);
+}
+
+void
+kore_tls_handshake_threads_set(u_int16_t threads)
+{
+#if defined(KORE_USE_TASKS)
+	tls_shake_threads = threads;
+#if defined(TLS_KEYMGR_ASYNC)
+	/* The handshake threads wait for the keymgr themselves. */
+	if (threads > 0)
+		tls_async = 0;
+#endif
+#else
+	if (threads > 0)
+		fatal("%s: requires a TASKS=1 build", __func__);
+#endif
+}
+
+/* Wait for the handshake threads to hand back all their connections. */
+void
+kore_tls_handshake_drain(void)
+{
+#if defined(KORE_USE_TASKS)
+	struct pollfd		pfd;
+
+	while (shake_inflight > 0) {
+		pfd.fd = shake_fds[0];
+		pfd.events = POLLIN;
+
+		if (poll(&pfd, 1, 100) == -1 && errno != EINTR)
+			fatal("%s: poll: %s", __func__, errno_s);
+
+		tls_shake_event(NULL, 0);
+	}
+#endif
+}
+
+void
+kore_tls_record_threshold_set(u_int32_t bytes)
+{
+	tls_record_threshold = bytes;
+}
+
+void
+kore_tls_record_idle_set(u_int32_t ms)
+{
+	tls_record_idle = ms;
+}
+
+void
+kore_tls_session_cache_set(u_int32_t entries)
+{
+	tls_session_entries = entries;
+}
+
+/* Called by the parent before any worker is spawned. */
+void
+kore_tls_session_cache_init(void)
+{
+	size_t		slots, len;
+
+	if (tls_session_entries == 0 || kore_keymgr_active == 0)
+		return;
+
+	slots = 1;
+	while (slots < tls_session_entries)
+		slots <<= 1;
+
+	len = slots * sizeof(struct tls_session_slot);
+
+	tls_session_table = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (tls_session_table == MAP_FAILED)
+		fatal("%s: mmap: %s", __func__, errno_s);
+
+	memset(tls_session_table, 0, len);
+	tls_session_mask = slots - 1;
+}
+
+/* Install the session ticket keys the keymgr sent us. */
+void
+kore_tls_ticket_keys(const void *data, size_t len)
+{
+	if (len == 0 || len % KORE_TLS_TICKET_KEY_LEN ||
+	    len > sizeof(tls_tickets)) {
+		kore_log(LOG_WARNING, "bad session ticket keys (%zu)", len);
+		return;
+	}
+
+#if defined(KORE_USE_TASKS)
+	pthread_mutex_lock(&tls_ticket_lock);
+#endif
+	OPENSSL_cleanse(tls_tickets, sizeof(tls_tickets));
+	memcpy(tls_tickets, data, len);
+	tls_ticket_count = len / KORE_TLS_TICKET_KEY_LEN;
+#if defined(KORE_USE_TASKS)
+	pthread_mutex_unlock(&tls_ticket_lock);
+#endif
+}
+
 void
 kore_tls_dh_check(void)
 {
@@ -184,6 +501,9 @@ void
 kore_tls_keymgr_init(void)
 {
 	const RSA_METHOD	*meth;
+	int			(*sign)(int, const unsigned char *, int,
+				    unsigned char *, unsigned int *,
+				    const BIGNUM *, const BIGNUM *, EC_KEY *);
 
 	if ((meth = RSA_get_default_method()) == NULL)
 		fatal("failed to obtain RSA method");
@@ -192,6 +512,10 @@ kore_tls_keymgr_init(void)
 	RSA_meth_set_pub_dec(keymgr_rsa_meth, RSA_meth_get_pub_dec(meth));
 	RSA_meth_set_bn_mod_exp(keymgr_rsa_meth, RSA_meth_get_bn_mod_exp(meth));
 
+	/* ECDSA_sign() ends up in our sign_sig through the default sign. */
+	EC_KEY_METHOD_get_sign(EC_KEY_get_default_method(), &sign, NULL, NULL);
+	EC_KEY_METHOD_set_sign(keymgr_ec_meth, sign, NULL, tls_keymgr_ecdsa_sign);
+
 	kore_msg_register(KORE_MSG_KEYMGR_RESP, tls_keymgr_msg_response);
 }
 
@@ -202,9 +526,9 @@ kore_tls_domain_setup(struct kore_domain *dom, int type,
 	const u_int8_t		*ptr;
 	RSA			*rsa;
 	X509			*x509;
-	EVP_PKEY		*pkey;
 	STACK_OF(X509_NAME)	*certs;
 	EC_KEY			*eckey;
+	EVP_PKEY		*pkey, *priv;
 	const SSL_METHOD	*method;
 
 	kore_debug("kore_domain_tlsinit(%s)", dom->domain);
@@ -280,26 +604,42 @@ kore_tls_domain_setup(struct kore_domain *dom, int type,
 	if ((pkey = X509_get_pubkey(x509)) == NULL)
 		fatalx("certificate has no public key");
 
+	/*
+	 * The key handed to OpenSSL must be a fresh EVP_PKEY around our
+	 * method, OpenSSL 3 would otherwise sign with the provider copy
+	 * of the public key and never call into the keymgr.
+	 */
+	if ((priv = EVP_PKEY_new()) == NULL)
+		fatalx("EVP_PKEY_new(): %s", ssl_errno_s);
+
 	switch (EVP_PKEY_id(pkey)) {
 	case EVP_PKEY_RSA:
 		if ((rsa = EVP_PKEY_get1_RSA(pkey)) == NULL)
 			fatalx("no RSA public key present");
 		RSA_set_app_data(rsa, dom);
 		RSA_set_method(rsa, keymgr_rsa_meth);
+		if (!EVP_PKEY_assign_RSA(priv, rsa))
+			fatalx("EVP_PKEY_assign_RSA(): %s", ssl_errno_s);
 		break;
 	case EVP_PKEY_EC:
 		if ((eckey = EVP_PKEY_get1_EC_KEY(pkey)) == NULL)
 			fatalx("no EC public key present");
 		EC_KEY_set_ex_data(eckey, 0, dom);
 		EC_KEY_set_method(eckey, keymgr_ec_meth);
+		if (!EVP_PKEY_assign_EC_KEY(priv, eckey))
+			fatalx("EVP_PKEY_assign_EC_KEY(): %s", ssl_errno_s);
 		break;
 	default:
 		fatalx("unknown public key in certificate");
 	}
 
-	if (!SSL_CTX_use_PrivateKey(dom->tls_ctx, pkey))
+	EVP_PKEY_free(pkey);
+
+	if (!SSL_CTX_use_PrivateKey(dom->tls_ctx, priv))
 		fatalx("SSL_CTX_use_PrivateKey(): %s", ssl_errno_s);
 
+	EVP_PKEY_free(priv);
+
 	if (!SSL_CTX_check_private_key(dom->tls_ctx)) {
 		fatalx("Public/Private key for %s do not match (%s)",
 		    dom->domain, ssl_errno_s);
@@ -332,8 +672,27 @@ kore_tls_domain_setup(struct kore_domain *dom, int type,
 
 	SSL_CTX_set_session_id_context(dom->tls_ctx,
 	    (unsigned char *)TLS_SESSION_ID, strlen(TLS_SESSION_ID));
+
+	/* Tickets are sealed with the keys from the keymgr, not our own. */
+#if defined(TLS_TICKET_EVP_MAC)
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(dom->tls_ctx, tls_ticket_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(dom->tls_ctx, tls_ticket_cb);
+#endif
+
+	if (tls_session_table != NULL) {
+		SSL_CTX_set_session_cache_mode(dom->tls_ctx,
+		    SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(dom->tls_ctx, tls_session_new);
+		SSL_CTX_sess_set_get_cb(dom->tls_ctx, tls_session_get);
+		SSL_CTX_sess_set_remove_cb(dom->tls_ctx, tls_session_remove);
+	}
+
 	SSL_CTX_set_mode(dom->tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
 
+	/* A retried write may come out of tls_wbuf instead, or vice versa. */
+	SSL_CTX_set_mode(dom->tls_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
 	if (tls_version == KORE_TLS_VERSION_BOTH) {
 		SSL_CTX_set_options(dom->tls_ctx, SSL_OP_NO_SSLv2);
 		SSL_CTX_set_options(dom->tls_ctx, SSL_OP_NO_SSLv3);
@@ -342,18 +701,50 @@ kore_tls_domain_setup(struct kore_domain *dom, int type,
 	}
 
 	SSL_CTX_set_options(dom->tls_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	/* OpenSSL quietly stays in userland if this cannot be offloaded. */
+	if (tls_ktls)
+		SSL_CTX_set_options(dom->tls_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
 	SSL_CTX_set_cipher_list(dom->tls_ctx, tls_cipher_list);
 
 	SSL_CTX_set_info_callback(dom->tls_ctx, tls_info_callback);
 	SSL_CTX_set_tlsext_servername_callback(dom->tls_ctx, tls_sni_cb);
 
-#if defined(KORE_USE_ACME)
-	SSL_CTX_set_alpn_select_cb(dom->tls_ctx, tls_acme_alpn, dom);
-#endif
+	SSL_CTX_set_alpn_select_cb(dom->tls_ctx, tls_alpn_select, dom);
+
+	SSL_CTX_set_tlsext_status_cb(dom->tls_ctx, tls_ocsp_staple);
+	SSL_CTX_set_tlsext_status_arg(dom->tls_ctx, dom);
 
 	X509_free(x509);
 }
 
+/*
+ * Install the OCSP response the keymgr verified for this domain, or
+ * stop stapling if there is none (len is 0).
+ */
+void
+kore_tls_domain_ocsp(struct kore_domain *dom, const void *data, size_t len)
+{
+#if defined(KORE_USE_TASKS)
+	pthread_mutex_lock(&tls_ocsp_lock);
+#endif
+	kore_free(dom->ocsp);
+	dom->ocsp = NULL;
+	dom->ocsp_len = 0;
+
+	if (len > 0) {
+		dom->ocsp = kore_malloc(len);
+		dom->ocsp_len = len;
+		memcpy(dom->ocsp, data, len);
+	}
+#if defined(KORE_USE_TASKS)
+	pthread_mutex_unlock(&tls_ocsp_lock);
+#endif
+}
+
 void
 kore_tls_domain_crl(struct kore_domain *dom, const void *pem, size_t pemlen)
 {
@@ -408,6 +799,8 @@ kore_tls_domain_crl(struct kore_domain *dom, const void *pem, size_t pemlen)
 void
 kore_tls_domain_cleanup(struct kore_domain *dom)
 {
+	kore_free(dom->ocsp);
+
 	if (dom->tls_ctx != NULL)
 		SSL_CTX_free(dom->tls_ctx);
 }
@@ -443,26 +836,68 @@ kore_tls_connection_accept(struct connection *c)
 
 		if (primary_dom->cafile != NULL)
 			c->flags |= CONN_LOG_TLS_FAILURE;
+
+#if defined(TLS_KEYMGR_ASYNC)
+		if (tls_async)
+			SSL_set_mode(c->tls, SSL_MODE_ASYNC);
+#endif
 	}
 
+#if defined(KORE_USE_TASKS)
+	if (tls_shake_threads > 0) {
+		/* Finished by a handshake thread, see tls_shake_event(). */
+		if (SSL_is_init_finished(c->tls))
+			return (KORE_RESULT_OK);
+		return (tls_shake_queue(c));
+	}
+#endif
+
 	ERR_clear_error();
+#if defined(TLS_KEYMGR_ASYNC)
+	tls_accepting = c;
+#endif
 	r = SSL_accept(c->tls);
-	if (r <= 0) {
+#if defined(TLS_KEYMGR_ASYNC)
+	tls_accepting = NULL;
+#endif
+	if (r <= 0)
 		r = SSL_get_error(c->tls, r);
-		switch (r) {
-		case SSL_ERROR_WANT_READ:
-		case SSL_ERROR_WANT_WRITE:
-			kore_connection_start_idletimer(c);
-			return (KORE_RESULT_RETRY);
-		default:
-			if (c->flags & CONN_LOG_TLS_FAILURE) {
-				kore_log(LOG_NOTICE,
-				    "SSL_accept: %s", ssl_errno_s);
-			}
-			return (KORE_RESULT_ERROR);
+	else
+		r = SSL_ERROR_NONE;
+
+	return (tls_accept_result(c, r, ERR_get_error()));
+}
+
+static int
+tls_accept_result(struct connection *c, int error, unsigned long reason)
+{
+	switch (error) {
+	case SSL_ERROR_NONE:
+		break;
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+#if defined(TLS_KEYMGR_ASYNC)
+	case SSL_ERROR_WANT_ASYNC:
+#endif
+		kore_connection_start_idletimer(c);
+		return (KORE_RESULT_RETRY);
+	default:
+		if (c->flags & CONN_LOG_TLS_FAILURE) {
+			kore_log(LOG_NOTICE,
+			    "SSL_accept: %s", ERR_error_string(reason, NULL));
 		}
+		KORE_PROBE2(tls__accept, c, 0);
+		return (KORE_RESULT_ERROR);
 	}
 
+	KORE_PROBE2(tls__accept, c, 1);
+	worker->metrics.tls_handshakes++;
+
+#if defined(TLS_KEYMGR_ASYNC)
+	/* Only the handshake needs jobs, keep SSL_read() and co cheap. */
+	SSL_clear_mode(c->tls, SSL_MODE_ASYNC);
+#endif
+
 #if defined(KORE_USE_ACME)
 	if (c->proto == CONN_PROTO_ACME_ALPN) {
 		kore_log(LOG_INFO, "disconnecting acme client");
@@ -481,6 +916,11 @@ kore_tls_connection_accept(struct connection *c)
 		c->tls_cert = NULL;
 	}
 
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	if (tls_ktls && BIO_get_ktls_send(SSL_get_wbio(c->tls)))
+		c->flags |= CONN_TLS_KTLS;
+#endif
+
 	return (KORE_RESULT_OK);
 }
 
@@ -512,7 +952,8 @@ kore_tls_read(struct connection *c, size_t *bytes)
 				return (KORE_RESULT_OK);
 			case EAGAIN:
 				c->evt.flags &= ~KORE_EVENT_READ;
-				c->snb->flags |= NETBUF_MUST_RESEND;
+				if (c->snb != NULL)
+					c->snb->flags |= NETBUF_MUST_RESEND;
 				return (KORE_RESULT_OK);
 			default:
 				break;
@@ -535,6 +976,43 @@ kore_tls_read(struct connection *c, size_t *bytes)
 
 int
 kore_tls_write(struct connection *c, size_t len, size_t *written)
+{
+	len = MIN(len, tls_record_size(c));
+
+	return (tls_write(c, c->snb->buf + c->snb->s_off, len, written));
+}
+
+/*
+ * Coalesce small netbufs into a single TLS record rather than sending a
+ * record per netbuf. A retried write always starts with the same bytes
+ * as the netbufs at the head of the queue do not move until written.
+ */
+int
+kore_tls_writev(struct connection *c, struct iovec *iov, int cnt,
+    size_t *written)
+{
+	int		i;
+	size_t		off, len, max;
+
+	max = MIN(sizeof(tls_wbuf), tls_record_size(c));
+
+	if (cnt == 1 || iov[0].iov_len >= max) {
+		len = MIN(iov[0].iov_len, max);
+		return (tls_write(c, iov[0].iov_base, len, written));
+	}
+
+	off = 0;
+	for (i = 0; i < cnt && off < max; i++) {
+		len = MIN(iov[i].iov_len, max - off);
+		memcpy(tls_wbuf + off, iov[i].iov_base, len);
+		off += len;
+	}
+
+	return (tls_write(c, tls_wbuf, off, written));
+}
+
+static int
+tls_write(struct connection *c, const void *data, size_t len, size_t *written)
 {
 	int		r;
 
@@ -542,7 +1020,7 @@ kore_tls_write(struct connection *c, size_t len, size_t *written)
 		return (KORE_RESULT_ERROR);
 
 	ERR_clear_error();
-	r = SSL_write(c->tls, (c->snb->buf + c->snb->s_off), len);
+	r = SSL_write(c->tls, data, len);
 	if (c->tls_reneg > 1)
 		return (KORE_RESULT_ERROR);
 
@@ -578,13 +1056,107 @@ kore_tls_write(struct connection *c, size_t len, size_t *written)
 	}
 
 	*written = (size_t)r;
+	c->tls_wbytes += (size_t)r;
 
 	return (KORE_RESULT_OK);
 }
 
+/*
+ * Dynamic record sizing. A new connection, or one that sat idle for
+ * tls_record_idle milliseconds and lost its congestion window, gets
+ * records that fit a single segment so the client can decrypt each one
+ * as soon as its packet arrives instead of waiting for a full 16KB
+ * record spread over several round trips. Once tls_record_threshold
+ * bytes went out the window has opened up and full records are cheaper.
+ *
+ * OpenSSL does not allow a retried write to become shorter, so a write
+ * that is being retried keeps the size it started with.
+ */
+static size_t
+tls_record_size(struct connection *c)
+{
+	u_int64_t	now;
+
+	if (tls_record_threshold == 0)
+		return (SIZE_MAX);
+
+	if (!(c->snb->flags & NETBUF_MUST_RESEND)) {
+		now = kore_time_ms();
+		if (now - c->tls_wlast >= tls_record_idle)
+			c->tls_wbytes = 0;
+		c->tls_wlast = now;
+	}
+
+	if (c->tls_wbytes < tls_record_threshold)
+		return (TLS_RECORD_SMALL);
+
+	return (SIZE_MAX);
+}
+
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+/*
+ * The kernel does the record encryption for kTLS connections, so file
+ * data goes straight from the page cache to the socket.
+ */
+int
+kore_tls_sendfile(struct connection *c, struct netbuf *nb)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	ossl_ssize_t	sent;
+	off_t		smin;
+	size_t		len;
+
+	smin = nb->fd_len - nb->fd_off;
+	len = MIN(SENDFILE_PAYLOAD_MAX, smin);
+
+	ERR_clear_error();
+	sent = SSL_sendfile(c->tls, nb->file_ref->fd, nb->fd_off, len, 0);
+	if (sent <= 0) {
+		switch (SSL_get_error(c->tls, sent)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			c->evt.flags &= ~KORE_EVENT_WRITE;
+			return (KORE_RESULT_OK);
+		case SSL_ERROR_SYSCALL:
+			if (errno == EINTR)
+				return (KORE_RESULT_OK);
+			if (errno == EAGAIN) {
+				c->evt.flags &= ~KORE_EVENT_WRITE;
+				return (KORE_RESULT_OK);
+			}
+			/* FALLTHROUGH */
+		default:
+			kore_debug("SSL_sendfile(): %s", ssl_errno_s);
+			if (c->flags & CONN_LOG_TLS_FAILURE) {
+				kore_log(LOG_NOTICE,
+				    "SSL_sendfile(): %s", ssl_errno_s);
+			}
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	nb->fd_off += sent;
+
+	if (nb->fd_off == nb->fd_len) {
+		net_remove_netbuf(c, nb);
+		c->snb = NULL;
+	}
+
+	return (KORE_RESULT_OK);
+#else
+	fatal("%s: no kTLS support", __func__);
+#endif
+}
+#endif
+
 void
 kore_tls_connection_cleanup(struct connection *c)
 {
+#if defined(TLS_KEYMGR_ASYNC)
+	if (c->tls != NULL && tls_keymgr_orphan(c))
+		c->tls = NULL;
+#endif
+
 	if (c->tls != NULL) {
 		SSL_shutdown(c->tls);
 		SSL_free(c->tls);
@@ -835,61 +1407,317 @@ tls_sni_cb(SSL *ssl, int *ad, void *arg)
 	return (SSL_TLSEXT_ERR_NOACK);
 }
 
+/*
+ * Seal or open a session ticket with the keys from the keymgr. Tickets
+ * sealed with an older key are still accepted but get replaced.
+ */
+#if defined(TLS_TICKET_EVP_MAC)
 static int
-tls_keymgr_rsa_init(RSA *rsa)
+tls_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc)
+#else
+static int
+tls_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *cipher, HMAC_CTX *mac, int enc)
+#endif
 {
-	if (rsa != NULL) {
-		RSA_set_flags(rsa, RSA_flags(rsa) |
-		    RSA_FLAG_EXT_PKEY | RSA_METHOD_FLAG_NO_CHECK);
-		return (1);
-	}
+	int			idx, ret;
+	struct tls_ticket_key	key;
+#if defined(TLS_TICKET_EVP_MAC)
+	OSSL_PARAM		params[3];
+#endif
 
-	return (0);
-}
+	if ((idx = tls_ticket_key(enc ? NULL : name, &key)) == -1)
+		return (0);
 
-static int
-tls_keymgr_rsa_privenc(int flen, const unsigned char *from, unsigned char *to,
+	ret = -1;
+
+	if (enc) {
+		memcpy(name, key.name, sizeof(key.name));
+		if (RAND_bytes(iv,
+		    EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			goto cleanup;
+		if (!EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(),
+		    NULL, key.aes, iv))
+			goto cleanup;
+	} else {
+		if (!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(),
+		    NULL, key.aes, iv))
+			goto cleanup;
+	}
+
+#if defined(TLS_TICKET_EVP_MAC)
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+	    key.hmac, sizeof(key.hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	    "sha256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	if (!EVP_MAC_CTX_set_params(mac, params))
+		goto cleanup;
+#else
+	if (!HMAC_Init_ex(mac, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL))
+		goto cleanup;
+#endif
+
+	ret = (enc || idx == 0) ? 1 : 2;
+
+cleanup:
+	OPENSSL_cleanse(&key, sizeof(key));
+
+	return (ret);
+}
+
+/*
+ * Staple the OCSP response for the domain whose context the handshake
+ * ended up on, OpenSSL takes ownership of the copy.
+ */
+static int
+tls_ocsp_staple(SSL *ssl, void *arg)
+{
+	int			ret;
+	u_int8_t		*resp;
+	struct kore_domain	*dom = arg;
+
+	ret = SSL_TLSEXT_ERR_NOACK;
+
+#if defined(KORE_USE_TASKS)
+	pthread_mutex_lock(&tls_ocsp_lock);
+#endif
+	if (dom->ocsp_len > 0 &&
+	    (resp = OPENSSL_malloc(dom->ocsp_len)) != NULL) {
+		memcpy(resp, dom->ocsp, dom->ocsp_len);
+		if (SSL_set_tlsext_status_ocsp_resp(ssl, resp, dom->ocsp_len))
+			ret = SSL_TLSEXT_ERR_OK;
+		else
+			OPENSSL_free(resp);
+	}
+#if defined(KORE_USE_TASKS)
+	pthread_mutex_unlock(&tls_ocsp_lock);
+#endif
+
+	return (ret);
+}
+
+/*
+ * Copy out the key with the given name, or the current key if name is
+ * NULL. Returns its index, or -1 if we have no such key.
+ */
+static int
+tls_ticket_key(const unsigned char *name, struct tls_ticket_key *out)
+{
+	size_t		idx;
+	int		ret;
+
+	ret = -1;
+
+#if defined(KORE_USE_TASKS)
+	pthread_mutex_lock(&tls_ticket_lock);
+#endif
+	for (idx = 0; idx < tls_ticket_count; idx++) {
+		if (name == NULL || !memcmp(tls_tickets[idx].name, name,
+		    sizeof(tls_tickets[idx].name))) {
+			memcpy(out, &tls_tickets[idx], sizeof(*out));
+			ret = (int)idx;
+			break;
+		}
+	}
+#if defined(KORE_USE_TASKS)
+	pthread_mutex_unlock(&tls_ticket_lock);
+#endif
+
+	return (ret);
+}
+
+static int
+tls_session_new(SSL *ssl, SSL_SESSION *sess)
+{
+	int				len;
+	u_int8_t			*ptr;
+	const unsigned char		*id;
+	unsigned int			id_len;
+	u_int32_t			seq;
+	struct tls_session_slot		*slot;
+
+	if (SSL_SESSION_get_protocol_version(sess) != TLS1_2_VERSION)
+		return (0);
+
+	len = i2d_SSL_SESSION(sess, NULL);
+	if (len <= 0 || len > TLS_SESSION_DATA_MAX)
+		return (0);
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	if ((slot = tls_session_slot(id, id_len, 1)) == NULL)
+		return (0);
+
+	seq = slot->seq;
+	if ((seq & 1) ||
+	    !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+		return (0);
+
+	ptr = slot->data;
+	slot->len = i2d_SSL_SESSION(sess, &ptr);
+	slot->expires = SSL_SESSION_get_time(sess) +
+	    SSL_SESSION_get_timeout(sess);
+	slot->id_len = id_len;
+	memcpy(slot->id, id, id_len);
+
+	(void)__sync_fetch_and_add(&slot->seq, 1);
+
+	/* We did not keep a reference to sess. */
+	return (0);
+}
+
+static SSL_SESSION *
+tls_session_get(SSL *ssl, const unsigned char *id, int id_len, int *copy)
+{
+	u_int32_t			seq, len;
+	const u_int8_t			*ptr;
+	struct tls_session_slot		*slot;
+	u_int8_t			data[TLS_SESSION_DATA_MAX];
+
+	*copy = 0;
+
+	if (id_len <= 0 ||
+	    (slot = tls_session_slot(id, (unsigned int)id_len, 0)) == NULL)
+		return (NULL);
+
+	seq = slot->seq;
+	__sync_synchronize();
+
+	if ((seq & 1) || slot->expires <= (u_int64_t)time(NULL))
+		return (NULL);
+
+	/* It may have been replaced since we found it. */
+	if (slot->id_len != (u_int32_t)id_len ||
+	    memcmp(slot->id, id, id_len))
+		return (NULL);
+
+	if ((len = slot->len) > sizeof(data))
+		return (NULL);
+
+	memcpy(data, slot->data, len);
+	__sync_synchronize();
+
+	if (slot->seq != seq)
+		return (NULL);
+
+	ptr = data;
+	return (d2i_SSL_SESSION(NULL, &ptr, len));
+}
+
+static void
+tls_session_remove(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	const unsigned char		*id;
+	unsigned int			id_len;
+	u_int32_t			seq;
+	struct tls_session_slot		*slot;
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	if ((slot = tls_session_slot(id, id_len, 0)) == NULL)
+		return;
+
+	seq = slot->seq;
+	if ((seq & 1) ||
+	    !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+		return;
+
+	if (slot->id_len == id_len && !memcmp(slot->id, id, id_len)) {
+		slot->id_len = 0;
+		slot->expires = 0;
+	}
+
+	(void)__sync_fetch_and_add(&slot->seq, 1);
+}
+
+/*
+ * Find the slot holding the session with the given id. If store is set
+ * and there is none, return the slot it should replace instead: the one
+ * closest to expiring out of those it may go into.
+ */
+static struct tls_session_slot *
+tls_session_slot(const unsigned char *id, unsigned int len, int store)
+{
+	u_int32_t			hash;
+	unsigned int			idx, probe;
+	struct tls_session_slot		*slot, *oldest;
+
+	if (len == 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+		return (NULL);
+
+	/* Session ids are random, their first bytes will do as a hash. */
+	hash = 0;
+	for (idx = 0; idx < len && idx < sizeof(hash); idx++)
+		hash = (hash << 8) | id[idx];
+
+	oldest = NULL;
+
+	for (probe = 0; probe < TLS_SESSION_PROBES; probe++) {
+		slot = &tls_session_table[(hash + probe) & tls_session_mask];
+		if (slot->id_len == len && !memcmp(slot->id, id, len))
+			return (slot);
+
+		if (oldest == NULL || slot->expires < oldest->expires)
+			oldest = slot;
+	}
+
+	return (store ? oldest : NULL);
+}
+
+static int
+tls_keymgr_rsa_init(RSA *rsa)
+{
+	if (rsa != NULL) {
+		RSA_set_flags(rsa, RSA_flags(rsa) |
+		    RSA_FLAG_EXT_PKEY | RSA_METHOD_FLAG_NO_CHECK);
+		return (1);
+	}
+
+	return (0);
+}
+
+static int
+tls_keymgr_rsa_privenc(int flen, const unsigned char *from, unsigned char *to,
     RSA *rsa, int padding)
 {
 	int			ret;
 	size_t			len;
 	struct kore_keyreq	*req;
 	struct kore_domain	*dom;
+	struct tls_keymgr_call	*call;
 
 	len = sizeof(*req) + flen;
-	if (len > sizeof(keymgr_buf))
+	if (len > sizeof(call->buf))
 		fatal("keymgr_buf too small");
 
 	if ((dom = RSA_get_app_data(rsa)) == NULL)
 		fatal("RSA key has no domain attached");
 
-	memset(keymgr_buf, 0, sizeof(keymgr_buf));
-
-	req = (struct kore_keyreq *)keymgr_buf;
+	call = tls_keymgr_call_get();
+	req = (struct kore_keyreq *)call->buf;
 
 	if (kore_strlcpy(req->domain, dom->domain, sizeof(req->domain)) >=
 	    sizeof(req->domain))
 		fatal("%s: domain truncated", __func__);
 
+	req->id = call->id;
 	req->data_len = flen;
 	req->padding = padding;
 	memcpy(&req->data[0], from, req->data_len);
 
-	kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_KEYMGR_REQ, keymgr_buf, len);
-	tls_keymgr_await_data();
+	tls_keymgr_call_run(call, len);
 
 	ret = -1;
-	if (keymgr_response) {
-		if (keymgr_buflen < INT_MAX &&
-		    (int)keymgr_buflen == RSA_size(rsa)) {
+	if (call->response) {
+		if (call->len < INT_MAX &&
+		    (int)call->len == RSA_size(rsa)) {
 			ret = RSA_size(rsa);
-			memcpy(to, keymgr_buf, RSA_size(rsa));
+			memcpy(to, call->buf, RSA_size(rsa));
 		}
 	}
 
-	keymgr_buflen = 0;
-	keymgr_response = 0;
-	kore_platform_event_all(worker->msg[1]->fd, worker->msg[1]);
+	tls_keymgr_call_put(call);
 
 	return (ret);
 }
@@ -909,44 +1737,214 @@ tls_keymgr_ecdsa_sign(const unsigned char *dgst, int dgst_len,
 	const u_int8_t			*ptr;
 	struct kore_domain		*dom;
 	struct kore_keyreq		*req;
+	struct tls_keymgr_call		*call;
 
 	if (in_kinv != NULL || in_r != NULL)
 		return (NULL);
 
 	len = sizeof(*req) + dgst_len;
-	if (len > sizeof(keymgr_buf))
+	if (len > sizeof(call->buf))
 		fatal("keymgr_buf too small");
 
 	if ((dom = EC_KEY_get_ex_data(eckey, 0)) == NULL)
 		fatal("EC_KEY has no domain");
 
-	memset(keymgr_buf, 0, sizeof(keymgr_buf));
-	req = (struct kore_keyreq *)keymgr_buf;
+	call = tls_keymgr_call_get();
+	req = (struct kore_keyreq *)call->buf;
 
 	if (kore_strlcpy(req->domain, dom->domain, sizeof(req->domain)) >=
 	    sizeof(req->domain))
 		fatal("%s: domain truncated", __func__);
 
+	req->id = call->id;
 	req->data_len = dgst_len;
 	memcpy(&req->data[0], dgst, req->data_len);
 
-	kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_KEYMGR_REQ, keymgr_buf, len);
-	tls_keymgr_await_data();
+	tls_keymgr_call_run(call, len);
 
-	if (keymgr_response) {
-		ptr = keymgr_buf;
-		sig = d2i_ECDSA_SIG(NULL, &ptr, keymgr_buflen);
+	if (call->response && call->len <= sizeof(call->buf)) {
+		ptr = call->buf;
+		sig = d2i_ECDSA_SIG(NULL, &ptr, call->len);
 	} else {
 		sig = NULL;
 	}
 
-	keymgr_buflen = 0;
-	keymgr_response = 0;
-	kore_platform_event_all(worker->msg[1]->fd, worker->msg[1]);
+	tls_keymgr_call_put(call);
 
 	return (sig);
 }
 
+static struct tls_keymgr_call *
+tls_keymgr_call_get(void)
+{
+	struct tls_keymgr_call		*call;
+
+#if defined(KORE_USE_TASKS)
+	/* Every handshake thread waits on a call of its own. */
+	if (kore_task_thread()) {
+		call = kore_calloc(1, sizeof(*call));
+		call->id = __sync_add_and_fetch(&keymgr_id, 1);
+		return (call);
+	}
+#endif
+
+#if defined(TLS_KEYMGR_ASYNC)
+	if (tls_accepting != NULL && ASYNC_get_current_job() != NULL) {
+		call = kore_calloc(1, sizeof(*call));
+		call->id = __sync_add_and_fetch(&keymgr_id, 1);
+		call->c = tls_accepting;
+		return (call);
+	}
+#endif
+
+	call = &keymgr_call;
+	memset(call, 0, sizeof(*call));
+	call->id = __sync_add_and_fetch(&keymgr_id, 1);
+
+	return (call);
+}
+
+static void
+tls_keymgr_call_run(struct tls_keymgr_call *call, size_t len)
+{
+#if defined(TLS_KEYMGR_ASYNC)
+	if (call->c != NULL) {
+		tls_keymgr_park(call, len);
+		return;
+	}
+#endif
+
+#if defined(KORE_USE_TASKS)
+	if (call != &keymgr_call) {
+		tls_shake_keymgr_wait(call, len);
+		return;
+	}
+#endif
+
+	call->sent = 1;
+	kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_KEYMGR_REQ, call->buf, len);
+	tls_keymgr_await_data();
+
+	kore_platform_event_all(worker->msg[1]->fd, worker->msg[1]);
+}
+
+static void
+tls_keymgr_call_put(struct tls_keymgr_call *call)
+{
+	if (call != &keymgr_call)
+		kore_free(call);
+}
+
+static void
+tls_keymgr_call_done(struct tls_keymgr_call *call, const void *data,
+    size_t len)
+{
+	call->response = 1;
+	call->len = len;
+
+	if (call->len > sizeof(call->buf))
+		return;
+
+	memcpy(call->buf, data, call->len);
+}
+
+#if defined(TLS_KEYMGR_ASYNC)
+static void
+tls_keymgr_park(struct tls_keymgr_call *call, size_t len)
+{
+	call->sent = 1;
+	call->parked = 1;
+	TAILQ_INSERT_TAIL(&keymgr_parked, call, list);
+
+	kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_KEYMGR_REQ, call->buf, len);
+
+	/*
+	 * Hand control back to the event loop, SSL_accept() returns
+	 * SSL_ERROR_WANT_ASYNC and we continue here once resumed by
+	 * tls_keymgr_unpark(). If the job can not pause the sign fails.
+	 */
+	while (call->response == 0) {
+		if (ASYNC_pause_job() == 0)
+			break;
+	}
+
+	if (call->parked) {
+		TAILQ_REMOVE(&keymgr_parked, call, list);
+		call->parked = 0;
+	}
+}
+
+static int
+tls_keymgr_unpark(u_int32_t id, const void *data, size_t len)
+{
+	SSL				*ssl;
+	struct connection		*c;
+	struct tls_keymgr_call		*call;
+
+	TAILQ_FOREACH(call, &keymgr_parked, list) {
+		if (call->id == id)
+			break;
+	}
+
+	if (call == NULL)
+		return (KORE_RESULT_ERROR);
+
+	TAILQ_REMOVE(&keymgr_parked, call, list);
+	call->parked = 0;
+
+	tls_keymgr_call_done(call, data, len);
+
+	c = call->c;
+	ssl = call->ssl;
+
+	/*
+	 * Resuming the job finishes the sign and frees the call, so
+	 * it can not be touched after this point.
+	 */
+	if (c == NULL) {
+		/* Connection is gone, let the job run out and clean up. */
+		(void)SSL_accept(ssl);
+		SSL_free(ssl);
+	} else if (c->state == CONN_STATE_DISCONNECTING) {
+		(void)SSL_accept(c->tls);
+	} else {
+		if (!c->handle(c))
+			kore_connection_disconnect(c);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+tls_keymgr_orphan(struct connection *c)
+{
+	BIO				*bio;
+	struct tls_keymgr_call		*call;
+
+	TAILQ_FOREACH(call, &keymgr_parked, list) {
+		if (call->c == c)
+			break;
+	}
+
+	if (call == NULL)
+		return (0);
+
+	/*
+	 * The paused job still references the SSL object. Keep it around
+	 * without a socket until the keymgr answers and the job can end.
+	 */
+	if ((bio = BIO_new(BIO_s_null())) == NULL)
+		fatalx("%s: BIO_new failed", __func__);
+
+	SSL_set_bio(c->tls, bio, bio);
+
+	call->c = NULL;
+	call->ssl = c->tls;
+
+	return (1);
+}
+#endif
+
 static void
 tls_keymgr_await_data(void)
 {
@@ -978,8 +1976,7 @@ tls_keymgr_await_data(void)
 	start = kore_time_ms();
 	kore_platform_disable_read(worker->msg[1]->fd);
 
-	keymgr_response = 0;
-	memset(keymgr_buf, 0, sizeof(keymgr_buf));
+	keymgr_call.response = 0;
 
 #if !defined(KORE_NO_HTTP)
 	process_requests = 0;
@@ -1023,7 +2020,7 @@ tls_keymgr_await_data(void)
 		if (!net_recv_flush(worker->msg[1]))
 			break;
 
-		if (keymgr_response)
+		if (keymgr_call.response)
 			break;
 
 #if !defined(KORE_NO_HTTP)
@@ -1038,13 +2035,36 @@ tls_keymgr_await_data(void)
 static void
 tls_keymgr_msg_response(struct kore_msg *msg, const void *data)
 {
-	keymgr_response = 1;
-	keymgr_buflen = msg->length;
+	size_t				len;
+	const struct kore_keyres	*res;
+
+	if (msg->length < sizeof(*res))
+		return;
+
+	res = data;
+	len = msg->length - sizeof(*res);
 
-	if (keymgr_buflen > sizeof(keymgr_buf))
+#if defined(KORE_USE_TASKS)
+	pthread_mutex_lock(&shake_lock);
+	if (shake_keymgr != NULL && shake_keymgr->sent &&
+	    shake_keymgr->response == 0 && shake_keymgr->id == res->id) {
+		tls_keymgr_call_done(shake_keymgr, res->data, len);
+		pthread_cond_broadcast(&shake_keymgr_cond);
+		pthread_mutex_unlock(&shake_lock);
 		return;
+	}
+	pthread_mutex_unlock(&shake_lock);
+#endif
+
+#if defined(TLS_KEYMGR_ASYNC)
+	if (tls_keymgr_unpark(res->id, res->data, len) == KORE_RESULT_OK)
+		return;
+#endif
 
-	memcpy(keymgr_buf, data, keymgr_buflen);
+	/* Anything else is a late answer to a call that timed out. */
+	if (keymgr_call.sent && keymgr_call.response == 0 &&
+	    keymgr_call.id == res->id)
+		tls_keymgr_call_done(&keymgr_call, res->data, len);
 }
 
 static int
@@ -1119,6 +2139,50 @@ tls_domain_load_certificate_chain(SSL_CTX *ctx, const void *data, size_t len)
 	return (x);
 }
 
+static int
+tls_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+    const unsigned char *in, unsigned int inlen, void *udata)
+{
+#if !defined(KORE_NO_HTTP)
+	struct connection	*c;
+	const u_int8_t		*names;
+	unsigned char		*sel;
+	unsigned int		len;
+#endif
+
+#if defined(KORE_USE_ACME)
+	if (inlen == sizeof(acme_alpn_name) &&
+	    !memcmp(acme_alpn_name, in, sizeof(acme_alpn_name)))
+		return (tls_acme_alpn(ssl, out, outlen, in, inlen, udata));
+#endif
+
+#if !defined(KORE_NO_HTTP)
+	if ((c = SSL_get_ex_data(ssl, 0)) == NULL)
+		fatal("%s: no connection data present", __func__);
+
+	/* Our own preference wins, skip h2 if it was turned off. */
+	names = http_alpn_names;
+	len = sizeof(http_alpn_names);
+
+	if (!http2_enable) {
+		names += names[0] + 1;
+		len -= http_alpn_names[0] + 1;
+	}
+
+	if (SSL_select_next_proto(&sel, outlen,
+	    names, len, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return (SSL_TLSEXT_ERR_NOACK);
+
+	*out = sel;
+	if (*outlen == 2 && !memcmp(sel, "h2", 2))
+		c->flags |= CONN_TLS_ALPN_H2;
+
+	return (SSL_TLSEXT_ERR_OK);
+#else
+	return (SSL_TLSEXT_ERR_NOACK);
+#endif
+}
+
 #if defined(KORE_USE_ACME)
 static int
 tls_acme_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
@@ -1190,3 +2254,235 @@ tls_acme_challenge_set_cert(SSL *ssl, struct kore_domain *dom)
 	c->proto = CONN_PROTO_ACME_ALPN;
 }
 #endif /* KORE_USE_ACME */
+
+#if defined(KORE_USE_TASKS)
+static void
+tls_shake_start(void)
+{
+	u_int16_t	i;
+	pthread_t	tid;
+	sigset_t	sigs, old;
+
+	TAILQ_INIT(&shake_pending);
+	TAILQ_INIT(&shake_done);
+
+#if defined(__linux__)
+	if ((shake_fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		fatal("%s: eventfd: %s", __func__, errno_s);
+	shake_fds[1] = shake_fds[0];
+#else
+	if (pipe(shake_fds) == -1)
+		fatal("%s: pipe: %s", __func__, errno_s);
+
+	if (!kore_connection_nonblock(shake_fds[0], 0) ||
+	    !kore_connection_nonblock(shake_fds[1], 0))
+		fatal("%s: failed to make doorbell nonblocking", __func__);
+#endif
+
+	shake_evt.type = KORE_TYPE_TLS_SHAKE;
+	shake_evt.flags = 0;
+	shake_evt.handle = tls_shake_event;
+	kore_platform_schedule_read(shake_fds[0], &shake_evt);
+
+	/* Signals are for the event loop only. */
+	sigfillset(&sigs);
+	if (pthread_sigmask(SIG_BLOCK, &sigs, &old) != 0)
+		fatal("%s: pthread_sigmask failed", __func__);
+
+	for (i = 0; i < tls_shake_threads; i++) {
+		if (pthread_create(&tid, NULL, tls_shake_thread, NULL) != 0)
+			fatal("%s: pthread_create: %s", __func__, errno_s);
+		(void)pthread_detach(tid);
+	}
+
+	(void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	shake_started = 1;
+}
+
+static int
+tls_shake_queue(struct connection *c)
+{
+	struct tls_shake	*shake;
+
+	if (shake_started == 0)
+		tls_shake_start();
+
+	shake = kore_malloc(sizeof(*shake));
+	shake->c = c;
+	shake->error = SSL_ERROR_NONE;
+	shake->reason = 0;
+
+	/* From here on the thread owns the connection. */
+	c->flags |= CONN_TLS_SHAKING;
+	c->evt.flags &= ~(KORE_EVENT_READ | KORE_EVENT_WRITE);
+	kore_connection_stop_idletimer(c);
+
+	shake_inflight++;
+
+	pthread_mutex_lock(&shake_lock);
+	TAILQ_INSERT_TAIL(&shake_pending, shake, list);
+	pthread_cond_signal(&shake_cond);
+	pthread_mutex_unlock(&shake_lock);
+
+	return (KORE_RESULT_RETRY);
+}
+
+static void *
+tls_shake_thread(void *arg)
+{
+	int			r;
+	struct tls_shake	*shake;
+
+	for (;;) {
+		pthread_mutex_lock(&shake_lock);
+		while ((shake = TAILQ_FIRST(&shake_pending)) == NULL)
+			pthread_cond_wait(&shake_cond, &shake_lock);
+		TAILQ_REMOVE(&shake_pending, shake, list);
+		pthread_mutex_unlock(&shake_lock);
+
+		ERR_clear_error();
+		r = SSL_accept(shake->c->tls);
+		if (r <= 0) {
+			shake->error = SSL_get_error(shake->c->tls, r);
+			shake->reason = ERR_get_error();
+		}
+		ERR_clear_error();
+
+		pthread_mutex_lock(&shake_lock);
+		TAILQ_INSERT_TAIL(&shake_done, shake, list);
+		pthread_mutex_unlock(&shake_lock);
+
+		tls_shake_ring();
+	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+static void
+tls_shake_event(void *arg, int error)
+{
+	int				ret;
+	struct tls_shake_queue		done;
+	struct tls_shake		*shake;
+	struct connection		*c;
+
+	tls_shake_clear();
+
+	TAILQ_INIT(&done);
+
+	pthread_mutex_lock(&shake_lock);
+
+	if (shake_keymgr != NULL && shake_keymgr->sent == 0) {
+		shake_keymgr->sent = 1;
+		kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_KEYMGR_REQ,
+		    shake_keymgr->buf, shake_keymgr->len);
+	}
+
+	TAILQ_CONCAT(&done, &shake_done, list);
+	pthread_mutex_unlock(&shake_lock);
+
+	while ((shake = TAILQ_FIRST(&done)) != NULL) {
+		TAILQ_REMOVE(&done, shake, list);
+
+		c = shake->c;
+		c->flags &= ~CONN_TLS_SHAKING;
+		shake_inflight--;
+
+		/* kore_connection_prune() picks it up now. */
+		if (c->state == CONN_STATE_DISCONNECTING) {
+			kore_free(shake);
+			continue;
+		}
+
+		ret = tls_accept_result(c, shake->error, shake->reason);
+		kore_free(shake);
+
+		switch (ret) {
+		case KORE_RESULT_OK:
+			/* The client may have sent data with its Finished. */
+			c->evt.flags |= KORE_EVENT_READ | KORE_EVENT_WRITE;
+			if (!c->handle(c))
+				kore_connection_disconnect(c);
+			break;
+		case KORE_RESULT_RETRY:
+			/* Woken up while the thread had it, go again. */
+			if (c->evt.flags & (KORE_EVENT_READ | KORE_EVENT_WRITE))
+				(void)tls_shake_queue(c);
+			break;
+		default:
+			kore_connection_disconnect(c);
+			break;
+		}
+	}
+}
+
+static void
+tls_shake_keymgr_wait(struct tls_keymgr_call *call, size_t len)
+{
+	struct timespec		ts;
+
+	call->len = len;
+
+	pthread_mutex_lock(&shake_lock);
+
+	/* The event loop picks up one thread request at a time. */
+	while (shake_keymgr != NULL)
+		pthread_cond_wait(&shake_keymgr_cond, &shake_lock);
+
+	shake_keymgr = call;
+	tls_shake_ring();
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 1;
+
+	while (call->response == 0) {
+		if (pthread_cond_timedwait(&shake_keymgr_cond,
+		    &shake_lock, &ts) == ETIMEDOUT)
+			break;
+	}
+
+	shake_keymgr = NULL;
+	pthread_cond_broadcast(&shake_keymgr_cond);
+	pthread_mutex_unlock(&shake_lock);
+}
+
+static void
+tls_shake_ring(void)
+{
+	ssize_t		r;
+#if defined(__linux__)
+	u_int64_t	one = 1;
+#else
+	u_int8_t	one = 1;
+#endif
+
+	r = write(shake_fds[1], &one, sizeof(one));
+	if (r == -1 && errno != EAGAIN && errno != EINTR)
+		fatal("%s: %s", __func__, errno_s);
+}
+
+static void
+tls_shake_clear(void)
+{
+	ssize_t		r;
+	u_int8_t	buf[64];
+
+	for (;;) {
+		r = read(shake_fds[0], buf, sizeof(buf));
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && errno == EAGAIN)
+			break;
+		if (r == -1)
+			fatal("%s: %s", __func__, errno_s);
+#if defined(__linux__)
+		break;
+#else
+		if (r == 0)
+			break;
+#endif
+	}
+}
+#endif /* KORE_USE_TASKS */
@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Graceful upgrades.
+ *
+ * On SIGUSR2 the parent starts a new copy of itself with the same binary
+ * and arguments and hands it all of its listening sockets over a unix
+ * socket pair (SCM_RIGHTS). When the configuration of the new process
+ * binds the same address again it takes the socket that was handed over
+ * instead of creating one, so the listen queue is never gone.
+ *
+ * Once all of its workers are up the new process writes a single byte
+ * back. The old parent then tells its workers to stop accepting and to
+ * finish what is still in flight, anything left after the drain timeout
+ * is dropped. If the new process dies before that the old one simply
+ * keeps running.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+
+#include "kore.h"
+
+#define UPGRADE_ENV		"KORE_UPGRADE_FD"
+#define UPGRADE_CHECK_MS	100
+
+struct upgrade_msg {
+	int			family;
+	char			host[256];
+	char			port[32];
+};
+
+struct upgrade_socket {
+	int				fd;
+	int				family;
+	char				*host;
+	char				*port;
+	TAILQ_ENTRY(upgrade_socket)	list;
+};
+
+static void	upgrade_abort(void);
+static int	upgrade_send(int);
+static void	upgrade_recv(int);
+static int	upgrade_send_socket(int, struct listener *);
+static void	upgrade_check(void *, u_int64_t);
+static void	upgrade_deadline(void *, u_int64_t);
+
+static TAILQ_HEAD(, upgrade_socket)	upgrade_sockets =
+    TAILQ_HEAD_INITIALIZER(upgrade_sockets);
+
+static int			upgrade_fd = -1;
+static pid_t			upgrade_pid = -1;
+static char			*upgrade_cwd = NULL;
+static char			*upgrade_path = NULL;
+static char			**upgrade_argv = NULL;
+static struct kore_timer	*upgrade_timer = NULL;
+
+int		kore_upgrade_handover = 0;
+u_int32_t	kore_upgrade_drain_timeout = 30;
+
+/*
+ * Remember how we were started, before the arguments are overwritten by
+ * the process title and before the parent changes directory. If we were
+ * started by a parent that is upgrading, collect its listening sockets.
+ */
+void
+kore_upgrade_init(int argc, char **argv)
+{
+	int		i, fd, err;
+	const char	*env;
+	char		path[PATH_MAX];
+
+	upgrade_argv = kore_calloc(argc + 1, sizeof(char *));
+	for (i = 0; i < argc; i++)
+		upgrade_argv[i] = kore_strdup(argv[i]);
+	upgrade_argv[i] = NULL;
+
+	if (strchr(argv[0], '/') != NULL && realpath(argv[0], path) != NULL)
+		upgrade_path = kore_strdup(path);
+	else
+		upgrade_path = kore_strdup(argv[0]);
+
+	if (getcwd(path, sizeof(path)) != NULL)
+		upgrade_cwd = kore_strdup(path);
+
+	if ((env = getenv(UPGRADE_ENV)) == NULL)
+		return;
+
+	fd = kore_strtonum(env, 10, 0, INT_MAX, &err);
+	if (err != KORE_RESULT_OK)
+		fatal("bad %s value '%s'", UPGRADE_ENV, env);
+
+	if (unsetenv(UPGRADE_ENV) == -1)
+		fatal("unsetenv(%s): %s", UPGRADE_ENV, errno_s);
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		fatal("%s: fcntl: %s", __func__, errno_s);
+
+	upgrade_recv(fd);
+	upgrade_fd = fd;
+}
+
+/*
+ * Returns the socket handed over for the given listener, or -1 if there
+ * is none and the caller must create one. Unix listeners have no port.
+ */
+int
+kore_upgrade_socket(int family, const char *host, const char *port)
+{
+	int			fd;
+	struct upgrade_socket	*us;
+
+	TAILQ_FOREACH(us, &upgrade_sockets, list) {
+		if (us->family != family || strcmp(us->host, host))
+			continue;
+
+		if (port != NULL && strcmp(us->port, port))
+			continue;
+
+		fd = us->fd;
+
+		TAILQ_REMOVE(&upgrade_sockets, us, list);
+		kore_free(us->host);
+		kore_free(us->port);
+		kore_free(us);
+
+		return (fd);
+	}
+
+	return (-1);
+}
+
+/*
+ * Close the sockets our configuration no longer binds, before they end
+ * up in the workers with nobody accepting on them.
+ */
+void
+kore_upgrade_release(void)
+{
+	struct upgrade_socket	*us;
+
+	while ((us = TAILQ_FIRST(&upgrade_sockets)) != NULL) {
+		if (us->family == AF_UNIX) {
+			kore_log(LOG_NOTICE,
+			    "upgrade: closing unused listener %s", us->host);
+		} else {
+			kore_log(LOG_NOTICE,
+			    "upgrade: closing unused listener %s:%s",
+			    us->host, us->port);
+		}
+
+		TAILQ_REMOVE(&upgrade_sockets, us, list);
+		close(us->fd);
+		kore_free(us->host);
+		kore_free(us->port);
+		kore_free(us);
+	}
+}
+
+/* Let the parent we are replacing know our workers are up. */
+void
+kore_upgrade_ready(void)
+{
+	u_int8_t	ready;
+
+	if (upgrade_fd == -1)
+		return;
+
+	ready = 1;
+	if (write(upgrade_fd, &ready, sizeof(ready)) == -1)
+		kore_log(LOG_NOTICE, "upgrade: write: %s", errno_s);
+
+	close(upgrade_fd);
+	upgrade_fd = -1;
+}
+
+/* Called in the parent on SIGUSR2. */
+void
+kore_upgrade_start(void)
+{
+	int		sv[2];
+	char		fd[16];
+
+	if (upgrade_fd != -1 || kore_upgrade_handover) {
+		kore_log(LOG_NOTICE, "upgrade: already in progress");
+		return;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		kore_log(LOG_ERR, "upgrade: socketpair: %s", errno_s);
+		return;
+	}
+
+	if ((upgrade_pid = fork()) == -1) {
+		kore_log(LOG_ERR, "upgrade: fork: %s", errno_s);
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+
+	if (upgrade_pid == 0) {
+		close(sv[0]);
+
+		/* Keep it out of our process group and our signals. */
+		(void)setsid();
+
+		if (upgrade_cwd != NULL && chdir(upgrade_cwd) == -1) {
+			kore_log(LOG_ERR, "upgrade: chdir(%s): %s",
+			    upgrade_cwd, errno_s);
+			_exit(1);
+		}
+
+		(void)snprintf(fd, sizeof(fd), "%d", sv[1]);
+		if (setenv(UPGRADE_ENV, fd, 1) == -1) {
+			kore_log(LOG_ERR, "upgrade: setenv: %s", errno_s);
+			_exit(1);
+		}
+
+		execvp(upgrade_path, upgrade_argv);
+		kore_log(LOG_ERR, "upgrade: exec(%s): %s",
+		    upgrade_path, errno_s);
+		_exit(1);
+	}
+
+	close(sv[1]);
+	upgrade_fd = sv[0];
+
+	if (!upgrade_send(upgrade_fd) ||
+	    !kore_connection_nonblock(upgrade_fd, 0)) {
+		upgrade_abort();
+		return;
+	}
+
+	kore_log(LOG_NOTICE, "upgrade: started new process %d", upgrade_pid);
+
+	upgrade_timer = kore_timer_add(upgrade_check,
+	    UPGRADE_CHECK_MS, NULL, 0);
+}
+
+static void
+upgrade_check(void *arg, u_int64_t now)
+{
+	ssize_t		ret;
+	int		status;
+	u_int8_t	ready;
+
+	/* The new process, or what daemon() left of it. */
+	if (upgrade_pid != -1 &&
+	    waitpid(upgrade_pid, &status, WNOHANG) == upgrade_pid)
+		upgrade_pid = -1;
+
+	if (kore_upgrade_handover) {
+		if (kore_worker_running() == 0) {
+			kore_log(LOG_NOTICE, "upgrade: all workers drained");
+			kore_quit = 1;
+		}
+		return;
+	}
+
+	if ((ret = read(upgrade_fd, &ready, sizeof(ready))) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		kore_log(LOG_ERR, "upgrade: read: %s", errno_s);
+		upgrade_abort();
+		return;
+	}
+
+	if (ret == 0) {
+		kore_log(LOG_ERR, "upgrade: new process failed to start");
+		upgrade_abort();
+		return;
+	}
+
+	close(upgrade_fd);
+	upgrade_fd = -1;
+	kore_upgrade_handover = 1;
+
+	kore_log(LOG_NOTICE,
+	    "upgrade: new process is up, draining workers for up to %us",
+	    kore_upgrade_drain_timeout);
+
+	kore_worker_dispatch_signal(SIGUSR2);
+
+	if (kore_upgrade_drain_timeout == 0) {
+		kore_quit = 1;
+		return;
+	}
+
+	kore_timer_add(upgrade_deadline,
+	    (u_int64_t)kore_upgrade_drain_timeout * 1000, NULL, 1);
+}
+
+static void
+upgrade_deadline(void *arg, u_int64_t now)
+{
+	kore_log(LOG_NOTICE, "upgrade: drain timeout reached, stopping");
+	kore_quit = 1;
+}
+
+static void
+upgrade_abort(void)
+{
+	int		status;
+
+	close(upgrade_fd);
+	upgrade_fd = -1;
+
+	if (upgrade_timer != NULL) {
+		kore_timer_remove(upgrade_timer);
+		upgrade_timer = NULL;
+	}
+
+	if (upgrade_pid != -1) {
+		(void)waitpid(upgrade_pid, &status, WNOHANG);
+		upgrade_pid = -1;
+	}
+}
+
+static int
+upgrade_send(int fd)
+{
+	struct listener		*l;
+	struct kore_server	*srv;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list) {
+			if (l->fd == -1)
+				continue;
+			if (!upgrade_send_socket(fd, l))
+				return (KORE_RESULT_ERROR);
+		}
+	}
+
+	/* A message without a socket ends the list. */
+	return (upgrade_send_socket(fd, NULL));
+}
+
+static int
+upgrade_send_socket(int fd, struct listener *l)
+{
+	struct msghdr		msg;
+	struct cmsghdr		*cmsg;
+	struct iovec		iov;
+	struct upgrade_msg	um;
+	union {
+		struct cmsghdr	hdr;
+		u_int8_t	buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+
+	memset(&um, 0, sizeof(um));
+	memset(&msg, 0, sizeof(msg));
+
+	iov.iov_base = &um;
+	iov.iov_len = sizeof(um);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (l != NULL) {
+		um.family = l->family;
+		(void)kore_strlcpy(um.host, l->host, sizeof(um.host));
+		if (l->port != NULL)
+			(void)kore_strlcpy(um.port, l->port, sizeof(um.port));
+
+		memset(&cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf.buf;
+		msg.msg_controllen = sizeof(cbuf.buf);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &l->fd, sizeof(int));
+	} else {
+		um.family = AF_UNSPEC;
+	}
+
+	for (;;) {
+		if (sendmsg(fd, &msg, 0) == -1) {
+			if (errno == EINTR)
+				continue;
+			kore_log(LOG_ERR, "upgrade: sendmsg: %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+		break;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+upgrade_recv(int fd)
+{
+	struct msghdr		msg;
+	struct cmsghdr		*cmsg;
+	struct iovec		iov;
+	struct upgrade_msg	um;
+	ssize_t			ret;
+	int			sock;
+	struct upgrade_socket	*us;
+	union {
+		struct cmsghdr	hdr;
+		u_int8_t	buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+
+		iov.iov_base = &um;
+		iov.iov_len = sizeof(um);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf.buf;
+		msg.msg_controllen = sizeof(cbuf.buf);
+
+		if ((ret = recvmsg(fd, &msg, MSG_WAITALL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("%s: recvmsg: %s", __func__, errno_s);
+		}
+
+		if ((size_t)ret != sizeof(um))
+			fatal("%s: short read from old parent", __func__);
+
+		if (um.family == AF_UNSPEC)
+			break;
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS ||
+		    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+			fatal("%s: no socket from old parent", __func__);
+
+		memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+
+		if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1)
+			fatal("%s: fcntl: %s", __func__, errno_s);
+
+		um.host[sizeof(um.host) - 1] = '\0';
+		um.port[sizeof(um.port) - 1] = '\0';
+
+		us = kore_calloc(1, sizeof(*us));
+		us->fd = sock;
+		us->family = um.family;
+		us->host = kore_strdup(um.host);
+		us->port = kore_strdup(um.port);
+
+		TAILQ_INSERT_TAIL(&upgrade_sockets, us, list);
+	}
+}
@@ -0,0 +1,1697 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * HTTP reverse proxying for routes configured with a proxy directive.
+ *
+ * The request is forwarded as HTTP/1.1 to one of the servers of its
+ * upstream over a connection taken from a per worker keep-alive pool.
+ * Hop-by-hop headers are dropped in both directions.
+ *
+ * The response streams back to HTTP/1.x clients as it arrives, reading
+ * from the upstream stops while more than UPSTREAM_PENDING_MAX bytes
+ * wait to be sent to the client. Content-length and chunked bodies are
+ * passed through as is, bodies delimited by the upstream closing the
+ * connection are chunked for HTTP/1.1 clients. HTTP/2 clients get the
+ * response in one go once it is complete (up to upstream_buffer_max).
+ *
+ * Health checking is passive: a server that failed max_fails times is
+ * left alone for fail_timeout seconds. Like the pools, this state is
+ * kept per worker.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdlib.h>
+
+#include "kore.h"
+#include "http.h"
+
+#if defined(__linux__)
+#include "seccomp.h"
+
+static struct sock_filter filter_upstream[] = {
+	KORE_SYSCALL_ALLOW(connect),
+	KORE_SYSCALL_ALLOW(getsockopt),
+	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_INET),
+	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_INET6),
+};
+#endif
+
+#define UPSTREAM_TICK_MS		500
+#define UPSTREAM_HASH_POINTS		160
+#define UPSTREAM_HEADER_MAX		(32 * 1024)
+#define UPSTREAM_HEADER_LINES		128
+#define UPSTREAM_READ_SIZE		(16 * 1024)
+#define UPSTREAM_PENDING_MAX		(256 * 1024)
+
+#define UPSTREAM_CONN_CONNECTING	1
+#define UPSTREAM_CONN_ACTIVE		2
+#define UPSTREAM_CONN_IDLE		3
+#define UPSTREAM_CONN_DEAD		4
+
+#define UPSTREAM_STATE_CONNECT		1
+#define UPSTREAM_STATE_SEND		2
+#define UPSTREAM_STATE_HEADERS		3
+#define UPSTREAM_STATE_BODY		4
+#define UPSTREAM_STATE_DONE		5
+
+#define UPSTREAM_FLAG_REUSED		0x0001
+#define UPSTREAM_FLAG_STREAM		0x0002
+#define UPSTREAM_FLAG_CHUNKED_IN	0x0004
+#define UPSTREAM_FLAG_CHUNKED_OUT	0x0008
+#define UPSTREAM_FLAG_UNTIL_CLOSE	0x0010
+#define UPSTREAM_FLAG_CLOSE		0x0020
+#define UPSTREAM_FLAG_DRAIN		0x0040
+#define UPSTREAM_FLAG_TIMEDOUT		0x0080
+#define UPSTREAM_FLAG_RECEIVED		0x0100
+#define UPSTREAM_FLAG_CLIENT_CLOSE	0x0200
+
+#define CHUNK_SIZE			1
+#define CHUNK_EXT			2
+#define CHUNK_SIZE_LF			3
+#define CHUNK_DATA			4
+#define CHUNK_DATA_CR			5
+#define CHUNK_DATA_LF			6
+#define CHUNK_TRAILER			7
+#define CHUNK_TRAILER_LINE		8
+#define CHUNK_TRAILER_LF		9
+#define CHUNK_DONE			10
+
+struct upstream_session;
+
+struct upstream_conn {
+	struct kore_event		evt;
+	int				fd;
+	int				state;
+	u_int64_t			idle;
+	struct kore_upstream_server	*server;
+	struct upstream_session		*session;
+	TAILQ_ENTRY(upstream_conn)	list;
+};
+
+TAILQ_HEAD(upstream_conn_list, upstream_conn);
+
+struct kore_upstream_server {
+	char				*name;
+	int				family;
+	socklen_t			addrlen;
+	struct sockaddr_storage		addr;
+
+	u_int32_t			fails;
+	u_int32_t			active;
+	u_int32_t			idle_count;
+	u_int64_t			tried;
+	u_int64_t			down_until;
+
+	struct kore_upstream		*upstream;
+	struct upstream_conn_list	idle;
+};
+
+struct kore_upstream_point {
+	u_int32_t			hash;
+	u_int32_t			server;
+};
+
+struct upstream_session {
+	u_int64_t			id;
+	int				state;
+	int				flags;
+	int				status;
+	u_int64_t			deadline;
+
+	struct http_request		*req;
+	struct kore_upstream		*upstream;
+	struct kore_upstream_server	*server;
+	struct upstream_conn		*conn;
+
+	/* Request head and body on their way out. */
+	struct kore_buf			out;
+	size_t				out_off;
+	u_int64_t			body_left;
+
+	/* Response headers as they come in. */
+	struct kore_buf			in;
+
+	/* Response body framing. */
+	u_int64_t			length;
+	u_int64_t			chunk_left;
+	int				chunk_state;
+
+	/* Response body for clients we do not stream to. */
+	struct kore_buf			*response;
+
+	TAILQ_ENTRY(upstream_session)	list;
+};
+
+static void	upstream_tick(void *, u_int64_t);
+static void	upstream_event(void *, int);
+static int	upstream_start(struct upstream_session *);
+static int	upstream_connected(struct upstream_session *);
+static int	upstream_send(struct upstream_session *);
+static int	upstream_headers(struct upstream_session *);
+static int	upstream_body(struct upstream_session *);
+static int	upstream_finish(struct upstream_session *);
+static int	upstream_failed(struct upstream_session *, int);
+static int	upstream_parse(struct upstream_session *, size_t);
+static int	upstream_response(struct upstream_session *,
+		    const char *, char **, char **, int);
+static void	upstream_request_head(struct upstream_session *);
+static int	upstream_forward(struct upstream_session *,
+		    u_int8_t *, size_t);
+static ssize_t	upstream_chunked(struct upstream_session *,
+		    const u_int8_t *, size_t);
+static int	upstream_sent(struct netbuf *);
+static void	upstream_detach(struct upstream_session *);
+static void	upstream_release(struct upstream_session *);
+static ssize_t	upstream_read(struct upstream_session *, void *, size_t);
+static void	upstream_server_failed(struct upstream_session *);
+static int	upstream_hop_header(const char *, const char *);
+static int	upstream_token(const char *, const char *);
+static int	upstream_usable(struct upstream_session *,
+		    struct kore_upstream_server *, u_int64_t);
+static int	upstream_point_cmp(const void *, const void *);
+static u_int32_t	upstream_hash(const void *, size_t, u_int32_t);
+
+static void	upstream_conn_put(struct upstream_conn *);
+static void	upstream_conn_close(struct upstream_conn *);
+
+static struct upstream_conn		*upstream_conn_get(
+					    struct upstream_session *);
+static struct kore_upstream_server	*upstream_select(
+					    struct upstream_session *);
+
+/* Never forwarded, on top of whatever Connection lists. */
+static const char *hop_headers[] = {
+	"connection",
+	"keep-alive",
+	"proxy-connection",
+	"proxy-authenticate",
+	"proxy-authorization",
+	"te",
+	"trailer",
+	"transfer-encoding",
+	"upgrade",
+	NULL
+};
+
+static LIST_HEAD(, kore_upstream)		upstreams;
+static TAILQ_HEAD(, upstream_session)		sessions;
+static struct upstream_conn_list		graveyard;
+static u_int64_t				session_id = 0;
+static int					initialized = 0;
+
+static void
+upstream_setup(void)
+{
+	if (initialized)
+		return;
+
+	LIST_INIT(&upstreams);
+	TAILQ_INIT(&sessions);
+	TAILQ_INIT(&graveyard);
+
+#if defined(__linux__)
+	kore_seccomp_filter("upstream",
+	    filter_upstream, KORE_FILTER_LEN(filter_upstream));
+#endif
+
+	initialized = 1;
+}
+
+struct kore_upstream *
+kore_upstream_create(const char *name)
+{
+	struct kore_upstream	*up;
+
+	upstream_setup();
+
+	if (kore_upstream_lookup(name) != NULL) {
+		kore_log(LOG_ERR, "upstream '%s' already exists", name);
+		return (NULL);
+	}
+
+	up = kore_calloc(1, sizeof(*up));
+	up->name = kore_strdup(name);
+	up->balance = KORE_UPSTREAM_ROUND_ROBIN;
+	up->keepalive = 32;
+	up->keepalive_timeout = 60;
+	up->max_fails = 1;
+	up->fail_timeout = 10;
+	up->connect_timeout = 5;
+	up->timeout = 60;
+	up->buffer_max = 16 * 1024 * 1024;
+
+	LIST_INSERT_HEAD(&upstreams, up, list);
+
+	return (up);
+}
+
+struct kore_upstream *
+kore_upstream_lookup(const char *name)
+{
+	struct kore_upstream	*up;
+
+	if (!initialized)
+		return (NULL);
+
+	LIST_FOREACH(up, &upstreams, list) {
+		if (!strcmp(up->name, name))
+			return (up);
+	}
+
+	return (NULL);
+}
+
+int
+kore_upstream_server_add(struct kore_upstream *up, const char *host,
+    const char *port)
+{
+	int				r;
+	struct addrinfo			hints, *res;
+	struct kore_upstream_server	*srv;
+	char				name[256];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((r = getaddrinfo(host, port, &hints, &res)) != 0) {
+		kore_log(LOG_ERR, "upstream: getaddrinfo(%s): %s",
+		    host, gai_strerror(r));
+		return (KORE_RESULT_ERROR);
+	}
+
+	if ((res->ai_family != AF_INET && res->ai_family != AF_INET6) ||
+	    res->ai_addrlen > sizeof(srv->addr)) {
+		kore_log(LOG_ERR, "upstream: unsupported address for %s", host);
+		freeaddrinfo(res);
+		return (KORE_RESULT_ERROR);
+	}
+
+	r = snprintf(name, sizeof(name), "%s:%s", host, port);
+	if (r == -1 || (size_t)r >= sizeof(name)) {
+		kore_log(LOG_ERR, "upstream: server name too long");
+		freeaddrinfo(res);
+		return (KORE_RESULT_ERROR);
+	}
+
+	srv = kore_calloc(1, sizeof(*srv));
+	srv->upstream = up;
+	srv->name = kore_strdup(name);
+	srv->family = res->ai_family;
+	srv->addrlen = res->ai_addrlen;
+	memcpy(&srv->addr, res->ai_addr, res->ai_addrlen);
+	TAILQ_INIT(&srv->idle);
+
+	freeaddrinfo(res);
+
+	up->servers = kore_realloc(up->servers,
+	    (up->server_count + 1) * sizeof(*up->servers));
+	up->servers[up->server_count++] = srv;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Called once the upstream block is closed, builds the hash ring used
+ * by the hash balancing policies. Every server gets a fixed number of
+ * points on it so adding or removing a server only moves the keys that
+ * hashed next to its points.
+ */
+int
+kore_upstream_finalize(struct kore_upstream *up)
+{
+	u_int32_t			i, p;
+	struct kore_upstream_server	*srv;
+
+	if (up->server_count == 0) {
+		kore_log(LOG_ERR, "upstream '%s' has no servers", up->name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	up->ring_len = up->server_count * UPSTREAM_HASH_POINTS;
+	up->ring = kore_calloc(up->ring_len, sizeof(*up->ring));
+
+	for (i = 0; i < up->server_count; i++) {
+		srv = up->servers[i];
+		for (p = 0; p < UPSTREAM_HASH_POINTS; p++) {
+			up->ring[(i * UPSTREAM_HASH_POINTS) + p].server = i;
+			up->ring[(i * UPSTREAM_HASH_POINTS) + p].hash =
+			    upstream_hash(srv->name, strlen(srv->name), p);
+		}
+	}
+
+	qsort(up->ring, up->ring_len, sizeof(*up->ring), upstream_point_cmp);
+
+	return (KORE_RESULT_OK);
+}
+
+void
+kore_upstream_worker_init(void)
+{
+	if (!initialized || LIST_EMPTY(&upstreams))
+		return;
+
+	kore_timer_add(upstream_tick, UPSTREAM_TICK_MS, NULL, 0);
+}
+
+/*
+ * The page handler for proxy routes, called from http_process_request()
+ * every time the request wakes up until the response is complete.
+ */
+int
+kore_upstream_run(struct http_request *req)
+{
+	int				r;
+	struct upstream_session		*s;
+
+	if ((s = req->upstream) == NULL) {
+		s = kore_calloc(1, sizeof(*s));
+		s->req = req;
+		s->id = ++session_id;
+		s->upstream = req->rt->upstream;
+
+		kore_buf_init(&s->out, UPSTREAM_READ_SIZE);
+		kore_buf_init(&s->in, UPSTREAM_READ_SIZE);
+
+		req->upstream = s;
+		TAILQ_INSERT_TAIL(&sessions, s, list);
+
+		if (!upstream_start(s))
+			return (upstream_failed(s, HTTP_STATUS_BAD_GATEWAY));
+	}
+
+	if (req->owner == NULL)
+		return (KORE_RESULT_ERROR);
+
+	for (;;) {
+		if (s->flags & UPSTREAM_FLAG_TIMEDOUT) {
+			s->flags &= ~UPSTREAM_FLAG_TIMEDOUT;
+			kore_log(LOG_NOTICE, "upstream %s: %s timed out",
+			    s->upstream->name, s->server->name);
+			return (upstream_failed(s,
+			    HTTP_STATUS_GATEWAY_TIMEOUT));
+		}
+
+		switch (s->state) {
+		case UPSTREAM_STATE_CONNECT:
+			r = upstream_connected(s);
+			break;
+		case UPSTREAM_STATE_SEND:
+			r = upstream_send(s);
+			break;
+		case UPSTREAM_STATE_HEADERS:
+			r = upstream_headers(s);
+			break;
+		case UPSTREAM_STATE_BODY:
+			r = upstream_body(s);
+			break;
+		case UPSTREAM_STATE_DONE:
+			return (upstream_finish(s));
+		default:
+			fatal("%s: unknown state %d", __func__, s->state);
+		}
+
+		switch (r) {
+		case KORE_RESULT_OK:
+			break;
+		case KORE_RESULT_RETRY:
+			http_request_sleep(req);
+			return (KORE_RESULT_RETRY);
+		case KORE_RESULT_ERROR:
+			return (upstream_failed(s, HTTP_STATUS_BAD_GATEWAY));
+		default:
+			fatal("%s: unknown result %d", __func__, r);
+		}
+	}
+}
+
+void
+kore_upstream_cleanup(struct http_request *req)
+{
+	struct upstream_session		*s;
+
+	if ((s = req->upstream) == NULL)
+		return;
+
+	upstream_detach(s);
+
+	/* Whatever the connection is in the middle of, it is of no use. */
+	if (s->conn != NULL) {
+		s->server->active--;
+		upstream_conn_close(s->conn);
+		s->conn = NULL;
+	}
+
+	TAILQ_REMOVE(&sessions, s, list);
+
+	kore_buf_cleanup(&s->in);
+	kore_buf_cleanup(&s->out);
+	if (s->response != NULL)
+		kore_buf_free(s->response);
+
+	kore_free(s);
+	req->upstream = NULL;
+}
+
+/*
+ * Picks a server and gets a connection to it, either from the pool
+ * or a brand new one.
+ */
+static int
+upstream_start(struct upstream_session *s)
+{
+	if ((s->server = upstream_select(s)) == NULL) {
+		kore_log(LOG_NOTICE, "upstream %s: no servers available",
+		    s->upstream->name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	s->server->tried = s->id;
+
+	s->flags &= ~UPSTREAM_FLAG_REUSED;
+	if ((s->conn = upstream_conn_get(s)) == NULL) {
+		upstream_server_failed(s);
+		return (upstream_start(s));
+	}
+
+	s->server->active++;
+	s->conn->session = s;
+
+	if (s->conn->state == UPSTREAM_CONN_CONNECTING) {
+		s->state = UPSTREAM_STATE_CONNECT;
+		s->deadline = kore_time_ms() +
+		    (s->upstream->connect_timeout * 1000);
+	} else {
+		s->state = UPSTREAM_STATE_SEND;
+		s->flags |= UPSTREAM_FLAG_REUSED;
+		s->deadline = kore_time_ms() + (s->upstream->timeout * 1000);
+	}
+
+	upstream_request_head(s);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+upstream_connected(struct upstream_session *s)
+{
+	int		err;
+	socklen_t	len;
+
+	if (!(s->conn->evt.flags & KORE_EVENT_WRITE))
+		return (KORE_RESULT_RETRY);
+
+	len = sizeof(err);
+	if (getsockopt(s->conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		err = errno;
+
+	if (err != 0) {
+		kore_log(LOG_NOTICE, "upstream %s: connect to %s: %s",
+		    s->upstream->name, s->server->name, strerror(err));
+		return (KORE_RESULT_ERROR);
+	}
+
+	s->conn->state = UPSTREAM_CONN_ACTIVE;
+	s->state = UPSTREAM_STATE_SEND;
+	s->deadline = kore_time_ms() + (s->upstream->timeout * 1000);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Writes the request head followed by the request body. The body was
+ * already received in full by the time the route runs, we read it back
+ * in pieces from wherever http_body_read() finds it.
+ */
+static int
+upstream_send(struct upstream_session *s)
+{
+	ssize_t		r;
+
+	for (;;) {
+		if (s->out_off == s->out.offset) {
+			if (s->body_left == 0) {
+				kore_buf_reset(&s->out);
+				s->out_off = 0;
+				s->state = UPSTREAM_STATE_HEADERS;
+				return (KORE_RESULT_OK);
+			}
+
+			kore_buf_reset(&s->out);
+			s->out_off = 0;
+
+			r = http_body_read(s->req, s->out.data,
+			    MIN(s->out.length, s->body_left));
+			if (r <= 0) {
+				kore_log(LOG_NOTICE,
+				    "upstream %s: request body unavailable",
+				    s->upstream->name);
+				return (KORE_RESULT_ERROR);
+			}
+
+			s->out.offset = r;
+			s->body_left -= r;
+		}
+
+		if (!(s->conn->evt.flags & KORE_EVENT_WRITE))
+			return (KORE_RESULT_RETRY);
+
+		r = send(s->conn->fd, s->out.data + s->out_off,
+		    s->out.offset - s->out_off, 0);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				s->conn->evt.flags &= ~KORE_EVENT_WRITE;
+				return (KORE_RESULT_RETRY);
+			}
+			kore_log(LOG_NOTICE, "upstream %s: send to %s: %s",
+			    s->upstream->name, s->server->name, errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+
+		s->out_off += r;
+	}
+}
+
+static int
+upstream_headers(struct upstream_session *s)
+{
+	ssize_t		r;
+	u_int8_t	*end;
+	size_t		len;
+
+	for (;;) {
+		end = kore_mem_find(s->in.data, s->in.offset, "\r\n\r\n", 4);
+		if (end != NULL) {
+			len = (end - s->in.data) + 4;
+			r = upstream_parse(s, len);
+			if (r != KORE_RESULT_RETRY)
+				return (r);
+			continue;
+		}
+
+		if (s->in.offset >= UPSTREAM_HEADER_MAX) {
+			kore_log(LOG_NOTICE,
+			    "upstream %s: %s sent too large headers",
+			    s->upstream->name, s->server->name);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (s->in.length - s->in.offset < UPSTREAM_READ_SIZE) {
+			s->in.length += UPSTREAM_READ_SIZE;
+			s->in.data = kore_realloc(s->in.data, s->in.length);
+		}
+
+		r = upstream_read(s, s->in.data + s->in.offset,
+		    s->in.length - s->in.offset);
+		if (r == -1)
+			return (KORE_RESULT_ERROR);
+		if (r == -2)
+			return (KORE_RESULT_RETRY);
+
+		if (r == 0) {
+			kore_log(LOG_NOTICE,
+			    "upstream %s: %s closed before responding",
+			    s->upstream->name, s->server->name);
+			return (KORE_RESULT_ERROR);
+		}
+
+		s->in.offset += r;
+	}
+}
+
+/*
+ * Parses the response head in the first len bytes of s->in. Returns
+ * KORE_RESULT_RETRY if it was an interim response that was skipped.
+ */
+static int
+upstream_parse(struct upstream_session *s, size_t len)
+{
+	int		err, cnt;
+	char		*p, *line, *next, *value, *conn, *te;
+	char		*names[UPSTREAM_HEADER_LINES];
+	char		*values[UPSTREAM_HEADER_LINES];
+
+	s->in.data[len - 2] = '\0';
+	line = (char *)s->in.data;
+
+	if ((next = strstr(line, "\r\n")) == NULL)
+		return (KORE_RESULT_ERROR);
+	*next = '\0';
+	next += 2;
+
+	if (strncmp(line, "HTTP/1.", 7) || strlen(line) < 12 ||
+	    line[8] != ' ' || (line[12] != ' ' && line[12] != '\0')) {
+		kore_log(LOG_NOTICE, "upstream %s: %s sent a bad status line",
+		    s->upstream->name, s->server->name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (line[7] != '1')
+		s->flags |= UPSTREAM_FLAG_CLOSE;
+
+	line[12] = '\0';
+	s->status = kore_strtonum(&line[9], 10, 100, 599, &err);
+	if (err != KORE_RESULT_OK)
+		return (KORE_RESULT_ERROR);
+
+	cnt = 0;
+	te = NULL;
+	conn = NULL;
+	s->length = 0;
+	s->flags |= UPSTREAM_FLAG_UNTIL_CLOSE;
+
+	for (line = next; *line != '\0'; line = next) {
+		if ((next = strstr(line, "\r\n")) == NULL)
+			return (KORE_RESULT_ERROR);
+		*next = '\0';
+		next += 2;
+
+		if ((p = strchr(line, ':')) == NULL || p == line)
+			return (KORE_RESULT_ERROR);
+		*(p)++ = '\0';
+
+		value = kore_text_trim(p, strlen(p));
+
+		if (!strcasecmp(line, "connection")) {
+			conn = value;
+		} else if (!strcasecmp(line, "transfer-encoding")) {
+			te = value;
+		} else if (!strcasecmp(line, "content-length")) {
+			s->length = kore_strtonum64(value, 0, &err);
+			if (err != KORE_RESULT_OK)
+				return (KORE_RESULT_ERROR);
+			s->flags &= ~UPSTREAM_FLAG_UNTIL_CLOSE;
+		}
+
+		if (cnt == UPSTREAM_HEADER_LINES)
+			return (KORE_RESULT_ERROR);
+
+		names[cnt] = line;
+		values[cnt] = value;
+		cnt++;
+	}
+
+	if (conn != NULL && upstream_token(conn, "close"))
+		s->flags |= UPSTREAM_FLAG_CLOSE;
+
+	/* Interim responses are not passed on, wait for the real one. */
+	if (s->status >= 100 && s->status < 200) {
+		if (s->status == 101)
+			return (KORE_RESULT_ERROR);
+
+		memmove(s->in.data, s->in.data + len, s->in.offset - len);
+		s->in.offset -= len;
+		s->flags &= ~UPSTREAM_FLAG_CLOSE;
+		return (KORE_RESULT_RETRY);
+	}
+
+	if (te != NULL) {
+		if (!upstream_token(te, "chunked"))
+			return (KORE_RESULT_ERROR);
+		s->flags |= UPSTREAM_FLAG_CHUNKED_IN;
+		s->flags &= ~UPSTREAM_FLAG_UNTIL_CLOSE;
+		s->chunk_state = CHUNK_SIZE;
+		s->chunk_left = 0;
+		s->length = 0;
+	}
+
+	if (s->req->method == HTTP_METHOD_HEAD ||
+	    s->status == HTTP_STATUS_NO_CONTENT ||
+	    s->status == HTTP_STATUS_NOT_MODIFIED) {
+		s->length = 0;
+		s->flags &= ~(UPSTREAM_FLAG_CHUNKED_IN |
+		    UPSTREAM_FLAG_UNTIL_CLOSE);
+	}
+
+	if (s->flags & UPSTREAM_FLAG_UNTIL_CLOSE)
+		s->flags |= UPSTREAM_FLAG_CLOSE;
+
+	s->server->fails = 0;
+	s->flags |= UPSTREAM_FLAG_RECEIVED;
+
+	if (!upstream_response(s, conn, names, values, cnt))
+		return (KORE_RESULT_ERROR);
+
+	/* What came in after the head is the start of the body. */
+	s->state = UPSTREAM_STATE_BODY;
+	s->in.offset -= len;
+
+	if (s->in.offset > 0) {
+		p = kore_malloc(s->in.offset);
+		memcpy(p, s->in.data + len, s->in.offset);
+		len = s->in.offset;
+		s->in.offset = 0;
+		return (upstream_forward(s, (u_int8_t *)p, len));
+	}
+
+	if (!(s->flags & (UPSTREAM_FLAG_CHUNKED_IN |
+	    UPSTREAM_FLAG_UNTIL_CLOSE)) && s->length == 0)
+		s->state = UPSTREAM_STATE_DONE;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Sets up the response to the client. HTTP/1.x clients get the headers
+ * right away and the body streamed after them.
+ */
+static int
+upstream_response(struct upstream_session *s, const char *conn,
+    char **names, char **values, int cnt)
+{
+	int			i;
+	struct http_request	*req;
+	struct http_header	*hdr;
+	struct connection	*c;
+
+	req = s->req;
+	c = req->owner;
+
+	for (i = 0; i < cnt; i++) {
+		if (upstream_hop_header(names[i], conn) ||
+		    !strcasecmp(names[i], "server"))
+			continue;
+
+		if (!strcasecmp(names[i], "content-length") &&
+		    (c->proto != CONN_PROTO_HTTP ||
+		    (s->flags & UPSTREAM_FLAG_CHUNKED_IN)))
+			continue;
+
+		/* Repeated headers such as set-cookie all go through. */
+		hdr = kore_pool_get(&http_header_pool);
+		hdr->header = http_request_strdup(req, names[i]);
+		hdr->value = http_request_strdup(req, values[i]);
+		TAILQ_INSERT_TAIL(&req->resp_headers, hdr, list);
+	}
+
+	if (c->proto != CONN_PROTO_HTTP) {
+		s->response = kore_buf_alloc(UPSTREAM_READ_SIZE);
+		return (KORE_RESULT_OK);
+	}
+
+	s->flags |= UPSTREAM_FLAG_STREAM;
+	req->flags |= HTTP_REQUEST_NO_CONTENT_LENGTH;
+
+	if ((s->flags & UPSTREAM_FLAG_CHUNKED_IN) &&
+	    (req->flags & HTTP_VERSION_1_0)) {
+		s->flags &= ~UPSTREAM_FLAG_STREAM;
+		s->response = kore_buf_alloc(UPSTREAM_READ_SIZE);
+		req->flags &= ~HTTP_REQUEST_NO_CONTENT_LENGTH;
+		return (KORE_RESULT_OK);
+	}
+
+	if (s->flags & UPSTREAM_FLAG_CHUNKED_IN) {
+		http_response_header(req, "transfer-encoding", "chunked");
+	} else if ((s->flags & UPSTREAM_FLAG_UNTIL_CLOSE) &&
+	    !(req->flags & HTTP_VERSION_1_0)) {
+		s->flags |= UPSTREAM_FLAG_CHUNKED_OUT;
+		http_response_header(req, "transfer-encoding", "chunked");
+	}
+
+	/* We start receiving again in upstream_finish(). */
+	c->flags |= CONN_IS_BUSY;
+	http_response(req, s->status, NULL, 0);
+
+	/* An empty send queue is not the end of the response yet. */
+	if (c->flags & CONN_CLOSE_EMPTY) {
+		c->flags &= ~CONN_CLOSE_EMPTY;
+		s->flags |= UPSTREAM_FLAG_CLIENT_CLOSE;
+	}
+
+	if (!net_send_flush(c)) {
+		kore_connection_disconnect(c);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+upstream_body(struct upstream_session *s)
+{
+	ssize_t		r;
+	u_int8_t	*buf;
+
+	for (;;) {
+		if (s->state != UPSTREAM_STATE_BODY)
+			return (KORE_RESULT_OK);
+
+		/* The client is not keeping up, wait for it. */
+		if ((s->flags & UPSTREAM_FLAG_STREAM) &&
+		    net_send_pending(s->req->owner) >= UPSTREAM_PENDING_MAX) {
+			s->flags |= UPSTREAM_FLAG_DRAIN;
+			s->deadline = 0;
+			return (KORE_RESULT_RETRY);
+		}
+
+		buf = kore_malloc(UPSTREAM_READ_SIZE);
+		r = upstream_read(s, buf, UPSTREAM_READ_SIZE);
+
+		if (r < 0) {
+			kore_free(buf);
+			if (r == -2)
+				return (KORE_RESULT_RETRY);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (r == 0) {
+			kore_free(buf);
+			if (!(s->flags & UPSTREAM_FLAG_UNTIL_CLOSE)) {
+				kore_log(LOG_NOTICE,
+				    "upstream %s: %s closed mid response",
+				    s->upstream->name, s->server->name);
+				return (KORE_RESULT_ERROR);
+			}
+			s->state = UPSTREAM_STATE_DONE;
+			return (KORE_RESULT_OK);
+		}
+
+		if (!upstream_forward(s, buf, r))
+			return (KORE_RESULT_ERROR);
+	}
+}
+
+/*
+ * Hands len bytes of response body in buf over to the client, buf is
+ * ours to keep or free. Updates the state once the body is complete.
+ */
+static int
+upstream_forward(struct upstream_session *s, u_int8_t *buf, size_t len)
+{
+	ssize_t			used;
+	struct netbuf		*nb;
+	struct connection	*c;
+	int			hlen;
+	char			chunk[32];
+
+	c = s->req->owner;
+
+	if (s->flags & UPSTREAM_FLAG_CHUNKED_IN) {
+		/* Decoded data goes into s->response when not streaming. */
+		if ((used = upstream_chunked(s, buf, len)) == -1) {
+			kore_free(buf);
+			return (KORE_RESULT_ERROR);
+		}
+	} else if (!(s->flags & UPSTREAM_FLAG_UNTIL_CLOSE)) {
+		used = MIN(len, s->length);
+		s->length -= used;
+		if (s->length == 0)
+			s->state = UPSTREAM_STATE_DONE;
+		if (s->response != NULL)
+			kore_buf_append(s->response, buf, used);
+	} else {
+		used = len;
+		if (s->response != NULL)
+			kore_buf_append(s->response, buf, used);
+	}
+
+	/* Anything past the response means the connection is garbage. */
+	if ((size_t)used != len)
+		s->flags |= UPSTREAM_FLAG_CLOSE;
+
+	if (s->response != NULL) {
+		kore_free(buf);
+		if (s->response->offset > s->upstream->buffer_max) {
+			kore_log(LOG_NOTICE,
+			    "upstream %s: response too large to buffer",
+			    s->upstream->name);
+			return (KORE_RESULT_ERROR);
+		}
+		return (KORE_RESULT_OK);
+	}
+
+	if (used == 0) {
+		kore_free(buf);
+		return (KORE_RESULT_OK);
+	}
+
+	if (s->flags & UPSTREAM_FLAG_CHUNKED_OUT) {
+		hlen = snprintf(chunk, sizeof(chunk), "%zx\r\n", (size_t)used);
+		if (hlen == -1 || (size_t)hlen >= sizeof(chunk))
+			fatal("%s: failed to create chunk header", __func__);
+		net_send_queue(c, chunk, hlen);
+	}
+
+	/* The buffer is sent as is and released by upstream_sent(). */
+	net_send_stream(c, buf, used, upstream_sent, &nb);
+	nb->extra = s;
+
+	if (s->flags & UPSTREAM_FLAG_CHUNKED_OUT)
+		net_send_queue(c, "\r\n", 2);
+
+	s->req->content_length += used;
+
+	if (!net_send_flush(c)) {
+		kore_connection_disconnect(c);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Walks the chunked encoding in data, returns how many bytes belong to
+ * the response body (including the framing) or -1 on bad encoding.
+ */
+static ssize_t
+upstream_chunked(struct upstream_session *s, const u_int8_t *data,
+    size_t len)
+{
+	size_t		off, n;
+	u_int8_t	ch;
+	int		digit;
+
+	off = 0;
+
+	while (off < len && s->chunk_state != CHUNK_DONE) {
+		if (s->chunk_state == CHUNK_DATA) {
+			n = MIN(len - off, s->chunk_left);
+			if (s->response != NULL)
+				kore_buf_append(s->response, data + off, n);
+			off += n;
+			s->chunk_left -= n;
+			if (s->chunk_left == 0)
+				s->chunk_state = CHUNK_DATA_CR;
+			continue;
+		}
+
+		ch = data[off++];
+
+		switch (s->chunk_state) {
+		case CHUNK_SIZE:
+			if (ch >= '0' && ch <= '9')
+				digit = ch - '0';
+			else if (ch >= 'a' && ch <= 'f')
+				digit = ch - 'a' + 10;
+			else if (ch >= 'A' && ch <= 'F')
+				digit = ch - 'A' + 10;
+			else
+				digit = -1;
+
+			if (digit != -1) {
+				if (s->chunk_left > (UINT64_MAX >> 4))
+					return (-1);
+				s->chunk_left = (s->chunk_left << 4) | digit;
+			} else if (ch == ';' || ch == ' ' || ch == '\t') {
+				s->chunk_state = CHUNK_EXT;
+			} else if (ch == '\r') {
+				s->chunk_state = CHUNK_SIZE_LF;
+			} else {
+				return (-1);
+			}
+			break;
+		case CHUNK_EXT:
+			if (ch == '\r')
+				s->chunk_state = CHUNK_SIZE_LF;
+			break;
+		case CHUNK_SIZE_LF:
+			if (ch != '\n')
+				return (-1);
+			if (s->chunk_left == 0)
+				s->chunk_state = CHUNK_TRAILER;
+			else
+				s->chunk_state = CHUNK_DATA;
+			break;
+		case CHUNK_DATA_CR:
+			if (ch != '\r')
+				return (-1);
+			s->chunk_state = CHUNK_DATA_LF;
+			break;
+		case CHUNK_DATA_LF:
+			if (ch != '\n')
+				return (-1);
+			s->chunk_state = CHUNK_SIZE;
+			break;
+		case CHUNK_TRAILER:
+			if (ch == '\r')
+				s->chunk_state = CHUNK_TRAILER_LF;
+			else
+				s->chunk_state = CHUNK_TRAILER_LINE;
+			break;
+		case CHUNK_TRAILER_LINE:
+			if (ch == '\n')
+				s->chunk_state = CHUNK_TRAILER;
+			break;
+		case CHUNK_TRAILER_LF:
+			if (ch != '\n')
+				return (-1);
+			s->chunk_state = CHUNK_DONE;
+			break;
+		default:
+			fatal("%s: unknown state %d", __func__, s->chunk_state);
+		}
+	}
+
+	if (s->chunk_state == CHUNK_DONE)
+		s->state = UPSTREAM_STATE_DONE;
+
+	return (off);
+}
+
+static int
+upstream_finish(struct upstream_session *s)
+{
+	struct http_request	*req;
+	struct connection	*c;
+
+	req = s->req;
+	c = req->owner;
+
+	upstream_release(s);
+
+	if (!(s->flags & UPSTREAM_FLAG_STREAM)) {
+		http_response(req, s->status,
+		    s->response->data, s->response->offset);
+		return (KORE_RESULT_OK);
+	}
+
+	if (s->flags & UPSTREAM_FLAG_CHUNKED_OUT)
+		net_send_queue(c, "0\r\n\r\n", 5);
+
+	c->flags &= ~CONN_IS_BUSY;
+
+	if (s->flags & UPSTREAM_FLAG_CLIENT_CLOSE)
+		c->flags |= CONN_CLOSE_EMPTY;
+	else
+		http_start_recv(c);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Something went wrong talking to the upstream. Before any of the
+ * response reached the client another server (or for a pooled
+ * connection that went stale, a fresh connection) is tried, as long as
+ * the upstream did not get to see the request body yet or never
+ * answered on a reused connection.
+ */
+static int
+upstream_failed(struct upstream_session *s, int status)
+{
+	int			retry;
+	struct http_header	*hdr;
+
+	if (s->flags & UPSTREAM_FLAG_STREAM) {
+		upstream_release(s);
+		s->req->owner->flags &= ~CONN_IS_BUSY;
+		return (KORE_RESULT_ERROR);
+	}
+
+	retry = 0;
+
+	if (s->conn != NULL && !(s->flags & UPSTREAM_FLAG_RECEIVED)) {
+		if (s->state == UPSTREAM_STATE_CONNECT) {
+			upstream_server_failed(s);
+			retry = 1;
+		} else if ((s->flags & UPSTREAM_FLAG_REUSED) &&
+		    status != HTTP_STATUS_GATEWAY_TIMEOUT &&
+		    s->in.offset == 0) {
+			/* The server closed it as we took it from the pool. */
+			s->server->tried = 0;
+			retry = 1;
+		} else {
+			upstream_server_failed(s);
+		}
+	}
+
+	s->flags |= UPSTREAM_FLAG_CLOSE;
+	upstream_release(s);
+
+	if (retry) {
+		kore_buf_reset(&s->in);
+		kore_buf_reset(&s->out);
+		s->out_off = 0;
+		if (http_body_rewind(s->req) && upstream_start(s))
+			return (kore_upstream_run(s->req));
+	}
+
+	if (s->response != NULL) {
+		kore_buf_free(s->response);
+		s->response = NULL;
+	}
+
+	/* Drop whatever headers the upstream did give us. */
+	while ((hdr = TAILQ_FIRST(&s->req->resp_headers)) != NULL) {
+		TAILQ_REMOVE(&s->req->resp_headers, hdr, list);
+		kore_pool_put(&http_header_pool, hdr);
+	}
+
+	s->req->flags &= ~HTTP_REQUEST_NO_CONTENT_LENGTH;
+	http_response(s->req, status, NULL, 0);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+upstream_request_head(struct upstream_session *s)
+{
+	struct http_request	*req;
+	struct http_header	*hdr;
+	struct connection	*c;
+	const char		*conn, *xff;
+	int			host;
+	char			addr[INET6_ADDRSTRLEN];
+
+	req = s->req;
+	c = req->owner;
+
+	kore_buf_reset(&s->out);
+	s->out_off = 0;
+
+	kore_buf_appendf(&s->out, "%s %s%s%s HTTP/1.1\r\n",
+	    http_method_text(req->method), req->path,
+	    req->query_string != NULL ? "?" : "",
+	    req->query_string != NULL ? req->query_string : "");
+
+	host = 0;
+	xff = NULL;
+
+	if (!http_request_header(req, "connection", &conn))
+		conn = NULL;
+
+	TAILQ_FOREACH(hdr, &req->req_headers, list) {
+		if (upstream_hop_header(hdr->header, conn) ||
+		    !strcasecmp(hdr->header, "content-length") ||
+		    !strcasecmp(hdr->header, "expect"))
+			continue;
+
+		if (!strcasecmp(hdr->header, "x-forwarded-for")) {
+			xff = hdr->value;
+			continue;
+		}
+
+		if (!strcasecmp(hdr->header, "host"))
+			host = 1;
+
+		kore_buf_appendf(&s->out, "%s: %s\r\n",
+		    hdr->header, hdr->value);
+	}
+
+	if (!host && req->host != NULL)
+		kore_buf_appendf(&s->out, "host: %s\r\n", req->host);
+
+	switch (c->family) {
+	case AF_INET:
+		if (inet_ntop(c->family, &c->addr.ipv4.sin_addr,
+		    addr, sizeof(addr)) == NULL)
+			addr[0] = '\0';
+		break;
+	case AF_INET6:
+		if (inet_ntop(c->family, &c->addr.ipv6.sin6_addr,
+		    addr, sizeof(addr)) == NULL)
+			addr[0] = '\0';
+		break;
+	default:
+		addr[0] = '\0';
+		break;
+	}
+
+	if (xff != NULL && addr[0] != '\0')
+		kore_buf_appendf(&s->out, "x-forwarded-for: %s, %s\r\n",
+		    xff, addr);
+	else if (xff != NULL)
+		kore_buf_appendf(&s->out, "x-forwarded-for: %s\r\n", xff);
+	else if (addr[0] != '\0')
+		kore_buf_appendf(&s->out, "x-forwarded-for: %s\r\n", addr);
+
+	kore_buf_appendf(&s->out, "x-forwarded-proto: %s\r\n",
+	    c->owner->server->tls ? "https" : "http");
+
+	s->body_left = req->http_body_length;
+	if (s->body_left > 0 || (req->flags & HTTP_REQUEST_EXPECT_BODY)) {
+		kore_buf_appendf(&s->out, "content-length: %" PRIu64 "\r\n",
+		    s->body_left);
+	}
+
+	if (s->upstream->keepalive == 0)
+		kore_buf_append(&s->out, "connection: close\r\n", 19);
+
+	kore_buf_append(&s->out, "\r\n", 2);
+}
+
+/*
+ * Reads from the upstream connection, returns -2 when there is nothing
+ * to read right now and -1 on errors.
+ */
+static ssize_t
+upstream_read(struct upstream_session *s, void *buf, size_t len)
+{
+	ssize_t		r;
+
+	if (!(s->conn->evt.flags & KORE_EVENT_READ))
+		return (-2);
+
+	for (;;) {
+		r = recv(s->conn->fd, buf, len, 0);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				s->conn->evt.flags &= ~KORE_EVENT_READ;
+				return (-2);
+			}
+			kore_log(LOG_NOTICE, "upstream %s: recv from %s: %s",
+			    s->upstream->name, s->server->name, errno_s);
+			return (-1);
+		}
+
+		break;
+	}
+
+	s->deadline = kore_time_ms() + (s->upstream->timeout * 1000);
+
+	return (r);
+}
+
+static int
+upstream_sent(struct netbuf *nb)
+{
+	struct upstream_session		*s;
+
+	kore_free(nb->buf);
+	nb->buf = NULL;
+
+	if ((s = nb->extra) == NULL)
+		return (KORE_RESULT_OK);
+
+	if ((s->flags & UPSTREAM_FLAG_DRAIN) &&
+	    net_send_pending(nb->owner) < UPSTREAM_PENDING_MAX) {
+		s->flags &= ~UPSTREAM_FLAG_DRAIN;
+		s->deadline = kore_time_ms() + (s->upstream->timeout * 1000);
+		http_request_wakeup(s->req);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/* Body buffers may still be queued after we are gone, unhook them. */
+static void
+upstream_detach(struct upstream_session *s)
+{
+	struct netbuf		*nb;
+	struct connection	*c;
+
+	if (!(s->flags & UPSTREAM_FLAG_STREAM) || (c = s->req->owner) == NULL)
+		return;
+
+	TAILQ_FOREACH(nb, &c->send_queue, list) {
+		if (nb->cb == upstream_sent && nb->extra == s)
+			nb->extra = NULL;
+	}
+
+#if defined(KORE_USE_PLATFORM_ZEROCOPY)
+	TAILQ_FOREACH(nb, &c->zc_queue, list) {
+		if (nb->cb == upstream_sent && nb->extra == s)
+			nb->extra = NULL;
+	}
+#endif
+}
+
+/* Gives the connection back to the pool if it can be used again. */
+static void
+upstream_release(struct upstream_session *s)
+{
+	struct upstream_conn	*conn;
+
+	if ((conn = s->conn) == NULL)
+		return;
+
+	s->conn = NULL;
+	s->server->active--;
+	conn->session = NULL;
+
+	if ((s->flags & UPSTREAM_FLAG_CLOSE) ||
+	    s->state != UPSTREAM_STATE_DONE || s->upstream->keepalive == 0) {
+		upstream_conn_close(conn);
+		return;
+	}
+
+	upstream_conn_put(conn);
+}
+
+static void
+upstream_server_failed(struct upstream_session *s)
+{
+	struct kore_upstream		*up;
+	struct kore_upstream_server	*srv;
+	struct upstream_conn		*conn;
+
+	up = s->upstream;
+	srv = s->server;
+
+	if (up->max_fails == 0 || ++srv->fails < up->max_fails)
+		return;
+
+	srv->fails = 0;
+	srv->down_until = kore_time_ms() + (up->fail_timeout * 1000);
+
+	kore_log(LOG_NOTICE, "upstream %s: %s marked down for %us",
+	    up->name, srv->name, up->fail_timeout);
+
+	while ((conn = TAILQ_FIRST(&srv->idle)) != NULL)
+		upstream_conn_close(conn);
+}
+
+static struct kore_upstream_server *
+upstream_select(struct upstream_session *s)
+{
+	u_int32_t			i, h, lo, hi, mid;
+	u_int64_t			now;
+	struct kore_upstream		*up;
+	struct kore_upstream_server	*srv, *best;
+	struct connection		*c;
+
+	up = s->upstream;
+	now = kore_time_ms();
+
+	switch (up->balance) {
+	case KORE_UPSTREAM_ROUND_ROBIN:
+		for (i = 0; i < up->server_count; i++) {
+			srv = up->servers[up->next++ % up->server_count];
+			if (upstream_usable(s, srv, now))
+				return (srv);
+		}
+		break;
+	case KORE_UPSTREAM_LEAST_CONN:
+		best = NULL;
+		h = up->next++;
+		for (i = 0; i < up->server_count; i++) {
+			srv = up->servers[(h + i) % up->server_count];
+			if (!upstream_usable(s, srv, now))
+				continue;
+			if (best == NULL || srv->active < best->active)
+				best = srv;
+		}
+		return (best);
+	case KORE_UPSTREAM_HASH_IP:
+	case KORE_UPSTREAM_HASH_URI:
+		c = s->req->owner;
+		if (up->balance == KORE_UPSTREAM_HASH_URI) {
+			h = upstream_hash(s->req->path,
+			    strlen(s->req->path), 0);
+		} else if (c->family == AF_INET) {
+			h = upstream_hash(&c->addr.ipv4.sin_addr,
+			    sizeof(c->addr.ipv4.sin_addr), 0);
+		} else if (c->family == AF_INET6) {
+			h = upstream_hash(&c->addr.ipv6.sin6_addr,
+			    sizeof(c->addr.ipv6.sin6_addr), 0);
+		} else {
+			h = 0;
+		}
+
+		lo = 0;
+		hi = up->ring_len;
+		while (lo < hi) {
+			mid = lo + ((hi - lo) / 2);
+			if (up->ring[mid].hash < h)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		/* Walk the ring clockwise until a usable server shows up. */
+		for (i = 0; i < up->ring_len; i++) {
+			h = up->ring[(lo + i) % up->ring_len].server;
+			srv = up->servers[h];
+			if (upstream_usable(s, srv, now))
+				return (srv);
+		}
+		break;
+	default:
+		fatal("%s: unknown balance %d", __func__, up->balance);
+	}
+
+	return (NULL);
+}
+
+static struct upstream_conn *
+upstream_conn_get(struct upstream_session *s)
+{
+	int				fd;
+	struct kore_upstream_server	*srv;
+	struct upstream_conn		*conn;
+
+	srv = s->server;
+
+	if ((conn = TAILQ_FIRST(&srv->idle)) != NULL) {
+		TAILQ_REMOVE(&srv->idle, conn, list);
+		srv->idle_count--;
+		conn->state = UPSTREAM_CONN_ACTIVE;
+		return (conn);
+	}
+
+	if ((fd = socket(srv->family, SOCK_STREAM, 0)) == -1) {
+		kore_log(LOG_ERR, "upstream: socket: %s", errno_s);
+		return (NULL);
+	}
+
+	if (!kore_connection_nonblock(fd, 1) ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		close(fd);
+		return (NULL);
+	}
+
+	if (connect(fd, (struct sockaddr *)&srv->addr, srv->addrlen) == -1 &&
+	    errno != EINPROGRESS) {
+		kore_log(LOG_NOTICE, "upstream %s: connect to %s: %s",
+		    srv->upstream->name, srv->name, errno_s);
+		close(fd);
+		return (NULL);
+	}
+
+	conn = kore_calloc(1, sizeof(*conn));
+	conn->fd = fd;
+	conn->server = srv;
+	conn->state = UPSTREAM_CONN_CONNECTING;
+	conn->evt.type = KORE_TYPE_UPSTREAM;
+	conn->evt.handle = upstream_event;
+
+	kore_platform_event_all(fd, conn);
+
+	return (conn);
+}
+
+static void
+upstream_conn_put(struct upstream_conn *conn)
+{
+	u_int8_t			byte;
+	struct kore_upstream_server	*srv;
+
+	srv = conn->server;
+
+	/*
+	 * The response was read up to its last byte, not until EAGAIN.
+	 * Make sure there is nothing else (including end of stream) before
+	 * forgetting about the read readiness we had.
+	 */
+	if (recv(conn->fd, &byte, sizeof(byte),
+	    MSG_PEEK | MSG_DONTWAIT) != -1 || errno != EAGAIN) {
+		upstream_conn_close(conn);
+		return;
+	}
+
+	conn->evt.flags &= ~KORE_EVENT_READ;
+
+	conn->state = UPSTREAM_CONN_IDLE;
+	conn->idle = kore_time_ms();
+
+	/* Most recently used first, the oldest ones expire at the tail. */
+	TAILQ_INSERT_HEAD(&srv->idle, conn, list);
+	srv->idle_count++;
+
+	if (srv->idle_count > srv->upstream->keepalive)
+		upstream_conn_close(TAILQ_LAST(&srv->idle, upstream_conn_list));
+}
+
+/*
+ * The descriptor is closed right away, the memory lingers until the
+ * next tick as the event loop may still hold events for it.
+ */
+static void
+upstream_conn_close(struct upstream_conn *conn)
+{
+	if (conn->state == UPSTREAM_CONN_IDLE) {
+		TAILQ_REMOVE(&conn->server->idle, conn, list);
+		conn->server->idle_count--;
+	}
+
+	close(conn->fd);
+	conn->fd = -1;
+	conn->session = NULL;
+	conn->state = UPSTREAM_CONN_DEAD;
+
+	TAILQ_INSERT_TAIL(&graveyard, conn, list);
+}
+
+static void
+upstream_event(void *arg, int error)
+{
+	struct upstream_conn	*conn = arg;
+
+	switch (conn->state) {
+	case UPSTREAM_CONN_DEAD:
+		break;
+	case UPSTREAM_CONN_IDLE:
+		/* An idle upstream has nothing to say, unless it is leaving. */
+		if (error || (conn->evt.flags & KORE_EVENT_READ))
+			upstream_conn_close(conn);
+		break;
+	default:
+		if (error)
+			conn->evt.flags |= KORE_EVENT_READ | KORE_EVENT_WRITE;
+		if (conn->session != NULL)
+			http_request_wakeup(conn->session->req);
+		break;
+	}
+}
+
+static void
+upstream_tick(void *unused, u_int64_t now)
+{
+	u_int32_t			i;
+	struct kore_upstream		*up;
+	struct kore_upstream_server	*srv;
+	struct upstream_session		*s;
+	struct upstream_conn		*conn;
+
+	while ((conn = TAILQ_FIRST(&graveyard)) != NULL) {
+		TAILQ_REMOVE(&graveyard, conn, list);
+		kore_free(conn);
+	}
+
+	TAILQ_FOREACH(s, &sessions, list) {
+		if (s->deadline != 0 && now >= s->deadline &&
+		    s->conn != NULL) {
+			s->deadline = 0;
+			s->flags |= UPSTREAM_FLAG_TIMEDOUT;
+			http_request_wakeup(s->req);
+		}
+	}
+
+	LIST_FOREACH(up, &upstreams, list) {
+		for (i = 0; i < up->server_count; i++) {
+			srv = up->servers[i];
+			while ((conn = TAILQ_LAST(&srv->idle,
+			    upstream_conn_list)) != NULL) {
+				if (now - conn->idle <
+				    (up->keepalive_timeout * 1000))
+					break;
+				upstream_conn_close(conn);
+			}
+		}
+	}
+}
+
+static int
+upstream_usable(struct upstream_session *s, struct kore_upstream_server *srv,
+    u_int64_t now)
+{
+	return (srv->tried != s->id && srv->down_until <= now);
+}
+
+static int
+upstream_hop_header(const char *name, const char *conn)
+{
+	const char	**hop;
+
+	for (hop = hop_headers; *hop != NULL; hop++) {
+		if (!strcasecmp(name, *hop))
+			return (1);
+	}
+
+	/* Headers named in Connection are hop-by-hop as well. */
+	if (conn != NULL && upstream_token(conn, name))
+		return (1);
+
+	return (0);
+}
+
+/* Is token one of the comma separated elements in list. */
+static int
+upstream_token(const char *list, const char *token)
+{
+	size_t		len;
+	const char	*p;
+
+	len = strlen(token);
+
+	for (p = list; *p != '\0'; p++) {
+		if (*p == ',' || *p == ' ' || *p == '\t')
+			continue;
+		if (!strncasecmp(p, token, len) &&
+		    (p[len] == '\0' || p[len] == ',' || p[len] == ';' ||
+		    p[len] == ' ' || p[len] == '\t'))
+			return (1);
+		while (*p != '\0' && *p != ',')
+			p++;
+		if (*p == '\0')
+			break;
+	}
+
+	return (0);
+}
+
+static int
+upstream_point_cmp(const void *a, const void *b)
+{
+	const struct kore_upstream_point	*pa = a;
+	const struct kore_upstream_point	*pb = b;
+
+	if (pa->hash < pb->hash)
+		return (-1);
+	if (pa->hash > pb->hash)
+		return (1);
+
+	return (0);
+}
+
+/* FNV-1a with a final avalanche, seed picks the point on the ring. */
+static u_int32_t
+upstream_hash(const void *data, size_t len, u_int32_t seed)
+{
+	size_t			i;
+	const u_int8_t		*p;
+	u_int32_t		h;
+
+	p = data;
+	h = 2166136261U ^ seed;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return (h);
+}
@@ -0,0 +1,538 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * io_uring event backend, replaces the epoll parts of linux.c when
+ * built with IO_URING=1.
+ *
+ * Every scheduled descriptor gets an IORING_OP_POLL_ADD so the
+ * readiness driven connection layer keeps working as is. Edge triggered
+ * descriptors use a multishot poll, level triggered ones a oneshot poll
+ * that is re-armed after each completion, as re-arming re-evaluates
+ * the current readiness just like epoll does in level mode. All
+ * poll additions and removals queued during a loop iteration are
+ * submitted together with the wait for completions in a single
+ * io_uring_enter(2) call.
+ *
+ * The user_data of a poll carries the descriptor and a generation
+ * number. Removing a poll is asynchronous, so completions that no
+ * longer match the current generation for a descriptor are dropped.
+ */
+
+#include <sys/param.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include <endian.h>
+
+#include "kore.h"
+
+#if defined(KORE_USE_PYTHON)
+#include "python_api.h"
+#endif
+
+#define URING_SQ_ENTRIES	1024
+#define URING_IGNORE		UINT64_MAX
+
+#define URING_USER_DATA(fd, gen)	\
+	(((u_int64_t)(gen) << 32) | (u_int32_t)(fd))
+
+struct uring_poll {
+	void			*udata;
+	u_int32_t		gen;
+	u_int32_t		events;
+	int			active;
+};
+
+struct uring_sq {
+	u_int32_t		*khead;
+	u_int32_t		*ktail;
+	u_int32_t		mask;
+	u_int32_t		entries;
+	u_int32_t		tail;
+	struct io_uring_sqe	*sqes;
+};
+
+struct uring_cq {
+	u_int32_t		*khead;
+	u_int32_t		*ktail;
+	u_int32_t		mask;
+	struct io_uring_cqe	*cqes;
+};
+
+static int			uring_enter(u_int32_t, u_int32_t,
+				    u_int32_t, void *);
+static u_int32_t		uring_pending(void);
+static struct io_uring_sqe	*uring_sqe(void);
+static void			uring_poll_add(int, u_int32_t, u_int32_t);
+static void			uring_poll_remove(int, u_int32_t);
+static void			uring_poll_grow(int);
+static void			uring_cqe(struct io_uring_cqe *);
+
+static int			rfd = -1;
+static struct uring_sq		sq;
+static struct uring_cq		cq;
+static void			*sq_ring = NULL;
+static void			*cq_ring = NULL;
+static size_t			sq_ring_len = 0;
+static size_t			cq_ring_len = 0;
+static size_t			sqes_len = 0;
+static struct uring_poll	*polls = NULL;
+static int			polls_len = 0;
+
+void
+kore_platform_event_init(void)
+{
+	u_int32_t		count;
+	struct io_uring_params	params;
+
+	kore_platform_event_cleanup();
+
+	count = worker_max_connections + nlisteners;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = MAX(count * 2, URING_SQ_ENTRIES * 2);
+
+	rfd = syscall(SYS_io_uring_setup, URING_SQ_ENTRIES, &params);
+	if (rfd == -1)
+		fatal("io_uring_setup(): %s", errno_s);
+
+	if (!(params.features & IORING_FEAT_EXT_ARG))
+		fatal("io_uring: kernel lacks IORING_FEAT_EXT_ARG");
+
+	sq_ring_len = params.sq_off.array +
+	    params.sq_entries * sizeof(u_int32_t);
+	cq_ring_len = params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		sq_ring_len = MAX(sq_ring_len, cq_ring_len);
+		cq_ring_len = 0;
+	}
+
+	sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		fatal("io_uring: mmap(sq): %s", errno_s);
+
+	if (cq_ring_len == 0) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+			fatal("io_uring: mmap(cq): %s", errno_s);
+	}
+
+	sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	sq.sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+	if (sq.sqes == MAP_FAILED)
+		fatal("io_uring: mmap(sqes): %s", errno_s);
+
+	sq.khead = (u_int32_t *)((u_int8_t *)sq_ring + params.sq_off.head);
+	sq.ktail = (u_int32_t *)((u_int8_t *)sq_ring + params.sq_off.tail);
+	sq.mask = *(u_int32_t *)((u_int8_t *)sq_ring +
+	    params.sq_off.ring_mask);
+	sq.entries = params.sq_entries;
+	sq.tail = *sq.ktail;
+
+	/* The submission array maps slot i to sqe i, forever. */
+	for (count = 0; count < sq.entries; count++) {
+		((u_int32_t *)((u_int8_t *)sq_ring +
+		    params.sq_off.array))[count] = count;
+	}
+
+	cq.khead = (u_int32_t *)((u_int8_t *)cq_ring + params.cq_off.head);
+	cq.ktail = (u_int32_t *)((u_int8_t *)cq_ring + params.cq_off.tail);
+	cq.mask = *(u_int32_t *)((u_int8_t *)cq_ring +
+	    params.cq_off.ring_mask);
+	cq.cqes = (struct io_uring_cqe *)((u_int8_t *)cq_ring +
+	    params.cq_off.cqes);
+}
+
+void
+kore_platform_event_cleanup(void)
+{
+	if (sq.sqes != NULL && sq.sqes != MAP_FAILED)
+		(void)munmap(sq.sqes, sqes_len);
+
+	if (cq_ring != NULL && cq_ring != MAP_FAILED && cq_ring != sq_ring)
+		(void)munmap(cq_ring, cq_ring_len);
+
+	if (sq_ring != NULL && sq_ring != MAP_FAILED)
+		(void)munmap(sq_ring, sq_ring_len);
+
+	if (rfd != -1) {
+		close(rfd);
+		rfd = -1;
+	}
+
+	if (polls != NULL) {
+		kore_free(polls);
+		polls = NULL;
+		polls_len = 0;
+	}
+
+	sq_ring = NULL;
+	cq_ring = NULL;
+
+	memset(&sq, 0, sizeof(sq));
+	memset(&cq, 0, sizeof(cq));
+}
+
+int
+kore_platform_event_wait(u_int64_t timer)
+{
+	u_int32_t			head, tail;
+	struct io_uring_cqe		cqe;
+	struct __kernel_timespec	ts;
+	struct io_uring_getevents_arg	arg;
+	u_int64_t			start;
+	int				r;
+	u_int32_t			wait, flags, n;
+
+	memset(&arg, 0, sizeof(arg));
+	flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+	if (timer != KORE_WAIT_INFINITE) {
+		ts.tv_sec = timer / 1000;
+		ts.tv_nsec = (timer % 1000) * 1000000;
+		arg.ts = (u_int64_t)(uintptr_t)&ts;
+	}
+
+	head = *cq.khead;
+	tail = __atomic_load_n(cq.ktail, __ATOMIC_ACQUIRE);
+
+	if (head != tail || timer == 0)
+		wait = 0;
+	else
+		wait = 1;
+
+	start = wait ? kore_time_us() : 0;
+
+#if defined(KORE_USE_PYTHON)
+	kore_python_gil_release();
+#endif
+
+	r = uring_enter(uring_pending(), wait, flags, &arg);
+
+#if defined(KORE_USE_PYTHON)
+	kore_python_gil_acquire();
+#endif
+
+	if (r == -1) {
+		switch (errno) {
+		case EINTR:
+		case ETIME:
+		case EBUSY:
+		case EAGAIN:
+			break;
+		default:
+			fatal("io_uring_enter(): %s", errno_s);
+		}
+	}
+
+	if (wait)
+		kore_evloop->idle_usec += kore_time_us() - start;
+
+	/* Whatever is left over past the batch is reaped next time. */
+	for (n = 0; worker_event_batch == 0 || n < worker_event_batch; n++) {
+		head = *cq.khead;
+		tail = __atomic_load_n(cq.ktail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		/*
+		 * Copy the entry out and hand the slot back before calling
+		 * into the handler, it may queue new work on the ring.
+		 */
+		cqe = cq.cqes[head & cq.mask];
+		__atomic_store_n(cq.khead, head + 1, __ATOMIC_RELEASE);
+
+		uring_cqe(&cqe);
+	}
+
+	if (n > 0) {
+		kore_evloop->wakeups++;
+		kore_evloop->events += n;
+	}
+
+	return ((int)n);
+}
+
+void
+kore_platform_event_level_all(int fd, void *c)
+{
+	kore_platform_event_schedule(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, 0, c);
+}
+
+void
+kore_platform_event_level_read(int fd, void *c)
+{
+	kore_platform_event_schedule(fd, EPOLLIN | EPOLLRDHUP, 0, c);
+}
+
+void
+kore_platform_event_all(int fd, void *c)
+{
+	kore_platform_event_schedule(fd,
+	    EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, 0, c);
+}
+
+void
+kore_platform_event_schedule(int fd, int type, int flags, void *udata)
+{
+	struct uring_poll	*p;
+
+	kore_debug("kore_platform_event_schedule(%d, %d, %d, %p)",
+	    fd, type, flags, udata);
+
+	if (fd < 0)
+		fatal("kore_platform_event_schedule: bad fd %d", fd);
+
+	uring_poll_grow(fd);
+	p = &polls[fd];
+
+	/* Like EPOLL_CTL_MOD, replace the poll and re-evaluate readiness. */
+	if (p->active)
+		uring_poll_remove(fd, p->gen);
+
+	p->gen++;
+	p->active = 1;
+	p->udata = udata;
+	p->events = (u_int32_t)type;
+
+	uring_poll_add(fd, p->gen, p->events);
+}
+
+void
+kore_platform_schedule_read(int fd, void *data)
+{
+	kore_platform_event_schedule(fd, EPOLLIN | EPOLLET, 0, data);
+}
+
+void
+kore_platform_schedule_write(int fd, void *data)
+{
+	kore_platform_event_schedule(fd, EPOLLOUT | EPOLLET, 0, data);
+}
+
+void
+kore_platform_disable_read(int fd)
+{
+	struct uring_poll	*p;
+
+	/*
+	 * The ring holds a reference to the file for as long as a poll
+	 * is armed, so this is also called before closing connections.
+	 */
+	if (fd < 0 || fd >= polls_len || !polls[fd].active)
+		return;
+
+	p = &polls[fd];
+	uring_poll_remove(fd, p->gen);
+
+	p->gen++;
+	p->active = 0;
+	p->udata = NULL;
+}
+
+void
+kore_platform_enable_accept(void)
+{
+	struct listener		*l;
+	struct kore_server	*srv;
+
+	kore_debug("kore_platform_enable_accept()");
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list)
+			kore_platform_event_schedule(l->fd, EPOLLIN, 0, l);
+	}
+}
+
+void
+kore_platform_disable_accept(void)
+{
+	struct listener		*l;
+	struct kore_server	*srv;
+
+	kore_debug("kore_platform_disable_accept()");
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list)
+			kore_platform_disable_read(l->fd);
+	}
+}
+
+static int
+uring_enter(u_int32_t submit, u_int32_t wait, u_int32_t flags, void *arg)
+{
+	return (syscall(SYS_io_uring_enter, rfd, submit, wait, flags,
+	    arg, sizeof(struct io_uring_getevents_arg)));
+}
+
+static u_int32_t
+uring_pending(void)
+{
+	return (sq.tail - __atomic_load_n(sq.khead, __ATOMIC_ACQUIRE));
+}
+
+static struct io_uring_sqe *
+uring_sqe(void)
+{
+	struct io_uring_sqe	*sqe;
+
+	/* Ring full, push what we have to the kernel right away. */
+	if (uring_pending() == sq.entries) {
+		if (syscall(SYS_io_uring_enter, rfd, sq.entries,
+		    0, 0, NULL, 0) == -1)
+			fatal("io_uring_enter(): %s", errno_s);
+	}
+
+	sqe = &sq.sqes[sq.tail & sq.mask];
+	memset(sqe, 0, sizeof(*sqe));
+
+	sq.tail++;
+
+	return (sqe);
+}
+
+static void
+uring_poll_add(int fd, u_int32_t gen, u_int32_t events)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->user_data = URING_USER_DATA(fd, gen);
+
+	if (events & EPOLLET)
+		sqe->len = IORING_POLL_ADD_MULTI;
+
+	events &= ~EPOLLET;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+
+	__atomic_store_n(sq.ktail, sq.tail, __ATOMIC_RELEASE);
+}
+
+static void
+uring_poll_remove(int fd, u_int32_t gen)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = URING_USER_DATA(fd, gen);
+	sqe->user_data = URING_IGNORE;
+
+	__atomic_store_n(sq.ktail, sq.tail, __ATOMIC_RELEASE);
+}
+
+static void
+uring_poll_grow(int fd)
+{
+	int		len;
+
+	if (fd < polls_len)
+		return;
+
+	len = MAX(polls_len * 2, 1024);
+	while (len <= fd)
+		len *= 2;
+
+	polls = kore_realloc(polls, len * sizeof(struct uring_poll));
+	memset(&polls[polls_len], 0,
+	    (len - polls_len) * sizeof(struct uring_poll));
+
+	polls_len = len;
+}
+
+static void
+uring_cqe(struct io_uring_cqe *cqe)
+{
+	int			fd, r;
+	u_int32_t		gen, mask;
+	struct kore_event	*evt;
+	struct uring_poll	*p;
+
+	if (cqe->user_data == URING_IGNORE)
+		return;
+
+	fd = (int)(cqe->user_data & 0xffffffff);
+	gen = (u_int32_t)(cqe->user_data >> 32);
+
+	if (fd >= polls_len)
+		return;
+
+	p = &polls[fd];
+	if (!p->active || p->gen != gen)
+		return;
+
+	if (p->udata == NULL)
+		fatal("io_uring: no udata for fd %d", fd);
+
+	if (cqe->res == -ECANCELED) {
+		/* Kernel dropped a poll we still want (CQ overflow). */
+		uring_poll_add(fd, p->gen, p->events);
+		return;
+	}
+
+	r = 0;
+	evt = (struct kore_event *)p->udata;
+
+	if (cqe->res < 0) {
+		r = 1;
+	} else {
+		mask = (u_int32_t)cqe->res;
+
+		if (mask & EPOLLIN)
+			evt->flags |= KORE_EVENT_READ;
+
+		if (mask & EPOLLOUT)
+			evt->flags |= KORE_EVENT_WRITE;
+
+		if (mask & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+			r = 1;
+
+		/* Only the error queue, the handler may drain it. */
+		if ((mask & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) == EPOLLERR)
+			evt->flags |= KORE_EVENT_ERROR;
+	}
+
+	evt->handle(p->udata, r);
+
+	/*
+	 * Oneshot polls are done and a multishot poll can terminate on
+	 * its own, re-arm unless the handler changed the descriptor.
+	 */
+	if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res >= 0) {
+		p = &polls[fd];
+		if (p->active && p->gen == gen)
+			uring_poll_add(fd, p->gen, p->events);
+	}
+}
@@ -25,8 +25,18 @@
 #include <time.h>
 #include <limits.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "kore.h"
 
+struct kore_clock	kore_clock;
+
 static struct {
 	char		*name;
 	int		value;
@@ -360,6 +370,9 @@ kore_time_to_date(time_t now)
 	static time_t		last = 0;
 	static char		tbuf[32];
 
+	if (now == kore_clock.wall)
+		return (kore_clock.date);
+
 	if (now != last) {
 		last = now;
 
@@ -383,6 +396,44 @@ kore_time_ms(void)
 	return ((u_int64_t)(ts.tv_sec * 1000 + (ts.tv_nsec / 1000000)));
 }
 
+u_int64_t
+kore_time_us(void)
+{
+	struct timespec		ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u_int64_t)(ts.tv_sec * 1000000 + (ts.tv_nsec / 1000)));
+}
+
+/*
+ * The date strings are only rendered again once the wall clock second
+ * changes, so callers may use them without further formatting.
+ */
+void
+kore_clock_tick(void)
+{
+	struct tm		*tm;
+	time_t			now;
+
+	kore_clock.ms = kore_time_ms();
+
+	if ((now = time(NULL)) == kore_clock.wall)
+		return;
+
+	if ((tm = gmtime(&now)) == NULL ||
+	    !strftime(kore_clock.date, sizeof(kore_clock.date),
+	    "%a, %d %b %Y %T GMT", tm))
+		kore_clock.date[0] = '\0';
+
+	if ((tm = localtime(&now)) == NULL ||
+	    !strftime(kore_clock.clf, sizeof(kore_clock.clf),
+	    "%d/%b/%Y:%H:%M:%S %z", tm))
+		kore_clock.clf[0] = '\0';
+
+	kore_clock.wall = now;
+}
+
 int
 kore_base64url_encode(const void *data, size_t len, char **out, int flags)
 {
@@ -413,8 +464,9 @@ kore_mem_find(void *src, size_t slen, const void *needle, size_t len)
 	size_t		pos;
 
 	for (pos = 0; pos < slen; pos++) {
-		if ( *((u_int8_t *)src + pos) != *(const u_int8_t *)needle)
-			continue;
+		pos = kore_mem_scan(src, pos, slen, *(const u_int8_t *)needle);
+		if (pos == slen)
+			break;
 
 		if ((slen - pos) < len)
 			return (NULL);
@@ -426,6 +478,65 @@ kore_mem_find(void *src, size_t slen, const void *needle, size_t len)
 	return (NULL);
 }
 
+/*
+ * Returns the offset of the first byte matching ch in src between
+ * off and len, or len if there is none.
+ */
+size_t
+kore_mem_scan(const void *src, size_t off, size_t len, u_int8_t ch)
+{
+	const u_int8_t	*p;
+#if defined(__AVX2__)
+	u_int32_t	mask;
+	__m256i		needle, chunk;
+#elif defined(__SSE2__)
+	u_int32_t	mask;
+	__m128i		needle, chunk;
+#elif defined(__ARM_NEON)
+	u_int64_t	mask;
+	uint8x16_t	needle, chunk;
+#endif
+
+	p = src;
+
+#if defined(__AVX2__)
+	needle = _mm256_set1_epi8((char)ch);
+	while (len - off >= sizeof(chunk)) {
+		chunk = _mm256_loadu_si256((const __m256i *)(p + off));
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+		if (mask != 0)
+			return (off + __builtin_ctz(mask));
+		off += sizeof(chunk);
+	}
+#elif defined(__SSE2__)
+	needle = _mm_set1_epi8((char)ch);
+	while (len - off >= sizeof(chunk)) {
+		chunk = _mm_loadu_si128((const __m128i *)(p + off));
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+		if (mask != 0)
+			return (off + __builtin_ctz(mask));
+		off += sizeof(chunk);
+	}
+#elif defined(__ARM_NEON)
+	needle = vdupq_n_u8(ch);
+	while (len - off >= sizeof(chunk)) {
+		chunk = vceqq_u8(vld1q_u8(p + off), needle);
+		mask = vget_lane_u64(vreinterpret_u64_u8(
+		    vshrn_n_u16(vreinterpretq_u16_u8(chunk), 4)), 0);
+		if (mask != 0)
+			return (off + (__builtin_ctzll(mask) >> 2));
+		off += sizeof(chunk);
+	}
+#endif
+
+	for (; off < len; off++) {
+		if (p[off] == ch)
+			return (off);
+	}
+
+	return (len);
+}
+
 char *
 kore_text_trim(char *string, size_t len)
 {
@@ -577,6 +688,10 @@ fatal_log(const char *fmt, va_list args)
 	(void)vsnprintf(buf, sizeof(buf), fmt, args);
 	kore_log(LOG_ERR, "FATAL: %s", buf);
 
+	/* Get the log line out before we exit, see kore_msg_flush(). */
+	if (worker != NULL)
+		kore_msg_flush();
+
 	if (worker != NULL && worker->id == KORE_WORKER_KEYMGR)
 		kore_keymgr_cleanup(1);
 }
@@ -16,8 +16,31 @@
 
 #include <sys/types.h>
 
+#include <ctype.h>
+#include <stdint.h>
+
 #include "kore.h"
 
+#define VALIDATOR_SPAN_SET(v, c)	((v)->span_set[(c) >> 3] |= 1 << ((c) & 7))
+#define VALIDATOR_SPAN_ISSET(v, c)	((v)->span_set[(c) >> 3] & (1 << ((c) & 7)))
+
+static int	validator_span_compile(struct kore_validator *, const char *);
+static int	validator_span_class(struct kore_validator *, const char **);
+static int	validator_span_check(struct kore_validator *, const void *);
+
+/*
+ * Only the character classes that mean the same thing in every locale,
+ * [:alpha:] and friends take in more than ASCII under a UTF-8 one.
+ */
+static struct {
+	const char	*name;
+	int		(*cb)(int);
+} validator_span_classes[] = {
+	{ "digit",	isdigit },
+	{ "xdigit",	isxdigit },
+	{ NULL,		NULL },
+};
+
 TAILQ_HEAD(, kore_validator)		validators;
 
 void
@@ -29,7 +52,6 @@ kore_validator_init(void)
 int
 kore_validator_add(const char *name, u_int8_t type, const char *arg)
 {
-	int				ret;
 	struct kore_validator		*val;
 
 	val = kore_malloc(sizeof(*val));
@@ -37,12 +59,10 @@ kore_validator_add(const char *name, u_int8_t type, const char *arg)
 
 	switch (val->type) {
 	case KORE_VALIDATOR_TYPE_REGEX:
-		ret = regcomp(&(val->rctx), arg, REG_EXTENDED | REG_NOSUB);
-		if (ret) {
+		if (!kore_validator_compile(val, arg)) {
 			kore_free(val);
 			kore_log(LOG_NOTICE,
-			    "validator %s has bad regex %s (%d)",
-			    name, arg, ret);
+			    "validator %s has bad regex %s", name, arg);
 			return (KORE_RESULT_ERROR);
 		}
 		break;
@@ -68,19 +88,31 @@ kore_validator_add(const char *name, u_int8_t type, const char *arg)
 	return (KORE_RESULT_OK);
 }
 
+/*
+ * Compile the regex for a validator. Patterns that are a single bracket
+ * expression with a repeat count, like ^[0-9]+$ or ^[a-f0-9]{32}$, are
+ * also turned into a byte set so they can be checked without regexec().
+ */
+int
+kore_validator_compile(struct kore_validator *val, const char *pattern)
+{
+	if (regcomp(&(val->rctx), pattern, REG_EXTENDED | REG_NOSUB))
+		return (KORE_RESULT_ERROR);
+
+	val->span = validator_span_compile(val, pattern);
+
+	return (KORE_RESULT_OK);
+}
+
 int
 kore_validator_run(struct http_request *req, const char *name, char *data)
 {
 	struct kore_validator		*val;
 
-	TAILQ_FOREACH(val, &validators, list) {
-		if (strcmp(val->name, name))
-			continue;
-
-		return (kore_validator_check(req, val, data));
-	}
+	if ((val = kore_validator_lookup(name)) == NULL)
+		return (KORE_RESULT_ERROR);
 
-	return (KORE_RESULT_ERROR);
+	return (kore_validator_check(req, val, data));
 }
 
 int
@@ -91,7 +123,9 @@ kore_validator_check(struct http_request *req, struct kore_validator *val,
 
 	switch (val->type) {
 	case KORE_VALIDATOR_TYPE_REGEX:
-		if (!regexec(&(val->rctx), data, 0, NULL, 0))
+		if (val->span)
+			r = validator_span_check(val, data);
+		else if (!regexec(&(val->rctx), data, 0, NULL, 0))
 			r = KORE_RESULT_OK;
 		else
 			r = KORE_RESULT_ERROR;
@@ -137,3 +171,171 @@ kore_validator_lookup(const char *name)
 
 	return (NULL);
 }
+
+/*
+ * Only anchored patterns made of one bracket expression over ASCII and an
+ * optional repeat count are taken, anything else is left to regexec().
+ * Multibyte locales make no difference for these since every character
+ * they can match is a single byte.
+ */
+static int
+validator_span_compile(struct kore_validator *val, const char *pattern)
+{
+	const char		*p;
+	char			*ep;
+	unsigned long		min, max;
+
+	p = pattern;
+	memset(val->span_set, 0, sizeof(val->span_set));
+
+	if (*p++ != '^' || *p++ != '[')
+		return (0);
+
+	if (!validator_span_class(val, &p))
+		return (0);
+
+	switch (*p) {
+	case '+':
+		min = 1;
+		max = ULONG_MAX;
+		p++;
+		break;
+	case '*':
+		min = 0;
+		max = ULONG_MAX;
+		p++;
+		break;
+	case '?':
+		min = 0;
+		max = 1;
+		p++;
+		break;
+	case '{':
+		p++;
+		if (!isdigit(*(const unsigned char *)p))
+			return (0);
+		min = strtoul(p, &ep, 10);
+		max = min;
+		p = ep;
+		if (*p == ',') {
+			p++;
+			if (*p == '}') {
+				max = ULONG_MAX;
+			} else {
+				if (!isdigit(*(const unsigned char *)p))
+					return (0);
+				max = strtoul(p, &ep, 10);
+				p = ep;
+			}
+		}
+		if (*p++ != '}' || min > max)
+			return (0);
+		break;
+	default:
+		min = 1;
+		max = 1;
+		break;
+	}
+
+	if (strcmp(p, "$"))
+		return (0);
+
+	val->span_min = min;
+	val->span_max = (max == ULONG_MAX) ? SIZE_MAX : max;
+
+	return (1);
+}
+
+/*
+ * Parse the inside of a bracket expression into the byte set of val,
+ * leaving *pp after its closing bracket. Negated sets, collating elements
+ * and equivalence classes are not handled.
+ */
+static int
+validator_span_class(struct kore_validator *val, const char **pp)
+{
+	const char	*p, *end;
+	size_t		i, len;
+	int		c, lo, hi, first;
+
+	p = *pp;
+	first = 1;
+
+	if (*p == '^')
+		return (0);
+
+	while (*p != ']' || first) {
+		first = 0;
+
+		if (*p == '\0')
+			return (0);
+
+		if (*p == '[' && (p[1] == '.' || p[1] == '='))
+			return (0);
+
+		if (*p == '[' && p[1] == ':') {
+			if ((end = strstr(p + 2, ":]")) == NULL)
+				return (0);
+
+			len = end - (p + 2);
+			for (i = 0; validator_span_classes[i].name != NULL; i++) {
+				if (strlen(validator_span_classes[i].name) ==
+				    len && !strncmp(p + 2,
+				    validator_span_classes[i].name, len))
+					break;
+			}
+
+			if (validator_span_classes[i].name == NULL)
+				return (0);
+
+			for (c = 0; c < 0x80; c++) {
+				if (validator_span_classes[i].cb(c))
+					VALIDATOR_SPAN_SET(val, c);
+			}
+
+			p = end + 2;
+			continue;
+		}
+
+		lo = *(const unsigned char *)p++;
+		hi = lo;
+
+		if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+			hi = *(const unsigned char *)(p + 1);
+			if (hi == '[')
+				return (0);
+			p += 2;
+		}
+
+		if (lo >= 0x80 || hi >= 0x80 || lo > hi)
+			return (0);
+
+		for (c = lo; c <= hi; c++)
+			VALIDATOR_SPAN_SET(val, c);
+	}
+
+	*pp = p + 1;
+
+	return (1);
+}
+
+static int
+validator_span_check(struct kore_validator *val, const void *data)
+{
+	size_t			len;
+	const u_int8_t		*p;
+
+	len = 0;
+
+	for (p = data; *p != '\0'; p++) {
+		if (!VALIDATOR_SPAN_ISSET(val, *p))
+			return (KORE_RESULT_ERROR);
+		if (++len > val->span_max)
+			return (KORE_RESULT_ERROR);
+	}
+
+	if (len < val->span_min)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
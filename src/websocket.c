@@ -16,6 +16,7 @@
 
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #include <limits.h>
 #include <string.h>
@@ -24,7 +25,13 @@
 #include "http.h"
 #include "sha1.h"
 
+#if defined(KORE_USE_COMPRESS)
+#define ZLIB_CONST
+#include <zlib.h>
+#endif
+
 #define WEBSOCKET_FRAME_HDR		2
+#define WEBSOCKET_FRAME_HDR_MAX		10
 #define WEBSOCKET_MASK_LEN		4
 #define WEBSOCKET_FRAME_MAXLEN		16384
 #define WEBSOCKET_PAYLOAD_SINGLE	125
@@ -38,15 +45,133 @@
 
 #define WEBSOCKET_SERVER_RESPONSE	"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
+#define WEBSOCKET_TOPIC_BUCKETS		1024
+#define WEBSOCKET_TOPIC_WORDS		((KORE_WORKER_MAX + 1) / 64)
+
+#if defined(KORE_USE_COMPRESS)
+#define WEBSOCKET_DEFLATE_RSV1		(1 << 6)
+#define WEBSOCKET_DEFLATE_BITS_MIN	9
+#define WEBSOCKET_DEFLATE_BITS_MAX	15
+#define WEBSOCKET_DEFLATE_CHUNK		4096
+#define WEBSOCKET_DEFLATE_OFFERS	8
+#define WEBSOCKET_DEFLATE_PARAMS	8
+#define WEBSOCKET_DEFLATE_SERVER_CTX	0x0001
+#define WEBSOCKET_DEFLATE_CLIENT_CTX	0x0002
+
+/*
+ * Negotiated permessage-deflate (RFC 7692) state for a connection.
+ *
+ * A connection only carries its own zlib streams for the directions in
+ * which context takeover is in effect. Without takeover every message
+ * is compressed from an empty history, so those connections share the
+ * per worker streams, which is also what lets a broadcast compress its
+ * payload once for all of them.
+ */
+struct websocket_deflate {
+	int		flags;
+	int		server_bits;
+	int		client_bits;
+	z_stream	*def;
+	z_stream	*inf;
+};
+#endif
+
+/*
+ * Topics a worker has subscribers for live in a hash table of their own,
+ * each keeping the list of connections subscribed to it. A connection
+ * also keeps the subscriptions it holds so they go away with it.
+ *
+ * Workers advertise which buckets of that table are in use in a bitmap
+ * shared with all other workers, a publish only goes out to the workers
+ * that have the bit set for the bucket of its topic. Two topics sharing
+ * a bucket can cause a worker to get a message it has no subscribers
+ * for, which it drops.
+ */
+struct websocket_topic {
+	char				*name;
+	u_int32_t			hash;
+	TAILQ_HEAD(, websocket_sub)	subs;
+	LIST_ENTRY(websocket_topic)	list;
+};
+
+struct websocket_sub {
+	struct connection		*c;
+	struct websocket_topic		*topic;
+	TAILQ_ENTRY(websocket_sub)	tlist;
+	LIST_ENTRY(websocket_sub)	clist;
+};
+
+/*
+ * A frame going out to several connections, built on first use and only
+ * once for all of them (once per window size if compressed).
+ */
+struct websocket_fanout {
+	struct netbuf_shared	*frame;
+#if defined(KORE_USE_COMPRESS)
+	struct netbuf_shared	*deflated[WEBSOCKET_DEFLATE_BITS_MAX + 1];
+#endif
+};
 
 u_int64_t	kore_websocket_timeout = 120000;
 u_int64_t	kore_websocket_maxframe = 16384;
 
+#if defined(KORE_USE_COMPRESS)
+u_int8_t	kore_websocket_deflate = 0;
+u_int8_t	kore_websocket_deflate_window = WEBSOCKET_DEFLATE_BITS_MAX;
+u_int8_t	kore_websocket_deflate_memlevel = 8;
+u_int8_t	kore_websocket_deflate_takeover = 1;
+size_t		kore_websocket_deflate_min_size = 64;
+#endif
+
 static int	websocket_recv_frame(struct netbuf *);
 static int	websocket_recv_opcode(struct netbuf *);
 static void	websocket_disconnect(struct connection *);
+static size_t	websocket_frame_header(u_int8_t *, u_int8_t, size_t);
 static void	websocket_frame_build(struct kore_buf *, u_int8_t,
 		    const void *, size_t);
+static void	websocket_frame_send(struct connection *, u_int8_t,
+		    const void *, size_t);
+static struct netbuf_shared	*websocket_frame_shared(u_int8_t,
+				    const void *, size_t);
+
+static void	websocket_fanout_send(struct websocket_fanout *,
+		    struct connection *, u_int8_t, const void *, size_t);
+static void	websocket_fanout_release(struct websocket_fanout *);
+
+static u_int32_t		websocket_topic_hash(const char *, size_t);
+static struct websocket_topic	*websocket_topic_lookup(const char *,
+				    u_int32_t);
+static void	websocket_topic_advertise(u_int32_t, int);
+static void	websocket_topic_forward(const char *, size_t, u_int32_t,
+		    u_int8_t, const void *, size_t);
+static void	websocket_sub_remove(struct websocket_sub *);
+
+static LIST_HEAD(, websocket_topic)	topics[WEBSOCKET_TOPIC_BUCKETS];
+static u_int64_t			(*topic_workers)[WEBSOCKET_TOPIC_WORDS];
+
+#if defined(KORE_USE_COMPRESS)
+static void	websocket_deflate_negotiate(struct http_request *);
+static int	websocket_deflate_offer(char *, struct websocket_deflate *,
+		    int *);
+static int	websocket_deflate_wanted(struct connection *, u_int8_t,
+		    size_t);
+static void	websocket_deflate_broadcast(struct connection *, u_int8_t,
+		    const void *, size_t, struct netbuf_shared **);
+static void	websocket_deflate_reserve(struct kore_buf *);
+static z_stream	*websocket_deflate_stream(struct websocket_deflate *);
+static z_stream	*websocket_inflate_stream(struct websocket_deflate *);
+static struct kore_buf	*websocket_deflate_data(z_stream *,
+			    const void *, size_t);
+static struct kore_buf	*websocket_inflate_data(struct connection *,
+			    u_int8_t *, size_t);
+
+static const u_int8_t	deflate_tail[] = { 0x00, 0x00, 0xff, 0xff };
+
+static struct kore_buf	deflate_out;
+static struct kore_buf	inflate_out;
+static z_stream		*deflate_shared[WEBSOCKET_DEFLATE_BITS_MAX + 1];
+static z_stream		*inflate_shared[WEBSOCKET_DEFLATE_BITS_MAX + 1];
+#endif
 
 void
 kore_websocket_handshake(struct http_request *req, const char *onconnect,
@@ -58,6 +183,12 @@ kore_websocket_handshake(struct http_request *req, const char *onconnect,
 	const char		*key, *version;
 	u_int8_t		digest[SHA1_DIGEST_LENGTH];
 
+	/* Bootstrapping websockets over HTTP/2 (RFC 8441) is not supported. */
+	if (req->owner->proto == CONN_PROTO_HTTP2) {
+		http_response(req, HTTP_STATUS_BAD_REQUEST, NULL, 0);
+		return;
+	}
+
 	if (!http_request_header(req, "sec-websocket-key", &key)) {
 		http_response(req, HTTP_STATUS_BAD_REQUEST, NULL, 0);
 		return;
@@ -95,6 +226,10 @@ kore_websocket_handshake(struct http_request *req, const char *onconnect,
 	http_response_header(req, "sec-websocket-accept", base64);
 	kore_free(base64);
 
+#if defined(KORE_USE_COMPRESS)
+	websocket_deflate_negotiate(req);
+#endif
+
 	kore_debug("%p: new websocket connection", req->owner);
 
 	req->owner->proto = CONN_PROTO_WEBSOCKET;
@@ -105,8 +240,8 @@ kore_websocket_handshake(struct http_request *req, const char *onconnect,
 	req->owner->rnb->flags &= ~NETBUF_CALL_CB_ALWAYS;
 
 	req->owner->http_timeout = 0;
-	req->owner->idle_timer.start = kore_time_ms();
 	req->owner->idle_timer.length = kore_websocket_timeout;
+	kore_connection_start_idletimer(req->owner);
 
 	if (onconnect != NULL) {
 		req->owner->ws_connect = kore_runtime_getcall(onconnect);
@@ -147,52 +282,443 @@ void
 kore_websocket_send(struct connection *c, u_int8_t op, const void *data,
     size_t len)
 {
-	struct kore_buf		frame;
+#if defined(KORE_USE_COMPRESS)
+	struct kore_buf		*buf;
 
-	kore_buf_init(&frame, len);
-	websocket_frame_build(&frame, op, data, len);
-	net_send_stream(c, frame.data, frame.offset,
-	    kore_websocket_send_clean, NULL);
+	if (websocket_deflate_wanted(c, op, len)) {
+		buf = websocket_deflate_data(websocket_deflate_stream(
+		    c->ws_deflate), data, len);
+		if (buf == NULL) {
+			kore_connection_disconnect(c);
+			return;
+		}
 
-	/* net_send_stream() takes over the buffer data pointer. */
-	frame.data = NULL;
-	kore_buf_cleanup(&frame);
+		op |= WEBSOCKET_DEFLATE_RSV1;
+		data = buf->data;
+		len = buf->offset;
+	}
+#endif
 
-	net_send_flush(c);
+	websocket_frame_send(c, op, data, len);
 }
 
+/*
+ * The frame is built once and queued by reference on every connection,
+ * it is freed when the last of them has sent it.
+ *
+ * Connections that negotiated permessage-deflate without server context
+ * takeover share one compressed frame per window size. The ones with
+ * takeover have their own compression history and are sent a frame of
+ * their own.
+ */
 void
 kore_websocket_broadcast(struct connection *src, u_int8_t op, const void *data,
     size_t len, int scope)
 {
-	struct connection	*c;
-	struct kore_buf		*frame;
+	struct connection		*c;
+	u_int8_t			*msg;
+	struct websocket_fanout		fo;
 
-	frame = kore_buf_alloc(len);
-	websocket_frame_build(frame, op, data, len);
+	memset(&fo, 0, sizeof(fo));
 
 	TAILQ_FOREACH(c, &connections, list) {
-		if (c != src && c->proto == CONN_PROTO_WEBSOCKET) {
-			net_send_queue(c, frame->data, frame->offset);
-			net_send_flush(c);
-		}
+		if (c == src || c->proto != CONN_PROTO_WEBSOCKET)
+			continue;
+
+		websocket_fanout_send(&fo, c, op, data, len);
 	}
 
+	websocket_fanout_release(&fo);
+
+	/*
+	 * Other workers get the opcode and the raw payload so they can
+	 * frame it for what each of their connections negotiated.
+	 */
 	if (scope == WEBSOCKET_BROADCAST_GLOBAL) {
+		msg = kore_malloc(len + 1);
+		msg[0] = op;
+		if (data != NULL && len > 0)
+			memcpy(&msg[1], data, len);
 		kore_msg_send(KORE_MSG_WORKER_ALL,
-		    KORE_MSG_WEBSOCKET, frame->data, frame->offset);
+		    KORE_MSG_WEBSOCKET, msg, len + 1);
+		kore_free(msg);
 	}
+}
+
+/*
+ * Called by the parent before any worker is spawned so the subscription
+ * bitmap is shared by all of them.
+ */
+void
+kore_websocket_topic_init(void)
+{
+	size_t		len;
+
+	len = sizeof(*topic_workers) * WEBSOCKET_TOPIC_BUCKETS;
+
+	topic_workers = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (topic_workers == MAP_FAILED)
+		fatal("%s: mmap: %s", __func__, errno_s);
+
+	memset(topic_workers, 0, len);
+}
+
+/* A worker that went away no longer has subscribers for anything. */
+void
+kore_websocket_topic_reap(u_int16_t id)
+{
+	u_int32_t	bucket;
+	u_int64_t	bit;
+
+	if (topic_workers == NULL || id > KORE_WORKER_MAX)
+		return;
+
+	bit = (u_int64_t)1 << (id % 64);
+
+	for (bucket = 0; bucket < WEBSOCKET_TOPIC_BUCKETS; bucket++) {
+		(void)__sync_fetch_and_and(&topic_workers[bucket][id / 64],
+		    ~bit);
+	}
+}
+
+int
+kore_websocket_subscribe(struct connection *c, const char *topic)
+{
+	size_t			len;
+	u_int32_t		hash, bucket;
+	struct websocket_sub	*sub;
+	struct websocket_topic	*t;
+
+	if (c->proto != CONN_PROTO_WEBSOCKET)
+		return (KORE_RESULT_ERROR);
+
+	len = strlen(topic);
+	if (len == 0 || len > KORE_WEBSOCKET_TOPIC_MAX)
+		return (KORE_RESULT_ERROR);
+
+	hash = websocket_topic_hash(topic, len);
+
+	LIST_FOREACH(sub, &c->ws_subs, clist) {
+		if (sub->topic->hash == hash &&
+		    !strcmp(sub->topic->name, topic))
+			return (KORE_RESULT_OK);
+	}
+
+	if ((t = websocket_topic_lookup(topic, hash)) == NULL) {
+		t = kore_malloc(sizeof(*t));
+		t->hash = hash;
+		t->name = kore_strdup(topic);
+		TAILQ_INIT(&t->subs);
+
+		bucket = hash & (WEBSOCKET_TOPIC_BUCKETS - 1);
+		if (LIST_EMPTY(&topics[bucket]))
+			websocket_topic_advertise(bucket, 1);
+
+		LIST_INSERT_HEAD(&topics[bucket], t, list);
+	}
+
+	sub = kore_malloc(sizeof(*sub));
+	sub->c = c;
+	sub->topic = t;
+
+	TAILQ_INSERT_TAIL(&t->subs, sub, tlist);
+	LIST_INSERT_HEAD(&c->ws_subs, sub, clist);
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_websocket_unsubscribe(struct connection *c, const char *topic)
+{
+	u_int32_t		hash;
+	struct websocket_sub	*sub;
+
+	hash = websocket_topic_hash(topic, strlen(topic));
+
+	LIST_FOREACH(sub, &c->ws_subs, clist) {
+		if (sub->topic->hash == hash &&
+		    !strcmp(sub->topic->name, topic)) {
+			websocket_sub_remove(sub);
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
+/*
+ * Send a message to the subscribers of a topic, other than src. With
+ * WEBSOCKET_BROADCAST_GLOBAL it is passed on to the workers that have
+ * subscribers for it as well.
+ */
+void
+kore_websocket_publish(struct connection *src, const char *topic, u_int8_t op,
+    const void *data, size_t len, int scope)
+{
+	size_t			tlen;
+	u_int32_t		hash;
+	struct websocket_sub	*sub;
+	struct websocket_topic	*t;
+	struct websocket_fanout	fo;
+
+	tlen = strlen(topic);
+	if (tlen == 0 || tlen > KORE_WEBSOCKET_TOPIC_MAX)
+		return;
+
+	hash = websocket_topic_hash(topic, tlen);
+
+	if ((t = websocket_topic_lookup(topic, hash)) != NULL) {
+		memset(&fo, 0, sizeof(fo));
+
+		TAILQ_FOREACH(sub, &t->subs, tlist) {
+			if (sub->c == src)
+				continue;
+			websocket_fanout_send(&fo, sub->c, op, data, len);
+		}
+
+		websocket_fanout_release(&fo);
+	}
+
+	if (scope == WEBSOCKET_BROADCAST_GLOBAL)
+		websocket_topic_forward(topic, tlen, hash, op, data, len);
+}
+
+void
+kore_websocket_cleanup(struct connection *c)
+{
+#if defined(KORE_USE_COMPRESS)
+	struct websocket_deflate	*wd;
+#endif
+	struct websocket_sub		*sub;
+
+	while ((sub = LIST_FIRST(&c->ws_subs)) != NULL)
+		websocket_sub_remove(sub);
+
+#if defined(KORE_USE_COMPRESS)
+	if ((wd = c->ws_deflate) == NULL)
+		return;
+
+	if (wd->def != NULL) {
+		deflateEnd(wd->def);
+		kore_free(wd->def);
+	}
+
+	if (wd->inf != NULL) {
+		inflateEnd(wd->inf);
+		kore_free(wd->inf);
+	}
+
+	kore_free(wd);
+	c->ws_deflate = NULL;
+#endif
+}
+
+static void
+websocket_fanout_send(struct websocket_fanout *fo, struct connection *c,
+    u_int8_t op, const void *data, size_t len)
+{
+#if defined(KORE_USE_COMPRESS)
+	if (websocket_deflate_wanted(c, op, len)) {
+		websocket_deflate_broadcast(c, op, data, len, fo->deflated);
+		return;
+	}
+#endif
+
+	if (fo->frame == NULL)
+		fo->frame = websocket_frame_shared(op, data, len);
+
+	net_send_shared(c, fo->frame);
+	net_send_flush(c);
+}
+
+static void
+websocket_fanout_release(struct websocket_fanout *fo)
+{
+#if defined(KORE_USE_COMPRESS)
+	int		i;
+
+	for (i = 0; i <= WEBSOCKET_DEFLATE_BITS_MAX; i++) {
+		if (fo->deflated[i] != NULL)
+			net_shared_release(fo->deflated[i]);
+	}
+#endif
+
+	if (fo->frame != NULL)
+		net_shared_release(fo->frame);
+}
+
+static u_int32_t
+websocket_topic_hash(const char *topic, size_t len)
+{
+	size_t		i;
+	u_int32_t	hash;
+
+	hash = 2166136261;
+	for (i = 0; i < len; i++) {
+		hash ^= (u_int8_t)topic[i];
+		hash *= 16777619;
+	}
+
+	return (hash);
+}
+
+static struct websocket_topic *
+websocket_topic_lookup(const char *topic, u_int32_t hash)
+{
+	struct websocket_topic	*t;
+
+	LIST_FOREACH(t, &topics[hash & (WEBSOCKET_TOPIC_BUCKETS - 1)], list) {
+		if (t->hash == hash && !strcmp(t->name, topic))
+			return (t);
+	}
+
+	return (NULL);
+}
+
+static void
+websocket_topic_advertise(u_int32_t bucket, int subscribed)
+{
+	u_int64_t	bit, *word;
+
+	if (topic_workers == NULL || worker == NULL)
+		return;
+
+	bit = (u_int64_t)1 << (worker->id % 64);
+	word = &topic_workers[bucket][worker->id / 64];
+
+	if (subscribed)
+		(void)__sync_fetch_and_or(word, bit);
+	else
+		(void)__sync_fetch_and_and(word, ~bit);
+}
+
+/*
+ * Pass a publish on to the other workers that have subscribers in the
+ * bucket of its topic. The message carries the opcode, the length of
+ * the topic, the topic and the raw payload.
+ */
+static void
+websocket_topic_forward(const char *topic, size_t tlen, u_int32_t hash,
+    u_int8_t op, const void *data, size_t len)
+{
+	struct kore_worker	*kw;
+	u_int8_t		*msg;
+	size_t			mlen;
+	u_int16_t		idx;
+	u_int64_t		*words;
+
+	if (worker == NULL)
+		return;
+
+	mlen = 2 + tlen + len;
+	msg = kore_malloc(mlen);
+
+	msg[0] = op;
+	msg[1] = (u_int8_t)tlen;
+	memcpy(&msg[2], topic, tlen);
+	if (data != NULL && len > 0)
+		memcpy(&msg[2 + tlen], data, len);
+
+	if (topic_workers == NULL) {
+		kore_msg_send(KORE_MSG_WORKER_ALL,
+		    KORE_MSG_WEBSOCKET_TOPIC, msg, mlen);
+		kore_free(msg);
+		return;
+	}
+
+	words = topic_workers[hash & (WEBSOCKET_TOPIC_BUCKETS - 1)];
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+		if (kw->id == worker->id || !kw->running)
+			continue;
+
+		if (!(words[kw->id / 64] & ((u_int64_t)1 << (kw->id % 64))))
+			continue;
+
+		kore_msg_send(kw->id, KORE_MSG_WEBSOCKET_TOPIC, msg, mlen);
+	}
+
+	kore_free(msg);
+}
+
+static void
+websocket_sub_remove(struct websocket_sub *sub)
+{
+	u_int32_t		bucket;
+	struct websocket_topic	*t = sub->topic;
+
+	TAILQ_REMOVE(&t->subs, sub, tlist);
+	LIST_REMOVE(sub, clist);
+	kore_free(sub);
+
+	if (!TAILQ_EMPTY(&t->subs))
+		return;
+
+	bucket = t->hash & (WEBSOCKET_TOPIC_BUCKETS - 1);
+
+	LIST_REMOVE(t, list);
+	kore_free(t->name);
+	kore_free(t);
 
-	kore_buf_free(frame);
+	if (LIST_EMPTY(&topics[bucket]))
+		websocket_topic_advertise(bucket, 0);
+}
+
+static void
+websocket_frame_send(struct connection *c, u_int8_t op, const void *data,
+    size_t len)
+{
+	struct kore_buf		frame;
+
+	kore_buf_init(&frame, len);
+	websocket_frame_build(&frame, op, data, len);
+	net_send_stream(c, frame.data, frame.offset,
+	    kore_websocket_send_clean, NULL);
+
+	/* net_send_stream() takes over the buffer data pointer. */
+	frame.data = NULL;
+	kore_buf_cleanup(&frame);
+
+	net_send_flush(c);
+}
+
+static struct netbuf_shared *
+websocket_frame_shared(u_int8_t op, const void *data, size_t len)
+{
+	struct netbuf_shared	*frame;
+	u_int8_t		hdr[WEBSOCKET_FRAME_HDR_MAX];
+	size_t			hlen;
+
+	hlen = websocket_frame_header(hdr, op, len);
+
+	frame = net_shared_alloc(hlen + len);
+	memcpy(frame->data, hdr, hlen);
+	if (data != NULL && len > 0)
+		memcpy(frame->data + hlen, data, len);
+
+	return (frame);
 }
 
 static void
 websocket_frame_build(struct kore_buf *frame, u_int8_t op, const void *data,
     size_t len)
 {
-	u_int8_t		len_1;
-	u_int16_t		len16;
-	u_int64_t		len64;
+	u_int8_t	hdr[WEBSOCKET_FRAME_HDR_MAX];
+
+	kore_buf_append(frame, hdr, websocket_frame_header(hdr, op, len));
+
+	if (data != NULL && len > 0)
+		kore_buf_append(frame, data, len);
+}
+
+/* Write the header for a frame of len bytes into hdr, returns its size. */
+static size_t
+websocket_frame_header(u_int8_t *hdr, u_int8_t op, size_t len)
+{
+	u_int8_t	len_1;
+	size_t		hlen;
 
 	if (len > WEBSOCKET_PAYLOAD_SINGLE) {
 		if (len <= USHRT_MAX)
@@ -203,27 +729,22 @@ websocket_frame_build(struct kore_buf *frame, u_int8_t op, const void *data,
 		len_1 = len;
 	}
 
-	op |= (1 << 7);
-	kore_buf_append(frame, &op, sizeof(op));
+	hdr[0] = op | (1 << 7);
+	hdr[1] = len_1 & ~(1 << 7);
+	hlen = 2;
 
-	len_1 &= ~(1 << 7);
-	kore_buf_append(frame, &len_1, sizeof(len_1));
-
-	if (len_1 > WEBSOCKET_PAYLOAD_SINGLE) {
-		switch (len_1) {
-		case WEBSOCKET_PAYLOAD_EXTEND_1:
-			net_write16((u_int8_t *)&len16, len);
-			kore_buf_append(frame, &len16, sizeof(len16));
-			break;
-		case WEBSOCKET_PAYLOAD_EXTEND_2:
-			net_write64((u_int8_t *)&len64, len);
-			kore_buf_append(frame, &len64, sizeof(len64));
-			break;
-		}
+	switch (hdr[1]) {
+	case WEBSOCKET_PAYLOAD_EXTEND_1:
+		net_write16(&hdr[hlen], len);
+		hlen += sizeof(u_int16_t);
+		break;
+	case WEBSOCKET_PAYLOAD_EXTEND_2:
+		net_write64(&hdr[hlen], len);
+		hlen += sizeof(u_int64_t);
+		break;
 	}
 
-	if (data != NULL && len > 0)
-		kore_buf_append(frame, data, len);
+	return (hlen);
 }
 
 static int
@@ -237,15 +758,28 @@ websocket_recv_opcode(struct netbuf *nb)
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (WEBSOCKET_RSV(nb->buf[0], 1) || WEBSOCKET_RSV(nb->buf[0], 2) ||
-	    WEBSOCKET_RSV(nb->buf[0], 3)) {
+	len = WEBSOCKET_FRAME_LENGTH(nb->buf[1]);
+	op = nb->buf[0] & WEBSOCKET_OPCODE_MASK;
+
+	if (WEBSOCKET_RSV(nb->buf[0], 2) || WEBSOCKET_RSV(nb->buf[0], 3)) {
 		kore_debug("%p: RSV bits are not zero", c);
 		return (KORE_RESULT_ERROR);
 	}
 
-	len = WEBSOCKET_FRAME_LENGTH(nb->buf[1]);
+	/* RSV1 marks a compressed message if permessage-deflate is on. */
+	if (WEBSOCKET_RSV(nb->buf[0], 1)) {
+#if defined(KORE_USE_COMPRESS)
+		if (c->ws_deflate == NULL ||
+		    (op != WEBSOCKET_OP_TEXT && op != WEBSOCKET_OP_BINARY)) {
+			kore_debug("%p: unexpected RSV1 bit", c);
+			return (KORE_RESULT_ERROR);
+		}
+#else
+		kore_debug("%p: RSV bits are not zero", c);
+		return (KORE_RESULT_ERROR);
+#endif
+	}
 
-	op = nb->buf[0] & WEBSOCKET_OPCODE_MASK;
 	switch (op) {
 	case WEBSOCKET_OP_CONT:
 	case WEBSOCKET_OP_TEXT:
@@ -285,8 +819,12 @@ websocket_recv_frame(struct netbuf *nb)
 {
 	struct connection	*c;
 	int			ret;
+	u_int8_t		*data;
 	u_int64_t		len, i, total;
 	u_int8_t		op, moff, extra;
+#if defined(KORE_USE_COMPRESS)
+	struct kore_buf		*buf;
+#endif
 
 	c = nb->owner;
 	op = nb->buf[0] & WEBSOCKET_OPCODE_MASK;
@@ -325,8 +863,9 @@ websocket_recv_frame(struct netbuf *nb)
 	if (total != nb->b_len)
 		return (KORE_RESULT_ERROR);
 
+	data = &nb->buf[moff + 4];
 	for (i = 0; i < len; i++)
-		nb->buf[moff + 4 + i] ^= nb->buf[moff + (i % 4)];
+		data[i] ^= nb->buf[moff + (i % 4)];
 
 	ret = KORE_RESULT_OK;
 	switch (op) {
@@ -339,10 +878,17 @@ websocket_recv_frame(struct netbuf *nb)
 		break;
 	case WEBSOCKET_OP_TEXT:
 	case WEBSOCKET_OP_BINARY:
-		if (c->ws_message != NULL) {
-			kore_runtime_wsmessage(c->ws_message,
-			    c, op, &nb->buf[moff + 4], len);
+#if defined(KORE_USE_COMPRESS)
+		if (WEBSOCKET_RSV(nb->buf[0], 1)) {
+			buf = websocket_inflate_data(c, data, len);
+			if (buf == NULL)
+				return (KORE_RESULT_ERROR);
+			data = buf->data;
+			len = buf->offset;
 		}
+#endif
+		if (c->ws_message != NULL)
+			kore_runtime_wsmessage(c->ws_message, c, op, data, len);
 		break;
 	case WEBSOCKET_OP_CLOSE:
 		c->evt.flags &= ~KORE_EVENT_READ;
@@ -353,8 +899,7 @@ websocket_recv_frame(struct netbuf *nb)
 		kore_connection_disconnect(c);
 		break;
 	case WEBSOCKET_OP_PING:
-		kore_websocket_send(c, WEBSOCKET_OP_PONG,
-		    &nb->buf[moff + 4], len);
+		kore_websocket_send(c, WEBSOCKET_OP_PONG, data, len);
 		break;
 	default:
 		kore_debug("%p: bad websocket op %d", c, op);
@@ -378,3 +923,347 @@ websocket_disconnect(struct connection *c)
 		kore_websocket_send(c, WEBSOCKET_OP_CLOSE, NULL, 0);
 	}
 }
+
+#if defined(KORE_USE_COMPRESS)
+/*
+ * Accept the first permessage-deflate offer in sec-websocket-extensions
+ * that we can honour and answer it with the parameters we settled on.
+ */
+static void
+websocket_deflate_negotiate(struct http_request *req)
+{
+	struct kore_buf			buf;
+	struct websocket_deflate	wd;
+	const char			*hdr;
+	int				i, cnt, offered;
+	char				*copy;
+	char				*offers[WEBSOCKET_DEFLATE_OFFERS];
+
+	if (!kore_websocket_deflate)
+		return;
+
+	if (!http_request_header(req, "sec-websocket-extensions", &hdr))
+		return;
+
+	offered = 0;
+	copy = kore_strdup(hdr);
+	cnt = kore_split_string(copy, ",", offers, WEBSOCKET_DEFLATE_OFFERS);
+
+	for (i = 0; i < cnt; i++) {
+		if (websocket_deflate_offer(offers[i], &wd, &offered))
+			break;
+	}
+
+	kore_free(copy);
+
+	if (i >= cnt)
+		return;
+
+	kore_buf_init(&buf, 128);
+	kore_buf_appendf(&buf, "permessage-deflate");
+
+	if (!(wd.flags & WEBSOCKET_DEFLATE_SERVER_CTX))
+		kore_buf_appendf(&buf, "; server_no_context_takeover");
+	if (!(wd.flags & WEBSOCKET_DEFLATE_CLIENT_CTX))
+		kore_buf_appendf(&buf, "; client_no_context_takeover");
+	if (wd.server_bits < WEBSOCKET_DEFLATE_BITS_MAX) {
+		kore_buf_appendf(&buf,
+		    "; server_max_window_bits=%d", wd.server_bits);
+	}
+	if (offered && wd.client_bits < WEBSOCKET_DEFLATE_BITS_MAX) {
+		kore_buf_appendf(&buf,
+		    "; client_max_window_bits=%d", wd.client_bits);
+	}
+
+	http_response_header(req, "sec-websocket-extensions",
+	    kore_buf_stringify(&buf, NULL));
+	kore_buf_cleanup(&buf);
+
+	req->owner->ws_deflate = kore_malloc(sizeof(wd));
+	memcpy(req->owner->ws_deflate, &wd, sizeof(wd));
+}
+
+static int
+websocket_deflate_offer(char *offer, struct websocket_deflate *wd,
+    int *offered)
+{
+	size_t		len;
+	int		i, cnt, bits, err;
+	char		*name, *val, *params[WEBSOCKET_DEFLATE_PARAMS];
+
+	cnt = kore_split_string(offer, ";", params, WEBSOCKET_DEFLATE_PARAMS);
+	if (cnt == 0 || cnt == WEBSOCKET_DEFLATE_PARAMS - 1)
+		return (KORE_RESULT_ERROR);
+
+	name = kore_text_trim(params[0], strlen(params[0]));
+	if (strcasecmp(name, "permessage-deflate"))
+		return (KORE_RESULT_ERROR);
+
+	*offered = 0;
+	wd->def = NULL;
+	wd->inf = NULL;
+	wd->flags = WEBSOCKET_DEFLATE_CLIENT_CTX;
+	wd->client_bits = WEBSOCKET_DEFLATE_BITS_MAX;
+	wd->server_bits = kore_websocket_deflate_window;
+
+	if (kore_websocket_deflate_takeover)
+		wd->flags |= WEBSOCKET_DEFLATE_SERVER_CTX;
+
+	for (i = 1; i < cnt; i++) {
+		if ((val = strchr(params[i], '=')) != NULL) {
+			*(val)++ = '\0';
+			val = kore_text_trim(val, strlen(val));
+			if (*val == '"') {
+				val++;
+				len = strlen(val);
+				if (len == 0 || val[len - 1] != '"')
+					return (KORE_RESULT_ERROR);
+				val[len - 1] = '\0';
+			}
+		}
+
+		name = kore_text_trim(params[i], strlen(params[i]));
+
+		if (!strcasecmp(name, "server_no_context_takeover")) {
+			if (val != NULL)
+				return (KORE_RESULT_ERROR);
+			wd->flags &= ~WEBSOCKET_DEFLATE_SERVER_CTX;
+		} else if (!strcasecmp(name, "client_no_context_takeover")) {
+			if (val != NULL)
+				return (KORE_RESULT_ERROR);
+			wd->flags &= ~WEBSOCKET_DEFLATE_CLIENT_CTX;
+		} else if (!strcasecmp(name, "server_max_window_bits")) {
+			if (val == NULL)
+				return (KORE_RESULT_ERROR);
+			bits = kore_strtonum(val, 10, 8, 15, &err);
+			if (err != KORE_RESULT_OK)
+				return (KORE_RESULT_ERROR);
+			/* zlib has no raw deflate for an 8 bit window. */
+			if (bits < WEBSOCKET_DEFLATE_BITS_MIN)
+				return (KORE_RESULT_ERROR);
+			wd->server_bits = MIN(wd->server_bits, bits);
+		} else if (!strcasecmp(name, "client_max_window_bits")) {
+			*offered = 1;
+			if (val == NULL)
+				continue;
+			bits = kore_strtonum(val, 10, 8, 15, &err);
+			if (err != KORE_RESULT_OK)
+				return (KORE_RESULT_ERROR);
+			wd->client_bits = bits;
+		} else {
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (*offered) {
+		wd->client_bits = MIN(wd->client_bits,
+		    kore_websocket_deflate_window);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+websocket_deflate_wanted(struct connection *c, u_int8_t op, size_t len)
+{
+	if (c->ws_deflate == NULL)
+		return (0);
+
+	if (op != WEBSOCKET_OP_TEXT && op != WEBSOCKET_OP_BINARY)
+		return (0);
+
+	if (len < kore_websocket_deflate_min_size || len > UINT_MAX)
+		return (0);
+
+	return (1);
+}
+
+static void
+websocket_deflate_broadcast(struct connection *c, u_int8_t op,
+    const void *data, size_t len, struct netbuf_shared **deflated)
+{
+	struct kore_buf			*buf;
+	struct websocket_deflate	*wd = c->ws_deflate;
+
+	if (wd->flags & WEBSOCKET_DEFLATE_SERVER_CTX) {
+		kore_websocket_send(c, op, data, len);
+		return;
+	}
+
+	if (deflated[wd->server_bits] == NULL) {
+		buf = websocket_deflate_data(websocket_deflate_stream(wd),
+		    data, len);
+		if (buf == NULL) {
+			kore_connection_disconnect(c);
+			return;
+		}
+
+		deflated[wd->server_bits] = websocket_frame_shared(
+		    op | WEBSOCKET_DEFLATE_RSV1, buf->data, buf->offset);
+	}
+
+	net_send_shared(c, deflated[wd->server_bits]);
+	net_send_flush(c);
+}
+
+/*
+ * Returns the stream to compress the next message with, the per worker
+ * ones start every message from a clean history.
+ */
+static z_stream *
+websocket_deflate_stream(struct websocket_deflate *wd)
+{
+	z_stream	**strm;
+
+	if (wd->flags & WEBSOCKET_DEFLATE_SERVER_CTX)
+		strm = &wd->def;
+	else
+		strm = &deflate_shared[wd->server_bits];
+
+	if (*strm == NULL) {
+		*strm = kore_calloc(1, sizeof(z_stream));
+		if (deflateInit2(*strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		    -wd->server_bits, kore_websocket_deflate_memlevel,
+		    Z_DEFAULT_STRATEGY) != Z_OK)
+			fatal("websocket: deflateInit2 failed");
+	} else if (!(wd->flags & WEBSOCKET_DEFLATE_SERVER_CTX)) {
+		if (deflateReset(*strm) != Z_OK)
+			fatal("websocket: deflateReset failed");
+	}
+
+	return (*strm);
+}
+
+static z_stream *
+websocket_inflate_stream(struct websocket_deflate *wd)
+{
+	int		bits;
+	z_stream	**strm;
+
+	bits = MAX(wd->client_bits, WEBSOCKET_DEFLATE_BITS_MIN);
+
+	if (wd->flags & WEBSOCKET_DEFLATE_CLIENT_CTX)
+		strm = &wd->inf;
+	else
+		strm = &inflate_shared[bits];
+
+	if (*strm == NULL) {
+		*strm = kore_calloc(1, sizeof(z_stream));
+		if (inflateInit2(*strm, -bits) != Z_OK)
+			fatal("websocket: inflateInit2 failed");
+	} else if (!(wd->flags & WEBSOCKET_DEFLATE_CLIENT_CTX)) {
+		if (inflateReset(*strm) != Z_OK)
+			fatal("websocket: inflateReset failed");
+	}
+
+	return (*strm);
+}
+
+static void
+websocket_deflate_reserve(struct kore_buf *buf)
+{
+	if (buf->length - buf->offset >= WEBSOCKET_DEFLATE_CHUNK)
+		return;
+
+	buf->length = buf->offset + MAX(buf->length, WEBSOCKET_DEFLATE_CHUNK);
+	buf->data = kore_realloc(buf->data, buf->length);
+}
+
+/*
+ * Compress a message and strip the empty stored block that the sync
+ * flush leaves at its end, as RFC 7692 section 7.2.1 requires.
+ */
+static struct kore_buf *
+websocket_deflate_data(z_stream *strm, const void *data, size_t len)
+{
+	kore_buf_reset(&deflate_out);
+
+	strm->next_in = data;
+	strm->avail_in = len;
+
+	for (;;) {
+		websocket_deflate_reserve(&deflate_out);
+
+		strm->next_out = deflate_out.data + deflate_out.offset;
+		strm->avail_out = deflate_out.length - deflate_out.offset;
+
+		if (deflate(strm, Z_SYNC_FLUSH) != Z_OK) {
+			kore_log(LOG_ERR, "websocket: deflate: %s",
+			    strm->msg != NULL ? strm->msg : "failed");
+			return (NULL);
+		}
+
+		deflate_out.offset = deflate_out.length - strm->avail_out;
+		if (strm->avail_out != 0)
+			break;
+	}
+
+	if (deflate_out.offset < sizeof(deflate_tail) ||
+	    memcmp(deflate_out.data + deflate_out.offset -
+	    sizeof(deflate_tail), deflate_tail, sizeof(deflate_tail)))
+		return (NULL);
+
+	deflate_out.offset -= sizeof(deflate_tail);
+
+	return (&deflate_out);
+}
+
+/*
+ * Inflate a message with the stripped tail put back, the result may
+ * not grow past websocket_maxframe.
+ */
+static struct kore_buf *
+websocket_inflate_data(struct connection *c, u_int8_t *data, size_t len)
+{
+	int		ret, tail;
+	z_stream	*strm;
+
+	strm = websocket_inflate_stream(c->ws_deflate);
+	kore_buf_reset(&inflate_out);
+
+	strm->next_in = data;
+	strm->avail_in = len;
+
+	for (tail = 0; tail < 2; tail++) {
+		if (tail) {
+			strm->next_in = deflate_tail;
+			strm->avail_in = sizeof(deflate_tail);
+		}
+
+		do {
+			websocket_deflate_reserve(&inflate_out);
+
+			strm->next_out = inflate_out.data + inflate_out.offset;
+			strm->avail_out = inflate_out.length -
+			    inflate_out.offset;
+
+			ret = inflate(strm, Z_SYNC_FLUSH);
+			inflate_out.offset = inflate_out.length -
+			    strm->avail_out;
+
+			if (inflate_out.offset > kore_websocket_maxframe) {
+				kore_debug("%p: inflated frame too big", c);
+				return (NULL);
+			}
+
+			/* A final block ends the stream, start over. */
+			if (ret == Z_STREAM_END) {
+				if (inflateReset(strm) != Z_OK)
+					return (NULL);
+				return (&inflate_out);
+			}
+
+			if (ret == Z_BUF_ERROR && strm->avail_out != 0)
+				break;
+
+			if (ret != Z_OK && ret != Z_BUF_ERROR) {
+				kore_debug("%p: inflate: %s", c,
+				    strm->msg != NULL ? strm->msg : "failed");
+				return (NULL);
+			}
+		} while (strm->avail_in > 0 || strm->avail_out == 0);
+	}
+
+	return (&inflate_out);
+}
+#endif
@@ -25,6 +25,7 @@
 
 #include <fcntl.h>
 #include <grp.h>
+#include <inttypes.h>
 #include <pwd.h>
 #include <signal.h>
 #include <unistd.h>
@@ -61,6 +62,14 @@
 
 #define WORKER_SOLO_COUNT	3
 
+/*
+ * How long a worker may take to come up, in milliseconds, and how often
+ * the parent looks. Workers starting together share the timeout which
+ * starts over whenever one of them is done.
+ */
+#define WORKER_SPAWN_TIMEOUT	5000
+#define WORKER_SPAWN_POLL	10
+
 #define WORKER(id)						\
 	(struct kore_worker *)((u_int8_t *)kore_workers +	\
 	    (sizeof(struct kore_worker) * id))
@@ -73,6 +82,8 @@ struct wlock {
 static int	worker_trylock(void);
 static void	worker_unlock(void);
 static void	worker_reaper(pid_t, int);
+static void	worker_fork(u_int16_t, u_int16_t, u_int16_t);
+static int	worker_wait_ready(u_int16_t, u_int16_t);
 static void	worker_runtime_teardown(void);
 static void	worker_runtime_configure(void);
 static void	worker_domain_check(struct kore_domain *);
@@ -82,9 +93,12 @@ static struct kore_runtime_call	*worker_runtime_signal(void);
 static inline int	worker_acceptlock_obtain(void);
 static inline void	worker_acceptlock_release(void);
 static void		worker_accept_avail(struct kore_msg *, const void *);
+static void		worker_event_wait(u_int64_t);
+static void		worker_drain(void);
 
 static void	worker_entropy_recv(struct kore_msg *, const void *);
 static void	worker_keymgr_response(struct kore_msg *, const void *);
+static void	worker_keymgr_tickets(struct kore_msg *, const void *);
 
 static pid_t				worker_pgrp;
 static int				accept_avail;
@@ -95,7 +109,12 @@ static struct wlock			*accept_lock;
 
 struct kore_worker		*worker = NULL;
 u_int8_t			worker_set_affinity = 1;
+u_int8_t			worker_numa = KORE_NUMA_OFF;
+char				*worker_numa_nic = NULL;
 u_int32_t			worker_accept_threshold = 16;
+u_int32_t			worker_event_batch = 0;
+u_int32_t			worker_busy_poll = 0;
+u_int8_t			worker_accept_exclusive = 0;
 u_int32_t			worker_rlimit_nofiles = 768;
 u_int32_t			worker_max_connections = 512;
 u_int32_t			worker_active_connections = 0;
@@ -113,6 +132,13 @@ kore_worker_init(void)
 	if (worker_count == 0)
 		worker_count = cpu_count;
 
+	/*
+	 * Per worker listening sockets make the accept lock redundant,
+	 * so do exclusive wakeups on the shared ones.
+	 */
+	if (kore_server_reuseport(worker_count) || worker_accept_exclusive)
+		worker_no_lock = 1;
+
 	/* Account for the keymgr/acme even if we don't end up starting it. */
 	worker_count += 2;
 
@@ -142,25 +168,40 @@ kore_worker_init(void)
 	/* Setup log buffers. */
 	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
 		kw = WORKER(idx);
-		kw->lb.offset = 0;
+		kw->lb.head = 0;
+		kw->lb.tail = 0;
+		kw->lb.reported = 0;
 	}
 
+	kore_msg_ring_init();
+	kore_ratelimit_init();
+	kore_tls_session_cache_init();
+#if !defined(KORE_NO_HTTP)
+	kore_websocket_topic_init();
+	kore_sse_init();
+#endif
+
 	if (!kore_quiet)
 		kore_log(LOG_INFO, "starting worker processes");
 
 	if ((worker_pgrp = getpgrp()) == -1)
 		fatal("%s: getpgrp(): %s", __func__, errno_s);
 
-	/* Now start all the workers. */
+	/*
+	 * Now start all the workers. Everything the parent set up so far,
+	 * including the modules and the Python application, is inherited so
+	 * they only have their own state left to do and can all do that at
+	 * the same time.
+	 */
 	id = 1;
-	cpu = 1;
 	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
-		if (cpu >= cpu_count)
-			cpu = 0;
-		if (!kore_worker_spawn(idx, id++, cpu++))
-			return (KORE_RESULT_ERROR);
+		cpu = kore_platform_worker_cpu(id - 1);
+		worker_fork(idx, id++, cpu);
 	}
 
+	if (!worker_wait_ready(KORE_WORKER_BASE, worker_count))
+		return (KORE_RESULT_ERROR);
+
 	if (kore_keymgr_active) {
 #if defined(KORE_USE_ACME)
 		/* The ACME process is only started if we need it. */
@@ -186,77 +227,9 @@ kore_worker_init(void)
 int
 kore_worker_spawn(u_int16_t idx, u_int16_t id, u_int16_t cpu)
 {
-	int			cnt;
-	struct kore_worker	*kw;
-#if defined(__linux__)
-	int			status;
-#endif
-
-	kw = WORKER(idx);
-	kw->id = id;
-	kw->cpu = cpu;
-	kw->running = 1;
-
-	kw->ready = 0;
-	kw->has_lock = 0;
-	kw->active_route = NULL;
+	worker_fork(idx, id, cpu);
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, kw->pipe) == -1)
-		fatal("socketpair(): %s", errno_s);
-
-	if (!kore_connection_nonblock(kw->pipe[0], 0) ||
-	    !kore_connection_nonblock(kw->pipe[1], 0))
-		fatal("could not set pipe fds to nonblocking: %s", errno_s);
-
-	switch (id) {
-	case KORE_WORKER_KEYMGR:
-		kw->ps = &keymgr_privsep;
-		break;
-#if defined(KORE_USE_ACME)
-	case KORE_WORKER_ACME:
-		kw->ps = &acme_privsep;
-		break;
-#endif
-	default:
-		kw->ps = &worker_privsep;
-		break;
-	}
-
-	kw->pid = fork();
-	if (kw->pid == -1)
-		fatal("could not spawn worker child: %s", errno_s);
-
-	if (kw->pid == 0) {
-		kw->pid = getpid();
-		kore_worker_entry(kw);
-		exit(1);
-	} else {
-		for (cnt = 0; cnt < 50; cnt++) {
-			if (kw->ready == 1)
-				break;
-			usleep(100000);
-#if defined(__linux__)
-			/*
-			 * If seccomp_tracing is enabled, make sure we
-			 * handle the SIGSTOP from the child processes.
-			 */
-			if (kore_seccomp_tracing) {
-				if (waitpid(kw->pid, &status, WNOHANG) > 0)
-					kore_seccomp_trace(kw->pid, status);
-			}
-#endif
-		}
-
-		if (kw->ready == 0) {
-			kore_log(LOG_NOTICE,
-			    "worker %d failed to start, shutting down",
-			    kw->id);
-
-			return (KORE_RESULT_ERROR);
-		}
-	}
-
-	return (KORE_RESULT_OK);
+	return (worker_wait_ready(idx, idx + 1));
 }
 
 struct kore_worker *
@@ -362,6 +335,104 @@ kore_worker_dispatch_signal(int sig)
 	}
 }
 
+/* Log the event loop counters of all workers, see worker_event_wait(). */
+void
+kore_worker_loop_report(void)
+{
+	u_int16_t		idx;
+	struct kore_worker	*kw;
+	struct kore_evloop	loop;
+	u_int64_t		per_wake;
+
+	for (idx = 0; idx < worker_count; idx++) {
+		kw = WORKER(idx);
+
+		if (kw->pid == -1 || kw->pid == 0)
+			continue;
+
+		loop = kw->loop;
+		per_wake = loop.wakeups ? (loop.events * 100) / loop.wakeups : 0;
+
+		kore_log(LOG_INFO, "%s: %" PRIu64 " wakeups, %" PRIu64
+		    ".%02" PRIu64 " events/wakeup, idle %" PRIu64 "ms, "
+		    "busy poll %" PRIu64 " hits in %" PRIu64 "ms",
+		    kore_worker_name(kw->id), loop.wakeups, per_wake / 100,
+		    per_wake % 100, loop.idle_usec / 1000, loop.busy_hits,
+		    loop.busy_usec / 1000);
+	}
+}
+
+/* Ask all workers for their pool statistics, see kore_worker_pool_stats(). */
+void
+kore_worker_pool_stats_request(void)
+{
+	u_int16_t		idx;
+	struct kore_worker	*kw;
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = WORKER(idx);
+
+		if (kw->pid == -1 || kw->pid == 0 || kw->ps == NULL)
+			continue;
+
+		kore_msg_send(kw->id, KORE_MSG_POOL_STATS, NULL, 0);
+	}
+}
+
+/*
+ * Workers answer a KORE_MSG_POOL_STATS request with their kore_mem_stats
+ * followed by a kore_pool_stats entry per pool, the parent logs them.
+ */
+void
+kore_worker_pool_stats(struct kore_msg *msg, const void *data)
+{
+	size_t				i, cnt, len, total;
+	struct kore_mem_stats		mem;
+	const struct kore_pool_stats	*st;
+	u_int8_t			*buf;
+
+	if (worker != NULL) {
+		cnt = kore_pool_stats_get(NULL, 0);
+		len = sizeof(mem) + (cnt * sizeof(*st));
+		buf = kore_malloc(len);
+
+		kore_mem_stats_get((struct kore_mem_stats *)buf);
+		total = kore_pool_stats_get((struct kore_pool_stats *)
+		    (buf + sizeof(mem)), cnt);
+		cnt = MIN(cnt, total);
+
+		kore_msg_send(KORE_MSG_PARENT, KORE_MSG_POOL_STATS,
+		    buf, sizeof(mem) + (cnt * sizeof(*st)));
+		kore_free(buf);
+		return;
+	}
+
+	if (msg->length < sizeof(mem) ||
+	    ((msg->length - sizeof(mem)) % sizeof(*st)) != 0) {
+		kore_log(LOG_NOTICE, "bad pool stats from %s",
+		    kore_worker_name(msg->src));
+		return;
+	}
+
+	memcpy(&mem, data, sizeof(mem));
+	kore_log(LOG_INFO, "%s: large allocations %" PRIu64 " (%" PRIu64
+	    " bytes), hwm %" PRIu64 " bytes, %" PRIu64 " total",
+	    kore_worker_name(msg->src), mem.large_count, mem.large_bytes,
+	    mem.large_hwm, mem.large_allocs);
+
+	cnt = (msg->length - sizeof(mem)) / sizeof(*st);
+	st = (const struct kore_pool_stats *)((const u_int8_t *)data +
+	    sizeof(mem));
+
+	for (i = 0; i < cnt; i++) {
+		kore_log(LOG_INFO, "%s: pool %.*s (%zu bytes): %zu/%zu in use, "
+		    "hwm %zu, %zu regions, %" PRIu64 " allocs (%" PRIu64 "/s)",
+		    kore_worker_name(msg->src), KORE_POOL_STATS_NAME,
+		    st[i].name, st[i].elen, st[i].inuse, st[i].elms,
+		    st[i].hwm, st[i].regions, st[i].allocs, st[i].rate);
+	}
+}
+
 void
 kore_worker_privsep(void)
 {
@@ -439,10 +510,12 @@ kore_worker_entry(struct kore_worker *kw)
 {
 	struct kore_runtime_call	*sigcall;
 	u_int64_t			last_seed;
-	int				quit, had_lock, sig;
+	int				quit, drain, had_lock, sig;
 	u_int64_t			netwait, now, next_timeo;
 
 	worker = kw;
+	kore_evloop = &kw->loop;
+	memset(kore_evloop, 0, sizeof(*kore_evloop));
 
 	if (!kore_foreground)
 		closelog();
@@ -471,6 +544,8 @@ kore_worker_entry(struct kore_worker *kw)
 	}
 #endif
 
+	kore_server_reuseport_select(kw->id);
+
 	net_init();
 	kore_connection_init();
 	kore_platform_event_init();
@@ -488,10 +563,18 @@ kore_worker_entry(struct kore_worker *kw)
 	kore_accesslog_worker_init();
 #endif
 	kore_timer_init();
+#if !defined(KORE_NO_HTTP)
+	kore_metrics_init();
+	kore_upstream_worker_init();
+#endif
 	kore_fileref_init();
 	kore_tls_keymgr_init();
 
+	if (kore_pool_idle_time > 0)
+		kore_timer_add(kore_pool_reclaim, 1000, NULL, 0);
+
 	quit = 0;
+	drain = 0;
 	had_lock = 0;
 	next_timeo = 0;
 	accept_avail = 1;
@@ -501,8 +584,11 @@ kore_worker_entry(struct kore_worker *kw)
 
 	if (kore_keymgr_active) {
 		kore_msg_register(KORE_MSG_CRL, worker_keymgr_response);
+		kore_msg_register(KORE_MSG_OCSP, worker_keymgr_response);
 		kore_msg_register(KORE_MSG_ENTROPY_RESP, worker_entropy_recv);
 		kore_msg_register(KORE_MSG_CERTIFICATE, worker_keymgr_response);
+		kore_msg_register(KORE_MSG_TLS_TICKET_KEYS,
+		    worker_keymgr_tickets);
 
 		if (worker->restarted) {
 			kore_msg_send(KORE_WORKER_KEYMGR,
@@ -517,6 +603,11 @@ kore_worker_entry(struct kore_worker *kw)
 	}
 
 	kore_msg_register(KORE_MSG_ACCEPT_AVAILABLE, worker_accept_avail);
+	kore_msg_register(KORE_MSG_POOL_STATS, kore_worker_pool_stats);
+#if !defined(KORE_NO_HTTP)
+	kore_auth_worker_init();
+	kore_sse_worker_init();
+#endif
 
 	if (nlisteners == 0)
 		worker_no_lock = 1;
@@ -526,10 +617,19 @@ kore_worker_entry(struct kore_worker *kw)
 	kore_module_onload();
 	kore_domain_callback(worker_domain_check);
 
+#if defined(KORE_USE_PGSQL)
+	kore_pgsql_worker_init();
+#endif
+
+#if defined(KORE_USE_CURL)
+	kore_curl_worker_init();
+#endif
+
 	kore_worker_started();
 	worker->restarted = 0;
 
 	sigcall = worker_runtime_signal();
+	kore_clock_tick();
 
 	for (;;) {
 		now = kore_time_ms();
@@ -541,7 +641,7 @@ kore_worker_entry(struct kore_worker *kw)
 			last_seed = now;
 		}
 
-		if (!worker->has_lock && accept_avail) {
+		if (!worker->has_lock && accept_avail && !drain) {
 			if (worker_acceptlock_obtain()) {
 				accept_avail = 0;
 				if (had_lock == 0) {
@@ -562,13 +662,26 @@ kore_worker_entry(struct kore_worker *kw)
 #endif
 		}
 
+		/* Look for connections that went idle regularly. */
+		if (drain)
+			netwait = MIN(netwait, 100);
+
 #if defined(KORE_USE_PYTHON)
 		if (kore_python_coro_pending())
 			netwait = 0;
 #endif
 
-		kore_platform_event_wait(netwait);
-		now = kore_time_ms();
+		if (net_recv_pending())
+			netwait = 0;
+
+#if defined(KORE_USE_CURL)
+		if (kore_curl_pending())
+			netwait = 0;
+#endif
+
+		worker_event_wait(netwait);
+		kore_clock_tick();
+		now = kore_clock.ms;
 
 		if (worker->has_lock)
 			worker_acceptlock_release();
@@ -591,11 +704,26 @@ kore_worker_entry(struct kore_worker *kw)
 			case SIGTERM:
 				quit = 1;
 				break;
+			case SIGUSR2:
+				if (drain)
+					break;
+				drain = 1;
+				if (had_lock == 1) {
+					had_lock = 0;
+					kore_platform_disable_accept();
+				}
+				worker_drain();
+				break;
 			case SIGCHLD:
 #if defined(KORE_USE_PYTHON)
 				kore_python_proc_reap();
 #endif
 				break;
+#if defined(KORE_USE_PYTHON)
+			case SIGUSR1:
+				kore_python_coro_trace_dump();
+				break;
+#endif
 			default:
 				break;
 			}
@@ -615,6 +743,7 @@ kore_worker_entry(struct kore_worker *kw)
 		kore_curl_run_scheduled();
 		kore_curl_do_timeout();
 #endif
+		net_recv_pending_flush();
 #if !defined(KORE_NO_HTTP)
 		http_process();
 #endif
@@ -626,10 +755,27 @@ kore_worker_entry(struct kore_worker *kw)
 			next_timeo = now + 500;
 		}
 
+		if (drain) {
+			kore_connection_drain();
+#if !defined(KORE_NO_HTTP)
+			if (worker_active_connections == 0 &&
+			    http_request_count == 0)
+				quit = 1;
+#else
+			if (worker_active_connections == 0)
+				quit = 1;
+#endif
+		}
+
 		kore_connection_prune(KORE_CONNECTION_PRUNE_DISCONNECT);
+		kore_msg_flush();
+
+		if (quit)
+			break;
 	}
 
 	worker_runtime_teardown();
+	kore_msg_flush();
 	kore_server_cleanup();
 
 	kore_platform_event_cleanup();
@@ -656,6 +802,24 @@ kore_worker_entry(struct kore_worker *kw)
 	exit(0);
 }
 
+/* The number of workers handling connections that are still running. */
+u_int16_t
+kore_worker_running(void)
+{
+	u_int16_t		idx, running;
+	struct kore_worker	*kw;
+
+	running = 0;
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = WORKER(idx);
+		if (kw->running)
+			running++;
+	}
+
+	return (running);
+}
+
 void
 kore_worker_reap(void)
 {
@@ -855,6 +1019,13 @@ worker_reaper(pid_t pid, int status)
 		return;
 #endif
 
+#if !defined(KORE_NO_HTTP)
+	if (kore_accesslog_reap(pid, status))
+		return;
+#endif
+
+	kore_msg_ring_reap(pid);
+
 	for (idx = 0; idx < worker_count; idx++) {
 		kw = WORKER(idx);
 		if (kw->pid != pid)
@@ -870,6 +1041,9 @@ worker_reaper(pid_t pid, int status)
 		}
 
 		kw->running = 0;
+#if !defined(KORE_NO_HTTP)
+		kore_websocket_topic_reap(kw->id);
+#endif
 
 		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
 			kw->pid = 0;
@@ -923,7 +1097,8 @@ worker_reaper(pid_t pid, int status)
 			break;
 		}
 
-		if (kore_quit == 0) {
+		/* Workers draining for an upgrade are not replaced. */
+		if (kore_quit == 0 && kore_upgrade_handover == 0) {
 			kore_log(LOG_NOTICE, "restarting worker %d", kw->id);
 			kw->restarted = 1;
 			kore_msg_parent_remove(kw);
@@ -940,6 +1115,117 @@ worker_reaper(pid_t pid, int status)
 	}
 }
 
+static void
+worker_fork(u_int16_t idx, u_int16_t id, u_int16_t cpu)
+{
+	struct kore_worker	*kw;
+
+	kw = WORKER(idx);
+	kw->id = id;
+	kw->cpu = cpu;
+	kw->running = 1;
+
+	kw->ready = 0;
+	kw->has_lock = 0;
+	kw->active_route = NULL;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, kw->pipe) == -1)
+		fatal("socketpair(): %s", errno_s);
+
+	if (!kore_connection_nonblock(kw->pipe[0], 0) ||
+	    !kore_connection_nonblock(kw->pipe[1], 0))
+		fatal("could not set pipe fds to nonblocking: %s", errno_s);
+
+	/* Not for the new binary started on upgrade. */
+	if (fcntl(kw->pipe[0], F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(kw->pipe[1], F_SETFD, FD_CLOEXEC) == -1)
+		fatal("could not set pipe fds to close-on-exec: %s", errno_s);
+
+	switch (id) {
+	case KORE_WORKER_KEYMGR:
+		kw->ps = &keymgr_privsep;
+		break;
+#if defined(KORE_USE_ACME)
+	case KORE_WORKER_ACME:
+		kw->ps = &acme_privsep;
+		break;
+#endif
+	default:
+		kw->ps = &worker_privsep;
+		break;
+	}
+
+	kw->pid = fork();
+	if (kw->pid == -1)
+		fatal("could not spawn worker child: %s", errno_s);
+
+	if (kw->pid == 0) {
+		kw->pid = getpid();
+		kore_worker_entry(kw);
+		exit(1);
+	}
+}
+
+/* Wait for the workers in [start, end) to report they are up. */
+static int
+worker_wait_ready(u_int16_t start, u_int16_t end)
+{
+	struct kore_worker	*kw;
+	u_int64_t		deadline;
+	u_int16_t		idx, pending, last;
+#if defined(__linux__)
+	int			status;
+#endif
+
+	last = end - start;
+	deadline = kore_time_ms() + WORKER_SPAWN_TIMEOUT;
+
+	for (;;) {
+		pending = 0;
+
+		for (idx = start; idx < end; idx++) {
+			kw = WORKER(idx);
+			if (kw->ready == 1)
+				continue;
+
+			pending++;
+#if defined(__linux__)
+			/*
+			 * If seccomp_tracing is enabled, make sure we
+			 * handle the SIGSTOP from the child processes.
+			 */
+			if (kore_seccomp_tracing) {
+				if (waitpid(kw->pid, &status, WNOHANG) > 0)
+					kore_seccomp_trace(kw->pid, status);
+			}
+#endif
+		}
+
+		if (pending == 0)
+			return (KORE_RESULT_OK);
+
+		if (pending < last) {
+			last = pending;
+			deadline = kore_time_ms() + WORKER_SPAWN_TIMEOUT;
+		} else if (kore_time_ms() >= deadline) {
+			break;
+		}
+
+		usleep(WORKER_SPAWN_POLL * 1000);
+	}
+
+	for (idx = start; idx < end; idx++) {
+		kw = WORKER(idx);
+		if (kw->ready == 0) {
+			kore_log(LOG_NOTICE,
+			    "worker %d failed to start, shutting down",
+			    kw->id);
+		}
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
 static inline void
 worker_acceptlock_release(void)
 {
@@ -951,7 +1237,8 @@ worker_acceptlock_release(void)
 
 	if (worker_active_connections < worker_max_connections) {
 #if !defined(KORE_NO_HTTP)
-		if (http_request_count < http_request_limit)
+		if (http_request_count < http_overload_limit() &&
+		    !http_overload_active())
 			return;
 #else
 		return;
@@ -985,7 +1272,7 @@ worker_acceptlock_obtain(void)
 		return (0);
 
 #if !defined(KORE_NO_HTTP)
-	if (http_request_count >= http_request_limit)
+	if (http_request_count >= http_overload_limit())
 		return (0);
 #endif
 
@@ -1020,12 +1307,73 @@ worker_unlock(void)
 		kore_log(LOG_NOTICE, "worker_unlock(): wasn't locked");
 }
 
+/*
+ * If the previous wakeup found work, spin on the event backend for up
+ * to worker_busy_poll microseconds before going to sleep so a closely
+ * following request does not pay for a full wakeup. An idle worker
+ * does not spin at all.
+ */
+static void
+worker_event_wait(u_int64_t netwait)
+{
+	static int	busy = 0;
+	int		n;
+	u_int64_t	start, now;
+
+	n = 0;
+
+	if (worker_busy_poll != 0 && busy && netwait != 0) {
+		start = kore_time_us();
+		do {
+			n = kore_platform_event_wait(0);
+			now = kore_time_us();
+		} while (n == 0 && (now - start) < worker_busy_poll);
+
+		kore_evloop->busy_usec += now - start;
+
+		if (n > 0)
+			kore_evloop->busy_hits++;
+		else if (netwait != KORE_WAIT_INFINITE)
+			netwait -= MIN(netwait, (now - start) / 1000);
+	}
+
+	if (n == 0)
+		n = kore_platform_event_wait(netwait);
+
+	busy = (n > 0);
+}
+
 static void
 worker_accept_avail(struct kore_msg *msg, const void *data)
 {
 	accept_avail = 1;
 }
 
+/*
+ * The parent handed our listeners to a new process: stop accepting and
+ * close connections as soon as they have nothing in flight, the worker
+ * exits once none are left.
+ */
+static void
+worker_drain(void)
+{
+	if (!kore_quiet)
+		kore_log(LOG_NOTICE, "draining connections");
+
+	if (worker->has_lock) {
+		if (worker_count != WORKER_SOLO_COUNT && worker_no_lock == 0)
+			worker_unlock();
+		worker->has_lock = 0;
+	}
+
+	accept_avail = 0;
+
+#if !defined(KORE_NO_HTTP)
+	/* Responses still to be sent tell the client to go elsewhere. */
+	http_keepalive_time = 0;
+#endif
+}
+
 static void
 worker_entropy_recv(struct kore_msg *msg, const void *data)
 {
@@ -1057,6 +1405,9 @@ worker_keymgr_response(struct kore_msg *msg, const void *data)
 	case KORE_MSG_CRL:
 		kore_tls_domain_crl(dom, req->data, req->data_len);
 		break;
+	case KORE_MSG_OCSP:
+		kore_tls_domain_ocsp(dom, req->data, req->data_len);
+		break;
 #if defined(KORE_USE_ACME)
 	case KORE_ACME_CHALLENGE_SET_CERT:
 		if (dom->tls_ctx == NULL) {
@@ -1089,3 +1440,15 @@ worker_keymgr_response(struct kore_msg *msg, const void *data)
 		break;
 	}
 }
+
+static void
+worker_keymgr_tickets(struct kore_msg *msg, const void *data)
+{
+	const struct kore_x509_msg	*req;
+
+	if (!kore_worker_keymgr_response_verify(msg, data, NULL))
+		return;
+
+	req = (const struct kore_x509_msg *)data;
+	kore_tls_ticket_keys(req->data, req->data_len);
+}
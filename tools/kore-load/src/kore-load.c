@@ -0,0 +1,1382 @@
+/*
+ * Copyright (c) 2013-2022 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * HTTP load generator, the counterpart to kore-serve.
+ *
+ * Every worker drives its share of the client connections from the
+ * normal Kore event loop using the regular connection and netbuf code.
+ * Once the run is over the workers hand their counters and latency
+ * histogram to the parent, which merges them and prints the report.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <kore/kore.h>
+#include <kore/hooks.h>
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdlib.h>
+
+#if defined(TLS_BACKEND_OPENSSL)
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#if defined(__linux__)
+#include <kore/seccomp.h>
+
+KORE_SECCOMP_FILTER("kore-load",
+	KORE_SYSCALL_ALLOW(connect),
+	KORE_SYSCALL_ALLOW(getpeername),
+	KORE_SYSCALL_ALLOW(getsockname),
+	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_INET),
+	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_INET6),
+)
+#endif
+
+#define LOAD_MSG_RESULT		(KORE_MSG_APP_BASE + 1)
+
+#define LOAD_SCENARIO_KEEPALIVE		1
+#define LOAD_SCENARIO_PIPELINE		2
+#define LOAD_SCENARIO_HANDSHAKE		3
+#define LOAD_SCENARIO_UPLOAD		4
+#define LOAD_SCENARIO_WEBSOCKET		5
+#define LOAD_SCENARIO_SLOW		6
+
+#define LOAD_STATE_CONNECTING		1
+#define LOAD_STATE_HEADERS		2
+#define LOAD_STATE_BODY			3
+#define LOAD_STATE_BODY_EOF		4
+#define LOAD_STATE_CHUNK_SIZE		5
+#define LOAD_STATE_CHUNK_DATA		6
+#define LOAD_STATE_CHUNK_TRAILER	7
+#define LOAD_STATE_WEBSOCKET		8
+
+#define LOAD_CONN_CLOSE			0x0001
+#define LOAD_CONN_CLOSING		0x0002
+#define LOAD_CONN_ANSWERED		0x0004
+
+#define LOAD_PIPELINE_MAX		256
+#define LOAD_HEADER_MAX			(64 * 1024)
+#define LOAD_RECV_LEN			16384
+#define LOAD_HEADERS_MAX		16
+#define LOAD_RETRY_MS			100
+
+#define LOAD_WS_KEY			"dGhlIHNhbXBsZSBub25jZQ=="
+#define LOAD_WS_OP_BINARY		0x02
+#define LOAD_WS_OP_CLOSE		0x08
+#define LOAD_WS_OP_PING			0x09
+#define LOAD_WS_OP_PONG			0x0a
+#define LOAD_WS_MASK_LEN		4
+
+struct load_result {
+	u_int64_t		elapsed;
+	u_int64_t		requests;
+	u_int64_t		errors;
+	u_int64_t		connects;
+	u_int64_t		bytes_in;
+	u_int64_t		bytes_out;
+	u_int64_t		status[6];
+	u_int64_t		min;
+	u_int64_t		max;
+	struct kore_histogram	latency;
+};
+
+struct load_conn {
+	struct connection	*c;
+	struct kore_buf		in;
+	struct kore_timer	*timer;
+
+	int			flags;
+	int			state;
+	int			status;
+	size_t			remain;
+	size_t			slow_off;
+
+	u_int64_t		started;
+	u_int64_t		sent[LOAD_PIPELINE_MAX];
+	u_int32_t		head;
+	u_int32_t		inflight;
+
+	LIST_ENTRY(load_conn)	list;
+};
+
+struct load_scenario {
+	const char		*name;
+	int			type;
+};
+
+static void	usage(void);
+static void	load_target_parse(const char *);
+static void	load_request_build(void);
+static void	load_msg_result(struct kore_msg *, const void *);
+static void	load_report_text(FILE *, u_int64_t);
+static void	load_report_json(const char *, u_int64_t);
+static u_int64_t load_percentile(double);
+
+static void	load_connect(void);
+static void	load_retry(void *, u_int64_t);
+static void	load_finish(void *, u_int64_t);
+static int	load_handle_connect(struct connection *);
+static int	load_established(struct connection *);
+static void	load_disconnect(struct connection *);
+static void	load_event(void *, int);
+static int	load_recv(struct netbuf *);
+static ssize_t	load_parse(struct load_conn *, u_int8_t *, size_t);
+static int	load_parse_headers(struct load_conn *, u_int8_t *, size_t);
+static void	load_response_done(struct load_conn *, u_int64_t);
+static void	load_request_send(struct load_conn *);
+static void	load_slow_tick(void *, u_int64_t);
+static void	load_latency(u_int64_t);
+
+static ssize_t	load_ws_parse(struct load_conn *, u_int8_t *, size_t);
+static void	load_ws_send(struct load_conn *, u_int8_t,
+		    const void *, size_t);
+static void	load_ws_publish(void *, u_int64_t);
+
+#if defined(TLS_BACKEND_OPENSSL)
+static int	load_handle_tls(struct connection *);
+#endif
+
+static const struct load_scenario	scenarios[] = {
+	{ "keepalive",		LOAD_SCENARIO_KEEPALIVE },
+	{ "pipeline",		LOAD_SCENARIO_PIPELINE },
+	{ "handshake",		LOAD_SCENARIO_HANDSHAKE },
+	{ "upload",		LOAD_SCENARIO_UPLOAD },
+	{ "websocket",		LOAD_SCENARIO_WEBSOCKET },
+	{ "slow",		LOAD_SCENARIO_SLOW },
+	{ NULL,			0 },
+};
+
+/* Run configuration, set up in the parent and inherited by the workers. */
+static const char		*load_url = NULL;
+static const char		*load_out = NULL;
+static const char		*load_name = "keepalive";
+static int			load_scenario = LOAD_SCENARIO_KEEPALIVE;
+static int			load_tls = 0;
+static int			load_workers = 1;
+static u_int32_t		load_conns = 64;
+static u_int32_t		load_depth = 1;
+static u_int64_t		load_duration = 10;
+static u_int64_t		load_interval = 100;
+static u_int64_t		load_timeout = 10000;
+static size_t			load_size = 0;
+static char			load_host[256];
+static char			load_port[8];
+static char			load_path[1024];
+static const char		*load_headers[LOAD_HEADERS_MAX];
+static int			load_headers_cnt = 0;
+static struct sockaddr_storage	load_addr;
+static socklen_t		load_addrlen;
+static struct kore_buf		load_request;
+static u_int8_t			*load_body = NULL;
+
+/* Worker state. */
+static int			load_running = 0;
+static u_int64_t		load_start = 0;
+static struct load_result	load_res;
+static LIST_HEAD(, load_conn)	load_list;
+
+/* Parent state. */
+static int			load_reported = 0;
+static struct load_result	load_total;
+
+#if defined(TLS_BACKEND_OPENSSL)
+static SSL_CTX			*load_ssl_ctx = NULL;
+#endif
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "Usage: kore-load [options] http[s]://host[:port]/path\n"
+	    "\n"
+	    "\t-s scenario\tkeepalive, pipeline, handshake, upload,\n"
+	    "\t\t\twebsocket or slow (default keepalive)\n"
+	    "\t-c conns\ttotal number of connections (default 64)\n"
+	    "\t-w workers\tnumber of workers (default 1)\n"
+	    "\t-d seconds\tduration of the run (default 10)\n"
+	    "\t-p depth\trequests in flight per connection (pipeline)\n"
+	    "\t-b bytes\tupload body or websocket message size\n"
+	    "\t-i ms\t\tinterval between websocket messages or slow\n"
+	    "\t\t\tclient writes (default 100)\n"
+	    "\t-t ms\t\tidle timeout per connection (default 10000)\n"
+	    "\t-H header\textra request header, can be repeated\n"
+	    "\t-o file\t\twrite a JSON report to file\n");
+
+	exit(1);
+}
+
+void
+kore_parent_configure(int argc, char *argv[])
+{
+	int		ch, i, err;
+
+	kore_quiet = 1;
+	kore_foreground = 1;
+
+	skip_runas = 1;
+	skip_chroot = 1;
+
+	while ((ch = getopt(argc, argv, "b:c:d:hH:i:o:p:s:t:w:")) != -1) {
+		switch (ch) {
+		case 'b':
+			load_size = kore_strtonum(optarg, 10, 1, INT_MAX, &err);
+			if (err != KORE_RESULT_OK)
+				fatal("invalid size '%s'", optarg);
+			break;
+		case 'c':
+			load_conns = kore_strtonum(optarg, 10, 1, 100000, &err);
+			if (err != KORE_RESULT_OK)
+				fatal("invalid connections '%s'", optarg);
+			break;
+		case 'd':
+			load_duration = kore_strtonum(optarg, 10,
+			    1, 86400, &err);
+			if (err != KORE_RESULT_OK)
+				fatal("invalid duration '%s'", optarg);
+			break;
+		case 'H':
+			if (load_headers_cnt == LOAD_HEADERS_MAX)
+				fatal("too many headers");
+			if (strchr(optarg, ':') == NULL)
+				fatal("header '%s' is not name: value", optarg);
+			load_headers[load_headers_cnt++] = optarg;
+			break;
+		case 'i':
+			load_interval = kore_strtonum(optarg, 10,
+			    1, 60000, &err);
+			if (err != KORE_RESULT_OK)
+				fatal("invalid interval '%s'", optarg);
+			break;
+		case 'o':
+			load_out = kore_strdup(optarg);
+			break;
+		case 'p':
+			load_depth = kore_strtonum(optarg, 10,
+			    1, LOAD_PIPELINE_MAX, &err);
+			if (err != KORE_RESULT_OK)
+				fatal("invalid depth '%s'", optarg);
+			break;
+		case 's':
+			for (i = 0; scenarios[i].name != NULL; i++) {
+				if (!strcmp(scenarios[i].name, optarg))
+					break;
+			}
+			if (scenarios[i].name == NULL)
+				fatal("unknown scenario '%s'", optarg);
+			load_name = scenarios[i].name;
+			load_scenario = scenarios[i].type;
+			break;
+		case 't':
+			load_timeout = kore_strtonum(optarg, 10,
+			    1, 600000, &err);
+			if (err != KORE_RESULT_OK)
+				fatal("invalid timeout '%s'", optarg);
+			break;
+		case 'w':
+			load_workers = kore_strtonum(optarg, 10,
+			    1, KORE_WORKER_MAX, &err);
+			if (err != KORE_RESULT_OK)
+				fatal("invalid workers '%s'", optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage();
+
+	load_url = kore_strdup(argv[0]);
+	load_target_parse(load_url);
+
+	if (load_scenario == LOAD_SCENARIO_PIPELINE && load_depth == 1)
+		load_depth = 16;
+	else if (load_scenario != LOAD_SCENARIO_PIPELINE)
+		load_depth = 1;
+
+	if (load_size == 0) {
+		if (load_scenario == LOAD_SCENARIO_WEBSOCKET)
+			load_size = 64;
+		else if (load_scenario == LOAD_SCENARIO_UPLOAD)
+			load_size = 1024 * 1024;
+	}
+
+	if (load_scenario == LOAD_SCENARIO_WEBSOCKET && load_size < 8)
+		fatal("websocket messages must be at least 8 bytes");
+
+	if ((u_int32_t)load_workers > load_conns)
+		load_workers = load_conns;
+
+	worker_count = load_workers;
+	worker_max_connections = (load_conns / load_workers) + 16;
+	worker_rlimit_nofiles = worker_max_connections * 2;
+
+	load_request_build();
+	memset(&load_total, 0, sizeof(load_total));
+
+	kore_msg_register(LOAD_MSG_RESULT, load_msg_result);
+}
+
+void
+kore_parent_teardown(void)
+{
+	u_int64_t	elapsed;
+
+	/* The run length is that of the slowest worker. */
+	elapsed = load_total.elapsed;
+
+	if (load_reported == 0) {
+		fprintf(stderr, "no results were collected\n");
+		return;
+	}
+
+	load_report_text(stdout, elapsed);
+
+	if (load_out != NULL)
+		load_report_json(load_out, elapsed);
+}
+
+void
+kore_worker_configure(void)
+{
+	u_int32_t	i, conns;
+
+#if defined(TLS_BACKEND_OPENSSL)
+	if (load_tls) {
+		if ((load_ssl_ctx = SSL_CTX_new(TLS_client_method())) == NULL)
+			fatal("SSL_CTX_new: %s", ERR_error_string(
+			    ERR_get_error(), NULL));
+		SSL_CTX_set_verify(load_ssl_ctx, SSL_VERIFY_NONE, NULL);
+		SSL_CTX_set_session_cache_mode(load_ssl_ctx,
+		    SSL_SESS_CACHE_OFF);
+	}
+#endif
+
+	LIST_INIT(&load_list);
+	memset(&load_res, 0, sizeof(load_res));
+	load_res.min = UINT64_MAX;
+
+	/* Spread the connections evenly over the workers. */
+	conns = load_conns / load_workers;
+	if ((u_int32_t)(worker->id - 1) < load_conns % load_workers)
+		conns++;
+
+	load_running = 1;
+	load_start = kore_time_us();
+
+	for (i = 0; i < conns; i++)
+		load_connect();
+
+	kore_timer_add(load_finish, load_duration * 1000,
+	    NULL, KORE_TIMER_ONESHOT);
+
+	if (load_scenario == LOAD_SCENARIO_WEBSOCKET)
+		kore_timer_add(load_ws_publish, load_interval, NULL, 0);
+}
+
+static void
+load_target_parse(const char *url)
+{
+	int			r;
+	size_t			len;
+	const char		*p, *host, *end;
+	struct addrinfo		hints, *results;
+
+	if (!strncmp(url, "http://", 7)) {
+		host = url + 7;
+		(void)kore_strlcpy(load_port, "80", sizeof(load_port));
+	} else if (!strncmp(url, "https://", 8)) {
+		host = url + 8;
+		load_tls = 1;
+		(void)kore_strlcpy(load_port, "443", sizeof(load_port));
+	} else {
+		fatal("url must start with http:// or https://");
+	}
+
+#if !defined(TLS_BACKEND_OPENSSL)
+	if (load_tls)
+		fatal("https is not supported without a TLS backend");
+#endif
+
+	if ((end = strchr(host, '/')) == NULL)
+		end = host + strlen(host);
+
+	if ((p = memchr(host, ':', end - host)) != NULL) {
+		len = end - (p + 1);
+		if (len == 0 || len >= sizeof(load_port))
+			fatal("invalid port in '%s'", url);
+		memcpy(load_port, p + 1, len);
+		load_port[len] = '\0';
+	} else {
+		p = end;
+	}
+
+	len = p - host;
+	if (len == 0 || len >= sizeof(load_host))
+		fatal("invalid host in '%s'", url);
+
+	memcpy(load_host, host, len);
+	load_host[len] = '\0';
+
+	if (*end == '\0')
+		end = "/";
+
+	if (kore_strlcpy(load_path, end, sizeof(load_path)) >=
+	    sizeof(load_path))
+		fatal("path in '%s' is too long", url);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	r = getaddrinfo(load_host, load_port, &hints, &results);
+	if (r != 0)
+		fatal("getaddrinfo(%s): %s", load_host, gai_strerror(r));
+
+	memcpy(&load_addr, results->ai_addr, results->ai_addrlen);
+	load_addrlen = results->ai_addrlen;
+
+	freeaddrinfo(results);
+}
+
+static void
+load_request_build(void)
+{
+	int		i;
+	size_t		off;
+
+	kore_buf_init(&load_request, 512);
+
+	switch (load_scenario) {
+	case LOAD_SCENARIO_UPLOAD:
+		kore_buf_appendf(&load_request, "POST %s HTTP/1.1\r\n",
+		    load_path);
+		kore_buf_appendf(&load_request,
+		    "content-type: application/octet-stream\r\n"
+		    "content-length: %zu\r\n", load_size);
+		break;
+	case LOAD_SCENARIO_WEBSOCKET:
+		kore_buf_appendf(&load_request, "GET %s HTTP/1.1\r\n",
+		    load_path);
+		kore_buf_appendf(&load_request,
+		    "upgrade: websocket\r\nconnection: upgrade\r\n"
+		    "sec-websocket-key: %s\r\n"
+		    "sec-websocket-version: 13\r\n", LOAD_WS_KEY);
+		break;
+	default:
+		kore_buf_appendf(&load_request, "GET %s HTTP/1.1\r\n",
+		    load_path);
+		break;
+	}
+
+	kore_buf_appendf(&load_request, "host: %s\r\n", load_host);
+	kore_buf_appendf(&load_request, "user-agent: kore-load\r\n");
+
+	if (load_scenario == LOAD_SCENARIO_HANDSHAKE)
+		kore_buf_appendf(&load_request, "connection: close\r\n");
+
+	for (i = 0; i < load_headers_cnt; i++)
+		kore_buf_appendf(&load_request, "%s\r\n", load_headers[i]);
+
+	kore_buf_appendf(&load_request, "\r\n");
+
+	if (load_scenario == LOAD_SCENARIO_UPLOAD) {
+		load_body = kore_malloc(load_size);
+		for (off = 0; off < load_size; off++)
+			load_body[off] = 'a' + (off % 26);
+	}
+}
+
+static void
+load_connect(void)
+{
+	int			fd;
+	struct connection	*c;
+	struct load_conn	*lc;
+
+	if ((fd = socket(load_addr.ss_family, SOCK_STREAM, 0)) == -1) {
+		kore_log(LOG_ERR, "socket(): %s", errno_s);
+		load_res.errors++;
+		kore_timer_add(load_retry, LOAD_RETRY_MS,
+		    NULL, KORE_TIMER_ONESHOT);
+		return;
+	}
+
+	if (!kore_connection_nonblock(fd, 1)) {
+		close(fd);
+		load_res.errors++;
+		kore_timer_add(load_retry, LOAD_RETRY_MS,
+		    NULL, KORE_TIMER_ONESHOT);
+		return;
+	}
+
+	lc = kore_calloc(1, sizeof(*lc));
+	kore_buf_init(&lc->in, 1024);
+	lc->state = LOAD_STATE_CONNECTING;
+	lc->started = kore_time_us();
+
+	c = kore_connection_new(NULL);
+	c->fd = fd;
+	c->family = load_addr.ss_family;
+	c->read = net_read;
+	c->write = net_write;
+	c->writev = net_writev;
+	c->proto = CONN_PROTO_UNKNOWN;
+	c->state = CONN_STATE_ESTABLISHED;
+	c->handle = load_handle_connect;
+	c->disconnect = load_disconnect;
+	c->evt.handle = load_event;
+	c->idle_timer.length = load_timeout;
+	c->hdlr_extra = lc;
+
+	lc->c = c;
+	LIST_INSERT_HEAD(&load_list, lc, list);
+
+	load_res.connects++;
+
+	kore_platform_schedule_write(c->fd, c);
+	kore_connection_start_idletimer(c);
+	TAILQ_INSERT_TAIL(&connections, c, list);
+
+	c->evt.flags |= KORE_EVENT_WRITE;
+	if (!c->handle(c))
+		kore_connection_disconnect(c);
+}
+
+static void
+load_retry(void *arg, u_int64_t now)
+{
+	if (load_running)
+		load_connect();
+}
+
+static void
+load_finish(void *arg, u_int64_t now)
+{
+	struct load_conn	*lc;
+
+	load_running = 0;
+	load_res.elapsed = kore_time_us() - load_start;
+
+	kore_msg_send(KORE_MSG_PARENT, LOAD_MSG_RESULT,
+	    &load_res, sizeof(load_res));
+
+	/* The disconnect callback takes the connection off the list. */
+	while ((lc = LIST_FIRST(&load_list)) != NULL)
+		kore_connection_disconnect(lc->c);
+}
+
+static int
+load_handle_connect(struct connection *c)
+{
+	if (!(c->evt.flags & KORE_EVENT_WRITE))
+		return (KORE_RESULT_OK);
+
+	kore_connection_stop_idletimer(c);
+
+	if (connect(c->fd, (struct sockaddr *)&load_addr, load_addrlen) == -1) {
+		if (errno != EALREADY && errno != EINPROGRESS &&
+		    errno != EISCONN) {
+			kore_log(LOG_ERR, "connect(): %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (errno != EISCONN) {
+			c->evt.flags &= ~KORE_EVENT_WRITE;
+			kore_connection_start_idletimer(c);
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	kore_platform_event_all(c->fd, c);
+
+#if defined(TLS_BACKEND_OPENSSL)
+	if (load_tls) {
+		if ((c->tls = SSL_new(load_ssl_ctx)) == NULL)
+			return (KORE_RESULT_ERROR);
+
+		SSL_set_fd(c->tls, c->fd);
+		SSL_set_connect_state(c->tls);
+		SSL_set_tlsext_host_name(c->tls, load_host);
+
+		c->handle = load_handle_tls;
+
+		return (c->handle(c));
+	}
+#endif
+
+	return (load_established(c));
+}
+
+#if defined(TLS_BACKEND_OPENSSL)
+static int
+load_handle_tls(struct connection *c)
+{
+	int		r;
+
+	kore_connection_stop_idletimer(c);
+
+	ERR_clear_error();
+	r = SSL_connect(c->tls);
+	if (r <= 0) {
+		switch (SSL_get_error(c->tls, r)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			kore_connection_start_idletimer(c);
+			return (KORE_RESULT_OK);
+		default:
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	c->read = kore_tls_read;
+	c->write = kore_tls_write;
+	c->writev = kore_tls_writev;
+
+	return (load_established(c));
+}
+#endif
+
+static int
+load_established(struct connection *c)
+{
+	struct load_conn	*lc = c->hdlr_extra;
+
+	c->handle = kore_connection_handle;
+	lc->state = LOAD_STATE_HEADERS;
+
+	net_recv_queue(c, LOAD_RECV_LEN, NETBUF_CALL_CB_ALWAYS, load_recv);
+
+	if (load_scenario == LOAD_SCENARIO_SLOW) {
+		lc->slow_off = 0;
+		lc->sent[0] = kore_time_us();
+		lc->inflight = 1;
+		lc->timer = kore_timer_add(load_slow_tick,
+		    load_interval, c, 0);
+	} else {
+		load_request_send(lc);
+	}
+
+	c->evt.flags |= KORE_EVENT_READ | KORE_EVENT_WRITE;
+
+	return (kore_connection_handle(c));
+}
+
+/*
+ * A server closing right after its response must not make us drop
+ * the data that is still unread, read until the end of the stream.
+ */
+static void
+load_event(void *arg, int error)
+{
+	struct connection	*c = arg;
+
+	if (error && c->state == CONN_STATE_ESTABLISHED &&
+	    c->handle == kore_connection_handle) {
+		c->evt.flags |= KORE_EVENT_READ | KORE_EVENT_WRITE;
+		error = 0;
+	}
+
+	kore_connection_event(c, error);
+}
+
+static void
+load_disconnect(struct connection *c)
+{
+	struct load_conn	*lc = c->hdlr_extra;
+
+	if (lc->timer != NULL) {
+		kore_timer_remove(lc->timer);
+		lc->timer = NULL;
+	}
+
+	/* A response without length ends with the connection. */
+	if (lc->state == LOAD_STATE_BODY_EOF && lc->inflight > 0)
+		load_response_done(lc, kore_time_us());
+
+	if (load_running && !(lc->flags & LOAD_CONN_CLOSING) &&
+	    (lc->inflight > 0 || lc->state == LOAD_STATE_CONNECTING))
+		load_res.errors++;
+
+	LIST_REMOVE(lc, list);
+	kore_buf_cleanup(&lc->in);
+
+	if (!load_running)
+		return;
+
+	/* Back off a little when the server is not answering at all. */
+	if (lc->flags & LOAD_CONN_ANSWERED)
+		load_connect();
+	else
+		kore_timer_add(load_retry, LOAD_RETRY_MS,
+		    NULL, KORE_TIMER_ONESHOT);
+}
+
+static void
+load_request_send(struct load_conn *lc)
+{
+	u_int32_t	slot;
+	u_int64_t	now;
+
+	if (!load_running || (lc->flags & LOAD_CONN_CLOSE))
+		return;
+
+	now = kore_time_us();
+
+	while (lc->inflight < load_depth) {
+		slot = (lc->head + lc->inflight) % LOAD_PIPELINE_MAX;
+		lc->sent[slot] = now;
+		lc->inflight++;
+
+		net_send_queue(lc->c, load_request.data, load_request.offset);
+		load_res.bytes_out += load_request.offset;
+
+		if (load_scenario == LOAD_SCENARIO_UPLOAD) {
+			net_send_stream(lc->c, load_body, load_size,
+			    NULL, NULL);
+			load_res.bytes_out += load_size;
+		}
+
+		/* A new connection per request only does one at a time. */
+		if (load_scenario == LOAD_SCENARIO_HANDSHAKE) {
+			lc->sent[slot] = lc->started;
+			lc->flags |= LOAD_CONN_CLOSE;
+			break;
+		}
+
+		if (load_scenario == LOAD_SCENARIO_WEBSOCKET)
+			break;
+	}
+
+	net_send_flush(lc->c);
+}
+
+/*
+ * Slow clients dribble their request out one byte per interval and
+ * start over once a response arrived.
+ */
+static void
+load_slow_tick(void *arg, u_int64_t now)
+{
+	struct connection	*c = arg;
+	struct load_conn	*lc = c->hdlr_extra;
+
+	if (lc->slow_off == load_request.offset) {
+		kore_timer_remove(lc->timer);
+		lc->timer = NULL;
+		return;
+	}
+
+	net_send_queue(c, load_request.data + lc->slow_off, 1);
+	load_res.bytes_out++;
+	lc->slow_off++;
+
+	kore_connection_start_idletimer(c);
+
+	if (!net_send_flush(c))
+		kore_connection_disconnect(c);
+}
+
+static int
+load_recv(struct netbuf *nb)
+{
+	ssize_t			used;
+	size_t			len;
+	u_int8_t		*data;
+	struct connection	*c = nb->owner;
+	struct load_conn	*lc = c->hdlr_extra;
+
+	load_res.bytes_in += nb->s_off;
+
+	/* Only copy when a previous read left a partial response. */
+	if (lc->in.offset > 0) {
+		kore_buf_append(&lc->in, nb->buf, nb->s_off);
+		data = lc->in.data;
+		len = lc->in.offset;
+	} else {
+		data = nb->buf;
+		len = nb->s_off;
+	}
+
+	if ((used = load_parse(lc, data, len)) == -1)
+		return (KORE_RESULT_ERROR);
+
+	if (data == lc->in.data) {
+		memmove(lc->in.data, lc->in.data + used, len - used);
+		lc->in.offset = len - used;
+	} else if ((size_t)used < len) {
+		kore_buf_append(&lc->in, data + used, len - used);
+	}
+
+	if (lc->in.offset > LOAD_HEADER_MAX &&
+	    lc->state != LOAD_STATE_WEBSOCKET) {
+		kore_log(LOG_NOTICE, "response headers too large");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (lc->flags & LOAD_CONN_CLOSING)
+		return (KORE_RESULT_ERROR);
+
+	net_recv_reset(c, LOAD_RECV_LEN, load_recv);
+
+	return (KORE_RESULT_OK);
+}
+
+/* Returns how much of data was consumed or -1 on a malformed response. */
+static ssize_t
+load_parse(struct load_conn *lc, u_int8_t *data, size_t len)
+{
+	int		r;
+	size_t		off, take;
+	u_int8_t	*end, *line;
+	char		*ep;
+	ssize_t		used;
+	unsigned long	chunk;
+
+	off = 0;
+
+	while (off < len && !(lc->flags & LOAD_CONN_CLOSING)) {
+		switch (lc->state) {
+		case LOAD_STATE_HEADERS:
+			end = kore_mem_find(data + off, len - off,
+			    "\r\n\r\n", 4);
+			if (end == NULL)
+				return (off);
+
+			end += 4;
+			r = load_parse_headers(lc, data + off,
+			    end - (data + off));
+			off = end - data;
+
+			if (r == -1)
+				return (-1);
+			break;
+		case LOAD_STATE_BODY:
+			take = MIN(lc->remain, len - off);
+			lc->remain -= take;
+			off += take;
+			if (lc->remain == 0)
+				load_response_done(lc, kore_time_us());
+			break;
+		case LOAD_STATE_BODY_EOF:
+			off = len;
+			break;
+		case LOAD_STATE_CHUNK_SIZE:
+		case LOAD_STATE_CHUNK_TRAILER:
+			line = data + off;
+			end = kore_mem_find(line, len - off, "\r\n", 2);
+			if (end == NULL)
+				return (off);
+
+			off = (end + 2) - data;
+
+			if (lc->state == LOAD_STATE_CHUNK_TRAILER) {
+				if (end == line)
+					load_response_done(lc, kore_time_us());
+				break;
+			}
+
+			*end = '\0';
+			errno = 0;
+			chunk = strtoul((const char *)line, &ep, 16);
+			if (errno != 0 || ep == (char *)line)
+				return (-1);
+
+			if (chunk == 0) {
+				lc->state = LOAD_STATE_CHUNK_TRAILER;
+			} else {
+				lc->remain = chunk + 2;
+				lc->state = LOAD_STATE_CHUNK_DATA;
+			}
+			break;
+		case LOAD_STATE_CHUNK_DATA:
+			take = MIN(lc->remain, len - off);
+			lc->remain -= take;
+			off += take;
+			if (lc->remain == 0)
+				lc->state = LOAD_STATE_CHUNK_SIZE;
+			break;
+		case LOAD_STATE_WEBSOCKET:
+			used = load_ws_parse(lc, data + off, len - off);
+			if (used == -1)
+				return (-1);
+			if (used == 0)
+				return (off);
+			off += used;
+			break;
+		default:
+			return (-1);
+		}
+	}
+
+	return (off);
+}
+
+static int
+load_parse_headers(struct load_conn *lc, u_int8_t *data, size_t len)
+{
+	int		err;
+	size_t		hlen;
+	char		code[4], *hdr, *next, *value;
+	int		chunked, closes, length;
+
+	data[len - 2] = '\0';
+	hdr = (char *)data;
+
+	if (strncmp(hdr, "HTTP/1.", 7) || len < 12)
+		return (-1);
+
+	memcpy(code, hdr + 9, 3);
+	code[3] = '\0';
+
+	lc->status = kore_strtonum(code, 10, 100, 599, &err);
+	if (err != KORE_RESULT_OK)
+		return (-1);
+
+	/* HTTP/1.0 servers close unless told otherwise. */
+	closes = (data[7] == '0');
+	length = 0;
+	chunked = 0;
+	lc->remain = 0;
+
+	for (hdr = strstr(hdr, "\r\n"); hdr != NULL; hdr = next) {
+		hdr += 2;
+		if ((next = strstr(hdr, "\r\n")) != NULL)
+			*next = '\0';
+
+		if ((value = strchr(hdr, ':')) == NULL)
+			continue;
+
+		hlen = value - hdr;
+		value++;
+		while (isspace(*(unsigned char *)value))
+			value++;
+
+		if (hlen == 14 && !strncasecmp(hdr, "content-length", hlen)) {
+			lc->remain = kore_strtonum64(value, 0, &err);
+			if (err != KORE_RESULT_OK)
+				return (-1);
+			length = 1;
+		} else if (hlen == 17 &&
+		    !strncasecmp(hdr, "transfer-encoding", hlen)) {
+			if (strcasestr(value, "chunked") != NULL)
+				chunked = 1;
+		} else if (hlen == 10 &&
+		    !strncasecmp(hdr, "connection", hlen)) {
+			if (strcasestr(value, "close") != NULL)
+				closes = 1;
+			else if (strcasestr(value, "keep-alive") != NULL)
+				closes = 0;
+		}
+	}
+
+	if (lc->status == 101 && load_scenario == LOAD_SCENARIO_WEBSOCKET) {
+		lc->state = LOAD_STATE_WEBSOCKET;
+		lc->flags |= LOAD_CONN_ANSWERED;
+		lc->inflight = 0;
+		return (0);
+	}
+
+	/* Interim responses are followed by the real one. */
+	if (lc->status < 200)
+		return (0);
+
+	if (closes)
+		lc->flags |= LOAD_CONN_CLOSE;
+
+	if (chunked) {
+		lc->state = LOAD_STATE_CHUNK_SIZE;
+	} else if (length) {
+		lc->state = LOAD_STATE_BODY;
+		if (lc->remain == 0)
+			load_response_done(lc, kore_time_us());
+	} else if (lc->status == 204 || lc->status == 304) {
+		load_response_done(lc, kore_time_us());
+	} else {
+		/* Without a length the body runs until the server closes. */
+		lc->flags |= LOAD_CONN_CLOSE;
+		lc->state = LOAD_STATE_BODY_EOF;
+	}
+
+	return (0);
+}
+
+static void
+load_response_done(struct load_conn *lc, u_int64_t now)
+{
+	int		idx;
+
+	lc->flags |= LOAD_CONN_ANSWERED;
+
+	if (lc->inflight == 0)
+		return;
+
+	if (load_running) {
+		load_latency(now - lc->sent[lc->head]);
+		load_res.requests++;
+
+		idx = lc->status / 100;
+		if (idx < 1 || idx > 5)
+			idx = 0;
+		load_res.status[idx]++;
+	}
+
+	lc->head = (lc->head + 1) % LOAD_PIPELINE_MAX;
+	lc->inflight--;
+
+	if (lc->state == LOAD_STATE_WEBSOCKET)
+		return;
+
+	lc->state = LOAD_STATE_HEADERS;
+
+	if (lc->flags & LOAD_CONN_CLOSE) {
+		lc->flags |= LOAD_CONN_CLOSING;
+		return;
+	}
+
+	if (load_scenario == LOAD_SCENARIO_SLOW) {
+		lc->slow_off = 0;
+		lc->sent[lc->head] = now;
+		lc->inflight = 1;
+		if (lc->timer == NULL && load_running) {
+			lc->timer = kore_timer_add(load_slow_tick,
+			    load_interval, lc->c, 0);
+		}
+		return;
+	}
+
+	load_request_send(lc);
+}
+
+static void
+load_latency(u_int64_t usec)
+{
+	kore_histogram_add(&load_res.latency, usec);
+
+	load_res.min = MIN(load_res.min, usec);
+	load_res.max = MAX(load_res.max, usec);
+}
+
+/*
+ * Frames from the server are never masked. Message payloads start with
+ * the time they were published at so every receiver can tell how long
+ * the fan out took.
+ */
+static ssize_t
+load_ws_parse(struct load_conn *lc, u_int8_t *data, size_t len)
+{
+	u_int8_t	op;
+	size_t		hdr;
+	u_int64_t	plen, ts, now;
+
+	if (len < 2)
+		return (0);
+
+	op = data[0] & 0x0f;
+	plen = data[1] & 0x7f;
+	hdr = 2;
+
+	if (plen == 126) {
+		if (len < 4)
+			return (0);
+		plen = net_read16(&data[2]);
+		hdr = 4;
+	} else if (plen == 127) {
+		if (len < 10)
+			return (0);
+		plen = net_read64(&data[2]);
+		hdr = 10;
+	}
+
+	if (data[1] & 0x80)
+		hdr += LOAD_WS_MASK_LEN;
+
+	if (plen > LOAD_HEADER_MAX)
+		return (-1);
+
+	if (len < hdr + plen)
+		return (0);
+
+	switch (op) {
+	case LOAD_WS_OP_CLOSE:
+		lc->flags |= LOAD_CONN_CLOSING;
+		break;
+	case LOAD_WS_OP_PING:
+		load_ws_send(lc, LOAD_WS_OP_PONG, data + hdr, plen);
+		net_send_flush(lc->c);
+		break;
+	default:
+		if (plen < sizeof(ts) || !load_running)
+			break;
+
+		memcpy(&ts, data + hdr, sizeof(ts));
+		now = kore_time_us();
+		if (ts <= now) {
+			load_latency(now - ts);
+			load_res.requests++;
+		}
+		break;
+	}
+
+	return (hdr + plen);
+}
+
+static void
+load_ws_send(struct load_conn *lc, u_int8_t op, const void *data, size_t len)
+{
+	size_t		i;
+	struct kore_buf	frame;
+	u_int8_t	hdr[14], *p;
+
+	kore_buf_init(&frame, len + sizeof(hdr));
+
+	hdr[0] = 0x80 | op;
+	if (len <= 125) {
+		hdr[1] = 0x80 | len;
+		kore_buf_append(&frame, hdr, 2);
+	} else if (len <= USHRT_MAX) {
+		hdr[1] = 0x80 | 126;
+		net_write16(&hdr[2], len);
+		kore_buf_append(&frame, hdr, 4);
+	} else {
+		hdr[1] = 0x80 | 127;
+		net_write64(&hdr[2], len);
+		kore_buf_append(&frame, hdr, 10);
+	}
+
+	/* Clients must mask, the key does not need to be unpredictable. */
+	hdr[0] = 0x4b;
+	hdr[1] = 0x6f;
+	hdr[2] = 0x72;
+	hdr[3] = 0x65;
+	kore_buf_append(&frame, hdr, LOAD_WS_MASK_LEN);
+
+	p = frame.data + frame.offset;
+	kore_buf_append(&frame, data, len);
+	for (i = 0; i < len; i++)
+		p[i] ^= hdr[i % LOAD_WS_MASK_LEN];
+
+	net_send_queue(lc->c, frame.data, frame.offset);
+	load_res.bytes_out += frame.offset;
+
+	kore_buf_cleanup(&frame);
+}
+
+/* Every worker has a single publisher, all others only listen. */
+static void
+load_ws_publish(void *arg, u_int64_t now)
+{
+	u_int64_t		ts;
+	struct load_conn	*lc;
+	static u_int8_t		*msg = NULL;
+
+	if (!load_running)
+		return;
+
+	if (msg == NULL)
+		msg = kore_calloc(1, load_size);
+
+	LIST_FOREACH(lc, &load_list, list) {
+		if (lc->state == LOAD_STATE_WEBSOCKET)
+			break;
+	}
+
+	if (lc == NULL)
+		return;
+
+	ts = kore_time_us();
+	memcpy(msg, &ts, sizeof(ts));
+
+	load_ws_send(lc, LOAD_WS_OP_BINARY, msg, load_size);
+	if (!net_send_flush(lc->c))
+		kore_connection_disconnect(lc->c);
+}
+
+static void
+load_msg_result(struct kore_msg *msg, const void *data)
+{
+	int				i;
+	const struct load_result	*res = data;
+
+	if (msg->length != sizeof(*res)) {
+		kore_log(LOG_NOTICE, "bad result from worker %u", msg->src);
+		return;
+	}
+
+	load_total.elapsed = MAX(load_total.elapsed, res->elapsed);
+	load_total.requests += res->requests;
+	load_total.errors += res->errors;
+	load_total.connects += res->connects;
+	load_total.bytes_in += res->bytes_in;
+	load_total.bytes_out += res->bytes_out;
+
+	if (load_reported == 0 || res->min < load_total.min)
+		load_total.min = res->min;
+	load_total.max = MAX(load_total.max, res->max);
+
+	for (i = 0; i < 6; i++)
+		load_total.status[i] += res->status[i];
+
+	load_total.latency.count += res->latency.count;
+	load_total.latency.sum += res->latency.sum;
+
+	for (i = 0; i < KORE_HISTO_BUCKETS; i++)
+		load_total.latency.buckets[i] += res->latency.buckets[i];
+
+	if (++load_reported == load_workers)
+		kore_quit = 1;
+}
+
+/* Percentiles are the upper bound of the histogram bucket they fall in. */
+static u_int64_t
+load_percentile(double q)
+{
+	int		i;
+	u_int64_t	rank, seen;
+
+	if (load_total.latency.count == 0)
+		return (0);
+
+	rank = (u_int64_t)(q * load_total.latency.count);
+	if (rank == 0)
+		rank = 1;
+
+	seen = 0;
+	for (i = 0; i < KORE_HISTO_BUCKETS; i++) {
+		seen += load_total.latency.buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i == KORE_HISTO_BUCKETS)
+		i--;
+
+	return (MIN(kore_histogram_bound(i), load_total.max));
+}
+
+static void
+load_report_text(FILE *fp, u_int64_t elapsed)
+{
+	double		secs;
+	u_int64_t	avg;
+
+	secs = (double)elapsed / 1000000.0;
+	if (secs == 0)
+		secs = 1;
+
+	avg = 0;
+	if (load_total.latency.count > 0)
+		avg = load_total.latency.sum / load_total.latency.count;
+
+	fprintf(fp, "scenario     %s\n", load_name);
+	fprintf(fp, "target       %s\n", load_url);
+	fprintf(fp, "run          %.2fs, %d workers, %u connections\n",
+	    secs, load_workers, load_conns);
+	fprintf(fp, "%-12s %" PRIu64 " (%.1f/s)\n",
+	    load_scenario == LOAD_SCENARIO_WEBSOCKET ? "messages" : "requests",
+	    load_total.requests, load_total.requests / secs);
+	fprintf(fp, "connects     %" PRIu64 " (%.1f/s)\n",
+	    load_total.connects, load_total.connects / secs);
+	fprintf(fp, "errors       %" PRIu64 "\n", load_total.errors);
+	fprintf(fp, "status       1xx=%" PRIu64 " 2xx=%" PRIu64 " 3xx=%"
+	    PRIu64 " 4xx=%" PRIu64 " 5xx=%" PRIu64 " other=%" PRIu64 "\n",
+	    load_total.status[1], load_total.status[2], load_total.status[3],
+	    load_total.status[4], load_total.status[5], load_total.status[0]);
+	fprintf(fp, "transfer     in %.2f MB/s, out %.2f MB/s\n",
+	    load_total.bytes_in / secs / (1024 * 1024),
+	    load_total.bytes_out / secs / (1024 * 1024));
+
+	if (load_total.latency.count == 0)
+		return;
+
+	fprintf(fp, "latency      min %" PRIu64 "us avg %" PRIu64
+	    "us max %" PRIu64 "us\n", load_total.min, avg, load_total.max);
+	fprintf(fp, "percentiles  p50 %" PRIu64 "us p90 %" PRIu64
+	    "us p99 %" PRIu64 "us p99.9 %" PRIu64 "us\n",
+	    load_percentile(0.50), load_percentile(0.90),
+	    load_percentile(0.99), load_percentile(0.999));
+}
+
+static void
+load_report_json(const char *path, u_int64_t elapsed)
+{
+	FILE			*fp;
+	struct kore_buf		buf;
+	struct kore_json_item	*root, *obj;
+
+	root = kore_json_create_object(NULL, NULL);
+
+	kore_json_create_string(root, "scenario", load_name);
+	kore_json_create_string(root, "target", load_url);
+	kore_json_create_integer(root, "workers", load_workers);
+	kore_json_create_integer(root, "connections", load_conns);
+	kore_json_create_integer(root, "depth", load_depth);
+	kore_json_create_integer_u64(root, "elapsed_us", elapsed);
+	kore_json_create_integer_u64(root, "requests", load_total.requests);
+	kore_json_create_integer_u64(root, "connects", load_total.connects);
+	kore_json_create_integer_u64(root, "errors", load_total.errors);
+	kore_json_create_integer_u64(root, "bytes_in", load_total.bytes_in);
+	kore_json_create_integer_u64(root, "bytes_out", load_total.bytes_out);
+
+	obj = kore_json_create_object(root, "status");
+	kore_json_create_integer_u64(obj, "1xx", load_total.status[1]);
+	kore_json_create_integer_u64(obj, "2xx", load_total.status[2]);
+	kore_json_create_integer_u64(obj, "3xx", load_total.status[3]);
+	kore_json_create_integer_u64(obj, "4xx", load_total.status[4]);
+	kore_json_create_integer_u64(obj, "5xx", load_total.status[5]);
+	kore_json_create_integer_u64(obj, "other", load_total.status[0]);
+
+	obj = kore_json_create_object(root, "latency_us");
+	kore_json_create_integer_u64(obj, "count", load_total.latency.count);
+	kore_json_create_integer_u64(obj, "sum", load_total.latency.sum);
+	kore_json_create_integer_u64(obj, "min",
+	    load_total.latency.count ? load_total.min : 0);
+	kore_json_create_integer_u64(obj, "max", load_total.max);
+	kore_json_create_integer_u64(obj, "p50", load_percentile(0.50));
+	kore_json_create_integer_u64(obj, "p90", load_percentile(0.90));
+	kore_json_create_integer_u64(obj, "p99", load_percentile(0.99));
+	kore_json_create_integer_u64(obj, "p999", load_percentile(0.999));
+
+	kore_buf_init(&buf, 1024);
+	kore_json_item_tobuf(root, &buf);
+	kore_buf_append(&buf, "\n", 1);
+	kore_json_item_free(root);
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "fopen(%s): %s\n", path, errno_s);
+	} else {
+		if (fwrite(buf.data, 1, buf.offset, fp) != buf.offset)
+			fprintf(stderr, "failed to write %s\n", path);
+		fclose(fp);
+	}
+
+	kore_buf_cleanup(&buf);
+}